@@ -14,6 +14,11 @@
  *  limitations under the License.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
 #include <sys/types.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,13 +54,67 @@ jobs_init( Jobs* jobs, int cpus )
  */ 
 {
   if ( jobs ) { 
+    size_t i; 
+    memset( jobs, 0, sizeof(Jobs) ); 
     jobs->cpus = cpus; 
-    return ( (jobs->jobs = calloc( sizeof(Job), cpus )) == NULL ) ? -1 : 0;
+    jobs->cpus_free = cpus; 
+    jobs->limit = cpus; 
+
+    /* at most half of the pid buckets are ever used */
+    for ( jobs->nchildren = 16; jobs->nchildren < 2 * jobs->cpus; jobs->nchildren <<= 1 ) ;
+    jobs->jobs = calloc( sizeof(Job), cpus ); 
+    jobs->free = calloc( sizeof(size_t), cpus ); 
+    jobs->children = calloc( sizeof(size_t), jobs->nchildren ); 
+    if ( jobs->jobs == NULL || jobs->free == NULL || jobs->children == NULL ) return -1; 
+
+    for ( i=jobs->cpus; i > 0; --i ) jobs->free[jobs->nfree++] = i-1; 
+    return 0; 
   } else {
     return -1; 
   }
 }
 
+int
+jobs_resources( Jobs* jobs, unsigned long memory, int pin )
+/* purpose: set the memory available to jobs, and whether to pin them to
+ *          cores of their own
+ * paramtr: jobs (IO): pointer to initialized Jobs data structure
+ *          memory (IN): MB of memory for all jobs, 0 for no limit
+ *          pin (IN): if true, pin each job to as many cores as it claims
+ * returns: 0 on success, -1 if jobs cannot be pinned.
+ */
+{
+  jobs->memory = memory; 
+  jobs->memory_free = memory; 
+  if ( ! pin ) return 0; 
+
+#ifdef __linux__
+  {
+    cpu_set_t mask; 
+    int i, n; 
+
+    /* only use the cores we may run on ourselves */
+    if ( sched_getaffinity( 0, sizeof(mask), &mask ) == -1 ) return -1; 
+    n = CPU_COUNT( &mask ); 
+    if ( n < jobs->cpus ) return -1; 
+
+    jobs->cores = calloc( sizeof(int), n ); 
+    jobs->owner = calloc( sizeof(int), n ); 
+    if ( jobs->cores == NULL || jobs->owner == NULL ) return -1; 
+    for ( i=0; i < CPU_SETSIZE && jobs->ncores < n; ++i ) {
+      if ( CPU_ISSET( i, &mask ) ) {
+	jobs->cores[jobs->ncores] = i; 
+	jobs->owner[jobs->ncores] = -1; 
+	jobs->ncores++; 
+      }
+    }
+    return 0; 
+  }
+#else
+  return -1; 
+#endif
+}
+
 void
 jobs_done( Jobs* jobs )
 /* purpose: d'tor for Jobs structure
@@ -64,6 +123,10 @@ jobs_done( Jobs* jobs )
 {
   if ( jobs ) {
     if ( jobs->jobs ) free((void*) jobs->jobs); 
+    if ( jobs->cores ) free((void*) jobs->cores); 
+    if ( jobs->owner ) free((void*) jobs->owner); 
+    if ( jobs->free ) free((void*) jobs->free); 
+    if ( jobs->children ) free((void*) jobs->children); 
     memset( jobs, 0, sizeof(Jobs) ); 
   }
 }
@@ -98,3 +161,184 @@ jobs_first_slot( Jobs* jobs, JobState state )
 
   return result; /* == jobs->cpus */ 
 }
+
+size_t
+jobs_free_slot( Jobs* jobs )
+/* purpose: find an empty slot without scanning all slots
+ * paramtr: jobs (IN): pointer to maintanance structure
+ * returns: 0 .. cpus-1: valid job slot
+ *          cpus: all slots are in use
+ */
+{
+  return jobs->nfree ? jobs->free[jobs->nfree-1] : jobs->cpus; 
+}
+
+static
+size_t
+jobs_bucket( Jobs* jobs, pid_t child )
+/* purpose: find the first bucket to probe for a pid */
+{
+  return ((size_t) child * 2654435761u) & (jobs->nchildren - 1); 
+}
+
+void
+jobs_add_child( Jobs* jobs, size_t slot )
+/* purpose: remember the pid of a job that was just started
+ * paramtr: jobs (IO): pointer to maintanance structure
+ *          slot (IN): job slot of the job, with its child pid set
+ */
+{
+  size_t i = jobs_bucket( jobs, jobs->jobs[slot].child ); 
+  while ( jobs->children[i] ) i = (i+1) & (jobs->nchildren - 1); 
+  jobs->children[i] = slot + 1; 
+}
+
+static
+size_t
+jobs_child_bucket( Jobs* jobs, pid_t child )
+/* purpose: find the bucket of a running job
+ * returns: bucket, or nchildren if there is no such job
+ */
+{
+  size_t i; 
+  for ( i = jobs_bucket( jobs, child ); jobs->children[i]; i = (i+1) & (jobs->nchildren - 1) ) {
+    if ( jobs->jobs[jobs->children[i]-1].child == child ) return i; 
+  }
+  return jobs->nchildren; 
+}
+
+size_t
+jobs_find_child( Jobs* jobs, pid_t child )
+/* purpose: find the slot of a running job by its pid
+ * paramtr: jobs (IN): pointer to maintanance structure
+ *          child (IN): pid of the job
+ * returns: 0 .. cpus-1: valid job slot
+ *          cpus: no such job
+ */
+{
+  size_t i = child > 0 ? jobs_child_bucket( jobs, child ) : jobs->nchildren; 
+  return i < jobs->nchildren ? jobs->children[i]-1 : jobs->cpus; 
+}
+
+static
+void
+jobs_remove_child( Jobs* jobs, size_t slot )
+/* purpose: forget the pid of a job that finished */
+{
+  size_t i, j, k, mask = jobs->nchildren - 1; 
+  pid_t child = jobs->jobs[slot].child; 
+
+  if ( child <= 0 || (i = jobs_child_bucket( jobs, child )) == jobs->nchildren ) return; 
+
+  /* move later entries of the probe sequence into the hole */
+  jobs->children[i] = 0; 
+  for ( j = (i+1) & mask; jobs->children[j]; j = (j+1) & mask ) {
+    k = jobs_bucket( jobs, jobs->jobs[jobs->children[j]-1].child ); 
+    if ( ((j - k) & mask) >= ((j - i) & mask) ) {
+      jobs->children[i] = jobs->children[j]; 
+      jobs->children[j] = 0; 
+      i = j; 
+    }
+  }
+}
+
+int
+jobs_fit( Jobs* jobs, int cpus, unsigned long memory )
+/* purpose: check if a job with the given needs can start now
+ * paramtr: jobs (IN): pointer to maintanance structure
+ *          cpus (IN): number of CPUs the job needs
+ *          memory (IN): MB of memory the job needs
+ * returns: true if the resources are free
+ */
+{
+  int used = (int) jobs->cpus - jobs->cpus_free; 
+
+  if ( cpus > jobs->cpus_free ) return 0; 
+  /* a job larger than the limit only runs by itself */
+  if ( used > 0 && used + cpus > jobs->limit ) return 0; 
+  if ( jobs->memory > 0 && memory > jobs->memory_free ) return 0; 
+  return 1; 
+}
+
+void
+jobs_claim( Jobs* jobs, size_t slot, int cpus, unsigned long memory )
+/* purpose: claim the resources of a job that is about to start
+ * paramtr: jobs (IO): pointer to maintanance structure
+ *          slot (IN): job slot of the job
+ *          cpus (IN): number of CPUs the job needs
+ *          memory (IN): MB of memory the job needs
+ * warning: call only if jobs_fit() is true
+ */
+{
+  int i, n; 
+  size_t k; 
+  Job* j = jobs->jobs + slot; 
+
+  /* the slot is usually on top of the stack */
+  for ( k = jobs->nfree; k > 0; --k ) {
+    if ( jobs->free[k-1] == slot ) {
+      memmove( jobs->free + k-1, jobs->free + k, (jobs->nfree - k) * sizeof(size_t) ); 
+      jobs->nfree--; 
+      break; 
+    }
+  }
+
+  j->cpus = cpus; 
+  j->memory = memory; 
+  jobs->cpus_free -= cpus; 
+  if ( jobs->memory > 0 ) jobs->memory_free -= memory; 
+
+  for ( i=0, n=0; i < jobs->ncores && n < cpus; ++i ) {
+    if ( jobs->owner[i] == -1 ) {
+      jobs->owner[i] = slot; 
+      n++; 
+    }
+  }
+}
+
+void
+jobs_release( Jobs* jobs, size_t slot )
+/* purpose: give back the resources of a job that finished
+ * paramtr: jobs (IO): pointer to maintanance structure
+ *          slot (IN): job slot of the job
+ */
+{
+  int i; 
+  Job* j = jobs->jobs + slot; 
+
+  jobs_remove_child( jobs, slot ); 
+  jobs->free[jobs->nfree++] = slot; 
+
+  jobs->cpus_free += j->cpus; 
+  if ( jobs->memory > 0 ) jobs->memory_free += j->memory; 
+  j->cpus = 0; 
+  j->memory = 0; 
+
+  for ( i=0; i < jobs->ncores; ++i ) {
+    if ( jobs->owner[i] == (int) slot ) jobs->owner[i] = -1; 
+  }
+}
+
+int
+jobs_pin( Jobs* jobs, size_t slot )
+/* purpose: pin the calling process to the cores claimed by a job slot
+ * paramtr: jobs (IN): pointer to maintanance structure
+ *          slot (IN): job slot of the job
+ * returns: 0 on success or without pinning, -1 on error
+ */
+{
+#ifdef __linux__
+  cpu_set_t mask; 
+  int i; 
+
+  if ( jobs->ncores == 0 ) return 0; 
+
+  CPU_ZERO( &mask ); 
+  for ( i=0; i < jobs->ncores; ++i ) {
+    if ( jobs->owner[i] == (int) slot ) CPU_SET( jobs->cores[i], &mask ); 
+  }
+  return sched_setaffinity( 0, sizeof(mask), &mask ); 
+#else
+  return 0; 
+#endif
+}
@@ -33,6 +33,9 @@ typedef struct {
   time_t when;    /* start time_t */
   unsigned long count;   /* copy from job counter */ 
   unsigned long lineno;  /* copy from lineno */ 
+  size_t task;           /* index of the task in the input */
+  int    cpus;    /* number of CPUs claimed -- when in state running */
+  unsigned long memory;  /* MB of memory claimed -- when in state running */
 } Job;
 
 extern
@@ -48,6 +51,20 @@ job_done( Job* job );
 typedef struct {
   Job*   jobs; 
   size_t cpus; 
+
+  int    cpus_free;      /* CPUs not claimed by running jobs */
+  int    limit;          /* CPUs running jobs may claim together */
+  unsigned long memory;  /* MB of memory for all jobs, 0 for no limit */
+  unsigned long memory_free; 
+
+  int    ncores;  /* with pinning: number of cores to pin jobs to */
+  int*   cores;   /* core ids */
+  int*   owner;   /* slot of the job each core is pinned to, or -1 */
+
+  size_t* free;   /* stack of empty slots, first slot on top */
+  size_t nfree; 
+  size_t* children;  /* running slots by pid, open addressing, slot+1 or 0 */
+  size_t nchildren;  /* number of buckets, a power of two */
 } Jobs; 
 
 extern
@@ -59,6 +76,17 @@ jobs_init( Jobs* jobs, int cpus );
  * returns: 0 on success, -1 on error.
  */ 
 
+extern
+int
+jobs_resources( Jobs* jobs, unsigned long memory, int pin );
+/* purpose: set the memory available to jobs, and whether to pin them to
+ *          cores of their own
+ * paramtr: jobs (IO): pointer to initialized Jobs data structure
+ *          memory (IN): MB of memory for all jobs, 0 for no limit
+ *          pin (IN): if true, pin each job to as many cores as it claims
+ * returns: 0 on success, -1 if jobs cannot be pinned.
+ */
+
 extern
 void
 jobs_done( Jobs* jobs ); 
@@ -85,4 +113,69 @@ jobs_first_slot( Jobs* jobs, JobState state );
  *          cpus: no such slot found
  */ 
 
+extern
+size_t
+jobs_free_slot( Jobs* jobs );
+/* purpose: find an empty slot without scanning all slots
+ * paramtr: jobs (IN): pointer to maintanance structure
+ * returns: 0 .. cpus-1: valid job slot
+ *          cpus: all slots are in use
+ */
+
+extern
+void
+jobs_add_child( Jobs* jobs, size_t slot );
+/* purpose: remember the pid of a job that was just started
+ * paramtr: jobs (IO): pointer to maintanance structure
+ *          slot (IN): job slot of the job, with its child pid set
+ */
+
+extern
+size_t
+jobs_find_child( Jobs* jobs, pid_t child );
+/* purpose: find the slot of a running job by its pid
+ * paramtr: jobs (IN): pointer to maintanance structure
+ *          child (IN): pid of the job
+ * returns: 0 .. cpus-1: valid job slot
+ *          cpus: no such job
+ */
+
+extern
+int
+jobs_fit( Jobs* jobs, int cpus, unsigned long memory );
+/* purpose: check if a job with the given needs can start now
+ * paramtr: jobs (IN): pointer to maintanance structure
+ *          cpus (IN): number of CPUs the job needs
+ *          memory (IN): MB of memory the job needs
+ * returns: true if the resources are free
+ */
+
+extern
+void
+jobs_claim( Jobs* jobs, size_t slot, int cpus, unsigned long memory );
+/* purpose: claim the slot and resources of a job that is about to start
+ * paramtr: jobs (IO): pointer to maintanance structure
+ *          slot (IN): empty job slot of the job
+ *          cpus (IN): number of CPUs the job needs
+ *          memory (IN): MB of memory the job needs
+ * warning: call only if jobs_fit() is true
+ */
+
+extern
+void
+jobs_release( Jobs* jobs, size_t slot );
+/* purpose: give back the slot and resources of a job that finished
+ * paramtr: jobs (IO): pointer to maintanance structure
+ *          slot (IN): job slot of the job
+ */
+
+extern
+int
+jobs_pin( Jobs* jobs, size_t slot );
+/* purpose: pin the calling process to the cores claimed by a job slot
+ * paramtr: jobs (IN): pointer to maintanance structure
+ *          slot (IN): job slot of the job
+ * returns: 0 on success or without pinning, -1 on error
+ */
+
 #endif /* _JOB_H */
@@ -0,0 +1,71 @@
+/*
+ * This file or a portion of this file is licensed under the terms of
+ * the Globus Toolkit Public License, found in file GTPL, or at
+ * http://www.globus.org/toolkit/download/license.html. This notice must
+ * appear in redistributions of this file, with or without modification.
+ *
+ * Redistributions of this Software, with or without modification, must
+ * reproduce the GTPL in: (1) the Software, or (2) the Documentation or
+ * some other similar material which is provided with the Software (if
+ * any).
+ *
+ * Copyright 1999-2016 University of Chicago and The University of
+ * Southern California. All rights reserved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "load.h"
+
+/* purpose: read the 10-second average of a pressure stall file
+ * paramtr: fn (IN): file in /proc/pressure
+ * returns: % of time some tasks stalled, or -1 if unavailable
+ */
+static double read_pressure(const char* fn) {
+    double avg10 = -1.0;
+    FILE* f = fopen(fn, "r");
+    if (f != NULL) {
+        if (fscanf(f, "some avg10=%lf", &avg10) != 1) {
+            avg10 = -1.0;
+        }
+        fclose(f);
+    }
+    return avg10;
+}
+
+int load_sample(Load* load) {
+    unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+    FILE* f;
+
+    if ((f = fopen("/proc/loadavg", "r")) == NULL) {
+        return -1;
+    }
+    int n = fscanf(f, "%lf", &load->load);
+    fclose(f);
+    if (n != 1) {
+        return -1;
+    }
+
+    load->memory = read_pressure("/proc/pressure/memory");
+    load->io = read_pressure("/proc/pressure/io");
+
+    /* iowait since the last sample */
+    load->iowait = 0.0;
+    if ((f = fopen("/proc/stat", "r")) != NULL) {
+        if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                   &user, &nice, &system, &idle, &iowait,
+                   &irq, &softirq, &steal) == 8) {
+            unsigned long long total = user + nice + system + idle + iowait +
+                                       irq + softirq + steal;
+            if (load->total > 0 && total > load->total) {
+                load->iowait = (double) (iowait - load->waited) / (total - load->total);
+            }
+            load->total = total;
+            load->waited = iowait;
+        }
+        fclose(f);
+    }
+
+    return 0;
+}
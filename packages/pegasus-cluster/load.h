@@ -0,0 +1,35 @@
+/*
+ * This file or a portion of this file is licensed under the terms of
+ * the Globus Toolkit Public License, found in file GTPL, or at
+ * http://www.globus.org/toolkit/download/license.html. This notice must
+ * appear in redistributions of this file, with or without modification.
+ *
+ * Redistributions of this Software, with or without modification, must
+ * reproduce the GTPL in: (1) the Software, or (2) the Documentation or
+ * some other similar material which is provided with the Software (if
+ * any).
+ *
+ * Copyright 1999-2016 University of Chicago and The University of
+ * Southern California. All rights reserved.
+ */
+#ifndef _LOAD_H
+#define _LOAD_H
+
+/* How busy the node is, from /proc */
+typedef struct {
+    double load;        /* 1-minute load average */
+    double memory;      /* % of time some tasks stalled on memory, or -1 */
+    double io;          /* % of time some tasks stalled on I/O, or -1 */
+    double iowait;      /* fraction of CPU time in iowait since last sample */
+
+    unsigned long long total;   /* CPU ticks at the last sample */
+    unsigned long long waited;  /* iowait ticks at the last sample */
+} Load;
+
+/* purpose: measure the load of the node
+ * paramtr: load (IO): last sample, initialized to 0 before the first one
+ * returns: 0 on success, -1 if the load average is not available
+ */
+extern int load_sample(Load* load);
+
+#endif /* _LOAD_H */
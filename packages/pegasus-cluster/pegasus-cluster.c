@@ -13,6 +13,7 @@
  * Southern California. All rights reserved.
  */
 #include <sys/types.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,12 +32,91 @@
 #include "mysystem.h"
 #include "job.h"
 #include "statinfo.h"
+#include "load.h"
 
 int debug = 0;
 int progress = -1;
 char* application = "pegasus-cluster";
 static char success[257];
 
+/* Adaptive concurrency: change the CPUs that applications may use
+ * together, one at a time, between adapt_min and adapt_max */
+#define ADAPT_INTERVAL 5.0  /* seconds between changes */
+#define PRESSURE_HIGH 10.0  /* % of time stalled on memory or I/O */
+#define PRESSURE_LOW 1.0
+#define IOWAIT_HIGH 0.25    /* fraction of CPU time in iowait */
+#define IOWAIT_LOW 0.05
+static int adapt_min = 0;
+static int adapt_max = 0;   /* 0 without -a */
+static double adapted = 0.0;
+static Load load;
+
+typedef enum {
+    TASK_WAITING,   /* read, but not started yet */
+    TASK_RUNNING,
+    TASK_SUCCEEDED,
+    TASK_FAILED,    /* failed, or skipped after a failed predecessor */
+} TaskState;
+
+#define NO_TASK ((size_t) -1)
+#define FAILED_TASK ((size_t) -2)   /* a predecessor that already failed */
+
+/* The last application with a name from a '#@ -i' line, or how it
+ * ended once it finished, for the '#@ -a' lines after it */
+typedef struct Name {
+    char* name;
+    size_t task;            /* NO_TASK once the task finished */
+    TaskState state;
+    struct Name* next;      /* next name in the same bucket */
+} Name;
+
+/* An application from the input that has not finished yet */
+typedef struct {
+    Name* name;             /* its name, or NULL */
+    char* cmd;              /* command line, until the task is started */
+    unsigned long hash;     /* hash of the command line */
+    unsigned long lineno;
+    int cpus;
+    unsigned long memory;
+    size_t* waiters;        /* tasks that wait for this one to finish */
+    size_t nwaiters;
+    size_t pending;         /* predecessors that have not finished */
+    int doomed;             /* some predecessor failed */
+    int queued;             /* in the ready queue */
+    size_t next_free;       /* next free slot once the task finished */
+    TaskState state;
+} Task;
+
+/* The slots of the tasks. Finished tasks give their slot back. */
+static Task* tasks = NULL;
+static size_t ntasks = 0;
+static size_t tasks_size = 0;
+static size_t free_task = NO_TASK;
+static size_t nwaiting = 0;       /* tasks that have not started */
+
+/* Waiting tasks whose predecessors have all finished, in the order that
+ * they became ready, from ready_head to ready_tail */
+static size_t* ready = NULL;
+static size_t ready_head = 0;
+static size_t ready_tail = 0;
+static size_t ready_size = 0;
+
+/* Names of the tasks, hashed */
+static Name** names = NULL;
+static size_t nnames = 0;
+static size_t names_size = 0;
+
+/* An application that succeeded in an earlier run */
+typedef struct {
+    unsigned long lineno;
+    unsigned long hash;
+    char* record;           /* its cluster-task record */
+} Resumed;
+
+/* Sorted by line number, from the status file given with -r */
+static Resumed* resumed = NULL;
+static size_t nresumed = 0;
+
 /* purpose: write help message and exit
  * paramtr: programname (IN): application of the program (us)
  *           rc (IN): exit code to exit with
@@ -47,14 +127,27 @@ static void helpMe(const char* programname, int rc) {
            " -d\tIncrease debug mode.\n"
            " -s fn\tProtocol anything to given status file, default stdout.\n"
            " -R fn\tRecords progress into the given file, see also SEQEXEC_PROGRESS_REPORT.\n"
+           " -r fn\tResume, skip applications that succeeded in status file fn of an earlier run.\n"
+           " -L\tAppend progress records without locking the progress file.\n"
            " -S ec\tMulti-option: Mark non-zero exit-code ec as success.\n"
            " -n nr\tNumber of CPUs to use, defaults to 1, string 'auto' permitted.\n"
+           " -a [min:]max\tAdapt the number of CPUs to use to the load, instead of -n.\n"
+           " -m mb\tMB of memory for all applications, defaults to the physical memory.\n"
+           " -p\tPin each application to as many cores of its own as it needs CPUs.\n"
            " input\tFile with list of applications and args to execute, default stdin.\n\n"
            "Execution control and exit code:\n"
            "\tExecute everything but return success only if all were successful.\n"
            " -e\tExecute everything (old default mode) and always return success.\n"
            " -f\tFail hard on first error (non-zero exit code or signal death).\n"
-           "\tOption -e and -f are mutually exclusive.\n" );
+           "\tOption -e and -f are mutually exclusive.\n\n"
+           "Resources:\n"
+           "\tA line '#@ -c cpus -m mb' before an application gives the number of CPUs\n"
+           "\tand MB of memory it needs, by default 1 CPU and no memory. An application\n"
+           "\tonly starts when its CPUs, out of -n, and memory, out of -m, are free.\n\n"
+           "Dependencies:\n"
+           "\tIn the same line, '-i id' names the application, and '-a id[,id..]'\n"
+           "\tstarts it only after the named applications above it have succeeded.\n"
+           "\tOther applications keep going into free slots in the meantime.\n" );
     exit(rc);
 }
 
@@ -77,7 +170,119 @@ static int processors() {
     return config < online ? config : online;
 }
 
-static void parseCommandline(int argc, char *argv[], int *fail_hard, int *old_mode, int *cpus) {
+static unsigned long physical_memory() {
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && pagesize > 0) {
+        return (unsigned long) ((double) pages * pagesize / (1024 * 1024));
+    }
+#endif
+    /* unknown, do not limit memory */
+    return 0;
+}
+
+int isafailure(int status) {
+    /* FIXME: On systems with exit codes outside 0..256 this may core dump! */
+    return (WIFEXITED(status) && success[WEXITSTATUS(status)] == 1 ) ? 0 : 1;
+}
+
+/* purpose: hash a command line to recognize it in a later run
+ * paramtr: cmd (IN): command line
+ * returns: 32-bit FNV-1a hash of the command line
+ */
+static unsigned long hash_command(const char* cmd) {
+    unsigned long hash = 2166136261ul;
+    for (; *cmd; cmd++) {
+        hash = ((hash ^ (unsigned char) *cmd) * 16777619ul) & 0xfffffffful;
+    }
+    return hash;
+}
+
+static int compare_resumed(const void* a, const void* b) {
+    unsigned long la = ((const Resumed*) a)->lineno;
+    unsigned long lb = ((const Resumed*) b)->lineno;
+    return la < lb ? -1 : la > lb;
+}
+
+/* purpose: remember the applications that succeeded in an earlier run
+ * paramtr: fn (IN): status file of the earlier run
+ * returns: 0 on success, -1 on error
+ * warning: records without a hash, from older versions, are ignored
+ */
+static int readResume(const char* fn) {
+    char line[MAXSTR];
+    size_t size = 0;
+    FILE* in = fopen(fn, "r");
+    if (in == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char* s;
+        char* l;
+        char* h;
+        if (strncmp(line, "[cluster-task id=", 17) != 0 ||
+            (s = strstr(line, ", status=")) == NULL ||
+            (l = strstr(line, ", line=")) == NULL ||
+            (h = strstr(line, ", hash=")) == NULL) {
+            continue;
+        }
+        if (isafailure(atoi(s + 9))) {
+            continue;
+        }
+
+        if (nresumed == size) {
+            size = size ? size << 1 : 64;
+            Resumed* temp = (Resumed*) realloc(resumed, size * sizeof(Resumed));
+            if (temp == NULL) {
+                fclose(in);
+                return -1;
+            }
+            resumed = temp;
+        }
+        Resumed* r = resumed + nresumed;
+        r->lineno = strtoul(l + 7, NULL, 10);
+        r->hash = strtoul(h + 7, NULL, 16);
+        if ((r->record = strdup(line)) == NULL) {
+            fclose(in);
+            return -1;
+        }
+        nresumed++;
+    }
+
+    fclose(in);
+    qsort(resumed, nresumed, sizeof(Resumed), compare_resumed);
+    return 0;
+}
+
+/* purpose: find an application that succeeded in an earlier run
+ * paramtr: lineno (IN): line number of the application
+ *          hash (IN): hash of its command line
+ * returns: the earlier record, or NULL to run the application
+ */
+static Resumed* find_resumed(unsigned long lineno, unsigned long hash) {
+    Resumed key;
+    key.lineno = lineno;
+    Resumed* r = (Resumed*) bsearch(&key, resumed, nresumed, sizeof(Resumed), compare_resumed);
+    if (r == NULL) {
+        return NULL;
+    }
+
+    /* the same line may have run more than once */
+    while (r > resumed && r[-1].lineno == lineno) {
+        r--;
+    }
+    for (; r < resumed + nresumed && r->lineno == lineno; r++) {
+        if (r->hash == hash) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static void parseCommandline(int argc, char *argv[], int *fail_hard, int *old_mode, int *cpus,
+                             unsigned long *memory, int *pin) {
 
     /* exit code 0 is always good, just in case */
     memset(success, 0, sizeof(success));
@@ -98,10 +303,20 @@ static void parseCommandline(int argc, char *argv[], int *fail_hard, int *old_mo
     /* Set default parallelism */
     char *cpus_string = getenv("SEQEXEC_CPUS");
 
+    /* status files are opened after all success codes are known */
+    char *resume_file = NULL;
+    char *status_file = NULL;
+
     int option, tmp;
     opterr = 0;
-    while ((option = getopt(argc, argv, "R:S:defhn:s:")) != -1) {
+    *memory = physical_memory();
+    *pin = 0;
+
+    while ((option = getopt(argc, argv, "LR:S:a:defhm:n:pr:s:")) != -1) {
         switch (option) {
+        case 'L':
+            report_nolock = 1;
+            break;
         case 'R':
             progress_file = optarg;
             break;
@@ -114,6 +329,19 @@ static void parseCommandline(int argc, char *argv[], int *fail_hard, int *old_mo
                         application, tmp);
             }
             break;
+        case 'a':
+            if (sscanf(optarg, "%d:%d", &adapt_min, &adapt_max) != 2) {
+                adapt_min = 1;
+                adapt_max = atoi(optarg);
+            }
+            if (adapt_max < 1) {
+                showerr("%s: Ignoring unreasonable adaptive bounds: %s\n",
+                        application, optarg);
+                adapt_max = 0;
+            }
+            if (adapt_min < 1) adapt_min = 1;
+            if (adapt_min > adapt_max) adapt_min = adapt_max;
+            break;
         case 'd':
             debug++;
             break;
@@ -125,15 +353,20 @@ static void parseCommandline(int argc, char *argv[], int *fail_hard, int *old_mo
             *fail_hard = 1;
             *old_mode = 0;
             break;
+        case 'm':
+            *memory = strtoul(optarg, NULL, 10);
+            break;
         case 'n':
             cpus_string = optarg;
             break;
+        case 'p':
+            *pin = 1;
+            break;
+        case 'r':
+            resume_file = optarg;
+            break;
         case 's':
-            if (freopen(optarg, "w", stdout) == NULL) {
-                showerr("%s: open status %s: %d: %s\n",
-                        application, optarg, errno, strerror(errno));
-                exit(2);
-            }
+            status_file = optarg;
             break;
         case 'h':
         case '?':
@@ -150,6 +383,19 @@ static void parseCommandline(int argc, char *argv[], int *fail_hard, int *old_mo
         helpMe(ptr, 1);
     }
 
+    /* Read the earlier run before its status file may be overwritten */
+    if (resume_file != NULL && readResume(resume_file) == -1) {
+        showerr("%s: open resume %s: %d: %s\n",
+                application, resume_file, errno, strerror(errno));
+        exit(2);
+    }
+
+    if (status_file != NULL && freopen(status_file, "w", stdout) == NULL) {
+        showerr("%s: open status %s: %d: %s\n",
+                application, status_file, errno, strerror(errno));
+        exit(2);
+    }
+
     /* Open the progress file, if specified */
     if (progress_file != NULL) {
         progress = open(progress_file, O_WRONLY | O_APPEND | O_CREAT, 0666);
@@ -174,6 +420,11 @@ static void parseCommandline(int argc, char *argv[], int *fail_hard, int *old_mo
         }
     }
 
+    /* adaptive mode has as many slots as it may ever use */
+    if (adapt_max > 0) {
+        *cpus = adapt_max;
+    }
+
     /* If there is one argument left, then point stdin to it */
     if ((argc - optind) == 1) {
         if ((freopen(argv[optind], "r", stdin)) == NULL) {
@@ -205,7 +456,311 @@ static char *merge( char* s1, char* s2, int use_space ) {
     }
 }
 
-pid_t wait_for_child( Jobs* jobs, int* status ) {
+/* purpose: find a name of a task
+ * paramtr: name (IN): name of the task
+ * returns: the name, or NULL if no task had it
+ */
+static Name* find_name(const char* name) {
+    if (names_size == 0) {
+        return NULL;
+    }
+    Name* n;
+    for (n = names[hash_command(name) & (names_size - 1)]; n != NULL; n = n->next) {
+        if (strcmp(n->name, name) == 0) {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+/* purpose: find or add a name of a task
+ * paramtr: name (IN): name of the task, taken over
+ * returns: the name, or NULL if out of memory
+ */
+static Name* add_name(char* name) {
+    Name* n = find_name(name);
+    if (n != NULL) {
+        free(name);
+        return n;
+    }
+
+    /* keep the chains short */
+    if (nnames >= names_size) {
+        size_t i, size = names_size ? names_size << 1 : 64;
+        Name** temp = (Name**) calloc(size, sizeof(Name*));
+        if (temp == NULL) {
+            return NULL;
+        }
+        for (i=0; i<names_size; i++) {
+            while (names[i] != NULL) {
+                Name* m = names[i];
+                names[i] = m->next;
+                m->next = temp[hash_command(m->name) & (size - 1)];
+                temp[hash_command(m->name) & (size - 1)] = m;
+            }
+        }
+        free(names);
+        names = temp;
+        names_size = size;
+    }
+
+    if ((n = (Name*) malloc(sizeof(Name))) == NULL) {
+        return NULL;
+    }
+    n->name = name;
+    n->task = NO_TASK;
+    n->state = TASK_SUCCEEDED;
+    n->next = names[hash_command(name) & (names_size - 1)];
+    names[hash_command(name) & (names_size - 1)] = n;
+    nnames++;
+    return n;
+}
+
+/* purpose: add the tasks in a comma-separated list to the predecessors
+ * paramtr: list (IO): names of the tasks, modified
+ *          lineno (IN): line number for messages
+ *          after (IO): indices of the predecessors that have not
+ *                      finished, or FAILED_TASK
+ *          nafter (IO): number of predecessors
+ */
+static void parseAfter(char* list, unsigned long lineno, size_t** after, size_t* nafter) {
+    char* name;
+    char* ptr = NULL;
+
+    for (name = strtok_r(list, ",", &ptr); name != NULL; name = strtok_r(NULL, ",", &ptr)) {
+        Name* n = find_name(name);
+        if (n == NULL) {
+            showerr("%s: line %lu: ignoring unknown task %s\n",
+                    application, lineno, name);
+            continue;
+        }
+
+        /* a task that finished is only remembered if it failed */
+        size_t task = n->task;
+        if (task == NO_TASK) {
+            if (n->state == TASK_SUCCEEDED) {
+                continue;
+            }
+            task = FAILED_TASK;
+        }
+
+        size_t* temp = (size_t*) realloc(*after, (*nafter + 1) * sizeof(size_t));
+        if (temp == NULL) {
+            showerr("%s: out of memory: %d: %s\n",
+                    application, errno, strerror(errno));
+            exit(42);
+        }
+        *after = temp;
+        (*after)[(*nafter)++] = task;
+    }
+}
+
+/* purpose: read the resources and dependencies of the next application
+ *          from a '#@' line
+ * paramtr: line (IN): annotation after the '#@'
+ *          lineno (IN): line number for messages
+ *          cpus (OUT): number of CPUs the application needs
+ *          memory (OUT): MB of memory the application needs
+ *          name (IO): name of the application
+ *          after (IO): indices of the tasks to run after
+ *          nafter (IO): number of tasks to run after
+ */
+static void parseAnnotation(char* line, unsigned long lineno, int* cpus, unsigned long* memory,
+                            char** name, size_t** after, size_t* nafter) {
+    char** argv;
+
+    /* names must not keep the line end */
+    line[strcspn(line, "\r\n")] = 0;
+    size_t i, argc = interpretArguments(line, &argv);
+
+    for (i=0; i<argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i+1 < argc) {
+            *cpus = atoi(argv[++i]);
+            if (*cpus < 1) {
+                showerr("%s: line %lu: invalid number of CPUs, using 1\n",
+                        application, lineno);
+                *cpus = 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0 && i+1 < argc) {
+            *memory = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-i") == 0 && i+1 < argc) {
+            free(*name);
+            *name = strdup(argv[++i]);
+        } else if (strcmp(argv[i], "-a") == 0 && i+1 < argc) {
+            parseAfter(argv[++i], lineno, after, nafter);
+        } else {
+            showerr("%s: line %lu: ignoring unknown resource %s\n",
+                    application, lineno, argv[i]);
+        }
+    }
+
+    for (i=0; i<argc; i++) {
+        free(argv[i]);
+    }
+    if (argc > 0) {
+        free(argv);
+    }
+}
+
+/* purpose: add a waiting task to the end of the ready queue
+ * paramtr: task (IN): index of the task
+ */
+static void enqueue_task(size_t task) {
+    if (tasks[task].queued) {
+        return;
+    }
+    if (ready_tail == ready_size) {
+        if (ready_head > 0) {
+            /* reuse the space of the tasks that left the queue */
+            memmove(ready, ready + ready_head, (ready_tail - ready_head) * sizeof(size_t));
+            ready_tail -= ready_head;
+            ready_head = 0;
+        } else {
+            size_t size = ready_size ? ready_size << 1 : 64;
+            size_t* temp = (size_t*) realloc(ready, size * sizeof(size_t));
+            if (temp == NULL) {
+                showerr("%s: out of memory: %d: %s\n",
+                        application, errno, strerror(errno));
+                exit(42);
+            }
+            ready = temp;
+            ready_size = size;
+        }
+    }
+    ready[ready_tail++] = task;
+    tasks[task].queued = 1;
+}
+
+/* purpose: remove the task at the head of the ready queue */
+static void dequeue_task() {
+    tasks[ready[ready_head]].queued = 0;
+    if (++ready_head == ready_tail) {
+        ready_head = ready_tail = 0;
+    }
+}
+
+/* purpose: append an application to the tasks
+ * paramtr: cmd (IN): command line, copied
+ *          lineno (IN): line number of the application
+ *          cpus (IN): number of CPUs the application needs
+ *          memory (IN): MB of memory the application needs
+ *          name (IN): name of the application, taken over
+ *          after (IN): indices of the tasks to run after, taken over
+ *          nafter (IN): number of tasks to run after
+ * returns: 0 on success, -1 on error
+ */
+static int add_task(const char* cmd, unsigned long lineno, int cpus, unsigned long memory,
+                    char* name, size_t* after, size_t nafter) {
+    size_t i, task = free_task;
+    if (task == NO_TASK) {
+        if (ntasks == tasks_size) {
+            size_t size = tasks_size ? tasks_size << 1 : 64;
+            Task* temp = (Task*) realloc(tasks, size * sizeof(Task));
+            if (temp == NULL) {
+                return -1;
+            }
+            tasks = temp;
+            tasks_size = size;
+        }
+        task = ntasks++;
+    } else {
+        free_task = tasks[task].next_free;
+    }
+
+    Task* t = tasks + task;
+    memset(t, 0, sizeof(Task));
+    t->state = TASK_WAITING;
+    t->next_free = NO_TASK;
+    nwaiting++;
+    if ((t->cmd = strdup(cmd)) == NULL) {
+        return -1;
+    }
+    t->hash = hash_command(cmd);
+    t->lineno = lineno;
+    t->cpus = cpus;
+    t->memory = memory;
+
+    /* the task is released by the predecessors that have not finished */
+    for (i=0; i<nafter; i++) {
+        if (after[i] == FAILED_TASK) {
+            t->doomed = 1;
+            continue;
+        }
+        Task* p = tasks + after[i];
+        size_t* temp = (size_t*) realloc(p->waiters, (p->nwaiters + 1) * sizeof(size_t));
+        if (temp == NULL) {
+            return -1;
+        }
+        p->waiters = temp;
+        p->waiters[p->nwaiters++] = task;
+        t->pending++;
+    }
+    free(after);
+
+    if (name != NULL) {
+        if ((t->name = add_name(name)) == NULL) {
+            return -1;
+        }
+        t->name->task = task;
+        t->name->state = TASK_WAITING;
+    }
+
+    if (t->doomed || t->pending == 0) {
+        enqueue_task(task);
+    }
+    return 0;
+}
+
+/* purpose: give up a task that will not run, and what it kept. Once it
+ *          succeeded or failed, release the tasks that wait for it and
+ *          give its slot back.
+ * paramtr: t (IO): task
+ *          state (IN): new state of the task
+ */
+static void finish_task(Task* t, TaskState state) {
+    size_t i;
+
+    if (t->state == TASK_WAITING) {
+        nwaiting--;
+    }
+    free(t->cmd);
+    t->cmd = NULL;
+    t->state = state;
+    if (state == TASK_RUNNING) {
+        return;
+    }
+
+    for (i=0; i<t->nwaiters; i++) {
+        Task* w = tasks + t->waiters[i];
+        w->pending--;
+        if (state == TASK_FAILED) {
+            w->doomed = 1;
+        }
+        if (w->doomed || w->pending == 0) {
+            enqueue_task(t->waiters[i]);
+        }
+    }
+    free(t->waiters);
+    t->waiters = NULL;
+    t->nwaiters = 0;
+
+    /* later tasks that name this one only need to know how it ended */
+    size_t task = t - tasks;
+    if (t->name != NULL && t->name->task == task) {
+        t->name->task = NO_TASK;
+        t->name->state = state;
+    }
+    t->next_free = free_task;
+    free_task = task;
+}
+
+/* purpose: wait for a child to finish, free its slot and report it
+ * paramtr: jobs (IO): job slots
+ *          status (OUT): return value from wait() family
+ *          options (IN): 0 to block, WNOHANG to only reap a finished child
+ * returns: pid of the child, 0 if WNOHANG and no child finished, -1 on error
+ */
+pid_t wait_for_child( Jobs* jobs, int* status, int options ) {
     struct rusage usage;
     Signals save;
     int saverr;
@@ -218,9 +773,11 @@ pid_t wait_for_child( Jobs* jobs, int* status ) {
      * and do not send me SIGCHLD since I am inside wait() anyways. Do
      * send the signals to the children, though (which hopefully exit.)
      */
-    save_signals(&save);
+    if (options == 0) {
+        save_signals(&save);
+    }
     errno = 0; /* we rely later on wait4 results */
-    while ( (child = wait4( ((pid_t) 0), status, 0, &usage )) < 0 ) {
+    while ( (child = wait4( ((pid_t) 0), status, options, &usage )) < 0 ) {
         saverr = errno;
         perror("wait4");
         errno = saverr;
@@ -234,13 +791,17 @@ pid_t wait_for_child( Jobs* jobs, int* status ) {
     final = now(NULL);
 
     /* FIXME: see above, end bracket. */
-    restore_signals(&save);
-
-    /* find child that has finished */
-    for (slot=0; slot < jobs->cpus; ++slot) {
-        if (jobs->jobs[slot].child == child) break;
+    if (options == 0) {
+        restore_signals(&save);
+    }
+    if (child == 0) {
+        /* no child has finished yet */
+        errno = saverr;
+        return child;
     }
 
+    /* find child that has finished */
+    slot = jobs_find_child(jobs, child);
     if ( slot == jobs->cpus ) {
         /* reaped child not found, not good */
         showerr("%s: process %d (status %d) is not a known child, ignoring.\n",
@@ -252,21 +813,28 @@ pid_t wait_for_child( Jobs* jobs, int* status ) {
 
         /* 20110419 PM-364: new requirement */
         showout("[cluster-task id=%lu, start=\"%s\", duration=%.3f, status=%d, "
-                "line=%lu, pid=%d, app=\"%s\"]\n",
+                "line=%lu, pid=%d, app=\"%s\", cpus=%d, memory=%lu, hash=%08lx]\n",
                 j->count,
                 iso2date( j->start, date, sizeof(date) ),
                 (final - j->start),
                 *status,
                 j->lineno,
                 child,
-                j->argv[ find_application(j->argv) ] );
+                j->argv[ find_application(j->argv) ],
+                j->cpus,
+                j->memory,
+                tasks[j->task].hash );
 
         /* progress report at finish of job */
         if (progress != -1) {
             report(progress, final, (final - j->start), *status, j->argv, &usage, NULL , j->count);
         }
 
-        /* free reported job */
+        /* tasks after this one may start now, or never */
+        finish_task(tasks + j->task, isafailure(*status) ? TASK_FAILED : TASK_SUCCEEDED);
+
+        /* free reported job and its resources */
+        jobs_release(jobs, slot);
         job_done(j);
     }
 
@@ -309,11 +877,6 @@ void run_independent_task(char* cmd, char* envp[], unsigned long* extra, const c
     (*extra)++;
 }
 
-int isafailure(int status) {
-    /* FIXME: On systems with exit codes outside 0..256 this may core dump! */
-    return (WIFEXITED(status) && success[WEXITSTATUS(status)] == 1 ) ? 0 : 1;
-}
-
 void massage_failure(int fail_hard, int current_ec, int *collect_ec) {
     if (fail_hard) {
         /* only propagate first failure in hard-fail mode */
@@ -326,11 +889,218 @@ void massage_failure(int fail_hard, int current_ec, int *collect_ec) {
     }
 }
 
+/* purpose: wait for a child to finish, and reap all other children that
+ *          have finished by then in the same pass
+ * paramtr: jobs (IO): job slots with at least one running job
+ *          fail_hard (IN): hard failure mode
+ *          status (IO): collected exit code
+ *          failure (IO): number of failed tasks
+ */
+static void reap_children(Jobs* jobs, int fail_hard, int* status, unsigned long* failure) {
+    int other;
+    int options = 0;
+    pid_t child;
+
+    do {
+        if ((child = wait_for_child(jobs, &other, options)) == 0) {
+            break;
+        }
+        if (errno == 0 && isafailure(other)) {
+            (*failure)++;
+        }
+        massage_failure(fail_hard, other, status);
+        options = WNOHANG;
+    } while (child > 0 && jobs->nfree < jobs->cpus);
+}
+
+/* purpose: start a task in a free slot
+ * paramtr: jobs (IO): job slots
+ *          slot (IN): free slot that fits the task
+ *          task (IN): index of the task
+ *          envp (IN): environment of the task
+ *          total (IO): number of tasks started
+ *          failure (IO): number of failed tasks
+ */
+static void start_task(Jobs* jobs, size_t slot, size_t task, char* envp[],
+                       unsigned long* total, unsigned long* failure) {
+    Signals save;
+    Task* t = tasks + task;
+    Job* j = jobs->jobs + slot;
+
+    if ((j->argc = interpretArguments(t->cmd, &(j->argv))) > 0) {
+        /* determine full path to application according to PATH */
+        char* fqpn = find_executable(j->argv[0]);
+        if (fqpn) {
+            /* found a FQPN, exchange first item in argument vector */
+            free(j->argv[0]);
+            j->argv[0] = fqpn;
+        }
+
+        (*total)++;
+        j->envp = envp;
+        j->lineno = t->lineno;
+        j->task = task;
+        finish_task(t, TASK_RUNNING);
+
+        /* WARNING: Must propagate "save" to start_child() */
+        save_signals(&save);
+        jobs_claim(jobs, slot, t->cpus, t->memory);
+
+        if ((j->child = fork()) == ((pid_t) -1)) {
+            /* fork error, bad */
+            showerr("%s: fork: %d: %s\n",
+                    application, errno, strerror(errno));
+            (*failure)++;
+            finish_task(t, TASK_FAILED);
+            jobs_release(jobs, slot);
+            job_done(j);
+        } else if (j->child == ((pid_t) 0)) {
+            /* child code */
+            if (jobs_pin(jobs, slot) == -1) {
+                showerr("%s: sched_setaffinity: %d: %s\n",
+                        application, errno, strerror(errno));
+            }
+            start_child(j->argv, j->envp, &save);
+            _exit(127); /* never reached, just in case */
+        } else {
+            /* parent code */
+            jobs_add_child(jobs, slot);
+            j->count = *total;
+            j->state = RUNNING;
+            j->start = now(&(j->when));
+        }
+
+        restore_signals(&save);
+    } else {
+        /* error parsing args */
+        if (debug) {
+            showerr("%s: error parsing arguments on line %lu, ignoring\n",
+                    application, t->lineno);
+        }
+        job_done(j);
+        finish_task(t, TASK_FAILED);
+    }
+}
+
+/* purpose: change the CPUs applications may use together to the load
+ * paramtr: jobs (IO): job slots, with a ready task that does not fit
+ * returns: true if more CPUs may be used now
+ */
+static int adapt(Jobs* jobs) {
+    double t = now(NULL);
+    if (adapt_max == 0 || t - adapted < ADAPT_INTERVAL) {
+        return 0;
+    }
+    adapted = t;
+    if (load_sample(&load) == -1) {
+        return 0;
+    }
+
+    /* step down when the node struggles, up when cores idle and we use
+     * everything we may */
+    int cores = processors();
+    int used = (int) jobs->cpus - jobs->cpus_free;
+    int limit = jobs->limit;
+    if (load.memory > PRESSURE_HIGH || load.io > PRESSURE_HIGH ||
+        load.iowait > IOWAIT_HIGH || load.load > cores * 1.25) {
+        limit--;
+    } else if (load.load + 1.0 <= cores && used >= limit &&
+               load.memory < PRESSURE_LOW && load.io < PRESSURE_LOW &&
+               load.iowait < IOWAIT_LOW) {
+        limit++;
+    }
+    if (limit < adapt_min) limit = adapt_min;
+    if (limit > adapt_max) limit = adapt_max;
+
+    if (limit == jobs->limit) {
+        return 0;
+    }
+    if (debug) {
+        showerr("%s: using %d CPU%s, load=%.2f memory=%.2f io=%.2f iowait=%.2f\n",
+                application, limit, (limit == 1 ? "" : "s"), load.load,
+                load.memory, load.io, load.iowait);
+    }
+    int more = limit > jobs->limit;
+    jobs->limit = limit;
+    report_limit(progress, t, limit, &load);
+    return more;
+}
+
+/* purpose: start the tasks whose predecessors have succeeded in the order
+ *          they became ready, waiting for slots and resources as necessary
+ * paramtr: jobs (IO): job slots
+ *          envp (IN): environment of the tasks
+ *          fail_hard (IN): if true, start nothing after a failure
+ *          drain (IN): if true, return only when no task is waiting
+ *          status (IO): collected exit code
+ *          total (IO): number of tasks started
+ *          failure (IO): number of failed tasks
+ */
+static void run_tasks(Jobs* jobs, char* envp[], int fail_hard, int drain,
+                      int* status, unsigned long* total, unsigned long* failure) {
+    size_t slot;
+
+    for (;;) {
+        /* we are in failure mode, skip starting new stuff */
+        if (fail_hard && *status && isafailure(*status)) {
+            return;
+        }
+
+        /* start what is ready until the next ready task does not fit */
+        while (ready_head < ready_tail) {
+            size_t task = ready[ready_head];
+            Task* t = tasks + task;
+            if (t->doomed) {
+                dequeue_task();
+                showerr("%s: line %lu: skipped, since a task before it failed\n",
+                        application, t->lineno);
+                (*total)++;
+                (*failure)++;
+                finish_task(t, TASK_FAILED);
+            } else if ((slot = jobs_free_slot(jobs)) < jobs->cpus &&
+                       jobs_fit(jobs, t->cpus, t->memory)) {
+                dequeue_task();
+                start_task(jobs, slot, task, envp, total, failure);
+            } else {
+                break;
+            }
+        }
+
+        /* all ready tasks started, read more or wait for the others,
+         * which are the waiting tasks that are not in the ready queue */
+        int fits = ready_head == ready_tail;
+        if (fits && !(drain && nwaiting > 0)) {
+            return;
+        }
+        if (jobs->nfree == jobs->cpus) {
+            /* nothing to wait for */
+            return;
+        }
+        if (!fits && adapt(jobs)) {
+            /* the next ready task may fit now */
+            continue;
+        }
+
+        /* wait for any child to finish */
+        if (debug) {
+            showerr("%s: %d slot%s busy, wait()ing\n",
+                    application, jobs->cpus - jobs->cpus_free,
+                    (jobs->cpus - jobs->cpus_free == 1 ? "" : "s"));
+        }
+        reap_children(jobs, fail_hard, status, failure);
+    }
+}
+
 int main(int argc, char* argv[], char* envp[]) {
     size_t len;
     char line[MAXSTR];
-    int other, exitstatus, status = 0;
-    int slot, cpus, fail_hard = 0, old_mode = 0;
+    int exitstatus, status = 0;
+    int cpus, pin, fail_hard = 0, old_mode = 0;
+    int need_cpus = 1;
+    unsigned long memory, need_memory = 0;
+    char* name = NULL;
+    size_t* after = NULL;
+    size_t nafter = 0;
     char* cmd;
     char* save = NULL;
     unsigned long total = 0;
@@ -340,7 +1110,7 @@ int main(int argc, char* argv[], char* envp[]) {
     time_t when;
     Jobs jobs;
     double diff, start = now(&when);
-    parseCommandline(argc, argv, &fail_hard, &old_mode, &cpus);
+    parseCommandline(argc, argv, &fail_hard, &old_mode, &cpus, &memory, &pin);
 
     /* progress report finish */
     if (progress != -1) {
@@ -353,6 +1123,20 @@ int main(int argc, char* argv[], char* envp[]) {
                 application, errno, strerror(errno));
         return 42;
     }
+    if (jobs_resources(&jobs, memory, pin) == -1) {
+        showerr("%s: unable to pin %d slot%s to cores of their own, not pinning\n",
+                application, cpus, (cpus == 1 ? "" : "s"));
+        jobs_resources(&jobs, memory, 0);
+    }
+
+    /* adaptive mode starts with all processors */
+    if (adapt_max > 0) {
+        int limit = processors();
+        jobs.limit = limit < adapt_min ? adapt_min : (limit > adapt_max ? adapt_max : limit);
+        adapted = start;
+        load_sample(&load);
+        report_limit(progress, start, jobs.limit, &load);
+    }
 
     /* since we will create multiple concurrent processes, let's create a
      * process group to order them by.
@@ -369,6 +1153,13 @@ int main(int argc, char* argv[], char* envp[]) {
     while (fgets(line, sizeof(line), stdin) != NULL) {
         ++lineno;
 
+        /* resources and dependencies of the next application */
+        if (line[0] == '#' && line[1] == '@') {
+            parseAnnotation(line + 2, lineno, &need_cpus, &need_memory,
+                            &name, &after, &nafter);
+            continue;
+        }
+
         /* check for skippable line */
         if (line[0] == 0 || /* empty line */
             line[0] == '\r' || /* CR */
@@ -407,98 +1198,81 @@ int main(int argc, char* argv[], char* envp[]) {
             cmd = line;
         }
 
-        /* find a free slot */
-        while ((slot = jobs_first_slot(&jobs, EMPTY)) == jobs.cpus) {
-            /* wait for any child to finish */
+        /* an application that needs more than there is runs by itself */
+        if (need_cpus > cpus) {
+            showerr("%s: line %lu needs %d CPUs, only %d available\n",
+                    application, lineno, need_cpus, cpus);
+            need_cpus = cpus;
+        }
+        if (memory > 0 && need_memory > memory) {
+            showerr("%s: line %lu needs %lu MB, only %lu available\n",
+                    application, lineno, need_memory, memory);
+            need_memory = memory;
+        }
+
+        Resumed* r = find_resumed(lineno, hash_command(cmd));
+        if (r != NULL) {
+            /* succeeded before, keep its record for the next resume,
+             * renumbered so that its id is not given to another task */
+            char* rest = r->record + 17;
             if (debug) {
-                showerr("%s: %d slot%s busy, wait()ing\n",
-                        application, jobs.cpus, (jobs.cpus == 1 ? "" : "s"));
+                showerr("%s: line %lu succeeded before, skipping\n",
+                        application, lineno);
             }
-            wait_for_child(&jobs, &other);
-            if (errno == 0 && isafailure(other)) {
-                failure++;
+            total++;
+            while (isdigit((unsigned char) *rest)) {
+                rest++;
             }
-            massage_failure(fail_hard, other, &status);
-        }
-
-        /* post-condition: there is a free slot; slot number in "slot" */
-
-        /* found free slot */
-        if (fail_hard && status && isafailure(status)) {
-            /* we are in failure mode already, skip starting new stuff */
-        } else if (slot < jobs.cpus) {
-            /* there is a free slot. Spawn and continue */
-            Signals save;
-            Job* j = jobs.jobs + slot;
-            if ((j->argc = interpretArguments(cmd, &(j->argv))) > 0) {
-                /* determine full path to application according to PATH */
-                char* fqpn = find_executable(j->argv[0]);
-                if (fqpn) {
-                    /* found a FQPN, exchange first item in argument vector */
-                    free(j->argv[0]);
-                    j->argv[0] = fqpn;
-                }
-
-                total++;
-                j->envp = envp;
-                j->lineno = lineno;
+            showout("[cluster-task id=%lu%s", total, rest);
 
-                /* WARNING: Must propagate "save" to start_child() */
-                save_signals(&save);
-
-                if ((j->child = fork()) == ((pid_t) -1)) {
-                    /* fork error, bad */
-                    showerr("%s: fork: %d: %s\n",
+            /* later tasks that name it may go ahead */
+            free(after);
+            if (name != NULL) {
+                Name* n = add_name(name);
+                if (n == NULL) {
+                    showerr("%s: out of memory: %d: %s\n",
                             application, errno, strerror(errno));
-                    failure++;
-                    job_done(j);
-                } else if (j->child == ((pid_t) 0)) {
-                    /* child code */
-                    start_child(j->argv, j->envp, &save);
-                    return 127; /* never reached, just in case */
-                } else {
-                    /* parent code */
-                    j->count = total;
-                    j->state = RUNNING;
-                    j->start = now(&(j->when));
-                }
-
-                restore_signals(&save);
-            } else {
-                /* error parsing args */
-                if (debug) {
-                    showerr("%s: error parsing arguments on line %lu, ignoring\n",
-                            application, lineno);
+                    return 42;
                 }
+                n->task = NO_TASK;
+                n->state = TASK_SUCCEEDED;
             }
-        } else {
-            /* no free slots, wait for children to finish */
-            showerr("%s: %s:%d THIS SHOULD NOT HAPPEN! (ignoring)\n",
-                    application, __FILE__, __LINE__ );
+        } else if (add_task(cmd, lineno, need_cpus, need_memory, name, after, nafter) == -1) {
+            /* queue the application, and start what is ready */
+            showerr("%s: out of memory: %d: %s\n",
+                    application, errno, strerror(errno));
+            return 42;
         }
+        run_tasks(&jobs, envp, fail_hard, 0, &status, &total, &failure);
 
         if (cmd != line) {
             free(cmd);
         }
 
+        /* annotations only apply to one application */
+        need_cpus = 1;
+        need_memory = 0;
+        name = NULL;
+        after = NULL;
+        nafter = 0;
+
         /* fail hard mode, if requested */
         if (fail_hard && status && isafailure(status)) {
             break;
         }
     }
 
+    /* start the tasks that still wait for others */
+    run_tasks(&jobs, envp, fail_hard, 1, &status, &total, &failure);
+
     /* wait for all children */
-    while ((slot = jobs_in_state(&jobs, EMPTY)) < jobs.cpus) {
+    while (jobs.nfree < jobs.cpus) {
         /* wait for any child to finish */
-        size_t n = jobs.cpus - slot;
+        size_t n = jobs.cpus - jobs.nfree;
         if (debug) {
             showerr("%s: %d task%s remaining\n", application, n, (n == 1 ? "" : "s"));
         }
-        wait_for_child(&jobs, &other);
-        if (errno == 0 && isafailure(other)) {
-            failure++;
-        }
-        massage_failure(fail_hard, other, &status);
+        reap_children(&jobs, fail_hard, &status, &failure);
     }
 
     /* NEW: unconditionally run a clean-up job */
@@ -32,8 +32,15 @@
 static char* identifier;
 struct utsname uname_cache;
 
-#define KS_FLAGS_ARG "ioelnNRBLTIwWSsKk"
-#define KS_FLAGS_NOARG "HVXFfqctzZ"
+/* Reused for every record, one page plus room for the line end */
+static char* record;
+static size_t record_size;
+
+/* Set to append records without locking the progress file */
+int report_nolock = 0;
+
+#define KS_FLAGS_ARG "ioelnNRBLTIwWSsKkbj"
+#define KS_FLAGS_NOARG "HVXFfqctzZg"
 
 static char* create_identifier() {
     char buffer[128];
@@ -243,6 +250,41 @@ static int mytrylock(int fd) {
     return 1;
 }
 
+/* purpose: get the buffer for a record
+ * returns: buffer of two pages, or NULL if out of memory
+ */
+static char* record_buffer() {
+    if (record == NULL) {
+        record_size = getpagesize();
+        record = (char*) malloc(record_size<<1);
+    }
+    return record;
+}
+
+/* purpose: append a record to the progress file
+ * paramtr: progress (IN): file descriptor open for writing
+ *          msg (IN): record including its line end
+ *          len (IN): length of the record
+ * returns: number of bytes written onto "progress"
+ */
+static ssize_t write_record(int progress, const char* msg, size_t len) {
+    /* Atomic append -- will still garble on Linux NFS */
+    if (report_nolock) {
+        return write(progress, msg, len);
+    }
+
+    /* Warning: Fcntl-locking may block in syscall on broken Linux kernels */
+    int locked = mytrylock(progress);
+    ssize_t wsize = write(progress, msg, len);
+    int save = errno;
+    if (locked) {
+        lockit(progress, F_SETLK, F_UNLCK);
+    }
+
+    errno = save;
+    return wsize;
+}
+
 /* purpose: report what has just finished.
  * paramtr: progress (IN): file descriptor open for writing
  *          time (IN): time to report (no millisecond resolution)
@@ -253,6 +295,10 @@ static int mytrylock(int fd) {
  *          special (IN): set for setup/cleanup jobs.
  *          taskid (IN): task number from input file. 
  * returns: number of bytes written onto "progress"
+ * warning: A record never exceeds one page, and is written with a single
+ *          write on a descriptor opened with O_APPEND. On local filesystems
+ *          such a write is atomic, so with report_nolock set the record is
+ *          appended without taking the fcntl lock.
  */
 ssize_t report(int progress, double time, double duration, int status,
                char *argv[], struct rusage *use, const char *special,
@@ -271,8 +317,11 @@ ssize_t report(int progress, double time, double duration, int status,
     char date[32];
     iso2date(time, date, sizeof(date));
 
-    size_t size = getpagesize();
-    char *msg = (char*) malloc(size<<1);
+    char *msg = record_buffer();
+    if (msg == NULL) {
+        return -1;
+    }
+    size_t size = record_size;
 
     /* message start */
     if (status == -1 && duration == 0.0 && use == NULL) {
@@ -316,17 +365,29 @@ ssize_t report(int progress, double time, double duration, int status,
     /* terminate line */
     strncat(msg+len, "\n", size-len);
 
-    /* Atomic append -- will still garble on Linux NFS */
-    /* Warning: Fcntl-locking may block in syscall on broken Linux kernels */
-    int locked = mytrylock(progress);
-    ssize_t wsize = write(progress, msg, len+1);
-    int save = errno;
-    if (locked) {
-        lockit(progress, F_SETLK, F_UNLCK);
+    return write_record(progress, msg, len+1);
+}
+
+ssize_t report_limit(int progress, double time, int limit, const Load* load) {
+    if (progress == -1) {
+        return 0;
+    }
+    if (identifier == NULL) {
+        identifier = create_identifier();
     }
 
-    free((void*) msg );
-    errno = save;
-    return wsize;
+    char date[32];
+    iso2date(time, date, sizeof(date));
+
+    char *msg = record_buffer();
+    if (msg == NULL) {
+        return -1;
+    }
+    int len = snprintf(msg, record_size,
+                       "%s %s 0 0/0 LIMIT %d ### load=%.2f memory=%.2f io=%.2f iowait=%.2f\n",
+                       date, identifier, limit, load->load, load->memory,
+                       load->io, load->iowait);
+
+    return write_record(progress, msg, len);
 }
 
@@ -21,6 +21,11 @@
 #include <time.h>
 #include <sys/resource.h>
 
+#include "load.h"
+
+/* Set to append progress records without the fcntl lock */
+extern int report_nolock;
+
 /* purpose: find start of argv excluding kickstart
  * paramtr: argv (IN): invocation argument vector
  * returns: start of argv. Returns 0 if unsure.
@@ -42,4 +47,13 @@ extern ssize_t report(int progress, double start, double duration,
                       int status, char* argv[], struct rusage* use,
                       const char* special, size_t taskid);
 
+/* purpose: report a change of the number of CPUs applications may use
+ * paramtr: progress (IN): file descriptor open for writing
+ *          time (IN): time to report
+ *          limit (IN): new number of CPUs
+ *          load (IN): load of the node that caused the change
+ * returns: number of bytes written onto "progress"
+ */
+extern ssize_t report_limit(int progress, double time, int limit, const Load* load);
+
 #endif /* _REPORT_H */
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/utsname.h>
@@ -19,6 +20,10 @@
 #include <net/if.h>
 #include <netdb.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#ifdef LINUX
+#include <sched.h>
+#endif
 
 #ifdef HAS_SYS_SOCKIO
 #include <sys/sockio.h>
@@ -180,6 +185,158 @@ spin( unsigned long interval )
     return count;
 }
 
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif // MIN
+
+struct SpinThread
+// purpose: one thread of the CPU load, and what it measured
+{
+    unsigned index;
+    unsigned long interval;     // seconds to run
+    unsigned duty;              // percent of each period to spin
+    pthread_t thread;
+    unsigned long count;        // rounds of julia set calculations
+    double wall;                // seconds from start to stop
+    double cpu;                 // CPU seconds of the thread
+    char cpus[256];             // CPUs the thread may run on
+    int first_cpu;              // CPU at the start, -1 if unknown
+    int last_cpu;               // CPU at the end, -1 if unknown
+    unsigned long migrations;   // changes of the CPU seen between periods
+};
+
+#define SPIN_PERIOD 0.1         // seconds of one busy and idle period
+
+static
+void
+format_affinity( char *buffer, size_t size )
+/* purpose: list the CPUs the calling thread may run on, like "0-3,6"
+ * paramtr: buffer (OUT): where to put the list
+ *          size (IN): capacity of the buffer */
+{
+    strncpy( buffer, "unknown", size );
+#ifdef LINUX
+    cpu_set_t mask;
+    if ( sched_getaffinity( 0, sizeof(mask), &mask ) == -1 ) return;
+
+    buffer[0] = '\0';
+    for ( int i = 0; i < CPU_SETSIZE; i++ )
+    {
+        if ( ! CPU_ISSET( i, &mask ) ) continue;
+        int j = i;
+        while ( j + 1 < CPU_SETSIZE && CPU_ISSET( j + 1, &mask ) ) j++;
+        char range[32];
+        if ( j > i ) snprintf( range, sizeof(range), "%s%d-%d", buffer[0] ? "," : "", i, j );
+        else snprintf( range, sizeof(range), "%s%d", buffer[0] ? "," : "", i );
+        strncat( buffer, range, size - strlen(buffer) - 1 );
+        i = j;
+    }
+#endif
+}
+
+static
+int
+current_cpu( void )
+{
+#ifdef LINUX
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+static
+void *
+spin_thread( void *arg )
+/* purpose: spin on one thread for its interval, busy for its duty cycle
+ * paramtr: arg (IO): the SpinThread */
+{
+    SpinThread *t = static_cast<SpinThread *>(arg);
+    double start = now();
+    double stop = start + t->interval;
+    unsigned short state[3];
+
+    // drand48() is not thread-safe, every thread has its own state
+    memcpy( state, &start, sizeof(state) );
+    state[0] ^= t->index;
+    double julia_x = 1.0 - 2.0 * erand48(state);
+    double julia_y = 1.0 - 2.0 * erand48(state);
+
+    format_affinity( t->cpus, sizeof(t->cpus) );
+    t->first_cpu = t->last_cpu = current_cpu();
+
+    for ( double period = start; period < stop; period += SPIN_PERIOD )
+    {
+        double busy = MIN( period + SPIN_PERIOD * t->duty / 100.0, stop );
+        do
+        {
+            for ( int i = 0; i < 16; ++i )
+                fractal( 1.0 - 2.0 * erand48(state), 1.0 - 2.0 * erand48(state), julia_x, julia_y, 1024 );
+            ++t->count;
+        }
+        while ( now() < busy );
+
+        int cpu = current_cpu();
+        if ( cpu != t->last_cpu ) t->migrations++;
+        t->last_cpu = cpu;
+
+        // idle for the rest of the period
+        double idle = MIN( period + SPIN_PERIOD, stop ) - now();
+        if ( idle > 0 ) usleep( static_cast<useconds_t>(idle * 1E6) );
+    }
+
+    t->wall = now() - start;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    if ( clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts ) == 0 )
+        t->cpu = ts.tv_sec + ts.tv_nsec / 1E9;
+#endif
+    return 0;
+}
+
+unsigned long
+spin_threads( unsigned long interval, unsigned nthreads, unsigned duty )
+/* purpose: spin on several threads, and report on stdout where each ran
+ * paramtr: interval (IN): seconds to spin
+ *          nthreads (IN): number of threads
+ *          duty (IN): percent of each period that the threads spin
+ * returns: rounds of julia set calculations of all threads */
+{
+    SpinThread *threads = static_cast<SpinThread *>( calloc( nthreads, sizeof(SpinThread) ) );
+    unsigned long count = 0;
+
+    for ( unsigned k = 0; k < nthreads; k++ )
+    {
+        threads[k].index = k;
+        threads[k].interval = interval;
+        threads[k].duty = duty;
+        if ( k > 0 && pthread_create( &threads[k].thread, 0, spin_thread, threads + k ) != 0 )
+        {
+            fprintf( stderr, "[warning] unable to start spin thread %u: %s\n", k, strerror(errno) );
+            threads[k].thread = 0;
+        }
+    }
+    spin_thread( threads );
+
+    for ( unsigned k = 0; k < nthreads; k++ )
+    {
+        SpinThread *t = threads + k;
+        if ( k > 0 )
+        {
+            if ( ! t->thread ) continue;
+            pthread_join( t->thread, 0 );
+        }
+        count += t->count;
+        printf( "[cpu] thread %u: affinity=%s cpu=%d..%d migrations=%lu wall=%.3f s "
+                "cpu=%.3f s usage=%.1f%% rounds=%lu\n",
+                k, t->cpus, t->first_cpu, t->last_cpu, t->migrations, t->wall, t->cpu,
+                t->wall > 0 ? 100.0 * t->cpu / t->wall : 0.0, t->count );
+    }
+
+    free( static_cast<void *>(threads) );
+    return count;
+}
+
 char *
 append( char *buffer, size_t capacity, const char *fmt, ... )
 {
@@ -491,8 +648,8 @@ identify( char *result, size_t size, const char *arg0,
 void helpMe(const char *ptr, unsigned long timeout, unsigned long spinout,
             unsigned long sleeptime, const char *prefix)
 {
-    printf( "Usage:\t%s [-a appname] [(-s|-t|-T) thinktime] [-l fn] [-o fn [..]]\n"
-            "\t[-i fn [..] | -G size] [-e env [..]] [-p p [..]] [-P ps] [-h]\n",
+    printf( "Usage:\t%s [-a appname] [(-s|-t|-T) thinktime] [-c n[:d]] [-l fn] [-o fn [..]]\n"
+            "\t[-i fn [..] | -G size] [-I io] [-M mm] [-R fn] [-e env [..]] [-p p [..]] [-P ps] [-h]\n",
             ptr );
     printf( " -a app\tset name of application to something else, default %s\n", ptr );
     printf( " -m me\tallocate 'me' MB of memory\n" );
@@ -502,6 +659,12 @@ void helpMe(const char *ptr, unsigned long timeout, unsigned long spinout,
     printf( " -t to\tsleep for 'to' seconds during execution, default %lu\n", timeout );
     printf( " -s to\tsleep for 'to' seconds after the I/O phase, default %lu\n", sleeptime);
     printf( " -T to\tspin for 'to' seconds during execution, default %lu\n", spinout );
+    printf( " -c n[:d]\tspin on 'n' threads, busy for 'd' percent of the time, default 1:100\n" );
+    printf( " -R fn\treplay the duration, CPU time, maxrss and file I/O of the main job\n\
+        in kickstart record or profile 'fn'\n" );
+    printf( " -M mm\tcomma-separated memory pattern to run after the I/O phase:\n\
+        copy, triad, chase or churn, mb=<MB>, time=<seconds>,\n\
+        bs=<min>-<max> and dist=uniform or exp for churn allocation sizes\n" );
     printf( " -l fn\tappend own information atomically to a logfile\n" );
     printf( " -o ..\tenumerate space-separated list output files to create\n\
         Accept also '<filename>=<filesize><data_unit>' form, where <data_unit>\n\
@@ -510,6 +673,8 @@ void helpMe(const char *ptr, unsigned long timeout, unsigned long spinout,
     printf( " -i ..\tenumerate space-separated list input to read and copy\n" );
     printf( " -G ..\tenumerate space-separated list of output file sizes\n" );
     printf( " -u un\tdata unit for output files generator - accepted values includes [ B K M G ], default is B\n" );
+    printf( " -I io\tcomma-separated I/O pattern for input and generated output files:\n\
+        bs=<size><data_unit>, seq or random, direct, mmap, fsync=<blocks>, streams=<n>\n" );
     printf( " -p ..\tenumerate space-separated parameters to mention\n" );
     printf( " -e ..\tenumerate space-separated environment values to print\n" );
     printf( " -C\tprint all environment variables starting with _CONDOR\n" );
@@ -544,10 +709,6 @@ data_unit_multiplier( char data_unit )
     return data_unit_multiplier;
 }
 
-#ifndef MIN
-#define MIN(a,b) ((a) < (b) ? (a) : (b))
-#endif // MIN
-
 char*
 allocate_mem_buffer( size_t mem_buf_size )
 /* purpose: allocate a memory buffor on heap and prevent it from being paged out
@@ -570,6 +731,508 @@ allocate_mem_buffer( size_t mem_buf_size )
     return memory_buffer;
 }
 
+struct MemPattern
+// purpose: how to exercise memory, set with -M
+{
+    enum { NONE, COPY, TRIAD, CHASE, CHURN } mode;
+    unsigned long mb;           // MB of memory to stream, chase or keep live
+    double seconds;             // how long to run
+    size_t min_block;           // churn: smallest allocation
+    size_t max_block;           // churn: largest allocation
+    bool exponential;           // churn: log-uniform instead of uniform sizes
+};
+
+bool
+parse_mem_pattern( const char *spec, MemPattern &mem )
+/* purpose: parse a memory pattern like "triad,mb=256,time=10"
+ * paramtr: spec (IN): the pattern
+ *          mem (OUT): the parsed pattern
+ * returns: false, if the pattern has an unknown item */
+{
+    char *copy = strdup(spec);
+    char *save = 0;
+    bool ok = true;
+
+    mem.mb = 64;
+    mem.seconds = 1.0;
+    mem.min_block = 64;
+    mem.max_block = 1024 * 1024;
+    for ( char *item = strtok_r( copy, ",", &save ); item; item = strtok_r( 0, ",", &save ) )
+    {
+        if ( strcmp( item, "copy" ) == 0 ) mem.mode = MemPattern::COPY;
+        else if ( strcmp( item, "triad" ) == 0 ) mem.mode = MemPattern::TRIAD;
+        else if ( strcmp( item, "chase" ) == 0 ) mem.mode = MemPattern::CHASE;
+        else if ( strcmp( item, "churn" ) == 0 ) mem.mode = MemPattern::CHURN;
+        else if ( strncmp( item, "mb=", 3 ) == 0 ) mem.mb = strtoul( item + 3, 0, 10 );
+        else if ( strncmp( item, "time=", 5 ) == 0 ) mem.seconds = strtod( item + 5, 0 );
+        else if ( strcmp( item, "dist=uniform" ) == 0 ) mem.exponential = false;
+        else if ( strcmp( item, "dist=exp" ) == 0 ) mem.exponential = true;
+        else if ( strncmp( item, "bs=", 3 ) == 0 )
+        {
+            // min-max, each with an optional data unit
+            char *unit = 0;
+            mem.min_block = strtoul( item + 3, &unit, 10 ) * data_unit_multiplier( *unit );
+            if ( *unit && *unit != '-' ) unit++;
+            mem.max_block = ( *unit == '-' ) ?
+                            strtoul( unit + 1, &unit, 10 ) * data_unit_multiplier( *unit ) :
+                            mem.min_block;
+        }
+        else ok = false;
+    }
+    free( static_cast<void *>(copy) );
+
+    if ( mem.mb == 0 ) mem.mb = 1;
+    if ( mem.min_block == 0 ) mem.min_block = 1;
+    if ( mem.max_block < mem.min_block ) mem.max_block = mem.min_block;
+    return ok && mem.mode != MemPattern::NONE;
+}
+
+static
+double
+stream_memory( const MemPattern &mem, unsigned long *passes )
+/* purpose: STREAM-like copy c = a or triad a = b + s * c over three arrays
+ * returns: bytes moved */
+{
+    size_t n = mem.mb * 1024 * 1024 / (3 * sizeof(double));
+    double *a = static_cast<double *>( malloc( n * sizeof(double) ) );
+    double *b = static_cast<double *>( malloc( n * sizeof(double) ) );
+    double *c = static_cast<double *>( malloc( n * sizeof(double) ) );
+    double bytes = 0.0;
+
+    if ( a && b && c )
+    {
+        for ( size_t i = 0; i < n; i++ ) { a[i] = 1.0; b[i] = 2.0; c[i] = 0.0; }
+
+        double stop = now() + mem.seconds;
+        do
+        {
+            if ( mem.mode == MemPattern::COPY )
+            {
+                for ( size_t i = 0; i < n; i++ ) c[i] = a[i];
+                bytes += 2.0 * n * sizeof(double);
+            }
+            else
+            {
+                for ( size_t i = 0; i < n; i++ ) a[i] = b[i] + 3.0 * c[i];
+                bytes += 3.0 * n * sizeof(double);
+            }
+            ++*passes;
+        }
+        while ( now() < stop );
+    }
+
+    free( static_cast<void *>(a) );
+    free( static_cast<void *>(b) );
+    free( static_cast<void *>(c) );
+    return bytes;
+}
+
+static
+double
+chase_memory( const MemPattern &mem, unsigned long *accesses )
+/* purpose: follow a random cycle through the buffer, one dependent load at a time
+ * returns: bytes of the cache lines touched, 64 per load */
+{
+    size_t n = mem.mb * 1024 * 1024 / sizeof(size_t);
+    size_t *next = static_cast<size_t *>( malloc( n * sizeof(size_t) ) );
+    if ( next == 0 || n < 2 )
+    {
+        free( static_cast<void *>(next) );
+        return 0.0;
+    }
+
+    // Sattolo's algorithm makes a single cycle through all elements
+    unsigned short state[3] = { 0x1234, 0x5678, static_cast<unsigned short>(getpid()) };
+    for ( size_t i = 0; i < n; i++ ) next[i] = i;
+    for ( size_t i = n - 1; i > 0; i-- )
+    {
+        size_t j = static_cast<size_t>( erand48(state) * i );
+        size_t t = next[i];
+        next[i] = next[j];
+        next[j] = t;
+    }
+
+    size_t p = 0;
+    double stop = now() + mem.seconds;
+    do
+    {
+        for ( int i = 0; i < 65536; i++ ) p = next[p];
+        *accesses += 65536;
+    }
+    while ( now() < stop );
+
+    // keep the loads from being optimized away
+    if ( p == n ) printf( "%lu\n", static_cast<unsigned long>(p) );
+    free( static_cast<void *>(next) );
+    return 64.0 * *accesses;
+}
+
+static
+double
+churn_memory( const MemPattern &mem, unsigned long *allocations )
+/* purpose: keep replacing allocations of random sizes, up to mb MB live
+ * returns: bytes allocated and written */
+{
+    const size_t slots = 4096;
+    char **live = static_cast<char **>( calloc( slots, sizeof(char *) ) );
+    size_t *sizes = static_cast<size_t *>( calloc( slots, sizeof(size_t) ) );
+    size_t total = 0, limit = mem.mb * 1024 * 1024;
+    double bytes = 0.0;
+    double lmin = log( static_cast<double>(mem.min_block) );
+    double lmax = log( static_cast<double>(mem.max_block) );
+    unsigned short state[3] = { 0x4321, 0x8765, static_cast<unsigned short>(getpid()) };
+
+    double stop = now() + mem.seconds;
+    do
+    {
+        for ( int i = 0; i < 256; i++ )
+        {
+            size_t k = static_cast<size_t>( erand48(state) * slots );
+            size_t size = mem.exponential ?
+                          static_cast<size_t>( exp( lmin + erand48(state) * (lmax - lmin) ) ) :
+                          mem.min_block + static_cast<size_t>( erand48(state) * (mem.max_block - mem.min_block) );
+
+            // free the old block of this slot, and more if we are above the limit
+            free( static_cast<void *>(live[k]) );
+            total -= sizes[k];
+            live[k] = 0;
+            sizes[k] = 0;
+            for ( size_t j = (k + 1) % slots; total + size > limit && j != k; j = (j + 1) % slots )
+            {
+                free( static_cast<void *>(live[j]) );
+                total -= sizes[j];
+                live[j] = 0;
+                sizes[j] = 0;
+            }
+
+            if ( (live[k] = static_cast<char *>( malloc(size) )) != 0 )
+            {
+                memset( live[k], 'Z', size );
+                sizes[k] = size;
+                total += size;
+                bytes += size;
+                ++*allocations;
+            }
+        }
+    }
+    while ( now() < stop );
+
+    for ( size_t k = 0; k < slots; k++ ) free( static_cast<void *>(live[k]) );
+    free( static_cast<void *>(live) );
+    free( static_cast<void *>(sizes) );
+    return bytes;
+}
+
+void
+exercise_memory( const MemPattern &mem )
+/* purpose: run the memory pattern, and report the achieved GB/s on stdout
+ * paramtr: mem (IN): the memory pattern */
+{
+    static const char *names[] = { "none", "copy", "triad", "chase", "churn" };
+    unsigned long count = 0;
+    double start = now();
+    double bytes;
+
+    switch ( mem.mode )
+    {
+    case MemPattern::COPY:
+    case MemPattern::TRIAD:
+        bytes = stream_memory( mem, &count );
+        break;
+    case MemPattern::CHASE:
+        bytes = chase_memory( mem, &count );
+        break;
+    case MemPattern::CHURN:
+        bytes = churn_memory( mem, &count );
+        break;
+    default:
+        return;
+    }
+
+    double elapsed = now() - start;
+    if ( elapsed <= 0.0 ) elapsed = 1E-6;
+    printf( "[mem] %s: %lu MB, %.3f GB/s over %.3f s", names[mem.mode], mem.mb,
+            bytes / elapsed / 1E9, elapsed );
+    if ( mem.mode == MemPattern::CHASE )
+        printf( ", %.1f ns per load\n", count ? elapsed * 1E9 / count : 0.0 );
+    else if ( mem.mode == MemPattern::CHURN )
+        printf( ", %.0f allocations/s\n", count / elapsed );
+    else
+        printf( ", %lu passes\n", count );
+}
+
+struct ReplayFile
+// purpose: bytes read from and written to one file of a replayed job
+{
+    char *name;
+    unsigned long long bread;
+    unsigned long long bwrite;
+};
+
+struct Replay
+// purpose: footprint of a job to replay, set with -R
+{
+    double duration;            // wall time in seconds
+    double utime;               // user CPU time in seconds
+    double stime;               // system CPU time in seconds
+    unsigned long maxrss;       // peak resident set size in KB
+    ReplayFile *files;
+    size_t nfiles;
+    size_t size;
+};
+
+static
+void
+replay_file( Replay &replay, const char *name, size_t len,
+             unsigned long long bread, unsigned long long bwrite )
+/* purpose: add the I/O of a file to a replay, summing over processes */
+{
+    for ( size_t i = 0; i < replay.nfiles; i++ )
+    {
+        if ( strlen( replay.files[i].name ) == len &&
+             strncmp( replay.files[i].name, name, len ) == 0 )
+        {
+            replay.files[i].bread += bread;
+            replay.files[i].bwrite += bwrite;
+            return;
+        }
+    }
+
+    if ( replay.nfiles == replay.size )
+    {
+        replay.size = replay.size ? replay.size << 1 : 16;
+        replay.files = static_cast<ReplayFile *>(
+            realloc( static_cast<void *>(replay.files), replay.size * sizeof(ReplayFile) ) );
+    }
+    ReplayFile &f = replay.files[replay.nfiles++];
+    f.name = strndup( name, len );
+    f.bread = bread;
+    f.bwrite = bwrite;
+}
+
+static
+unsigned long long
+replay_attribute( const char *line, const char *key )
+/* purpose: value of an attribute like bread="123" in a kickstart <file> line */
+{
+    const char *p = strstr( line, key );
+    return p ? strtoull( p + strlen(key), 0, 10 ) : 0;
+}
+
+bool
+read_replay( const char *fn, Replay &replay )
+/* purpose: read the footprint of a job from a kickstart record or profile
+ * paramtr: fn (IN): name of the YAML invocation record or compact profile
+ *          replay (OUT): the footprint of the main job
+ * returns: false, if the file cannot be read or has no footprint
+ * warning: only the first mainjob of a record is used. A compact profile
+ *          has no mainjob, and lines "duration:", "utime:", "stime:",
+ *          "maxrss:" and "file: name bread bwrite" */
+{
+    FILE *in = fopen( fn, "r" );
+    if ( in == NULL )
+    {
+        fprintf( stderr, "open(%s): %s\n", fn, strerror(errno) );
+        return false;
+    }
+
+    char line[4096];
+    int mainjob = -1;           // indentation of the mainjob, -1 before it
+    bool found = false;
+    bool seen[4] = { false, false, false, false };
+    while ( fgets( line, sizeof(line), in ) )
+    {
+        char *s = line;
+        while ( *s == ' ' ) s++;
+        int indent = s - line;
+        if ( *s == '\n' || *s == '#' || *s == 0 ) continue;
+
+        if ( strncmp( s, "mainjob:", 8 ) == 0 )
+        {
+            if ( found ) break;
+            // forget anything from the setup or prejob
+            memset( seen, 0, sizeof(seen) );
+            for ( size_t i = 0; i < replay.nfiles; i++ ) free( static_cast<void *>(replay.files[i].name) );
+            replay.nfiles = 0;
+            mainjob = indent;
+            found = true;
+            continue;
+        }
+        if ( mainjob >= 0 && indent <= mainjob ) break;
+
+        if ( ! seen[0] && strncmp( s, "duration:", 9 ) == 0 )
+        {
+            replay.duration = strtod( s + 9, 0 );
+            seen[0] = true;
+        }
+        else if ( ! seen[1] && strncmp( s, "utime:", 6 ) == 0 )
+        {
+            replay.utime = strtod( s + 6, 0 );
+            seen[1] = true;
+        }
+        else if ( ! seen[2] && strncmp( s, "stime:", 6 ) == 0 )
+        {
+            replay.stime = strtod( s + 6, 0 );
+            seen[2] = true;
+        }
+        else if ( ! seen[3] && strncmp( s, "maxrss:", 7 ) == 0 )
+        {
+            replay.maxrss = strtoul( s + 7, 0, 10 );
+            seen[3] = true;
+        }
+        else if ( strncmp( s, "<file name=\"", 12 ) == 0 )
+        {
+            const char *name = s + 12;
+            const char *end = strchr( name, '"' );
+            if ( end ) replay_file( replay, name, end - name,
+                                    replay_attribute( end, " bread=\"" ),
+                                    replay_attribute( end, " bwrite=\"" ) );
+        }
+        else if ( strncmp( s, "file:", 5 ) == 0 )
+        {
+            char *name = s + 5;
+            while ( *name == ' ' ) name++;
+            char *end = name;
+            while ( *end && ! isspace(*end) ) end++;
+            char *rest = end;
+            unsigned long long bread = strtoull( rest, &rest, 10 );
+            unsigned long long bwrite = strtoull( rest, &rest, 10 );
+            if ( end > name ) replay_file( replay, name, end - name, bread, bwrite );
+        }
+    }
+    fclose(in);
+
+    if ( ! (seen[0] || seen[1] || seen[2] || seen[3] || replay.nfiles) )
+    {
+        fprintf( stderr, "[warning] no job footprint found in \"%s\"\n", fn );
+        return false;
+    }
+    return true;
+}
+
+static
+double
+cpu_seconds( bool user )
+/* purpose: user or system CPU time used by the process so far */
+{
+    struct rusage use;
+    getrusage( RUSAGE_SELF, &use );
+    const struct timeval &tv = user ? use.ru_utime : use.ru_stime;
+    return tv.tv_sec + tv.tv_usec / 1E6;
+}
+
+void
+replay_job( const Replay &replay, char *buffer, size_t bufsize, double start )
+/* purpose: reproduce the memory, I/O and CPU footprint of a job, and report it
+ * paramtr: replay (IN): the footprint read with read_replay
+ *          buffer (IO): scratch buffer
+ *          bufsize (IN): size of the scratch buffer
+ *          start (IN): start time of keg, to pad the wall time to the duration */
+{
+    // memory: allocate and touch what the job had on top of keg itself
+    struct rusage use;
+    getrusage( RUSAGE_SELF, &use );
+    unsigned long rss = static_cast<unsigned long>( use.ru_maxrss );
+    char *memory = NULL;
+    if ( replay.maxrss > rss )
+        memory = allocate_mem_buffer( (replay.maxrss - rss) * 1024 );
+
+    // I/O: files by their base name in the current directory, so that a
+    // replayed workflow passes its files along like the real one. Reads
+    // need the file to exist, wrapping around at its end.
+    unsigned long long nread = 0, nwritten = 0;
+    for ( size_t i = 0; i < replay.nfiles; i++ )
+    {
+        const ReplayFile &f = replay.files[i];
+        if ( strncmp( f.name, "/dev/", 5 ) == 0 ||
+             strncmp( f.name, "/proc/", 6 ) == 0 ||
+             strncmp( f.name, "/sys/", 5 ) == 0 ) continue;
+        // pipes and sockets look like "pipe:[1234]"
+        if ( *f.name != '/' && strstr( f.name, ":[" ) != NULL ) continue;
+        const char *base = strrchr( f.name, '/' );
+        base = base ? base + 1 : f.name;
+        if ( *base == 0 ) continue;
+
+        if ( f.bread )
+        {
+            int fd = open( base, O_RDONLY );
+            if ( fd != -1 )
+            {
+                unsigned long long todo = f.bread;
+                while ( todo )
+                {
+                    ssize_t rsize = read( fd, buffer, todo < bufsize ? todo : bufsize );
+                    if ( rsize < 0 ) break;
+                    if ( rsize == 0 )
+                    {
+                        // wrap around, unless the file is empty
+                        if ( lseek( fd, 0, SEEK_CUR ) == 0 || lseek( fd, 0, SEEK_SET ) == -1 ) break;
+                        continue;
+                    }
+                    todo -= rsize;
+                    nread += rsize;
+                }
+                close(fd);
+            }
+        }
+
+        if ( f.bwrite )
+        {
+            int fd = open( base, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+            if ( fd == -1 )
+            {
+                fprintf( stderr, "open(%s): %s\n", base, strerror(errno) );
+                continue;
+            }
+            // reads above overwrote the buffer
+            for ( size_t j = 0; j < bufsize; j++ ) buffer[j] = pattern[j & 63];
+            unsigned long long todo = f.bwrite;
+            while ( todo )
+            {
+                ssize_t wsize = write( fd, buffer, todo < bufsize ? todo : bufsize );
+                if ( wsize <= 0 ) break;
+                todo -= wsize;
+                nwritten += wsize;
+            }
+            close(fd);
+        }
+    }
+
+    // CPU: system time with reads from /dev/zero, then user time spinning
+    int zero = open( "/dev/zero", O_RDONLY );
+    if ( zero != -1 )
+    {
+        while ( cpu_seconds(false) < replay.stime )
+            for ( int i = 0; i < 64; i++ ) read( zero, buffer, bufsize );
+        close(zero);
+    }
+    double dummy = 0.0;
+    while ( cpu_seconds(true) < replay.utime )
+        for ( int i = 0; i < 100000; i++ ) dummy += sqrt( i + dummy );
+    if ( dummy < 0.0 ) printf( "%f\n", dummy );
+
+    // wall time: idle for the rest of the duration
+    double rest = start + replay.duration - now();
+    if ( rest > 0.0 )
+    {
+        struct timespec ts;
+        ts.tv_sec = static_cast<time_t>(rest);
+        ts.tv_nsec = static_cast<long>( (rest - ts.tv_sec) * 1E9 );
+        while ( nanosleep( &ts, &ts ) == -1 && errno == EINTR ) ;
+    }
+
+    getrusage( RUSAGE_SELF, &use );
+    printf( "[replay] duration=%.3f/%.3f utime=%.3f/%.3f stime=%.3f/%.3f maxrss=%lu/%lu"
+            " read=%llu written=%llu files=%lu\n",
+            now() - start, replay.duration, cpu_seconds(true), replay.utime,
+            cpu_seconds(false), replay.stime,
+            static_cast<unsigned long>( use.ru_maxrss ), replay.maxrss,
+            nread, nwritten, static_cast<unsigned long>( replay.nfiles ) );
+
+    if ( memory != NULL )
+        free( static_cast<void *>(memory) );
+}
+
 unsigned long
 calculate_input_file_size( DirtyVector iox[5], char *buffer )
 /* purpose: sum up input file sizes
@@ -616,13 +1279,21 @@ calculate_input_file_size( DirtyVector iox[5], char *buffer )
     return input_files_size;
 }
 
+struct IOPattern;
+
+static
+int
+read_input_pattern( FILE *in, const char *fn, char *dest, size_t *size, const IOPattern &io );
+
 int
-read_input_files( DirtyVector iox[5], char *buffer, size_t bufsize, char *memory_buffer )
+read_input_files( DirtyVector iox[5], char *buffer, size_t bufsize, char *memory_buffer,
+                  const IOPattern &io )
 /* purpose: read input file content to a memory buffer
  * paramtr: iox (DirtyVector[]): a data structure with information about all input/output files
  *         buffer (char*): an already allocated auxiliary buffer
  *         bufsize (size_t): size of the auxiliary buffer
  *         memory_buffer (char*): destination point where the input files content should be placed
+ *         io (IOPattern): how to read regular input files, if enabled
  */
 {
     FILE *in;
@@ -640,7 +1311,19 @@ read_input_files( DirtyVector iox[5], char *buffer, size_t bufsize, char *memory
             memcpy( memory_buffer + mem_buf_offset, buffer, strlen( buffer ) );
             mem_buf_offset += strlen( buffer );
 
-            while ( fgets( buffer, bufsize, in ) )
+            size_t size = 0;
+            int error = read_input_pattern( in, iox[1][j], memory_buffer + mem_buf_offset, &size, io );
+            if ( error > 0 )
+            {
+                printf( "[error] read \"%s\": %d: %s\n", iox[1][j], error, strerror(error) );
+                fclose(in);
+                return 1;
+            }
+            else if ( error == 0 )
+            {
+                mem_buf_offset += size;
+            }
+            else while ( fgets( buffer, bufsize, in ) )
             {
                 memcpy( memory_buffer + mem_buf_offset, buffer, strlen( buffer ) );
                 mem_buf_offset += strlen( buffer );
@@ -662,6 +1345,319 @@ read_input_files( DirtyVector iox[5], char *buffer, size_t bufsize, char *memory
     return 0;
 }
 
+struct IOPattern
+// purpose: how to read input and write output files, set with -I
+{
+    bool enabled;               // -I was given
+    size_t block;               // bytes per read or write
+    bool random;                // blocks in pseudo-random instead of file order
+    bool direct;                // bypass the page cache with O_DIRECT
+    bool mmap;                  // copy through a shared mapping
+    unsigned long fsync;        // sync after every so many blocks, 0 never
+    unsigned streams;           // concurrent threads, each on its own part
+};
+
+struct IOStream
+// purpose: the part of a file that one thread reads or writes
+{
+    int fd;
+    char *map;                  // mapping of the whole file, or NULL
+    char *dest;                 // where read data goes
+    const IOPattern *io;
+    bool write;
+    unsigned long long first;   // first block
+    unsigned long long count;   // number of blocks
+    unsigned long long size;    // size of the file
+    unsigned long long bytes;   // transferred
+    unsigned long ops;          // reads or writes done
+    int error;                  // errno of the first failure
+};
+
+bool
+parse_io_pattern( const char *spec, IOPattern &io )
+/* purpose: parse a comma-separated I/O pattern like "bs=1M,random,streams=4"
+ * paramtr: spec (IN): the pattern
+ *          io (OUT): the parsed pattern
+ * returns: false, if the pattern has an unknown item */
+{
+    char *copy = strdup(spec);
+    char *save = 0;
+    bool ok = true;
+
+    io.enabled = true;
+    for ( char *item = strtok_r( copy, ",", &save ); item; item = strtok_r( 0, ",", &save ) )
+    {
+        if ( strncmp( item, "bs=", 3 ) == 0 )
+        {
+            char *unit = 0;
+            io.block = strtoul( item + 3, &unit, 10 ) * data_unit_multiplier( *unit );
+        }
+        else if ( strcmp( item, "seq" ) == 0 ) io.random = false;
+        else if ( strcmp( item, "random" ) == 0 ) io.random = true;
+        else if ( strcmp( item, "direct" ) == 0 ) io.direct = true;
+        else if ( strcmp( item, "mmap" ) == 0 ) io.mmap = true;
+        else if ( strncmp( item, "fsync=", 6 ) == 0 ) io.fsync = strtoul( item + 6, 0, 10 );
+        else if ( strncmp( item, "streams=", 8 ) == 0 ) io.streams = strtoul( item + 8, 0, 10 );
+        else ok = false;
+    }
+    free( static_cast<void *>(copy) );
+
+    if ( io.block == 0 ) io.block = sizeof(output);
+    if ( io.streams == 0 ) io.streams = 1;
+    // O_DIRECT needs aligned offsets and sizes
+    if ( io.direct && io.block % 4096 ) io.block += 4096 - io.block % 4096;
+    return ok;
+}
+
+static
+unsigned long long
+gcd( unsigned long long a, unsigned long long b )
+{
+    while ( b )
+    {
+        unsigned long long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static
+void *
+run_io_stream( void *arg )
+/* purpose: read or write the blocks of one stream
+ * paramtr: arg (IO): the IOStream
+ * warning: random order steps through the blocks with a stride that is
+ *          coprime to their count, so every block is still used once */
+{
+    IOStream *st = static_cast<IOStream *>(arg);
+    const IOPattern *io = st->io;
+    size_t bs = io->block;
+    unsigned long long stride = 1;
+    char *block = 0;
+
+    if ( st->count == 0 ) return 0;
+    if ( io->random )
+    {
+        for ( stride = 2654435761ull % st->count; stride < 2 || gcd( stride, st->count ) != 1; stride++ )
+            if ( stride >= st->count ) { stride = 1; break; }
+    }
+
+    if ( posix_memalign( reinterpret_cast<void **>(&block), 4096, bs ) != 0 )
+    {
+        st->error = ENOMEM;
+        return 0;
+    }
+    for ( size_t i = 0; i < bs; i++ ) block[i] = pattern[i & 63];
+
+    unsigned long synced = 0;
+    for ( unsigned long long i = 0; i < st->count; i++ )
+    {
+        unsigned long long offset = ( st->first + (i * stride) % st->count ) * bs;
+        size_t len = MIN( bs, st->size - offset );
+        ssize_t done;
+
+        if ( st->map )
+        {
+            if ( st->write ) memcpy( st->map + offset, block, len );
+            else memcpy( st->dest + offset, st->map + offset, len );
+            done = len;
+        }
+        else if ( st->write )
+        {
+            done = pwrite( st->fd, block, len, offset );
+        }
+        else
+        {
+            done = pread( st->fd, block, len, offset );
+            if ( done > 0 ) memcpy( st->dest + offset, block, done );
+        }
+
+        if ( done != static_cast<ssize_t>(len) )
+        {
+            st->error = done < 0 ? errno : EIO;
+            break;
+        }
+        st->bytes += len;
+        st->ops++;
+
+        if ( st->write && io->fsync && ++synced == io->fsync )
+        {
+            synced = 0;
+            if ( st->map )
+            {
+                // sync this stream's part of the mapping
+                unsigned long long from = st->first * bs;
+                from -= from % getpagesize();
+                msync( st->map + from, MIN( st->size, (st->first + st->count) * bs ) - from, MS_SYNC );
+            }
+            else
+            {
+                fsync( st->fd );
+            }
+        }
+    }
+
+    free( static_cast<void *>(block) );
+    return 0;
+}
+
+static
+int
+run_io_pattern( int fd, char *dest, unsigned long long size, bool write,
+                const IOPattern &io, const char *fn )
+/* purpose: read or write a whole regular file in the given I/O pattern, and
+ *          report the achieved bandwidth and IOPS on stdout
+ * paramtr: fd (IN): file open for reading, or reading and writing
+ *          dest (OUT): buffer of size bytes for read data
+ *          size (IN): bytes to read or write
+ *          write (IN): true to write, false to read
+ *          io (IN): the I/O pattern
+ *          fn (IN): file name to report
+ * returns: 0 on success, or an errno value */
+{
+    IOPattern pat = io;
+    char *map = 0;
+    int error = 0;
+
+    if ( pat.mmap && size > 0 )
+    {
+        if ( write && ftruncate( fd, size ) == -1 ) return errno;
+        map = static_cast<char *>( ::mmap( 0, size, write ? PROT_READ | PROT_WRITE : PROT_READ,
+                                           MAP_SHARED, fd, 0 ) );
+        if ( map == MAP_FAILED ) return errno;
+        pat.direct = false;
+    }
+
+    // the last partial block cannot use O_DIRECT, leave it to us
+    unsigned long long blocks = size / pat.block;
+    unsigned long long tail = pat.direct ? size % pat.block : 0;
+    if ( ! tail && size % pat.block ) blocks++;
+
+    int flags = fcntl( fd, F_GETFL );
+    if ( pat.direct && fcntl( fd, F_SETFL, flags | O_DIRECT ) == -1 )
+    {
+        fprintf( stderr, "[warning] no O_DIRECT for \"%s\": %s\n", fn, strerror(errno) );
+        pat.direct = false;
+        blocks += tail ? 1 : 0;
+        tail = 0;
+    }
+
+    IOStream *st = static_cast<IOStream *>( calloc( pat.streams, sizeof(IOStream) ) );
+    pthread_t *tid = static_cast<pthread_t *>( calloc( pat.streams, sizeof(pthread_t) ) );
+    double start = now();
+    for ( unsigned k = 0; k < pat.streams; k++ )
+    {
+        st[k].fd = fd;
+        st[k].map = map;
+        st[k].dest = dest;
+        st[k].io = &pat;
+        st[k].write = write;
+        st[k].first = blocks * k / pat.streams;
+        st[k].count = blocks * (k + 1) / pat.streams - st[k].first;
+        st[k].size = size;
+        if ( k > 0 && pthread_create( tid + k, 0, run_io_stream, st + k ) != 0 )
+        {
+            // run it ourselves
+            run_io_stream( st + k );
+            tid[k] = 0;
+        }
+    }
+    run_io_stream( st );
+
+    unsigned long long bytes = 0;
+    unsigned long ops = 0;
+    for ( unsigned k = 0; k < pat.streams; k++ )
+    {
+        if ( k > 0 && tid[k] ) pthread_join( tid[k], 0 );
+        bytes += st[k].bytes;
+        ops += st[k].ops;
+        if ( st[k].error && ! error ) error = st[k].error;
+    }
+
+    if ( tail )
+    {
+        fcntl( fd, F_SETFL, flags );
+        IOStream last;
+        memset( &last, 0, sizeof(last) );
+        last.fd = fd;
+        last.dest = dest;
+        last.io = &pat;
+        last.write = write;
+        last.first = blocks;
+        last.count = 1;
+        last.size = size;
+        run_io_stream( &last );
+        bytes += last.bytes;
+        ops += last.ops;
+        if ( last.error && ! error ) error = last.error;
+    }
+
+    if ( write && ! error )
+    {
+        if ( map ) msync( map, size, MS_SYNC );
+        else if ( pat.fsync ) fsync( fd );
+    }
+    double elapsed = now() - start;
+
+    if ( map ) munmap( map, size );
+    fcntl( fd, F_SETFL, flags );
+    free( static_cast<void *>(st) );
+    free( static_cast<void *>(tid) );
+
+    if ( elapsed <= 0.0 ) elapsed = 1E-6;
+    printf( "[io] %s \"%s\": %llu bytes in %.3f s, %.1f MB/s, %.0f IOPS "
+            "(bs=%lu %s%s%s fsync=%lu streams=%u)\n",
+            write ? "write" : "read", fn, bytes, elapsed,
+            bytes / elapsed / (1024 * 1024), ops / elapsed,
+            static_cast<unsigned long>(pat.block), pat.random ? "random" : "seq",
+            pat.direct ? " direct" : "", pat.mmap ? " mmap" : "",
+            pat.fsync, pat.streams );
+    return error;
+}
+
+static
+int
+read_input_pattern( FILE *in, const char *fn, char *dest, size_t *size, const IOPattern &io )
+/* purpose: read a regular input file in the given I/O pattern
+ * paramtr: in (IN): the open input file
+ *          fn (IN): its name
+ *          dest (OUT): where to put its content
+ *          size (OUT): bytes read
+ *          io (IN): the I/O pattern
+ * returns: 0 on success, an errno value on failure, or -1 to read it line by line */
+{
+    struct stat st;
+    if ( ! io.enabled || fstat( fileno(in), &st ) == -1 || ! S_ISREG(st.st_mode) ) return -1;
+
+    *size = st.st_size;
+    return run_io_pattern( fileno(in), dest, st.st_size, false, io, fn );
+}
+
+bool
+write_output_pattern( FILE *out, const char *fn, unsigned long xsize, const IOPattern &io )
+/* purpose: write the generated data of a regular output file in the given I/O pattern
+ * paramtr: out (IO): the freshly opened output file
+ *          fn (IN): its name
+ *          xsize (ulong): how much data (in bytes) should be generated
+ *          io (IN): the I/O pattern
+ * returns: false, if the output is not a regular file and nothing was written */
+{
+    struct stat st;
+    int fd;
+    if ( ! io.enabled || fstat( fileno(out), &st ) == -1 || ! S_ISREG(st.st_mode) ||
+            (fd = open( fn, O_RDWR )) == -1 )
+        return false;
+
+    int error = run_io_pattern( fd, 0, xsize, true, io, fn );
+    if ( error ) fprintf( stderr, "[error] write \"%s\": %d: %s\n", fn, error, strerror(error) );
+    close(fd);
+
+    fseek( out, xsize, SEEK_SET );
+    fputc( '\n', out );
+    return true;
+}
+
 void
 generate_output_file( FILE *out, unsigned long xsize )
 /* purpose: write the specified amount of 'random' data to a file
@@ -715,6 +1711,9 @@ main( int argc, char *argv[] )
 
     // required CPU time
     unsigned long spinout = 0;
+    // threads and their duty cycle to spin with
+    unsigned spin_nthreads = 0;
+    unsigned spin_duty = 100;
     // required wall time
     unsigned long timeout = 0;
     // required sleep time
@@ -736,6 +1735,13 @@ main( int argc, char *argv[] )
     // unsigned long gensize = 0;
     char data_unit = 'B';
     DirtyVector iox[5];
+    IOPattern io;
+    memset( &io, 0, sizeof(io) );
+    MemPattern mem;
+    memset( &mem, 0, sizeof(mem) );
+    Replay replay;
+    memset( &replay, 0, sizeof(replay) );
+    bool replaying = false;
 
     // when did we start
     double start = now();
@@ -762,7 +1768,7 @@ main( int argc, char *argv[] )
         char *s = argv[i];
         if ( s[0] == '-' && s[1] != 0 )
         {
-            if ( strchr( "iotTGaepPlCmruhs\0", s[1] ) != NULL )
+            if ( strchr( "iotTGaepPlCmruhsIcMR\0", s[1] ) != NULL )
             {
                 switch (s[1])
                 {
@@ -805,6 +1811,18 @@ main( int argc, char *argv[] )
                 case 's':
                     state = 19;
                     break;
+                case 'I':
+                    state = 20;
+                    break;
+                case 'c':
+                    state = 21;
+                    break;
+                case 'M':
+                    state = 22;
+                    break;
+                case 'R':
+                    state = 23;
+                    break;
 #ifdef WITH_MPI
                 case 'r':
                     root_only_memory_allocation = true;
@@ -856,6 +1874,22 @@ main( int argc, char *argv[] )
             case 19:
                 sleeptime = strtoul(s, 0, 10);
                 break;
+            case 20:
+                if ( ! parse_io_pattern( s, io ) )
+                    fprintf( stderr, "[warning] ignoring unknown items in I/O pattern \"%s\"\n", s );
+                break;
+            case 21:
+                if ( sscanf( s, "%u:%u", &spin_nthreads, &spin_duty ) < 1 || spin_nthreads < 1 )
+                    spin_nthreads = 1;
+                if ( spin_duty < 1 || spin_duty > 100 ) spin_duty = 100;
+                break;
+            case 22:
+                if ( ! parse_mem_pattern( s, mem ) )
+                    fprintf( stderr, "[warning] ignoring unknown items in memory pattern \"%s\"\n", s );
+                break;
+            case 23:
+                replaying = read_replay( s, replay );
+                break;
             }
             state = 0;
         }
@@ -913,7 +1947,7 @@ main( int argc, char *argv[] )
         }
 
         // 3. read the input files content
-        if( read_input_files( iox, buffer, bufsize, memory_buffer ) ) {
+        if( read_input_files( iox, buffer, bufsize, memory_buffer, io ) ) {
             free( static_cast<void *>(buffer) );
             return 2;
         }
@@ -923,6 +1957,8 @@ main( int argc, char *argv[] )
         for ( unsigned i = 0; i < iox[2].size(); ++i )
         {
             unsigned long xsize = 0;
+            const char *outfn = iox[2][i];
+            char filename[256];
 
             if ( iox[2][i][0] == '-' && iox[2][i][1] == '\0' )
             {
@@ -931,7 +1967,6 @@ main( int argc, char *argv[] )
             else 
             {
                 char *filesize = strrchr( (char*)iox[2][i], '=' );
-                char filename[256];
                 
                 if ( filesize != NULL )
                 {
@@ -939,6 +1974,7 @@ main( int argc, char *argv[] )
                     filename[( filesize - iox[2][i] )] = '\0';
 
                     out = fopen( filename, "w" );
+                    outfn = filename;
 
                     unsigned long long unit_multiplier = 1;
 
@@ -980,7 +2016,8 @@ main( int argc, char *argv[] )
                         const char *xsize_str = iox[4][ i % iox[4].size() ];  
                         xsize = strtoul(xsize_str, 0, 10) * data_unit_multiplier( data_unit );
                     }
-                    generate_output_file( out, xsize );
+                    if ( ! write_output_pattern( out, outfn, xsize, io ) )
+                        generate_output_file( out, xsize );
                 }
                 else
                 {
@@ -1006,6 +2043,13 @@ main( int argc, char *argv[] )
         }
     }
 
+    // PHASE 2b - exercising memory
+    exercise_memory( mem );
+
+    // PHASE 2c - replaying the footprint of a recorded job
+    if ( replaying )
+        replay_job( replay, buffer, bufsize, start );
+
     double timestamp = now();
     int time_diff = spinout - ( (int) (timestamp - start) );
     // printf( "Start time: %f - Current timestamp: %f - Difference: %f\n", start, timestamp, timestamp - start);
@@ -1030,7 +2074,8 @@ main( int argc, char *argv[] )
         else
         {
             // printf( "[debug] you specified %lu [s] to spin so we will spin for %d [s]\n", spinout, time_diff );
-            spin(time_diff);
+            if ( spin_nthreads ) spin_threads( time_diff, spin_nthreads, spin_duty );
+            else spin(time_diff);
         }
     }
 
@@ -1086,6 +2131,10 @@ main( int argc, char *argv[] )
     if ( memory_buffer != NULL )
         free( static_cast<void *>(memory_buffer) );
 
+    for ( size_t i = 0; i < replay.nfiles; i++ )
+        free( static_cast<void *>(replay.files[i].name) );
+    free( static_cast<void *>(replay.files) );
+
     if ( buffer != NULL )
         free( static_cast<void *>(buffer) );
 
@@ -23,8 +23,6 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <grp.h>
-#include <pwd.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -122,8 +120,8 @@ static int comparator(const void* a, const void* b) {
 static size_t convert2YAML(FILE *out, const AppInfo* run) {
     size_t i;
     size_t error_count = 0;
-    struct passwd* user = getpwuid(getuid());
-    struct group* group = getgrgid(getgid());
+    const char* user = userName(getuid());
+    const char* group = groupName(getgid());
 
     fprintf(out, "- invocation: True\n"
                  "  version: " YAML_SCHEMA_VERSION "\n");
@@ -188,13 +186,13 @@ static size_t convert2YAML(FILE *out, const AppInfo* run) {
     /* user info about who ran this thing */
     fprintf(out, "  uid: %d\n", getuid());
     if (user) {
-        fprintf(out, "  user: %s\n", user->pw_name);
+        fprintf(out, "  user: %s\n", user);
     }
 
     /* group info about who ran this thing */
     fprintf(out, "  gid: %d\n", getgid());
     if (group) {
-        fprintf(out, "  group: %s\n", group->gr_name);
+        fprintf(out, "  group: %s\n", group);
     }
 
     /* currently active umask settings */
@@ -310,6 +308,28 @@ static char* pattern(char* buffer, size_t size, const char* dir,
     return buffer;
 }
 
+/* The bytes of stdout and stderr to keep in memory when they are captured
+ * through pipes with KICKSTART_CAPTURE, or 0 if they go to temporary files */
+static size_t captureThreshold() {
+    char* value = getenv("KICKSTART_CAPTURE");
+    if (value == NULL || *value == '\0') {
+        return 0;
+    }
+    char* end;
+    unsigned long long threshold = strtoull(value, &end, 0);
+    if (*end != '\0') {
+        printerr("Invalid KICKSTART_CAPTURE: %s\n", value);
+        return 0;
+    }
+    return threshold;
+}
+
+static void initStdioInfo(StatInfo* statinfo, char* tempname, size_t threshold) {
+    if (threshold == 0 || initStatInfoAsCapture(statinfo, tempname, threshold) < 0) {
+        initStatInfoAsTemp(statinfo, tempname);
+    }
+}
+
 int initAppInfo(AppInfo* appinfo, int argc, char* const* argv) {
     /* purpose: initialize the data structure with defaults
      * paramtr: appinfo (OUT): initialized memory block
@@ -344,11 +364,11 @@ int initAppInfo(AppInfo* appinfo, int argc, char* const* argv) {
 
     /* default for stdout */
     pattern(tempname, tempsize, tempdir, "/", "ks.out.XXXXXX");
-    initStatInfoAsTemp(&appinfo->output, tempname);
+    initStdioInfo(&appinfo->output, tempname, captureThreshold());
 
     /* default for stderr */
     pattern(tempname, tempsize, tempdir, "/", "ks.err.XXXXXX");
-    initStatInfoAsTemp(&appinfo->error, tempname);
+    initStdioInfo(&appinfo->error, tempname, captureThreshold());
 
     /* default for stdlog */
     initStatInfoFromHandle(&appinfo->logfile, STDOUT_FILENO);
@@ -382,6 +402,55 @@ int initAppInfo(AppInfo* appinfo, int argc, char* const* argv) {
     appinfo->currentChild = 0;
     appinfo->nextSignal = SIGTERM;
 
+    appinfo->cgroupInterval = 1.0;
+
+    return 0;
+}
+
+static void renewTempFile(StatInfo* statinfo, const char* tempdir, const char* file) {
+    /* The old file belongs to the batch, which removes it when it is done */
+    char tempname[BUFSIZ];
+    if (statinfo->source == IS_TEMP) {
+        close(statinfo->file.descriptor);
+        free((void*) statinfo->file.name);
+        pattern(tempname, sizeof(tempname), tempdir, "/", file);
+        initStatInfoAsTemp(statinfo, tempname);
+    } else if (statinfo->source == IS_CAPTURE) {
+        /* The capture of the batch was never started */
+        size_t threshold = statinfo->capture->threshold;
+        deleteStatInfo(statinfo);
+        pattern(tempname, sizeof(tempname), tempdir, "/", file);
+        initStdioInfo(statinfo, tempname, threshold);
+    }
+}
+
+int initTaskAppInfo(AppInfo* appinfo, int argc, char* const* argv) {
+    /* purpose: prepare the data structure for one command of a batch, in
+     *          the process forked for it. The machine and host information
+     *          and the options of the batch are kept, and the command gets
+     *          its own temporary files and timestamps.
+     * paramtr: appinfo (IO): data structure initialized for the batch
+     *          argc (IN): number of arguments of the command
+     *          argv (IN): arguments of the command, in kickstart form
+     */
+    const char* tempdir = getTempDir();
+
+    now(&appinfo->start);
+    appinfo->finish = appinfo->start;
+
+    renewTempFile(&appinfo->output, tempdir, "ks.out.XXXXXX");
+    renewTempFile(&appinfo->error, tempdir, "ks.err.XXXXXX");
+    renewTempFile(&appinfo->metadata, tempdir, "ks.meta.XXXXXX");
+    renewTempFile(&appinfo->integritydata, tempdir, "ks.integrity.XXXXXX");
+
+    appinfo->argc = argc;
+    appinfo->argv = argv;
+    appinfo->child = getpid();
+    appinfo->isPrinted = 0;
+    appinfo->status = 0;
+    appinfo->currentChild = 0;
+    appinfo->nextSignal = SIGTERM;
+
     return 0;
 }
 
@@ -414,10 +483,12 @@ int printAppInfo(AppInfo* run) {
         return -1;
     }
 
-    /* Create a stream for the file. We use dup so that we can call
-     * fclose later regardless of whether fd is stdout/stderr.
-     */
-    FILE *out = fdopen(dup(fd), "w");
+    /* The record is built in memory and written with as few write calls
+     * as possible, so that it does not interleave with the output of other
+     * processes that write to the same file or pipe. */
+    char *record = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&record, &size);
     if (out == NULL) {
         printerr("ERROR: Unable to open output stream\n");
         goto exit;
@@ -438,17 +509,35 @@ int printAppInfo(AppInfo* run) {
     /* print the invocation record */
     result = convert2YAML(out, run);
 
-    /* make sure the data is completely flushed */
-    fflush(out);
-    fsync(fileno(out));
+    if (fclose(out) != 0) {
+        printerr("ERROR: Unable to create invocation record: %s\n", strerror(errno));
+        result = -1;
+    } else {
+        /* write() only writes part of the record if it is interrupted, or
+         * if the pipe or disk is full */
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = write(fd, record + done, size - done);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                printerr("ERROR: Unable to write invocation record: %s\n", strerror(errno));
+                result = -1;
+                break;
+            }
+            done += n;
+        }
 
-    run->isPrinted = 1;
+        /* make sure the data is completely flushed */
+        fsync(fd);
+    }
+    free(record);
 
-    fclose(out);
+    run->isPrinted = 1;
 
 exit:
     if (run->logfile.source == IS_FILE) {
-        fsync(fd);
         close(fd);
     }
 
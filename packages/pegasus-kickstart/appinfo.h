@@ -36,6 +36,9 @@ typedef struct {
     int            enableSysTrace; /* Enable system call tracing */
     int            omitData;       /* Omit <data> for stdout and stderr if job succeeds */
     int            enableLibTrace; /* Enable library tracing */
+    int            enableCgroup;   /* Enable cgroup accounting */
+    double         cgroupInterval; /* Seconds between /proc polls in a cgroup */
+    double         sampleInterval; /* Seconds between resource samples, 0 is off */
     int            termTimeout;    /* Time to allow job to run before sending sigterm */
     int            killTimeout;    /* Time to allow job to handle sigterm before sending sigkill */
     pid_t          currentChild;   /* The current child process (setup, pre, main, post, cleanup) */
@@ -83,6 +86,7 @@ typedef struct {
 } AppInfo;
 
 extern int initAppInfo(AppInfo* appinfo, int argc, char* const* argv);
+extern int initTaskAppInfo(AppInfo* appinfo, int argc, char* const* argv);
 extern int printAppInfo(AppInfo* runinfo);
 extern void deleteAppInfo(AppInfo* runinfo);
 
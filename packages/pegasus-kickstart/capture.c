@@ -0,0 +1,310 @@
+/* This module captures the stdout or stderr of the jobs through a pipe,
+ * instead of a temporary file that every job creates, appends to, stats
+ * and removes, which is slow when the temporary directory is on a shared
+ * file system. A thread of the kickstart parent reads the pipe while the
+ * jobs run, so that they never block on a full pipe, and keeps the
+ * output in memory. When the record only needs the tail of the output,
+ * because the data section is limited with -B, the memory is a ring that
+ * keeps the last bytes and drops the rest. Otherwise the output is kept
+ * until it reaches the spill threshold, and then it is moved to a
+ * temporary file that takes the rest of the output, as without capture.
+ *
+ * All reads from the pipe are done with the lock held, so that the
+ * output that was written before a job exited can be drained in order by
+ * syncCapture() before the record is written.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "error.h"
+
+static int openPipe(int fds[2]) {
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+    /* The jobs only get the write end, as their stdout or stderr */
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+static void closePipe(int fds[2]) {
+    if (fds[0] >= 0) {
+        close(fds[0]);
+    }
+    if (fds[1] >= 0) {
+        close(fds[1]);
+    }
+    fds[0] = fds[1] = -1;
+}
+
+static void writeAll(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, data, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printerr("Unable to write captured output: %s\n", strerror(errno));
+            return;
+        }
+        data += w;
+        n -= w;
+    }
+}
+
+static void ringAppend(CaptureInfo *c, const char *data, size_t n) {
+    /* Only the last capacity bytes can be kept */
+    if (n >= c->capacity) {
+        data += n - c->capacity;
+        n = c->capacity;
+        c->start = 0;
+        c->used = 0;
+    }
+
+    /* The ring grows until it reaches its capacity, and only wraps after
+     * that, so it is never wrapped when it is resized */
+    if (c->used + n > c->alloc && c->alloc < c->capacity) {
+        size_t size = c->alloc > 0 ? 2 * c->alloc : 4096;
+        if (size < c->used + n) {
+            size = c->used + n;
+        }
+        if (size > c->capacity) {
+            size = c->capacity;
+        }
+        char *ring = realloc(c->ring, size);
+        if (ring == NULL) {
+            printerr("realloc: %s\n", strerror(errno));
+            return;
+        }
+        c->ring = ring;
+        c->alloc = size;
+    }
+
+    size_t end = (c->start + c->used) % c->alloc;
+    size_t first = c->alloc - end < n ? c->alloc - end : n;
+    memcpy(c->ring + end, data, first);
+    memcpy(c->ring, data + first, n - first);
+    c->used += n;
+    if (c->used > c->alloc) {
+        c->start = (c->start + c->used - c->alloc) % c->alloc;
+        c->used = c->alloc;
+    }
+}
+
+/* Move the output to a temporary file. If that fails, the oldest output
+ * is dropped instead. */
+static int spill(CaptureInfo *c) {
+    int fd = mkstemp(c->pattern);
+    if (fd < 0) {
+        printerr("Unable to spill captured output: mkstemp: %s\n", strerror(errno));
+        c->bounded = 1;
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    c->spillfd = fd;
+    c->spillname = strdup(c->pattern);
+
+    /* The ring has not wrapped, because it is not bounded */
+    writeAll(fd, c->ring, c->used);
+    free(c->ring);
+    c->ring = NULL;
+    c->alloc = c->start = c->used = 0;
+    return 0;
+}
+
+static void append(CaptureInfo *c, const char *data, size_t n) {
+    c->total += n;
+    if (c->spillfd < 0 && !c->bounded && c->used + n > c->capacity) {
+        spill(c);
+    }
+    if (c->spillfd >= 0) {
+        writeAll(c->spillfd, data, n);
+    } else {
+        ringAppend(c, data, n);
+    }
+}
+
+/* Read everything that is in the pipe. Returns 1 if the pipe is empty,
+ * 0 at the end of the output, and -1 on error. */
+static int drain(CaptureInfo *c) {
+    char buf[65536];
+    for (;;) {
+        ssize_t n = read(c->fds[0], buf, sizeof(buf));
+        if (n > 0) {
+            append(c, buf, n);
+        } else if (n == 0) {
+            return 0;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        } else if (errno != EINTR) {
+            printerr("Unable to read captured output: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+}
+
+static void *captureThread(void *arg) {
+    CaptureInfo *c = (CaptureInfo *)arg;
+
+    struct pollfd fds[2];
+    fds[0].fd = c->fds[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = c->wake[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        pthread_mutex_lock(&c->lock);
+        int rc = drain(c);
+        pthread_mutex_unlock(&c->lock);
+        if (rc <= 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+CaptureInfo *newCapture(const char *pattern, size_t threshold) {
+    CaptureInfo *c = (CaptureInfo *)calloc(1, sizeof(CaptureInfo));
+    if (c == NULL) {
+        printerr("calloc: %s\n", strerror(errno));
+        return NULL;
+    }
+    c->pattern = strdup(pattern);
+    if (c->pattern == NULL) {
+        printerr("strdup: %s\n", strerror(errno));
+        free(c);
+        return NULL;
+    }
+    c->threshold = threshold;
+    c->fds[0] = c->fds[1] = -1;
+    c->wake[0] = c->wake[1] = -1;
+    c->spillfd = -1;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+/* Create the pipe and start reading it, before the first job that writes
+ * to it starts. keep is the number of bytes at the end of the output that
+ * the record needs, or 0 if it needs all of it. This is not done when
+ * the capture is created, because the commands of a batch are forked
+ * from a process that does not run jobs itself. */
+int startCapture(CaptureInfo *c, size_t keep) {
+    if (c->started) {
+        return 0;
+    }
+    c->keep = keep;
+    c->bounded = keep > 0 && keep <= c->threshold;
+    c->capacity = c->bounded ? keep : c->threshold;
+
+    if (openPipe(c->fds) < 0 || openPipe(c->wake) < 0) {
+        printerr("pipe: %s\n", strerror(errno));
+        closePipe(c->fds);
+        closePipe(c->wake);
+        return -1;
+    }
+    fcntl(c->fds[0], F_SETFL, fcntl(c->fds[0], F_GETFL) | O_NONBLOCK);
+
+    /* Signals for kickstart have to go to the thread that waits for the
+     * job, so the capture thread blocks all of them */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&c->thread, NULL, captureThread, c);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        printerr("Unable to start output capture: %s\n", strerror(rc));
+        closePipe(c->fds);
+        closePipe(c->wake);
+        return -1;
+    }
+
+    c->started = 1;
+    return 0;
+}
+
+/* Read the output that is still in the pipe, which is all the output of
+ * the jobs that have exited. Returns the size of the output. */
+size_t syncCapture(CaptureInfo *c) {
+    pthread_mutex_lock(&c->lock);
+    if (c->started) {
+        drain(c);
+    }
+    size_t total = c->total;
+    pthread_mutex_unlock(&c->lock);
+    return total;
+}
+
+/* Returns a copy of the output in memory, which the caller has to free,
+ * or NULL if there is none or it was spilled. If the oldest output was
+ * dropped, the copy starts at the next UTF-8 character. */
+char *captureData(CaptureInfo *c, size_t *size) {
+    char *data = NULL;
+    *size = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->spillfd < 0 && c->used > 0) {
+        size_t skip = 0;
+        if (c->total > c->used) {
+            while (skip < 3 && skip < c->used &&
+                   (c->ring[(c->start + skip) % c->alloc] & 0xc0) == 0x80) {
+                skip++;
+            }
+        }
+        size_t n = c->used - skip;
+        size_t from = (c->start + skip) % c->alloc;
+        size_t first = c->alloc - from < n ? c->alloc - from : n;
+        data = n > 0 ? malloc(n) : NULL;
+        if (data != NULL) {
+            memcpy(data, c->ring + from, first);
+            memcpy(data + first, c->ring, n - first);
+            *size = n;
+        } else if (n > 0) {
+            printerr("malloc: %s\n", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return data;
+}
+
+void deleteCapture(CaptureInfo *c) {
+    if (c == NULL) {
+        return;
+    }
+    if (c->started) {
+        if (write(c->wake[1], "x", 1) == 1) {
+            pthread_join(c->thread, NULL);
+        } else {
+            pthread_detach(c->thread);
+        }
+        closePipe(c->fds);
+        closePipe(c->wake);
+    }
+    if (c->spillfd >= 0) {
+        close(c->spillfd);
+        unlink(c->spillname);
+    }
+    free(c->spillname);
+    free(c->ring);
+    free(c->pattern);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
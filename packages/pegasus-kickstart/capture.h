@@ -0,0 +1,39 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* The stdout or stderr of the jobs, read through a pipe by a thread of
+ * the kickstart parent and kept in memory */
+typedef struct CaptureInfo {
+    char *pattern;              /* mkstemp() pattern for the spill file */
+    size_t threshold;           /* Bytes kept in memory before spilling */
+    size_t keep;                /* Bytes of the tail the record needs, 0 for all */
+
+    int fds[2];                 /* Pipe the jobs write to */
+    int wake[2];                /* Pipe to stop the reader thread */
+    int started;
+
+    char *ring;                 /* Buffered output, oldest byte at start */
+    size_t alloc;
+    size_t start;
+    size_t used;
+    size_t capacity;            /* Size the ring can grow to */
+    int bounded;                /* Drop the oldest bytes instead of spilling */
+    size_t total;               /* Bytes written by the jobs */
+
+    int spillfd;                /* Temporary file once the output was spilled */
+    char *spillname;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+} CaptureInfo;
+
+CaptureInfo *newCapture(const char *pattern, size_t threshold);
+int startCapture(CaptureInfo *c, size_t keep);
+size_t syncCapture(CaptureInfo *c);
+char *captureData(CaptureInfo *c, size_t *size);
+void deleteCapture(CaptureInfo *c);
+
+#endif /* _CAPTURE_H */
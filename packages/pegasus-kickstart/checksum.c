@@ -21,13 +21,136 @@
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
 #include <sys/time.h>
 #include "sha2.h"
+#include "sha256accel.h"
 
 #include "checksum.h"
 
 #define BUFSIZE 4096
 
+/* Output files are read in large chunks to keep the number of read calls
+ * down for multi-gigabyte outputs */
+#define HASH_BUFSIZE (1024 * 1024)
+
+/* Checksums computed by libinterpose while the files were written */
+typedef struct {
+    char          *fname;
+    uint64_t      size;
+    int64_t       mtime_sec;
+    int64_t       mtime_nsec;
+    unsigned char sha256[SHA256_DIGEST_SIZE];
+} InlineDigest;
+
+static InlineDigest *digests = NULL;
+static size_t ndigests = 0;
+static size_t maxdigests = 0;
+
+void pegasus_integrity_add_digest(const char *fname, uint64_t size,
+                                  int64_t mtime_sec, int64_t mtime_nsec,
+                                  const unsigned char *sha256) {
+    /* purpose: remember the checksum of a file computed as it was written
+     * paramtr: fname: real path of the file
+     *          size: size of the file when the checksum was computed
+     *          mtime_sec, mtime_nsec: modification time at that point
+     *          sha256: the checksum
+     */
+    if (ndigests == maxdigests) {
+        size_t newmax = maxdigests == 0 ? 16 : maxdigests * 2;
+        InlineDigest *newdigests = realloc(digests, sizeof(InlineDigest) * newmax);
+        if (newdigests == NULL) {
+            return;
+        }
+        digests = newdigests;
+        maxdigests = newmax;
+    }
+
+    InlineDigest *d = &digests[ndigests];
+    if ((d->fname = strdup(fname)) == NULL) {
+        return;
+    }
+    d->size = size;
+    d->mtime_sec = mtime_sec;
+    d->mtime_nsec = mtime_nsec;
+    memcpy(d->sha256, sha256, SHA256_DIGEST_SIZE);
+    ndigests++;
+}
+
+static int find_digest(const char *fname, unsigned char hval[]) {
+    /* purpose: look for a checksum from libinterpose that is still valid,
+     *          i.e. the file has not changed since it was computed
+     * paramtr: fname: real path of the file
+     *          hval: the buffer for the checksum
+     * returns: 1 if one was found
+     */
+    struct stat st;
+    size_t i;
+
+    if (fname == NULL || ndigests == 0 || stat(fname, &st) != 0) {
+        return 0;
+    }
+
+    for (i = 0; i < ndigests; ++i) {
+        InlineDigest *d = &digests[i];
+        if (d->size == (uint64_t) st.st_size &&
+            d->mtime_sec == st.st_mtim.tv_sec &&
+            d->mtime_nsec == st.st_mtim.tv_nsec &&
+            strcmp(d->fname, fname) == 0) {
+            memcpy(hval, d->sha256, SHA256_DIGEST_SIZE);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int hash_file(const char *fname, unsigned char hval[]) {
+    /* purpose: calculate the checksum of a file by reading it
+     * paramtr: fname: name of the file
+     *          hval: the buffer for the checksum
+     * returns: 1 on success
+     */
+    int           fd;
+    unsigned char *data;
+    sha256_ctx    ctx[1];
+    ssize_t       len;
+
+    if ((fd = open(fname, O_RDONLY)) == -1) {
+        return 0;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    if (posix_memalign((void **) &data, 4096, HASH_BUFSIZE) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    sha256_begin(ctx);
+    for (;;) {
+        len = read(fd, data, HASH_BUFSIZE);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+        sha256_hash_fast(data, len, ctx);
+    }
+    free(data);
+    close(fd);
+    if (len < 0) {
+        return 0;
+    }
+    sha256_end(hval, ctx);
+
+    return 1;
+}
 
 int pegasus_integrity_yaml(const char *fname, char *yaml) {
     /* purpose: calculate the checksum of a file
@@ -35,13 +158,11 @@ int pegasus_integrity_yaml(const char *fname, char *yaml) {
      *          yaml: the buffer for the calculated checksum
      * returns: 1 on success
      */
-    FILE          *inf;
     char          buf[BUFSIZE];
-    sha256_ctx    ctx[1];
     unsigned char hval[SHA256_DIGEST_SIZE];
     char          chksum_str[(SHA256_DIGEST_SIZE * 2) + 1];
     char          *chksum_cur;
-    int           i, len;
+    int           i;
     double        start_ts, duration;
 
     /* in case of failure */
@@ -49,22 +170,9 @@ int pegasus_integrity_yaml(const char *fname, char *yaml) {
     chksum_str[0] = '\0';
 
     start_ts = get_ts(); 
-    if (!(inf = fopen(fname, "r"))) {
+    if (!find_digest(fname, hval) && !hash_file(fname, hval)) {
         return 0;
     }
-
-    sha256_begin(ctx);
-    len = 0;
-    do
-    {   
-        len = (int)fread(buf, 1, BUFSIZE, inf);
-        if (len) {
-            sha256_hash((unsigned char*)buf, len, ctx);
-        }
-    }
-    while (len);
-    fclose(inf);
-    sha256_end(hval, ctx);
     duration = get_ts() - start_ts;
 
     chksum_cur = chksum_str;
@@ -15,6 +15,12 @@
 #ifndef _CHECKSUM_H
 #define _CHECKSUM_H
 
+#include <stdint.h>
+
+extern void pegasus_integrity_add_digest(const char *fname, uint64_t size,
+                                         int64_t mtime_sec, int64_t mtime_nsec,
+                                         const unsigned char *sha256);
+
 extern int pegasus_integrity_yaml(const char *fname, char *xml);
 
 extern int print_pegasus_integrity_yaml_blob(FILE *out, const char *fname);
@@ -8,6 +8,7 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
 #include <fcntl.h>
@@ -24,7 +25,16 @@
 #ifdef HAS_PAPI
 #include <papi.h>
 #endif
+#ifdef HAS_IO_URING
+#include <linux/io_uring.h>
+#endif
 #include <fnmatch.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "tracefile.h"
+#include "sha256accel.h"
 
 /* TODO Unlocked I/O (e.g. fwrite_unlocked) */
 /* TODO Handle directories */
@@ -44,9 +54,7 @@
 /* TODO What happens if one interposed library function calls another (e.g.
  *      fopen calls fopen64)? I think internal calls are not traced.
  */
-/* TODO What about mmap? Probably nothing we can do besides interpose
- *      mmap and assume that the total size being mapped is read/written
- */
+/* TODO Handle mremap of mapped files */
 
 static int myerr = STDERR_FILENO;
 
@@ -61,6 +69,13 @@ static int myerr = STDERR_FILENO;
 #define debug(format, args...)
 #endif
 
+/* Latency histograms for one descriptor. See TraceLatency. */
+typedef struct {
+    uint32_t read[TRACE_BUCKETS];
+    uint32_t write[TRACE_BUCKETS];
+    uint32_t meta[TRACE_BUCKETS];
+} Latency;
+
 typedef struct {
     char type;
     char *path;
@@ -70,6 +85,13 @@ typedef struct {
     size_t nwrite;
     size_t bseek;
     size_t nseek;
+    size_t nuring;          /* io_uring requests, see trace_uring_enter */
+    size_t buring;
+    Latency *latency;       /* NULL unless KICKSTART_TRACE_TIMING is set */
+    sha256_ctx *hash;       /* Checksum of the data written, see hash_iov */
+    uint64_t hashed;        /* Bytes added to hash */
+    pthread_t writer;       /* The only thread that wrote to the file */
+    char has_writer;
 } Descriptor;
 
 const char DTYPE_NONE = 0;
@@ -97,6 +119,158 @@ static pthread_mutex_t descriptor_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
     } \
 } while (0);
 
+/* I/O counters for one descriptor */
+typedef struct {
+    size_t bread;
+    size_t bwrite;
+    size_t nread;
+    size_t nwrite;
+    size_t bseek;
+    size_t nseek;
+    Latency *latency;       /* Owned by the thread, cleared but not freed */
+} Counters;
+
+/* Each thread counts its reads, writes and seeks in its own table, indexed
+ * by descriptor, so that tracing them does not take the descriptor mutex.
+ * The tables are in a list so that trace_close can add up the counters of
+ * every thread. When a thread exits, its counters are added to the
+ * descriptor table. A thread only takes the mutex to create or grow its
+ * table, because other threads read it.
+ */
+typedef struct Shard {
+    Counters *counters;
+    int size;
+    struct Shard *next;
+} Shard;
+
+static Shard *shards = NULL;
+static __thread Shard *myshard = NULL;
+
+/* Mappings of traced files. They are not part of the descriptor table
+ * because a mapping outlives the descriptor it was created from. Each
+ * mapping adds to the totals of its file, which are written to the trace
+ * when the process exits. */
+typedef struct MappedFile {
+    char *path;
+    size_t nmmap;
+    size_t bmmap;           /* Bytes mapped */
+    size_t bfault;          /* Bytes resident when they were unmapped */
+    struct MappedFile *next;
+} MappedFile;
+
+typedef struct Mapping {
+    char *start;
+    size_t length;          /* A multiple of the page size */
+    MappedFile *file;
+    struct Mapping *next;
+} Mapping;
+
+#ifdef HAS_IO_URING
+/* An io_uring instance, and its submission queue once the application
+ * has mapped it */
+typedef struct Ring {
+    int fd;
+    unsigned flags;
+    struct io_sqring_offsets sq_off;
+    char *sq;
+    size_t sq_length;
+    char *sqes;
+    size_t sqes_length;
+    struct Ring *next;
+} Ring;
+
+static Ring *rings = NULL;
+#endif
+
+static MappedFile *mapped_files = NULL;
+static Mapping *mappings = NULL;
+
+/* Number of mappings and rings, so that munmap only takes the mutex
+ * when there is something to look for */
+static volatile int tracked_maps = 0;
+
+/* Protects the mappings and rings. It is taken before the descriptor
+ * mutex, never while holding it. */
+static pthread_mutex_t mapping_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define lock_mappings() do { \
+    if (pthread_mutex_lock(&mapping_mutex) != 0) { \
+        printerr("Error locking mapping mutex\n"); \
+        abort(); \
+    } \
+} while (0);
+
+#define unlock_mappings() do { \
+    if (pthread_mutex_unlock(&mapping_mutex) != 0) { \
+        printerr("Error unlocking mapping mutex\n"); \
+        abort(); \
+    } \
+} while (0);
+
+/* Which files to trace. This is read from the environment once, when the
+ * library is initialized. */
+static const int POLICY_DEFAULT = 0;
+static const int POLICY_ALL = 1;
+static const int POLICY_CWD = 2;
+static const int POLICY_IGNORE = 3;
+static const int POLICY_MATCH = 4;
+
+static struct {
+    int mode;
+    char *cwd;              /* Current working directory */
+    char *prefix;           /* KICKSTART_PREFIX */
+    char *patternbuf;       /* Storage for patterns */
+    char **patterns;        /* KICKSTART_TRACE_IGNORE or _MATCH, split */
+    int npatterns;
+    int sample;             /* KICKSTART_TRACE_SAMPLE, or 1 */
+    int timing;             /* KICKSTART_TRACE_TIMING is set */
+    int checksum;           /* KICKSTART_TRACE_CHECKSUM is set */
+} policy;
+
+/* State of the random number generator used to pick sampled calls */
+static __thread uint32_t sample_state = 0;
+static __thread int sample_skip = 0;
+
+/* Whether the read or write call in progress is sampled, and when it
+ * started if it is being timed */
+static __thread int io_sampled = 1;
+static __thread uint64_t io_start = 0;
+
+/* When the open or close call in progress started, if it is being timed.
+ * meta_fd is the descriptor being closed, or -1 for an open. */
+static __thread uint64_t meta_start = 0;
+static __thread int meta_fd = -1;
+
+/* Directories resolved by realpath, so that opening many files in the
+ * same directory does not resolve the directory again every time. This
+ * assumes that directories aren't renamed or replaced with symlinks while
+ * the process runs. */
+typedef struct {
+    char *dir;
+    char *resolved;
+} DirCacheEntry;
+
+#define DIRCACHE_SIZE 256
+
+static DirCacheEntry dircache[DIRCACHE_SIZE];
+
+/* Protects the policy cwd and the directory cache */
+static pthread_mutex_t path_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define lock_paths() do { \
+    if (pthread_mutex_lock(&path_mutex) != 0) { \
+        printerr("Error locking path mutex\n"); \
+        abort(); \
+    } \
+} while (0);
+
+#define unlock_paths() do { \
+    if (pthread_mutex_unlock(&path_mutex) != 0) { \
+        printerr("Error unlocking path mutex\n"); \
+        abort(); \
+    } \
+} while (0);
+
 /* Thread tracking */
 static int cur_threads;
 static int tot_threads;
@@ -119,24 +293,76 @@ static pthread_mutex_t thread_track_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static int mypid = 0;
 
-/* This is the trace file where we write information about the process */
-static FILE* trace = NULL;
+/* This is the trace file shared by all the processes of the job. Its
+ * header and the extent that this process appends records to are mapped
+ * into memory. See tracefile.h. */
+static int trace = -1;
+static TraceFileHeader *trace_header = NULL;
+static char *trace_map = NULL;
+static size_t trace_size = 0;
+static uint32_t trace_nstrings = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/* Largest extent claimed for records that are not larger than that */
+#define TRACE_EXTENT_MAX (1024 * 1024)
+
+/* Returned by tstring when the string could not be written */
+#define TRACE_NOSTRING UINT32_MAX
+
+#define lock_trace() do { \
+    if (pthread_mutex_lock(&trace_mutex) != 0) { \
+        printerr("Error locking trace mutex\n"); \
+        abort(); \
+    } \
+} while (0);
+
+#define unlock_trace() do { \
+    if (pthread_mutex_unlock(&trace_mutex) != 0) { \
+        printerr("Error unlocking trace mutex\n"); \
+        abort(); \
+    } \
+} while (0);
+
+/* Strings already written to the trace file, with their ids */
+typedef struct {
+    char *value;
+    uint32_t id;
+} TraceEntry;
+
+static TraceEntry *strtab = NULL;
+static size_t strtab_size = 0;
+static size_t strtab_used = 0;
 
 #ifdef HAS_PAPI
 int papi_ok = 0;
-
-char *papi_events[] = {
-    "PAPI_TOT_INS",
-    "PAPI_LD_INS",
-    "PAPI_SR_INS",
-    "PAPI_FP_OPS",
-    "PAPI_FP_INS",
-    "PAPI_L3_TCM",
-    "PAPI_L2_TCM",
-    "PAPI_L1_TCM"
+int papi_multiplex = 0;
+
+/* Groups of events that can be named in KICKSTART_PAPI_EVENTS. The
+ * first one is used when the variable is not set. */
+static const struct {
+    const char *name;
+    const char *events;
+} papi_groups[] = {
+    { "default", "PAPI_TOT_INS,PAPI_TOT_CYC,PAPI_LD_INS,PAPI_SR_INS,"
+                 "PAPI_FP_OPS,PAPI_FP_INS,PAPI_L3_TCM,PAPI_L2_TCM,PAPI_L1_TCM" },
+    { "ipc", "PAPI_TOT_INS,PAPI_TOT_CYC" },
+    { "cache", "PAPI_TOT_INS,PAPI_L1_TCA,PAPI_L1_TCM,PAPI_L2_TCA,PAPI_L2_TCM,"
+               "PAPI_L3_TCA,PAPI_L3_TCM" },
+    { "flops", "PAPI_TOT_INS,PAPI_TOT_CYC,PAPI_FP_OPS,PAPI_FP_INS" },
+    { "memory", "PAPI_TOT_INS,PAPI_LD_INS,PAPI_SR_INS" },
+    { NULL, NULL }
 };
 
-#define n_papi_events (sizeof(papi_events) / sizeof(char *))
+/* The events to count, and their totals over all the threads */
+#define MAX_PAPI_EVENTS 32
+static char *papi_events[MAX_PAPI_EVENTS];
+static int papi_codes[MAX_PAPI_EVENTS];
+static long long papi_totals[MAX_PAPI_EVENTS];
+static int papi_counted[MAX_PAPI_EVENTS];
+static int n_papi_events = 0;
+
+/* Event set of the current thread */
+static __thread int papi_eventset = PAPI_NULL;
 
 #endif
 
@@ -152,6 +378,13 @@ static char *fgets_untraced(char *s, int size, FILE *stream);
 static size_t fread_untraced(void *ptr, size_t size, size_t nmemb, FILE *stream);
 static int fclose_untraced(FILE *fp);
 static int dup_untraced(int fd);
+static int open_untraced(const char *path, int oflag, mode_t mode);
+static int close_untraced(int fd);
+static int ftruncate_untraced(int fd, off_t length);
+static ssize_t pwrite_untraced(int fd, const void *buf, size_t count, off_t offset);
+static void *mmap_untraced(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+static int munmap_untraced(void *addr, size_t length);
+static void tdetach();
 
 /* The gettid() system call first appeared on Linux in kernel 2.4.11. 
  * Library support was added in glibc 2.30. */
@@ -161,49 +394,262 @@ static pid_t gettid(void) {
 }
 #endif
 
-/* Open the trace file */
+/* Open the trace file that kickstart created for the job and map its
+ * header. Records are only written once textend has claimed an extent. */
 static int topen() {
     debug("Open trace file");
 
-    char *kickstart_prefix = getenv("KICKSTART_PREFIX");
-    if (kickstart_prefix == NULL) {
+    char *filename = getenv("KICKSTART_PREFIX");
+    if (filename == NULL) {
         printerr("Unable to open trace file: KICKSTART_PREFIX not set in environment\n");
         return -1;
     }
 
-    char filename[BUFSIZ];
-    snprintf(filename, BUFSIZ, "%s.%d", kickstart_prefix, getpid());
+    trace = open_untraced(filename, O_RDWR|O_CLOEXEC, 0);
+    if (trace < 0) {
+        printerr("Unable to open trace file: %s\n", strerror(errno));
+        return -1;
+    }
 
-    trace = fopen_untraced(filename, "a");
-    if (trace == NULL) {
-        printerr("Unable to open trace file\n");
+    trace_header = mmap_untraced(NULL, sizeof(TraceFileHeader), PROT_READ|PROT_WRITE, MAP_SHARED, trace, 0);
+    if (trace_header == MAP_FAILED) {
+        printerr("Unable to map trace file: %s\n", strerror(errno));
+        trace_header = NULL;
+        close_untraced(trace);
+        trace = -1;
         return -1;
     }
 
+    if (trace_header->magic != TRACE_MAGIC || trace_header->version != TRACE_VERSION) {
+        printerr("Invalid trace file: %s\n", filename);
+        tdetach();
+        return -1;
+    }
+
+    trace_nstrings = 0;
+
     return 0;
 }
 
-/* Print something to the trace file if it is open */
-static int tprintf(const char *format, ...) {
-    if (trace == NULL) {
+/* Claim a new extent with room for at least size bytes of records and
+ * continue the stream of this process in it. Call with the trace locked. */
+static int textend(size_t size) {
+    if (trace_header == NULL) {
+        return -1;
+    }
+
+    /* Start small, since most processes write few records, and double
+     * the size of each extent after that */
+    size_t extent = trace_map == NULL ? TRACE_EXTENT : 2 * trace_size;
+    if (extent > TRACE_EXTENT_MAX) {
+        extent = TRACE_EXTENT_MAX;
+    }
+    size += sizeof(TraceExtent);
+    if (extent < size) {
+        extent = (size + TRACE_EXTENT - 1) / TRACE_EXTENT * TRACE_EXTENT;
+    }
+
+    uint64_t offset = __sync_fetch_and_add(&trace_header->end, extent);
+
+    /* Grow the file to cover the extent. Writing its last byte never
+     * shrinks the file, unlike ftruncate, which could cut off the extents
+     * that other processes claimed in the meantime. */
+    char zero = 0;
+    if (pwrite_untraced(trace, &zero, 1, offset + extent - 1) != 1) {
+        printerr("Unable to extend trace file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char *map = mmap_untraced(NULL, extent, PROT_READ|PROT_WRITE, MAP_SHARED, trace, offset);
+    if (map == MAP_FAILED) {
+        printerr("Unable to map trace file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    TraceExtent *e = (TraceExtent *)map;
+    e->pid = getpid();
+    e->size = extent;
+    e->used = sizeof(TraceExtent);
+    e->next = 0;
+    e->first = trace_map == NULL;
+    __sync_synchronize();
+    e->magic = TRACE_EXTENT_MAGIC;
+
+    if (trace_map != NULL) {
+        ((TraceExtent *)trace_map)->next = offset;
+        munmap_untraced(trace_map, trace_size);
+    }
+    trace_map = map;
+    trace_size = extent;
+
+    return 0;
+}
+
+/* Reserve a record at the end of the current extent. The record is not
+ * part of the trace until it is passed to tcommit. Call with the trace
+ * locked. */
+static void *treserve(uint16_t type, size_t size) {
+    if (trace_header == NULL) {
+        return NULL;
+    }
+
+    /* Keep records aligned */
+    size = (size + 7) & ~((size_t)7);
+
+    TraceExtent *e = (TraceExtent *)trace_map;
+    if (e == NULL || e->used + size > trace_size) {
+        if (textend(size) < 0) {
+            return NULL;
+        }
+        e = (TraceExtent *)trace_map;
+    }
+
+    TraceRecord *r = (TraceRecord *)(trace_map + e->used);
+    memset(r, 0, size);
+    r->type = type;
+    r->size = size;
+    return r;
+}
+
+/* Add a record returned by treserve to the trace */
+static void tcommit(void *record) {
+    TraceExtent *e = (TraceExtent *)trace_map;
+    e->used += ((TraceRecord *)record)->size;
+}
+
+/* Write a fixed-size record to the trace file if it is open. The header
+ * of the record is filled in here. */
+static void twrite(uint16_t type, void *record, size_t size) {
+    lock_trace();
+    TraceRecord *r = treserve(type, size);
+    if (r != NULL) {
+        memcpy(r + 1, (TraceRecord *)record + 1, size - sizeof(TraceRecord));
+        tcommit(r);
+    }
+    unlock_trace();
+}
+
+static uint32_t hash_string(const char *s) {
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    for (; *s != '\0'; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+/* Return the id of a string in the trace file, writing a TR_STRING
+ * record the first time the string is seen. Call with the trace locked. */
+static uint32_t tstring(const char *value) {
+    if (trace_header == NULL) {
         return 0;
     }
-    va_list args;
-    va_start(args, format);
-    int rc = vfprintf_untraced(trace, format, args);
-    va_end(args);
-    return rc;
+
+    /* Keep the table at most half full */
+    if (2 * (strtab_used + 1) > strtab_size) {
+        size_t newsize = strtab_size == 0 ? 256 : strtab_size * 2;
+        TraceEntry *newtab = (TraceEntry *)calloc(sizeof(TraceEntry), newsize);
+        if (newtab == NULL) {
+            printerr("Error allocating string table: calloc: %s\n", strerror(errno));
+            return TRACE_NOSTRING;
+        }
+        for (size_t i = 0; i < strtab_size; i++) {
+            if (strtab[i].value == NULL) {
+                continue;
+            }
+            size_t j = hash_string(strtab[i].value) & (newsize - 1);
+            while (newtab[j].value != NULL) {
+                j = (j + 1) & (newsize - 1);
+            }
+            newtab[j] = strtab[i];
+        }
+        free(strtab);
+        strtab = newtab;
+        strtab_size = newsize;
+    }
+
+    size_t i = hash_string(value) & (strtab_size - 1);
+    while (strtab[i].value != NULL) {
+        if (strcmp(strtab[i].value, value) == 0) {
+            return strtab[i].id;
+        }
+        i = (i + 1) & (strtab_size - 1);
+    }
+
+    char *temp = strdup(value);
+    if (temp == NULL) {
+        printerr("strdup: %s\n", strerror(errno));
+        return TRACE_NOSTRING;
+    }
+
+    size_t length = strlen(value);
+    TraceString *r = treserve(TR_STRING, sizeof(TraceString) + length + 1);
+    if (r == NULL) {
+        free(temp);
+        return TRACE_NOSTRING;
+    }
+    r->id = trace_nstrings++;
+    r->length = length;
+    memcpy(r->value, value, length + 1);
+    tcommit(r);
+
+    strtab[i].value = temp;
+    strtab[i].id = r->id;
+    strtab_used++;
+
+    return strtab[i].id;
+}
+
+/* Write a record that names a single string */
+static void tname(uint16_t type, const char *name) {
+    lock_trace();
+    TraceName r = { .name = tstring(name) };
+    twrite(type, &r, sizeof(r));
+    unlock_trace();
+}
+
+static void tfree_strings() {
+    for (size_t i = 0; i < strtab_size; i++) {
+        free(strtab[i].value);
+    }
+    free(strtab);
+    strtab = NULL;
+    strtab_size = 0;
+    strtab_used = 0;
+}
+
+/* Unmap the trace file without changing it. This is used in a forked
+ * child, which shares the mappings with its parent. */
+static void tdetach() {
+    if (trace_map != NULL) {
+        munmap_untraced(trace_map, trace_size);
+        trace_map = NULL;
+        trace_size = 0;
+    }
+    if (trace_header != NULL) {
+        munmap_untraced(trace_header, sizeof(TraceFileHeader));
+        trace_header = NULL;
+    }
+    if (trace >= 0) {
+        close_untraced(trace);
+        trace = -1;
+    }
+    tfree_strings();
 }
 
 /* Close trace file */
 static int tclose() {
-    if (trace == NULL) {
+    if (trace_header == NULL) {
         return 0;
     }
 
     debug("Close trace file");
 
-    return fclose_untraced(trace);
+    lock_trace();
+    tdetach();
+    unlock_trace();
+
+    return 0;
 }
 
 /* Get the current time in seconds since the epoch */
@@ -287,6 +733,10 @@ static void init_descriptors() {
     closedir(fddir);
 
 unlock:
+    /* Forget the start time if the file isn't traced */
+    if (meta_fd == -1) {
+        meta_start = 0;
+    }
     unlock_descriptors();
 }
 
@@ -354,6 +804,143 @@ static Descriptor *get_descriptor(int fd) {
     return &(descriptors[fd]);
 }
 
+/* Get the counters of the calling thread for fd */
+static Counters *get_counters(int fd) {
+    /* See get_descriptor */
+    if (descriptors == NULL || fd < 0) {
+        return NULL;
+    }
+
+    Shard *s = myshard;
+    if (s != NULL && fd < s->size) {
+        return &(s->counters[fd]);
+    }
+
+    lock_descriptors();
+
+    if (s == NULL) {
+        s = (Shard *)calloc(1, sizeof(Shard));
+        if (s == NULL) {
+            printerr("Error allocating counters for thread %d: calloc: %s\n",
+                     gettid(), strerror(errno));
+            unlock_descriptors();
+            return NULL;
+        }
+        s->next = shards;
+        shards = s;
+        myshard = s;
+    }
+
+    int newsize = s->size > 0 ? s->size : 256;
+    while (fd >= newsize) {
+        newsize = newsize * 2;
+    }
+
+    Counters *newcounters = realloc(s->counters, sizeof(Counters) * newsize);
+    if (newcounters == NULL) {
+        printerr("Error reallocating counters with %d entries: realloc: %s\n",
+                 newsize, strerror(errno));
+        /* This is a fatal error */
+        abort();
+    }
+    bzero(&(newcounters[s->size]), (newsize-s->size)*sizeof(Counters));
+    s->counters = newcounters;
+    s->size = newsize;
+
+    unlock_descriptors();
+
+    return &(s->counters[fd]);
+}
+
+/* Return the latency histograms of f, allocating them if necessary */
+/* Note: You must be holding the descriptor mutex when you call this */
+static Latency *descriptor_latency(Descriptor *f) {
+    if (f->latency == NULL) {
+        f->latency = (Latency *)calloc(1, sizeof(Latency));
+        if (f->latency == NULL) {
+            printerr("Error allocating latency histograms: calloc: %s\n", strerror(errno));
+        }
+    }
+    return f->latency;
+}
+
+/* Add the counters of every thread for fd to f and clear them */
+/* Note: You must be holding the descriptor mutex when you call this */
+static void collect_counters(int fd, Descriptor *f) {
+    for (Shard *s = shards; s != NULL; s = s->next) {
+        if (fd >= s->size) {
+            continue;
+        }
+        Counters *c = &(s->counters[fd]);
+        f->bread += c->bread;
+        f->bwrite += c->bwrite;
+        f->nread += c->nread;
+        f->nwrite += c->nwrite;
+        f->bseek += c->bseek;
+        f->nseek += c->nseek;
+        Latency *l = c->latency;
+        if (l != NULL) {
+            Latency *fl = descriptor_latency(f);
+            if (fl != NULL) {
+                for (int i=0; i<TRACE_BUCKETS; i++) {
+                    fl->read[i] += l->read[i];
+                    fl->write[i] += l->write[i];
+                }
+            }
+            bzero(l, sizeof(Latency));
+        }
+        bzero(c, sizeof(Counters));
+        c->latency = l;
+    }
+}
+
+/* Clear the counters of every thread for fd */
+/* Note: You must be holding the descriptor mutex when you call this */
+static void reset_counters(int fd) {
+    for (Shard *s = shards; s != NULL; s = s->next) {
+        if (fd < s->size) {
+            Latency *l = s->counters[fd].latency;
+            if (l != NULL) {
+                bzero(l, sizeof(Latency));
+            }
+            bzero(&(s->counters[fd]), sizeof(Counters));
+            s->counters[fd].latency = l;
+        }
+    }
+}
+
+/* Add the counters of the calling thread to the descriptor table */
+static void merge_thread_counters() {
+    Shard *s = myshard;
+    if (s == NULL) {
+        return;
+    }
+
+    lock_descriptors();
+
+    for (int fd = 0; fd < s->size; fd++) {
+        Descriptor *f = get_descriptor(fd);
+        if (f != NULL) {
+            collect_counters(fd, f);
+        }
+    }
+
+    /* Remove the table from the list */
+    Shard **p = &shards;
+    while (*p != s) {
+        p = &((*p)->next);
+    }
+    *p = s->next;
+    for (int fd = 0; fd < s->size; fd++) {
+        free(s->counters[fd].latency);
+    }
+    free(s->counters);
+    free(s);
+    myshard = NULL;
+
+    unlock_descriptors();
+}
+
 static void read_cmdline() {
     char cmdline[] = "/proc/self/cmdline";
 
@@ -417,7 +1004,7 @@ static void read_cmdline() {
                 result[j++] = args[i];
             }
         }
-        tprintf("cmd:%s\n", result);
+        tname(TR_CMD, result);
         free(result);
     }
 
@@ -438,7 +1025,7 @@ static void read_exe() {
         return;
     }
     exe[size] = '\0';
-    tprintf("exe: %s\n", exe);
+    tname(TR_EXE, exe);
 }
 
 /* Return 1 if line begins with tok */
@@ -463,16 +1050,19 @@ static void read_status() {
         return;
     }
 
+    TraceStatus r = {};
     char line[BUFSIZ];
     while (fgets_untraced(line, BUFSIZ, f) != NULL) {
         if (startswith(line,"VmPeak")) {
-            tprintf(line);
+            sscanf(line, "VmPeak:%d kB\n", &r.vmpeak);
         } else if (startswith(line,"VmHWM")) {
-            tprintf(line);
+            sscanf(line, "VmHWM:%d kB\n", &r.rsspeak);
         }
     }
 
     fclose_untraced(f);
+
+    twrite(TR_STATUS, &r, sizeof(r));
 }
 
 /* Read CPU usage */
@@ -482,8 +1072,11 @@ static void read_rusage() {
         printerr("Error getting resource usage: %s\n", strerror(errno));
         return;
     }
-    tprintf("utime: %.3lf\n", (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec/1.0e6);
-    tprintf("stime: %.3lf\n", (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec/1.0e6);
+    TraceRusage r = {
+        .utime = (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec/1.0e6,
+        .stime = (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec/1.0e6
+    };
+    twrite(TR_RUSAGE, &r, sizeof(r));
 }
 
 /* Read /proc/self/stat to get performance stats */
@@ -522,7 +1115,8 @@ static void read_stat() {
     long clocks = sysconf(_SC_CLK_TCK);
     double real_iowait = ((double)iowait) / clocks;
 
-    tprintf("iowait: %.3lf\n", real_iowait);
+    TraceIowait r = { .iowait = real_iowait };
+    twrite(TR_IOWAIT, &r, sizeof(r));
 }
 
 /* Read /proc/self/io to get I/O usage */
@@ -545,68 +1139,154 @@ static void read_io() {
         return;
     }
 
+    TraceIO r = {};
     char line[BUFSIZ];
     while (fgets_untraced(line, BUFSIZ, f) != NULL) {
         if (startswith(line, "rchar")) {
-            tprintf(line);
+            sscanf(line, "rchar: %"SCNu64"\n", &r.rchar);
         } else if (startswith(line, "wchar")) {
-            tprintf(line);
+            sscanf(line, "wchar: %"SCNu64"\n", &r.wchar);
         } else if (startswith(line,"syscr")) {
-            tprintf(line);
+            sscanf(line, "syscr: %"SCNu64"\n", &r.syscr);
         } else if (startswith(line,"syscw")) {
-            tprintf(line);
+            sscanf(line, "syscw: %"SCNu64"\n", &r.syscw);
         } else if (startswith(line,"read_bytes")) {
-            tprintf(line);
+            sscanf(line, "read_bytes: %"SCNu64"\n", &r.read_bytes);
         } else if (startswith(line,"write_bytes")) {
-            tprintf(line);
+            sscanf(line, "write_bytes: %"SCNu64"\n", &r.write_bytes);
         } else if (startswith(line,"cancelled_write_bytes")) {
-            tprintf(line);
+            sscanf(line, "cancelled_write_bytes: %"SCNu64"\n", &r.cancelled_write_bytes);
         }
     }
 
     fclose_untraced(f);
-}
 
-static int path_matches_patterns(const char *path, const char *patterns) {
-    char buf[BUFSIZ];
-    strncpy(buf, patterns, BUFSIZ);
+    twrite(TR_IO, &r, sizeof(r));
+}
 
-    char *sav;
-    char *token = strtok_r(buf, ":", &sav);
-    while (token != NULL) {
-        int result = fnmatch(token, path, 0);
+static int path_matches_patterns(const char *path) {
+    for (int i=0; i<policy.npatterns; i++) {
+        int result = fnmatch(policy.patterns[i], path, 0);
         if (result == 0) {
             return 1;
         } else if (result == FNM_NOMATCH) {
             /* No match, do nothing */
         } else {
-            printerr("fnmatch('%s', '%s', 0) failed: %s\n", token, path, strerror(errno));
+            printerr("fnmatch('%s', '%s', 0) failed: %s\n", policy.patterns[i], path, strerror(errno));
         }
-        token = strtok_r(NULL, ":", &sav);
     }
 
     return 0;
 }
 
+/* Remember the current working directory. Call with paths locked. */
+static void update_cwd() {
+    char *wd = getcwd(NULL, 0);
+    if (wd == NULL) {
+        printerr("getcwd: %s\n", strerror(errno));
+        return;
+    }
+    free(policy.cwd);
+    policy.cwd = wd;
+}
+
+/* Read the tracing policy from the environment. This is done once in
+ * interpose_init so that should_trace does not have to do it for every
+ * file that is opened. */
+static void init_policy() {
+    lock_paths();
+
+    free(policy.cwd);
+    free(policy.prefix);
+    free(policy.patternbuf);
+    free(policy.patterns);
+    memset(&policy, 0, sizeof(policy));
+
+    update_cwd();
+
+    char *prefix = getenv("KICKSTART_PREFIX");
+    if (prefix != NULL) {
+        policy.prefix = strdup(prefix);
+    }
+
+    policy.sample = 1;
+    char *sample = getenv("KICKSTART_TRACE_SAMPLE");
+    if (sample != NULL) {
+        policy.sample = atoi(sample);
+        if (policy.sample < 1) {
+            printerr("Invalid KICKSTART_TRACE_SAMPLE: %s\n", sample);
+            policy.sample = 1;
+        }
+    }
+
+    policy.timing = getenv("KICKSTART_TRACE_TIMING") != NULL;
+    policy.checksum = getenv("KICKSTART_TRACE_CHECKSUM") != NULL;
+
+    char *patterns = NULL;
+    if (getenv("KICKSTART_TRACE_ALL") != NULL) {
+        policy.mode = POLICY_ALL;
+    } else if (getenv("KICKSTART_TRACE_CWD") != NULL) {
+        policy.mode = POLICY_CWD;
+    } else if ((patterns = getenv("KICKSTART_TRACE_IGNORE")) != NULL) {
+        policy.mode = POLICY_IGNORE;
+    } else if ((patterns = getenv("KICKSTART_TRACE_MATCH")) != NULL) {
+        policy.mode = POLICY_MATCH;
+    } else {
+        policy.mode = POLICY_DEFAULT;
+    }
+
+    /* Split the list of patterns */
+    if (patterns != NULL) {
+        policy.patternbuf = strdup(patterns);
+        int max = 1;
+        for (char *c = patterns; *c != '\0'; c++) {
+            if (*c == ':') {
+                max++;
+            }
+        }
+        policy.patterns = (char **)calloc(sizeof(char *), max);
+        if (policy.patternbuf == NULL || policy.patterns == NULL) {
+            printerr("Error allocating trace patterns: %s\n", strerror(errno));
+            abort();
+        }
+
+        char *sav;
+        char *token = strtok_r(policy.patternbuf, ":", &sav);
+        while (token != NULL) {
+            policy.patterns[policy.npatterns++] = token;
+            token = strtok_r(NULL, ":", &sav);
+        }
+    }
+
+    /* Forget resolved directories from before exec */
+    for (int i=0; i<DIRCACHE_SIZE; i++) {
+        free(dircache[i].dir);
+        free(dircache[i].resolved);
+        dircache[i].dir = NULL;
+        dircache[i].resolved = NULL;
+    }
+
+    unlock_paths();
+}
+
 /* Determine which paths should be traced */
 static int should_trace(int fd, const char *path) {
     /* Trace all files */
-    if (getenv("KICKSTART_TRACE_ALL") != NULL) {
+    if (policy.mode == POLICY_ALL) {
         return 1;
     }
 
     /* Only trace files in the current working directory */
-    if (getenv("KICKSTART_TRACE_CWD") != NULL) {
-        char *wd = getcwd(NULL, 0);
-        int incwd = startswith(path, wd);
-        free(wd);
+    if (policy.mode == POLICY_CWD) {
+        lock_paths();
+        int incwd = policy.cwd != NULL && startswith(path, policy.cwd);
+        unlock_paths();
         return incwd;
     }
 
     /* Ignore a list of patterns */
-    char *ignore = getenv("KICKSTART_TRACE_IGNORE");
-    if (ignore != NULL) {
-        if (path_matches_patterns(path, ignore)) {
+    if (policy.mode == POLICY_IGNORE) {
+        if (path_matches_patterns(path)) {
             return 0;
         } else {
             return 1;
@@ -614,9 +1294,8 @@ static int should_trace(int fd, const char *path) {
     }
 
     /* Match a list of patterns */
-    char *match = getenv("KICKSTART_TRACE_MATCH");
-    if (match != NULL) {
-        if (path_matches_patterns(path, match)) {
+    if (policy.mode == POLICY_MATCH) {
+        if (path_matches_patterns(path)) {
             return 1;
         } else {
             return 0;
@@ -629,8 +1308,7 @@ static int should_trace(int fd, const char *path) {
     }
 
     /* Don't trace the trace log! */
-    char *prefix = getenv("KICKSTART_PREFIX");
-    if (startswith(path, prefix)) {
+    if (policy.prefix != NULL && startswith(path, policy.prefix)) {
         return 0;
     }
 
@@ -647,6 +1325,299 @@ static int should_trace(int fd, const char *path) {
     return 1;
 }
 
+/* Return the resolved path of a directory, using the cache if possible.
+ * The result must be freed. */
+static char *resolve_dir(const char *dir) {
+    lock_paths();
+
+    DirCacheEntry *e = &dircache[hash_string(dir) % DIRCACHE_SIZE];
+    if (e->dir != NULL && strcmp(e->dir, dir) == 0) {
+        char *resolved = strdup(e->resolved);
+        unlock_paths();
+        return resolved;
+    }
+
+    char *resolved = realpath(dir, NULL);
+    if (resolved != NULL) {
+        char *d = strdup(dir);
+        char *r = strdup(resolved);
+        if (d != NULL && r != NULL) {
+            free(e->dir);
+            free(e->resolved);
+            e->dir = d;
+            e->resolved = r;
+        } else {
+            free(d);
+            free(r);
+        }
+    }
+
+    unlock_paths();
+
+    return resolved;
+}
+
+/* Like realpath, but the directories in path are only resolved the first
+ * time they are seen. After that, resolving a file only takes one lstat to
+ * check that it is not a symlink. The result must be freed. */
+static char *resolve_path(const char *path) {
+    char buf[BUFSIZ];
+
+    /* Make relative paths absolute */
+    if (path[0] != '/') {
+        lock_paths();
+        if (policy.cwd == NULL) {
+            unlock_paths();
+            return realpath(path, NULL);
+        }
+        int len = snprintf(buf, BUFSIZ, "%s/%s", policy.cwd, path);
+        unlock_paths();
+        if (len >= BUFSIZ) {
+            return realpath(path, NULL);
+        }
+        path = buf;
+    }
+
+    const char *slash = strrchr(path, '/');
+    const char *base = slash + 1;
+    if (*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        return realpath(path, NULL);
+    }
+
+    char dir[BUFSIZ];
+    size_t dirlen = slash == path ? 1 : slash - path;
+    if (dirlen >= BUFSIZ) {
+        return realpath(path, NULL);
+    }
+    memcpy(dir, path, dirlen);
+    dir[dirlen] = '\0';
+
+    char *resolved = resolve_dir(dir);
+    if (resolved == NULL) {
+        return realpath(path, NULL);
+    }
+
+    size_t rlen = strlen(resolved);
+    char *fullpath = (char *)malloc(rlen + strlen(base) + 2);
+    if (fullpath == NULL) {
+        free(resolved);
+        return NULL;
+    }
+    strcpy(fullpath, resolved);
+    if (rlen > 1) {
+        fullpath[rlen++] = '/';
+    }
+    strcpy(fullpath + rlen, base);
+    free(resolved);
+
+    /* If the file itself is a symlink, then resolve it the slow way */
+    struct stat st;
+    if (lstat(fullpath, &st) != 0 || S_ISLNK(st.st_mode)) {
+        free(fullpath);
+        return realpath(path, NULL);
+    }
+
+    return fullpath;
+}
+
+/* Return 1 if this read, write or seek should be counted. When
+ * KICKSTART_TRACE_SAMPLE is N, each thread counts one call in N on
+ * average, and the counted calls are scaled by N. The number of calls to
+ * skip is random so that the samples don't line up with a regular
+ * pattern of calls, such as a read followed by a write. */
+static inline int sample_call() {
+    if (policy.sample == 1) {
+        return 1;
+    }
+
+    if (sample_skip > 0) {
+        sample_skip--;
+        return 0;
+    }
+
+    /* xorshift32 */
+    uint32_t x = sample_state;
+    if (x == 0) {
+        x = (uint32_t)gettid() * 2654435761u + 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sample_state = x;
+
+    /* Skip between 0 and 2N-2 calls, N-1 on average */
+    sample_skip = x % (2 * policy.sample - 1);
+
+    return 1;
+}
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Return the histogram bucket for a call that took ns nanoseconds */
+static inline int latency_bucket(uint64_t ns) {
+    int b = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    return b < TRACE_BUCKETS ? b : TRACE_BUCKETS - 1;
+}
+
+/* Called before each read or write call. This decides whether the call
+ * is sampled, so that unsampled calls are not timed either. */
+static inline void io_begin() {
+    io_sampled = sample_call();
+    if (io_sampled && policy.timing) {
+        io_start = now_ns();
+    }
+}
+
+/* Return the latency histograms for counters c, allocating them if
+ * necessary. Only the thread that owns c may call this. */
+static Latency *counters_latency(Counters *c) {
+    if (c->latency == NULL) {
+        c->latency = (Latency *)calloc(1, sizeof(Latency));
+    }
+    return c->latency;
+}
+
+/* Called before each open or close call. fd is the descriptor being
+ * closed, or -1 for an open. */
+static inline void meta_begin(int fd) {
+    if (policy.timing) {
+        meta_start = now_ns();
+        meta_fd = fd;
+    }
+}
+
+/* Add the time taken by the open or close of fd, if it was timed, to the
+ * histograms of f */
+/* Note: You must be holding the descriptor mutex when you call this */
+static void meta_end(int fd, Descriptor *f) {
+    if (meta_start == 0 || meta_fd != fd) {
+        return;
+    }
+    uint64_t elapsed = now_ns() - meta_start;
+    meta_start = 0;
+    Latency *l = descriptor_latency(f);
+    if (l != NULL) {
+        l->meta[latency_bucket(elapsed)]++;
+    }
+}
+
+/* Stop computing the checksum of f. kickstart will read the file back
+ * instead. */
+/* Note: You must be holding the descriptor mutex when you call this */
+static void reset_hash(Descriptor *f) {
+    free(f->hash);
+    f->hash = NULL;
+    f->hashed = 0;
+    f->has_writer = 0;
+}
+
+/* With KICKSTART_TRACE_CHECKSUM, start computing the checksum of the data
+ * written to fd if it is a regular file that is open for writing and still
+ * empty, so that kickstart does not have to read it back to checksum it. */
+/* Note: You must be holding the descriptor mutex when you call this */
+static void start_hash(int fd, Descriptor *f) {
+    reset_hash(f);
+
+    if (!policy.checksum) {
+        return;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || (flags & O_ACCMODE) == O_RDONLY) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size != 0) {
+        return;
+    }
+
+    f->hash = (sha256_ctx *)malloc(sizeof(sha256_ctx));
+    if (f->hash == NULL) {
+        printerr("Error allocating checksum: malloc: %s\n", strerror(errno));
+        return;
+    }
+    sha256_begin(f->hash);
+}
+
+/* Add len bytes written to fd from iov to the checksum of fd. offset is
+ * where they were written, or -1 if they were written at the current
+ * position. The checksum is only kept while the file is written
+ * sequentially by one thread. Data written out of order, by another
+ * thread, or by a call that doesn't give us the data (iov is NULL) stops
+ * it. Writes that are not seen at all, for example through mmap or
+ * another descriptor, are caught when the file is closed because its
+ * size no longer matches. */
+static void hash_iov(int fd, const struct iovec *iov, int iovcnt, size_t len, off_t offset) {
+    if (!policy.checksum) {
+        return;
+    }
+
+    lock_descriptors();
+
+    Descriptor *f = get_descriptor(fd);
+    if (f == NULL || f->hash == NULL) {
+        goto unlock;
+    }
+
+    pthread_t self = pthread_self();
+    if (!f->has_writer) {
+        f->writer = self;
+        f->has_writer = 1;
+    }
+
+    if (iov == NULL || !pthread_equal(f->writer, self) ||
+            (offset != -1 && (uint64_t)offset != f->hashed)) {
+        reset_hash(f);
+        goto unlock;
+    }
+
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        size_t n = iov[i].iov_len < len ? iov[i].iov_len : len;
+        sha256_hash_fast((const unsigned char *)iov[i].iov_base, n, f->hash);
+        f->hashed += n;
+        len -= n;
+    }
+
+unlock:
+    unlock_descriptors();
+}
+
+static void hash_write(int fd, const void *buf, size_t len, off_t offset) {
+    if (!policy.checksum) {
+        return;
+    }
+
+    if (buf == NULL) {
+        hash_iov(fd, NULL, 0, len, offset);
+    } else {
+        struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+        hash_iov(fd, &iov, 1, len, offset);
+    }
+}
+
+/* The position of fd was changed to pos, or to an unknown position if pos
+ * is -1. Moving anywhere but the end of the data written so far stops the
+ * checksum. */
+static void hash_seek(int fd, off_t pos) {
+    if (!policy.checksum) {
+        return;
+    }
+
+    lock_descriptors();
+
+    Descriptor *f = get_descriptor(fd);
+    if (f != NULL && f->hash != NULL && (pos < 0 || (uint64_t)pos != f->hashed)) {
+        reset_hash(f);
+    }
+
+    unlock_descriptors();
+}
+
 static void trace_file(const char *path, int fd) {
     debug("trace_file %s %d", path, fd);
 
@@ -669,12 +1640,17 @@ static void trace_file(const char *path, int fd) {
 
     f->type = DTYPE_FILE;
     f->path = temp;
+    reset_counters(fd);
     f->bread = 0;
     f->bwrite = 0;
     f->nread = 0;
     f->nwrite = 0;
     f->bseek = 0;
     f->nseek = 0;
+    f->nuring = 0;
+    f->buring = 0;
+    start_hash(fd, f);
+    meta_end(-1, f);
 
 unlock:
     unlock_descriptors();
@@ -683,7 +1659,7 @@ unlock:
 static void trace_open(const char *path, int fd) {
     debug("trace_open %s %d", path, fd);
 
-    char *fullpath = realpath(path, NULL);
+    char *fullpath = resolve_path(path);
     if (fullpath == NULL) {
         printerr("Unable to get real path for '%s': %s\n",
                  path, strerror(errno));
@@ -722,49 +1698,58 @@ static void trace_openat(int fd) {
 static void trace_read(int fd, ssize_t amount) {
     debug("trace_read %d %lu", fd, amount);
 
-    lock_descriptors();
-
-    Descriptor *f = get_descriptor(fd);
-    if (f == NULL) {
-        goto unlock;
+    if (!io_sampled) {
+        return;
     }
-    f->bread += amount;
-    f->nread += 1;
 
-unlock:
-    unlock_descriptors();
+    Counters *c = get_counters(fd);
+    if (c == NULL) {
+        return;
+    }
+    if (policy.timing) {
+        Latency *l = counters_latency(c);
+        if (l != NULL) {
+            l->read[latency_bucket(now_ns() - io_start)]++;
+        }
+    }
+    c->bread += amount * policy.sample;
+    c->nread += policy.sample;
 }
 
 static void trace_write(int fd, ssize_t amount) {
     debug("trace_write %d %lu", fd, amount);
 
-    lock_descriptors();
-
-    Descriptor *f = get_descriptor(fd);
-    if (f == NULL) {
-        goto unlock;
+    if (!io_sampled) {
+        return;
     }
-    f->bwrite += amount;
-    f->nwrite += 1;
 
-unlock:
-    unlock_descriptors();
+    Counters *c = get_counters(fd);
+    if (c == NULL) {
+        return;
+    }
+    if (policy.timing) {
+        Latency *l = counters_latency(c);
+        if (l != NULL) {
+            l->write[latency_bucket(now_ns() - io_start)]++;
+        }
+    }
+    c->bwrite += amount * policy.sample;
+    c->nwrite += policy.sample;
 }
 
 static void trace_seek(int fd, off_t offset) {
     debug("trace_seek %d %ld", fd, offset);
 
-    lock_descriptors();
-
-    Descriptor *f = get_descriptor(fd);
-    if (f == NULL) {
-        goto unlock;
+    if (!sample_call()) {
+        return;
     }
-    f->bseek += offset > 0 ? offset : -offset;
-    f->nseek += 1;
 
-unlock:
-    unlock_descriptors();
+    Counters *c = get_counters(fd);
+    if (c == NULL) {
+        return;
+    }
+    c->bseek += (offset > 0 ? offset : -offset) * policy.sample;
+    c->nseek += policy.sample;
 }
 
 static void trace_close(int fd) {
@@ -782,23 +1767,83 @@ static void trace_close(int fd) {
 
     debug("trace_close %d", fd);
 
-    /* Only report files that have ops on them */
-    if (f->type == DTYPE_FILE && (f->nread+f->nwrite+f->nseek) > 0) {
+    collect_counters(fd, f);
+    meta_end(fd, f);
+
+    /* Only report files that have ops on them. When calls are sampled,
+     * a file may have ops that weren't counted, so report all of them. */
+    if (f->type == DTYPE_FILE && ((f->nread+f->nwrite+f->nseek+f->nuring) > 0 || policy.sample > 1)) {
         /* Try to get the final size of the file */
         size_t size = 0;
         struct stat st;
-        if (stat(f->path, &st) == 0) {
+        int have_stat = stat(f->path, &st) == 0;
+        if (have_stat) {
             size = st.st_size;
         }
 
-        tprintf("file: '%s' %lu %lu %lu %lu %lu %lu %lu\n",
-                f->path, size, f->bread, f->bwrite, f->nread, f->nwrite, f->bseek, f->nseek);
+        lock_trace();
+        TraceFile r = {
+            .path = tstring(f->path),
+            .size = size,
+            .bread = f->bread,
+            .bwrite = f->bwrite,
+            .nread = f->nread,
+            .nwrite = f->nwrite,
+            .bseek = f->bseek,
+            .nseek = f->nseek
+        };
+        twrite(TR_FILE, &r, sizeof(r));
+        if (f->latency != NULL) {
+            TraceLatency lr = { .path = r.path };
+            memcpy(lr.read, f->latency->read, sizeof(lr.read));
+            memcpy(lr.write, f->latency->write, sizeof(lr.write));
+            memcpy(lr.meta, f->latency->meta, sizeof(lr.meta));
+            twrite(TR_LATENCY, &lr, sizeof(lr));
+        }
+        if (f->nuring > 0) {
+            TraceUring ur = {
+                .path = r.path,
+                .nsubmit = f->nuring,
+                .bsubmit = f->buring
+            };
+            twrite(TR_URING, &ur, sizeof(ur));
+        }
+        /* If the file is bigger, then some writes weren't seen */
+        if (f->hash != NULL && have_stat && (uint64_t)st.st_size == f->hashed) {
+            TraceDigest dr = {
+                .path = r.path,
+                .size = st.st_size,
+                .mtime_sec = st.st_mtim.tv_sec,
+                .mtime_nsec = st.st_mtim.tv_nsec
+            };
+            sha256_end(dr.sha256, f->hash);
+            twrite(TR_DIGEST, &dr, sizeof(dr));
+        }
+        unlock_trace();
     } else if (f->type == DTYPE_SOCK) {
-        tprintf("socket: %s %lu %lu %lu %lu\n", f->path, f->bread, f->bwrite, f->nread, f->nwrite);
+        /* The path of a socket is "address port" */
+        char address[128];
+        int port = 0;
+        if (sscanf(f->path, "%127s %d", address, &port) == 2) {
+            lock_trace();
+            TraceSocket r = {
+                .address = tstring(address),
+                .port = port,
+                .brecv = f->bread,
+                .bsend = f->bwrite,
+                .nrecv = f->nread,
+                .nsend = f->nwrite
+            };
+            twrite(TR_SOCKET, &r, sizeof(r));
+            unlock_trace();
+        }
     }
 
     /* Reset the entry */
     free(f->path);
+    free(f->latency);
+    f->latency = NULL;
+    reset_hash(f);
     f->type = DTYPE_NONE;
     f->path = NULL;
     f->bread = 0;
@@ -807,8 +1852,13 @@ static void trace_close(int fd) {
     f->nwrite = 0;
     f->bseek = 0;
     f->nseek = 0;
+    f->nuring = 0;
+    f->buring = 0;
 
 unlock:
+    if (meta_fd == fd) {
+        meta_start = 0;
+    }
     unlock_descriptors();
 }
 
@@ -840,6 +1890,7 @@ static void trace_sock(int sockfd, const struct sockaddr *addr, socklen_t addrle
         /* Reset the descriptor */
         d->type = DTYPE_NONE;
         d->path = NULL;
+        reset_counters(sockfd);
         d->bread = 0;
         d->bwrite = 0;
         d->nread = 0;
@@ -853,88 +1904,493 @@ static void trace_sock(int sockfd, const struct sockaddr *addr, socklen_t addrle
             goto unlock;
         }
 
-        d->type = DTYPE_SOCK;
-        d->path = temp;
+        d->type = DTYPE_SOCK;
+        d->path = temp;
+    }
+
+unlock:
+    unlock_descriptors();
+}
+
+static void trace_dup(int oldfd, int newfd) {
+    debug("trace_dup %d %d", oldfd, newfd);
+
+    if (oldfd == newfd) {
+        printerr("trace_dup: duplicating the same fd %d\n", oldfd);
+        return;
+    }
+
+    lock_descriptors();
+
+    /* XXX Be careful in this function. Calling get_descriptor with
+     * two different file descriptors can cause problems because
+     * the second get_descriptor can invalidate the pointer returned by
+     * the first! To avoid that, ensure that the descriptor table is
+     * large enough to contain both descriptors first.
+     */
+    ensure_descriptor(newfd);
+    ensure_descriptor(oldfd);
+
+    Descriptor *o = get_descriptor(oldfd);
+    if (o == NULL) {
+        goto unlock;
+    }
+
+    /* Not a descriptor we are tracing */
+    if (o->path == NULL) {
+        goto unlock;
+    }
+
+    /* Just in case newfd is already open */
+    trace_close(newfd);
+
+    char *temp = strdup(o->path);
+    if (temp == NULL) {
+        printerr("strdup: %s\n", strerror(errno));
+        goto unlock;
+    }
+
+    /* Copy the old descriptor into the new */
+    Descriptor *n = get_descriptor(newfd);
+    if (n == NULL) {
+        goto unlock;
+    }
+    n->type = o->type;
+    n->path = temp;
+    reset_counters(newfd);
+    n->bread = 0;
+    n->bwrite = 0;
+    n->nread = 0;
+    n->nwrite = 0;
+    n->bseek = 0;
+    n->nseek = 0;
+    n->nuring = 0;
+    n->buring = 0;
+
+unlock:
+    unlock_descriptors();
+}
+
+static void trace_truncate(const char *path, off_t length) {
+    debug("trace_truncate %s %lu", path, length);
+
+    char *fullpath = realpath(path, NULL);
+    if (fullpath == NULL) {
+        printerr("Unable to get real path for '%s': %s\n",
+                 path, strerror(errno));
+        return;
+    }
+
+    lock_trace();
+    TraceFile r = {
+        .path = tstring(fullpath),
+        .size = length
+    };
+    twrite(TR_FILE, &r, sizeof(r));
+    unlock_trace();
+
+    free(fullpath);
+}
+
+/* Round length up to a whole number of pages */
+static size_t page_round(size_t length) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    return (length + pagesize - 1) / pagesize * pagesize;
+}
+
+/* Return the number of bytes in the pages of [start, start+length) that
+ * are resident in memory. For a mapped file this is an estimate of what
+ * was read through the mapping: the pages may have been in the page cache
+ * before, and pages that were read and then evicted are missed. */
+static size_t resident_bytes(char *start, size_t length) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    unsigned char vec[1024];
+    size_t resident = 0;
+
+    while (length > 0) {
+        size_t chunk = sizeof(vec) * pagesize;
+        if (chunk > length) {
+            chunk = length;
+        }
+        if (mincore(start, chunk, vec) != 0) {
+            break;
+        }
+        for (size_t i = 0; i < (chunk + pagesize - 1) / pagesize; i++) {
+            if (vec[i] & 1) {
+                resident += pagesize;
+            }
+        }
+        start += chunk;
+        length -= chunk;
+    }
+
+    return resident;
+}
+
+/* Return the totals of the mapped file path, adding them if necessary */
+/* Note: You must be holding the mapping mutex when you call this */
+static MappedFile *get_mapped_file(const char *path) {
+    MappedFile *file;
+    for (file = mapped_files; file != NULL; file = file->next) {
+        if (strcmp(file->path, path) == 0) {
+            return file;
+        }
+    }
+
+    file = (MappedFile *)calloc(1, sizeof(MappedFile));
+    if (file == NULL) {
+        printerr("Error allocating mapped file: calloc: %s\n", strerror(errno));
+        return NULL;
+    }
+    file->path = strdup(path);
+    if (file->path == NULL) {
+        printerr("strdup: %s\n", strerror(errno));
+        free(file);
+        return NULL;
+    }
+    file->next = mapped_files;
+    mapped_files = file;
+    return file;
+}
+
+#ifdef HAS_IO_URING
+/* Note: You must be holding the mapping mutex when you call this */
+static Ring *get_ring(int fd) {
+    for (Ring *r = rings; r != NULL; r = r->next) {
+        if (r->fd == fd) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* Note: You must be holding the mapping mutex when you call this */
+static void forget_ring(Ring *ring) {
+    Ring **p = &rings;
+    while (*p != ring) {
+        p = &((*p)->next);
+    }
+    *p = ring->next;
+    free(ring);
+    tracked_maps--;
+}
+
+/* A ring was set up with io_uring_setup. Its submission queue is found
+ * when the application maps it. */
+static void trace_uring_setup(int fd, const struct io_uring_params *params) {
+    debug("trace_uring_setup %d", fd);
+
+    /* With a polling thread the kernel takes requests from the queue
+     * without io_uring_enter, so they can't be counted */
+    if (params->flags & IORING_SETUP_SQPOLL) {
+        return;
+    }
+
+    lock_mappings();
+
+    /* The descriptor of an old ring that was closed without unmapping
+     * its queue may have been reused */
+    Ring *ring = get_ring(fd);
+    if (ring != NULL) {
+        forget_ring(ring);
+    }
+
+    ring = (Ring *)calloc(1, sizeof(Ring));
+    if (ring == NULL) {
+        printerr("Error allocating ring: calloc: %s\n", strerror(errno));
+        goto unlock;
     }
+    ring->fd = fd;
+    ring->flags = params->flags;
+    ring->sq_off = params->sq_off;
+    ring->next = rings;
+    rings = ring;
+    tracked_maps++;
 
 unlock:
-    unlock_descriptors();
+    unlock_mappings();
+}
+
+/* Return the number of bytes that a read or write request asks for */
+static size_t uring_bytes(const struct io_uring_sqe *sqe) {
+    switch (sqe->opcode) {
+        case IORING_OP_READ:
+        case IORING_OP_WRITE:
+        case IORING_OP_READ_FIXED:
+        case IORING_OP_WRITE_FIXED:
+            return sqe->len;
+        case IORING_OP_READV:
+        case IORING_OP_WRITEV: {
+            const struct iovec *iov = (const struct iovec *)(uintptr_t)sqe->addr;
+            size_t total = 0;
+            for (unsigned i = 0; i < sqe->len; i++) {
+                total += iov[i].iov_len;
+            }
+            return total;
+        }
+    }
+    return 0;
 }
 
-static void trace_dup(int oldfd, int newfd) {
-    debug("trace_dup %d %d", oldfd, newfd);
+/* Count the requests that io_uring_enter is about to submit from the
+ * ring of fd against the files they use. Requests on registered files
+ * (IOSQE_FIXED_FILE) are not counted, because their descriptors are not
+ * in the request. */
+static void trace_uring_enter(int fd, unsigned to_submit) {
+    debug("trace_uring_enter %d %u", fd, to_submit);
 
-    if (oldfd == newfd) {
-        printerr("trace_dup: duplicating the same fd %d\n", oldfd);
+    if (to_submit == 0 || tracked_maps == 0) {
         return;
     }
 
-    lock_descriptors();
-
-    /* XXX Be careful in this function. Calling get_descriptor with
-     * two different file descriptors can cause problems because
-     * the second get_descriptor can invalidate the pointer returned by
-     * the first! To avoid that, ensure that the descriptor table is
-     * large enough to contain both descriptors first.
-     */
-    ensure_descriptor(newfd);
-    ensure_descriptor(oldfd);
+    lock_mappings();
 
-    Descriptor *o = get_descriptor(oldfd);
-    if (o == NULL) {
+    Ring *ring = get_ring(fd);
+    if (ring == NULL || ring->sq == NULL || ring->sqes == NULL) {
         goto unlock;
     }
 
-    /* Not a descriptor we are tracing */
-    if (o->path == NULL) {
+    const struct io_sqring_offsets *off = &(ring->sq_off);
+    unsigned head = __atomic_load_n((unsigned *)(ring->sq + off->head), __ATOMIC_ACQUIRE);
+    unsigned tail = __atomic_load_n((unsigned *)(ring->sq + off->tail), __ATOMIC_ACQUIRE);
+    unsigned mask = *(unsigned *)(ring->sq + off->ring_mask);
+    unsigned *array = (unsigned *)(ring->sq + off->array);
+    if (off->array + (mask + (size_t)1) * sizeof(unsigned) > ring->sq_length) {
         goto unlock;
     }
 
-    /* Just in case newfd is already open */
-    trace_close(newfd);
+    size_t sqe_size = sizeof(struct io_uring_sqe);
+#ifdef IORING_SETUP_SQE128
+    if (ring->flags & IORING_SETUP_SQE128) {
+        sqe_size *= 2;
+    }
+#endif
 
-    char *temp = strdup(o->path);
-    if (temp == NULL) {
-        printerr("strdup: %s\n", strerror(errno));
+    unsigned n = tail - head;
+    if (n > to_submit) {
+        n = to_submit;
+    }
+
+    lock_descriptors();
+    for (unsigned i = 0; i < n; i++) {
+        unsigned index = array[(head + i) & mask];
+        if ((index + (size_t)1) * sqe_size > ring->sqes_length) {
+            continue;
+        }
+        const struct io_uring_sqe *sqe = (const struct io_uring_sqe *)(ring->sqes + index * sqe_size);
+        if (sqe->flags & IOSQE_FIXED_FILE) {
+            continue;
+        }
+        Descriptor *f = get_descriptor(sqe->fd);
+        if (f == NULL || f->type != DTYPE_FILE) {
+            continue;
+        }
+        f->nuring++;
+        f->buring += uring_bytes(sqe);
+    }
+    unlock_descriptors();
+
+unlock:
+    unlock_mappings();
+}
+#endif
+
+/* The application mapped length bytes of fd at addr */
+static void trace_mmap(void *addr, size_t length, int fd, off_t offset) {
+    debug("trace_mmap %p %lu %d", addr, length, fd);
+
+    lock_mappings();
+
+#ifdef HAS_IO_URING
+    Ring *ring = get_ring(fd);
+    if (ring != NULL) {
+        if (offset == IORING_OFF_SQ_RING) {
+            ring->sq = addr;
+            ring->sq_length = length;
+        } else if (offset == IORING_OFF_SQES) {
+            ring->sqes = addr;
+            ring->sqes_length = length;
+        }
         goto unlock;
     }
+#endif
 
-    /* Copy the old descriptor into the new */
-    Descriptor *n = get_descriptor(newfd);
-    if (n == NULL) {
+    MappedFile *file = NULL;
+    lock_descriptors();
+    Descriptor *f = get_descriptor(fd);
+    if (f != NULL && f->type == DTYPE_FILE) {
+        file = get_mapped_file(f->path);
+    }
+    unlock_descriptors();
+    if (file == NULL) {
         goto unlock;
     }
-    n->type = o->type;
-    n->path = temp;
-    n->bread = 0;
-    n->bwrite = 0;
-    n->nread = 0;
-    n->nwrite = 0;
-    n->bseek = 0;
-    n->nseek = 0;
+
+    Mapping *m = (Mapping *)calloc(1, sizeof(Mapping));
+    if (m == NULL) {
+        printerr("Error allocating mapping: calloc: %s\n", strerror(errno));
+        goto unlock;
+    }
+    m->start = addr;
+    m->length = page_round(length);
+    m->file = file;
+    m->next = mappings;
+    mappings = m;
+    tracked_maps++;
+
+    file->nmmap++;
+    file->bmmap += length;
 
 unlock:
-    unlock_descriptors();
+    unlock_mappings();
 }
 
-static void trace_truncate(const char *path, off_t length) {
-    debug("trace_truncate %s %lu", path, length);
-
-    char *fullpath = realpath(path, NULL);
-    if (fullpath == NULL) {
-        printerr("Unable to get real path for '%s': %s\n",
-                 path, strerror(errno));
+/* The application is about to unmap [addr, addr+length). The resident
+ * pages of the mappings in that range are added to their files, and the
+ * mappings are trimmed, split or removed. */
+static void trace_munmap(void *addr, size_t length) {
+    if (tracked_maps == 0) {
         return;
     }
 
-    tprintf("file: '%s' %lu 0 0 0 0\n", fullpath, length);
+    debug("trace_munmap %p %lu", addr, length);
 
-    free(fullpath);
+    char *lo = (char *)addr;
+    char *hi = lo + page_round(length);
+
+    lock_mappings();
+
+#ifdef HAS_IO_URING
+    Ring *ring = rings;
+    while (ring != NULL) {
+        Ring *next = ring->next;
+        if ((ring->sq != NULL && ring->sq < hi && ring->sq + ring->sq_length > lo) ||
+                (ring->sqes != NULL && ring->sqes < hi && ring->sqes + ring->sqes_length > lo)) {
+            forget_ring(ring);
+        }
+        ring = next;
+    }
+#endif
+
+    Mapping **p = &mappings;
+    while (*p != NULL) {
+        Mapping *m = *p;
+        char *end = m->start + m->length;
+        if (end <= lo || m->start >= hi) {
+            p = &(m->next);
+            continue;
+        }
+
+        char *from = m->start > lo ? m->start : lo;
+        char *to = end < hi ? end : hi;
+        m->file->bfault += resident_bytes(from, to - from);
+
+        if (m->start < from && to < end) {
+            /* A hole in the middle leaves two mappings */
+            Mapping *rest = (Mapping *)calloc(1, sizeof(Mapping));
+            if (rest != NULL) {
+                rest->start = to;
+                rest->length = end - to;
+                rest->file = m->file;
+                rest->next = m->next;
+                m->next = rest;
+                tracked_maps++;
+            }
+            m->length = from - m->start;
+            p = &(m->next);
+        } else if (m->start < from) {
+            m->length = from - m->start;
+            p = &(m->next);
+        } else if (to < end) {
+            m->start = to;
+            m->length = end - to;
+            p = &(m->next);
+        } else {
+            *p = m->next;
+            free(m);
+            tracked_maps--;
+        }
+    }
+
+    unlock_mappings();
+}
+
+/* Free the mappings, mapped files and rings */
+/* Note: You must be holding the mapping mutex when you call this */
+static void free_mappings() {
+    while (mappings != NULL) {
+        Mapping *m = mappings;
+        mappings = m->next;
+        free(m);
+    }
+    while (mapped_files != NULL) {
+        MappedFile *file = mapped_files;
+        mapped_files = file->next;
+        free(file->path);
+        free(file);
+    }
+#ifdef HAS_IO_URING
+    while (rings != NULL) {
+        Ring *r = rings;
+        rings = r->next;
+        free(r);
+    }
+#endif
+    tracked_maps = 0;
+}
+
+/* Add the resident pages of the mappings that are still there to their
+ * files and write the totals of each mapped file. This is called when
+ * the process exits or calls exec, so the tables are cleared. */
+static void report_mappings() {
+    lock_mappings();
+
+    for (Mapping *m = mappings; m != NULL; m = m->next) {
+        m->file->bfault += resident_bytes(m->start, m->length);
+    }
+
+    for (MappedFile *file = mapped_files; file != NULL; file = file->next) {
+        struct stat st;
+        lock_trace();
+        TraceMmap r = {
+            .path = tstring(file->path),
+            .size = stat(file->path, &st) == 0 ? st.st_size : 0,
+            .nmmap = file->nmmap,
+            .bmmap = file->bmmap,
+            /* The last page of a mapping may extend past the data */
+            .bfault = file->bfault < file->bmmap ? file->bfault : file->bmmap
+        };
+        twrite(TR_MMAP, &r, sizeof(r));
+        unlock_trace();
+    }
+
+    free_mappings();
+
+    unlock_mappings();
+}
+
+/* Forget the mappings of the parent in a forked child. The parent
+ * reports them. Another thread of the parent may have been holding the
+ * mutex, so it is reset and the tables are dropped without freeing
+ * them. */
+static void forget_mappings() {
+    pthread_mutex_init(&mapping_mutex, NULL);
+    mappings = NULL;
+    mapped_files = NULL;
+#ifdef HAS_IO_URING
+    rings = NULL;
+#endif
+    tracked_maps = 0;
 }
 
 static void report_thread_counters() {
     lock_threads();
-    tprintf("threads: %d %d %d\n", cur_threads, max_threads, tot_threads);
+    TraceThreads r = {
+        .cur = cur_threads,
+        .max = max_threads,
+        .tot = tot_threads
+    };
+    twrite(TR_THREADS, &r, sizeof(r));
     unlock_threads();
 }
 
@@ -979,6 +2435,72 @@ static long unsigned int papi_gettid() {
     return (long unsigned int)gettid();
 }
 
+/* Add an event to the list of events to count, if it is available */
+static void add_papi_event(const char *name) {
+    int err;
+
+    for (int i=0; i<n_papi_events; i++) {
+        if (strcmp(papi_events[i], name) == 0) {
+            return;
+        }
+    }
+    if (n_papi_events == MAX_PAPI_EVENTS) {
+        printerr("Too many PAPI events, ignoring %s\n", name);
+        return;
+    }
+
+    int event;
+    err = PAPI_event_name_to_code((char *)name, &event);
+    if (err < 0) {
+        printerr("Error getting PAPI event code for %s: %s\n", name, PAPI_strerror(err));
+        return;
+    }
+
+    PAPI_event_info_t info;
+    err = PAPI_get_event_info(event, &info);
+    if (err < 0) {
+        printerr("Error getting PAPI event info for %s: %s\n", name, PAPI_strerror(err));
+        return;
+    }
+    if (info.count == 0) {
+        /* Event is not available */
+        return;
+    }
+
+    papi_events[n_papi_events] = strdup(name);
+    if (papi_events[n_papi_events] == NULL) {
+        return;
+    }
+    papi_codes[n_papi_events] = event;
+    n_papi_events++;
+}
+
+/* Add a list of event and group names separated by commas */
+static void add_papi_events(const char *list) {
+    char *buf = strdup(list);
+    if (buf == NULL) {
+        return;
+    }
+
+    char *save = NULL;
+    for (char *name = strtok_r(buf, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        int group = 0;
+        for (int i=0; papi_groups[i].name != NULL; i++) {
+            if (strcmp(papi_groups[i].name, name) == 0) {
+                add_papi_events(papi_groups[i].events);
+                group = 1;
+                break;
+            }
+        }
+        if (!group) {
+            add_papi_event(name);
+        }
+    }
+
+    free(buf);
+}
+
 static void init_papi() {
     int err;
 
@@ -1001,6 +2523,21 @@ static void init_papi() {
         return;
     }
 
+    /* Multiplexing lets us count more events than there are hardware
+     * counters, at the cost of scaled estimates instead of exact counts.
+     * It is only switched on for event sets that need it. */
+    err = PAPI_multiplex_init();
+    papi_multiplex = err == PAPI_OK;
+    if (!papi_multiplex) {
+        printerr("PAPI_multiplex_init failed: %s\n", PAPI_strerror(err));
+    }
+
+    char *events = getenv("KICKSTART_PAPI_EVENTS");
+    add_papi_events(events != NULL ? events : papi_groups[0].events);
+    if (n_papi_events == 0) {
+        return;
+    }
+
     papi_ok = 1;
 }
 
@@ -1025,34 +2562,26 @@ static void start_papi() {
         return;
     }
 
-    /* Make sure all the events are available and add them to the set */
+    int multiplexed = 0;
     for (int i=0; i<n_papi_events; i++) {
-        int event;
-        err = PAPI_event_name_to_code(papi_events[i], &event);
-        if (err < 0) {
-            printerr("Error getting PAPI event code for %s: %s\n", papi_events[i], PAPI_strerror(err));
-            continue;
-        }
-
-        PAPI_event_info_t info;
-        err = PAPI_get_event_info(event, &info);
-        if (err < 0) {
-            printerr("Error getting PAPI event info for %s: %s\n", papi_events[i], PAPI_strerror(err));
-            continue;
-        }
-        if (info.count == 0) {
-            /* Event is not available */
-            //printerr("PAPI event %s not available: %s\n", papi_events[i], info.long_descr);
-            continue;
+        err = PAPI_add_event(eventset, papi_codes[i]);
+        if (err == PAPI_ECNFLCT && papi_multiplex && !multiplexed) {
+            /* Out of hardware counters: share them between the events */
+            err = PAPI_set_multiplex(eventset);
+            if (err < 0) {
+                printerr("PAPI_set_multiplex failed: %s\n", PAPI_strerror(err));
+                papi_multiplex = 0;
+                continue;
+            }
+            multiplexed = 1;
+            err = PAPI_add_event(eventset, papi_codes[i]);
         }
-
-        err = PAPI_add_event(eventset, event);
         if (err < 0) {
             if (err == PAPI_ECNFLCT) {
                 /* Event conflicts with another event */
                 continue;
             }
-            printerr("Error adding PAPI event %d to event set: %s\n", i, PAPI_strerror(err));
+            printerr("Error adding PAPI event %s to event set: %s\n", papi_events[i], PAPI_strerror(err));
             continue;
         }
     }
@@ -1062,9 +2591,12 @@ static void start_papi() {
         printerr("PAPI_start failed: %s\n", PAPI_strerror(err));
         return;
     }
+
+    papi_eventset = eventset;
 }
 
-/* Stop and report papi counters for a given eventset */
+/* Stop the papi counters for a given eventset and add them to the totals
+ * of the process */
 static void stop_papi(int eventset) {
     int err;
 
@@ -1073,39 +2605,72 @@ static void stop_papi(int eventset) {
     }
 
     /* Collect counter values */
-    long long counters[n_papi_events];
+    long long counters[MAX_PAPI_EVENTS];
     err = PAPI_stop(eventset, counters);
+    if (err == PAPI_ENOEVST || err == PAPI_ENOTRUN) {
+        /* Already stopped when its thread exited */
+        return;
+    }
     if (err < 0) {
         printerr("PAPI_stop failed: %s\n", PAPI_strerror(err));
         return;
     }
 
     /* Get the events that were actually recorded */
-    int nevents = n_papi_events;
-    int events[n_papi_events];
+    int nevents = MAX_PAPI_EVENTS;
+    int events[MAX_PAPI_EVENTS];
     err = PAPI_list_events(eventset, events, &nevents);
     if (err < 0) {
         printerr("PAPI_list_events failed: %s\n", PAPI_strerror(err));
         return;
     }
 
-    /* Report counters */
-    char eventname[256];
     for (int i=0; i<nevents; i++) {
-        PAPI_event_code_to_name(events[i], eventname);
-        tprintf("%s: %lld\n", eventname, counters[i]);
+        for (int j=0; j<n_papi_events; j++) {
+            if (papi_codes[j] == events[i]) {
+                __sync_fetch_and_add(&papi_totals[j], counters[i]);
+                papi_counted[j] = 1;
+                break;
+            }
+        }
+    }
+}
+
+/* Stop the papi counters of a thread that is exiting */
+static void finish_papi() {
+    if (papi_eventset == PAPI_NULL) {
+        return;
     }
+
+    stop_papi(papi_eventset);
+    PAPI_cleanup_eventset(papi_eventset);
+    PAPI_destroy_eventset(&papi_eventset);
+    PAPI_unregister_thread();
 }
 
 static void fini_papi() {
-    /* It turns out that the eventsets are ID numbers that are
-     * allocated sequentially for each thread starting at 1,
-     * so we can just * call stop on every one from 1 to
-     * tot_threads */
+    /* Threads that are still running at exit have not stopped their
+     * counters yet. It turns out that the eventsets are ID numbers that
+     * are allocated sequentially for each thread starting at 1, so we
+     * can just call stop on every one from 1 to tot_threads */
     for (int i=1; i<=tot_threads; i++) {
         stop_papi(i);
     }
 
+    /* Report one total per event for the whole process */
+    for (int i=0; i<n_papi_events; i++) {
+        if (!papi_counted[i]) {
+            continue;
+        }
+        lock_trace();
+        TracePAPI r = {
+            .event = tstring(papi_events[i]),
+            .value = papi_totals[i]
+        };
+        twrite(TR_PAPI, &r, sizeof(r));
+        unlock_trace();
+    }
+
     PAPI_shutdown();
 }
 
@@ -1115,6 +2680,8 @@ static void fini_papi() {
 static void __attribute__((constructor)) interpose_init(void) {
     mypid = getpid();
 
+    init_policy();
+
     /* dup stderr because the program might close it. This is
      * untraced because the descriptor table has not been
      * initialized yet */
@@ -1126,10 +2693,17 @@ static void __attribute__((constructor)) interpose_init(void) {
     init_descriptors();
     init_threads();
 
-    tprintf("start: %lf\n", get_time());
+    TraceStart r = {
+        .time = get_time(),
+        .pid = getpid(),
+        .ppid = getppid()
+    };
+    twrite(TR_START, &r, sizeof(r));
 
-    tprintf("Pid: %d\n", getpid());
-    tprintf("PPid: %d\n", getppid());
+    if (policy.sample > 1) {
+        TraceSample sr = { .rate = policy.sample };
+        twrite(TR_SAMPLE, &sr, sizeof(sr));
+    }
     read_cmdline();
 
 #ifdef HAS_PAPI
@@ -1151,6 +2725,8 @@ static void __attribute__((destructor)) interpose_fini(void) {
         trace_close(i);
     }
 
+    report_mappings();
+
     report_thread_counters();
 
 #ifdef HAS_PAPI
@@ -1163,7 +2739,8 @@ static void __attribute__((destructor)) interpose_fini(void) {
     read_stat();
     read_io();
 
-    tprintf("stop: %lf\n", get_time());
+    TraceStop r = { .time = get_time() };
+    twrite(TR_STOP, &r, sizeof(r));
 
     /* Close trace file */
     tclose();
@@ -1186,6 +2763,16 @@ static int dup_untraced(int oldfd) {
     return (*orig_dup)(oldfd);
 }
 
+static int open_untraced(const char *path, int oflag, mode_t mode) {
+    typeof(open) *orig_open = osym("open");
+    return (*orig_open)(path, oflag, mode);
+}
+
+static int close_untraced(int fd) {
+    typeof(close) *orig_close = osym("close");
+    return (*orig_close)(fd);
+}
+
 int dup(int oldfd) {
     debug("dup");
 
@@ -1241,6 +2828,7 @@ int open(const char *path, int oflag, ...) {
         va_end(list);
     }
 
+    meta_begin(-1);
     int rc = (*orig_open)(path, oflag, mode);
 
     if (rc >= 0) {
@@ -1263,6 +2851,7 @@ int open64(const char *path, int oflag, ...) {
         va_end(list);
     }
 
+    meta_begin(-1);
     int rc = (*orig_open64)(path, oflag, mode);
 
     if (rc >= 0) {
@@ -1285,10 +2874,15 @@ int openat(int dirfd, const char *path, int oflag, ...) {
         va_end(list);
     }
 
+    meta_begin(-1);
     int rc = (*orig_openat)(dirfd, path, oflag, mode);
 
     if (rc >= 0) {
-        trace_openat(rc);
+        if (dirfd == AT_FDCWD || path[0] == '/') {
+            trace_open(path, rc);
+        } else {
+            trace_openat(rc);
+        }
     }
 
     return rc;
@@ -1307,10 +2901,15 @@ int openat64(int dirfd, const char *path, int oflag, ...) {
         va_end(list);
     }
 
+    meta_begin(-1);
     int rc = (*orig_openat64)(dirfd, path, oflag, mode);
 
     if (rc >= 0) {
-        trace_openat(rc);
+        if (dirfd == AT_FDCWD || path[0] == '/') {
+            trace_open(path, rc);
+        } else {
+            trace_openat(rc);
+        }
     }
 
     return rc;
@@ -1321,6 +2920,7 @@ int creat(const char *path, mode_t mode) {
 
     typeof(creat) *orig_creat = osym("creat");
 
+    meta_begin(-1);
     int rc = (*orig_creat)(path, mode);
 
     if (rc >= 0) {
@@ -1335,6 +2935,7 @@ int creat64(const char *path, mode_t mode) {
 
     typeof(creat64) *orig_creat64 = osym("creat64");
 
+    meta_begin(-1);
     int rc = (*orig_creat64)(path, mode);
 
     if (rc >= 0) {
@@ -1352,6 +2953,7 @@ static FILE *fopen_untraced(const char *path, const char *mode) {
 FILE *fopen(const char *path, const char *mode) {
     debug("fopen");
 
+    meta_begin(-1);
     FILE *f = fopen_untraced(path, mode);
 
     if (f != NULL) {
@@ -1365,6 +2967,7 @@ FILE *fopen64(const char *path, const char *mode) {
     debug("fopen64");
 
     typeof(fopen64) *orig_fopen64 = osym("fopen64");
+    meta_begin(-1);
     FILE *f = (*orig_fopen64)(path, mode);
 
     if (f != NULL) {
@@ -1378,6 +2981,7 @@ FILE *freopen(const char *path, const char *mode, FILE *stream) {
     debug("freopen");
 
     typeof(freopen) *orig_freopen = osym("freopen");
+    meta_begin(-1);
     FILE *f = orig_freopen(path, mode, stream);
 
     if (f != NULL) {
@@ -1391,6 +2995,7 @@ FILE *freopen64(const char *path, const char *mode, FILE *stream) {
     debug("freopen64");
 
     typeof(freopen64) *orig_freopen64 = osym("freopen64");
+    meta_begin(-1);
     FILE *f = orig_freopen64(path, mode, stream);
 
     if (f != NULL) {
@@ -1404,6 +3009,7 @@ int close(int fd) {
     debug("close");
 
     typeof(close) *orig_close = osym("close");
+    meta_begin(fd);
     int rc = (*orig_close)(fd);
 
     if (fd >= 0) {
@@ -1426,6 +3032,7 @@ int fclose(FILE *fp) {
         fd = fileno(fp);
     }
 
+    meta_begin(fd);
     int rc = fclose_untraced(fp);
 
     if (fd >= 0) {
@@ -1439,6 +3046,7 @@ ssize_t read(int fd, void *buf, size_t count) {
     debug("read");
 
     typeof(read) *orig_read = osym("read");
+    io_begin();
     ssize_t rc = (*orig_read)(fd, buf, count);
 
     if (rc > 0) {
@@ -1452,10 +3060,12 @@ ssize_t write(int fd, const void *buf, size_t count) {
     debug("write");
 
     typeof(write) *orig_write = osym("write");
+    io_begin();
     ssize_t rc = (*orig_write)(fd, buf, count);
 
     if (rc > 0) {
         trace_write(fd, rc);
+        hash_write(fd, buf, rc, -1);
     }
 
     return rc;
@@ -1469,6 +3079,7 @@ static size_t fread_untraced(void *ptr, size_t size, size_t nmemb, FILE *stream)
 size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
     debug("fread");
 
+    io_begin();
     size_t rc = fread_untraced(ptr, size, nmemb, stream);
 
     if (rc > 0) {
@@ -1483,11 +3094,13 @@ size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream) {
     debug("fwrite");
 
     typeof(fwrite) *orig_fwrite = osym("fwrite");
+    io_begin();
     size_t rc = (*orig_fwrite)(ptr, size, nmemb, stream);
 
     if (rc > 0) {
         /* rc is the number of objects written */
         trace_write(fileno(stream), rc*size);
+        hash_write(fileno(stream), ptr, rc*size, -1);
     }
 
     return rc;
@@ -1497,6 +3110,7 @@ ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
     debug("pread");
 
     typeof(pread) *orig_pread = osym("pread");
+    io_begin();
     ssize_t rc = (*orig_pread)(fd, buf, count, offset);
 
     if (rc > 0) {
@@ -1510,6 +3124,7 @@ ssize_t pread64(int fd, void *buf, size_t count, off_t offset) {
     debug("pread64");
 
     typeof(pread64) *orig_pread64 = osym("pread64");
+    io_begin();
     ssize_t rc = (*orig_pread64)(fd, buf, count, offset);
 
     if (rc > 0) {
@@ -1519,14 +3134,21 @@ ssize_t pread64(int fd, void *buf, size_t count, off_t offset) {
     return rc;
 }
 
+static ssize_t pwrite_untraced(int fd, const void *buf, size_t count, off_t offset) {
+    typeof(pwrite) *orig_pwrite = osym("pwrite");
+    return (*orig_pwrite)(fd, buf, count, offset);
+}
+
 ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
     debug("pwrite");
 
     typeof(pwrite) *orig_pwrite = osym("pwrite");
+    io_begin();
     ssize_t rc = (*orig_pwrite)(fd, buf, count, offset);
 
     if (rc > 0) {
         trace_write(fd, rc);
+        hash_write(fd, buf, rc, offset);
     }
 
     return rc;
@@ -1536,10 +3158,12 @@ ssize_t pwrite64(int fd, const void *buf, size_t count, off_t offset) {
     debug("pwrite64");
 
     typeof(pwrite64) *orig_pwrite64 = osym("pwrite64");
+    io_begin();
     ssize_t rc = (*orig_pwrite64)(fd, buf, count, offset);
 
     if (rc > 0) {
         trace_write(fd, rc);
+        hash_write(fd, buf, rc, offset);
     }
 
     return rc;
@@ -1549,6 +3173,7 @@ ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
     debug("readv");
 
     typeof(readv) *orig_readv = osym("readv");
+    io_begin();
     ssize_t rc = (*orig_readv)(fd, iov, iovcnt);
 
     if (rc > 0) {
@@ -1563,6 +3188,7 @@ ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
     debug("preadv");
 
     typeof(preadv) *orig_preadv = osym("preadv");
+    io_begin();
     ssize_t rc = (*orig_preadv)(fd, iov, iovcnt, offset);
 
     if (rc > 0) {
@@ -1578,6 +3204,7 @@ ssize_t preadv64(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
     debug("preadv64");
 
     typeof(preadv64) *orig_preadv64 = osym("preadv64");
+    io_begin();
     ssize_t rc = (*orig_preadv64)(fd, iov, iovcnt, offset);
 
     if (rc > 0) {
@@ -1592,10 +3219,12 @@ ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
     debug("writev");
 
     typeof(writev) *orig_writev = osym("writev");
+    io_begin();
     ssize_t rc = (*orig_writev)(fd, iov, iovcnt);
 
     if (rc > 0) {
         trace_write(fd, rc);
+        hash_iov(fd, iov, iovcnt, rc, -1);
     }
 
     return rc;
@@ -1606,10 +3235,12 @@ ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
     debug("pwritev");
 
     typeof(pwritev) *orig_pwritev = osym("pwritev");
+    io_begin();
     ssize_t rc = (*orig_pwritev)(fd, iov, iovcnt, offset);
 
     if (rc > 0) {
         trace_write(fd, rc);
+        hash_iov(fd, iov, iovcnt, rc, offset);
     }
 
     return rc;
@@ -1621,10 +3252,12 @@ ssize_t pwritev64(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
     debug("pwritev64");
 
     typeof(pwritev64) *orig_pwritev64 = osym("pwritev64");
+    io_begin();
     ssize_t rc = (*orig_pwritev64)(fd, iov, iovcnt, offset);
 
     if (rc > 0) {
         trace_write(fd, rc);
+        hash_iov(fd, iov, iovcnt, rc, offset);
     }
 
     return rc;
@@ -1635,6 +3268,7 @@ int fgetc(FILE *stream) {
     debug("fgetc");
 
     typeof(fgetc) *orig_fgetc = osym("fgetc");
+    io_begin();
     int rc = (*orig_fgetc)(stream);
 
     if (rc > 0) {
@@ -1648,10 +3282,13 @@ int fputc(int c, FILE *stream) {
     debug("fputc");
 
     typeof(fputc) *orig_fputc = osym("fputc");
+    io_begin();
     int rc = (*orig_fputc)(c, stream);
 
     if (rc > 0) {
+        unsigned char byte = c;
         trace_write(fileno(stream), 1);
+        hash_write(fileno(stream), &byte, 1, -1);
     }
 
     return rc;
@@ -1665,6 +3302,7 @@ static char *fgets_untraced(char *s, int size, FILE *stream) {
 char *fgets(char *s, int size, FILE *stream) {
     debug("fgets");
 
+    io_begin();
     char *ret = fgets_untraced(s, size, stream);
 
     if (ret != NULL) {
@@ -1678,10 +3316,12 @@ int fputs(const char *s, FILE *stream) {
     debug("fputs");
 
     typeof(fputs) *orig_fputs = osym("fputs");
+    io_begin();
     int rc = (*orig_fputs)(s, stream);
 
     if (rc > 0) {
         trace_write(fileno(stream), strlen(s));
+        hash_write(fileno(stream), s, strlen(s), -1);
     }
 
     return rc;
@@ -1698,6 +3338,7 @@ int vfscanf(FILE *stream, const char *format, va_list ap) {
      */
     long before = ftell(stream);
 
+    io_begin();
     int rc = (*orig_vfscanf)(stream, format, ap);
 
     if (rc > 0) {
@@ -1726,10 +3367,13 @@ static int vfprintf_untraced(FILE *stream, const char *format, va_list ap) {
 int vfprintf(FILE *stream, const char *format, va_list ap) {
     debug("vfprintf");
 
+    io_begin();
     int rc = vfprintf_untraced(stream, format, ap);
 
     if (rc > 0) {
         trace_write(fileno(stream), rc);
+        /* The formatted data isn't available */
+        hash_write(fileno(stream), NULL, rc, -1);
     }
 
     return rc;
@@ -1765,6 +3409,7 @@ ssize_t send(int sockfd, const void *buf, size_t len, int flags) {
     debug("send");
 
     typeof(send) *orig_send = osym("send");
+    io_begin();
     ssize_t rc = (*orig_send)(sockfd, buf, len, flags);
 
     if (rc > 0) {
@@ -1778,11 +3423,13 @@ ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
     debug("sendfile");
 
     typeof(sendfile) *orig_sendfile = osym("sendfile");
+    io_begin();
     ssize_t rc = (*orig_sendfile)(out_fd, in_fd, offset, count);
 
     if (rc > 0) {
         trace_read(in_fd, rc);
         trace_write(out_fd, rc);
+        hash_write(out_fd, NULL, rc, -1);
     }
 
     return rc;
@@ -1808,6 +3455,7 @@ ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
     debug("sendmsg");
 
     typeof(sendmsg) *orig_sendmsg = osym("sendmsg");
+    io_begin();
     ssize_t rc = (*orig_sendmsg)(sockfd, msg, flags);
 
     if (rc > 0) {
@@ -1825,6 +3473,7 @@ ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
     debug("recv");
 
     typeof(recv) *orig_recv = osym("recv");
+    io_begin();
     ssize_t rc = (*orig_recv)(sockfd, buf, len, flags);
 
     if (rc > 0) {
@@ -1854,6 +3503,7 @@ ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
     debug("recvmsg");
 
     typeof(recvmsg) *orig_recvmsg = osym("recvmsg");
+    io_begin();
     ssize_t rc = (*orig_recvmsg)(sockfd, msg, flags);
 
     if (rc > 0) {
@@ -1867,6 +3517,25 @@ ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
     return rc;
 }
 
+static int ftruncate_untraced(int fd, off_t length) {
+    typeof(ftruncate) *orig_ftruncate = osym("ftruncate");
+    return (*orig_ftruncate)(fd, length);
+}
+
+int ftruncate(int fd, off_t length) {
+    debug("ftruncate");
+
+    int rc = ftruncate_untraced(fd, length);
+
+    if (rc == 0) {
+        /* Unless the length is unchanged, the file no longer holds
+         * exactly the data written so far */
+        hash_seek(fd, length);
+    }
+
+    return rc;
+}
+
 int truncate(const char *path, off_t length) {
     debug("truncate");
 
@@ -1880,14 +3549,129 @@ int truncate(const char *path, off_t length) {
     return rc;
 }
 
+static void *mmap_untraced(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    typeof(mmap) *orig_mmap = osym("mmap");
+    return (*orig_mmap)(addr, length, prot, flags, fd, offset);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    debug("mmap");
+
+    /* A fixed mapping replaces whatever was mapped there */
+    if (flags & MAP_FIXED) {
+        trace_munmap(addr, length);
+    }
+
+    void *rc = mmap_untraced(addr, length, prot, flags, fd, offset);
+
+    if (rc != MAP_FAILED && !(flags & MAP_ANONYMOUS) && fd >= 0) {
+        trace_mmap(rc, length, fd, offset);
+    }
+
+    return rc;
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset) {
+    debug("mmap64");
+
+    typeof(mmap64) *orig_mmap64 = osym("mmap64");
+
+    if (flags & MAP_FIXED) {
+        trace_munmap(addr, length);
+    }
+
+    void *rc = (*orig_mmap64)(addr, length, prot, flags, fd, offset);
+
+    if (rc != MAP_FAILED && !(flags & MAP_ANONYMOUS) && fd >= 0) {
+        trace_mmap(rc, length, fd, offset);
+    }
+
+    return rc;
+}
+
+static int munmap_untraced(void *addr, size_t length) {
+    typeof(munmap) *orig_munmap = osym("munmap");
+    return (*orig_munmap)(addr, length);
+}
+
+int munmap(void *addr, size_t length) {
+    debug("munmap");
+
+    /* The pages have to be measured before they are gone */
+    trace_munmap(addr, length);
+
+    return munmap_untraced(addr, length);
+}
+
+#ifdef HAS_IO_URING
+/* There are no io_uring functions in libc, so applications that don't
+ * issue the system calls themselves, as liburing does on most
+ * architectures, call io_uring_setup and io_uring_enter through
+ * syscall. The arguments are passed on as six longs, like libc does. */
+long syscall(long number, ...) {
+    typeof(syscall) *orig_syscall = osym("syscall");
+
+    va_list ap;
+    long args[6];
+    va_start(ap, number);
+    for (int i = 0; i < 6; i++) {
+        args[i] = va_arg(ap, long);
+    }
+    va_end(ap);
+
+    if (number == SYS_io_uring_enter) {
+        trace_uring_enter((int)args[0], (unsigned)args[1]);
+    }
+
+    long rc = (*orig_syscall)(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+
+    if (number == SYS_io_uring_setup && rc >= 0) {
+        trace_uring_setup((int)rc, (const struct io_uring_params *)args[1]);
+    }
+
+    return rc;
+}
+#endif
+
+int chdir(const char *path) {
+    debug("chdir");
+
+    typeof(chdir) *orig_chdir = osym("chdir");
+    int rc = (*orig_chdir)(path);
+
+    if (rc == 0) {
+        lock_paths();
+        update_cwd();
+        unlock_paths();
+    }
+
+    return rc;
+}
+
+int fchdir(int fd) {
+    debug("fchdir");
+
+    typeof(fchdir) *orig_fchdir = osym("fchdir");
+    int rc = (*orig_fchdir)(fd);
+
+    if (rc == 0) {
+        lock_paths();
+        update_cwd();
+        unlock_paths();
+    }
+
+    return rc;
+}
+
 int mkstemp(char *template) {
     debug("mkstemp");
 
     typeof(mkstemp) *orig_mkstemp = osym("mkstemp");
+    meta_begin(-1);
     int rc = (*orig_mkstemp)(template);
 
     if (rc >= 0) {
-        trace_openat(rc);
+        trace_open(template, rc);
     }
 
     return rc;
@@ -1898,10 +3682,11 @@ int mkostemp(char *template, int flags) {
     debug("mkostemp");
 
     typeof(mkostemp) *orig_mkostemp = osym("mkostemp");
+    meta_begin(-1);
     int rc = (*orig_mkostemp)(template, flags);
 
     if (rc >= 0) {
-        trace_openat(rc);
+        trace_open(template, rc);
     }
 
     return rc;
@@ -1913,10 +3698,11 @@ int mkstemps(char *template, int suffixlen) {
     debug("mkstemps");
 
     typeof(mkstemps) *orig_mkstemps = osym("mkstemps");
+    meta_begin(-1);
     int rc = (*orig_mkstemps)(template, suffixlen);
 
     if (rc >= 0) {
-        trace_openat(rc);
+        trace_open(template, rc);
     }
 
     return rc;
@@ -1928,10 +3714,11 @@ int mkostemps(char *template, int suffixlen, int flags) {
     debug("mkostemps");
 
     typeof(mkostemps) *orig_mkostemps = osym("mkostemps");
+    meta_begin(-1);
     int rc = (*orig_mkostemps)(template, suffixlen, flags);
 
     if (rc >= 0) {
-        trace_openat(rc);
+        trace_open(template, rc);
     }
 
     return rc;
@@ -1942,6 +3729,7 @@ FILE *tmpfile(void) {
     debug("tmpfile");
 
     typeof(tmpfile) *orig_tmpfile = osym("tmpfile");
+    meta_begin(-1);
     FILE *f = (*orig_tmpfile)();
 
     if (f != NULL) {
@@ -1959,6 +3747,7 @@ off_t lseek(int fd, off_t offset, int whence) {
 
     if (result >= 0) {
         trace_seek(fd, offset);
+        hash_seek(fd, result);
     }
 
     return result;
@@ -1973,6 +3762,7 @@ off64_t lseek64(int fd, off64_t offset, int whence) {
 
     if (result >= 0) {
         trace_seek(fd, offset);
+        hash_seek(fd, result);
     }
 
     return result;
@@ -1987,6 +3777,7 @@ int fseek(FILE *stream, long offset, int whence) {
 
     if (result == 0) {
         trace_seek(fileno(stream), offset);
+        hash_seek(fileno(stream), -1);
     }
 
     return result;
@@ -2000,12 +3791,21 @@ int fseeko(FILE *stream, off_t offset, int whence) {
 
     if (result == 0) {
         trace_seek(fileno(stream), offset);
+        hash_seek(fileno(stream), -1);
     }
 
     return result;
 }
 
 static void interpose_pthread_cleanup(void *arg) {
+    /* Keep the I/O counted by this thread */
+    merge_thread_counters();
+
+#ifdef HAS_PAPI
+    /* Add the hardware counters of this thread to the process totals */
+    finish_papi();
+#endif
+
     /* Update thread counters */
     thread_finished();
 
@@ -2200,13 +4000,15 @@ pid_t fork(void) {
     pid_t rc = (*orig_fork)();
 
     if (rc == 0) {
-        /* Close the trace file since we inherited it */
-        tclose();
+        /* Drop the trace file since we inherited it from the parent */
+        tdetach();
+        forget_mappings();
 
         /* Reinitialize libinterpose on a successful fork */
         interpose_init();
 
-        tprintf("fork\n");
+        TraceRecord r;
+        twrite(TR_FORK, &r, sizeof(r));
     }
 
     return rc;
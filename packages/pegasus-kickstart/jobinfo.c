@@ -350,6 +350,14 @@ int printYAMLJobInfo(FILE *out, int indent, const char* tag, const JobInfo* job)
     /* <proc>s */
     printYAMLProcInfo(out, indent+2, job->children);
 
+    if (job->cgroup != NULL) {
+        printYAMLCgroupInfo(out, indent+2, job->cgroup);
+    }
+
+    if (job->samples != NULL) {
+        printYAMLSampleInfo(out, indent+2, job->samples);
+    }
+
     return 0;
 }
 
@@ -376,6 +384,12 @@ void deleteJobInfo(JobInfo* jobinfo) {
     deleteProcInfo(jobinfo->children);
     jobinfo->children = NULL;
 
+    deleteCgroupInfo(jobinfo->cgroup);
+    jobinfo->cgroup = NULL;
+
+    deleteSampleInfo(jobinfo->samples);
+    jobinfo->samples = NULL;
+
     /* final invalidation */
     jobinfo->isValid = 0;
 }
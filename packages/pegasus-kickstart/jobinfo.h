@@ -21,6 +21,7 @@
 #include <sys/resource.h>
 #include "statinfo.h"
 #include "procinfo.h"
+#include "sampler.h"
 
 typedef struct {
   int            isValid;     /* 0: uninitialized, 1:valid, 2:app not found */
@@ -40,6 +41,8 @@ typedef struct {
   struct rusage  use;         /* rusage record from reaping application status */
 
   ProcInfo *     children;    /* per-process memory, I/O and CPU usage */
+  CgroupInfo *   cgroup;      /* job totals from its cgroup, or NULL */
+  SampleInfo *   samples;     /* usage sampled while the job ran, or NULL */
 } JobInfo;
 
 /* if set to 1, make the application executable, no matter what. */
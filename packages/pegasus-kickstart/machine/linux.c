@@ -27,6 +27,8 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include <signal.h> /* signal names */
 
@@ -333,6 +335,127 @@ static void gather_proc_cpuinfo(MachineLinuxInfo* machine) {
     }
 }
 
+/* The CPU description doesn't change until the next boot, but parsing
+ * /proc/cpuinfo takes a while on machines with many cores. It is cached in
+ * a file per user in the temp dir, together with the boot id, and shared
+ * by all the kickstarts on the machine. */
+static int cpuinfo_cache_path(char* path, size_t size) {
+    const char* tempdir = getTempDir();
+    if (tempdir == NULL) {
+        return -1;
+    }
+    if (snprintf(path, size, "%s/pegasus-kickstart-%d.cpuinfo", tempdir, (int) geteuid()) >= size) {
+        return -1;
+    }
+    return 0;
+}
+
+static int read_boot_id(char* boot_id, size_t size) {
+    FILE* f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    int rc = fgets(boot_id, size, f) == NULL ? -1 : 0;
+    fclose(f);
+    if (rc == 0) {
+        boot_id[strcspn(boot_id, "\n")] = 0;
+    }
+    return rc;
+}
+
+static int load_cpuinfo_cache(MachineLinuxInfo* machine, const char* path, const char* boot_id) {
+    /* Only trust a file that nobody else could have written */
+    int fd = open(path, O_RDONLY|O_NOFOLLOW);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP|S_IWOTH))) {
+        close(fd);
+        return -1;
+    }
+    FILE* f = fdopen(fd, "r");
+    if (f == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    char line[256];
+    int valid = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        char* value = strchr(line, ' ');
+        if (value == NULL) {
+            continue;
+        }
+        *value++ = 0;
+        if (strcmp(line, "boot_id") == 0) {
+            valid = strcmp(value, boot_id) == 0;
+            if (!valid) {
+                break;
+            }
+        } else if (strcmp(line, "cpu_count") == 0) {
+            machine->cpu_count = (unsigned short) strtoul(value, NULL, 10);
+        } else if (strcmp(line, "cpu_speed") == 0) {
+            machine->megahertz = strtoul(value, NULL, 10);
+        } else if (strcmp(line, "cpu_vendor") == 0) {
+            strncpy(machine->vendor_id, value, sizeof(machine->vendor_id) - 1);
+        } else if (strcmp(line, "cpu_model") == 0) {
+            strncpy(machine->model_name, value, sizeof(machine->model_name) - 1);
+        }
+    }
+    fclose(f);
+
+    if (!valid || machine->cpu_count == 0) {
+        machine->cpu_count = 0;
+        machine->megahertz = 0;
+        machine->vendor_id[0] = 0;
+        machine->model_name[0] = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void save_cpuinfo_cache(const MachineLinuxInfo* machine, const char* path, const char* boot_id) {
+    /* Write a new file and rename it, so that concurrent kickstarts
+     * never see a partial file */
+    char temp[PATH_MAX];
+    if (snprintf(temp, sizeof(temp), "%s.%d", path, getpid()) >= sizeof(temp)) {
+        return;
+    }
+    int fd = open(temp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0644);
+    if (fd < 0) {
+        return;
+    }
+    FILE* f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        unlink(temp);
+        return;
+    }
+    fprintf(f, "boot_id %s\ncpu_count %hu\ncpu_speed %lu\ncpu_vendor %s\ncpu_model %s\n",
+            boot_id, machine->cpu_count, machine->megahertz,
+            machine->vendor_id, machine->model_name);
+    if (fclose(f) != 0 || rename(temp, path) < 0) {
+        unlink(temp);
+    }
+}
+
+static void gather_cpuinfo(MachineLinuxInfo* machine) {
+    char path[PATH_MAX];
+    char boot_id[64];
+    if (cpuinfo_cache_path(path, sizeof(path)) < 0 ||
+            read_boot_id(boot_id, sizeof(boot_id)) < 0) {
+        gather_proc_cpuinfo(machine);
+        return;
+    }
+    if (load_cpuinfo_cache(machine, path, boot_id) == 0) {
+        return;
+    }
+    gather_proc_cpuinfo(machine);
+    save_cpuinfo_cache(machine, path, boot_id);
+}
+
 static unsigned long extract_version(const char* release) {
     /* purpose: extract a.b.c version from release string, ignoring extra junk
      * paramtr: release (IN): pointer to kernel release string (with junk)
@@ -365,9 +488,16 @@ void* initMachine(void) {
                    &p->ram_shared, &p->ram_buffer,
                    &p->swap_total, &p->swap_free);
     gather_loadavg(p->load);
-    gather_proc_cpuinfo(p);
+    gather_cpuinfo(p);
     gather_proc_uptime(&p->boottime, &p->idletime);
 
+    /* Walking all of /proc is slow on busy machines, so the process and
+     * task totals are only collected if they are asked for */
+    char* procs = getenv("KICKSTART_MACHINE_PROCS");
+    if (procs == NULL || *procs == 0) {
+        return p;
+    }
+
     version = extract_version(p->basic->uname.release);
     /* This used to have an upper limit of 3.2 from PM-571, but it was 
      * removed because the Linux kernel is changing version numbers too
@@ -23,7 +23,9 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <libgen.h>
-#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <spawn.h>
 
 #include "utils.h"
 #include "appinfo.h"
@@ -31,6 +33,10 @@
 #include "mysystem.h"
 #include "procinfo.h"
 #include "error.h"
+#include "tracefile.h"
+#include "checksum.h"
+
+extern char **environ;
 
 /* Find the path to the interposition library */
 static int findInterposeLibrary(char *path, int pathsize) {
@@ -77,22 +83,7 @@ static int findInterposeLibrary(char *path, int pathsize) {
     return -1;
 }
 
-static FileInfo *readTraceFileRecord(const char *buf, FileInfo *files) {
-    char filename[BUFSIZ];
-    size_t size = 0;
-    size_t bread = 0;
-    size_t bwrite = 0;
-    size_t nread = 0;
-    size_t nwrite = 0;
-    size_t bseek = 0;
-    size_t nseek = 0;
-
-    if (sscanf(buf, "file: '%[^']' %lu %lu %lu %lu %lu %lu %lu\n",
-               filename, &size, &bread, &bwrite, &nread, &nwrite, &bseek, &nseek) != 8) {
-        printerr("Invalid file record: %s", buf);
-        return files;
-    }
-
+static FileInfo *readTraceFileRecord(const char *filename, const TraceFile *rec, FileInfo *files) {
     /* Look for a duplicate file in the list of files */
     FileInfo *file = NULL;
     FileInfo *last = NULL;
@@ -120,13 +111,13 @@ static FileInfo *readTraceFileRecord(const char *buf, FileInfo *files) {
             return files;
         }
         file->filename = temp;
-        file->size = size;
-        file->bread = bread;
-        file->bwrite = bwrite;
-        file->nread = nread;
-        file->nwrite = nwrite;
-        file->bseek = bseek;
-        file->nseek = nseek;
+        file->size = rec->size;
+        file->bread = rec->bread;
+        file->bwrite = rec->bwrite;
+        file->nread = rec->nread;
+        file->nwrite = rec->nwrite;
+        file->bseek = rec->bseek;
+        file->nseek = rec->nseek;
 
         if (files == NULL) {
             /* List was empty */
@@ -137,35 +128,24 @@ static FileInfo *readTraceFileRecord(const char *buf, FileInfo *files) {
         }
     } else {
         /* Duplicate found, increment counters */
-        file->size = file->size > size ? file->size : size; /* max */
-        file->bread += bread;
-        file->bwrite += bwrite;
-        file->nread += nread;
-        file->nwrite += nwrite;
-        file->bseek += bseek;
-        file->nseek += nseek;
+        file->size = file->size > rec->size ? file->size : rec->size; /* max */
+        file->bread += rec->bread;
+        file->bwrite += rec->bwrite;
+        file->nread += rec->nread;
+        file->nwrite += rec->nwrite;
+        file->bseek += rec->bseek;
+        file->nseek += rec->nseek;
     }
 
     return files;
 }
 
-static SockInfo *readTraceSocketRecord(const char *buf, SockInfo *sockets) {
-    char address[BUFSIZ];
-    int port = 0;
-    size_t brecv = 0;
-    size_t bsend = 0;
-    size_t nrecv = 0;
-    size_t nsend = 0;
-    if (sscanf(buf, "socket: %s %d %lu %lu %lu %lu\n", address, &port, &brecv, &bsend, &nrecv, &nsend) != 6) {
-        printerr("Invalid socket record: %s", buf);
-        return sockets;
-    }
-
+static SockInfo *readTraceSocketRecord(const char *address, const TraceSocket *rec, SockInfo *sockets) {
     /* Look for a duplicate socket in list of sockets */
     SockInfo *sock = NULL;
     SockInfo *last = NULL;
     for (sock = sockets; sock != NULL; sock = sock->next) {
-        if (port == sock->port && strcmp(address, sock->address) == 0) {
+        if (rec->port == sock->port && strcmp(address, sock->address) == 0) {
             /* Found a duplicate */
             break;
         }
@@ -188,11 +168,11 @@ static SockInfo *readTraceSocketRecord(const char *buf, SockInfo *sockets) {
             return sockets;
         }
         sock->address = temp;
-        sock->port = port;
-        sock->brecv = brecv;
-        sock->bsend = bsend;
-        sock->nrecv = nrecv;
-        sock->nsend = nsend;
+        sock->port = rec->port;
+        sock->brecv = rec->brecv;
+        sock->bsend = rec->bsend;
+        sock->nrecv = rec->nrecv;
+        sock->nsend = rec->nsend;
 
         if (sockets == NULL) {
             /* List was empty */
@@ -203,210 +183,590 @@ static SockInfo *readTraceSocketRecord(const char *buf, SockInfo *sockets) {
         }
     } else {
         /* Duplicate found, increment counters */
-        sock->brecv += brecv;
-        sock->bsend += bsend;
-        sock->nrecv += nrecv;
-        sock->nsend += nsend;
+        sock->brecv += rec->brecv;
+        sock->bsend += rec->bsend;
+        sock->nrecv += rec->nrecv;
+        sock->nsend += rec->nsend;
     }
 
     return sockets;
 }
 
-/* Return 1 if line begins with tok */
-static int startswith(const char *line, const char *tok) {
-    return strstr(line, tok) == line;
+/* Add the histograms in rec to the file they belong to. The file was
+ * added to files by the TR_FILE record that comes before rec. */
+static void readTraceLatencyRecord(const char *filename, const TraceLatency *rec, FileInfo *files) {
+    FileInfo *file;
+    for (file = files; file != NULL; file = file->next) {
+        if (strcmp(filename, file->filename) == 0) {
+            break;
+        }
+    }
+    if (file == NULL) {
+        return;
+    }
+
+    if (file->latency == NULL) {
+        file->latency = (Latency *)calloc(sizeof(Latency), 1);
+        if (file->latency == NULL) {
+            printerr("calloc: %s\n", strerror(errno));
+            return;
+        }
+    }
+
+    for (int i = 0; i < LATENCY_BUCKETS && i < TRACE_BUCKETS; i++) {
+        file->latency->read[i] += rec->read[i];
+        file->latency->write[i] += rec->write[i];
+        file->latency->meta[i] += rec->meta[i];
+    }
 }
 
-static ProcInfo *processTraceFile(const char *fullpath) {
-    FILE *trace = fopen(fullpath, "r");
-    if (trace == NULL) {
-        printerr("Unable to open trace file '%s': %s\n",
-                fullpath, strerror(errno));
-        return NULL;
+/* Keep the checksum in rec for the file it belongs to. The file was added
+ * to files by the TR_FILE record that comes before rec. If the file was
+ * written several times, the last checksum wins. */
+static void readTraceDigestRecord(const char *filename, const TraceDigest *rec, FileInfo *files) {
+    FileInfo *file;
+    for (file = files; file != NULL; file = file->next) {
+        if (strcmp(filename, file->filename) == 0) {
+            break;
+        }
+    }
+    if (file == NULL) {
+        return;
     }
 
-    ProcInfo *procs = NULL;
-    ProcInfo *proc = NULL;
-    ProcInfo *lastproc = NULL;
+    if (file->digest == NULL) {
+        file->digest = (Digest *)calloc(sizeof(Digest), 1);
+        if (file->digest == NULL) {
+            printerr("calloc: %s\n", strerror(errno));
+            return;
+        }
+    }
 
-    int fork = 0;
+    file->digest->size = rec->size;
+    file->digest->mtime_sec = rec->mtime_sec;
+    file->digest->mtime_nsec = rec->mtime_nsec;
+    memcpy(file->digest->sha256, rec->sha256, sizeof(file->digest->sha256));
+}
 
-    /* Read data from the trace file */
-    int lines = 0;
-    char line[BUFSIZ];
-    long long llval;
-    while (fgets(line, BUFSIZ, trace) != NULL) {
-        lines++;
+/* Add the mappings in rec to their file. The file may not have been read
+ * or written with any calls that were traced, so it is added to files if
+ * it isn't there. */
+static FileInfo *readTraceMmapRecord(const char *filename, const TraceMmap *rec, FileInfo *files) {
+    TraceFile empty = { .size = rec->size };
+    files = readTraceFileRecord(filename, &empty, files);
 
-        if (proc == NULL) {
-            proc = (ProcInfo *)calloc(sizeof(ProcInfo), 1);
-            if (proc == NULL) {
-                printerr("calloc: %s\n", strerror(errno));
-                goto exit;
-            }
-            fork = 0;
+    FileInfo *file;
+    for (file = files; file != NULL; file = file->next) {
+        if (strcmp(filename, file->filename) == 0) {
+            break;
+        }
+    }
+    if (file == NULL) {
+        return files;
+    }
+
+    file->nmmap += rec->nmmap;
+    file->bmmap += rec->bmmap;
+    file->bfault += rec->bfault;
+
+    return files;
+}
+
+/* Add the io_uring requests in rec to the file they belong to. The file
+ * was added to files by the TR_FILE record that comes before rec. */
+static void readTraceUringRecord(const char *filename, const TraceUring *rec, FileInfo *files) {
+    FileInfo *file;
+    for (file = files; file != NULL; file = file->next) {
+        if (strcmp(filename, file->filename) == 0) {
+            break;
         }
+    }
+    if (file == NULL) {
+        return;
+    }
+
+    file->nuring += rec->nsubmit;
+    file->buring += rec->bsubmit;
+}
+
+static void readTracePAPIRecord(const char *event, const TracePAPI *rec, ProcInfo *proc) {
+    for (int i=0; i<proc->npapi; i++) {
+        if (strcmp(proc->papi[i].event, event) == 0) {
+            proc->papi[i].value += rec->value;
+            return;
+        }
+    }
+
+    PAPICounter *papi = (PAPICounter *)realloc(proc->papi, sizeof(PAPICounter) * (proc->npapi + 1));
+    if (papi == NULL) {
+        printerr("realloc: %s\n", strerror(errno));
+        return;
+    }
+    proc->papi = papi;
+    papi[proc->npapi].event = strdup(event);
+    if (papi[proc->npapi].event == NULL) {
+        printerr("strdup: %s\n", strerror(errno));
+        return;
+    }
+    papi[proc->npapi].value = rec->value;
+    proc->npapi++;
+}
+
+/* Return the smallest valid size of a record of the given type, or 0 if
+ * the type is unknown */
+static size_t traceRecordSize(int type) {
+    switch (type) {
+        case TR_STRING: return sizeof(TraceString) + 1;
+        case TR_START: return sizeof(TraceStart);
+        case TR_STOP: return sizeof(TraceStop);
+        case TR_FORK: return sizeof(TraceRecord);
+        case TR_CMD: return sizeof(TraceName);
+        case TR_EXE: return sizeof(TraceName);
+        case TR_STATUS: return sizeof(TraceStatus);
+        case TR_RUSAGE: return sizeof(TraceRusage);
+        case TR_IOWAIT: return sizeof(TraceIowait);
+        case TR_IO: return sizeof(TraceIO);
+        case TR_THREADS: return sizeof(TraceThreads);
+        case TR_FILE: return sizeof(TraceFile);
+        case TR_SOCKET: return sizeof(TraceSocket);
+        case TR_PAPI: return sizeof(TracePAPI);
+        case TR_SAMPLE: return sizeof(TraceSample);
+        case TR_LATENCY: return sizeof(TraceLatency);
+        case TR_DIGEST: return sizeof(TraceDigest);
+        case TR_MMAP: return sizeof(TraceMmap);
+        case TR_URING: return sizeof(TraceUring);
+    }
+    return 0;
+}
+
+/* The processes of one pid, while its streams are read */
+typedef struct {
+    ProcInfo *procs;
+    ProcInfo *proc;
+    ProcInfo *lastproc;
+    int fork;
+} TraceProc;
+
+/* Return the extent at offset in a trace file, or NULL if there is no
+ * valid extent there */
+static const TraceExtent *traceExtent(const char *map, uint64_t end, uint64_t offset) {
+    if (offset < TRACE_EXTENT || offset % TRACE_EXTENT != 0 ||
+            offset + sizeof(TraceExtent) > end) {
+        return NULL;
+    }
+    const TraceExtent *e = (const TraceExtent *)(map + offset);
+    if (e->magic != TRACE_EXTENT_MAGIC || e->size < TRACE_EXTENT ||
+            e->size % TRACE_EXTENT != 0 || e->size > end - offset) {
+        return NULL;
+    }
+    return e;
+}
 
-        if (proc != lastproc) {
-            if (procs == NULL) {
-                procs = proc;
+/* Read the stream of one process image, which starts with the extent at
+ * offset, and add its records to the processes of its pid */
+static void processTraceStream(const char *fullpath, const char *map, uint64_t end,
+                               uint64_t offset, TraceProc *tp) {
+    /* Strings defined in the stream, indexed by id. They point into the
+     * mapped file. */
+    const char **strings = NULL;
+    uint32_t nstrings = 0;
+    uint32_t size = 0;
+
+    const TraceExtent *e = traceExtent(map, end, offset);
+    while (e != NULL) {
+        /* Ignore any space at the end that a process didn't use because
+         * it was killed. */
+        uint64_t used = offset + (e->used < e->size ? e->used : e->size);
+        uint64_t roff = offset + sizeof(TraceExtent);
+        while (roff + sizeof(TraceRecord) <= used) {
+            const TraceRecord *r = (const TraceRecord *)(map + roff);
+            size_t minsize = traceRecordSize(r->type);
+            if (minsize == 0) {
+                printerr("Unrecognized libinterpose record type %d in %s\n",
+                        r->type, fullpath);
+                goto exit;
             }
-            if (lastproc != NULL) {
-                lastproc->next = proc;
+            if (r->size < minsize || roff + r->size > used) {
+                printerr("Invalid libinterpose record at offset %"PRIu64" in %s\n",
+                        roff, fullpath);
+                goto exit;
             }
-            proc->prev = lastproc;
-            lastproc = proc;
-        }
-
-        if (startswith(line, "file:")) {
-            proc->files = readTraceFileRecord(line, proc->files);
-        } else if (startswith(line, "socket:")) {
-            proc->sockets = readTraceSocketRecord(line, proc->sockets);
-        } else if (startswith(line, "exe:")) {
-            char exe[BUFSIZ];
-            sscanf(line, "exe: %s\n", exe);
-            proc->exe = strdup(exe);
-            if (proc->exe == NULL) {
-                printerr("strdup: %s\n", strerror(errno));
-                break;
+            roff += r->size;
+
+            if (r->type == TR_STRING) {
+                const TraceString *s = (const TraceString *)r;
+                if (s->id > nstrings || s->length >= r->size - sizeof(TraceString) ||
+                        s->value[s->length] != '\0') {
+                    continue;
+                }
+                /* Ids are given out in order */
+                if (s->id == nstrings) {
+                    if (nstrings == size) {
+                        size = size == 0 ? 64 : size * 2;
+                        const char **temp = (const char **)realloc(strings, sizeof(char *) * size);
+                        if (temp == NULL) {
+                            printerr("realloc: %s\n", strerror(errno));
+                            goto exit;
+                        }
+                        strings = temp;
+                    }
+                    nstrings++;
+                }
+                strings[s->id] = s->value;
+                continue;
             }
-        } else if (startswith(line, "Pid")) {
-            sscanf(line, "Pid:%d\n", &(proc->pid));
-        } else if (startswith(line, "PPid")) {
-            sscanf(line,"PPid:%d\n", &(proc->ppid));
-        } else if (startswith(line,"VmPeak")) {
-            sscanf(line,"VmPeak:%d kB\n", &(proc->vmpeak));
-        } else if (startswith(line,"VmHWM")) {
-            sscanf(line,"VmHWM:%d kB\n", &(proc->rsspeak));
-        } else if (startswith(line, "threads")) {
-            sscanf(line,"threads: %d %d %d\n", &(proc->fin_threads),
-                    &(proc->max_threads), &(proc->tot_threads));
-        } else if (startswith(line, "utime:")) {
-            sscanf(line,"utime:%lf\n", &(proc->utime));
-        } else if (startswith(line, "stime:")) {
-            sscanf(line,"stime:%lf\n", &(proc->stime));
-        } else if (startswith(line, "iowait:")) {
-            sscanf(line,"iowait:%lf\n", &(proc->iowait));
-        } else if (startswith(line, "rchar")) {
-            sscanf(line,"rchar: %"SCNu64"\n", &(proc->rchar));
-        } else if (startswith(line, "wchar")) {
-            sscanf(line,"wchar: %"SCNu64"\n", &(proc->wchar));
-        } else if (startswith(line,"syscr")) {
-            sscanf(line,"syscr: %"SCNu64"\n", &(proc->syscr));
-        } else if (startswith(line,"syscw")) {
-            sscanf(line,"syscw: %"SCNu64"\n", &(proc->syscw));
-        } else if (startswith(line,"read_bytes")) {
-            sscanf(line,"read_bytes: %"SCNu64"\n",&(proc->read_bytes));
-        } else if (startswith(line,"write_bytes")) {
-            sscanf(line,"write_bytes: %"SCNu64"\n",&(proc->write_bytes));
-        } else if (startswith(line,"cancelled_write_bytes")) {
-            sscanf(line,"cancelled_write_bytes: %"SCNu64"\n",&(proc->cancelled_write_bytes));
-        } else if (startswith(line, "start:")) {
-            /* Only set the start time if it is not already set.
-             * This handles cases where fork() is called. */
-            if (proc->start == 0) {
-                sscanf(line, "start:%lf\n", &(proc->start));
+
+            if (tp->proc == NULL) {
+                tp->proc = (ProcInfo *)calloc(sizeof(ProcInfo), 1);
+                if (tp->proc == NULL) {
+                    printerr("calloc: %s\n", strerror(errno));
+                    goto exit;
+                }
+                tp->fork = 0;
             }
-        } else if (startswith(line, "stop:")) {
-            sscanf(line,"stop:%lf\n", &(proc->stop));
-            if (fork == 0) {
-                /* Reset the pointer so that it creates a new object */
-                proc = NULL;
-            } else {
-                /* We skipped one exec, reset fork so we don't skip another */
-                fork = 0;
+
+            if (tp->proc != tp->lastproc) {
+                if (tp->procs == NULL) {
+                    tp->procs = tp->proc;
+                }
+                if (tp->lastproc != NULL) {
+                    tp->lastproc->next = tp->proc;
+                }
+                tp->proc->prev = tp->lastproc;
+                tp->lastproc = tp->proc;
+            }
+
+            switch (r->type) {
+                case TR_FILE: {
+                    const TraceFile *f = (const TraceFile *)r;
+                    if (f->path < nstrings && strings[f->path] != NULL) {
+                        tp->proc->files = readTraceFileRecord(strings[f->path], f, tp->proc->files);
+                    }
+                    break;
+                }
+                case TR_SOCKET: {
+                    const TraceSocket *s = (const TraceSocket *)r;
+                    if (s->address < nstrings && strings[s->address] != NULL) {
+                        tp->proc->sockets = readTraceSocketRecord(strings[s->address], s, tp->proc->sockets);
+                    }
+                    break;
+                }
+                case TR_EXE: {
+                    const TraceName *n = (const TraceName *)r;
+                    if (n->name < nstrings && strings[n->name] != NULL) {
+                        free(tp->proc->exe);
+                        tp->proc->exe = strdup(strings[n->name]);
+                        if (tp->proc->exe == NULL) {
+                            printerr("strdup: %s\n", strerror(errno));
+                        }
+                    }
+                    break;
+                }
+                case TR_CMD: {
+                    const TraceName *n = (const TraceName *)r;
+                    if (n->name < nstrings && strings[n->name] != NULL) {
+                        free(tp->proc->cmd);
+                        tp->proc->cmd = strdup(strings[n->name]);
+                        if (tp->proc->cmd == NULL) {
+                            printerr("strdup: %s\n", strerror(errno));
+                        }
+                    }
+                    break;
+                }
+                case TR_START: {
+                    const TraceStart *s = (const TraceStart *)r;
+                    /* Only set the start time if it is not already set.
+                     * This handles cases where fork() is called. */
+                    if (tp->proc->start == 0) {
+                        tp->proc->start = s->time;
+                    }
+                    tp->proc->pid = s->pid;
+                    tp->proc->ppid = s->ppid;
+                    break;
+                }
+                case TR_STOP:
+                    tp->proc->stop = ((const TraceStop *)r)->time;
+                    if (tp->fork == 0) {
+                        /* Reset the pointer so that it creates a new object */
+                        tp->proc = NULL;
+                    } else {
+                        /* We skipped one exec, reset fork so we don't skip another */
+                        tp->fork = 0;
+                    }
+                    break;
+                case TR_FORK:
+                    tp->fork = 1;
+                    break;
+                case TR_STATUS: {
+                    const TraceStatus *s = (const TraceStatus *)r;
+                    tp->proc->vmpeak = s->vmpeak;
+                    tp->proc->rsspeak = s->rsspeak;
+                    break;
+                }
+                case TR_RUSAGE: {
+                    const TraceRusage *u = (const TraceRusage *)r;
+                    tp->proc->utime = u->utime;
+                    tp->proc->stime = u->stime;
+                    break;
+                }
+                case TR_IOWAIT:
+                    tp->proc->iowait = ((const TraceIowait *)r)->iowait;
+                    break;
+                case TR_IO: {
+                    const TraceIO *io = (const TraceIO *)r;
+                    tp->proc->rchar = io->rchar;
+                    tp->proc->wchar = io->wchar;
+                    tp->proc->syscr = io->syscr;
+                    tp->proc->syscw = io->syscw;
+                    tp->proc->read_bytes = io->read_bytes;
+                    tp->proc->write_bytes = io->write_bytes;
+                    tp->proc->cancelled_write_bytes = io->cancelled_write_bytes;
+                    break;
+                }
+                case TR_THREADS: {
+                    const TraceThreads *t = (const TraceThreads *)r;
+                    tp->proc->fin_threads = t->cur;
+                    tp->proc->max_threads = t->max;
+                    tp->proc->tot_threads = t->tot;
+                    break;
+                }
+                case TR_LATENCY: {
+                    const TraceLatency *l = (const TraceLatency *)r;
+                    if (l->path < nstrings && strings[l->path] != NULL) {
+                        readTraceLatencyRecord(strings[l->path], l, tp->proc->files);
+                    }
+                    break;
+                }
+                case TR_DIGEST: {
+                    const TraceDigest *d = (const TraceDigest *)r;
+                    if (d->path < nstrings && strings[d->path] != NULL) {
+                        readTraceDigestRecord(strings[d->path], d, tp->proc->files);
+                    }
+                    break;
+                }
+                case TR_MMAP: {
+                    const TraceMmap *m = (const TraceMmap *)r;
+                    if (m->path < nstrings && strings[m->path] != NULL) {
+                        tp->proc->files = readTraceMmapRecord(strings[m->path], m, tp->proc->files);
+                    }
+                    break;
+                }
+                case TR_URING: {
+                    const TraceUring *u = (const TraceUring *)r;
+                    if (u->path < nstrings && strings[u->path] != NULL) {
+                        readTraceUringRecord(strings[u->path], u, tp->proc->files);
+                    }
+                    break;
+                }
+                case TR_SAMPLE:
+                    tp->proc->io_sample = ((const TraceSample *)r)->rate;
+                    break;
+                case TR_PAPI: {
+                    const TracePAPI *p = (const TracePAPI *)r;
+                    if (p->event < nstrings && strings[p->event] != NULL) {
+                        readTracePAPIRecord(strings[p->event], p, tp->proc);
+                    }
+                    break;
+                }
             }
-        } else if (startswith(line, "PAPI_TOT_INS:")) {
-            sscanf(line,"PAPI_TOT_INS:%lld\n", &llval);
-            proc->PAPI_TOT_INS += llval;
-        } else if (startswith(line, "PAPI_LD_INS:")) {
-            sscanf(line,"PAPI_LD_INS:%lld\n", &llval);
-            proc->PAPI_LD_INS += llval;
-        } else if (startswith(line, "PAPI_SR_INS:")) {
-            sscanf(line,"PAPI_SR_INS:%lld\n", &llval);
-            proc->PAPI_SR_INS += llval;
-        } else if (startswith(line, "PAPI_FP_INS:")) {
-            sscanf(line,"PAPI_FP_INS:%lld\n", &llval);
-            proc->PAPI_FP_INS += llval;
-        } else if (startswith(line, "PAPI_FP_OPS:")) {
-            sscanf(line,"PAPI_FP_OPS:%lld\n", &llval);
-            proc->PAPI_FP_OPS += llval;
-        } else if (startswith(line, "PAPI_L3_TCM:")) {
-            sscanf(line,"PAPI_L3_TCM:%lld\n", &llval);
-            proc->PAPI_L3_TCM += llval;
-        } else if (startswith(line, "PAPI_L2_TCM:")) {
-            sscanf(line,"PAPI_L2_TCM:%lld\n", &llval);
-            proc->PAPI_L2_TCM += llval;
-        } else if (startswith(line, "PAPI_L1_TCM:")) {
-            sscanf(line,"PAPI_L1_TCM:%lld\n", &llval);
-            proc->PAPI_L1_TCM += llval;
-        } else if (startswith(line, "cmd:")) {
-            proc->cmd = strdup(line+4);
-            proc->cmd[strlen(proc->cmd)-1] = '\0';
-        } else if (startswith(line, "fork")) {
-            fork = 1;
-        } else {
-            printerr("Unrecognized libinterpose record: %s", line);
         }
+
+        /* Extents are claimed in order, so a stream only goes forward */
+        if (e->next <= offset) {
+            break;
+        }
+        offset = e->next;
+        e = traceExtent(map, end, offset);
     }
 
 exit:
-    fclose(trace);
-
-    /* Remove the file */
-    unlink(fullpath);
+    free(strings);
+}
 
-    /* Empty file? */
-    if (lines == 0) {
-        printerr("Empty trace file: %s\n", fullpath);
-        return NULL;
+/* The first extent of a stream */
+typedef struct {
+    pid_t pid;
+    uint64_t offset;
+} TraceStream;
+
+static int compareTraceStreams(const void *a, const void *b) {
+    const TraceStream *x = (const TraceStream *)a;
+    const TraceStream *y = (const TraceStream *)b;
+    if (x->pid != y->pid) {
+        return x->pid < y->pid ? -1 : 1;
     }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
 
-    return procs;
+/* The processes of a pid, and the offset of its first stream */
+typedef struct {
+    uint64_t offset;
+    ProcInfo *procs;
+} TracePid;
+
+static int compareTracePids(const void *a, const void *b) {
+    const TracePid *x = (const TracePid *)a;
+    const TracePid *y = (const TracePid *)b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
 }
 
-/* Go through all the files in tempdir and read all of the traces that begin with trace_file_prefix */
-static ProcInfo *processTraceFiles(const char *tempdir, const char *trace_file_prefix) {
-    DIR *tmp = opendir(tempdir);
-    if (tmp == NULL) {
-        printerr("Unable to open trace file directory: %s", tempdir);
+/* Read the trace file written by the processes of the job. The processes
+ * are listed in the order in which they first wrote to the file. The file
+ * is removed once it has been read. */
+static ProcInfo *processTraceFile(const char *fullpath) {
+    ProcInfo *procs = NULL;
+    ProcInfo *lastproc = NULL;
+    TraceStream *streams = NULL;
+    TracePid *pids = NULL;
+    size_t nstreams = 0;
+    size_t size = 0;
+    size_t npids = 0;
+
+    int fd = open(fullpath, O_RDONLY);
+    if (fd < 0) {
+        printerr("Unable to open trace file '%s': %s\n",
+                fullpath, strerror(errno));
         return NULL;
     }
 
-    ProcInfo *procs = NULL;
-    ProcInfo *lastproc = NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        printerr("Unable to stat trace file '%s': %s\n",
+                fullpath, strerror(errno));
+        goto exit;
+    }
+    if (st.st_size < sizeof(TraceFileHeader)) {
+        goto exit;
+    }
 
-    struct dirent *d;
-    for (d = readdir(tmp); d!=NULL; d = readdir(tmp)) {
-        /* If the file name starts with the prefix */
-        if (strstr(d->d_name, trace_file_prefix) == d->d_name) {
-            char fullpath[BUFSIZ];
-            snprintf(fullpath, BUFSIZ, "%s/%s", tempdir, d->d_name);
-            ProcInfo *p = processTraceFile(fullpath);
-            if (p == NULL) {
-                continue;
-            }
-            p->prev = lastproc;
-            if (procs == NULL) {
-                procs = p;
-            } else {
-                lastproc->next = p;
-            }
-            lastproc = p;
-            /* If processTraceFile retuns a list of several procs */
-            while (lastproc->next != NULL) {
-                lastproc = lastproc->next;
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        printerr("Unable to map trace file '%s': %s\n",
+                fullpath, strerror(errno));
+        goto exit;
+    }
+
+    const TraceFileHeader *header = (const TraceFileHeader *)map;
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION) {
+        printerr("Invalid trace file: %s\n", fullpath);
+        goto unmap;
+    }
+
+    /* Find the streams. An extent that was claimed by a process that was
+     * killed before it wrote the header is empty, and is skipped one
+     * TRACE_EXTENT at a time. */
+    uint64_t end = header->end < st.st_size ? header->end : st.st_size;
+    uint64_t offset = TRACE_EXTENT;
+    while (offset < end) {
+        const TraceExtent *e = traceExtent(map, end, offset);
+        if (e == NULL) {
+            offset += TRACE_EXTENT;
+            continue;
+        }
+        if (e->first) {
+            if (nstreams == size) {
+                size = size == 0 ? 64 : size * 2;
+                TraceStream *temp = (TraceStream *)realloc(streams, sizeof(TraceStream) * size);
+                if (temp == NULL) {
+                    printerr("realloc: %s\n", strerror(errno));
+                    goto unmap;
+                }
+                streams = temp;
             }
+            streams[nstreams].pid = e->pid;
+            streams[nstreams].offset = offset;
+            nstreams++;
         }
+        offset += e->size;
+    }
+    if (nstreams == 0) {
+        goto unmap;
     }
 
-    closedir(tmp);
+    /* Read the streams of each pid in the order they were started */
+    qsort(streams, nstreams, sizeof(TraceStream), compareTraceStreams);
+    pids = (TracePid *)calloc(sizeof(TracePid), nstreams);
+    if (pids == NULL) {
+        printerr("calloc: %s\n", strerror(errno));
+        goto unmap;
+    }
+    for (size_t i = 0; i < nstreams; ) {
+        TraceProc tp;
+        memset(&tp, 0, sizeof(tp));
+        size_t j = i;
+        for (; j < nstreams && streams[j].pid == streams[i].pid; j++) {
+            processTraceStream(fullpath, map, end, streams[j].offset, &tp);
+        }
+        if (tp.procs != NULL) {
+            pids[npids].offset = streams[i].offset;
+            pids[npids].procs = tp.procs;
+            npids++;
+        }
+        i = j;
+    }
+
+    /* Merge the results in the order of their first stream */
+    qsort(pids, npids, sizeof(TracePid), compareTracePids);
+    for (size_t i = 0; i < npids; i++) {
+        ProcInfo *p = pids[i].procs;
+        p->prev = lastproc;
+        if (procs == NULL) {
+            procs = p;
+        } else {
+            lastproc->next = p;
+        }
+        lastproc = p;
+        /* If a pid has several processes */
+        while (lastproc->next != NULL) {
+            lastproc = lastproc->next;
+        }
+    }
+
+unmap:
+    munmap(map, st.st_size);
+
+exit:
+    close(fd);
+    free(streams);
+    free(pids);
+
+    /* Remove the file */
+    unlink(fullpath);
 
     return procs;
 }
 
+/* Create the trace file that the processes of the job append to */
+static int createTraceFile(const char *fullpath) {
+    /* Remove the file of an earlier kickstart with the same pid */
+    unlink(fullpath);
+
+    int fd = open(fullpath, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    if (fd < 0) {
+        printerr("Unable to create trace file '%s': %s\n",
+                fullpath, strerror(errno));
+        return -1;
+    }
+
+    TraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.end = TRACE_EXTENT;
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        printerr("Unable to write trace file '%s': %s\n",
+                fullpath, strerror(errno));
+        close(fd);
+        unlink(fullpath);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
 /* Try to get a new environment for the child process that has the tracing vars */
-static void set_tracing_environment(const char *tempdir, const char *trace_file_prefix) {
+static void set_tracing_environment(const char *trace_file) {
     /* If KICKSTART_PREFIX or LD_PRELOAD are already set then we can't trace */
     if (getenv("KICKSTART_PREFIX") != NULL || getenv("LD_PRELOAD") != NULL) {
         return;
@@ -421,10 +781,8 @@ static void set_tracing_environment(const char *tempdir, const char *trace_file_
     }
     setenv("LD_PRELOAD", ld_preload, 1);
 
-    /* Set KICKSTART_PREFIX to be tempdir/prefix */
-    char kickstart_prefix[BUFSIZ];
-    snprintf(kickstart_prefix, BUFSIZ, "%s/%s", tempdir, trace_file_prefix);
-    setenv("KICKSTART_PREFIX", kickstart_prefix, 1);
+    /* Set KICKSTART_PREFIX to the trace file */
+    setenv("KICKSTART_PREFIX", trace_file, 1);
 }
 
 /* Defined in pegasus-kickstart.c */
@@ -437,6 +795,62 @@ void propagate_signal(int sig) {
     }
 }
 
+/* Add the file action that connects a stdio descriptor of the job, like
+ * forcefd() does in the child. Returns 0, or -1 if the stream is not one
+ * that posix_spawn can connect. */
+static int spawnStdio(posix_spawn_file_actions_t *actions, const StatInfo *info, int fd) {
+    if (info->source == IS_HANDLE || info->source == IS_TEMP || info->source == IS_CAPTURE) {
+        if (info->file.descriptor == fd) {
+            return 0;
+        }
+        return posix_spawn_file_actions_adddup2(actions, info->file.descriptor, fd) == 0 ? 0 : -1;
+    }
+    if (info->source == IS_FILE && info->file.name != NULL) {
+        /* Shared stdout/stderr files are always appended to, see forcefd() */
+        int mode = info->file.descriptor;
+        if ((mode & O_ACCMODE) != O_RDONLY) {
+            mode |= O_APPEND;
+        }
+        return posix_spawn_file_actions_addopen(actions, fd, info->file.name, mode, 0666) == 0 ? 0 : -1;
+    }
+    return -1;
+}
+
+/* Start the job with posix_spawn. This is used when kickstart has nothing
+ * to do in the child before exec, which is the case unless the job is
+ * traced, preloads libinterpose or joins a cgroup. posix_spawn does not
+ * copy the page tables of kickstart, which is a large part of the time it
+ * takes to start a short job. Returns the pid of the job, 0 if the job
+ * has to be started with fork instead, or -1 if posix_spawn failed. */
+static pid_t spawnJob(AppInfo* appinfo, JobInfo* jobinfo, const struct sigaction *saved) {
+    /* A signal that was ignored when kickstart started stays ignored in
+     * the job. Only the fork path can put that back, because exec resets
+     * the propagate_signal handler to the default. */
+    for (int i = 0; i < 3; i++) {
+        if (saved[i].sa_handler == SIG_IGN) {
+            return 0;
+        }
+    }
+
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        return 0;
+    }
+    pid_t pid = 0;
+    if (spawnStdio(&actions, &appinfo->input, STDIN_FILENO) == 0 &&
+        spawnStdio(&actions, &appinfo->output, STDOUT_FILENO) == 0 &&
+        spawnStdio(&actions, &appinfo->error, STDERR_FILENO) == 0) {
+        int rc = posix_spawn(&pid, jobinfo->argv[0], &actions, NULL,
+                             (char* const*) jobinfo->argv, environ);
+        if (rc != 0) {
+            errno = rc;
+            pid = -1;
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+}
+
 int mysystem(AppInfo* appinfo, JobInfo* jobinfo) {
     /* purpose: emulate the system() libc call, but save utilization data.
      * paramtr: appinfo (IO): shared record of information
@@ -468,36 +882,57 @@ int mysystem(AppInfo* appinfo, JobInfo* jobinfo) {
     }
 
     /* Pass signals on to child */
-    struct sigaction propagate, saveintr, saveterm, savequit;
+    struct sigaction propagate, saved[3];
     memset(&propagate, 0, sizeof(struct sigaction));
     propagate.sa_handler = propagate_signal;
     sigemptyset(&propagate.sa_mask);
     propagate.sa_flags = 0;
-    if (sigaction(SIGINT, &propagate, &saveintr) < 0) {
+    if (sigaction(SIGINT, &propagate, &saved[0]) < 0) {
         return -1;
     }
-    if (sigaction(SIGTERM, &propagate, &saveterm) < 0) {
+    if (sigaction(SIGTERM, &propagate, &saved[1]) < 0) {
         return -1;
     }
-    if (sigaction(SIGQUIT, &propagate, &savequit) < 0) {
+    if (sigaction(SIGQUIT, &propagate, &saved[2]) < 0) {
         return -1;
     }
 
-    /* Prefix for trace files generated by this job */
-    char trace_file_prefix[128];
-    snprintf(trace_file_prefix, 128, "ks.trace.%d", getpid());
-
-    /* Temp dir where trace files are stored for this job */
+    /* Trace file shared by the processes of this job */
     const char *tempdir = getTempDir();
     if (tempdir == NULL) {
         tempdir = "/tmp";
     }
+    char trace_file[BUFSIZ];
+    snprintf(trace_file, BUFSIZ, "%s/ks.trace.%d", tempdir, getpid());
+
+    /* It has to exist before the first process of the job opens it */
+    int libtrace = appinfo->enableLibTrace && createTraceFile(trace_file) == 0;
+
+    /* The cgroup has to exist before the child can join it */
+    if (appinfo->enableCgroup) {
+        jobinfo->cgroup = procCgroupCreate();
+    }
+
+    /* Without tracing and cgroups nothing has to run in the child
+     * before exec, so the job can be spawned */
+    int spawn = !appinfo->enableTracing && !appinfo->enableLibTrace && jobinfo->cgroup == NULL;
+
+    /* Captured output is read from a pipe that has to exist before the
+     * job starts */
+    startStatInfoCapture(&appinfo->output);
+    startStatInfoCapture(&appinfo->error);
 
     /* start wall-clock */
     now(&(jobinfo->start));
 
-    if ((jobinfo->child=fork()) < 0) {
-        /* no more process table space */
+    /* spawnJob returns 0 if the job has to be forked */
+    jobinfo->child = spawn ? spawnJob(appinfo, jobinfo, saved) : 0;
+    if (jobinfo->child == 0) {
+        jobinfo->child = fork();
+    }
+
+    if (jobinfo->child < 0) {
+        /* no more process table space, or the job could not be spawned */
         jobinfo->status = -1;
     } else if (jobinfo->child == 0) {
         /* child */
@@ -505,8 +940,8 @@ int mysystem(AppInfo* appinfo, JobInfo* jobinfo) {
 
         /* If we are using library tracing, try to set the necessary
            environment variables */
-        if (appinfo->enableLibTrace) {
-            set_tracing_environment(tempdir, trace_file_prefix);
+        if (libtrace) {
+            set_tracing_environment(trace_file);
         }
 
         /* connect jobs stdio */
@@ -515,15 +950,21 @@ int mysystem(AppInfo* appinfo, JobInfo* jobinfo) {
         if (forcefd(&appinfo->error, STDERR_FILENO)) _exit(126);
 
         /* restore signal handlers */
-        sigaction(SIGINT, &saveintr, NULL);
-        sigaction(SIGTERM, &saveterm, NULL);
-        sigaction(SIGQUIT, &savequit, NULL);
+        sigaction(SIGINT, &saved[0], NULL);
+        sigaction(SIGTERM, &saved[1], NULL);
+        sigaction(SIGQUIT, &saved[2], NULL);
 
         /* If we are tracing, then hand over control to the proc module */
         if (appinfo->enableTracing) {
             if (procChild()) _exit(126);
         }
 
+        /* Join the cgroup before exec so that every process of the job is
+         * in it. The job can still run if this fails. */
+        if (jobinfo->cgroup != NULL && procChildCgroup(jobinfo->cgroup) < 0) {
+            printerr("Unable to join cgroup %s: %s\n", jobinfo->cgroup->path, strerror(errno));
+        }
+
         execv(jobinfo->argv[0], (char* const*) jobinfo->argv);
         perror("execv");
         _exit(127); /* executed in child process */
@@ -532,13 +973,30 @@ int mysystem(AppInfo* appinfo, JobInfo* jobinfo) {
         appinfo->currentChild = jobinfo->child;
 
         /* parent */
+        if (appinfo->sampleInterval > 0) {
+            jobinfo->samples = startSampler(jobinfo->child,
+                                            jobinfo->cgroup != NULL ? jobinfo->cgroup->path : NULL,
+                                            appinfo->sampleInterval);
+        }
+
         if (appinfo->enableTracing) {
             /* TODO If this returns an error, then we need to untrace all the children and try the wait instead */
             procParentTrace(jobinfo->child, &jobinfo->status, &jobinfo->use, &(jobinfo->children), appinfo->enableSysTrace);
+        } else if (jobinfo->cgroup != NULL) {
+            procParentCgroup(jobinfo->child, &jobinfo->status, &jobinfo->use, &(jobinfo->children),
+                             jobinfo->cgroup, appinfo->cgroupInterval);
         } else {
             procParentWait(jobinfo->child, &jobinfo->status, &jobinfo->use, &(jobinfo->children));
         }
 
+        if (jobinfo->samples != NULL) {
+            stopSampler(jobinfo->samples);
+        }
+
+        if (jobinfo->cgroup != NULL) {
+            procCgroupFinish(jobinfo->cgroup);
+        }
+
         /* sanity check */
         if (kill(jobinfo->child, 0) == 0) {
             printerr("ERROR: job %d is still running!\n", jobinfo->child);
@@ -556,13 +1014,24 @@ int mysystem(AppInfo* appinfo, JobInfo* jobinfo) {
     now(&(jobinfo->finish));
 
     /* restore signal handlers */
-    sigaction(SIGINT, &saveintr, NULL);
-    sigaction(SIGTERM, &saveterm, NULL);
-    sigaction(SIGQUIT, &savequit, NULL);
-
-    /* Look for trace files from libinterpose and add trace data to jobinfo */
-    if (appinfo->enableLibTrace) {
-        jobinfo->children = processTraceFiles(tempdir, trace_file_prefix);
+    sigaction(SIGINT, &saved[0], NULL);
+    sigaction(SIGTERM, &saved[1], NULL);
+    sigaction(SIGQUIT, &saved[2], NULL);
+
+    /* Add the trace data from libinterpose to jobinfo */
+    if (libtrace) {
+        jobinfo->children = processTraceFile(trace_file);
+
+        /* Let the integrity code use the checksums computed while the
+         * files were written */
+        for (ProcInfo *p = jobinfo->children; p != NULL; p = p->next) {
+            for (FileInfo *f = p->files; f != NULL; f = f->next) {
+                if (f->digest != NULL) {
+                    pegasus_integrity_add_digest(f->filename, f->digest->size,
+                            f->digest->mtime_sec, f->digest->mtime_nsec, f->digest->sha256);
+                }
+            }
+        }
     }
 
     /* finalize */
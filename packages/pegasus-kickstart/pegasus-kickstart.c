@@ -36,6 +36,7 @@
 #include "utils.h"
 #include "version.h"
 #include "ptrace.h"
+#include "parse.h"
 
 #define show(s) (s ? s : "(undefined)")
 
@@ -45,6 +46,12 @@ AppInfo appinfo; /* sigh, needs to be global for signal handlers */
 /* module local globals */
 static volatile sig_atomic_t alarmed = 0;
 static volatile sig_atomic_t skip_atexit = 0;
+static volatile sig_atomic_t batch_signal = 0;
+static int batch_task = 0; /* set in the process forked for a batch command */
+
+/* files to stat before and after the job, shared with batch commands */
+static mylist_t initial;
+static mylist_t final;
 
 static void on_alarm(int signal) {
     /* If this signal handler is invoked, then we need to do something special */
@@ -103,6 +110,19 @@ static int prepareSideJob(JobInfo* scripting, const char* envval) {
     return 1;
 }
 
+/* Number of listed files to stat at a time. KICKSTART_STAT_THREADS
+ * overrides the default. Unlike checksums, stat calls mostly wait on the
+ * file system, so this does not depend on the number of CPUs. */
+#define STAT_THREADS 8
+static int stat_parallelism() {
+    char *value = getenv("KICKSTART_STAT_THREADS");
+    if (value != NULL && strlen(value) > 0) {
+        int n = atoi(value);
+        return n > 0 ? n : 1;
+    }
+    return STAT_THREADS;
+}
+
 /* Initialize the statlist and statlist size in appinfo. */
 StatInfo* initStatFromList(mylist_p list, size_t* size) {
     /* paramtr: list (IN): list of filenames
@@ -120,13 +140,25 @@ StatInfo* initStatFromList(mylist_p list, size_t* size) {
         return NULL;
     }
 
+    const char** names = (const char**) calloc(sizeof(char*), list->count);
+    if (names == NULL) {
+        printerr("calloc: %s\n", strerror(errno));
+        free(result);
+        return NULL;
+    }
+
     size_t i = 0;
-    mylist_item_p item = list->head;
+    mylist_item_p item;
+
+    for (item = list->head; item && i < list->count; item = item->next) {
+        names[i++] = item->pfn;
+    }
+    initStatInfosFromNames(result, names, i, stat_parallelism());
+    free(names);
 
-    while (item && i < list->count) {
-        initStatInfoFromName(result+i, item->pfn, O_RDONLY, 0);
+    i = 0;
+    for (item = list->head; item && i < list->count; item = item->next) {
         if (item->lfn != NULL) addLFNToStatInfo(result+i, item->lfn);
-        item = item->next;
         ++i;
     }
 
@@ -149,6 +181,7 @@ static const char* xlate(const StatInfo* info) {
             return buffer;
         case IS_FIFO:
         case IS_TEMP:
+        case IS_CAPTURE:
         case IS_FILE:
             return show(info->file.name);
         default:
@@ -196,6 +229,8 @@ static void helpMe(const AppInfo* run) {
             " -H\tOmit <?xml ...?> header and <machine> from record. This is used\n"
             "   \tin clustered jobs to supress duplicate information.\n"
             " -I fn\tReads job and args from the file fn, one arg per line.\n"
+            " -b fn\tRuns each command in the batch file fn, or stdin if fn is -.\n"
+            " -j n\tRuns up to n commands of a batch at the same time, default is 1.\n"
             " -V\tDisplays the version and exit.\n"
             " -X\tMakes the application executable, no matter what.\n"
             " -w dir\tSets a different working directory dir for jobs.\n" 
@@ -220,6 +255,7 @@ static void helpMe(const AppInfo* run) {
 #endif
 #ifdef LINUX
             " -Z\tEnable library call interposition to get files and I/O\n"
+            " -g\tEnable resource usage accounting with a cgroup\n"
 #endif
             /* NOTE: If you add another flag to kickstart, please update
              * the argument skipping logic in
@@ -340,33 +376,255 @@ void set_path() {
     }
 }
 
-int main(int argc, char* argv[]) {
-    size_t cwd_size = getpagesize();
-    int status, result = 0;
-    int i, j, keeploop;
-    int createDir = 0;
-    char* temp;
-    char* end;
-    char* workdir = NULL;
-    mylist_t initial;
-    mylist_t final;
+/* Number of output files to checksum at a time. KICKSTART_CHECKSUM_THREADS
+ * overrides the default, which is one per CPU up to CHECKSUM_THREADS. */
+#define CHECKSUM_THREADS 4
+static int checksum_parallelism() {
+    char *value = getenv("KICKSTART_CHECKSUM_THREADS");
+    if (value != NULL && strlen(value) > 0) {
+        int n = atoi(value);
+        return n > 0 ? n : 1;
+    }
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > 0 && ncpus < CHECKSUM_THREADS) {
+        return ncpus;
+    }
+    return CHECKSUM_THREADS;
+}
+
+static int kickstart(int argc, char* argv[]);
+
+static void on_batch_signal(int signal) {
+    batch_signal = signal;
+}
+
+/* Reads the lines of a batch file with read(2) rather than stdio, so that
+ * the processes forked for the commands cannot move the shared file offset
+ * when they exit. */
+typedef struct {
+    int fd;
+    char* buf;
+    size_t size;            /* Allocated size of buf */
+    size_t len;             /* Number of bytes in buf */
+    size_t next;            /* Start of the next line in buf */
+} BatchReader;
+
+static char* batchLine(BatchReader* reader) {
+    /* purpose: read the next line of a batch file
+     * paramtr: reader (IO): the batch file
+     * returns: the line without its line feed, valid until the next call,
+     *          or NULL at the end of the file or on error.
+     */
+    while (1) {
+        char* eol = memchr(reader->buf + reader->next, '\n', reader->len - reader->next);
+        if (eol != NULL) {
+            char* line = reader->buf + reader->next;
+            *eol = '\0';
+            reader->next = eol - reader->buf + 1;
+            return line;
+        }
+
+        /* keep the start of the line and read more */
+        memmove(reader->buf, reader->buf + reader->next, reader->len - reader->next);
+        reader->len -= reader->next;
+        reader->next = 0;
+        if (reader->len + 1 >= reader->size) {
+            size_t size = reader->size == 0 ? 4096 : reader->size * 2;
+            char* buf = realloc(reader->buf, size);
+            if (buf == NULL) {
+                printerr("realloc: %s\n", strerror(errno));
+                return NULL;
+            }
+            reader->buf = buf;
+            reader->size = size;
+        }
+
+        ssize_t n = read(reader->fd, reader->buf + reader->len, reader->size - reader->len - 1);
+        if (n < 0) {
+            if (errno == EINTR && batch_signal == 0) {
+                continue;
+            }
+            if (errno != EINTR) {
+                printerr("Unable to read batch file: %s\n", strerror(errno));
+            }
+            return NULL;
+        }
+        if (n == 0) {
+            /* last line without a line feed */
+            if (reader->len == 0) {
+                return NULL;
+            }
+            reader->buf[reader->len] = '\0';
+            reader->next = reader->len;
+            return reader->buf;
+        }
+        reader->len += n;
+    }
+}
+
+static void batchWait(pid_t* running, int* nrunning, int* failed, int* forwarded) {
+    /* purpose: wait for one of the running batch commands to finish, and
+     *          pass a signal received by the batch on to the commands.
+     * paramtr: running (IO): pids of the running commands
+     *          nrunning (IO): number of running commands
+     *          failed (IO): number of commands that failed
+     *          forwarded (IO): set once the signal was passed on
+     */
+    int status, k;
+
+    if (batch_signal && !*forwarded) {
+        for (k=0; k < *nrunning; ++k) {
+            kill(running[k], batch_signal);
+        }
+        *forwarded = 1;
+    }
+
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+        if (errno != EINTR) {
+            printerr("wait: %s\n", strerror(errno));
+            *nrunning = 0;
+        }
+        return;
+    }
+
+    for (k=0; k < *nrunning; ++k) {
+        if (running[k] == pid) {
+            running[k] = running[--(*nrunning)];
+            break;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        (*failed)++;
+    }
+}
+
+static int runBatch(int fd, int maxjobs, char* self) {
+    /* purpose: run the commands in a batch file, each in a process forked
+     *          from this one, so that the machine and host information and
+     *          the options given before -b are only set up once. Every
+     *          command writes its own invocation record.
+     * paramtr: fd (IN): open batch file
+     *          maxjobs (IN): maximum number of commands to run at a time
+     *          self (IN): argv[0] of kickstart
+     * returns: 0 if all commands succeeded, 1 otherwise
+     */
+    BatchReader reader = { fd, NULL, 0, 0, 0 };
+    int nrunning = 0, failed = 0, forwarded = 0;
+    unsigned long lineno = 0;
+    char* line;
+
+    pid_t* running = calloc(maxjobs, sizeof(pid_t));
+    if (running == NULL) {
+        printerr("calloc: %s\n", strerror(errno));
+        return 1;
+    }
+
+    /* pass signals on to the running commands, and start no new ones */
+    struct sigaction handler, saveintr, saveterm, savequit;
+    handler.sa_handler = on_batch_signal;
+    handler.sa_flags = 0;
+    sigemptyset(&handler.sa_mask);
+    sigaction(SIGINT, &handler, &saveintr);
+    sigaction(SIGTERM, &handler, &saveterm);
+    sigaction(SIGQUIT, &handler, &savequit);
+
+    while (batch_signal == 0 && (line = batchLine(&reader)) != NULL) {
+        ++lineno;
+
+        /* same format as pegasus-cluster: skip empty lines and comments */
+        size_t len = strlen(line);
+        while (len > 0 && line[len-1] == '\r') {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        Node* head = parseCommandLine(line);
+        if (head == NULL) {
+            printerr("Unable to parse line %lu of the batch file\n", lineno);
+            failed++;
+            continue;
+        }
+
+        /* The line may be a complete kickstart command line, as in a
+         * pegasus-cluster input file, or just the command to run */
+        Node* args = head;
+        const char* base = strrchr(args->data, '/');
+        base = (base == NULL) ? args->data : base+1;
+        if (strcmp(base, "pegasus-kickstart") == 0 || strcmp(base, "kickstart") == 0) {
+            args = args->next;
+        }
+
+        int task_argc = countNodes(args) + 1;
+        char** task_argv = calloc(task_argc + 1, sizeof(char*));
+        if (task_argv == NULL) {
+            printerr("calloc: %s\n", strerror(errno));
+            deleteNodes(head);
+            failed++;
+            break;
+        }
+        task_argv[0] = self;
+        for (int k=1; args != NULL; args=args->next) {
+            task_argv[k++] = (char*) args->data;
+        }
+
+        while (nrunning == maxjobs && batch_signal == 0) {
+            batchWait(running, &nrunning, &failed, &forwarded);
+        }
+        if (batch_signal) {
+            free(task_argv);
+            deleteNodes(head);
+            break;
+        }
 
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            printerr("fork: %s\n", strerror(errno));
+            failed++;
+        } else if (pid == 0) {
+            /* child: run the command as if kickstart had been started for it */
+            close(fd);
+            batch_task = 1;
+            sigaction(SIGINT, &saveintr, NULL);
+            sigaction(SIGTERM, &saveterm, NULL);
+            sigaction(SIGQUIT, &savequit, NULL);
+            initTaskAppInfo(&appinfo, task_argc, task_argv);
+            exit(kickstart(task_argc, task_argv));
+        } else {
+            running[nrunning++] = pid;
+        }
+
+        free(task_argv);
+        deleteNodes(head);
+    }
+
+    while (nrunning > 0) {
+        batchWait(running, &nrunning, &failed, &forwarded);
+    }
+
+    sigaction(SIGINT, &saveintr, NULL);
+    sigaction(SIGTERM, &saveterm, NULL);
+    sigaction(SIGQUIT, &savequit, NULL);
+
+    free(running);
+    free(reader.buf);
+
+    return (failed > 0 || batch_signal) ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
     /* premature init with defaults */
     if (mylist_init(&initial)) return 43;
     if (mylist_init(&final)) return 43;
     if (initAppInfo(&appinfo, argc, argv)) return 43;
 
-    /* Set the default status to 1 */
-    appinfo.status = 1;
-
     /* Set the PATH variable before we copy env into appinfo */
     set_path();
-    
-    /* Tell the app where to write integritydata */
-    setenv("KICKSTART_INTEGRITY_DATA", appinfo.integritydata.file.name, 1);
-
-    /* Tell the app where to write metadata */
-    setenv("KICKSTART_METADATA", appinfo.metadata.file.name, 1);
 
     /* register emergency exit handler */
     if (atexit(finish) == -1) {
@@ -381,12 +639,66 @@ int main(int argc, char* argv[]) {
         helpMe(&appinfo);
     }
 
+    return kickstart(argc, argv);
+}
+
+static int kickstart(int argc, char* argv[]) {
+    /* purpose: run one invocation: parse the kickstart options, run the
+     *          job and write its record. This is called once by main(),
+     *          or once for each command of a batch.
+     */
+    size_t cwd_size = getpagesize();
+    int status, result = 0;
+    int i, j, keeploop;
+    int createDir = 0;
+    char* temp;
+    char* end;
+    char* workdir = NULL;
+    char* batchfile = NULL;
+    int batchfd = -1;
+    int batchjobs = 1;
+
+    /* Set the default status to 1 */
+    appinfo.status = 1;
+
+    /* Tell the app where to write integritydata */
+    setenv("KICKSTART_INTEGRITY_DATA", appinfo.integritydata.file.name, 1);
+
+    /* Tell the app where to write metadata */
+    setenv("KICKSTART_METADATA", appinfo.metadata.file.name, 1);
+
     /*
      * read commandline arguments
      */
     for (keeploop=i=1; i < argc && argv[i][0] == '-' && keeploop; ++i) {
         j = i;
         switch (argv[i][1]) {
+            case 'b':
+                if (!argv[i][2] && argc <= i+1) {
+                    fprintf(stderr, "ERROR: -b argument missing\n");
+                    return 127;
+                }
+                if (batch_task) {
+                    fprintf(stderr, "ERROR: -b is not allowed in a batch file\n");
+                    return 127;
+                }
+                batchfile = argv[i][2] ? &argv[i][2] : argv[++i];
+                break;
+            case 'j':
+                if (!argv[i][2] && argc <= i+1) {
+                    fprintf(stderr, "ERROR: -j argument missing\n");
+                    return 127;
+                }
+
+                temp = argv[i][2] ? &argv[i][2] : argv[++i];
+                end = temp;
+                batchjobs = strtol(temp, &end, 0);
+                if (batchjobs < 1 || *end != '\0') {
+                    fprintf(stderr, "ERROR: Invalid -j argument: %s\n", temp);
+                    return 127;
+                }
+
+                break;
             case 'B':
                 if (!argv[i][2] && argc <= i+1) {
                     fprintf(stderr, "ERROR: -B argument missing\n");
@@ -597,6 +909,9 @@ int main(int argc, char* argv[]) {
             case 'Z':
                 appinfo.enableLibTrace++;
                 break;
+            case 'g':
+                appinfo.enableCgroup++;
+                break;
             case 'w':
                 if (!argv[i][2] && argc <= i+1) {
                     fprintf(stderr, "ERROR: -w argument missing\n");
@@ -664,7 +979,22 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    if (argc-i <= 0) {
+    if (batchfile != NULL) {
+        /* the commands come from the batch file */
+        if (argc-i > 0) {
+            fprintf(stderr, "ERROR: No application allowed with -b\n");
+            return 127;
+        }
+
+        /* open it before changing to the working directory */
+        if (strcmp(batchfile, "-") == 0) {
+            batchfd = STDIN_FILENO;
+        } else if ((batchfd = open(batchfile, O_RDONLY)) < 0) {
+            fprintf(stderr, "ERROR: Unable to open batch file %s: %s\n",
+                    batchfile, strerror(errno));
+            return 127;
+        }
+    } else if (argc-i <= 0) {
         /* there is no application to run */
         helpMe(&appinfo);
     }
@@ -696,6 +1026,22 @@ REDIR:
         return 127;
     }
 
+    /* the commands of a batch run in the working directory of the batch,
+     * unless they have their own */
+    if (batchfd >= 0) {
+        result = runBatch(batchfd, batchjobs, argv[0]);
+        if (batchfd != STDIN_FILENO) {
+            close(batchfd);
+        }
+        mylist_done(&initial);
+        mylist_done(&final);
+
+        /* the batch itself has no record */
+        skip_atexit = 1;
+        deleteAppInfo(&appinfo);
+        return result;
+    }
+
 
     /* initialize app info and register CLI parameters with it */
     initJobInfo(&appinfo.application, argc-i, argv+i, getenv("KICKSTART_WRAPPER"));
@@ -727,6 +1073,18 @@ REDIR:
     updateStatInfo(&appinfo.error);
     updateStatInfo(&appinfo.logfile);
 
+    /* How often to look at the processes of a job in its cgroup */
+    char *interval = getenv("KICKSTART_CGROUP_INTERVAL");
+    if (interval != NULL && strlen(interval) > 0) {
+        appinfo.cgroupInterval = atof(interval);
+    }
+
+    /* How often to sample the resource usage of a job while it runs */
+    interval = getenv("KICKSTART_SAMPLE_INTERVAL");
+    if (interval != NULL && strlen(interval) > 0) {
+        appinfo.sampleInterval = atof(interval);
+    }
+
     /* stat pre files */
     appinfo.initial = initStatFromList(&initial, &appinfo.icount);
     mylist_done(&initial);
@@ -795,6 +1153,7 @@ REDIR:
     /* stat post files */
     appinfo.final = initStatFromList(&final, &appinfo.fcount);
     mylist_done(&final);
+    checksumStatInfos(appinfo.final, appinfo.fcount, checksum_parallelism());
 
     /* If the timeout occurred, then set the result to SIGALRM */
     if (alarmed) {
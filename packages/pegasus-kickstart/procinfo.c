@@ -27,6 +27,8 @@
 #include <sys/time.h>
 #include <limits.h>
 #include <errno.h>
+#include <mntent.h>
+#include <sys/stat.h>
 
 #include "procinfo.h"
 #include "utils.h"
@@ -34,8 +36,10 @@
 #include "error.h"
 
 #ifdef HAS_PTRACE
-
 #include <sys/user.h> /* struct user_regs_struct */
+#endif
+
+#ifdef LINUX
 
 /* Find ProcInfo in a list by pid */
 static ProcInfo *proc_lookup(ProcInfo **list, pid_t pid) {
@@ -481,6 +485,477 @@ int procParentWait(pid_t main, int *main_status,  struct rusage *main_usage, Pro
     return *main_status;
 }
 
+#ifdef LINUX
+
+/* Return the directory where the cgroup v2 hierarchy is mounted */
+static char *cgroup_mount() {
+    FILE *f = setmntent("/proc/self/mounts", "r");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    char *dir = NULL;
+    struct mntent *m;
+    while ((m = getmntent(f)) != NULL) {
+        if (strcmp(m->mnt_type, "cgroup2") == 0) {
+            dir = strdup(m->mnt_dir);
+            break;
+        }
+    }
+
+    endmntent(f);
+    return dir;
+}
+
+/* Return the cgroup v2 path of kickstart, relative to the mount point */
+static char *cgroup_self() {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    char *path = NULL;
+    char line[BUFSIZ];
+    while (fgets(line, BUFSIZ, f) != NULL) {
+        /* The v2 hierarchy has ID 0 and no controllers */
+        if (startswith(line, "0::")) {
+            line[strcspn(line, "\n")] = '\0';
+            path = strdup(line + 3);
+            break;
+        }
+    }
+
+    fclose(f);
+    return path;
+}
+
+/* Write value to the file name in the cgroup directory dir */
+static int cgroup_write(const char *dir, const char *name, const char *value) {
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    /* cgroup files report errors when the buffer is flushed */
+    int rc = fputs(value, f) < 0 ? -1 : 0;
+    if (fclose(f) != 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+/* Open the file name in the cgroup directory dir */
+static FILE *cgroup_open(const char *dir, const char *name) {
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+        return NULL;
+    }
+    return fopen(path, "r");
+}
+
+/* Read a file in the cgroup directory dir that holds a single number */
+static int cgroup_read_value(const char *dir, const char *name, uint64_t *value) {
+    FILE *f = cgroup_open(dir, name);
+    if (f == NULL) {
+        return -1;
+    }
+    int rc = fscanf(f, "%"SCNu64, value) == 1 ? 0 : -1;
+    fclose(f);
+    return rc;
+}
+
+/* kickstart runs its jobs in a sub-tree of the cgroup it was started in:
+ *
+ *   <self>/kickstart-<pid>/supervisor   kickstart itself
+ *   <self>/kickstart-<pid>/job-<n>      one group for each job
+ *
+ * Controllers can only be enabled for the children of a group that has no
+ * processes of its own, so kickstart moves into the supervisor leaf before
+ * it enables them, and only in kickstart-<pid>. The group kickstart was
+ * started in is never changed. The sub-tree is removed when kickstart
+ * exits. */
+static char *cgroup_home = NULL;
+static char *cgroup_top = NULL;
+static pid_t cgroup_owner = 0;
+
+/* Move kickstart to the cgroup directory dir */
+static int cgroup_move_self(const char *dir) {
+    char pid[32];
+    snprintf(pid, sizeof(pid), "%d", getpid());
+    return cgroup_write(dir, "cgroup.procs", pid);
+}
+
+/* Move kickstart back to the group it was started in and remove its
+ * sub-tree. Registered with atexit, so children that exit are ignored. */
+static void cgroup_remove_tree() {
+    if (cgroup_top == NULL || getpid() != cgroup_owner) {
+        return;
+    }
+
+    char supervisor[PATH_MAX];
+    snprintf(supervisor, PATH_MAX, "%s/supervisor", cgroup_top);
+    if (cgroup_move_self(cgroup_home) < 0) {
+        printerr("Unable to move kickstart back to cgroup %s: %s\n", cgroup_home, strerror(errno));
+    } else if (rmdir(supervisor) < 0 || rmdir(cgroup_top) < 0) {
+        printerr("Unable to remove cgroup %s: %s\n", cgroup_top, strerror(errno));
+    }
+
+    free(cgroup_home);
+    free(cgroup_top);
+    cgroup_home = NULL;
+    cgroup_top = NULL;
+}
+
+/* Create the sub-tree of kickstart the first time a job needs a cgroup */
+static int cgroup_setup() {
+    if (cgroup_top != NULL) {
+        return 0;
+    }
+
+    char *mount = cgroup_mount();
+    if (mount == NULL) {
+        printerr("Unable to use cgroup accounting: cgroup v2 is not mounted\n");
+        return -1;
+    }
+
+    int rc = -1;
+    char *self = cgroup_self();
+    if (self == NULL) {
+        printerr("Unable to use cgroup accounting: kickstart is not in a cgroup v2 group\n");
+        goto out;
+    }
+
+    char home[PATH_MAX];
+    char top[PATH_MAX];
+    char supervisor[PATH_MAX];
+    snprintf(home, PATH_MAX, "%s%s", mount, strcmp(self, "/") == 0 ? "" : self);
+    if (snprintf(top, PATH_MAX, "%s/kickstart-%d", home, getpid()) >= PATH_MAX ||
+            snprintf(supervisor, PATH_MAX, "%s/supervisor", top) >= PATH_MAX) {
+        printerr("Unable to use cgroup accounting: cgroup path is too long\n");
+        goto out;
+    }
+
+    if (mkdir(top, 0755) < 0) {
+        printerr("Unable to create cgroup %s: %s\n", top, strerror(errno));
+        goto out;
+    }
+    if (mkdir(supervisor, 0755) < 0) {
+        printerr("Unable to create cgroup %s: %s\n", supervisor, strerror(errno));
+        rmdir(top);
+        goto out;
+    }
+    if (cgroup_move_self(supervisor) < 0) {
+        printerr("Unable to move kickstart to cgroup %s: %s\n", supervisor, strerror(errno));
+        rmdir(supervisor);
+        rmdir(top);
+        goto out;
+    }
+
+    /* Ask for as many controllers as we can get. This fails if the group
+     * kickstart was started in doesn't have them, or isn't allowed to
+     * delegate them, in which case the corresponding totals are left out. */
+    const char *controllers[] = { "cpu", "memory", "io", "pids" };
+    for (int i = 0; i < 4; i++) {
+        char enable[16];
+        snprintf(enable, sizeof(enable), "+%s", controllers[i]);
+        if (cgroup_write(top, "cgroup.subtree_control", enable) < 0) {
+            printerr("Unable to enable the %s cgroup controller in %s: %s\n",
+                     controllers[i], top, strerror(errno));
+        }
+    }
+
+    cgroup_home = strdup(home);
+    cgroup_top = strdup(top);
+    cgroup_owner = getpid();
+    atexit(cgroup_remove_tree);
+    rc = 0;
+
+out:
+    free(self);
+    free(mount);
+    return rc;
+}
+
+CgroupInfo *procCgroupCreate() {
+    static int count = 0;
+
+    if (cgroup_setup() < 0) {
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/job-%d", cgroup_top, count++) >= PATH_MAX) {
+        printerr("Unable to use cgroup accounting: cgroup path is too long\n");
+        return NULL;
+    }
+
+    if (mkdir(path, 0755) < 0) {
+        printerr("Unable to create cgroup %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    CgroupInfo *cg = (CgroupInfo *)calloc(1, sizeof(CgroupInfo));
+    if (cg == NULL) {
+        printerr("calloc: %s\n", strerror(errno));
+        rmdir(path);
+        return NULL;
+    }
+    cg->path = strdup(path);
+    if (cg->path == NULL) {
+        printerr("strdup: %s\n", strerror(errno));
+        rmdir(path);
+        free(cg);
+        return NULL;
+    }
+    return cg;
+}
+
+int procChildCgroup(CgroupInfo *cg) {
+    char pid[32];
+    snprintf(pid, sizeof(pid), "%d", getpid());
+    return cgroup_write(cg->path, "cgroup.procs", pid);
+}
+
+/* Update the record of a process in a cgroup from /proc */
+static void cgroup_read_proc(ProcInfo *p) {
+    /* Read the exe every time, because the process may not have called
+     * exec yet when it was first seen. Processes can exit at any time, so
+     * failures are not reported. */
+    char link[64];
+    char exe[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/%d/exe", p->pid);
+    ssize_t size = readlink(link, exe, sizeof(exe) - 1);
+    if (size > 0) {
+        exe[size] = '\0';
+        if (p->exe == NULL || strcmp(p->exe, exe) != 0) {
+            free(p->exe);
+            p->exe = strdup(exe);
+        }
+    }
+
+    proc_read_meminfo(p);
+    proc_read_statinfo(p);
+    proc_read_io(p);
+}
+
+/* Count the processes in the cgroup. If details is set, then also update
+ * their records from /proc. Returns -1 on error. */
+static int cgroup_poll(CgroupInfo *cg, ProcInfo **procs, int details) {
+    FILE *f = cgroup_open(cg->path, "cgroup.procs");
+    if (f == NULL) {
+        return -1;
+    }
+
+    int n = 0;
+    pid_t pid;
+    while (fscanf(f, "%d", &pid) == 1) {
+        n++;
+        if (!details) {
+            continue;
+        }
+
+        double now = get_time();
+        ProcInfo *p = proc_lookup(procs, pid);
+        if (p == NULL) {
+            p = proc_add(procs, pid);
+            if (p == NULL) {
+                continue;
+            }
+            p->start = now;
+        }
+        cgroup_read_proc(p);
+        /* The process was alive at least until now */
+        p->stop = now;
+    }
+
+    fclose(f);
+    return n;
+}
+
+int procParentCgroup(pid_t main, int *main_status, struct rusage *main_usage,
+                     ProcInfo **procs, CgroupInfo *cg, double interval) {
+    /* How often to check if the job is done */
+    const double tick = 0.01;
+
+    /* The main process is added now, because it may not be in the cgroup
+     * yet. Other processes get the time of the first poll that sees them,
+     * and the time of the last poll that saw them as their stop time. */
+    ProcInfo *mainproc = interval > 0 ? proc_add(procs, main) : NULL;
+    if (mainproc != NULL) {
+        mainproc->ppid = getpid();
+        mainproc->start = get_time();
+    }
+
+    int running = 1;
+    double next_poll = get_time() + tick;
+    while (1) {
+        if (running) {
+            /* Look at the main process once more before reaping it */
+            siginfo_t si;
+            memset(&si, 0, sizeof(si));
+            if (waitid(P_PID, main, &si, WEXITED|WNOHANG|WNOWAIT) < 0) {
+                if (errno != EINTR) {
+                    perror("waitid");
+                    *main_status = -42;
+                    running = 0;
+                }
+            } else if (si.si_pid == main) {
+                if (mainproc != NULL) {
+                    mainproc->stop = get_time();
+                    cgroup_read_proc(mainproc);
+                }
+                while (wait4(main, main_status, 0, main_usage) < 0) {
+                    if (errno != EINTR) {
+                        perror("wait4");
+                        *main_status = -42;
+                        break;
+                    }
+                }
+                running = 0;
+            }
+        }
+
+        double now = get_time();
+        int details = interval > 0 && now >= next_poll;
+        if (details) {
+            next_poll = now + interval;
+        }
+
+        /* Keep going until every process in the job is gone, like
+         * procParentTrace does */
+        int n = cgroup_poll(cg, procs, details);
+        if (!running && n <= 0) {
+            break;
+        }
+
+        struct timespec ts = { 0, (long)(tick * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+
+    /* ensure we have non-zero usage - our smallest unit is 0.001s */
+    if (main_usage->ru_stime.tv_sec == 0 && main_usage->ru_stime.tv_usec < 1000) {
+        main_usage->ru_stime.tv_usec = 1000;
+    }
+    if (main_usage->ru_utime.tv_sec == 0 && main_usage->ru_utime.tv_usec < 1000) {
+        main_usage->ru_utime.tv_usec = 1000;
+    }
+    return *main_status;
+}
+
+void procCgroupFinish(CgroupInfo *cg) {
+    char line[BUFSIZ];
+    FILE *f;
+
+    /* cpu.stat is there even without the cpu controller */
+    if ((f = cgroup_open(cg->path, "cpu.stat")) != NULL) {
+        while (fgets(line, BUFSIZ, f) != NULL) {
+            if (sscanf(line, "user_usec %"SCNu64, &cg->user_usec) == 1) {
+                cg->have_cpu = 1;
+            } else {
+                sscanf(line, "system_usec %"SCNu64, &cg->system_usec);
+            }
+        }
+        fclose(f);
+    }
+
+    /* memory.peak and pids.peak are fairly new. Without them there is no
+     * way to get the peaks once the job is gone, so they are left out. */
+    cg->have_memory = cgroup_read_value(cg->path, "memory.peak", &cg->memory_peak) == 0;
+    cg->have_pids = cgroup_read_value(cg->path, "pids.peak", &cg->pids_peak) == 0;
+
+    /* io.stat has one line per device */
+    if ((f = cgroup_open(cg->path, "io.stat")) != NULL) {
+        cg->have_io = 1;
+        while (fgets(line, BUFSIZ, f) != NULL) {
+            char *tok = strtok(line, " \n");
+            while ((tok = strtok(NULL, " \n")) != NULL) {
+                uint64_t value;
+                if (sscanf(tok, "rbytes=%"SCNu64, &value) == 1) {
+                    cg->rbytes += value;
+                } else if (sscanf(tok, "wbytes=%"SCNu64, &value) == 1) {
+                    cg->wbytes += value;
+                } else if (sscanf(tok, "rios=%"SCNu64, &value) == 1) {
+                    cg->rios += value;
+                } else if (sscanf(tok, "wios=%"SCNu64, &value) == 1) {
+                    cg->wios += value;
+                }
+            }
+        }
+        fclose(f);
+    }
+
+    if (rmdir(cg->path) < 0) {
+        printerr("Unable to remove cgroup %s: %s\n", cg->path, strerror(errno));
+    }
+}
+
+#else
+
+CgroupInfo *procCgroupCreate() {
+    printerr("Unable to use cgroup accounting: only available on Linux\n");
+    return NULL;
+}
+
+int procChildCgroup(CgroupInfo *cg) {
+    return -1;
+}
+
+int procParentCgroup(pid_t main, int *main_status, struct rusage *main_usage,
+                     ProcInfo **procs, CgroupInfo *cg, double interval) {
+    return procParentWait(main, main_status, main_usage, procs);
+}
+
+void procCgroupFinish(CgroupInfo *cg) {
+}
+
+#endif
+
+int printYAMLCgroupInfo(FILE *out, int indent, CgroupInfo *cg) {
+    fprintf(out, "%*scgroup:\n", indent, "");
+    fprintf(out, "%*s  path: %s\n", indent, "", cg->path);
+    if (cg->have_cpu) {
+        fprintf(out, "%*s  utime: %.3lf\n", indent, "", cg->user_usec / 1e6);
+        fprintf(out, "%*s  stime: %.3lf\n", indent, "", cg->system_usec / 1e6);
+    }
+    if (cg->have_memory) {
+        fprintf(out, "%*s  memory_peak: %"PRIu64"\n", indent, "", cg->memory_peak);
+    }
+    if (cg->have_io) {
+        fprintf(out, "%*s  rbytes: %"PRIu64"\n", indent, "", cg->rbytes);
+        fprintf(out, "%*s  wbytes: %"PRIu64"\n", indent, "", cg->wbytes);
+        fprintf(out, "%*s  rios: %"PRIu64"\n", indent, "", cg->rios);
+        fprintf(out, "%*s  wios: %"PRIu64"\n", indent, "", cg->wios);
+    }
+    if (cg->have_pids) {
+        fprintf(out, "%*s  pids_peak: %"PRIu64"\n", indent, "", cg->pids_peak);
+    }
+    return 0;
+}
+
+void deleteCgroupInfo(CgroupInfo *cg) {
+    if (cg == NULL) {
+        return;
+    }
+    free(cg->path);
+    free(cg);
+}
+
+/* Print the buckets of a histogram up to the last one that isn't empty */
+static void printHistogram(FILE *out, const char *sep, const uint64_t *buckets) {
+    int n = LATENCY_BUCKETS;
+    while (n > 0 && buckets[n-1] == 0) {
+        n--;
+    }
+    for (int b = 0; b < n; b++) {
+        fprintf(out, "%s%"PRIu64, b == 0 ? "" : sep, buckets[b]);
+    }
+}
+
 static int printXMLFileInfo(FILE *out, int indent, FileInfo *files) {
     FileInfo *i;
     for (i = files; i != NULL; i = i->next) {
@@ -488,13 +963,210 @@ static int printXMLFileInfo(FILE *out, int indent, FileInfo *files) {
                 "bread=\"%"PRIu64"\" nread=\"%"PRIu64"\" "
                 "bwrite=\"%"PRIu64"\" nwrite=\"%"PRIu64"\" "
                 "bseek=\"%"PRIu64"\" nseek=\"%"PRIu64"\" "
-                "size=\"%"PRIu64"\"/>\n",
+                "size=\"%"PRIu64"\"",
                 indent, "", i->filename, i->bread, i->nread,
                 i->bwrite, i->nwrite, i->bseek, i->nseek, i->size);
+        /* Only files that were mapped or used with io_uring get these */
+        if (i->nmmap > 0) {
+            fprintf(out, " nmmap=\"%"PRIu64"\" bmmap=\"%"PRIu64"\" bfault=\"%"PRIu64"\"",
+                    i->nmmap, i->bmmap, i->bfault);
+        }
+        if (i->nuring > 0) {
+            fprintf(out, " nuring=\"%"PRIu64"\" buring=\"%"PRIu64"\"",
+                    i->nuring, i->buring);
+        }
+        fprintf(out, "%s>\n", i->latency == NULL ? "/" : "");
+        if (i->latency != NULL) {
+            const char *ops[] = { "read", "write", "meta" };
+            const uint64_t *hists[] = { i->latency->read, i->latency->write, i->latency->meta };
+            for (int h = 0; h < 3; h++) {
+                fprintf(out, "%*s  <latency op=\"%s\" buckets=\"", indent, "", ops[h]);
+                printHistogram(out, " ", hists[h]);
+                fprintf(out, "\"/>\n");
+            }
+            fprintf(out, "%*s</file>\n", indent, "");
+        }
     }
     return 0;
 }
 
+/* Mount points from /proc/self/mounts */
+typedef struct {
+    char **dirs;
+    int n;
+} Mounts;
+
+static void readMounts(Mounts *m) {
+    m->dirs = NULL;
+    m->n = 0;
+
+    FILE *f = setmntent("/proc/self/mounts", "r");
+    if (f == NULL) {
+        return;
+    }
+
+    int size = 0;
+    struct mntent *ent;
+    while ((ent = getmntent(f)) != NULL) {
+        if (m->n == size) {
+            size = size == 0 ? 32 : size * 2;
+            char **dirs = realloc(m->dirs, sizeof(char *) * size);
+            if (dirs == NULL) {
+                break;
+            }
+            m->dirs = dirs;
+        }
+        m->dirs[m->n] = strdup(ent->mnt_dir);
+        if (m->dirs[m->n] != NULL) {
+            m->n++;
+        }
+    }
+
+    endmntent(f);
+}
+
+static void freeMounts(Mounts *m) {
+    for (int i = 0; i < m->n; i++) {
+        free(m->dirs[i]);
+    }
+    free(m->dirs);
+}
+
+/* Return the index of the mount that contains path, or -1 */
+static int findMount(Mounts *m, const char *path) {
+    int best = -1;
+    size_t bestlen = 0;
+    for (int i = 0; i < m->n; i++) {
+        size_t len = strlen(m->dirs[i]);
+        if (strncmp(path, m->dirs[i], len) != 0) {
+            continue;
+        }
+        /* "/" contains everything, /a contains /a/b but not /ab */
+        if (len > 1 && path[len] != '/' && path[len] != '\0') {
+            continue;
+        }
+        if (best < 0 || len >= bestlen) {
+            best = i;
+            bestlen = len;
+        }
+    }
+    return best;
+}
+
+/* Print the latency histograms of the files in a process, added up for
+ * each mount point */
+static void printYAMLMountLatency(FILE *out, int indent, FileInfo *files, Mounts *mounts) {
+    if (mounts->n == 0) {
+        return;
+    }
+
+    Latency *totals = NULL;
+    for (FileInfo *f = files; f != NULL; f = f->next) {
+        if (f->latency == NULL) {
+            continue;
+        }
+        int m = findMount(mounts, f->filename);
+        if (m < 0) {
+            continue;
+        }
+        if (totals == NULL) {
+            totals = (Latency *)calloc(sizeof(Latency), mounts->n);
+            if (totals == NULL) {
+                printerr("calloc: %s\n", strerror(errno));
+                return;
+            }
+        }
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            totals[m].read[b] += f->latency->read[b];
+            totals[m].write[b] += f->latency->write[b];
+            totals[m].meta[b] += f->latency->meta[b];
+        }
+    }
+
+    if (totals == NULL) {
+        return;
+    }
+
+    fprintf(out, "%*sio_latency:\n", indent, "");
+    for (int m = 0; m < mounts->n; m++) {
+        Latency *l = &totals[m];
+        const char *ops[] = { "read", "write", "meta" };
+        const uint64_t *hists[] = { l->read, l->write, l->meta };
+        int used = 0;
+        for (int h = 0; h < 3; h++) {
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                used |= hists[h][b] != 0;
+            }
+        }
+        if (!used) {
+            continue;
+        }
+        fprintf(out, "%*s  \"%s\":\n", indent, "", mounts->dirs[m]);
+        for (int h = 0; h < 3; h++) {
+            fprintf(out, "%*s    %s: [", indent, "", ops[h]);
+            printHistogram(out, ", ", hists[h]);
+            fprintf(out, "]\n");
+        }
+    }
+
+    free(totals);
+}
+
+/* Value of a PAPI event for a process, or -1 if it was not counted */
+static long long papiValue(ProcInfo *p, const char *event) {
+    for (int i=0; i<p->npapi; i++) {
+        if (strcmp(p->papi[i].event, event) == 0) {
+            return p->papi[i].value;
+        }
+    }
+    return -1;
+}
+
+/* Print the hardware counters of a process, and the metrics derived from
+ * them that can be compared between jobs */
+static void printYAMLPAPIInfo(FILE *out, int indent, ProcInfo *p) {
+    if (p->npapi == 0) {
+        return;
+    }
+
+    fprintf(out, "%*spapi:\n", indent, "");
+    for (int i=0; i<p->npapi; i++) {
+        fprintf(out, "%*s%s: %lld\n", indent+2, "", p->papi[i].event, p->papi[i].value);
+    }
+
+    long long ins = papiValue(p, "PAPI_TOT_INS");
+    long long cyc = papiValue(p, "PAPI_TOT_CYC");
+    if (ins >= 0 && cyc > 0) {
+        fprintf(out, "%*sipc: %.3lf\n", indent+2, "", (double)ins / cyc);
+    }
+
+    /* Misses per access where the accesses were counted, and per
+     * thousand instructions */
+    static const char *levels[] = { "L1", "L2", "L3" };
+    for (int l=0; l<3; l++) {
+        char event[16];
+        snprintf(event, sizeof(event), "PAPI_%s_TCM", levels[l]);
+        long long tcm = papiValue(p, event);
+        if (tcm < 0) {
+            continue;
+        }
+        snprintf(event, sizeof(event), "PAPI_%s_TCA", levels[l]);
+        long long tca = papiValue(p, event);
+        if (tca > 0) {
+            fprintf(out, "%*sl%d_miss_rate: %.4lf\n", indent+2, "", l+1, (double)tcm / tca);
+        }
+        if (ins > 0) {
+            fprintf(out, "%*sl%d_mpki: %.3lf\n", indent+2, "", l+1, tcm * 1000.0 / ins);
+        }
+    }
+
+    long long flops = papiValue(p, "PAPI_FP_OPS");
+    double seconds = p->stop - p->start;
+    if (flops >= 0 && seconds > 0) {
+        fprintf(out, "%*sflops: %.0lf\n", indent+2, "", flops / seconds);
+    }
+}
+
 static int printXMLSockInfo(FILE *out, int indent, SockInfo *sockets) {
     SockInfo *i;
     for (i = sockets; i != NULL; i = i->next) {
@@ -508,6 +1180,12 @@ static int printXMLSockInfo(FILE *out, int indent, SockInfo *sockets) {
 /* Write <proc> records to buffer */
 int printYAMLProcInfo(FILE *out, int indent, ProcInfo* procs) {
     fprintf(out, "%*sprocs:\n", indent, "");
+    /* Only traced jobs have processes, so the mount table is not read
+     * for the others */
+    Mounts mounts = { NULL, 0 };
+    if (procs != NULL) {
+        readMounts(&mounts);
+    }
     ProcInfo *i;
     for (i = procs; i; i = i->next) {
         /* This means that the trace file was probably incomplete */
@@ -558,32 +1236,12 @@ int printYAMLProcInfo(FILE *out, int indent, ProcInfo* procs) {
                      indent, "", i->syscr,
                      indent, "", i->syscw
         );
-#ifdef HAS_PAPI
-        if (i->PAPI_TOT_INS > 0) {
-            fprintf(out, " totins=\"%lld\"", i->PAPI_TOT_INS);
-        }
-        if (i->PAPI_LD_INS > 0) {
-            fprintf(out, " ldins=\"%lld\"", i->PAPI_LD_INS);
-        }
-        if (i->PAPI_SR_INS > 0) {
-            fprintf(out, " srins=\"%lld\"", i->PAPI_SR_INS);
+        if (i->io_sample > 1) {
+            fprintf(out, "%*s    io_sample: %d # file and socket I/O counts are estimates\n",
+                    indent, "", i->io_sample);
         }
-        if (i->PAPI_FP_INS > 0) {
-            fprintf(out, " fpins=\"%lld\"", i->PAPI_FP_INS);
-        }
-        if (i->PAPI_FP_OPS > 0) {
-            fprintf(out, " fpops=\"%lld\"", i->PAPI_FP_OPS);
-        }
-        if (i->PAPI_L3_TCM > 0) {
-            fprintf(out, " l3misses=\"%lld\"", i->PAPI_L3_TCM);
-        }
-        if (i->PAPI_L2_TCM > 0) {
-            fprintf(out, " l2misses=\"%lld\"", i->PAPI_L2_TCM);
-        }
-        if (i->PAPI_L1_TCM > 0) {
-            fprintf(out, " l1misses=\"%lld\"", i->PAPI_L1_TCM);
-        }
-#endif
+        printYAMLMountLatency(out, indent+4, i->files, &mounts);
+        printYAMLPAPIInfo(out, indent+4, i);
         if ( ! (i->cmd == NULL && i->files == NULL && i->sockets == NULL)) {
             if (i->cmd != NULL) {
                 fprintf(out, "%*scmd:\n", indent+4, "");
@@ -594,6 +1252,7 @@ int printYAMLProcInfo(FILE *out, int indent, ProcInfo* procs) {
             printXMLSockInfo(out, indent+4, i->sockets);
         }
     }
+    freeMounts(&mounts);
     return 0;
 }
 
@@ -604,10 +1263,16 @@ void deleteProcInfo(ProcInfo *procs) {
         if (p->cmd != NULL) {
             free(p->cmd);
         }
+        for (int i=0; i<p->npapi; i++) {
+            free(p->papi[i].event);
+        }
+        free(p->papi);
         FileInfo *files = p->files;
         while (files != NULL) {
             FileInfo *f = files;
             files = files->next;
+            free(f->latency);
+            free(f->digest);
             free(f);
         }
         SockInfo *sockets = p->sockets;
@@ -10,6 +10,25 @@
 
 #define SC_ARGS 6
 
+#define LATENCY_BUCKETS 32  /* Same as TRACE_BUCKETS in tracefile.h */
+
+/* I/O latency histograms. Bucket 0 counts calls that took less than 1 ns,
+ * and bucket i counts calls that took at least 2^(i-1) ns and less than
+ * 2^i ns. The last bucket also counts all slower calls. */
+typedef struct {
+    uint64_t read[LATENCY_BUCKETS];
+    uint64_t write[LATENCY_BUCKETS];
+    uint64_t meta[LATENCY_BUCKETS]; /* open and close */
+} Latency;
+
+/* Checksum of the data written to a file, computed by libinterpose */
+typedef struct {
+    uint64_t size;          /* Size of the file when it was closed */
+    int64_t mtime_sec;      /* Modification time when it was closed */
+    int64_t mtime_nsec;
+    unsigned char sha256[32];
+} Digest;
+
 typedef struct _FileInfo {
     char *filename;         /* Name of the file */
     uint64_t bread;         /* Number of bytes read */
@@ -19,6 +38,13 @@ typedef struct _FileInfo {
     uint64_t nwrite;        /* Number of write operations */
     uint64_t bseek;         /* Total seek distance */
     uint64_t nseek;         /* Number of seek operations */
+    uint64_t nmmap;         /* Number of mmap calls */
+    uint64_t bmmap;         /* Number of bytes mapped */
+    uint64_t bfault;        /* Estimated bytes read through mappings */
+    uint64_t nuring;        /* Number of io_uring requests submitted */
+    uint64_t buring;        /* Bytes requested by io_uring reads and writes */
+    Latency *latency;       /* I/O latency, or NULL if it wasn't timed */
+    Digest *digest;         /* Checksum, or NULL if there isn't one */
     struct _FileInfo *next;
 } FileInfo;
 
@@ -32,6 +58,12 @@ typedef struct _SockInfo {
     struct _SockInfo *next;
 } SockInfo;
 
+/* Total of one PAPI event for a process */
+typedef struct {
+    char *event;            /* PAPI event name, e.g. PAPI_TOT_INS */
+    long long value;
+} PAPICounter;
+
 typedef struct _ProcInfo {
     pid_t pid;              /* Process ID */
     pid_t ppid;             /* Parent pid */
@@ -53,6 +85,7 @@ typedef struct _ProcInfo {
     int max_threads;        /* Peak number of threads */
     int tot_threads;        /* Total number of threads */
     int fin_threads;        /* Number of threads when process exited */
+    int io_sample;          /* I/O sampling rate, or 0 if all calls were counted */
 
     /* Keeping track of system calls in progress */
     int insyscall;          /* in a system call? */
@@ -65,14 +98,8 @@ typedef struct _ProcInfo {
 
     SockInfo *sockets;      /* Linked list of sockets */
 
-    long long PAPI_TOT_INS; /* Total instructions */
-    long long PAPI_LD_INS;  /* Load instructions */
-    long long PAPI_SR_INS;  /* Store instructions */
-    long long PAPI_FP_INS;  /* Floating point instructions */
-    long long PAPI_FP_OPS;  /* Floating point ops */
-    long long PAPI_L3_TCM;  /* L3 cache misses */
-    long long PAPI_L2_TCM;  /* L2 cache misses */
-    long long PAPI_L1_TCM;  /* L1 cache misses */
+    PAPICounter *papi;      /* Hardware counters, added up over all threads */
+    int npapi;
 
     char *cmd;              /* Command line */
 
@@ -80,10 +107,35 @@ typedef struct _ProcInfo {
     struct _ProcInfo *prev;
 } ProcInfo;
 
+/* Totals for a job from the cgroup v2 group it runs in. The have_ flags
+ * say which controllers were available. */
+typedef struct {
+    char *path;             /* Directory of the cgroup */
+    int have_cpu;
+    int have_memory;
+    int have_io;
+    int have_pids;
+    uint64_t user_usec;     /* cpu.stat */
+    uint64_t system_usec;
+    uint64_t memory_peak;   /* memory.peak, in bytes */
+    uint64_t rbytes;        /* io.stat, added up over all devices */
+    uint64_t wbytes;
+    uint64_t rios;
+    uint64_t wios;
+    uint64_t pids_peak;     /* pids.peak */
+} CgroupInfo;
+
 int procChild();
 int procParentTrace(pid_t main, int* main_status, struct rusage* main_usage, ProcInfo** procs, int interpose);
 int procParentWait(pid_t main, int* main_status, struct rusage* main_usage, ProcInfo** procs);
 int printYAMLProcInfo(FILE *out, int indent, ProcInfo* procs);
 void deleteProcInfo(ProcInfo *list);
+CgroupInfo *procCgroupCreate();
+int procChildCgroup(CgroupInfo *cg);
+int procParentCgroup(pid_t main, int* main_status, struct rusage* main_usage,
+                     ProcInfo** procs, CgroupInfo *cg, double interval);
+void procCgroupFinish(CgroupInfo *cg);
+int printYAMLCgroupInfo(FILE *out, int indent, CgroupInfo *cg);
+void deleteCgroupInfo(CgroupInfo *cg);
 
 #endif /* _PROC_H */
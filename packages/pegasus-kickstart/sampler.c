@@ -0,0 +1,466 @@
+/* This module samples the memory, CPU and I/O usage of a running job at
+ * a fixed interval, so that the invocation record shows how much memory
+ * the job needed most of the time and how its CPU and I/O use changed,
+ * not just the totals at the end. A thread in the kickstart parent finds
+ * the processes of the job, either in its cgroup or by following the
+ * children of the main process in /proc, adds up /proc/[pid]/stat and
+ * /proc/[pid]/io over all of them, and keeps one value per metric and
+ * sample. When the job is done the samples are summarized as the peak,
+ * median and 95th percentile of each metric.
+ *
+ * Processes that leave the process tree of the main process, for example
+ * daemons that detach from their parent, are only seen in cgroup mode. CPU
+ * and I/O used by a process after the last sample before it exits are not
+ * counted.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "sampler.h"
+#include "error.h"
+
+static const char *metric_names[SAMPLE_METRICS] = {
+    "procs", "threads", "rss", "vm", "cpu", "rchar_rate", "wchar_rate"
+};
+
+static double get_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + ((double)tv.tv_usec / 1e6);
+}
+
+static void series_add(SampleSeries *series, double value) {
+    if (series->count == series->size) {
+        size_t size = series->size == 0 ? 64 : series->size * 2;
+        double *values = realloc(series->values, size * sizeof(double));
+        if (values == NULL) {
+            return;
+        }
+        series->values = values;
+        series->size = size;
+    }
+    series->values[series->count++] = value;
+}
+
+#ifdef LINUX
+
+/* A growable list of pids */
+typedef struct {
+    pid_t *pids;
+    size_t count;
+    size_t size;
+} PidList;
+
+static int pids_add(PidList *list, pid_t pid) {
+    if (list->count == list->size) {
+        size_t size = list->size == 0 ? 64 : list->size * 2;
+        pid_t *pids = realloc(list->pids, size * sizeof(pid_t));
+        if (pids == NULL) {
+            return -1;
+        }
+        list->pids = pids;
+        list->size = size;
+    }
+    list->pids[list->count++] = pid;
+    return 0;
+}
+
+/* Read a file of pids, one per line or separated by spaces, as used by
+ * cgroup.procs and /proc/[pid]/task/[tid]/children */
+static int pids_read(PidList *list, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    int pid;
+    while (fscanf(f, "%d", &pid) == 1) {
+        pids_add(list, pid);
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Find the main process and all of its descendants. Threads can have
+ * children of their own, so the children of every task are read. */
+static int pids_tree(PidList *list, pid_t root) {
+    pids_add(list, root);
+    for (size_t i = 0; i < list->count; i++) {
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "/proc/%d/task", list->pids[i]);
+        DIR *dir = opendir(path);
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent *d;
+        while ((d = readdir(dir)) != NULL) {
+            if (d->d_name[0] < '0' || d->d_name[0] > '9') {
+                continue;
+            }
+            snprintf(path, PATH_MAX, "/proc/%d/task/%s/children", list->pids[i], d->d_name);
+            if (pids_read(list, path) < 0 && errno == ENOENT && i == 0) {
+                /* The kernel doesn't have the children files */
+                closedir(dir);
+                return -1;
+            }
+        }
+        closedir(dir);
+    }
+    return 0;
+}
+
+/* Find the main process and all of its descendants by looking at the
+ * parent of every process in /proc. This is only used if the kernel
+ * doesn't have the children files. */
+static int pids_scan(PidList *list, pid_t root) {
+    PidList all = { NULL, 0, 0 };
+    PidList parents = { NULL, 0, 0 };
+
+    DIR *dir = opendir("/proc");
+    if (dir == NULL) {
+        return -1;
+    }
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_name[0] < '0' || d->d_name[0] > '9') {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "/proc/%s/stat", d->d_name);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        char buf[1024];
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        buf[n] = '\0';
+        char *p = strrchr(buf, ')');
+        int ppid;
+        if (p == NULL || sscanf(p + 2, "%*c %d", &ppid) != 1) {
+            continue;
+        }
+        pids_add(&all, atoi(d->d_name));
+        pids_add(&parents, ppid);
+    }
+    closedir(dir);
+
+    /* Each pass adds the children of the processes found so far */
+    pids_add(list, root);
+    size_t found;
+    do {
+        found = list->count;
+        for (size_t i = 0; i < all.count; i++) {
+            int member = 0, parent = 0;
+            for (size_t j = 0; j < list->count; j++) {
+                if (list->pids[j] == all.pids[i]) {
+                    member = 1;
+                    break;
+                }
+                if (list->pids[j] == parents.pids[i]) {
+                    parent = 1;
+                }
+            }
+            if (!member && parent) {
+                pids_add(list, all.pids[i]);
+            }
+        }
+    } while (list->count > found);
+
+    free(all.pids);
+    free(parents.pids);
+    return 0;
+}
+
+/* Per-process values read at one sample */
+typedef struct {
+    SampleCounters c;
+    long threads;
+    unsigned long vsize;        /* Bytes */
+    long rss;                   /* Pages */
+} ProcSample;
+
+static int read_sample(pid_t pid, ProcSample *ps) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    /* The command name can have spaces and parens in it */
+    char *p = strrchr(buf, ')');
+    if (p == NULL) {
+        return -1;
+    }
+    char state;
+    unsigned long utime, stime;
+    if (sscanf(p + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+               "%*d %*d %*d %*d %ld %*d %llu %lu %ld",
+               &state, &utime, &stime, &ps->threads, &ps->c.start,
+               &ps->vsize, &ps->rss) != 7) {
+        return -1;
+    }
+    if (state == 'Z' || state == 'X') {
+        return -1;
+    }
+    ps->c.pid = pid;
+    ps->c.ticks = utime + stime;
+
+    /* The I/O counters may not be readable, in which case they are 0 */
+    ps->c.rchar = ps->c.wchar = 0;
+    snprintf(path, PATH_MAX, "/proc/%d/io", pid);
+    f = fopen(path, "r");
+    if (f != NULL) {
+        char line[256];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "rchar: %"SCNu64, &ps->c.rchar) == 1) {
+                continue;
+            }
+            if (sscanf(line, "wchar: %"SCNu64, &ps->c.wchar) == 1) {
+                break;
+            }
+        }
+        fclose(f);
+    }
+    return 0;
+}
+
+static int compare_counters(const void *a, const void *b) {
+    pid_t x = ((const SampleCounters *)a)->pid;
+    pid_t y = ((const SampleCounters *)b)->pid;
+    return x < y ? -1 : x > y;
+}
+
+static void take_sample(SampleInfo *s) {
+    static int have_children_files = 1;
+    static long page_kb = 0;
+    static long ticks_per_sec = 0;
+    if (page_kb == 0) {
+        page_kb = sysconf(_SC_PAGESIZE) / 1024;
+        ticks_per_sec = sysconf(_SC_CLK_TCK);
+    }
+
+    PidList list = { NULL, 0, 0 };
+    if (s->cgroup != NULL) {
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s/cgroup.procs", s->cgroup);
+        pids_read(&list, path);
+    } else if (!have_children_files || pids_tree(&list, s->root) < 0) {
+        have_children_files = 0;
+        list.count = 0;
+        pids_scan(&list, s->root);
+    }
+
+    double now = get_time();
+    SampleCounters *cur = calloc(list.count + 1, sizeof(SampleCounters));
+    if (cur == NULL) {
+        free(list.pids);
+        return;
+    }
+
+    size_t ncur = 0;
+    double total[SAMPLE_METRICS];
+    memset(total, 0, sizeof(total));
+    unsigned long dticks = 0;
+    uint64_t drchar = 0, dwchar = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        ProcSample ps;
+        if (read_sample(list.pids[i], &ps) < 0) {
+            continue;
+        }
+        total[SAMPLE_PROCS] += 1;
+        total[SAMPLE_THREADS] += ps.threads;
+        total[SAMPLE_RSS] += (double)ps.rss * page_kb;
+        total[SAMPLE_VM] += ps.vsize / 1024.0;
+
+        /* A process that wasn't there at the last sample started since
+         * then, or joined the job, so all of its usage is new */
+        SampleCounters *old = bsearch(&ps.c, s->prev, s->nprev, sizeof(SampleCounters),
+                                      compare_counters);
+        if (old != NULL && old->start == ps.c.start) {
+            dticks += ps.c.ticks - old->ticks;
+            drchar += ps.c.rchar - old->rchar;
+            dwchar += ps.c.wchar - old->wchar;
+        } else {
+            dticks += ps.c.ticks;
+            drchar += ps.c.rchar;
+            dwchar += ps.c.wchar;
+        }
+        cur[ncur++] = ps.c;
+    }
+    free(list.pids);
+
+    /* Once the job is gone there is nothing left to record */
+    if (ncur == 0) {
+        free(cur);
+        return;
+    }
+
+    series_add(&s->series[SAMPLE_PROCS], total[SAMPLE_PROCS]);
+    series_add(&s->series[SAMPLE_THREADS], total[SAMPLE_THREADS]);
+    series_add(&s->series[SAMPLE_RSS], total[SAMPLE_RSS]);
+    series_add(&s->series[SAMPLE_VM], total[SAMPLE_VM]);
+
+    /* Rates need a previous sample */
+    if (s->last > 0 && now > s->last) {
+        double elapsed = now - s->last;
+        series_add(&s->series[SAMPLE_CPU], (double)dticks / ticks_per_sec / elapsed);
+        series_add(&s->series[SAMPLE_RCHAR], drchar / elapsed);
+        series_add(&s->series[SAMPLE_WCHAR], dwchar / elapsed);
+    }
+
+    qsort(cur, ncur, sizeof(SampleCounters), compare_counters);
+    free(s->prev);
+    s->prev = cur;
+    s->nprev = ncur;
+    s->last = now;
+}
+
+static void *sampler_thread(void *arg) {
+    SampleInfo *s = (SampleInfo *)arg;
+
+    /* Samples are taken at fixed times after the start so that the time
+     * it takes to read /proc doesn't add up */
+    double start = get_time();
+    unsigned long n = 0;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop) {
+        double next = start + (++n * s->interval);
+        struct timespec deadline;
+        deadline.tv_sec = (time_t)next;
+        deadline.tv_nsec = (long)((next - deadline.tv_sec) * 1e9);
+        while (!s->stop) {
+            if (pthread_cond_timedwait(&s->cond, &s->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        if (s->stop) {
+            break;
+        }
+        pthread_mutex_unlock(&s->lock);
+        take_sample(s);
+        pthread_mutex_lock(&s->lock);
+
+        /* Skip the samples that were missed if a sample took too long */
+        double now = get_time();
+        if (start + ((n + 1) * s->interval) < now) {
+            n = (unsigned long)((now - start) / s->interval);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+SampleInfo *startSampler(pid_t root, const char *cgroup, double interval) {
+    SampleInfo *s = (SampleInfo *)calloc(1, sizeof(SampleInfo));
+    if (s == NULL) {
+        printerr("calloc: %s\n", strerror(errno));
+        return NULL;
+    }
+    s->interval = interval;
+    s->root = root;
+    if (cgroup != NULL) {
+        s->cgroup = strdup(cgroup);
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    /* Signals for kickstart have to go to the thread that waits for the
+     * job, so the sampler thread blocks all of them */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&s->thread, NULL, sampler_thread, s);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        printerr("Unable to start resource sampler: %s\n", strerror(rc));
+        deleteSampleInfo(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+void stopSampler(SampleInfo *s) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+
+    free(s->prev);
+    s->prev = NULL;
+    s->nprev = 0;
+}
+
+#else
+
+SampleInfo *startSampler(pid_t root, const char *cgroup, double interval) {
+    printerr("Resource sampling is only supported on Linux\n");
+    return NULL;
+}
+
+void stopSampler(SampleInfo *s) {
+}
+
+#endif
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted values */
+static double percentile(const double *values, size_t count, double p) {
+    size_t rank = (size_t)ceil(p * count);
+    return values[rank > 0 ? rank - 1 : 0];
+}
+
+int printYAMLSampleInfo(FILE *out, int indent, SampleInfo *s) {
+    fprintf(out, "%*ssamples:\n", indent, "");
+    fprintf(out, "%*s  interval: %.3lf\n", indent, "", s->interval);
+    fprintf(out, "%*s  count: %zu\n", indent, "", s->series[SAMPLE_PROCS].count);
+    for (int i = 0; i < SAMPLE_METRICS; i++) {
+        SampleSeries *series = &s->series[i];
+        if (series->count == 0) {
+            continue;
+        }
+        qsort(series->values, series->count, sizeof(double), compare_double);
+        const char *fmt = i == SAMPLE_CPU ? "%*s    %s: %.3lf\n" : "%*s    %s: %.0lf\n";
+        fprintf(out, "%*s  %s:\n", indent, "", metric_names[i]);
+        fprintf(out, fmt, indent, "", "peak", series->values[series->count - 1]);
+        fprintf(out, fmt, indent, "", "p50", percentile(series->values, series->count, 0.50));
+        fprintf(out, fmt, indent, "", "p95", percentile(series->values, series->count, 0.95));
+    }
+    return 0;
+}
+
+void deleteSampleInfo(SampleInfo *s) {
+    if (s == NULL) {
+        return;
+    }
+    for (int i = 0; i < SAMPLE_METRICS; i++) {
+        free(s->series[i].values);
+    }
+    free(s->prev);
+    free(s->cgroup);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s);
+}
@@ -0,0 +1,61 @@
+#ifndef _SAMPLER_H
+#define _SAMPLER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Metrics recorded at every sample, added up over all the processes
+ * of the job */
+enum {
+    SAMPLE_PROCS,           /* Number of processes */
+    SAMPLE_THREADS,         /* Number of threads */
+    SAMPLE_RSS,             /* Resident set size in KB */
+    SAMPLE_VM,              /* Virtual memory size in KB */
+    SAMPLE_CPU,             /* CPU time (user + system) per second */
+    SAMPLE_RCHAR,           /* Characters read per second */
+    SAMPLE_WCHAR,           /* Characters written per second */
+    SAMPLE_METRICS
+};
+
+typedef struct {
+    double *values;
+    size_t count;
+    size_t size;
+} SampleSeries;
+
+/* Counters of one process at the previous sample, used to turn the
+ * cumulative CPU and I/O counters into rates */
+typedef struct {
+    pid_t pid;
+    unsigned long long start;   /* Start time, to tell reused pids apart */
+    unsigned long ticks;        /* utime + stime in clock ticks */
+    uint64_t rchar;
+    uint64_t wchar;
+} SampleCounters;
+
+/* Periodic samples of the memory, CPU and I/O usage of a job, taken
+ * by a thread of the kickstart parent while the job runs */
+typedef struct {
+    double interval;            /* Seconds between samples */
+    pid_t root;                 /* Main process of the job */
+    char *cgroup;               /* Directory of the job's cgroup, or NULL */
+    SampleSeries series[SAMPLE_METRICS];
+
+    SampleCounters *prev;       /* Counters at the previous sample */
+    size_t nprev;
+    double last;                /* Time of the previous sample */
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+} SampleInfo;
+
+SampleInfo *startSampler(pid_t root, const char *cgroup, double interval);
+void stopSampler(SampleInfo *s);
+int printYAMLSampleInfo(FILE *out, int indent, SampleInfo *s);
+void deleteSampleInfo(SampleInfo *s);
+
+#endif /* _SAMPLER_H */
@@ -0,0 +1,130 @@
+/* SHA-256 block compression using the x86 SHA extensions (SHA-NI). The
+ * portable implementation in sha2.c is used when these aren't available.
+ */
+#include "sha256accel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+int sha256_accel_available(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    /* SSSE3 and SSE4.1 */
+    if (!(ecx & (1 << 9)) || !(ecx & (1 << 19))) {
+        return 0;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    /* SHA */
+    return (ebx & (1 << 29)) != 0;
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void sha256_accel_blocks(uint32_t state[8], const unsigned char *data, size_t nblocks) {
+    /* Swaps the bytes of each 32-bit word */
+    const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    /* The instructions want the state as ABEF and CDGH */
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);                 /* CDAB */
+    state1 = _mm_shuffle_epi32(state1, 0x1B);           /* EFGH */
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);   /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);        /* CDGH */
+
+    for (; nblocks > 0; nblocks--, data += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[4];
+
+        /* Each step does 4 rounds. w[i % 4] holds message words 4i..4i+3,
+         * and the schedule computes the words for later steps in place. */
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), BSWAP);
+            }
+
+            __m128i msg = _mm_add_epi32(w[i % 4], _mm_loadu_si128((const __m128i *)&K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+            if (i >= 3 && i <= 14) {
+                tmp = _mm_alignr_epi8(w[i % 4], w[(i + 3) % 4], 4);
+                w[(i + 1) % 4] = _mm_add_epi32(w[(i + 1) % 4], tmp);
+                w[(i + 1) % 4] = _mm_sha256msg2_epu32(w[(i + 1) % 4], w[i % 4]);
+            }
+
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+            if (i >= 1 && i <= 12) {
+                w[(i + 3) % 4] = _mm_sha256msg1_epu32(w[(i + 3) % 4], w[i % 4]);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);              /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xB1);           /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);        /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);           /* HGFE */
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#else
+
+int sha256_accel_available(void) {
+    return 0;
+}
+
+void sha256_accel_blocks(uint32_t state[8], const unsigned char *data, size_t nblocks) {
+}
+
+#endif
+
+void sha256_hash_fast(const unsigned char *data, size_t len, sha256_ctx ctx[1]) {
+    /* -1 until the CPU has been checked. Threads that race here all
+     * store the same value. */
+    static int accel = -1;
+    if (accel < 0) {
+        accel = sha256_accel_available();
+    }
+
+    /* The accelerated code only works on block boundaries, so fall back
+     * to sha256_hash while part of a block is buffered in ctx */
+    size_t nblocks = len / SHA256_BLOCK_SIZE;
+    if (accel && nblocks > 0 && (ctx->count[0] & (SHA256_BLOCK_SIZE - 1)) == 0) {
+        size_t n = nblocks * SHA256_BLOCK_SIZE;
+        uint64_t count = ((uint64_t)ctx->count[1] << 32) + ctx->count[0] + n;
+
+        sha256_accel_blocks(ctx->hash, data, nblocks);
+        ctx->count[0] = (uint_32t)count;
+        ctx->count[1] = (uint_32t)(count >> 32);
+        data += n;
+        len -= n;
+    }
+
+    if (len > 0) {
+        sha256_hash(data, len, ctx);
+    }
+}
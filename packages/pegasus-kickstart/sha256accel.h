@@ -0,0 +1,19 @@
+#ifndef KICKSTART_SHA256ACCEL_H
+#define KICKSTART_SHA256ACCEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sha2.h"
+
+/* Returns 1 if this CPU can run sha256_accel_blocks */
+extern int sha256_accel_available(void);
+
+/* Compress nblocks 64-byte blocks of data into the SHA-256 state. This is
+ * the same state as the hash field of sha256_ctx in sha2.h. */
+extern void sha256_accel_blocks(uint32_t state[8], const unsigned char *data, size_t nblocks);
+
+/* Same as sha256_hash, but whole blocks are compressed with
+ * sha256_accel_blocks when the CPU supports it */
+extern void sha256_hash_fast(const unsigned char *data, size_t len, sha256_ctx ctx[1]);
+
+#endif /* KICKSTART_SHA256ACCEL_H */
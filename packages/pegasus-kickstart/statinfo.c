@@ -14,6 +14,8 @@
  */
 #include <sys/param.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -24,8 +26,7 @@
 
 #include <unistd.h>
 #include <fcntl.h>
-#include <grp.h>
-#include <pwd.h>
+#include <pthread.h>
 
 #include "statinfo.h"
 #include "utils.h"
@@ -45,7 +46,8 @@ int forcefd(const StatInfo* info, int fd) {
      *          2 if dup2 call failed
      */
     /* is this a regular file with name, or is this a descriptor to copy from? */
-    int isHandle = (info->source == IS_HANDLE || info->source == IS_TEMP);
+    int isHandle = (info->source == IS_HANDLE || info->source == IS_TEMP ||
+                    info->source == IS_CAPTURE);
     int mode = info->file.descriptor; /* openmode for IS_FILE */
 
     /* initialize the newHandle variable by opening regular files, or copying the fd */
@@ -140,6 +142,65 @@ error:
     return -1;
 }
 
+int initStatInfoAsCapture(StatInfo* statinfo, const char* pattern,
+                          size_t threshold) {
+    /* purpose: Initialize a stat info buffer for output that is read
+     *          through a pipe and kept in memory
+     * paramtr: statinfo (OUT): the newly initialized buffer
+     *          pattern (IN): mkstemp() pattern for the file that the
+     *          output is spilled to when it is larger than threshold
+     *          threshold (IN): bytes of output to keep in memory
+     * returns: a value of -1 indicates an error
+     */
+    memset(statinfo, 0, sizeof(StatInfo));
+
+    statinfo->capture = newCapture(pattern, threshold);
+    statinfo->file.name = strdup(pattern);
+    if (statinfo->capture == NULL || statinfo->file.name == NULL) {
+        deleteCapture(statinfo->capture);
+        free((void*) statinfo->file.name);
+        memset(statinfo, 0, sizeof(StatInfo));
+        statinfo->source = IS_INVALID;
+        statinfo->error = ENOMEM;
+        return -1;
+    }
+
+    /* the pipe is only created when the first job starts, until then
+     * this looks like an empty pipe */
+    statinfo->source = IS_CAPTURE;
+    statinfo->file.descriptor = -1;
+    statinfo->info.st_mode = S_IFIFO | 0600;
+    statinfo->info.st_uid = geteuid();
+    statinfo->info.st_gid = getegid();
+    statinfo->info.st_mtime = statinfo->info.st_atime = statinfo->info.st_ctime = time(NULL);
+
+    return 0;
+}
+
+int startStatInfoCapture(StatInfo* statinfo) {
+    /* purpose: start reading captured output before a job is started
+     * paramtr: statinfo (IO): the stream of the job. If the pipe cannot be
+     *          set up, the stream becomes a temporary file instead.
+     * returns: a value of -1 indicates an error
+     */
+    if (statinfo->source != IS_CAPTURE) {
+        return 0;
+    }
+
+    /* The data section is limited to data_section_size characters, and
+     * a UTF-8 character takes up to 4 bytes */
+    size_t keep = data_section_size > SIZE_MAX / 4 ? 0 : 4 * data_section_size;
+    if (startCapture(statinfo->capture, keep) == 0) {
+        statinfo->file.descriptor = statinfo->capture->fds[1];
+        return 0;
+    }
+
+    char pattern[BUFSIZ];
+    snprintf(pattern, sizeof(pattern), "%s", statinfo->capture->pattern);
+    deleteStatInfo(statinfo);
+    return initStatInfoAsTemp(statinfo, pattern);
+}
+
 static int preserveFile(const char* fn) {
     /* purpose: preserve the given file by renaming it with a backup extension.
      * paramtr: fn (IN): name of the file
@@ -246,6 +307,24 @@ int updateStatInfo(StatInfo* statinfo) {
      * returns: the result of the stat() or fstat() system call. */
     int result = -1;
 
+    if (statinfo->source == IS_CAPTURE) {
+        /* the size is that of all the output, the rest is the pipe or
+         * the file the output was spilled to */
+        CaptureInfo* capture = statinfo->capture;
+        size_t total = syncCapture(capture);
+
+        errno = 0;
+        result = 0;
+        if (capture->spillfd >= 0) {
+            result = fstat(capture->spillfd, &(statinfo->info));
+        } else if (capture->started) {
+            result = fstat(capture->fds[0], &(statinfo->info));
+        }
+        statinfo->error = errno;
+        statinfo->info.st_size = total;
+        return result;
+    }
+
     if (statinfo->source == IS_FILE && (statinfo->deferred & 1) == 1) {
         /* FIXME: As long as we use shared stdio for stdout and stderr, we need
          * to explicitely truncate (and create) file to zero, if not appending.
@@ -341,6 +420,150 @@ int addLFNToStatInfo(StatInfo* info, const char* lfn) {
     return 0;
 }
 
+typedef struct StatWork {
+    StatInfo* infos;
+    const char** names;           /* initStatInfosFromNames only */
+    int count;
+    int next;
+    void (*process)(struct StatWork* work, int i);
+} StatWork;
+
+static void* statWorker(void* arg) {
+    StatWork* work = (StatWork*) arg;
+    for (;;) {
+        int i = __sync_fetch_and_add(&work->next, 1);
+        if (i >= work->count) {
+            break;
+        }
+        work->process(work, i);
+    }
+    return NULL;
+}
+
+static void runStatWork(StatWork* work, int nthreads) {
+    /* purpose: process all records of work with up to nthreads threads
+     * paramtr: work (IO): records and the function to apply to each one
+     *          nthreads (IN): maximum number of records processed at a time
+     */
+    pthread_t* threads;
+    int started, i;
+
+    work->next = 0;
+    if (nthreads > work->count) {
+        nthreads = work->count;
+    }
+
+    /* This thread is one of the workers */
+    started = 0;
+    threads = NULL;
+    if (nthreads > 1) {
+        threads = (pthread_t*) calloc(sizeof(pthread_t), nthreads - 1);
+        if (threads == NULL) {
+            printerr("calloc: %s\n", strerror(errno));
+        }
+    }
+    for (i = 1; threads != NULL && i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, statWorker, work) != 0) {
+            printerr("Unable to start worker thread: %s\n", strerror(errno));
+            break;
+        }
+        started++;
+    }
+    statWorker(work);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+static void statListedFile(StatWork* work, int i) {
+    StatInfo* info = &work->infos[i];
+    initStatInfoFromName(info, work->names[i], O_RDONLY, 0);
+    if (info->file.name != NULL) {
+        info->real = realpath(info->file.name, NULL);
+    }
+}
+
+/* Files stat'ed per thread by initStatInfosFromNames. Short lists are
+ * done by the calling thread alone, as starting threads costs more than
+ * a stat of a local file. */
+#define STAT_BATCH 32
+
+void initStatInfosFromNames(StatInfo* infos, const char** names,
+                            size_t count, int parallelism) {
+    /* purpose: initialize the records of a -s/-S file list, with several
+     *          stat calls in flight so that long lists on a network file
+     *          system do not wait for each metadata round trip in turn
+     * paramtr: infos (OUT): vector of records to initialize
+     *          names (IN): file to stat for each record
+     *          count (IN): number of records in infos
+     *          parallelism (IN): maximum number of files stat'ed at a time
+     */
+    StatWork work;
+    int nthreads;
+
+    if (infos == NULL || count == 0) {
+        return;
+    }
+
+    work.infos = infos;
+    work.names = names;
+    work.count = count;
+    work.process = statListedFile;
+
+    nthreads = (count + STAT_BATCH - 1) / STAT_BATCH;
+    if (nthreads > parallelism) {
+        nthreads = parallelism;
+    }
+    runStatWork(&work, nthreads);
+}
+
+static void checksumStatInfo(StatWork* work, int i) {
+    /* purpose: compute the integrity YAML of a "final" record ahead of
+     *          printYAMLStatInfo
+     * paramtr: work (IO): records to checksum
+     *          i (IN): index of the record to checksum
+     */
+    StatInfo* info = &work->infos[i];
+    char chksum_xml[2048];
+    char* real;
+
+    if (info->source == IS_INVALID || info->error != 0) {
+        return;
+    }
+
+    real = info->real ? info->real : realpath(info->file.name, NULL);
+    if (pegasus_integrity_yaml(real, chksum_xml) == 1 &&
+        (info->checksum = strdup(chksum_xml)) != NULL) {
+        info->checksummed = 1;
+    } else {
+        info->checksummed = -1;
+    }
+    if (real && real != info->real) {
+        free((void*) real);
+    }
+}
+
+void checksumStatInfos(StatInfo* infos, size_t count, int parallelism) {
+    /* purpose: checksum the files of several "final" records at once, so
+     *          that jobs with many outputs do not hash them one by one
+     * paramtr: infos (IO): vector of records
+     *          count (IN): number of records in infos
+     *          parallelism (IN): maximum number of files hashed at a time
+     */
+    StatWork work;
+
+    if (infos == NULL || count == 0) {
+        return;
+    }
+
+    work.infos = infos;
+    work.names = NULL;
+    work.count = count;
+    work.process = checksumStatInfo;
+    runStatWork(&work, parallelism);
+}
+
 size_t printYAMLStatInfo(FILE *out, int indent, const char* id,
                         const StatInfo* info, int includeData, int useCDATA,
                         int allowTruncate) {
@@ -398,6 +621,14 @@ size_t printYAMLStatInfo(FILE *out, int indent, const char* id,
                     indent+2, "", info->file.name, indent+2, "", info->file.descriptor);
             break;
 
+        case IS_CAPTURE: /* output read through a pipe */
+            if (info->capture->spillname != NULL) {
+                fprintf(out, "%*stemporary_name: %s\n%*sdescriptor: %d\n",
+                        indent+2, "", info->capture->spillname,
+                        indent+2, "", info->capture->spillfd);
+            }
+            break;
+
         case IS_FIFO: /* <fifo> element */
             fprintf(out, "%*sfifo_name: \"%s\"\n%*sdescriptor: %d\n%*scount: %zu\n%*srsize: %zu\n%*swsize: %zu\n",
                     indent+2, "", info->file.name,
@@ -408,6 +639,10 @@ size_t printYAMLStatInfo(FILE *out, int indent, const char* id,
             break;
 
         case IS_FILE: /* <file> element */
+            if (info->real) {
+                fprintf(out, "%*sfile_name: %s\n", indent+2, "", info->real);
+                break;
+            }
             real = realpath(info->file.name, NULL);
             fprintf(out, "%*sfile_name: %s\n", indent+2, "", real ? real : info->file.name);
             if (real) {
@@ -429,8 +664,8 @@ size_t printYAMLStatInfo(FILE *out, int indent, const char* id,
     if (info->error == 0 && info->source != IS_INVALID) {
         /* <stat> subrecord */
         char my[32];
-        struct passwd* user = getpwuid(info->info.st_uid);
-        struct group* group = getgrgid(info->info.st_gid);
+        const char* user = userName(info->info.st_uid);
+        const char* group = groupName(info->info.st_gid);
 
         fprintf(out, "%*smode: 0o%o\n", indent+2, "", info->info.st_mode);
 
@@ -457,11 +692,11 @@ size_t printYAMLStatInfo(FILE *out, int indent, const char* id,
 
         fprintf(out, "%*suid: %d\n", indent+2, "", info->info.st_uid);
         if (user) {
-            fprintf(out, "%*suser: %s\n", indent+2, "", user->pw_name);
+            fprintf(out, "%*suser: %s\n", indent+2, "", user);
         }
         fprintf(out, "%*sgid: %d\n", indent+2, "", info->info.st_gid);
         if (group) {
-            fprintf(out, "%*sgroup: %s\n", indent+2, "", group->gr_name);
+            fprintf(out, "%*sgroup: %s\n", indent+2, "", group);
         }
     }
 
@@ -472,17 +707,25 @@ size_t printYAMLStatInfo(FILE *out, int indent, const char* id,
          fprintf(out, "%*soutput: True\n", indent+2, "");
         size_t result = 0;
         char chksum_xml[2048];
-        real = realpath(info->file.name, NULL);
-        result = pegasus_integrity_yaml(real, chksum_xml);
-        if (result == 1) {
-            fprintf(out, "%s", chksum_xml);
+        if (info->checksummed > 0) {
+            fprintf(out, "%s", info->checksum);
         }
         else {
-            fprintf(out, "%*sintegrity_error: failed creating a checksum\n", indent+2, "");
-            return 1;
-        }
-        if (real) {
-            free((void*) real);
+            /* not done by checksumStatInfos, or it failed there */
+            if (info->checksummed == 0) {
+                real = realpath(info->file.name, NULL);
+                result = pegasus_integrity_yaml(real, chksum_xml);
+            }
+            if (result == 1) {
+                fprintf(out, "%s", chksum_xml);
+            }
+            else {
+                fprintf(out, "%*sintegrity_error: failed creating a checksum\n", indent+2, "");
+                return 1;
+            }
+            if (real) {
+                free((void*) real);
+            }
         }
     }
 
@@ -498,7 +741,7 @@ size_t printYAMLStatInfo(FILE *out, int indent, const char* id,
 
     /* data section from stdout and stderr of application */
     if (includeData &&
-        info->source == IS_TEMP &&
+        (info->source == IS_TEMP || info->source == IS_CAPTURE) &&
         info->error == 0 &&
         fsize > 0 && dsize > 0) {
 
@@ -509,29 +752,42 @@ size_t printYAMLStatInfo(FILE *out, int indent, const char* id,
             /* initial indent */
             fprintf(out, "%*s", indent+4, "");
 
-            wint_t c;
-            size_t ccount = 0;
-            size_t cskip = 0;
-            int fd = dup(info->file.descriptor);
-            if (fd != -1) {
-                /* as utf8 can be multibyte, we have to walk the file twice - once
-                * to figure out how many characters to skip, and once to output */
-                if (lseek(fd, 0, SEEK_SET) != -1) {
-                    FILE *in = fdopen(fd, "r");
-                    while ((c = fgetwc(in)) != WEOF)
-                        ccount++;
-                    if (ccount > dsize)
-                        cskip = ccount - dsize;
-                    /* reset and start skipping */
-                    ccount = 0;
-                    lseek(fd, 0, SEEK_SET);
-                    in = fdopen(fd, "r");
-                    while (ccount < cskip && (c = fgetwc(in)) != WEOF) 
-                        ccount++;
-                    /* the rest of the file can be dumped to the yaml output */
-                    yamldump(in, out, indent+4);
+            if (info->source == IS_CAPTURE && info->capture->spillfd < 0) {
+                /* captured output that is still in memory */
+                size_t csize = 0;
+                char* captured = captureData(info->capture, &csize);
+                if (captured != NULL) {
+                    size_t ccount = mbcount(captured, csize);
+                    size_t cskip = ccount > dsize ? mbskip(captured, csize, ccount - dsize) : 0;
+                    yamldumpbuf(captured + cskip, csize - cskip, out, indent+4);
+                    free(captured);
+                }
+            } else {
+                wint_t c;
+                size_t ccount = 0;
+                size_t cskip = 0;
+                int fd = dup(info->source == IS_CAPTURE ?
+                             info->capture->spillfd : info->file.descriptor);
+                if (fd != -1) {
+                    /* as utf8 can be multibyte, we have to walk the file twice - once
+                    * to figure out how many characters to skip, and once to output */
+                    if (lseek(fd, 0, SEEK_SET) != -1) {
+                        FILE *in = fdopen(fd, "r");
+                        while ((c = fgetwc(in)) != WEOF)
+                            ccount++;
+                        if (ccount > dsize)
+                            cskip = ccount - dsize;
+                        /* reset and start skipping */
+                        ccount = 0;
+                        lseek(fd, 0, SEEK_SET);
+                        in = fdopen(fd, "r");
+                        while (ccount < cskip && (c = fgetwc(in)) != WEOF) 
+                            ccount++;
+                        /* the rest of the file can be dumped to the yaml output */
+                        yamldump(in, out, indent+4);
+                    }
+                    close(fd);
                 }
-                close(fd);
             }
             /* final newline */
             fprintf(out, "\n");
@@ -545,6 +801,13 @@ void deleteStatInfo(StatInfo* statinfo) {
     /* purpose: clean up and invalidates structure after being done.
      * paramtr: statinfo (IO): clean up record. */
 
+    if (statinfo->source == IS_CAPTURE) {
+        deleteCapture(statinfo->capture);
+        statinfo->capture = NULL;
+        free((void*) statinfo->file.name);
+        statinfo->file.name = NULL;
+    }
+
     if (statinfo->source == IS_FILE ||
         statinfo->source == IS_TEMP ||
         statinfo->source == IS_FIFO) {
@@ -560,6 +823,16 @@ void deleteStatInfo(StatInfo* statinfo) {
         }
     }
 
+    if (statinfo->checksum) {
+        free(statinfo->checksum);
+        statinfo->checksum = NULL;
+    }
+    if (statinfo->real) {
+        free(statinfo->real);
+        statinfo->real = NULL;
+    }
+    statinfo->checksummed = 0;
+
     /* invalidate */
     statinfo->source = IS_INVALID;
 }
@@ -19,19 +19,22 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "capture.h"
+
 typedef enum {
     IS_INVALID    = 0,
     IS_FILE       = 1,
     IS_HANDLE     = 2,
     IS_TEMP       = 3,
-    IS_FIFO       = 4
+    IS_FIFO       = 4,
+    IS_CAPTURE    = 5
 } StatSource;
 
 typedef struct {
     StatSource source;
     struct {
-        int descriptor;           /* IS_HANDLE, IS_TEMP|FIFO, openmode IS_FILE */
-        const char* name;         /* IS_FILE, IS_TEMP|FIFO */
+        int descriptor;           /* IS_HANDLE, IS_TEMP|FIFO|CAPTURE, openmode IS_FILE */
+        const char* name;         /* IS_FILE, IS_TEMP|FIFO|CAPTURE */
     } file;
     int error;
     int deferred;                 /* IS_FILE: truncate was deferred */
@@ -45,6 +48,10 @@ typedef struct {
     } client;
     struct stat info;
     const char* lfn;              /* from -s/-S option */
+    int checksummed;              /* 1: checksum is set, -1: checksum failed */
+    char* checksum;               /* integrity YAML from checksumStatInfos */
+    char* real;                   /* IS_FILE: resolved name from initStatInfosFromNames */
+    CaptureInfo* capture;         /* IS_CAPTURE: output read through a pipe */
 } StatInfo;
 
 /* size of the <data> section returned for stdout and stderr. */
@@ -52,11 +59,17 @@ extern size_t data_section_size;
 
 extern int forcefd(const StatInfo* info, int fd);
 extern int initStatInfoAsTemp(StatInfo* statinfo, char* pattern);
+extern int initStatInfoAsCapture(StatInfo* statinfo, const char* pattern,
+                                 size_t threshold);
+extern int startStatInfoCapture(StatInfo* statinfo);
 extern int initStatInfoFromName(StatInfo* statinfo, const char* filename,
                                 int openmode, int flag);
 extern int initStatInfoFromHandle(StatInfo* statinfo, int descriptor);
 extern int updateStatInfo(StatInfo* statinfo);
 extern int addLFNToStatInfo(StatInfo* info, const char* lfn);
+extern void initStatInfosFromNames(StatInfo* infos, const char** names,
+                                   size_t count, int parallelism);
+extern void checksumStatInfos(StatInfo* infos, size_t count, int parallelism);
 extern size_t printYAMLStatInfo(FILE *out, int indent, const char* id,
                                const StatInfo* info, int includeData, int useCDATA,
                                int allowTruncate);
@@ -0,0 +1,39 @@
+#!/bin/bash
+#
+# Measure the time pegasus-kickstart adds to a job that does nothing.
+# Short tasks are dominated by this time, so it is worth checking after
+# changes to the code that runs on every invocation.
+#
+# Usage: bench-startup.sh [RUNS]
+#
+
+KICKSTART=${PEGASUS_BIN_DIR:-..}/pegasus-kickstart
+RUNS=${1:-1000}
+JOB=/bin/true
+
+# Print the average wall time of one run of the command in microseconds
+function measure {
+    local start=$(date +%s%N)
+    for ((i = 0; i < RUNS; i++)); do
+        "$@" >/dev/null 2>&1
+    done
+    local end=$(date +%s%N)
+    echo $(( (end - start) / RUNS / 1000 ))
+}
+
+# Warm up the page cache and the CPU info cache
+measure $KICKSTART $JOB >/dev/null
+
+direct=$(measure $JOB)
+printf "%-28s %8d us\n" "$JOB" $direct
+
+function report {
+    local name=$1
+    shift
+    local t=$(measure $KICKSTART "$@" $JOB)
+    printf "%-28s %8d us  (+%d us)\n" "$name" $t $(( t - direct ))
+}
+
+report "kickstart"
+report "kickstart -H" -H
+report "kickstart -f" -f
@@ -230,6 +230,55 @@ function test_bad_stdio {
     return 0
 }
 
+function test_capture {
+    KICKSTART_CAPTURE=65536 kickstart -B 10 seq 1 100000
+    rc=$?
+    if ! [[ $(cat test.out) =~ "100000" ]] || [[ $(cat test.out) =~ "temporary_name: .*ks.out" ]]; then
+        echo "Expected the end of the output from memory"
+        return 1
+    fi
+    return $rc
+}
+
+function test_capture_spill {
+    KICKSTART_CAPTURE=1000 kickstart -B all seq 1 1000
+    rc=$?
+    if ! [[ $(cat test.out) =~ "temporary_name: ".*"ks.out" ]] || ! [[ $(cat test.out) =~ " 1"$'\n'.*" 1000" ]]; then
+        echo "Expected all the output from the spill file"
+        return 1
+    fi
+    return $rc
+}
+
+# -g should fall back to the usual accounting when there is no cgroup
+# for the job, and should not change the cgroup kickstart was started in
+function test_cgroup {
+    mnt=$(awk '$3 == "cgroup2" { print $2; exit }' /proc/mounts)
+    home=$mnt$(sed -n 's/^0:://p' /proc/self/cgroup)
+    before=$(cat $home/cgroup.subtree_control 2>/dev/null)
+    kickstart -g /bin/true
+    rc=$?
+    if [ $rc -ne 0 ]; then
+        echo "Expected the job to run with -g"
+        return 1
+    fi
+    if [ "$(cat $home/cgroup.subtree_control 2>/dev/null)" != "$before" ]; then
+        echo "Expected the controllers of $home to be left alone"
+        return 1
+    fi
+    if [[ $(cat test.out) =~ "cgroup:" ]]; then
+        top=$(sed -n 's/^ *path: \(.*\)\/job-0$/\1/p' test.out)
+        if [ -z "$top" ] || [ -e "$top" ]; then
+            echo "Expected the cgroups of kickstart to be removed"
+            return 1
+        fi
+    elif ! [[ $(cat test.err) =~ "Unable to" ]]; then
+        echo "Expected the reason cgroup accounting is not used"
+        return 1
+    fi
+    return 0
+}
+
 function test_timeout_ok {
     kickstart -k 5 /bin/sleep 1
     return $?
@@ -603,6 +652,9 @@ run_test test_quoting
 run_test test_truncate
 run_test test_all_stdio
 run_test test_bad_stdio
+run_test test_capture
+run_test test_capture_spill
+run_test test_cgroup
 run_test test_timeout_ok
 run_test test_timeout_fail
 run_test test_timeout_kill
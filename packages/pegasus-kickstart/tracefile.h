@@ -0,0 +1,245 @@
+#ifndef KICKSTART_TRACEFILE_H
+#define KICKSTART_TRACEFILE_H
+
+#include <stdint.h>
+
+/* Binary trace file written by libinterpose and read by kickstart.
+ *
+ * All the traced processes of a job append to one file, which kickstart
+ * creates before it starts the job, so that jobs that run many processes
+ * do not create a file for each one. The file starts with a
+ * TraceFileHeader and the rest of it is divided into extents. Extents
+ * start at multiples of TRACE_EXTENT and their size is a multiple of
+ * TRACE_EXTENT. A process claims an extent by adding its size to the end
+ * offset in the header, which every process has mapped into memory, then
+ * maps the extent and appends records to it.
+ *
+ * Every record starts with a TraceRecord giving its type and its total
+ * size, which is always a multiple of 8 so that the records stay aligned.
+ * Records never cross extents. When an extent is full the process claims
+ * a larger one and links it from the previous one, so each process image
+ * writes one chain of extents, a stream. Paths and other strings are
+ * stored once per stream in TR_STRING records and referred to by their
+ * id in the records that follow. When a process calls exec the new image
+ * starts a new stream, so the streams of a pid are read in the order in
+ * which they start, each one ending with TR_STOP.
+ */
+
+#define TRACE_MAGIC 0x5254534b /* "KSTR" */
+#define TRACE_EXTENT_MAGIC 0x5845534b /* "KSEX" */
+#define TRACE_VERSION 2
+
+/* Size and alignment of extents. This is the first extent of a stream,
+ * and also covers the header of the file. */
+#define TRACE_EXTENT (64 * 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t end;           /* Offset of the next extent to claim */
+} TraceFileHeader;
+
+typedef struct {
+    uint32_t magic;         /* Written last, once the other fields are set */
+    int32_t pid;
+    uint64_t size;          /* Size of the extent */
+    uint64_t used;          /* Bytes used, including this header */
+    uint64_t next;          /* Offset of the next extent of the stream, or 0 */
+    uint32_t first;         /* 1 if this extent starts a stream */
+    uint32_t pad;
+} TraceExtent;
+
+enum {
+    TR_STRING = 1,
+    TR_START,
+    TR_STOP,
+    TR_FORK,
+    TR_CMD,
+    TR_EXE,
+    TR_STATUS,
+    TR_RUSAGE,
+    TR_IOWAIT,
+    TR_IO,
+    TR_THREADS,
+    TR_FILE,
+    TR_SOCKET,
+    TR_PAPI,
+    TR_SAMPLE,
+    TR_LATENCY,
+    TR_DIGEST,
+    TR_MMAP,
+    TR_URING
+};
+
+typedef struct {
+    uint16_t type;
+    uint16_t pad;
+    uint32_t size;          /* Size of the record, including this header */
+} TraceRecord;
+
+/* TR_STRING: a NUL-terminated string with the next id */
+typedef struct {
+    TraceRecord r;
+    uint32_t id;
+    uint32_t length;        /* Length of value, not including the NUL */
+    char value[];
+} TraceString;
+
+/* TR_START */
+typedef struct {
+    TraceRecord r;
+    double time;
+    int32_t pid;
+    int32_t ppid;
+} TraceStart;
+
+/* TR_STOP */
+typedef struct {
+    TraceRecord r;
+    double time;
+} TraceStop;
+
+/* TR_CMD and TR_EXE */
+typedef struct {
+    TraceRecord r;
+    uint32_t name;          /* String id */
+    uint32_t pad;
+} TraceName;
+
+/* TR_STATUS: memory usage from /proc/self/status */
+typedef struct {
+    TraceRecord r;
+    int32_t vmpeak;         /* KB */
+    int32_t rsspeak;        /* KB */
+} TraceStatus;
+
+/* TR_RUSAGE */
+typedef struct {
+    TraceRecord r;
+    double utime;
+    double stime;
+} TraceRusage;
+
+/* TR_IOWAIT */
+typedef struct {
+    TraceRecord r;
+    double iowait;
+} TraceIowait;
+
+/* TR_IO: I/O usage from /proc/self/io */
+typedef struct {
+    TraceRecord r;
+    uint64_t rchar;
+    uint64_t wchar;
+    uint64_t syscr;
+    uint64_t syscw;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t cancelled_write_bytes;
+} TraceIO;
+
+/* TR_THREADS */
+typedef struct {
+    TraceRecord r;
+    int32_t cur;
+    int32_t max;
+    int32_t tot;
+    int32_t pad;
+} TraceThreads;
+
+/* TR_FILE */
+typedef struct {
+    TraceRecord r;
+    uint32_t path;          /* String id */
+    uint32_t pad;
+    uint64_t size;
+    uint64_t bread;
+    uint64_t bwrite;
+    uint64_t nread;
+    uint64_t nwrite;
+    uint64_t bseek;
+    uint64_t nseek;
+} TraceFile;
+
+/* TR_SOCKET */
+typedef struct {
+    TraceRecord r;
+    uint32_t address;       /* String id */
+    int32_t port;
+    uint64_t brecv;
+    uint64_t bsend;
+    uint64_t nrecv;
+    uint64_t nsend;
+} TraceSocket;
+
+/* TR_PAPI */
+typedef struct {
+    TraceRecord r;
+    uint32_t event;         /* String id of the event name */
+    uint32_t pad;
+    int64_t value;
+} TracePAPI;
+
+/* TR_SAMPLE: read, write and seek calls were sampled, so the counters in
+ * the TR_FILE and TR_SOCKET records of this process are estimates */
+typedef struct {
+    TraceRecord r;
+    uint32_t rate;          /* One call in rate was counted, on average */
+    uint32_t pad;
+} TraceSample;
+
+/* TR_LATENCY: latency histograms for a file, written after its TR_FILE
+ * record. Bucket 0 counts calls that took less than 1 ns, and bucket i
+ * counts calls that took at least 2^(i-1) ns and less than 2^i ns. The
+ * last bucket also counts all slower calls. */
+#define TRACE_BUCKETS 32
+
+typedef struct {
+    TraceRecord r;
+    uint32_t path;          /* String id */
+    uint32_t pad;
+    uint32_t read[TRACE_BUCKETS];
+    uint32_t write[TRACE_BUCKETS];
+    uint32_t meta[TRACE_BUCKETS];   /* open and close */
+} TraceLatency;
+
+/* TR_DIGEST: SHA-256 of everything written to a file, written after its
+ * TR_FILE record. It is only written if the file was empty when it was
+ * opened and every write was seen, in order, up to the size and
+ * modification time that the file had when it was closed. */
+typedef struct {
+    TraceRecord r;
+    uint32_t path;          /* String id */
+    uint32_t pad;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint8_t sha256[32];
+} TraceDigest;
+
+/* TR_MMAP: mappings of a file, written when the process exits. bfault is
+ * an estimate of the bytes that were read through the mappings: the part
+ * of each mapping that was resident in memory, according to mincore, when
+ * it was unmapped. It does not need a TR_FILE record. */
+typedef struct {
+    TraceRecord r;
+    uint32_t path;          /* String id */
+    uint32_t pad;
+    uint64_t size;
+    uint64_t nmmap;
+    uint64_t bmmap;         /* Bytes mapped */
+    uint64_t bfault;
+} TraceMmap;
+
+/* TR_URING: io_uring requests on a file that were submitted with
+ * io_uring_enter, written after its TR_FILE record. bsubmit counts the
+ * bytes that reads and writes asked for, not the bytes they moved. */
+typedef struct {
+    TraceRecord r;
+    uint32_t path;          /* String id */
+    uint32_t pad;
+    uint64_t nsubmit;
+    uint64_t bsubmit;
+} TraceUring;
+
+#endif /* KICKSTART_TRACEFILE_H */
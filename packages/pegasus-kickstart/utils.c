@@ -27,6 +27,8 @@
 #include <sys/poll.h>
 #include <wchar.h>
 #include <locale.h>
+#include <pwd.h>
+#include <grp.h>
 
 #include "utils.h"
 
@@ -85,6 +87,25 @@ void yamlquote(FILE *out, const char* msg, size_t msglen) {
     }
 }
 
+static void yamlchar(wint_t c, int *first_line, FILE *out, const int indent) {
+    /* first line can not have leading white spaces */
+    if (*first_line && (
+          c == 0x20 ||
+          c == 0x9  ||
+          c == 0xD  )) {
+        return;
+    }
+
+    /* newline or cr maps to a new line */
+    if (c == 0xA || c == 0xD) {
+        fprintf(out, "\n%*s", indent, "");
+    }
+    else if (yamlprintable(c)) {
+        fprintf(out, "%lc", c);
+        *first_line = 0;
+    }
+}
+
 void yamldump(FILE *in, FILE *out, const int indent) {
     /* purpose: write a stream to yaml as a literal`
      * paramtr: out (IO): stream to write the quoted xml to
@@ -96,22 +117,76 @@ void yamldump(FILE *in, FILE *out, const int indent) {
     wint_t c;
     int first_line = 1;
     while ((c = fgetwc(in)) != WEOF) {
-        /* first line can not have leading white spaces */
-        if (first_line && (
-              c == 0x20 ||
-              c == 0x9  ||
-              c == 0xD  )) {
-            continue;
-        }
+        yamlchar(c, &first_line, out, indent);
+    }
+}
 
-        /* newline or cr maps to a new line */
-        if (c == 0xA || c == 0xD) {
-            fprintf(out, "\n%*s", indent, "");
-        }
-        else if (yamlprintable(c)) {
-            fprintf(out, "%lc", c);
-            first_line = 0;
-        }
+static size_t mbnext(const char *data, size_t size, wchar_t *c, mbstate_t *state) {
+    /* purpose: decode the next character of a buffer like fgetwc() does
+     * returns: the number of bytes of the character, or 0 at the end of
+     *          the buffer or at an invalid or incomplete character */
+    size_t n = mbrtowc(c, data, size, state);
+    if (n == (size_t) -1 || n == (size_t) -2) {
+        return 0;
+    }
+    /* a NUL character is one byte */
+    return n == 0 ? 1 : n;
+}
+
+size_t mbcount(const char *data, size_t size) {
+    /* purpose: count the characters in a buffer, up to the first invalid one
+     * paramtr: data (IN): multibyte characters in the current locale
+     *          size (IN): bytes in data
+     * returns: number of characters */
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    size_t count = 0;
+    size_t n;
+    wchar_t c;
+    while (size > 0 && (n = mbnext(data, size, &c, &state)) > 0) {
+        data += n;
+        size -= n;
+        count++;
+    }
+    return count;
+}
+
+size_t mbskip(const char *data, size_t size, size_t count) {
+    /* purpose: find the byte offset of a character in a buffer
+     * paramtr: data (IN): multibyte characters in the current locale
+     *          size (IN): bytes in data
+     *          count (IN): number of characters to skip
+     * returns: offset of the character after the skipped ones */
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    size_t offset = 0;
+    size_t n;
+    wchar_t c;
+    while (count > 0 && offset < size &&
+           (n = mbnext(data + offset, size - offset, &c, &state)) > 0) {
+        offset += n;
+        count--;
+    }
+    return offset;
+}
+
+void yamldumpbuf(const char *data, size_t size, FILE *out, const int indent) {
+    /* purpose: write a buffer to yaml as a literal, like yamldump()
+     * paramtr: data (IN): multibyte characters in the current locale
+     *          size (IN): bytes in data
+     *          out (IO): stream to write to
+     *          indent: indentation of the lines
+     * returns: nada
+     */
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    int first_line = 1;
+    size_t n;
+    wchar_t c;
+    while (size > 0 && (n = mbnext(data, size, &c, &state)) > 0) {
+        yamlchar(c, &first_line, out, indent);
+        data += n;
+        size -= n;
     }
 }
 
@@ -283,3 +358,53 @@ char* sizer(char* buffer, size_t capacity, size_t vsize, const void* value) {
     return buffer;
 }
 
+
+/* Names of the user and group ids seen so far. A record names the same
+ * few ids several times, and every getpwuid() or getgrgid() call reads
+ * the passwd or group database again. */
+#define ID_CACHE_SIZE 8
+
+typedef struct {
+    unsigned int id;
+    char* name;
+} IdName;
+
+static IdName userCache[ID_CACHE_SIZE];
+static int userCount = 0;
+static IdName groupCache[ID_CACHE_SIZE];
+static int groupCount = 0;
+
+static const char* cachedName(IdName* cache, int* count, unsigned int id, const char* name) {
+    if (*count < ID_CACHE_SIZE && name != NULL) {
+        cache[*count].id = id;
+        cache[*count].name = strdup(name);
+        if (cache[*count].name != NULL) {
+            return cache[(*count)++].name;
+        }
+    }
+    return name;
+}
+
+const char* userName(uid_t uid) {
+    /* purpose: look up the name of a user id
+     * returns: the name, or NULL if the user does not exist */
+    for (int i = 0; i < userCount; i++) {
+        if (userCache[i].id == uid) {
+            return userCache[i].name;
+        }
+    }
+    struct passwd* user = getpwuid(uid);
+    return cachedName(userCache, &userCount, uid, user ? user->pw_name : NULL);
+}
+
+const char* groupName(gid_t gid) {
+    /* purpose: look up the name of a group id
+     * returns: the name, or NULL if the group does not exist */
+    for (int i = 0; i < groupCount; i++) {
+        if (groupCache[i].id == gid) {
+            return groupCache[i].name;
+        }
+    }
+    struct group* group = getgrgid(gid);
+    return cachedName(groupCache, &groupCount, gid, group ? group->gr_name : NULL);
+}
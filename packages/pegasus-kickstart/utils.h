@@ -22,10 +22,15 @@
 
 extern void yamlquote(FILE *out, const char* msg, size_t msglen);
 extern void yamldump(FILE *in, FILE *out, const int indent);
+extern size_t mbcount(const char *data, size_t size);
+extern size_t mbskip(const char *data, size_t size, size_t count);
+extern void yamldumpbuf(const char *data, size_t size, FILE *out, const int indent);
 extern char* fmtisodate(time_t seconds, long micros);
 extern double doubletime(const struct timeval t);
 extern void now(struct timeval* t);
 extern const char* getTempDir(void);
 extern char* sizer(char* buffer, size_t capacity, size_t vsize, const void* value);
+extern const char* userName(uid_t uid);
+extern const char* groupName(gid_t gid);
 
 #endif /* _UTILS_H */
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <string>
+
+#include "gendag.h"
+#include "engine.h"
+#include "dag.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+using std::string;
+using std::exception;
+
+/*
+ * Times each step of loading and running a synthetic DAG: parsing the
+ * DAG file, reading a rescue file, reading and writing the DAG cache,
+ * computing priorities, creating the Engine, and finishing every task in
+ * dependency order. The DAG is benchmarked at several sizes, doubling up
+ * to the largest one, so that the time per task shows whether each step
+ * scales linearly.
+ */
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: bench-dag [options]\n"
+        "\n"
+        "Options:\n"
+        "  -n N      Number of tasks in the largest DAG [1000000]\n"
+        "  -x N      Number of sizes to benchmark, halving each time [4]\n"
+        "  -g SHAPE  Shape of the DAG: levels, wide, chain, butterfly or tree [levels]\n"
+        "  -W N      Width of levels, chains and butterflies [1000]\n"
+        "  -f N      Parents of each task in levels, inputs of each merge in trees [2]\n"
+        "  -R F      Fraction of tasks that are DONE in the rescue file [0.5]\n"
+        "  -k        Keep the generated DAG and rescue files\n"
+    );
+}
+
+/* Peak resident set size of this process in MB */
+static double peak_rss() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        myfailures("getrusage failed");
+    }
+    return usage.ru_maxrss / 1024.0;
+}
+
+static void report(const char *step, double seconds, unsigned tasks) {
+    printf("  %-16s %10.3lf ms %10.1lf ns/task\n", step, 1e3 * seconds,
+            1e9 * seconds / tasks);
+}
+
+static void bench(DAGGenerator &gen, const string &dir, double rescued, bool keep) {
+    string dagfile = dir + "/bench.dag";
+    string rescuefile = dir + "/bench.dag.rescue";
+    string cachefile = dir + "/bench.dag.pmcb";
+
+    gen.write(dagfile);
+    gen.write_rescue(rescuefile, rescued);
+    printf("%u tasks, %lu edges\n", gen.tasks, gen.edges);
+
+    double start = current_time();
+    {
+        DAG dag(dagfile, "", false);
+    }
+    report("read_dag", current_time() - start, gen.tasks);
+
+    start = current_time();
+    {
+        DAG dag(dagfile, rescuefile, false);
+    }
+    report("read_dag+rescue", current_time() - start, gen.tasks);
+
+    unlink(cachefile.c_str());
+    start = current_time();
+    {
+        DAG dag(dagfile, "", false, 1, cachefile);
+    }
+    report("write_cache", current_time() - start, gen.tasks);
+
+    start = current_time();
+    {
+        DAG dag(dagfile, "", false, 1, cachefile);
+    }
+    report("read_cache", current_time() - start, gen.tasks);
+
+    DAG dag(dagfile, "", false);
+
+    start = current_time();
+    dag.compute_priorities(PRIORITY_CRITICAL_PATH);
+    report("priorities", current_time() - start, gen.tasks);
+
+    start = current_time();
+    Engine engine(dag);
+    report("Engine", current_time() - start, gen.tasks);
+
+    start = current_time();
+    unsigned finished = 0;
+    while (engine.has_ready_task()) {
+        engine.mark_task_finished(engine.next_ready_task(), 0);
+        finished++;
+    }
+    report("replay", current_time() - start, gen.tasks);
+
+    if (finished != gen.tasks || !engine.is_finished()) {
+        myfailure("Only %u of %u tasks finished", finished, gen.tasks);
+    }
+
+    printf("  %-16s %10.1lf MB\n", "peak RSS", peak_rss());
+
+    if (keep) {
+        printf("  Kept %s and %s\n", dagfile.c_str(), rescuefile.c_str());
+    } else {
+        unlink(dagfile.c_str());
+        unlink(rescuefile.c_str());
+    }
+    unlink(cachefile.c_str());
+}
+
+int main(int argc, char *argv[]) {
+    DAGGenerator gen;
+    unsigned ntasks = 1000000;
+    unsigned sizes = 4;
+    double rescued = 0.5;
+    bool keep = false;
+
+    gen.width = 1000;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:x:g:W:f:R:kh")) != -1) {
+        switch (c) {
+            case 'n': ntasks = atoi(optarg); break;
+            case 'x': sizes = atoi(optarg); break;
+            case 'g':
+                if (!parse_dag_shape(optarg, &gen.shape)) {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'W': gen.width = atoi(optarg); break;
+            case 'f': gen.fanin = atoi(optarg); break;
+            case 'R': rescued = atof(optarg); break;
+            case 'k': keep = true; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (ntasks == 0 || sizes == 0 || gen.fanin == 0 || rescued < 0 || rescued > 1) {
+        usage();
+        return 1;
+    }
+
+    try {
+        log_set_level(LOG_WARN);
+
+        char dir[] = "/tmp/bench-dag.XXXXXX";
+        if (mkdtemp(dir) == NULL) {
+            myfailures("Unable to create temporary directory");
+        }
+
+        // Smallest first, so that the peak RSS is that of each size
+        for (unsigned i = sizes; i > 0; i--) {
+            gen.tasks = ntasks >> (i - 1);
+            if (gen.tasks == 0) {
+                continue;
+            }
+            bench(gen, dir, rescued, keep);
+        }
+
+        if (!keep) {
+            rmdir(dir);
+        }
+
+        return 0;
+    } catch (exception &error) {
+        log_error("ERROR: %s", error.what());
+        return 1;
+    }
+}
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+
+#include "fdcache.h"
+#include "protocol.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+using std::string;
+using std::vector;
+using std::exception;
+
+/*
+ * Measures the throughput of collective I/O in the master. The first
+ * part writes records straight into an FDCache with write(), for several
+ * cache sizes and numbers of destination files, to show the cost of the
+ * cache hits and misses. The second part runs records through the whole
+ * forwarding path: the worker reads the data from a file and encodes it
+ * in an IODataMessage, then the master decodes the message, enqueues the
+ * data in the FDCache, and flushes it once per scheduling cycle, as
+ * process_iodata() and commit_pending_results() do. This is done with
+ * the data written in the master loop, with --write-behind, and with
+ * --writer-threads. Syscalls are counted from /proc/self/io, so they are
+ * only reported on Linux, and do not include the files opened.
+ */
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: bench-fdcache [options]\n"
+        "\n"
+        "Options:\n"
+        "  -n N      Number of records [100000]\n"
+        "  -s SIZE   Mean record size in bytes [4096]\n"
+        "  -d DIST   Distribution of record sizes: fixed, uniform or mixed,\n"
+        "            which is mostly small records with a few 1 MB chunks [fixed]\n"
+        "  -o N      Destination files for the forwarding path [16]\n"
+        "  -c N      Records per scheduling cycle of the master [64]\n"
+        "  -t N      Writer threads for --writer-threads [4]\n"
+        "  -D DIR    Directory to write the files in [/tmp]\n"
+        "  -k        Keep the files that were written\n"
+    );
+}
+
+enum SizeDistribution {
+    SIZES_FIXED,
+    SIZES_UNIFORM,
+    SIZES_MIXED
+};
+
+/* Counts of read and write syscalls from /proc/self/io */
+static bool syscall_counts(unsigned long *reads, unsigned long *writes) {
+    FILE *f = fopen("/proc/self/io", "r");
+    if (f == NULL) {
+        return false;
+    }
+    char line[128];
+    bool found_reads = false;
+    bool found_writes = false;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "syscr: %lu", reads) == 1) {
+            found_reads = true;
+        } else if (sscanf(line, "syscw: %lu", writes) == 1) {
+            found_writes = true;
+        }
+    }
+    fclose(f);
+    return found_reads && found_writes;
+}
+
+/* Measures the time, CPU and syscalls of one run */
+class Measurement {
+    double start;
+    double cpu_start;
+    unsigned long reads;
+    unsigned long writes;
+    bool counted;
+public:
+    double elapsed;
+    double cpu;
+    long syscalls;
+
+    void begin() {
+        counted = syscall_counts(&reads, &writes);
+        cpu_start = cpu_time();
+        start = current_time();
+    }
+
+    void end() {
+        elapsed = current_time() - start;
+        cpu = cpu_time() - cpu_start;
+        unsigned long r, w;
+        syscalls = -1;
+        if (counted && syscall_counts(&r, &w)) {
+            // Reading /proc/self/io is one read itself
+            syscalls = (r - reads - 1) + (w - writes);
+        }
+    }
+};
+
+static vector<unsigned> record_sizes(unsigned n, unsigned mean, SizeDistribution dist) {
+    vector<unsigned> sizes(n);
+    srand(42);
+    for (unsigned i = 0; i < n; i++) {
+        switch (dist) {
+            case SIZES_FIXED:
+                sizes[i] = mean;
+                break;
+            case SIZES_UNIFORM:
+                sizes[i] = 1 + rand() % (2 * mean);
+                break;
+            case SIZES_MIXED:
+                // Like task stdout, with the occasional chunk of a large file
+                if (rand() % 100 == 0) {
+                    sizes[i] = IODATA_CHUNK_SIZE;
+                } else {
+                    sizes[i] = 1 + rand() % (2 * mean);
+                }
+                break;
+        }
+    }
+    return sizes;
+}
+
+static string file_name(const string &dir, const char *prefix, unsigned i) {
+    char name[32];
+    sprintf(name, "%s.%u", prefix, i);
+    return dir + "/" + name;
+}
+
+static void remove_files(const string &dir, const char *prefix, unsigned n) {
+    for (unsigned i = 0; i < n; i++) {
+        unlink(file_name(dir, prefix, i).c_str());
+    }
+}
+
+static void report(const char *label, const Measurement &m, unsigned long bytes,
+        unsigned records) {
+    double mb = bytes / (1024.0 * 1024.0);
+    printf("  %-24s %10.1lf MB/s %12.0lf records/s %10.3lf ms CPU/MB", label,
+            m.elapsed > 0 ? mb / m.elapsed : 0.0,
+            m.elapsed > 0 ? records / m.elapsed : 0.0,
+            mb > 0 ? 1e3 * m.cpu / mb : 0.0);
+    if (m.syscalls >= 0) {
+        printf(" %8.3lf syscalls/record", (double)m.syscalls / records);
+    }
+    printf("\n");
+}
+
+/* Write records round robin to fanout files through a cache of maxsize */
+static void bench_write(const string &dir, const vector<unsigned> &sizes,
+        const char *payload, unsigned long bytes, unsigned maxsize, unsigned fanout,
+        bool keep) {
+    vector<string> files;
+    for (unsigned i = 0; i < fanout; i++) {
+        files.push_back(file_name(dir, "write", i));
+    }
+    remove_files(dir, "write", fanout);
+
+    FDCache cache(maxsize);
+    Measurement m;
+    m.begin();
+    for (unsigned i = 0; i < sizes.size(); i++) {
+        if (cache.write(files[i % fanout], payload, sizes[i]) < 0) {
+            myfailures("Unable to write %s", files[i % fanout].c_str());
+        }
+    }
+    cache.close();
+    m.end();
+
+    char label[64];
+    sprintf(label, "maxsize %u, %u files", maxsize, fanout);
+    report(label, m, bytes, sizes.size());
+    printf("  %-24s %10.1lf%% hits\n", "", 100.0 * cache.hitrate());
+
+    if (!keep) {
+        remove_files(dir, "write", fanout);
+    }
+}
+
+/*
+ * Run records through the forwarding path. The worker side is timed
+ * separately from the master side, so that the CPU per MB is only the
+ * master's.
+ */
+static void bench_forward(const string &dir, const char *label, const vector<unsigned> &sizes,
+        unsigned long bytes, unsigned fanout, unsigned cycle, unsigned write_behind,
+        unsigned threads, bool keep) {
+    // The data that the tasks forward, which the worker reads back
+    string srcfile = dir + "/forward.src";
+    int src = open(srcfile.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (src < 0) {
+        myfailures("Unable to create %s", srcfile.c_str());
+    }
+    vector<char> chunk(IODATA_CHUNK_SIZE, 'x');
+    if (write(src, &chunk[0], chunk.size()) != (ssize_t)chunk.size()) {
+        myfailures("Unable to write %s", srcfile.c_str());
+    }
+
+    vector<string> files;
+    for (unsigned i = 0; i < fanout; i++) {
+        files.push_back(file_name(dir, "forward", i));
+    }
+    remove_files(dir, "forward", fanout);
+
+    // Worker: read each record and encode it
+    vector<IODataMessage *> messages;
+    messages.reserve(sizes.size());
+    Measurement worker;
+    worker.begin();
+    for (unsigned i = 0; i < sizes.size(); i++) {
+        if (pread(src, &chunk[0], sizes[i], 0) != (ssize_t)sizes[i]) {
+            myfailures("Unable to read %s", srcfile.c_str());
+        }
+        char task[32];
+        sprintf(task, "task%u", i);
+        messages.push_back(new IODataMessage(task, files[i % fanout], &chunk[0], sizes[i]));
+    }
+    worker.end();
+    close(src);
+    unlink(srcfile.c_str());
+
+    // Master: decode each message, buffer the data, and write it at the
+    // end of every cycle
+    FDCache cache(256);
+    if (write_behind > 0) {
+        cache.start_writer(write_behind, threads);
+    }
+    Measurement master;
+    master.begin();
+    for (unsigned i = 0; i < messages.size(); i++) {
+        IODataMessage *sent = messages[i];
+        IODataMessage mesg(sent->msg, sent->msgsize, 1);
+        cache.enqueue(mesg.filename, mesg.task, mesg.data, mesg.size, 1);
+        // The decoded message owns the buffer now
+        sent->msg = NULL;
+        delete sent;
+        if ((i + 1) % cycle == 0 && write_behind == 0) {
+            cache.flush();
+        }
+    }
+    cache.flush();
+    cache.close();
+    master.end();
+
+    printf("  %s\n", label);
+    report("worker read+encode", worker, bytes, sizes.size());
+    report("master decode+write", master, bytes, sizes.size());
+
+    if (!keep) {
+        remove_files(dir, "forward", fanout);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned records = 100000;
+    unsigned mean = 4096;
+    SizeDistribution dist = SIZES_FIXED;
+    const char *dist_name = "fixed";
+    unsigned fanout = 16;
+    unsigned cycle = 64;
+    unsigned threads = 4;
+    string dir = "/tmp";
+    bool keep = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:d:o:c:t:D:kh")) != -1) {
+        switch (c) {
+            case 'n': records = atoi(optarg); break;
+            case 's': mean = atoi(optarg); break;
+            case 'd':
+                dist_name = optarg;
+                if (strcmp(optarg, "fixed") == 0) {
+                    dist = SIZES_FIXED;
+                } else if (strcmp(optarg, "uniform") == 0) {
+                    dist = SIZES_UNIFORM;
+                } else if (strcmp(optarg, "mixed") == 0) {
+                    dist = SIZES_MIXED;
+                } else {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'o': fanout = atoi(optarg); break;
+            case 'c': cycle = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'D': dir = optarg; break;
+            case 'k': keep = true; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (records == 0 || mean == 0 || mean > IODATA_CHUNK_SIZE / 2 || fanout == 0 ||
+            cycle == 0 || threads == 0) {
+        usage();
+        return 1;
+    }
+
+    try {
+        log_set_level(LOG_WARN);
+
+        vector<unsigned> sizes = record_sizes(records, mean, dist);
+        unsigned long bytes = 0;
+        for (unsigned i = 0; i < sizes.size(); i++) {
+            bytes += sizes[i];
+        }
+        vector<char> payload(IODATA_CHUNK_SIZE, 'x');
+
+        printf("FDCache::write: %u %s records, %.1lf MB\n", records, dist_name,
+                bytes / (1024.0 * 1024.0));
+        unsigned maxsizes[] = {16, 256};
+        unsigned fanouts[] = {1, 16, 256, 1024};
+        for (unsigned i = 0; i < 2; i++) {
+            for (unsigned j = 0; j < 4; j++) {
+                bench_write(dir, sizes, &payload[0], bytes, maxsizes[i], fanouts[j], keep);
+            }
+        }
+
+        printf("Forwarding path: %u %s records, %.1lf MB, %u files, %u records per cycle\n",
+                records, dist_name, bytes / (1024.0 * 1024.0), fanout, cycle);
+        bench_forward(dir, "written by the master loop", sizes, bytes, fanout, cycle,
+                0, 1, keep);
+        bench_forward(dir, "--write-behind 10", sizes, bytes, fanout, cycle,
+                10, 1, keep);
+        char label[64];
+        sprintf(label, "--write-behind 10 --writer-threads %u", threads);
+        bench_forward(dir, label, sizes, bytes, fanout, cycle, 10, threads, keep);
+
+        return 0;
+    } catch (exception &error) {
+        log_error("ERROR: %s", error.what());
+        return 1;
+    }
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "simcomm.h"
+#include "gendag.h"
+#include "master.h"
+#include "engine.h"
+#include "dag.h"
+#include "config.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+using std::vector;
+using std::exception;
+
+/*
+ * Runs the master against a simulated communicator to measure how fast
+ * it schedules a large synthetic workflow. The tasks do not run: each
+ * one takes its -r estimate in virtual time, so the makespan is the one
+ * the master would achieve with infinitely fast workers and network, and
+ * the CPU time is what the master (and the simulator) spent to get there.
+ */
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: bench-scheduler [options]\n"
+        "\n"
+        "Options:\n"
+        "  -n N      Number of tasks [1000000]\n"
+        "  -w N      Number of workers [10000]\n"
+        "  -p N      Workers per host [16]\n"
+        "  -s N      Slots per worker (--worker-slots) [1]\n"
+        "  -g SHAPE  Shape of the DAG: levels, wide, chain, butterfly or tree [levels]\n"
+        "  -W N      Width of levels, chains and butterflies [all tasks]\n"
+        "  -f N      Parents of each task in levels, inputs of each merge in trees [2]\n"
+        "  -r T      Mean task runtime in seconds [60]\n"
+        "  -j F      Runtime jitter as a fraction of the mean [0.5]\n"
+        "  -b N      Tasks per batch (--batch-size) [1]\n"
+        "  -B        Broadcast the DAG (--broadcast-dag)\n"
+        "  -S        Use sub-masters (--submasters)\n"
+        "  -k        Keep the generated DAG file\n"
+        "  -v        Show the master's log messages\n"
+    );
+}
+
+static double percentile(const vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    unsigned i = (unsigned)(p * (sorted.size() - 1));
+    return sorted[i];
+}
+
+int main(int argc, char *argv[]) {
+    DAGGenerator gen;
+    int nworkers = 10000;
+    unsigned per_host = 16;
+    bool keep = false;
+    bool verbose = false;
+
+    gen.tasks = 1000000;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:w:p:s:g:W:f:r:j:b:BSkvh")) != -1) {
+        switch (c) {
+            case 'n': gen.tasks = atoi(optarg); break;
+            case 'w': nworkers = atoi(optarg); break;
+            case 'p': per_host = atoi(optarg); break;
+            case 's': config.worker_slots = atoi(optarg); break;
+            case 'g':
+                if (!parse_dag_shape(optarg, &gen.shape)) {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'W': gen.width = atoi(optarg); break;
+            case 'f': gen.fanin = atoi(optarg); break;
+            case 'r': gen.runtime = atof(optarg); break;
+            case 'j': gen.jitter = atof(optarg); break;
+            case 'b': config.batch_size = atoi(optarg); break;
+            case 'B': config.broadcast_dag = true; break;
+            case 'S': config.submasters = true; break;
+            case 'k': keep = true; break;
+            case 'v': verbose = true; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (gen.tasks == 0 || nworkers <= 0 || per_host == 0 || gen.fanin == 0 ||
+            config.worker_slots == 0 || config.batch_size == 0) {
+        usage();
+        return 1;
+    }
+
+    try {
+        log_set_level(verbose ? LOG_INFO : LOG_WARN);
+
+        char dagfile[] = "/tmp/bench-scheduler.XXXXXX";
+        int fd = mkstemp(dagfile);
+        if (fd < 0) {
+            myfailures("Unable to create DAG file");
+        }
+        close(fd);
+
+        double start = current_time();
+        gen.write(dagfile);
+        DAG dag(dagfile, "", false);
+        Engine engine(dag);
+        double load_time = current_time() - start;
+
+        unsigned slots = nworkers * config.worker_slots;
+        cpu_t host_cpus = per_host * config.worker_slots;
+        SimCommunicator comm(&dag, nworkers, per_host, host_cpus, 1024 * 1024);
+        Master master(&comm, argv[0], engine, dag, dagfile, "/dev/null",
+                "/dev/null");
+
+        double cpu_start = cpu_time();
+        start = current_time();
+        int rc = master.run();
+        double elapsed = current_time() - start;
+        double cpu = cpu_time() - cpu_start;
+
+        if (!keep) {
+            unlink(dagfile);
+        }
+
+        vector<double> cycles = comm.cycle_times();
+        std::sort(cycles.begin(), cycles.end());
+        double cycle_total = 0.0;
+        for (unsigned i = 0; i < cycles.size(); i++) {
+            cycle_total += cycles[i];
+        }
+
+        // The makespan can't be less than the total work spread across
+        // every slot, or than the critical path
+        double bound = std::max(gen.total_runtime / slots, gen.critical_path);
+
+        printf("DAG: %u tasks, %lu edges, %s\n", gen.tasks, gen.edges,
+                keep ? dagfile : "deleted");
+        printf("Workers: %d (%u slots, %u workers per host)\n",
+                nworkers, slots, per_host);
+        printf("DAG load time: %.3lf s\n", load_time);
+        printf("Master wall time: %.3lf s\n", elapsed);
+        printf("Master CPU time: %.3lf s (%.2lf us/task)\n", cpu,
+                1e6 * cpu / gen.tasks);
+        printf("Scheduling cycles: %lu\n", (unsigned long)cycles.size());
+        if (!cycles.empty()) {
+            printf("Cycle latency: mean %.2lf us, p50 %.2lf us, p99 %.2lf us, max %.2lf us\n",
+                    1e6 * cycle_total / cycles.size(),
+                    1e6 * percentile(cycles, 0.50),
+                    1e6 * percentile(cycles, 0.99),
+                    1e6 * cycles.back());
+        }
+        printf("Virtual makespan: %.3lf s (lower bound %.3lf s, efficiency %.3lf)\n",
+                comm.virtual_time(), bound,
+                comm.virtual_time() > 0 ? bound / comm.virtual_time() : 0.0);
+        printf("Bytes sent: %lu, received: %lu\n", comm.sent(), comm.recvd());
+
+        return rc;
+    } catch (exception &error) {
+        log_error("ERROR: %s", error.what());
+        return 1;
+    }
+}
@@ -1,13 +1,22 @@
 #ifndef COMM_H
 #define COMM_H
 
+#include <vector>
+
 #include "protocol.h"
+#include "tools.h"
+
+using std::vector;
 
 class Communicator {
 public:
     Communicator() {}
     virtual ~Communicator() {}
     virtual void send_message(Message *message, int dest) = 0;
+    virtual void send_message_async(Message *message, int dest) = 0;
+    virtual void wait_for_sends() = 0;
+    virtual Message *broadcast_message(Message *message, int root) = 0;
+    virtual vector<Message *> gather_messages(Message *message, int root) = 0;
     virtual Message *recv_message(double timeout = 0) = 0;
     virtual bool message_waiting() = 0;
     virtual void barrier() = 0;
@@ -16,6 +25,12 @@ public:
     virtual int size() = 0;
     virtual unsigned long sent() = 0;
     virtual unsigned long recvd() = 0;
+    // Whether the methods can be called from different threads, as long
+    // as the calls don't overlap
+    virtual bool supports_threads() { return true; }
+    // The clock that the master uses to account for the time of the
+    // slots, which is virtual when the workers are simulated
+    virtual double clock() { return current_time(); }
 };
 
 #endif /* COMM_H */
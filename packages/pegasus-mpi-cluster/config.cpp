@@ -1,4 +1,63 @@
 #include "config.h"
 
+Configuration::Configuration() {
+    set_affinity = false;
+    memory_affinity = MEMORY_AFFINITY_NONE;
+    thread_env = true;
+    backfill = false;
+    aging_interval = 0.0;
+    starvation_time = 0.0;
+    placement = PLACEMENT_PACK;
+    submasters = false;
+    batch_size = 1;
+    prefetch = 0;
+    broadcast_dag = false;
+    rescue_batch = 1;
+    rescue_interval = 1000;
+    binary_rescue = false;
+    write_behind = 0;
+    writer_threads = 1;
+    stream_pipes = false;
+    direct_forwards = false;
+    master_memory = 0;
+    rank_stdio = false;
+    merge_threads = 4;
+    worker_slots = 1;
+    vfork = false;
+    speculate = 0.0;
+    locality_delay = 0.0;
+    release_idle = 0.0;
+    wall_time_margin = 0.0;
+    quarantine_failures = 0;
+    quarantine_time = 300.0;
+    bundle_time = 0.0;
+    recv_thread = false;
+    estimate_resources = false;
+    overcommit_memory = 0.0;
+    staging_size = 0;
+    max_runtime = 0.0;
+    resource_log_binary = false;
+    resource_log_interval = 0.0;
+    event_interval = 1000;
+    status_interval = 10.0;
+    monitor = false;
+}
+
 Configuration config;
 
+
+static const char *placement_names[] = {"", "pack", "spread", "first-fit", "least-loaded"};
+
+bool parse_placement(const std::string &name, PlacementPolicy &policy) {
+    for (int p = PLACEMENT_PACK; p <= PLACEMENT_LEAST_LOADED; p++) {
+        if (name == placement_names[p]) {
+            policy = (PlacementPolicy)p;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *placement_name(PlacementPolicy policy) {
+    return placement_names[policy];
+}
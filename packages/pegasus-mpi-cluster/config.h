@@ -1,9 +1,86 @@
 #ifndef _CONFIG_H
 #define _CONFIG_H
 
+#include <string>
+#include <map>
+#include <vector>
+
+enum MemoryAffinity {
+    MEMORY_AFFINITY_NONE,      // Tasks use the default memory policy
+    MEMORY_AFFINITY_PREFERRED, // Prefer the NUMA node of the task's CPUs
+    MEMORY_AFFINITY_BIND       // Only use the NUMA node of the task's CPUs
+};
+
+/* How the scheduler chooses among the hosts that can run a task */
+enum PlacementPolicy {
+    PLACEMENT_DEFAULT,      // The policy of the workflow, or none in the resource log
+    PLACEMENT_PACK,         // The host with the fewest free resources that fit
+    PLACEMENT_SPREAD,       // The host with the most free resources
+    PLACEMENT_FIRST_FIT,    // The first host that fits, in registration order
+    PLACEMENT_LEAST_LOADED  // The host with the largest fraction of its CPUs free
+};
+
+bool parse_placement(const std::string &name, PlacementPolicy &policy);
+const char *placement_name(PlacementPolicy policy);
+
 class Configuration {
 public:
     bool set_affinity;
+    MemoryAffinity memory_affinity;
+    // Set OMP_NUM_THREADS and the like in the environment of tasks
+    bool thread_env;
+    bool backfill;
+    double aging_interval;
+    double starvation_time;
+    std::map<std::string, unsigned> max_jobs;
+    PlacementPolicy placement;
+    bool submasters;
+    unsigned batch_size;
+    unsigned prefetch;
+    bool broadcast_dag;
+    // Files and directories copied to broadcast_dir on each host at startup
+    std::vector<std::string> broadcast_files;
+    std::string broadcast_dir;
+    unsigned rescue_batch;
+    unsigned rescue_interval;
+    bool binary_rescue;
+    std::string dag_stream;
+    unsigned write_behind;
+    unsigned writer_threads;
+    bool stream_pipes;
+    bool direct_forwards;
+    unsigned master_memory;
+    bool rank_stdio;
+    unsigned merge_threads;
+    unsigned worker_slots;
+    bool vfork;
+    double speculate;
+    double locality_delay;
+    double release_idle;
+    double wall_time_margin;
+    unsigned quarantine_failures;
+    double quarantine_time;
+    double bundle_time;
+    bool recv_thread;
+    bool estimate_resources;
+    std::string cgroup_dir;
+    double overcommit_memory;
+    std::string result_cache;
+    std::string cache_env;
+    std::string staging_dir;
+    unsigned staging_size;
+    double max_runtime;
+    bool resource_log_binary;
+    double resource_log_interval;
+    unsigned event_interval;
+    std::string status_file;
+    double status_interval;
+    std::string trace_file;
+    std::string utilization_file;
+    bool monitor;
+    std::string monitor_interpose;
+
+    Configuration();
 };
 
 extern Configuration config;
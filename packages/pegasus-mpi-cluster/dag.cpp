@@ -1,30 +1,43 @@
 #include <map>
+#include <set>
 #include <vector>
+#include <algorithm>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <math.h>
 #include <cstdlib>
 #include <fstream>
+#include <new>
 
 #include "strlib.h"
 #include "dag.h"
 #include "failure.h"
 #include "log.h"
+#include "config.h"
 
 using std::string;
 using std::vector;
 using std::map;
 using std::list;
 
-Task::Task(const string &name, const list<string> &args, unsigned memory, unsigned cpus, unsigned tries, int priority, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards) {
+Task::Task(const string &name, const ArgList &args, unsigned memory, unsigned cpus, unsigned tries, int priority, double runtime, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards) {
     this->name = name;
     this->args = args;
     this->memory = memory;
     this->cpus = cpus;
+    this->gpus = 0;
+    this->threads = 0;
+    this->hosts = 1;
     this->tries = tries;
     this->priority = priority;
+    this->runtime = runtime;
+    this->max_runtime = 0.0;
+    this->placement = PLACEMENT_DEFAULT;
     this->pipe_forwards = NULL;
     if (pipe_forwards.size() > 0) {
         this->pipe_forwards = new map<string,string>(pipe_forwards);
@@ -33,16 +46,29 @@ Task::Task(const string &name, const list<string> &args, unsigned memory, unsign
     if (file_forwards.size() > 0) {
         this->file_forwards = new map<string,string>(file_forwards);
     }
-    this->io_failed = false;
+    this->inputs = NULL;
+    this->outputs = NULL;
+    this->intermediates = NULL;
+    this->transformation = NULL;
+    this->category = NULL;
     this->success = false;
     this->failures = 0;
     this->last_exitcode = 0;
     this->submit_seq = 0;
+    this->index = 0;
+    this->workflow = 0;
+    this->sweep = NULL;
+    this->sweep_index = 0;
+    this->sweep_args = NULL;
 }
 
 Task::~Task() {
+    delete sweep_args;
     delete pipe_forwards;
     delete file_forwards;
+    delete inputs;
+    delete outputs;
+    delete intermediates;
 }
 
 bool Task::is_ready() {
@@ -61,7 +87,8 @@ bool Task::is_ready() {
     return true;
 }
 
-DAG::DAG(const string &dagfile, const string &rescuefile, const bool lock, unsigned tries) {
+DAG::DAG(const string &dagfile, const string &rescuefile, const bool lock, unsigned tries, const string &cachefile) {
+    this->block_used = TASK_BLOCK_SIZE;
     this->lock = lock;
     this->dagfd = -1;
     this->tries = tries;
@@ -91,7 +118,11 @@ DAG::DAG(const string &dagfile, const string &rescuefile, const bool lock, unsig
         }
     }
 
-    this->read_dag(dagfile);
+    if (cachefile.empty()) {
+        this->read_dag(dagfile);
+    } else {
+        this->read_cached_dag(dagfile, cachefile);
+    }
 
     if (!rescuefile.empty()) {
         this->read_rescue(rescuefile);
@@ -118,28 +149,112 @@ DAG::~DAG() {
         close(this->dagfd);
     }
 
-    // Delete all tasks
+    this->clear();
+}
+
+/* Delete all the tasks and edges */
+void DAG::clear() {
+    // The tasks were constructed in place in the blocks
     for (iterator i = this->begin(); i != this->end(); i++) {
-        delete (*i).second;
+        (*i)->~Task();
     }
+    for (unsigned i = 0; i < blocks.size(); i++) {
+        operator delete(blocks[i]);
+    }
+    blocks.clear();
+    for (unsigned i = 0; i < sweeps.size(); i++) {
+        delete sweeps[i];
+    }
+    sweeps.clear();
+    block_used = TASK_BLOCK_SIZE;
+    tasks.clear();
+    table.clear();
+    edges.clear();
+    child_edges.clear();
+    parent_edges.clear();
+    maxjobs.clear();
+    strings.clear();
+}
+
+/* Get memory for a new task from the current block */
+void *DAG::allocate_task() {
+    if (block_used == TASK_BLOCK_SIZE) {
+        blocks.push_back((char *)operator new(sizeof(Task) * TASK_BLOCK_SIZE));
+        block_used = 0;
+    }
+    return blocks.back() + sizeof(Task) * block_used++;
+}
+
+/* FNV-1a */
+static unsigned hash_name(const string &name) {
+    unsigned h = 2166136261u;
+    for (unsigned i = 0; i < name.length(); i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Return the position of name in the hash table, or of the empty slot
+ * where it would go. The table size is a power of two and the table is
+ * never more than half full, so there is always an empty slot.
+ */
+unsigned DAG::find_slot(const string &name) const {
+    unsigned mask = table.size() - 1;
+    unsigned i = hash_name(name) & mask;
+    while (table[i] != NULL && table[i]->name != name) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void DAG::rehash(unsigned size) {
+    table.assign(size, NULL);
+    for (iterator i = this->begin(); i != this->end(); i++) {
+        table[find_slot((*i)->name)] = *i;
+    }
+}
+
+/*
+ * Number the tasks of this DAG as part of a run with several workflows
+ * and prefix their names, so that the names stay unique in the master.
+ * This is done after the rescue file has been read, because it records
+ * the names without the prefix.
+ */
+void DAG::set_workflow(unsigned workflow, const string &prefix) {
+    this->name_prefix = prefix;
+    for (iterator i = this->begin(); i != this->end(); i++) {
+        (*i)->workflow = workflow;
+        (*i)->name.insert(0, prefix);
+    }
+    rehash(table.size());
 }
 
 bool DAG::has_task(const string &name) const {
-    return this->tasks.find(name) != this->tasks.end();
+    return this->get_task(name) != NULL;
 }
 
 Task *DAG::get_task(const string &name) const {
-    if (!this->has_task(name)) {
+    if (table.empty()) {
         return NULL;
     }
-    return (*(this->tasks.find(name))).second;
+    return table[find_slot(name)];
 }
 
 void DAG::add_task(Task *task) {
     if (this->has_task(task->name)) {
         myfailure("Duplicate task: %s\n", task->name.c_str());
     }
-    this->tasks[task->name] = task;
+    task->index = this->tasks.size();
+    this->tasks.push_back(task);
+
+    // Keep the table at most half full
+    if (table.size() < 2 * tasks.size()) {
+        rehash(std::max(16u, 2 * (unsigned)table.size()));
+    } else {
+        table[find_slot(task->name)] = task;
+    }
 }
 
 void DAG::add_edge(const string &parent, const string &child) {
@@ -153,178 +268,813 @@ void DAG::add_edge(const string &parent, const string &child) {
     Task *p = get_task(parent);
     Task *c = get_task(child);
 
-    p->children.push_back(c);
-    c->parents.push_back(p);
+    // The edges are added to the tasks by build_edges
+    edges.push_back(std::make_pair(p, c));
+}
+
+/*
+ * Parse a parameter sweep name of the form base[START:END]. Returns false
+ * if name is not a sweep, in which case it is the name of a single task.
+ */
+static bool parse_sweep(const string &name, string &base, unsigned *start, unsigned *end) {
+    size_t open = name.rfind('[');
+    size_t colon = name.rfind(':');
+    if (open == string::npos || open == 0 || colon == string::npos || colon < open ||
+            name[name.length() - 1] != ']') {
+        return false;
+    }
+    string first = name.substr(open + 1, colon - open - 1);
+    string last = name.substr(colon + 1, name.length() - colon - 2);
+    if (first.empty() || last.empty() ||
+            first.find_first_not_of("0123456789") != string::npos ||
+            last.find_first_not_of("0123456789") != string::npos) {
+        return false;
+    }
+    base = name.substr(0, open);
+    *start = (unsigned)strtoul(first.c_str(), NULL, 10);
+    *end = (unsigned)strtoul(last.c_str(), NULL, 10);
+    if (*start >= *end) {
+        myfailure("Empty parameter sweep: %s", name.c_str());
+    }
+    return true;
+}
+
+/* The name of task i of the sweep base */
+static string sweep_name(const string &base, unsigned i) {
+    char index[16];
+    snprintf(index, sizeof(index), "[%u]", i);
+    return base + index;
+}
+
+/* Replace each {i} in s with index */
+static string substitute(const string &s, const string &index) {
+    string result = s;
+    size_t pos = 0;
+    while ((pos = result.find("{i}", pos)) != string::npos) {
+        result.replace(pos, 3, index);
+        pos += index.length();
+    }
+    return result;
+}
+
+/* Intern the files in list with each {i} replaced by index */
+FileList *DAG::substitute_files(const FileList *list, const string &index) {
+    if (list == NULL) {
+        return NULL;
+    }
+    FileList *result = new FileList(*list);
+    for (unsigned i = 0; i < result->size(); i++) {
+        if ((*result)[i]->find("{i}") != string::npos) {
+            (*result)[i] = strings.intern(substitute(*(*result)[i], index));
+        }
+    }
+    return result;
+}
+
+/*
+ * Add the tasks base[start] to base[end - 1] of a parameter sweep. The
+ * DAG keeps the template, and each task only gets its name, resources
+ * and files, which the master needs before the task is ready. Its
+ * arguments and forwards are filled in by expand when it is ready, so a
+ * large sweep does not hold a copy of them for every index.
+ */
+void DAG::add_sweep(Task *tmpl, const string &base, unsigned start, unsigned end) {
+    sweeps.push_back(tmpl);
+    map<string, string> none;
+    char buf[16];
+    for (unsigned i = start; i < end; i++) {
+        string name = sweep_name(base, i);
+        if (this->has_task(name)) {
+            const Task *other = get_task(name)->sweep;
+            if (other != NULL) {
+                myfailure("Duplicate task: %s is in sweeps %s and %s", name.c_str(), 
+                        other->name.c_str(), tmpl->name.c_str());
+            }
+            myfailure("Duplicate task: %s is also in sweep %s", name.c_str(), 
+                    tmpl->name.c_str());
+        }
+
+        snprintf(buf, sizeof(buf), "%u", i);
+        string index = buf;
+
+        Task *t = new (allocate_task()) Task(name, ArgList(), tmpl->memory, 
+                tmpl->cpus, tmpl->tries, tmpl->priority, tmpl->runtime, none, none);
+        t->gpus = tmpl->gpus;
+        t->threads = tmpl->threads;
+        t->hosts = tmpl->hosts;
+        t->max_runtime = tmpl->max_runtime;
+        t->placement = tmpl->placement;
+        t->inputs = substitute_files(tmpl->inputs, index);
+        t->outputs = substitute_files(tmpl->outputs, index);
+        t->intermediates = substitute_files(tmpl->intermediates, index);
+        t->transformation = tmpl->transformation;
+        t->category = tmpl->category;
+        t->sweep = tmpl;
+        t->sweep_index = i;
+        this->add_task(t);
+    }
+}
+
+/*
+ * Fill in the arguments, forwards and Pegasus id of a sweep task from its
+ * template, with {i} replaced by its index. Arguments without {i} are
+ * shared with the template. The others belong to the task rather than
+ * the string pool, so that collapse can free them. Does nothing if the
+ * task is not in a sweep or was already expanded.
+ */
+void DAG::expand(Task *task) {
+    const Task *tmpl = task->sweep;
+    if (tmpl == NULL || !task->args.empty()) {
+        return;
+    }
+
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u", task->sweep_index);
+    string index = buf;
+
+    task->args = tmpl->args;
+    for (unsigned j = 0; j < task->args.size(); j++) {
+        if (task->args[j]->find("{i}") != string::npos) {
+            if (task->sweep_args == NULL) {
+                task->sweep_args = new list<string>();
+            }
+            task->sweep_args->push_back(substitute(*task->args[j], index));
+            task->args[j] = &task->sweep_args->back();
+        }
+    }
+    if (tmpl->pipe_forwards != NULL) {
+        task->pipe_forwards = new map<string, string>();
+        for (map<string, string>::iterator f = tmpl->pipe_forwards->begin(); 
+                f != tmpl->pipe_forwards->end(); f++) {
+            (*task->pipe_forwards)[f->first] = substitute(f->second, index);
+        }
+    }
+    if (tmpl->file_forwards != NULL) {
+        task->file_forwards = new map<string, string>();
+        for (map<string, string>::iterator f = tmpl->file_forwards->begin(); 
+                f != tmpl->file_forwards->end(); f++) {
+            (*task->file_forwards)[substitute(f->first, index)] = substitute(f->second, index);
+        }
+    }
+    if (!tmpl->pegasus_id.empty()) {
+        task->pegasus_id = substitute(tmpl->pegasus_id, index);
+    }
+}
+
+/*
+ * Give back what expand filled in once the master is done with a sweep
+ * task, so that only the tasks that are ready or running hold their
+ * arguments and forwards. The task can be expanded again if it is
+ * retried. Does nothing if the task is not in a sweep.
+ */
+void DAG::collapse(Task *task) {
+    if (task->sweep == NULL) {
+        return;
+    }
+    ArgList().swap(task->args);
+    delete task->sweep_args;
+    task->sweep_args = NULL;
+    delete task->pipe_forwards;
+    task->pipe_forwards = NULL;
+    delete task->file_forwards;
+    task->file_forwards = NULL;
+    string().swap(task->pegasus_id);
+}
+
+/*
+ * Store the edges in compressed sparse row form: the children of each
+ * task are contiguous in child_edges, and likewise for parents, in the
+ * order that the edges appear in the DAG file.
+ */
+void DAG::build_edges() {
+    unsigned n = tasks.size();
+    vector<unsigned> child_start(n + 1, 0);
+    vector<unsigned> parent_start(n + 1, 0);
+    for (unsigned e = 0; e < edges.size(); e++) {
+        child_start[edges[e].first->index + 1]++;
+        parent_start[edges[e].second->index + 1]++;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        child_start[i + 1] += child_start[i];
+        parent_start[i + 1] += parent_start[i];
+    }
+
+    child_edges.assign(edges.size(), NULL);
+    parent_edges.assign(edges.size(), NULL);
+    vector<unsigned> child_next(child_start.begin(), child_start.end() - 1);
+    vector<unsigned> parent_next(parent_start.begin(), parent_start.end() - 1);
+    for (unsigned e = 0; e < edges.size(); e++) {
+        Task *p = edges[e].first;
+        Task *c = edges[e].second;
+        child_edges[child_next[p->index]++] = c;
+        parent_edges[parent_next[c->index]++] = p;
+    }
+
+    for (unsigned i = 0; i < n; i++) {
+        Task *t = tasks[i];
+        unsigned nchildren = child_start[i + 1] - child_start[i];
+        unsigned nparents = parent_start[i + 1] - parent_start[i];
+        t->children = nchildren ? TaskArray(&child_edges[child_start[i]], nchildren) : TaskArray();
+        t->parents = nparents ? TaskArray(&parent_edges[parent_start[i]], nparents) : TaskArray();
+    }
+
+    // Release the memory used by the edge list
+    vector<pair<Task *, Task *> >().swap(edges);
+}
+
+/* Order the tasks so that every task comes after all of its parents */
+void DAG::topological_sort(vector<Task *> &order) {
+    vector<unsigned> pending(tasks.size());
+    for (iterator i = this->begin(); i != this->end(); i++) {
+        Task *t = *i;
+        pending[t->index] = t->parents.size();
+        if (t->parents.empty()) {
+            order.push_back(t);
+        }
+    }
+
+    for (unsigned i = 0; i < order.size(); i++) {
+        Task *t = order[i];
+        for (unsigned j = 0; j < t->children.size(); j++) {
+            Task *c = t->children[j];
+            if (--pending[c->index] == 0) {
+                order.push_back(c);
+            }
+        }
+    }
+
+    if (order.size() != this->tasks.size()) {
+        myfailure("DAG contains a cycle");
+    }
+}
+
+/*
+ * Replace the task priorities with ones derived from the structure of
+ * the DAG. For the critical path mode the rank of a task is its runtime
+ * estimate (or 1 if it does not have one) plus the largest rank of its
+ * children. The ranks are converted to integer priorities that preserve
+ * their order.
+ */
+void DAG::compute_priorities(PriorityMode mode) {
+    if (mode == PRIORITY_USER) {
+        return;
+    }
+
+    vector<Task *> order;
+    topological_sort(order);
+
+    map<Task *, double> rank;
+    if (mode == PRIORITY_CRITICAL_PATH) {
+        for (vector<Task *>::reverse_iterator i = order.rbegin(); i != order.rend(); i++) {
+            Task *t = *i;
+            double longest = 0.0;
+            for (unsigned j = 0; j < t->children.size(); j++) {
+                longest = std::max(longest, rank[t->children[j]]);
+            }
+            rank[t] = (t->runtime > 0 ? t->runtime : 1.0) + longest;
+        }
+    } else {
+        // The level of a task is the length of the longest path from a root
+        for (vector<Task *>::iterator i = order.begin(); i != order.end(); i++) {
+            Task *t = *i;
+            double level = 0.0;
+            for (unsigned j = 0; j < t->parents.size(); j++) {
+                level = std::max(level, rank[t->parents[j]] + 1);
+            }
+            rank[t] = level;
+        }
+        if (mode == PRIORITY_BFS) {
+            for (map<Task *, double>::iterator r = rank.begin(); r != rank.end(); r++) {
+                r->second = -r->second;
+            }
+        }
+    }
+
+    // Tasks with the same rank get the same priority
+    std::set<double> distinct;
+    for (map<Task *, double>::iterator r = rank.begin(); r != rank.end(); r++) {
+        distinct.insert(r->second);
+    }
+    map<double, int> priorities;
+    int next = 0;
+    for (std::set<double>::iterator d = distinct.begin(); d != distinct.end(); d++) {
+        priorities[*d] = next++;
+    }
+    for (map<Task *, double>::iterator r = rank.begin(); r != rank.end(); r++) {
+        r->first->priority = priorities[r->second];
+        log_trace("Task %s has computed priority %d", r->first->name.c_str(), 
+                r->first->priority);
+    }
+}
+
+static bool is_delim(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* A field of a record, pointing into the DAG file */
+struct Field {
+    const char *start;
+    const char *end;
+
+    string str() const { return string(start, end - start); }
+};
+
+/*
+ * Split the record [p, end) on whitespace into at most maxsplits + 1
+ * fields without copying. This works the same way as split(): the last
+ * field is the rest of the record with the whitespace trimmed off.
+ */
+static unsigned split_record(const char *p, const char *end, unsigned maxsplits, Field *fields) {
+    unsigned n = 0;
+    while (p < end) {
+        while (p < end && is_delim(*p)) p++;
+        if (p == end) {
+            break;
+        }
+        fields[n].start = p;
+        if (n == maxsplits) {
+            while (end > p && is_delim(end[-1])) end--;
+            p = end;
+        } else {
+            while (p < end && !is_delim(*p)) p++;
+        }
+        fields[n].end = p;
+        n++;
+    }
+    return n;
 }
 
+/*
+ * Splits task arguments one at a time using the same quoting rules as
+ * split_args(). The argument is stored in a string supplied by the
+ * caller so that its buffer can be reused for every argument.
+ */
+class ArgTokenizer {
+    const char *p;
+    const char *end;
+public:
+    ArgTokenizer(const Field &f) : p(f.start), end(f.end) {}
+
+    bool next(string &arg) {
+        arg.clear();
+        bool inquote = false;
+        while (p < end) {
+            char c = *p++;
+            if (c == '\'' || c == '"') {
+                if (inquote) {
+                    return true;
+                }
+                inquote = true;
+            } else if (c == '\\') {
+                if (p < end) {
+                    arg += *p++;
+                } else {
+                    arg += c;
+                }
+            } else if (isspace(c)) {
+                if (inquote) {
+                    arg += c;
+                } else if (arg.length() > 0) {
+                    return true;
+                }
+            } else {
+                arg += c;
+            }
+        }
+        return arg.length() > 0;
+    }
+};
+
+/* Parse a number the same way sscanf does. Returns false if s is not a number */
+static bool parse_double(const string &s, double *value) {
+    const char *start = s.c_str();
+    char *end;
+    *value = strtod(start, &end);
+    return end != start;
+}
+
+static bool parse_int(const string &s, int *value) {
+    const char *start = s.c_str();
+    char *end;
+    *value = (int)strtol(start, &end, 10);
+    return end != start;
+}
+
+/*
+ * The DAG file is mapped into memory and each record is split in place.
+ * Strings are only created for the values that are stored in the DAG
+ * and for error messages.
+ */
 void DAG::read_dag(const string &filename) {
-    std::ifstream infile;
-    infile.open(filename.c_str());
-    if (!infile.good()) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
         myfailures("Error opening DAG file: %s", filename.c_str());
     }
 
-    const char *DELIM = " \t\n\r";
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        myfailures("Error reading DAG: %s", filename.c_str());
+    }
+
+    // Files that can't be mapped, such as pipes, are read into memory instead
+    size_t size = 0;
+    char *data = NULL;
+    bool mapped = S_ISREG(st.st_mode);
+    vector<char> buffer;
+    if (mapped) {
+        size = st.st_size;
+        if (size > 0) {
+            data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                myfailures("Error reading DAG: %s", filename.c_str());
+            }
+            madvise(data, size, MADV_SEQUENTIAL);
+        }
+    } else {
+        char block[BUFSIZ];
+        ssize_t r;
+        while ((r = read(fd, block, sizeof(block))) > 0) {
+            buffer.insert(buffer.end(), block, block + r);
+        }
+        if (r < 0) {
+            close(fd);
+            myfailures("Error reading DAG: %s", filename.c_str());
+        }
+        size = buffer.size();
+        if (size > 0) {
+            data = &buffer[0];
+        }
+    }
+    close(fd);
+
+    try {
+        parse_dag(data, size);
+    } catch (...) {
+        if (mapped && size > 0) munmap(data, size);
+        throw;
+    }
+
+    if (mapped && size > 0) munmap(data, size);
+
+    build_edges();
+
+    log_debug("DAG has %u tasks, %u edges, and %u distinct arguments", 
+            tasks.size(), child_edges.size(), strings.size());
+}
+
+void DAG::parse_dag(const char *data, size_t size) {
     string pegasus_id = "";
-    string rec;
-    while (getline(infile, rec)) {
-        trim(rec);
+    const string *transformation = NULL;
+
+    // These are reused for every record to avoid allocating memory
+    string arg;
+    string value;
+    string parent;
+    string child;
+    ArgList interned;
+
+    const char *next = data;
+    const char *stop = data + size;
+    while (next < stop) {
+        // Find the next line and trim it
+        const char *rec = next;
+        const char *eol = (const char *)memchr(rec, '\n', stop - rec);
+        if (eol == NULL) {
+            eol = stop;
+        }
+        next = eol + 1;
+        while (rec < eol && is_delim(*rec)) rec++;
+        while (eol > rec && is_delim(eol[-1])) eol--;
+        size_t reclen = eol - rec;
 
         // Blank lines
-        if (rec.length() == 0) {
+        if (reclen == 0) {
             continue;
         }
 
-        if (rec.find("TASK", 0, 4) == 0) {
-            vector<string> v;
-
-            split(v, rec, DELIM, 2);
+        Field v[4];
 
-            if (v.size() < 3) {
-                myfailure("Invalid TASK record: %s\n", rec.c_str());
+        if (reclen >= 4 && memcmp(rec, "TASK", 4) == 0) {
+            if (split_record(rec, eol, 2, v) < 3) {
+                myfailure("Invalid TASK record: %s\n", string(rec, reclen).c_str());
             }
 
-            string name = v[1];
+            string name = v[1].str();
+
+            // A parameter sweep is parsed once into a template task that
+            // the tasks of the sweep are expanded from
+            string base;
+            unsigned sweep_start = 0;
+            unsigned sweep_end = 0;
+            bool sweep = parse_sweep(name, base, &sweep_start, &sweep_end);
 
             // Check for duplicate tasks
-            if (this->has_task(name)) {
+            if (!sweep && this->has_task(name)) {
+                const Task *other = get_task(name)->sweep;
+                if (other != NULL) {
+                    myfailure("Duplicate task: %s is also in sweep %s", name.c_str(), 
+                            other->name.c_str());
+                }
                 myfailure("Duplicate task: %s", name.c_str());
             }
 
             // Default task arguments
             unsigned memory = 0;
             unsigned cpus = 1;
+            unsigned gpus = 0;
+            unsigned threads = 0;
+            unsigned hosts = 1;
             unsigned tries = this->tries;
             int priority = 0;
+            double runtime = 0.0;
+            double max_runtime = 0.0;
+            PlacementPolicy placement = PLACEMENT_DEFAULT;
+            const string *category = NULL;
             map<string, string> pipe_forwards;
             map<string, string> file_forwards;
+            FileList inputs;
+            FileList outputs;
+            FileList intermediates;
 
             // Parse task arguments
-            list<string> args;
-            split_args(args, v[2]);
-            while (true) {
-                string arg = args.front();
-                if (arg[0] == '-') {
-                    if (arg == "-m" || arg == "--request-memory") {
-                        args.pop_front();
-                        if (args.size() == 0) {
-                            myfailure("-m/--request-memory requires N for task %s", 
-                                name.c_str());
-                        }
-                        string smemory = args.front();
-                        float fmemory;
-                        if (sscanf(smemory.c_str(), "%f", &fmemory) != 1) {
-                            myfailure(
-                                "Invalid memory requirement '%s' for task %s", 
-                                smemory.c_str(), name.c_str());
-                        }
-                        if (fmemory < 0) {
-                            myfailure(
-                                "Negative memory requirement not allowed for task %s", 
-                                name.c_str());
-                        }
-                        // We round up to the next integer
-                        memory = (unsigned)ceil(fmemory);
-                        log_trace("Requested %u MB memory for task %s", 
-                            memory, name.c_str());
-                    } else if (arg == "-c" || arg == "--request-cpus") {
-                        args.pop_front();
-                        if (args.size() == 0) {
-                            myfailure("-c/--request-cpus requires N for task %s", 
-                                name.c_str());
-                        }
-                        string scpus = args.front();
-                        float fcpus;
-                        if (sscanf(scpus.c_str(), "%f", &fcpus) != 1) {
-                            myfailure(
-                                "Invalid CPU requirement '%s' for task %s", 
-                                scpus.c_str(), name.c_str());
-                        }
-                        if (fcpus < 0) {
-                            myfailure(
-                                "Negative CPU requirement not allowed for task %s", 
-                                name.c_str());
-                        }
-                        // We round up to the next integer
-                        cpus = (unsigned)ceil(fcpus);
-                        log_trace("Requested %u CPUs for task %s", 
-                            cpus, name.c_str());
-                    } else if (arg == "-t" || arg == "--tries") {
-                        args.pop_front();
-                        if (args.size() == 0) {
-                            myfailure("-t/--tries requires N for task %s", 
-                                name.c_str());
-                        }
-                        string stries = args.front();
-                        int itries;
-                        if (sscanf(stries.c_str(), "%d", &itries) != 1) {
-                            myfailure("Invalid tries '%s' for task %s", 
-                                stries.c_str(), name.c_str());
-                        }
-                        if (itries < 0) {
-                            myfailure("Negative tries not allowed for task %s", 
-                                name.c_str());
-                        }
-                        tries = itries;
-                        log_trace("Task %s has %u tries", name.c_str(), tries);
-                    } else if (arg == "-p" || arg == "--priority") {
-                        args.pop_front();
-                        if (args.size() == 0) {
-                            myfailure("-p/--priority requires P for task %s", 
-                                name.c_str());
-                        }
-                        string spriority = args.front();
-                        if (sscanf(spriority.c_str(), "%d", &priority) != 1) {
-                            myfailure("Invalid priority '%s' for task %s", 
-                                spriority.c_str(), name.c_str());
-                        }
-                        log_trace("Task %s has priority %d", 
-                            name.c_str(), priority);
-                    } else if (arg == "-f" || arg == "--pipe-forward") {
-                        args.pop_front();
-                        if (args.size() == 0) {
-                            myfailure("-f/--pipe-forward requires VAR=PATH for task %s",
-                                name.c_str());
-                        }
-                        string forward = args.front();
-                        size_t eq = forward.find("=");
-                        if (eq == string::npos) {
-                            myfailure("-f/--pipe-forward format should be VAR=PATH for task %s: %s",
-                                    name.c_str(), forward.c_str());
-                        }
-                        string varname = forward.substr(0, eq);
-                        string filename = forward.substr(eq + 1);
-                        log_trace("Task %s needs data forwarded to %s",
-                                name.c_str(), filename.c_str());
-                        pipe_forwards[varname] = filename;
-                    } else if (arg == "-F" || arg == "--file-forward") {
-                        args.pop_front();
-                        if (args.size() == 0) {
-                            myfailure("-F/--file-forward requires SRC=DEST for task %s",
-                                name.c_str());
-                        }
-                        string forward = args.front();
-                        size_t eq = forward.find("=");
-                        if (eq == string::npos) {
-                            myfailure("-F/--file-forward format should be SRC=DEST for task %s: %s",
-                                    name.c_str(), forward.c_str());
-                        }
-                        string srcfile = forward.substr(0, eq);
-                        string destfile = forward.substr(eq + 1);
-                        log_trace("Task %s needs data forwarded from %s to %s",
-                                name.c_str(), srcfile.c_str(), destfile.c_str());
-                        file_forwards[srcfile] = destfile;
-                    } else {
-                        myfailure("Invalid argument '%s' for task %s", 
-                            arg.c_str(), name.c_str());
-                    }
-                    args.pop_front();
+            ArgTokenizer args(v[2]);
+            bool more = args.next(arg);
+            while (more && arg[0] == '-') {
+                if (arg == "-m" || arg == "--request-memory") {
+                    if (!args.next(value)) {
+                        myfailure("-m/--request-memory requires N for task %s", 
+                            name.c_str());
+                    }
+                    double dmemory;
+                    if (!parse_double(value, &dmemory)) {
+                        myfailure(
+                            "Invalid memory requirement '%s' for task %s", 
+                            value.c_str(), name.c_str());
+                    }
+                    float fmemory = (float)dmemory;
+                    if (fmemory < 0) {
+                        myfailure(
+                            "Negative memory requirement not allowed for task %s", 
+                            name.c_str());
+                    }
+                    // We round up to the next integer
+                    memory = (unsigned)ceil(fmemory);
+                    log_trace("Requested %u MB memory for task %s", 
+                        memory, name.c_str());
+                } else if (arg == "-c" || arg == "--request-cpus") {
+                    if (!args.next(value)) {
+                        myfailure("-c/--request-cpus requires N for task %s", 
+                            name.c_str());
+                    }
+                    double dcpus;
+                    if (!parse_double(value, &dcpus)) {
+                        myfailure(
+                            "Invalid CPU requirement '%s' for task %s", 
+                            value.c_str(), name.c_str());
+                    }
+                    float fcpus = (float)dcpus;
+                    if (fcpus < 0) {
+                        myfailure(
+                            "Negative CPU requirement not allowed for task %s", 
+                            name.c_str());
+                    }
+                    // We round up to the next integer
+                    cpus = (unsigned)ceil(fcpus);
+                    log_trace("Requested %u CPUs for task %s", 
+                        cpus, name.c_str());
+                } else if (arg == "-g" || arg == "--request-gpus") {
+                    if (!args.next(value)) {
+                        myfailure("-g/--request-gpus requires N for task %s", 
+                            name.c_str());
+                    }
+                    int igpus;
+                    if (!parse_int(value, &igpus)) {
+                        myfailure("Invalid GPU requirement '%s' for task %s", 
+                            value.c_str(), name.c_str());
+                    }
+                    if (igpus < 0) {
+                        myfailure(
+                            "Negative GPU requirement not allowed for task %s", 
+                            name.c_str());
+                    }
+                    gpus = igpus;
+                    log_trace("Requested %u GPUs for task %s", 
+                        gpus, name.c_str());
+                } else if (arg == "--request-hosts") {
+                    if (!args.next(value)) {
+                        myfailure("--request-hosts requires N for task %s", 
+                            name.c_str());
+                    }
+                    int ihosts;
+                    if (!parse_int(value, &ihosts)) {
+                        myfailure("Invalid host requirement '%s' for task %s", 
+                            value.c_str(), name.c_str());
+                    }
+                    if (ihosts < 1) {
+                        myfailure("Task %s must request at least 1 host", 
+                            name.c_str());
+                    }
+                    hosts = ihosts;
+                    log_trace("Requested %u hosts for task %s", 
+                        hosts, name.c_str());
+                } else if (arg == "--threads") {
+                    if (!args.next(value)) {
+                        myfailure("--threads requires N for task %s", 
+                            name.c_str());
+                    }
+                    int ithreads;
+                    if (!parse_int(value, &ithreads)) {
+                        myfailure("Invalid threads '%s' for task %s", 
+                            value.c_str(), name.c_str());
+                    }
+                    if (ithreads < 1 || ithreads > 255) {
+                        myfailure("Task %s must run between 1 and 255 threads", 
+                            name.c_str());
+                    }
+                    threads = ithreads;
+                    log_trace("Requested %u threads for task %s", 
+                        threads, name.c_str());
+                } else if (arg == "-t" || arg == "--tries") {
+                    if (!args.next(value)) {
+                        myfailure("-t/--tries requires N for task %s", 
+                            name.c_str());
+                    }
+                    int itries;
+                    if (!parse_int(value, &itries)) {
+                        myfailure("Invalid tries '%s' for task %s", 
+                            value.c_str(), name.c_str());
+                    }
+                    if (itries < 0) {
+                        myfailure("Negative tries not allowed for task %s", 
+                            name.c_str());
+                    }
+                    tries = itries;
+                    log_trace("Task %s has %u tries", name.c_str(), tries);
+                } else if (arg == "-p" || arg == "--priority") {
+                    if (!args.next(value)) {
+                        myfailure("-p/--priority requires P for task %s", 
+                            name.c_str());
+                    }
+                    if (!parse_int(value, &priority)) {
+                        myfailure("Invalid priority '%s' for task %s", 
+                            value.c_str(), name.c_str());
+                    }
+                    log_trace("Task %s has priority %d", 
+                        name.c_str(), priority);
+                } else if (arg == "-r" || arg == "--runtime") {
+                    if (!args.next(value)) {
+                        myfailure("-r/--runtime requires T for task %s", 
+                            name.c_str());
+                    }
+                    if (!parse_double(value, &runtime)) {
+                        myfailure("Invalid runtime '%s' for task %s", 
+                            value.c_str(), name.c_str());
+                    }
+                    if (runtime < 0) {
+                        myfailure("Negative runtime not allowed for task %s", 
+                            name.c_str());
+                    }
+                    log_trace("Task %s has runtime estimate %lf seconds", 
+                        name.c_str(), runtime);
+                } else if (arg == "-T" || arg == "--max-runtime") {
+                    if (!args.next(value)) {
+                        myfailure("-T/--max-runtime requires T for task %s", 
+                            name.c_str());
+                    }
+                    if (!parse_double(value, &max_runtime)) {
+                        myfailure("Invalid maximum runtime '%s' for task %s", 
+                            value.c_str(), name.c_str());
+                    }
+                    if (max_runtime < 0) {
+                        myfailure("Negative maximum runtime not allowed for task %s", 
+                            name.c_str());
+                    }
+                    log_trace("Task %s has maximum runtime %lf seconds", 
+                        name.c_str(), max_runtime);
+                } else if (arg == "--placement") {
+                    if (!args.next(value)) {
+                        myfailure("--placement requires POLICY for task %s", 
+                            name.c_str());
+                    }
+                    if (!parse_placement(value, placement)) {
+                        myfailure("Invalid placement policy '%s' for task %s", 
+                            value.c_str(), name.c_str());
+                    }
+                    log_trace("Task %s has placement policy %s", 
+                        name.c_str(), value.c_str());
+                } else if (arg == "--category") {
+                    if (!args.next(value)) {
+                        myfailure("--category requires NAME for task %s", 
+                            name.c_str());
+                    }
+                    category = strings.intern(value);
+                    log_trace("Task %s is in category %s", 
+                        name.c_str(), value.c_str());
+                } else if (arg == "-f" || arg == "--pipe-forward") {
+                    if (!args.next(value)) {
+                        myfailure("-f/--pipe-forward requires VAR=PATH for task %s",
+                            name.c_str());
+                    }
+                    size_t eq = value.find("=");
+                    if (eq == string::npos) {
+                        myfailure("-f/--pipe-forward format should be VAR=PATH for task %s: %s",
+                                name.c_str(), value.c_str());
+                    }
+                    string varname = value.substr(0, eq);
+                    string filename = value.substr(eq + 1);
+                    log_trace("Task %s needs data forwarded to %s",
+                            name.c_str(), filename.c_str());
+                    pipe_forwards[varname] = filename;
+                } else if (arg == "-F" || arg == "--file-forward") {
+                    if (!args.next(value)) {
+                        myfailure("-F/--file-forward requires SRC=DEST for task %s",
+                            name.c_str());
+                    }
+                    size_t eq = value.find("=");
+                    if (eq == string::npos) {
+                        myfailure("-F/--file-forward format should be SRC=DEST for task %s: %s",
+                                name.c_str(), value.c_str());
+                    }
+                    string srcfile = value.substr(0, eq);
+                    string destfile = value.substr(eq + 1);
+                    log_trace("Task %s needs data forwarded from %s to %s",
+                            name.c_str(), srcfile.c_str(), destfile.c_str());
+                    file_forwards[srcfile] = destfile;
+                } else if (arg == "-i" || arg == "--input") {
+                    if (!args.next(value)) {
+                        myfailure("-i/--input requires PATH for task %s",
+                            name.c_str());
+                    }
+                    log_trace("Task %s reads %s", name.c_str(), value.c_str());
+                    inputs.push_back(strings.intern(value));
+                } else if (arg == "-o" || arg == "--output") {
+                    if (!args.next(value)) {
+                        myfailure("-o/--output requires PATH for task %s",
+                            name.c_str());
+                    }
+                    log_trace("Task %s writes %s", name.c_str(), value.c_str());
+                    outputs.push_back(strings.intern(value));
+                } else if (arg == "-I" || arg == "--intermediate") {
+                    if (!args.next(value)) {
+                        myfailure("-I/--intermediate requires PATH for task %s",
+                            name.c_str());
+                    }
+                    // Intermediate files live under the staging directory
+                    if (value.empty() || value[0] == '/' || value == ".." ||
+                            value.compare(0, 3, "../") == 0 ||
+                            value.find("/../") != string::npos ||
+                            (value.length() >= 3 && 
+                             value.compare(value.length() - 3, 3, "/..") == 0)) {
+                        myfailure("-I/--intermediate PATH must be relative to the "
+                            "staging directory for task %s: %s", name.c_str(), 
+                            value.c_str());
+                    }
+                    log_trace("Task %s writes intermediate file %s", name.c_str(), 
+                            value.c_str());
+                    const string *path = strings.intern(value);
+                    outputs.push_back(path);
+                    intermediates.push_back(path);
                 } else {
-                    break;
+                    myfailure("Invalid argument '%s' for task %s", 
+                        arg.c_str(), name.c_str());
                 }
+                more = args.next(arg);
+            }
+
+            if (!more) {
+                myfailure("Missing command for task %s", name.c_str());
             }
 
-            Task *t = new Task(name, args, memory, cpus, tries, priority, pipe_forwards, file_forwards);
+            interned.clear();
+            do {
+                interned.push_back(strings.intern(arg));
+            } while (args.next(arg));
+
+            Task *t;
+            if (sweep) {
+                t = new Task(name, interned, memory, cpus, tries, priority, runtime, 
+                        pipe_forwards, file_forwards);
+            } else {
+                t = new (allocate_task()) Task(name, interned, memory, cpus, tries, 
+                        priority, runtime, pipe_forwards, file_forwards);
+            }
+            t->gpus = gpus;
+            t->threads = threads;
+            t->hosts = hosts;
+            t->max_runtime = max_runtime;
+            t->placement = placement;
+            t->category = category;
+            if (!inputs.empty()) {
+                t->inputs = new FileList(inputs);
+            }
+            if (!outputs.empty()) {
+                t->outputs = new FileList(outputs);
+            }
+            if (!intermediates.empty()) {
+                t->intermediates = new FileList(intermediates);
+            }
 
             if (pegasus_id.length() > 0) {
                 // We are only interested in the pegasus ID
@@ -333,46 +1083,574 @@ void DAG::read_dag(const string &filename) {
                 // reset the value so that the next task doesn't get it
                 pegasus_id = "";
             }
-            this->add_task(t);
-        } else if (rec.find("EDGE", 0, 4) == 0) {
+            t->transformation = transformation;
+            transformation = NULL;
+            if (sweep) {
+                this->add_sweep(t, base, sweep_start, sweep_end);
+            } else {
+                this->add_task(t);
+            }
+        } else if (reclen >= 4 && memcmp(rec, "EDGE", 4) == 0) {
+            if (split_record(rec, eol, 2, v) < 3) {
+                myfailure("Invalid EDGE record: %s\n", string(rec, reclen).c_str());
+            }
 
-            vector<string> v;
+            parent.assign(v[1].start, v[1].end - v[1].start);
+            child.assign(v[2].start, v[2].end - v[2].start);
+
+            // Edges between sweeps connect the tasks with the same offset
+            // in each sweep, and edges between a sweep and a single task
+            // connect the task to every task of the sweep
+            string parent_base;
+            string child_base;
+            unsigned pstart, pend, cstart, cend;
+            bool psweep = parse_sweep(parent, parent_base, &pstart, &pend);
+            bool csweep = parse_sweep(child, child_base, &cstart, &cend);
+            if (psweep && csweep) {
+                if (pend - pstart != cend - cstart) {
+                    myfailure("Sweeps in EDGE record have different sizes: %s", 
+                            string(rec, reclen).c_str());
+                }
+                for (unsigned i = 0; i < pend - pstart; i++) {
+                    this->add_edge(sweep_name(parent_base, pstart + i), 
+                            sweep_name(child_base, cstart + i));
+                }
+            } else if (psweep) {
+                for (unsigned i = pstart; i < pend; i++) {
+                    this->add_edge(sweep_name(parent_base, i), child);
+                }
+            } else if (csweep) {
+                for (unsigned i = cstart; i < cend; i++) {
+                    this->add_edge(parent, sweep_name(child_base, i));
+                }
+            } else {
+                this->add_edge(parent, child);
+            }
+        } else if (reclen >= 7 && memcmp(rec, "MAXJOBS", 7) == 0) {
+            // Like DAGMan, a limit of 0 means that there is no limit
+            int limit;
+            if (split_record(rec, eol, 2, v) < 3 || !parse_int(v[2].str(), &limit) ||
+                    limit < 0) {
+                myfailure("Invalid MAXJOBS record: %s\n", string(rec, reclen).c_str());
+            }
+            maxjobs[v[1].str()] = limit;
+        } else if (reclen >= 2 && memcmp(rec, "#@", 2) == 0) {
+            // Pegasus cluster comment - includes extra task information
+            if (split_record(rec, eol, 3, v) < 4) {
+                myfailure("Invalid #@ record: %s\n", string(rec, reclen).c_str());
+            }
+
+            pegasus_id = v[1].str();
+            transformation = strings.intern(v[2].str());
+            //pegasus_dax_id = v[3];
+        } else if (rec[0] == '#') {
+            // Comments
+        } else {
+            myfailure("Invalid DAG record: %s", string(rec, reclen).c_str());
+        }
+    }
+}
+
+/*
+ * The compiled DAG cache is the task table and edge arrays of a DAG
+ * written in the native format of the machine. It is only used if it
+ * was written by the same version of PMC for the same DAG file (inode),
+ * with the same size and modification time to the nanosecond, and with
+ * the same default number of tries. Whole seconds are not enough: a DAG
+ * that is regenerated right after a run usually has the same size and
+ * is written within the same second.
+ */
+#define DAG_CACHE_MAGIC "PMCB"
+#define DAG_CACHE_VERSION 12
+
+struct DAGCacheHeader {
+    char magic[4];
+    unsigned version;
+    unsigned tries;
+    unsigned nsweeps;
+    unsigned ntasks;
+    unsigned nstrings;
+    unsigned nedges;
+    off_t dagsize;
+    ino_t dagino;
+    time_t dagmtime;
+    long dagmtime_nsec;
+};
+
+static void cache_put(string &buf, const void *data, size_t size) {
+    buf.append((const char *)data, size);
+}
+
+static void cache_put_unsigned(string &buf, unsigned value) {
+    cache_put(buf, &value, sizeof(value));
+}
+
+static void cache_put_string(string &buf, const string &s) {
+    cache_put_unsigned(buf, s.length());
+    buf.append(s);
+}
+
+static void cache_put_forwards(string &buf, const map<string, string> *forwards) {
+    // Tasks without forwards have no map
+    if (forwards == NULL) {
+        cache_put_unsigned(buf, 0);
+        return;
+    }
+    cache_put_unsigned(buf, forwards->size());
+    for (map<string, string>::const_iterator i = forwards->begin(); i != forwards->end(); i++) {
+        cache_put_string(buf, i->first);
+        cache_put_string(buf, i->second);
+    }
+}
 
-            split(v, rec, DELIM, 2);
+static void cache_put_files(string &buf, const FileList *files) {
+    if (files == NULL) {
+        cache_put_unsigned(buf, 0);
+        return;
+    }
+    cache_put_unsigned(buf, files->size());
+    for (unsigned i = 0; i < files->size(); i++) {
+        cache_put_string(buf, *(*files)[i]);
+    }
+}
 
-            if (v.size() < 3) {
-                myfailure("Invalid EDGE record: %s\n", rec.c_str());
+/* Reads values from a cache. Every method returns false if the cache is truncated */
+class CacheReader {
+    const char *p;
+    const char *end;
+public:
+    CacheReader(const char *data, size_t size) : p(data), end(data + size) {}
+
+    bool get(void *value, size_t size) {
+        if ((size_t)(end - p) < size) {
+            return false;
+        }
+        memcpy(value, p, size);
+        p += size;
+        return true;
+    }
+
+    bool get_unsigned(unsigned &value) {
+        return get(&value, sizeof(value));
+    }
+
+    bool get_string(string &s) {
+        unsigned length;
+        if (!get_unsigned(length) || (size_t)(end - p) < length) {
+            return false;
+        }
+        s.assign(p, length);
+        p += length;
+        return true;
+    }
+
+    bool get_forwards(map<string, string> &forwards) {
+        unsigned count;
+        if (!get_unsigned(count)) {
+            return false;
+        }
+        string key;
+        string value;
+        for (unsigned i = 0; i < count; i++) {
+            if (!get_string(key) || !get_string(value)) {
+                return false;
+            }
+            forwards[key] = value;
+        }
+        return true;
+    }
+
+    bool get_files(vector<string> &files) {
+        unsigned count;
+        if (!get_unsigned(count)) {
+            return false;
+        }
+        files.resize(count);
+        for (unsigned i = 0; i < count; i++) {
+            if (!get_string(files[i])) {
+                return false;
             }
+        }
+        return true;
+    }
 
-            string parent = v[1];
-            string child = v[2];
+    bool done() const { return p == end; }
+};
+
+/*
+ * Load the DAG from the cache if it is up to date, otherwise parse the
+ * DAG file and write a new cache.
+ */
+void DAG::read_cached_dag(const string &dagfile, const string &cachefile) {
+    // The DAG is checked before it is read so that the cache is not
+    // marked up to date if the DAG changes while it is being parsed
+    struct stat dagstat;
+    if (stat(dagfile.c_str(), &dagstat) < 0) {
+        myfailures("Error opening DAG file: %s", dagfile.c_str());
+    }
 
-            this->add_edge(parent, child);
-        } else if (rec.find("#@", 0, 2) == 0) {
-            // Pegasus cluster comment - includes extra task information
-            vector<string> v;
+    if (this->read_cache(cachefile, dagstat)) {
+        log_debug("DAG has %u tasks, %u edges, and %u distinct arguments", 
+                tasks.size(), child_edges.size(), strings.size());
+        return;
+    }
+
+    this->read_dag(dagfile);
+    this->write_cache(cachefile, dagstat);
+}
+
+bool DAG::read_cache(const string &cachefile, const struct stat &dagstat) {
+    int fd = open(cachefile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            log_warn("Unable to open DAG cache %s: %s", cachefile.c_str(), strerror(errno));
+        }
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        log_warn("Unable to read DAG cache %s: %s", cachefile.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    DAGCacheHeader header;
+    if ((size_t)st.st_size < sizeof(header)) {
+        log_warn("Ignoring invalid DAG cache %s", cachefile.c_str());
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_warn("Unable to read DAG cache %s: %s", cachefile.c_str(), strerror(errno));
+        return false;
+    }
+
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, DAG_CACHE_MAGIC, 4) != 0 || 
+            header.version != DAG_CACHE_VERSION) {
+        log_warn("Ignoring invalid DAG cache %s", cachefile.c_str());
+        munmap(data, size);
+        return false;
+    }
+
+    if (header.dagsize != dagstat.st_size || 
+            header.dagino != dagstat.st_ino || 
+            header.dagmtime != dagstat.st_mtim.tv_sec || 
+            header.dagmtime_nsec != dagstat.st_mtim.tv_nsec || 
+            header.tries != this->tries) {
+        log_debug("DAG cache %s is out of date", cachefile.c_str());
+        munmap(data, size);
+        return false;
+    }
+
+    bool loaded = this->load_cache(data, size);
+    munmap(data, size);
 
-            split(v, rec, DELIM, 3);
+    if (!loaded) {
+        log_warn("Ignoring invalid DAG cache %s", cachefile.c_str());
+        this->clear();
+        return false;
+    }
+
+    log_debug("Loaded DAG from cache %s", cachefile.c_str());
+
+    return true;
+}
+
+/* Create the tasks and edges from the cache. Returns false if the cache is invalid. */
+bool DAG::load_cache(const char *data, size_t size) {
+    CacheReader cache(data, size);
+
+    DAGCacheHeader header;
+    cache.get(&header, sizeof(header));
 
-            if (v.size() < 4) {
-                myfailure("Invalid #@ record: %s\n", rec.c_str());
+    // Arguments are stored once, and tasks refer to them by index
+    vector<const string *> args_table(header.nstrings);
+    string arg;
+    for (unsigned i = 0; i < header.nstrings; i++) {
+        if (!cache.get_string(arg)) {
+            return false;
+        }
+        args_table[i] = strings.intern(arg);
+    }
+
+    string name;
+    string pegasus_id;
+    string transformation;
+    string category;
+    ArgList args;
+    for (unsigned i = 0; i < header.nsweeps + header.ntasks; i++) {
+        bool is_template = i < header.nsweeps;
+        unsigned sweep = 0;
+        unsigned sweep_index = 0;
+        unsigned memory;
+        unsigned cpus;
+        unsigned gpus;
+        unsigned threads;
+        unsigned hosts;
+        unsigned placement;
+        unsigned tries;
+        int priority;
+        double runtime;
+        double max_runtime;
+        unsigned nargs;
+        map<string, string> pipe_forwards;
+        map<string, string> file_forwards;
+        vector<string> inputs;
+        vector<string> outputs;
+        vector<string> intermediates;
+
+        if (!is_template && (!cache.get_unsigned(sweep) || sweep > header.nsweeps ||
+                    !cache.get_unsigned(sweep_index))) {
+            return false;
+        }
+        if (!cache.get_string(name) || !cache.get_string(pegasus_id) || 
+                !cache.get_string(transformation) || !cache.get_string(category) ||
+                !cache.get_unsigned(memory) || !cache.get_unsigned(cpus) ||
+                !cache.get_unsigned(gpus) || !cache.get_unsigned(threads) ||
+                !cache.get_unsigned(hosts) || hosts == 0 ||
+                !cache.get_unsigned(placement) ||
+                placement > PLACEMENT_LEAST_LOADED ||
+                !cache.get_unsigned(tries) || !cache.get(&priority, sizeof(priority)) ||
+                !cache.get(&runtime, sizeof(runtime)) ||
+                !cache.get(&max_runtime, sizeof(max_runtime)) ||
+                !cache.get_forwards(pipe_forwards) || 
+                !cache.get_forwards(file_forwards) ||
+                !cache.get_files(inputs) || !cache.get_files(outputs) ||
+                !cache.get_files(intermediates) ||
+                !cache.get_unsigned(nargs) || (nargs == 0) != (sweep > 0)) {
+            return false;
+        }
+
+        args.clear();
+        for (unsigned j = 0; j < nargs; j++) {
+            unsigned id;
+            if (!cache.get_unsigned(id) || id >= header.nstrings) {
+                return false;
             }
+            args.push_back(args_table[id]);
+        }
 
-            pegasus_id = v[1];
-            //pegasus_transformation = v[2];
-            //pegasus_dax_id = v[3];
-        } else if (rec[0] == '#') {
-            // Comments
+        Task *t;
+        if (is_template) {
+            t = new Task(name, args, memory, cpus, tries, priority, runtime, 
+                    pipe_forwards, file_forwards);
+            sweeps.push_back(t);
+        } else if (this->has_task(name)) {
+            return false;
         } else {
-            myfailure("Invalid DAG record: %s", rec.c_str());
+            t = new (allocate_task()) Task(name, args, memory, cpus, tries, 
+                    priority, runtime, pipe_forwards, file_forwards);
+        }
+        t->gpus = gpus;
+        t->threads = threads;
+        t->hosts = hosts;
+        t->max_runtime = max_runtime;
+        t->placement = (PlacementPolicy)placement;
+        t->pegasus_id = pegasus_id;
+        if (!transformation.empty()) {
+            t->transformation = strings.intern(transformation);
+        }
+        if (!category.empty()) {
+            t->category = strings.intern(category);
+        }
+        if (!inputs.empty()) {
+            t->inputs = new FileList();
+            for (unsigned j = 0; j < inputs.size(); j++) {
+                t->inputs->push_back(strings.intern(inputs[j]));
+            }
+        }
+        if (!outputs.empty()) {
+            t->outputs = new FileList();
+            for (unsigned j = 0; j < outputs.size(); j++) {
+                t->outputs->push_back(strings.intern(outputs[j]));
+            }
+        }
+        if (!intermediates.empty()) {
+            t->intermediates = new FileList();
+            for (unsigned j = 0; j < intermediates.size(); j++) {
+                t->intermediates->push_back(strings.intern(intermediates[j]));
+            }
+        }
+        if (sweep > 0) {
+            t->sweep = sweeps[sweep - 1];
+            t->sweep_index = sweep_index;
+        }
+        if (!is_template) {
+            this->add_task(t);
         }
     }
 
-    if (infile.bad() || !infile.eof()) {
-        myfailures("Error reading DAG: %s", filename.c_str());
+    // The children of every task, then the parents of every task
+    child_edges.assign(header.nedges, NULL);
+    parent_edges.assign(header.nedges, NULL);
+    for (unsigned pass = 0; pass < 2; pass++) {
+        vector<Task *> &edge_array = pass == 0 ? child_edges : parent_edges;
+        unsigned next = 0;
+        for (unsigned i = 0; i < tasks.size(); i++) {
+            unsigned count;
+            if (!cache.get_unsigned(count) || count > header.nedges - next) {
+                return false;
+            }
+            TaskArray array = count ? TaskArray(&edge_array[next], count) : TaskArray();
+            for (unsigned j = 0; j < count; j++) {
+                unsigned index;
+                if (!cache.get_unsigned(index) || index >= tasks.size()) {
+                    return false;
+                }
+                edge_array[next++] = tasks[index];
+            }
+            if (pass == 0) {
+                tasks[i]->children = array;
+            } else {
+                tasks[i]->parents = array;
+            }
+        }
+        if (next != header.nedges) {
+            return false;
+        }
     }
 
-    infile.close();
+    // The MAXJOBS limits of the categories
+    unsigned ncategories;
+    if (!cache.get_unsigned(ncategories)) {
+        return false;
+    }
+    for (unsigned i = 0; i < ncategories; i++) {
+        unsigned limit;
+        if (!cache.get_string(category) || !cache.get_unsigned(limit)) {
+            return false;
+        }
+        maxjobs[category] = limit;
+    }
+
+    return cache.done();
+}
+
+/*
+ * Write the cache to a temporary file and rename it so that a partial
+ * cache is never read. Errors are not fatal because the DAG can always
+ * be parsed again.
+ */
+void DAG::write_cache(const string &cachefile, const struct stat &dagstat) {
+    map<const string *, unsigned> ids;
+    string strings_section;
+    string tasks_section;
+
+    // The sweep templates come first. The tasks of a sweep refer to their
+    // template by its position plus one, and have no arguments, forwards
+    // or Pegasus id of their own.
+    map<const Task *, unsigned> sweep_ids;
+    vector<Task *> records(sweeps);
+    records.insert(records.end(), tasks.begin(), tasks.end());
+    for (unsigned i = 0; i < records.size(); i++) {
+        Task *t = records[i];
+        bool expanded = t->sweep == NULL;
+        if (i < sweeps.size()) {
+            sweep_ids[t] = i + 1;
+        } else {
+            cache_put_unsigned(tasks_section, expanded ? 0 : sweep_ids[t->sweep]);
+            cache_put_unsigned(tasks_section, t->sweep_index);
+        }
+        cache_put_string(tasks_section, t->name);
+        cache_put_string(tasks_section, expanded ? t->pegasus_id : "");
+        cache_put_string(tasks_section, t->transformation == NULL ? "" : *t->transformation);
+        cache_put_string(tasks_section, t->category == NULL ? "" : *t->category);
+        cache_put_unsigned(tasks_section, t->memory);
+        cache_put_unsigned(tasks_section, t->cpus);
+        cache_put_unsigned(tasks_section, t->gpus);
+        cache_put_unsigned(tasks_section, t->threads);
+        cache_put_unsigned(tasks_section, t->hosts);
+        cache_put_unsigned(tasks_section, t->placement);
+        cache_put_unsigned(tasks_section, t->tries);
+        cache_put(tasks_section, &t->priority, sizeof(t->priority));
+        cache_put(tasks_section, &t->runtime, sizeof(t->runtime));
+        cache_put(tasks_section, &t->max_runtime, sizeof(t->max_runtime));
+        cache_put_forwards(tasks_section, expanded ? t->pipe_forwards : NULL);
+        cache_put_forwards(tasks_section, expanded ? t->file_forwards : NULL);
+        cache_put_files(tasks_section, t->inputs);
+        cache_put_files(tasks_section, t->outputs);
+        cache_put_files(tasks_section, t->intermediates);
+        unsigned nargs = expanded ? t->args.size() : 0;
+        cache_put_unsigned(tasks_section, nargs);
+        for (unsigned j = 0; j < nargs; j++) {
+            const string *arg = t->args[j];
+            map<const string *, unsigned>::iterator id = ids.find(arg);
+            if (id == ids.end()) {
+                id = ids.insert(std::make_pair(arg, (unsigned)ids.size())).first;
+                cache_put_string(strings_section, *arg);
+            }
+            cache_put_unsigned(tasks_section, id->second);
+        }
+    }
+
+    string edges_section;
+    for (unsigned pass = 0; pass < 2; pass++) {
+        for (iterator i = this->begin(); i != this->end(); i++) {
+            TaskArray &array = pass == 0 ? (*i)->children : (*i)->parents;
+            cache_put_unsigned(edges_section, array.size());
+            for (unsigned j = 0; j < array.size(); j++) {
+                cache_put_unsigned(edges_section, array[j]->index);
+            }
+        }
+    }
+
+    string categories_section;
+    cache_put_unsigned(categories_section, maxjobs.size());
+    for (map<string, unsigned>::iterator m = maxjobs.begin(); m != maxjobs.end(); m++) {
+        cache_put_string(categories_section, m->first);
+        cache_put_unsigned(categories_section, m->second);
+    }
+
+    DAGCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DAG_CACHE_MAGIC, 4);
+    header.version = DAG_CACHE_VERSION;
+    header.tries = this->tries;
+    header.nsweeps = sweeps.size();
+    header.ntasks = tasks.size();
+    header.nstrings = ids.size();
+    header.nedges = child_edges.size();
+    header.dagsize = dagstat.st_size;
+    header.dagino = dagstat.st_ino;
+    header.dagmtime = dagstat.st_mtim.tv_sec;
+    header.dagmtime_nsec = dagstat.st_mtim.tv_nsec;
+
+    string tmpfile = cachefile + ".tmp";
+    FILE *f = fopen(tmpfile.c_str(), "w");
+    if (f == NULL) {
+        log_warn("Unable to write DAG cache %s: %s", tmpfile.c_str(), strerror(errno));
+        return;
+    }
+
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(strings_section.data(), 1, strings_section.size(), f);
+    fwrite(tasks_section.data(), 1, tasks_section.size(), f);
+    fwrite(edges_section.data(), 1, edges_section.size(), f);
+    fwrite(categories_section.data(), 1, categories_section.size(), f);
+
+    bool failed = ferror(f);
+    if (fclose(f) != 0) {
+        failed = true;
+    }
+    if (failed) {
+        log_warn("Unable to write DAG cache %s: %s", tmpfile.c_str(), strerror(errno));
+        unlink(tmpfile.c_str());
+        return;
+    }
+
+    if (rename(tmpfile.c_str(), cachefile.c_str()) < 0) {
+        log_warn("Unable to write DAG cache %s: %s", cachefile.c_str(), strerror(errno));
+        unlink(tmpfile.c_str());
+        return;
+    }
+
+    log_debug("Wrote DAG cache %s", cachefile.c_str());
 }
 
 void DAG::read_rescue(const string &filename) {
@@ -392,6 +1670,24 @@ void DAG::read_rescue(const string &filename) {
         myfailures("Unable to open rescue file: %s", filename.c_str());
     }
 
+    // Binary rescue files are read in one pass
+    char magic[4];
+    if (infile.read(magic, 4) && memcmp(magic, BINARY_RESCUE_MAGIC, 4) == 0) {
+        vector<char> data(magic, magic + 4);
+        char block[BUFSIZ];
+        while (infile.read(block, sizeof(block)) || infile.gcount() > 0) {
+            data.insert(data.end(), block, block + infile.gcount());
+        }
+        if (infile.bad()) {
+            myfailures("Error reading rescue file");
+        }
+        infile.close();
+        this->read_binary_rescue(filename, &data[0], data.size());
+        return;
+    }
+    infile.clear();
+    infile.seekg(0);
+
     const char *DELIM = " \t\n\r";
     string rec;
     while (getline(infile, rec)) {
@@ -419,6 +1715,11 @@ void DAG::read_rescue(const string &filename) {
             string name = v[1];
 
             if (!this->has_task(name)) {
+                if (!config.dag_stream.empty()) {
+                    // The task may have been added from the DAG stream
+                    this->rescued.insert(name);
+                    continue;
+                }
                 myfailure("Unknown task %s in rescue file", name.c_str());
             }
 
@@ -436,3 +1737,167 @@ void DAG::read_rescue(const string &filename) {
     infile.close();
 }
 
+void DAG::read_binary_rescue(const string &filename, const char *data, size_t size) {
+    BinaryRescueHeader header;
+    if (size < sizeof(header)) {
+        myfailure("Invalid binary rescue file: %s", filename.c_str());
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.version != BINARY_RESCUE_VERSION) {
+        myfailure("Unsupported binary rescue file version %u: %s", 
+                header.version, filename.c_str());
+    }
+    if (header.ntasks != tasks.size() || header.key != this->rescue_key()) {
+        myfailure("Binary rescue file %s does not match the DAG", filename.c_str());
+    }
+
+    const unsigned char *p = (const unsigned char *)data + sizeof(header);
+    const unsigned char *end = (const unsigned char *)data + size;
+    unsigned done = 0;
+    while (p < end) {
+        unsigned index = 0;
+        unsigned shift = 0;
+        while (p < end && (*p & 0x80)) {
+            if (shift > 21) {
+                myfailure("Invalid record in rescue file %s", filename.c_str());
+            }
+            index |= (*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        if (p == end) {
+            // The master failed while writing the last record
+            log_warn("Ignoring incomplete record at the end of rescue file %s", 
+                    filename.c_str());
+            break;
+        }
+        index |= *p++ << shift;
+
+        if (index >= tasks.size()) {
+            myfailure("Invalid task index %u in rescue file", index);
+        }
+        tasks[index]->success = true;
+        done++;
+    }
+
+    log_debug("Read %u records from binary rescue file %s", done, filename.c_str());
+}
+
+/*
+ * Identifies the DAG that a binary rescue file belongs to. This is a
+ * hash of the task names in the order that they appear in the DAG.
+ */
+unsigned DAG::rescue_key() const {
+    unsigned key = 2166136261u;
+    for (unsigned i = 0; i < tasks.size(); i++) {
+        key = (key ^ hash_name(tasks[i]->name)) * 16777619u;
+    }
+    return key;
+}
+
+/*
+ * Add the TASK and EDGE records in data to the DAG. Existing tasks can
+ * be the parents of new tasks, but not their children. Returns the
+ * index of the first new task.
+ */
+unsigned DAG::add_records(const char *data, size_t size) {
+    unsigned first = tasks.size();
+
+    // The edge arrays are rebuilt from all of the edges
+    for (unsigned i = 0; i < first; i++) {
+        Task *t = tasks[i];
+        for (unsigned j = 0; j < t->children.size(); j++) {
+            edges.push_back(std::make_pair(t, t->children[j]));
+        }
+    }
+    unsigned old_edges = edges.size();
+
+    parse_dag(data, size);
+
+    for (unsigned e = old_edges; e < edges.size(); e++) {
+        if (edges[e].second->index < first) {
+            myfailure("Invalid EDGE %s %s: %s was already added to the workflow", 
+                    edges[e].first->name.c_str(), edges[e].second->name.c_str(), 
+                    edges[e].second->name.c_str());
+        }
+    }
+
+    build_edges();
+
+    // Tasks that succeeded in a previous run
+    for (unsigned i = first; i < tasks.size(); i++) {
+        if (rescued.erase(tasks[i]->name) > 0) {
+            tasks[i]->success = true;
+        }
+    }
+
+    return first;
+}
+
+DAGStream::DAGStream(const string &path) {
+    this->path = path;
+    this->end = false;
+
+    // Opening a FIFO for reading does not wait for a writer with O_NONBLOCK
+    this->fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+    if (this->fd < 0) {
+        myfailures("Unable to open DAG stream: %s", path.c_str());
+    }
+}
+
+DAGStream::~DAGStream() {
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+}
+
+/* Read the records that are available now without blocking */
+void DAGStream::read(DAG *dag) {
+    char block[BUFSIZ];
+    while (!end) {
+        ssize_t r = ::read(fd, block, sizeof(block));
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            myfailures("Error reading DAG stream: %s", path.c_str());
+        }
+        if (r == 0) {
+            // There is no writer, or the writer has not written any more
+            break;
+        }
+        buffer.append(block, r);
+
+        size_t start = 0;
+        size_t eol;
+        while (!end && (eol = buffer.find('\n', start)) != string::npos) {
+            string rec = buffer.substr(start, eol - start);
+            start = eol + 1;
+            trim(rec);
+            if (rec == "COMMIT") {
+                commit(dag);
+            } else if (rec == "END") {
+                commit(dag);
+                end = true;
+            } else {
+                records += rec;
+                records += '\n';
+            }
+        }
+        buffer.erase(0, start);
+    }
+
+    if (end) {
+        log_debug("End of DAG stream %s", path.c_str());
+        close(fd);
+        fd = -1;
+    }
+}
+
+void DAGStream::commit(DAG *dag) {
+    if (records.empty()) {
+        return;
+    }
+    unsigned first = dag->add_records(records.data(), records.size());
+    log_debug("Added %u tasks from DAG stream %s", dag->size() - first, path.c_str());
+    records.clear();
+}
@@ -5,58 +5,206 @@
 #include <map>
 #include <vector>
 #include <list>
+#include <set>
+#include <sys/stat.h>
 
 #include "tools.h"
+#include "config.h"
 
 using std::string;
 using std::map;
 using std::vector;
 using std::list;
+using std::set;
+using std::pair;
+
+// Number of tasks allocated at once by the DAG
+#define TASK_BLOCK_SIZE 1024
+
+class Task;
+
+/*
+ * A binary rescue file starts with this header, followed by the index of
+ * each task that succeeded, encoded as a base 128 varint. The header
+ * identifies the DAG so that the indices are not applied to a different
+ * DAG. Text rescue files contain "DONE name" records instead.
+ */
+#define BINARY_RESCUE_MAGIC "PMCR"
+#define BINARY_RESCUE_VERSION 1
+
+struct BinaryRescueHeader {
+    char magic[4];
+    unsigned version;
+    unsigned ntasks;
+    unsigned key;
+};
+
+/* A read-only view of a contiguous array of tasks */
+class TaskArray {
+private:
+    Task **first;
+    unsigned count;
+
+public:
+    TaskArray() : first(NULL), count(0) {}
+    TaskArray(Task **first, unsigned count) : first(first), count(count) {}
+    unsigned size() const { return count; }
+    bool empty() const { return count == 0; }
+    Task *operator[](unsigned i) const { return first[i]; }
+};
+
+/* Task arguments point to strings that are shared by all the tasks in a DAG */
+typedef vector<const string *> ArgList;
+
+/* Files read and written by a task, also shared by all the tasks in a DAG */
+typedef vector<const string *> FileList;
+
+/*
+ * Stores one copy of each distinct string. Most tasks in a DAG share the
+ * executable and many of the flags, so storing them once saves a lot of
+ * memory on large DAGs. The strings live as long as the pool.
+ */
+class StringPool {
+private:
+    set<string> strings;
+
+public:
+    const string *intern(const string &s) { return &*strings.insert(s).first; }
+    unsigned size() { return strings.size(); }
+    void clear() { strings.clear(); }
+};
 
 class Task {
 public:
     string name;
-    list<string> args;
-    vector<Task *> children;
-    vector<Task *> parents;
+    ArgList args;
 
-    // This comes from the pegasus cluster arguments
+    // These point into the edge arrays of the DAG
+    TaskArray children;
+    TaskArray parents;
+
+    // These come from the pegasus cluster arguments. The transformation
+    // is interned, or NULL if the task has no #@ record.
     string pegasus_id;
+    const string *transformation;
+
+    // The category of the task for MAXJOBS limits, or NULL if the task
+    // has no --category, in which case the transformation is used
+    const string *category;
 
     bool success;
-    bool io_failed;
     int last_exitcode;
 
     unsigned memory;
     cpu_t cpus;
+    cpu_t gpus;
+    // Threads the task runs with, for OMP_NUM_THREADS and the like, or 0
+    // for one per CPU
+    cpu_t threads;
+    // Number of hosts the task needs at the same time. The cpus, memory
+    // and gpus of the task are needed on each of them.
+    unsigned hosts;
     unsigned tries;
     unsigned failures;
     int priority;
+    double runtime;
+    // Hard limit on the runtime of the task in seconds, or 0
+    double max_runtime;
+    // Overrides the --placement of the workflow for this task
+    PlacementPolicy placement;
     map<string, string> *pipe_forwards;
     map<string, string> *file_forwards;
+    // Files declared with --input and --output, or NULL if there are none
+    FileList *inputs;
+    FileList *outputs;
+    // Outputs that stay in the staging area of the host that wrote them,
+    // or NULL. They are also in outputs.
+    FileList *intermediates;
 
     unsigned submit_seq;
 
-    Task(const string &name, const list<string> &args, unsigned memory, unsigned cpus, unsigned tries, int priority, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards);
+    // Position of the task in the DAG file, starting from 0
+    unsigned index;
+
+    // Position of the task's DAG in the list of workflows of the master
+    unsigned workflow;
+
+    // The template of the parameter sweep that the task belongs to, or
+    // NULL. The arguments, forwards and Pegasus id of a sweep task are
+    // empty until DAG::expand fills them in from the template.
+    const Task *sweep;
+    unsigned sweep_index;
+    // The arguments of an expanded sweep task that have its index in
+    // them. They are owned by the task, and args points into them.
+    list<string> *sweep_args;
+
+    Task(const string &name, const ArgList &args, unsigned memory, unsigned cpus, unsigned tries, int priority, double runtime, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards);
     ~Task();
 
     bool is_ready();
 };
 
+typedef enum {
+    PRIORITY_USER,          // Use the priorities given with -p
+    PRIORITY_CRITICAL_PATH, // Longest path to an exit task (upward rank)
+    PRIORITY_BFS,           // Tasks closer to the roots run first
+    PRIORITY_DFS            // Tasks further from the roots run first
+} PriorityMode;
+
+/*
+ * Tasks are allocated in blocks, indexed by name in an open addressing
+ * hash table, and kept in a vector in the order they appear in the DAG
+ * file. The edges of all the tasks are stored in two arrays, one for
+ * children and one for parents, that are built after the DAG is read.
+ */
 class DAG {
-    map<string, Task *> tasks;
+    vector<Task *> tasks;
+    vector<Task *> table;
+    vector<char *> blocks;
+    unsigned block_used;
+    vector<pair<Task *, Task *> > edges;
+    vector<Task *> child_edges;
+    vector<Task *> parent_edges;
+    StringPool strings;
+
+    // The template tasks of the parameter sweeps, which are not in tasks
+    vector<Task *> sweeps;
+
+    // Tasks in the rescue file that have not been read from the DAG stream yet
+    set<string> rescued;
+
     bool lock;
     int dagfd;
     unsigned tries;
 
+    // Prepended to the task names when several DAGs run together
+    string name_prefix;
+
     void read_dag(const string &filename);
+    void parse_dag(const char *data, size_t size);
+    void read_cached_dag(const string &dagfile, const string &cachefile);
+    bool read_cache(const string &cachefile, const struct stat &dagstat);
+    bool load_cache(const char *data, size_t size);
+    void write_cache(const string &cachefile, const struct stat &dagstat);
+    void clear();
     void read_rescue(const string &filename);
+    void read_binary_rescue(const string &filename, const char *data, size_t size);
+    void *allocate_task();
+    unsigned find_slot(const string &name) const;
+    void rehash(unsigned size);
     void add_task(Task *task);
     void add_edge(const string &parent, const string &child);
+    void add_sweep(Task *tmpl, const string &base, unsigned start, unsigned end);
+    FileList *substitute_files(const FileList *list, const string &index);
+    void build_edges();
+    void topological_sort(vector<Task *> &order);
 public:
-    typedef map<string, Task *>::iterator iterator;
+    typedef vector<Task *>::iterator iterator;
 
-    DAG(const string &dagfile, const string &rescuefile = "", const bool lock = true, unsigned tries = 1);
+    // The MAXJOBS limit of each category of tasks
+    map<string, unsigned> maxjobs;
+
+    DAG(const string &dagfile, const string &rescuefile = "", const bool lock = true, unsigned tries = 1, const string &cachefile = "");
     ~DAG();
 
     bool has_task(const string &name) const;
@@ -64,6 +212,34 @@ public:
     iterator begin() { return this->tasks.begin(); }
     iterator end() { return this->tasks.end(); }
     unsigned size() { return this->tasks.size(); }
+    unsigned rescue_key() const;
+    void expand(Task *task);
+    void collapse(Task *task);
+    unsigned add_records(const char *data, size_t size);
+    void compute_priorities(PriorityMode mode);
+    void set_workflow(unsigned workflow, const string &prefix);
+    const string &prefix() const { return this->name_prefix; }
+};
+
+/*
+ * Reads TASK and EDGE records that are added to a running workflow from
+ * a FIFO or a file that is still being written. The records are added
+ * to the DAG when a COMMIT record is read, so that a task and the edges
+ * to it are added together. The stream ends with an END record.
+ */
+class DAGStream {
+    string path;
+    int fd;
+    string buffer;
+    string records;
+    bool end;
+
+    void commit(DAG *dag);
+public:
+    DAGStream(const string &path);
+    ~DAGStream();
+    void read(DAG *dag);
+    bool ended() const { return end; }
 };
 
 #endif /* DAG_H */
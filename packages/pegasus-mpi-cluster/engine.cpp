@@ -9,6 +9,7 @@
 #include "failure.h"
 #include "log.h"
 #include "engine.h"
+#include "config.h"
 
 Engine::Engine(DAG &dag, const std::string &rescuefile, int max_failures) {
     if (max_failures < 0) {
@@ -17,21 +18,56 @@ Engine::Engine(DAG &dag, const std::string &rescuefile, int max_failures) {
     this->max_failures = max_failures;
     this->dag = &dag;
     this->rescue = NULL;
+    this->rescue_pending = 0;
+    this->rescue_deadline = 0;
     if (!rescuefile.empty()) {
         this->open_rescue(rescuefile);
     }
     
     this->failures = 0;
     
-    // Queue all tasks that are ready, but not done
-    for (DAG::iterator i=this->dag->begin(); i!=this->dag->end(); i++) {
-        Task *t = (*i).second;
-        if (t->is_ready() && !t->success) {
+    this->nqueued = 0;
+    this->streaming = false;
+    this->count_pending_parents(0);
+}
+
+/*
+ * Count the unfinished parents of the tasks starting at index first, and
+ * queue the ones that are ready, but not done
+ */
+void Engine::count_pending_parents(unsigned first) {
+    this->pending_parents.resize(this->dag->size(), 0);
+    this->queued.resize(this->dag->size(), false);
+    for (DAG::iterator i=this->dag->begin()+first; i!=this->dag->end(); i++) {
+        Task *t = *i;
+        for (unsigned j=0; j<t->parents.size(); j++) {
+            if (!t->parents[j]->success) {
+                this->pending_parents[t->index]++;
+            }
+        }
+    }
+    
+    for (DAG::iterator i=this->dag->begin()+first; i!=this->dag->end(); i++) {
+        Task *t = *i;
+        if (this->pending_parents[t->index] == 0 && !t->success) {
             this->queue_ready_task(t);
         }
     }
 }
 
+/* Add the tasks that were added to the DAG starting at index first */
+void Engine::add_tasks(unsigned first) {
+    this->count_pending_parents(first);
+
+    // Tasks that succeeded in a previous run are not in the new rescue file yet
+    for (DAG::iterator i=this->dag->begin()+first; i!=this->dag->end(); i++) {
+        Task *t = *i;
+        if (t->success) {
+            this->write_rescue(t);
+        }
+    }
+}
+
 Engine::~Engine() {
     // Close rescue file
     this->close_rescue();
@@ -39,22 +75,71 @@ Engine::~Engine() {
 
 void Engine::queue_ready_task(Task *t) {
     this->ready.push(t);
-    this->queue.insert(t);
+    if (!this->queued[t->index]) {
+        this->queued[t->index] = true;
+        this->nqueued++;
+    }
+}
+
+void Engine::dequeue_task(Task *t) {
+    if (this->queued[t->index]) {
+        this->queued[t->index] = false;
+        this->nqueued--;
+    }
 }
 
 void Engine::open_rescue(const std::string &filename) {
-    this->rescue = fopen(filename.c_str(), "a");
-    if (this->rescue == NULL) {
-        myfailure("Unable to open rescue file: %s", filename.c_str());
+    if (config.binary_rescue) {
+        // A binary rescue file is always rewritten, and then replaces the
+        // old one, so that records are never appended to a text rescue
+        // file or to a rescue file for a different DAG
+        std::string tmpfile = filename + ".tmp";
+        this->rescue = fopen(tmpfile.c_str(), "w");
+        if (this->rescue == NULL) {
+            myfailure("Unable to open rescue file: %s", tmpfile.c_str());
+        }
+
+        BinaryRescueHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BINARY_RESCUE_MAGIC, 4);
+        header.version = BINARY_RESCUE_VERSION;
+        header.ntasks = this->dag->size();
+        header.key = this->dag->rescue_key();
+        this->rescue_buffer.append((const char *)&header, sizeof(header));
+    } else {
+        // A binary rescue file is replaced by a text one, otherwise new
+        // records are appended to the existing file
+        const char *mode = "a";
+        FILE *old = fopen(filename.c_str(), "r");
+        if (old != NULL) {
+            char magic[4];
+            if (fread(magic, 1, 4, old) == 4 && 
+                    memcmp(magic, BINARY_RESCUE_MAGIC, 4) == 0) {
+                mode = "w";
+            }
+            fclose(old);
+        }
+        this->rescue = fopen(filename.c_str(), mode);
+        if (this->rescue == NULL) {
+            myfailure("Unable to open rescue file: %s", filename.c_str());
+        }
     }
     
     // Mark done tasks as done in the new rescue file
     for (DAG::iterator i=this->dag->begin(); i!=this->dag->end(); i++) {
-        Task *t = (*i).second;
+        Task *t = *i;
         if (t->success) {
             this->write_rescue(t);
         }
     }
+    this->commit_rescue();
+
+    if (config.binary_rescue) {
+        std::string tmpfile = filename + ".tmp";
+        if (rename(tmpfile.c_str(), filename.c_str()) < 0) {
+            myfailures("Unable to replace rescue file: %s", filename.c_str());
+        }
+    }
 }
 
 bool Engine::has_rescue() {
@@ -63,17 +148,71 @@ bool Engine::has_rescue() {
 
 void Engine::close_rescue() {
     if (this->has_rescue()) {
+        this->flush_rescue();
         fclose(this->rescue);
         this->rescue = NULL;
     }
 }
 
+/*
+ * Records are buffered and committed to the rescue file in groups of
+ * up to config.rescue_batch records. A record is never buffered for more
+ * than config.rescue_interval ms: the master calls flush_rescue() when
+ * rescue_flush_time() is reached, even if no other tasks finish.
+ */
 void Engine::write_rescue(Task *task) {
+    if (!this->has_rescue()) {
+        return;
+    }
+
+    if (config.binary_rescue) {
+        unsigned index = task->index;
+        while (index >= 0x80) {
+            this->rescue_buffer += (char)(index | 0x80);
+            index >>= 7;
+        }
+        this->rescue_buffer += (char)index;
+    } else {
+        // The rescue file of each DAG has the names without the prefix
+        this->rescue_buffer += "\nDONE ";
+        this->rescue_buffer.append(task->name, dag->prefix().size(), std::string::npos);
+    }
+    if (this->rescue_pending == 0) {
+        this->rescue_deadline = current_time() + config.rescue_interval / 1000.0;
+    }
+    this->rescue_pending++;
+
+    if (this->rescue_pending >= config.rescue_batch || 
+            current_time() >= this->rescue_deadline) {
+        this->commit_rescue();
+    }
+}
+
+void Engine::flush_rescue() {
+    if (this->has_rescue() && this->rescue_pending > 0) {
+        this->commit_rescue();
+    }
+}
+
+/* Returns the time when the buffered records must be committed, or 0 if there are none */
+double Engine::rescue_flush_time() {
+    if (this->rescue_pending == 0) {
+        return 0;
+    }
+    return this->rescue_deadline;
+}
+
+void Engine::commit_rescue() {
     // TODO What if an error occurs here?
     if (this->has_rescue()) {
-        if (fprintf(this->rescue, "\nDONE %s", task->name.c_str()) < 0) {
+        log_trace("Committing %u rescue records", this->rescue_pending);
+        double start = current_time();
+        if (fwrite(this->rescue_buffer.data(), 1, this->rescue_buffer.size(), 
+                    this->rescue) != this->rescue_buffer.size()) {
             log_error("Error writing to rescue file: %s", strerror(errno));
         }
+        this->rescue_buffer.clear();
+        this->rescue_pending = 0;
         if (fflush(this->rescue)) {
             log_error("Error flushing rescue file: %s", strerror(errno));
         }
@@ -89,11 +228,18 @@ void Engine::write_rescue(Task *task) {
                     strerror(errno));
         }
 #endif
+        this->rescue_commit_times.observe(current_time() - start);
     }
 }
 
 void Engine::mark_task_finished(Task *t, int exitcode) {
     
+    // A task that runs more than once at the same time can still only
+    // finish once, otherwise it would be in the rescue log twice
+    if (t->success) {
+        myfailure("Task %s finished more than once", t->name.c_str());
+    }
+    
     if (exitcode == 0) {
         // Task succeeded
         t->success = true;
@@ -113,19 +259,19 @@ void Engine::mark_task_finished(Task *t, int exitcode) {
     }
 
     // Remove from the queue
-    this->queue.erase(t);
+    this->dequeue_task(t);
     
     if (max_failures_reached()) {
         // Clear ready queue
         while (this->has_ready_task()) {
             Task *t = this->next_ready_task();
-            this->queue.erase(t);
+            this->dequeue_task(t);
         }
-    } else {
-        // Release ready children
+    } else if (t->success) {
+        // Release children whose parents have all succeeded
         for (unsigned i=0; i<t->children.size(); i++) {
             Task *c = t->children[i];
-            if (c->is_ready()) {
+            if (--this->pending_parents[c->index] == 0) {
                 this->queue_ready_task(c);
             }
         }
@@ -137,6 +283,11 @@ void Engine::mark_task_finished(Task *t, int exitcode) {
     }
 }
 
+/* Run a task that did not finish again without counting it as a failure */
+void Engine::retry_task(Task *t) {
+    this->queue_ready_task(t);
+}
+
 bool Engine::max_failures_reached() {
     return this->failures >= this->max_failures && this->max_failures != 0;
 }
@@ -155,7 +306,7 @@ Task *Engine::next_ready_task() {
 }
 
 bool Engine::is_finished() {
-    return this->queue.empty();
+    return this->nqueued == 0 && !this->streaming;
 }
 
 bool Engine::is_failed() {
@@ -165,7 +316,7 @@ bool Engine::is_failed() {
     }
     
     for (DAG::iterator i=this->dag->begin(); i!=this->dag->end(); i++) {
-        Task *t = (*i).second;
+        Task *t = *i;
         if (!t->success) {
             return true;
         }
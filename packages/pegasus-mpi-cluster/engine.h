@@ -2,24 +2,42 @@
 #define ENGINE_H
 
 #include <queue>
-#include <set>
+#include <vector>
 #include "stdio.h"
 
 #include "dag.h"
+#include "tools.h"
 
 class Engine {
     DAG *dag;
     std::queue<Task *> ready;
-    std::set<Task *> queue;
+
+    // Number of parents of each task that have not succeeded yet
+    std::vector<unsigned> pending_parents;
+
+    // Tasks that are ready or running, and how many there are
+    std::vector<bool> queued;
+    unsigned nqueued;
+
+    // More tasks may be added until the DAG stream ends
+    bool streaming;
+
     FILE *rescue;
+    std::string rescue_buffer;
+    unsigned rescue_pending;
+    double rescue_deadline;
+    Histogram rescue_commit_times;
     int failures;
     int max_failures;
     
     void queue_ready_task(Task *t);
+    void dequeue_task(Task *t);
+    void count_pending_parents(unsigned first);
 
     void open_rescue(const std::string &rescuefile);
     void close_rescue();
     void write_rescue(Task *task);
+    void commit_rescue();
     bool has_rescue();
 public:
     Engine(DAG &dag, const std::string &rescuefile = "", int max_failures = 0);
@@ -27,10 +45,16 @@ public:
     
     bool max_failures_reached();
     void mark_task_finished(Task *t, int exitcode);
+    void retry_task(Task *t);
     bool has_ready_task();
     Task *next_ready_task();
     bool is_finished();
     bool is_failed();
+    void flush_rescue();
+    void add_tasks(unsigned first);
+    void set_streaming(bool streaming) { this->streaming = streaming; }
+    double rescue_flush_time();
+    const Histogram &rescue_latency() { return rescue_commit_times; }
 };
 
 #endif /* ENGINE_H */
@@ -1,5 +1,9 @@
 #include <cerrno>
 #include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <climits>
 #include <fcntl.h>
 
 #include "fdcache.h"
@@ -10,6 +14,26 @@
 #define NOFILE_MAX 256
 #define NOFILE_RESERVE 64
 
+// If the write-behind buffers grow larger than this, then the master
+// waits for the writer thread to catch up
+#define WRITE_BEHIND_MAX_BYTES (64*1024*1024)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+IORecord::IORecord(const string &filename, const string &task, const char *data, int size,
+        int source, unsigned seq, bool last, bool aborted, long long offset) {
+    this->filename = filename;
+    this->task = task;
+    this->data.assign(data, size);
+    this->source = source;
+    this->seq = seq;
+    this->last = last;
+    this->aborted = aborted;
+    this->offset = offset;
+}
+
 FDEntry::FDEntry(const string &filename, FILE *file) {
     this->filename = filename;
     this->file = file;
@@ -30,6 +54,16 @@ FDCache::FDCache(unsigned maxsize) {
     this->last = NULL;
     this->hits = 0;
     this->misses = 0;
+    this->writer_running = false;
+    this->writer_stopping = false;
+    this->flush_interval = 0;
+    this->buffered_bytes = 0;
+    this->flush_requests = 0;
+    this->flushes_done = 0;
+    this->credit_all = false;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wakeup, NULL);
+    pthread_cond_init(&flushed, NULL);
 
     // Determine the system limit
     unsigned limit = get_max_open_files();
@@ -63,9 +97,58 @@ FDCache::FDCache(unsigned maxsize) {
 
 FDCache::~FDCache() {
     this->close();
+    pthread_cond_destroy(&flushed);
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&lock);
 }
 
 void FDCache::close() {
+    // Write out anything that is still buffered before closing the files
+    for (unsigned i = 0; i < shards.size(); i++) {
+        FDCache *s = shards[i];
+        s->close();
+        log_debug("File descriptor cache shard %u hit rate: %lf", i, s->hitrate());
+        this->hits += s->hits;
+        this->misses += s->misses;
+        delete s;
+    }
+    shards.clear();
+    if (writer_running) {
+        pthread_mutex_lock(&lock);
+        writer_stopping = true;
+        flush_requests++;
+        pthread_cond_signal(&wakeup);
+        pthread_mutex_unlock(&lock);
+        if (pthread_join(writer, NULL) != 0) {
+            myfailure("Unable to join write-behind thread");
+        }
+        writer_running = false;
+        writer_stopping = false;
+    }
+
+    // If a stream never finished, then the data it was holding up
+    // is written anyway
+    map<string, list<IORecord *> >::iterator h;
+    for (h = held.begin(); h != held.end(); h++) {
+        buffered.insert(buffered.end(), h->second.begin(), h->second.end());
+    }
+    held.clear();
+    streams.clear();
+    flush();
+
+    // Pinned files belong to someone else, so they are only flushed
+    map<string, FDEntry *>::iterator p;
+    for (p = pinned.begin(); p != pinned.end(); p++) {
+        FDEntry *entry = p->second;
+        if (fflush(entry->file) != 0) {
+            log_error("fflush failed on file %s: %s", p->first.c_str(), 
+                    strerror(errno));
+        }
+        entry->file = NULL;
+        delete entry;
+    }
+    pinned.clear();
+
     FDEntry *i = first;
     while (i!=NULL) {
         FDEntry *next = i->next;
@@ -180,6 +263,11 @@ FILE *FDCache::open(string filename) {
     // If the file is already in the cache, then
     // return it
     map<string, FDEntry *>::iterator i;
+    i = pinned.find(filename);
+    if (i != pinned.end()) {
+        this->hits += 1;
+        return i->second->file;
+    }
     i = byname.find(filename);
     if (i == byname.end()) {
         this->misses += 1;
@@ -213,7 +301,42 @@ FILE *FDCache::open(string filename) {
     return file;
 }
 
-int FDCache::write(string filename, const char *data, int size) {
+/*
+ * Use a file that is already open for the given name. The cache writes
+ * to it like any other file, but never closes it. This is used to send
+ * forwarded data to the stdout and stderr of the process.
+ */
+void FDCache::pin(const string &filename, FILE *file) {
+    if (pinned.find(filename) != pinned.end()) {
+        myfailure("File %s is already pinned", filename.c_str());
+    }
+    pinned[filename] = new FDEntry(filename, file);
+    for (unsigned i = 0; i < shards.size(); i++) {
+        shards[i]->pin(filename, file);
+    }
+}
+
+/* Sync the file to disk if SYNC_IODATA is enabled */
+static int sync_file(const string &filename, int fd) {
+#ifdef SYNC_IODATA
+#ifdef DARWIN
+    // OSX does not have fdatasync
+    int rc = fsync(fd);
+#else
+    int rc = fdatasync(fd);
+#endif
+    // Pipes and terminals cannot be synced, and don't need to be
+    if (rc != 0 && errno != EINVAL) {
+        log_error("fsync/fdatasync failed on file %s: %s", filename.c_str(), 
+                strerror(errno));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Write data to the file without flushing it */
+int FDCache::append(const string &filename, const char *data, int size) {
     FILE *file = open(filename);
     if (file == NULL) {
         log_error("Error opening file %s: errno %d: %s", filename.c_str(),
@@ -232,27 +355,542 @@ int FDCache::write(string filename, const char *data, int size) {
                 strerror(errno));
         return -1;
     }
+    return 0;
+}
+
+/* Flush the file if it is open. Files that have been evicted were
+ * flushed when they were closed. */
+int FDCache::flush_file(const string &filename) {
+    map<string, FDEntry *>::iterator i = pinned.find(filename);
+    if (i == pinned.end()) {
+        i = byname.find(filename);
+        if (i == byname.end()) {
+            return 0;
+        }
+    }
+    FILE *file = i->second->file;
     if (fflush(file) != 0) {
         log_error("fflush failed on file %s: %s", filename.c_str(), 
                 strerror(errno));
         return -1;
     }
-#ifdef SYNC_IODATA
-#ifdef DARWIN
-    // OSX does not have fdatasync
-    rc = fsync(fileno(file));
-#else
-    rc = fdatasync(fileno(file));
-#endif
-    if (rc != 0) {
-        log_error("fsync/fdatasync failed on file %s: %s", filename.c_str(), 
+    return sync_file(filename, fileno(file));
+}
+
+int FDCache::write(string filename, const char *data, int size) {
+    if (append(filename, data, size) < 0) {
+        return -1;
+    }
+    return flush_file(filename);
+}
+
+/*
+ * Start a thread that writes buffered data in the background. After
+ * this is called, data should only be added using enqueue(). The
+ * buffers are written at least every interval ms, and whenever
+ * flush() is called.
+ */
+void FDCache::start_writer(unsigned interval, unsigned nthreads) {
+    if (write_behind()) {
+        myfailure("Write-behind thread already started");
+    }
+
+    // The open files are divided between the shards so that the
+    // total stays within the limit
+    if (nthreads > 1) {
+        unsigned shard_size = maxsize / nthreads;
+        if (shard_size < 1) {
+            shard_size = 1;
+        }
+        for (unsigned i = 0; i < nthreads; i++) {
+            FDCache *s = new FDCache(shard_size);
+            map<string, FDEntry *>::iterator p;
+            for (p = pinned.begin(); p != pinned.end(); p++) {
+                s->pin(p->first, p->second->file);
+            }
+            s->credit_all = credit_all;
+            s->start_writer(interval);
+            shards.push_back(s);
+        }
+        return;
+    }
+
+    flush_interval = interval;
+    writer_running = true;
+    if (pthread_create(&writer, NULL, writer_main, this) != 0) {
+        myfailure("Unable to start write-behind thread");
+    }
+    log_info("Writing collective I/O every %u ms", interval);
+}
+
+bool FDCache::write_behind() {
+    return writer_running || !shards.empty();
+}
+
+static unsigned hash_filename(const string &filename) {
+    unsigned h = 2166136261u;
+    for (unsigned i = 0; i < filename.length(); i++) {
+        h ^= (unsigned char)filename[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+FDCache *FDCache::shard(const string &filename) {
+    return shards[hash_filename(filename) % shards.size()];
+}
+
+void *FDCache::writer_main(void *arg) {
+    static_cast<FDCache *>(arg)->run_writer();
+    return NULL;
+}
+
+void FDCache::run_writer() {
+    pthread_mutex_lock(&lock);
+    while (true) {
+        // Sleep until the interval expires or someone wants a flush
+        if (flush_requests == flushes_done) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            unsigned long usec = now.tv_usec + (flush_interval % 1000) * 1000;
+            struct timespec deadline;
+            deadline.tv_sec = now.tv_sec + flush_interval / 1000 + usec / 1000000;
+            deadline.tv_nsec = (usec % 1000000) * 1000;
+            pthread_cond_timedwait(&wakeup, &lock, &deadline);
+        }
+
+        // All the records buffered before a flush request are
+        // picked up here, so the request is satisfied once they
+        // are written
+        unsigned request = flush_requests;
+        bool stopping = writer_stopping;
+        vector<IORecord *> records;
+        records.swap(buffered);
+        buffered_bytes = 0;
+        pthread_mutex_unlock(&lock);
+
+        write_records(records);
+
+        pthread_mutex_lock(&lock);
+        release_records(records);
+        flushes_done = request;
+        pthread_cond_broadcast(&flushed);
+        if (stopping && buffered.empty()) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Write a group of records. The records for each file are written with
+ * one writev() on the file's descriptor, which was opened with O_APPEND,
+ * in the order they were received. The writev() is only split where a
+ * stream starts or is aborted.
+ */
+void FDCache::write_records(const vector<IORecord *> &records) {
+    map<string, vector<IORecord *> > files;
+    for (vector<IORecord *>::const_iterator r = records.begin(); r != records.end(); r++) {
+        files[(*r)->filename].push_back(*r);
+    }
+
+    // If a write fails, then every task that wrote to the file fails
+    set<string> failed;
+    map<string, vector<IORecord *> >::iterator f;
+    for (f = files.begin(); f != files.end(); f++) {
+        if (write_file(f->first, f->second) < 0) {
+            vector<IORecord *>::iterator r;
+            for (r = f->second.begin(); r != f->second.end(); r++) {
+                log_error("Error writing %lu bytes to %s for task %s",
+                        (unsigned long)(*r)->data.size(), (*r)->filename.c_str(),
+                        (*r)->task.c_str());
+                failed.insert((*r)->task);
+            }
+        }
+    }
+
+    if (!failed.empty()) {
+        pthread_mutex_lock(&lock);
+        failed_tasks.insert(failed.begin(), failed.end());
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/* Write all of iov to fd, which may take more than one writev() */
+static int write_iov(const string &filename, int fd, vector<struct iovec> &iov) {
+    unsigned i = 0;
+    while (i < iov.size()) {
+        int count = iov.size() - i;
+        if (count > IOV_MAX) {
+            count = IOV_MAX;
+        }
+        ssize_t rc = writev(fd, &iov[i], count);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Error writing to %s: %s", filename.c_str(), 
+                    strerror(errno));
+            return -1;
+        }
+
+        // Skip what was written, which may end in the middle of a record
+        size_t written = rc;
+        while (i < iov.size() && written >= iov[i].iov_len) {
+            written -= iov[i].iov_len;
+            i++;
+        }
+        if (written > 0) {
+            iov[i].iov_base = (char *)iov[i].iov_base + written;
+            iov[i].iov_len -= written;
+        }
+    }
+    iov.clear();
+    return 0;
+}
+
+/*
+ * Write records that go to given offsets of a file. The file is opened
+ * without O_APPEND, which would make pwrite() append on Linux.
+ */
+static int write_at(const string &filename, const vector<IORecord *> &records) {
+    int fd = ::open(filename.c_str(), O_WRONLY|O_CREAT|O_CLOEXEC, 0666);
+    if (fd < 0) {
+        log_error("Error opening file %s: %s", filename.c_str(), strerror(errno));
+        return -1;
+    }
+    int result = 0;
+    for (unsigned i = 0; i < records.size() && result == 0; i++) {
+        const string &data = records[i]->data;
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t rc = pwrite(fd, data.data() + written, data.size() - written,
+                    records[i]->offset + written);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc < 0) {
+                log_error("Error writing to %s: %s", filename.c_str(), strerror(errno));
+                result = -1;
+                break;
+            }
+            written += rc;
+        }
+    }
+    if (result == 0) {
+        result = sync_file(filename, fd);
+    }
+    if (close(fd) < 0 && result == 0) {
+        log_error("Error closing %s: %s", filename.c_str(), strerror(errno));
+        result = -1;
+    }
+    return result;
+}
+
+/*
+ * Write the records for one file. The size of the file is remembered
+ * when a stream starts, so that an aborted stream can be truncated back
+ * to it. No other task writes to the file while the stream is open.
+ */
+int FDCache::write_file(const string &filename, const vector<IORecord *> &records) {
+    // Files that workers write with --direct-forwards are never appended to
+    if (records.front()->offset >= 0) {
+        return write_at(filename, records);
+    }
+
+    FILE *file = open(filename);
+    if (file == NULL) {
+        log_error("Error opening file %s: errno %d: %s", filename.c_str(),
+                  errno, strerror(errno));
+        log_error("Number of open files: %u, max: %u",
+                  get_nr_open_fds(), this->maxsize);
+        return -1;
+    }
+
+    // Anything written through stdio has to go out first
+    if (fflush(file) != 0) {
+        log_error("fflush failed on file %s: %s", filename.c_str(), 
                 strerror(errno));
         return -1;
     }
-#endif
+    int fd = fileno(file);
+
+    vector<struct iovec> iov;
+    for (unsigned i = 0; i < records.size(); i++) {
+        IORecord *record = records[i];
+        if (record->chunked() && (record->seq == 0 || record->aborted)) {
+            if (write_iov(filename, fd, iov) < 0) {
+                return -1;
+            }
+        }
+
+        if (record->aborted) {
+            map<string, off_t>::iterator start = stream_starts.find(filename);
+            if (start == stream_starts.end()) {
+                continue;
+            }
+            log_warn("Removing the data of task %s from %s", record->task.c_str(),
+                    filename.c_str());
+            if (ftruncate(fd, start->second) < 0) {
+                log_error("Unable to truncate %s: %s", filename.c_str(), strerror(errno));
+                stream_starts.erase(start);
+                return -1;
+            }
+            stream_starts.erase(start);
+            continue;
+        }
+
+        if (record->chunked() && record->seq == 0) {
+            struct stat st;
+            if (fstat(fd, &st) < 0) {
+                log_error("Unable to stat %s: %s", filename.c_str(), strerror(errno));
+                return -1;
+            }
+            stream_starts[filename] = st.st_size;
+        }
+        if (record->chunked() && record->last) {
+            stream_starts.erase(filename);
+        }
+
+        struct iovec v;
+        v.iov_base = (void *)record->data.data();
+        v.iov_len = record->data.size();
+        iov.push_back(v);
+    }
+
+    if (write_iov(filename, fd, iov) < 0) {
+        return -1;
+    }
+
+    return sync_file(filename, fd);
+}
+
+/* Forget records that have been written. Called with the lock held. */
+void FDCache::release_records(const vector<IORecord *> &records) {
+    for (vector<IORecord *>::const_iterator r = records.begin(); r != records.end(); r++) {
+        map<string, unsigned>::iterator p = pending_records.find((*r)->task);
+        if (--p->second == 0) {
+            pending_records.erase(p);
+        }
+        if (((*r)->chunked() || credit_all) && (*r)->source >= 0) {
+            credits[(*r)->source]++;
+        }
+        delete *r;
+    }
+}
+
+/*
+ * Buffer data to be written. If there is no writer thread, then the
+ * data is written the next time flush() is called.
+ */
+void FDCache::enqueue(const string &filename, const string &task, const char *data, int size,
+        int source, unsigned seq, bool last, bool aborted, long long offset) {
+    if (!shards.empty()) {
+        shard(filename)->enqueue(filename, task, data, size, source, seq, last, aborted,
+                offset);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    pending_records[task]++;
+    int rc = admit(new IORecord(filename, task, data, size, source, seq, last, aborted,
+                offset));
+    bool full = buffered_bytes > WRITE_BEHIND_MAX_BYTES;
+    pthread_mutex_unlock(&lock);
+
+    if (rc < 0) {
+        myfailure("Invalid chunk of I/O data for %s", filename.c_str());
+    }
+
+    if (full) {
+        log_debug("Write-behind buffers are full");
+        flush();
+    }
+}
+
+/*
+ * Add a record to the buffers, unless another task is streaming to the
+ * same file, in which case the record is held until the stream ends.
+ * Returns -1 if a chunk is out of order. Called with the lock held.
+ */
+int FDCache::admit(IORecord *record) {
+    const string &filename = record->filename;
+    map<string, IOStream>::iterator s = streams.find(filename);
+    if (s != streams.end() && s->second.task != record->task) {
+        held[filename].push_back(record);
+        return 0;
+    }
+
+    if (record->chunked()) {
+        unsigned expected = s == streams.end() ? 0 : s->second.next;
+        if (record->seq != expected) {
+            log_error("Chunk %u of %s from task %s is out of order: expected %u",
+                    record->seq, filename.c_str(), record->task.c_str(), expected);
+            delete record;
+            return -1;
+        }
+    }
+
+    if (record->aborted) {
+        drop_stream(record);
+    }
+
+    buffered.push_back(record);
+    buffered_bytes += record->data.size();
+
+    if (!record->chunked()) {
+        return 0;
+    }
+    if (!record->last) {
+        IOStream &stream = streams[filename];
+        stream.task = record->task;
+        stream.next = record->seq + 1;
+        return 0;
+    }
+
+    // The stream is done, so let the records it held up in. One of
+    // them may start another stream.
+    streams.erase(filename);
+    map<string, list<IORecord *> >::iterator h = held.find(filename);
+    if (h != held.end()) {
+        list<IORecord *> waiting;
+        waiting.swap(h->second);
+        held.erase(h);
+        for (list<IORecord *>::iterator r = waiting.begin(); r != waiting.end(); r++) {
+            if (admit(*r) < 0) {
+                return -1;
+            }
+        }
+    }
     return 0;
 }
 
+/*
+ * Throw away the chunks of an aborted stream that have not been written
+ * yet. The aborted record is still written, to truncate the file if some
+ * chunks already were. Called with the lock held.
+ */
+void FDCache::drop_stream(IORecord *record) {
+    vector<IORecord *> keep;
+    vector<IORecord *> dropped;
+    for (vector<IORecord *>::iterator r = buffered.begin(); r != buffered.end(); r++) {
+        if ((*r)->filename == record->filename && (*r)->task == record->task &&
+                (*r)->chunked()) {
+            buffered_bytes -= (*r)->data.size();
+            dropped.push_back(*r);
+        } else {
+            keep.push_back(*r);
+        }
+    }
+    buffered.swap(keep);
+    log_debug("Discarding %u chunks of %s from task %s", (unsigned)dropped.size(),
+            record->filename.c_str(), record->task.c_str());
+    release_records(dropped);
+}
+
+/* Wait until everything buffered so far has been written and flushed */
+void FDCache::flush() {
+    // Wake up all the shards before waiting so that they flush
+    // at the same time
+    if (!shards.empty()) {
+        vector<unsigned> requests;
+        for (unsigned i = 0; i < shards.size(); i++) {
+            requests.push_back(shards[i]->request_flush());
+        }
+        for (unsigned i = 0; i < shards.size(); i++) {
+            shards[i]->wait_for_flush(requests[i]);
+        }
+        return;
+    }
+    if (writer_running) {
+        wait_for_flush(request_flush());
+        return;
+    }
+
+    // Without a writer thread, write the buffers here
+    pthread_mutex_lock(&lock);
+    vector<IORecord *> records;
+    records.swap(buffered);
+    buffered_bytes = 0;
+    pthread_mutex_unlock(&lock);
+
+    write_records(records);
+
+    pthread_mutex_lock(&lock);
+    release_records(records);
+    pthread_mutex_unlock(&lock);
+}
+
+unsigned FDCache::request_flush() {
+    pthread_mutex_lock(&lock);
+    unsigned request = ++flush_requests;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+    return request;
+}
+
+void FDCache::wait_for_flush(unsigned request) {
+    pthread_mutex_lock(&lock);
+    while (flushes_done < request) {
+        pthread_cond_wait(&flushed, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Returns true if the task has data that has not been flushed yet */
+bool FDCache::pending(const string &task) {
+    for (unsigned i = 0; i < shards.size(); i++) {
+        if (shards[i]->pending(task)) {
+            return true;
+        }
+    }
+    pthread_mutex_lock(&lock);
+    bool result = pending_records.find(task) != pending_records.end();
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+/* Add the number of chunks written for each worker to result */
+void FDCache::take_credits(map<int, unsigned> &result) {
+    for (unsigned i = 0; i < shards.size(); i++) {
+        shards[i]->take_credits(result);
+    }
+    pthread_mutex_lock(&lock);
+    for (map<int, unsigned>::iterator c = credits.begin(); c != credits.end(); c++) {
+        result[c->first] += c->second;
+    }
+    credits.clear();
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Owe the worker credit for every record it sent, so that workers can
+ * only send as much data as they have credit for.
+ */
+void FDCache::credit_records() {
+    for (unsigned i = 0; i < shards.size(); i++) {
+        shards[i]->credit_records();
+    }
+    pthread_mutex_lock(&lock);
+    credit_all = true;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Returns true if writing data for the task failed, and clears the error */
+bool FDCache::take_failure(const string &task) {
+    // A task can fail in more than one shard
+    bool result = false;
+    for (unsigned i = 0; i < shards.size(); i++) {
+        if (shards[i]->take_failure(task)) {
+            result = true;
+        }
+    }
+    pthread_mutex_lock(&lock);
+    result = failed_tasks.erase(task) > 0 || result;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
 /* Determine the system limit on open file descriptors */
 unsigned FDCache::get_max_open_files() {
     unsigned limit = 0;
@@ -3,10 +3,17 @@
 
 #include <string>
 #include <map>
+#include <list>
+#include <set>
+#include <vector>
 #include <cstdio>
+#include <pthread.h>
 
 using std::string;
 using std::map;
+using std::list;
+using std::set;
+using std::vector;
 
 class FDEntry {
 public:
@@ -18,7 +25,81 @@ public:
     ~FDEntry();
 };
 
+/* Data waiting to be written to a file */
+class IORecord {
+public:
+    string filename;
+    string task;
+    string data;
+    // The worker that sent the data, or -1 if no credit is owed for it,
+    // and its position in the stream of chunks if it is one. The last
+    // chunk of a stream that the worker could not finish is aborted.
+    int source;
+    unsigned seq;
+    bool last;
+    bool aborted;
+    // Where the data goes in the file, or -1 to append it
+    long long offset;
+    IORecord(const string &filename, const string &task, const char *data, int size,
+            int source = 0, unsigned seq = 0, bool last = true, bool aborted = false,
+            long long offset = -1);
+    bool chunked() const { return seq > 0 || !last; }
+};
+
+/* A task that is sending a file in chunks, and the next chunk expected */
+class IOStream {
+public:
+    string task;
+    unsigned next;
+};
+
 class FDCache {
+    // Buffered records and write-behind state. Everything below is
+    // protected by lock, except for the cache entries, which are only
+    // used by the writer thread while it is running.
+    bool writer_running;
+    bool writer_stopping;
+    unsigned flush_interval;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t flushed;
+    vector<IORecord *> buffered;
+    unsigned long buffered_bytes;
+    unsigned flush_requests;
+    unsigned flushes_done;
+    map<string, unsigned> pending_records;
+    set<string> failed_tasks;
+
+    // While a task is streaming chunks to a file, data from other tasks
+    // for the file is held so that the output of each task stays together
+    map<string, IOStream> streams;
+    map<string, list<IORecord *> > held;
+
+    // The size of each file when the stream being written to it started,
+    // which an aborted stream is truncated back to. Only used by the
+    // thread that writes the records.
+    map<string, off_t> stream_starts;
+
+    // Chunks written for each worker since the last take_credits(), and
+    // whether every record from a worker is owed credit, not just chunks
+    map<int, unsigned> credits;
+    bool credit_all;
+
+    // With more than one writer thread, each thread owns a shard of
+    // the cache, and each file always goes to the same shard
+    vector<FDCache *> shards;
+
+    FDCache *shard(const string &filename);
+    int admit(IORecord *record);
+    void drop_stream(IORecord *record);
+    unsigned request_flush();
+    void wait_for_flush(unsigned request);
+    static void *writer_main(void *arg);
+    void run_writer();
+    void write_records(const vector<IORecord *> &records);
+    int write_file(const string &filename, const vector<IORecord *> &records);
+    void release_records(const vector<IORecord *> &records);
 public:
     unsigned maxsize;
     unsigned hits;
@@ -28,6 +109,10 @@ public:
     FDEntry *last;
     map<string, FDEntry *> byname;
 
+    // Files that were opened elsewhere, such as stdout, and are never
+    // evicted or closed by the cache
+    map<string, FDEntry *> pinned;
+
     FDCache(unsigned maxsize=0);
     ~FDCache();
     double hitrate();
@@ -35,7 +120,20 @@ public:
     void push(FDEntry *entry);
     FDEntry *pop();
     FILE *open(string filename);
+    void pin(const string &filename, FILE *file);
+    int append(const string &filename, const char *data, int size);
+    int flush_file(const string &filename);
     int write(string filename, const char *data, int size);
+    void start_writer(unsigned interval, unsigned nthreads=1);
+    bool write_behind();
+    void enqueue(const string &filename, const string &task, const char *data, int size,
+            int source = 0, unsigned seq = 0, bool last = true, bool aborted = false,
+            long long offset = -1);
+    void flush();
+    bool pending(const string &task);
+    bool take_failure(const string &task);
+    void take_credits(map<int, unsigned> &result);
+    void credit_records();
     int size();
     void close();
     unsigned get_nr_open_fds();
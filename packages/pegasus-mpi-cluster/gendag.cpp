@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+#include "gendag.h"
+#include "failure.h"
+
+using std::vector;
+
+bool parse_dag_shape(const string &name, DAGShape *shape) {
+    if (name == "levels") {
+        *shape = SHAPE_LEVELS;
+    } else if (name == "wide") {
+        *shape = SHAPE_WIDE;
+    } else if (name == "chain") {
+        *shape = SHAPE_CHAIN;
+    } else if (name == "butterfly") {
+        *shape = SHAPE_BUTTERFLY;
+    } else if (name == "tree") {
+        *shape = SHAPE_TREE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+DAGGenerator::DAGGenerator() {
+    shape = SHAPE_LEVELS;
+    tasks = 1000;
+    width = 0;
+    fanin = 2;
+    runtime = 60.0;
+    jitter = 0.5;
+    seed = 42;
+    command = "/bin/true";
+    edges = 0;
+    total_runtime = 0.0;
+    critical_path = 0.0;
+}
+
+/* Return the parents of child, which are all less than child */
+static void get_parents(const DAGGenerator &gen, unsigned child, unsigned width,
+        unsigned stage_bits, vector<unsigned> &parents) {
+    parents.clear();
+    unsigned n = gen.tasks;
+    switch (gen.shape) {
+        case SHAPE_LEVELS:
+            if (child >= width) {
+                // Pick distinct parents, unless there are not enough
+                unsigned first = (child / width - 1) * width;
+                unsigned count = std::min(gen.fanin, width);
+                while (parents.size() < count) {
+                    unsigned p = first + rand() % width;
+                    if (std::find(parents.begin(), parents.end(), p) == parents.end()) {
+                        parents.push_back(p);
+                    }
+                }
+            }
+            break;
+        case SHAPE_WIDE:
+            if (child == n - 1 && n > 2) {
+                for (unsigned p = 1; p < n - 1; p++) {
+                    parents.push_back(p);
+                }
+            } else if (child > 0) {
+                parents.push_back(0);
+            }
+            break;
+        case SHAPE_CHAIN:
+            if (child >= width) {
+                parents.push_back(child - width);
+            }
+            break;
+        case SHAPE_BUTTERFLY:
+            if (child >= width) {
+                unsigned stage = child / width;
+                unsigned pos = child % width;
+                unsigned first = (stage - 1) * width;
+                parents.push_back(first + pos);
+                if (stage_bits > 0) {
+                    unsigned partner = pos ^ (1u << ((stage - 1) % stage_bits));
+                    parents.push_back(first + partner);
+                }
+            }
+            break;
+        case SHAPE_TREE: {
+            // Number the tasks from the root, which is the last task,
+            // so that task r merges tasks r*fanin+1 ... r*fanin+fanin
+            unsigned r = n - 1 - child;
+            for (unsigned k = 1; k <= gen.fanin; k++) {
+                unsigned long input = (unsigned long)r * gen.fanin + k;
+                if (input < n) {
+                    parents.push_back(n - 1 - input);
+                }
+            }
+            break;
+        }
+    }
+}
+
+void DAGGenerator::write(const string &path) {
+    if (tasks == 0) {
+        myfailure("DAG must have at least one task");
+    }
+    if (fanin == 0) {
+        myfailure("Fan-in must be at least 1");
+    }
+
+    unsigned w = width;
+    if (w == 0 || w > tasks) {
+        w = tasks;
+    }
+    unsigned stage_bits = 0;
+    if (shape == SHAPE_BUTTERFLY) {
+        // The width of a butterfly is a power of two
+        while ((2u << stage_bits) <= w) {
+            stage_bits++;
+        }
+        w = 1u << stage_bits;
+    }
+
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL) {
+        myfailures("Unable to create %s", path.c_str());
+    }
+
+    srand(seed);
+    vector<double> runtimes(tasks);
+    total_runtime = 0.0;
+    for (unsigned i = 0; i < tasks; i++) {
+        double r = runtime * (1.0 + jitter * (2.0 * rand() / RAND_MAX - 1.0));
+        runtimes[i] = r;
+        total_runtime += r;
+        fprintf(f, "TASK t%u -r %.3lf %s\n", i, r, command.c_str());
+    }
+
+    // Because parents come before their children, the time at which each
+    // task can finish is known when its edges are written
+    vector<double> finish(runtimes);
+    vector<unsigned> parents;
+    edges = 0;
+    critical_path = 0.0;
+    for (unsigned child = 0; child < tasks; child++) {
+        get_parents(*this, child, w, stage_bits, parents);
+        double ready = 0.0;
+        for (unsigned k = 0; k < parents.size(); k++) {
+            fprintf(f, "EDGE t%u t%u\n", parents[k], child);
+            ready = std::max(ready, finish[parents[k]]);
+        }
+        edges += parents.size();
+        finish[child] = ready + runtimes[child];
+        critical_path = std::max(critical_path, finish[child]);
+    }
+
+    if (fclose(f) != 0) {
+        myfailures("Error writing %s", path.c_str());
+    }
+}
+
+/* Write a rescue file in which the first fraction of the tasks are done */
+void DAGGenerator::write_rescue(const string &path, double fraction) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL) {
+        myfailures("Unable to create %s", path.c_str());
+    }
+    unsigned done = (unsigned)(fraction * tasks);
+    for (unsigned i = 0; i < done; i++) {
+        fprintf(f, "DONE t%u\n", i);
+    }
+    if (fclose(f) != 0) {
+        myfailures("Error writing %s", path.c_str());
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef GENDAG_H
+#define GENDAG_H
+
+#include <string>
+
+using std::string;
+
+enum DAGShape {
+    SHAPE_LEVELS,    // Levels of width tasks, each with fanin random parents
+    SHAPE_WIDE,      // One root, all other tasks its children, one sink
+    SHAPE_CHAIN,     // width independent chains
+    SHAPE_BUTTERFLY, // FFT-style exchange between stages of width tasks
+    SHAPE_TREE       // Reduction tree where each task merges fanin others
+};
+
+bool parse_dag_shape(const string &name, DAGShape *shape);
+
+/*
+ * Generates synthetic DAGs for benchmarks. Tasks are named t0, t1, ...
+ * and every edge goes from a task to one with a larger index. Runtime
+ * estimates are uniform in runtime * (1 +/- jitter), and the sequence of
+ * random numbers depends only on the seed, so the same options always
+ * produce the same DAG.
+ */
+class DAGGenerator {
+public:
+    DAGShape shape;
+    unsigned tasks;
+    unsigned width;
+    unsigned fanin;
+    double runtime;
+    double jitter;
+    unsigned seed;
+    string command;
+
+    // Set by write()
+    unsigned long edges;
+    double total_runtime;
+    double critical_path;
+
+    DAGGenerator();
+    void write(const string &path);
+    void write_rescue(const string &path, double fraction);
+};
+
+#endif /* GENDAG_H */
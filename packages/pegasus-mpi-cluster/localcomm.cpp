@@ -0,0 +1,357 @@
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "localcomm.h"
+#include "failure.h"
+#include "tools.h"
+#include "log.h"
+
+enum LocalKind {
+    LOCAL_MESSAGE,
+    LOCAL_BROADCAST,
+    LOCAL_GATHER,
+    LOCAL_BARRIER
+};
+
+static char *copy_buffer(Message *message) {
+    char *msg = alloc_buffer(message->msgsize);
+    memcpy(msg, message->msg, message->msgsize);
+    return msg;
+}
+
+LocalCommunicator::LocalCommunicator(Communicator *comm, unsigned workers) {
+    this->comm = comm;
+    this->first = comm->size();
+    this->bytes_sent = 0;
+    this->bytes_recvd = 0;
+    pthread_mutex_init(&lock, NULL);
+    inboxes.resize(workers + 1);
+    posted = new pthread_cond_t[workers + 1];
+    for (unsigned i = 0; i <= workers; i++) {
+        pthread_cond_init(&posted[i], NULL);
+    }
+    for (unsigned i = 0; i < workers; i++) {
+        this->workers.push_back(new LocalWorkerCommunicator(this, first + i));
+    }
+}
+
+LocalCommunicator::~LocalCommunicator() {
+    for (unsigned i = 0; i < workers.size(); i++) {
+        delete workers[i];
+    }
+    for (unsigned i = 0; i < inboxes.size(); i++) {
+        list<LocalEnvelope>::iterator e;
+        for (e = inboxes[i].begin(); e != inboxes[i].end(); e++) {
+            free_buffer(e->msg, e->msgsize);
+        }
+        pthread_cond_destroy(&posted[i]);
+    }
+    delete [] posted;
+    pthread_mutex_destroy(&lock);
+}
+
+Communicator *LocalCommunicator::worker(unsigned i) {
+    return workers[i];
+}
+
+/* The inbox of the master is first, followed by those of the local workers */
+unsigned LocalCommunicator::index(int rank) {
+    if (rank == comm->rank()) {
+        return 0;
+    }
+    if (rank < first || rank >= size()) {
+        myfailure("Rank %d is not a local worker", rank);
+    }
+    return rank - first + 1;
+}
+
+/* Whether a message of kind is waiting for rank */
+bool LocalCommunicator::waiting(int rank, int kind) {
+    unsigned i = index(rank);
+    bool found = false;
+    pthread_mutex_lock(&lock);
+    list<LocalEnvelope>::iterator e;
+    for (e = inboxes[i].begin(); e != inboxes[i].end() && !found; e++) {
+        found = e->kind == kind;
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+/* Queue a message for dest, which takes ownership of msg */
+void LocalCommunicator::post(int dest, int kind, int tag, int source, char *msg,
+        unsigned msgsize) {
+    LocalEnvelope envelope;
+    envelope.kind = kind;
+    envelope.tag = tag;
+    envelope.source = source;
+    envelope.msg = msg;
+    envelope.msgsize = msgsize;
+
+    unsigned i = index(dest);
+    pthread_mutex_lock(&lock);
+    inboxes[i].push_back(envelope);
+    pthread_cond_signal(&posted[i]);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Take the oldest message of kind that is waiting for rank. If there is
+ * none, this waits up to timeout seconds for one, or forever if timeout
+ * is 0. A negative timeout does not wait. Returns false if there is no
+ * message.
+ */
+bool LocalCommunicator::take(int rank, int kind, LocalEnvelope &envelope, double timeout) {
+    struct timespec deadline;
+    if (timeout > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        double end = deadline.tv_sec + deadline.tv_nsec / 1e9 + timeout;
+        deadline.tv_sec = (time_t)floor(end);
+        deadline.tv_nsec = (long)((end - floor(end)) * 1e9);
+    }
+
+    unsigned i = index(rank);
+    bool found = false;
+    pthread_mutex_lock(&lock);
+    while (true) {
+        list<LocalEnvelope>::iterator e;
+        for (e = inboxes[i].begin(); e != inboxes[i].end(); e++) {
+            if (e->kind == kind) {
+                envelope = *e;
+                inboxes[i].erase(e);
+                found = true;
+                break;
+            }
+        }
+        if (found || timeout < 0) {
+            break;
+        }
+        if (timeout == 0) {
+            pthread_cond_wait(&posted[i], &lock);
+        } else if (pthread_cond_timedwait(&posted[i], &lock, &deadline) == ETIMEDOUT) {
+            timeout = -1;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+Message *LocalCommunicator::take_message(int rank, int kind, double timeout) {
+    LocalEnvelope envelope;
+    if (!take(rank, kind, envelope, timeout)) {
+        return NULL;
+    }
+    return create_message(envelope.tag, envelope.msg, envelope.msgsize, envelope.source);
+}
+
+void LocalCommunicator::send_message(Message *message, int dest) {
+    if (dest < first) {
+        comm->send_message(message, dest);
+        return;
+    }
+
+    log_trace("Rank %d: Sending %d byte message of type %d to local worker %d",
+              rank(), message->msgsize, message->tag(), dest);
+
+    post(dest, LOCAL_MESSAGE, message->tag(), rank(), copy_buffer(message),
+            message->msgsize);
+    bytes_sent += message->msgsize;
+}
+
+/* The local worker gets the buffer of the message, so it is not copied */
+void LocalCommunicator::send_message_async(Message *message, int dest) {
+    if (dest < first) {
+        comm->send_message_async(message, dest);
+        return;
+    }
+
+    log_trace("Rank %d: Sending %d byte message of type %d to local worker %d",
+              rank(), message->msgsize, message->tag(), dest);
+
+    post(dest, LOCAL_MESSAGE, message->tag(), rank(), message->msg, message->msgsize);
+    bytes_sent += message->msgsize;
+    message->msg = NULL;
+    delete message;
+}
+
+void LocalCommunicator::wait_for_sends() {
+    comm->wait_for_sends();
+}
+
+/* Only the master can broadcast, because the local workers can only reach it */
+Message *LocalCommunicator::broadcast_message(Message *message, int root) {
+    if (root != rank()) {
+        myfailure("Only the master can broadcast to local workers");
+    }
+    comm->broadcast_message(message, root);
+    for (unsigned i = 0; i < workers.size(); i++) {
+        post(first + i, LOCAL_BROADCAST, message->tag(), root, copy_buffer(message),
+                message->msgsize);
+    }
+    bytes_sent += message->msgsize;
+    return NULL;
+}
+
+vector<Message *> LocalCommunicator::gather_messages(Message *message, int root) {
+    if (root != rank()) {
+        myfailure("Only the master can gather from local workers");
+    }
+    vector<Message *> messages = comm->gather_messages(message, root);
+    messages.resize(size(), NULL);
+    for (unsigned i = 0; i < workers.size(); i++) {
+        Message *mesg = take_message(rank(), LOCAL_GATHER, 0);
+        bytes_recvd += mesg->msgsize;
+        messages[mesg->source] = mesg;
+    }
+    return messages;
+}
+
+Message *LocalCommunicator::recv_message(double timeout) {
+    log_trace("Rank %d: waiting for message", rank());
+
+    double start = current_time();
+    useconds_t sleeptime = LOCAL_MIN_RECV_SLEEP;
+    while (true) {
+        Message *message = take_message(rank(), LOCAL_MESSAGE, -1);
+        if (message != NULL) {
+            bytes_recvd += message->msgsize;
+            return message;
+        }
+
+        if (comm->message_waiting()) {
+            return comm->recv_message();
+        }
+
+        if (timeout > 0 && current_time() - start >= timeout) {
+            log_trace("Rank %d: No message waiting", rank());
+            return NULL;
+        }
+
+        if (usleep(sleeptime)) {
+            // The sleep was interrupted by a signal
+            return NULL;
+        }
+
+        // Back off while there are no messages
+        sleeptime = std::min(2 * sleeptime, (useconds_t)LOCAL_MAX_RECV_SLEEP);
+    }
+}
+
+bool LocalCommunicator::message_waiting() {
+    return waiting(rank(), LOCAL_MESSAGE) || comm->message_waiting();
+}
+
+void LocalCommunicator::barrier() {
+    comm->barrier();
+    LocalEnvelope envelope;
+    for (unsigned i = 0; i < workers.size(); i++) {
+        take(rank(), LOCAL_BARRIER, envelope, 0);
+    }
+    for (unsigned i = 0; i < workers.size(); i++) {
+        post(first + i, LOCAL_BARRIER, 0, rank(), NULL, 0);
+    }
+}
+
+void LocalCommunicator::abort(int exitcode) {
+    comm->abort(exitcode);
+}
+
+int LocalCommunicator::rank() {
+    return comm->rank();
+}
+
+int LocalCommunicator::size() {
+    return first + workers.size();
+}
+
+unsigned long LocalCommunicator::sent() {
+    return comm->sent() + bytes_sent;
+}
+
+unsigned long LocalCommunicator::recvd() {
+    return comm->recvd() + bytes_recvd;
+}
+
+LocalWorkerCommunicator::LocalWorkerCommunicator(LocalCommunicator *local, int rank) {
+    this->local = local;
+    this->myrank = rank;
+    this->bytes_sent = 0;
+    this->bytes_recvd = 0;
+}
+
+void LocalWorkerCommunicator::send_message(Message *message, int dest) {
+    if (dest != local->rank()) {
+        myfailure("Local worker %d can only send messages to the master, not %d",
+                myrank, dest);
+    }
+    local->post(dest, LOCAL_MESSAGE, message->tag(), myrank, copy_buffer(message),
+            message->msgsize);
+    bytes_sent += message->msgsize;
+}
+
+void LocalWorkerCommunicator::send_message_async(Message *message, int dest) {
+    if (dest != local->rank()) {
+        myfailure("Local worker %d can only send messages to the master, not %d",
+                myrank, dest);
+    }
+    local->post(dest, LOCAL_MESSAGE, message->tag(), myrank, message->msg,
+            message->msgsize);
+    bytes_sent += message->msgsize;
+    message->msg = NULL;
+    delete message;
+}
+
+Message *LocalWorkerCommunicator::broadcast_message(Message *message, int root) {
+    Message *mesg = local->take_message(myrank, LOCAL_BROADCAST, 0);
+    bytes_recvd += mesg->msgsize;
+    return mesg;
+}
+
+vector<Message *> LocalWorkerCommunicator::gather_messages(Message *message, int root) {
+    local->post(root, LOCAL_GATHER, message->tag(), myrank, copy_buffer(message),
+            message->msgsize);
+    bytes_sent += message->msgsize;
+    return vector<Message *>();
+}
+
+Message *LocalWorkerCommunicator::recv_message(double timeout) {
+    Message *mesg = local->take_message(myrank, LOCAL_MESSAGE, timeout);
+    if (mesg != NULL) {
+        bytes_recvd += mesg->msgsize;
+    }
+    return mesg;
+}
+
+bool LocalWorkerCommunicator::message_waiting() {
+    return local->waiting(myrank, LOCAL_MESSAGE);
+}
+
+void LocalWorkerCommunicator::barrier() {
+    local->post(local->rank(), LOCAL_BARRIER, 0, myrank, NULL, 0);
+    LocalEnvelope envelope;
+    local->take(myrank, LOCAL_BARRIER, envelope, 0);
+}
+
+void LocalWorkerCommunicator::abort(int exitcode) {
+    local->abort(exitcode);
+}
+
+int LocalWorkerCommunicator::rank() {
+    return myrank;
+}
+
+int LocalWorkerCommunicator::size() {
+    return local->size();
+}
+
+unsigned long LocalWorkerCommunicator::sent() {
+    return bytes_sent;
+}
+
+unsigned long LocalWorkerCommunicator::recvd() {
+    return bytes_recvd;
+}
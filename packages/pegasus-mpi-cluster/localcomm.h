@@ -0,0 +1,113 @@
+#ifndef LOCALCOMM_H
+#define LOCALCOMM_H
+
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "comm.h"
+
+using std::list;
+using std::vector;
+
+// Bounds on the time the master sleeps between checks for messages in usec
+#define LOCAL_MIN_RECV_SLEEP 10
+#define LOCAL_MAX_RECV_SLEEP 1000
+
+/*
+ * A message on its way between the master and a local worker. It is
+ * decoded by the thread that receives it.
+ */
+struct LocalEnvelope {
+    int kind;
+    int tag;
+    int source;
+    char *msg;
+    unsigned msgsize;
+};
+
+class LocalWorkerCommunicator;
+
+/*
+ * A communicator for running workers in threads of the master process,
+ * so that the CPUs of the master's host that the master does not need
+ * can run tasks without extra MPI ranks that compete with it. The local
+ * workers get the ranks after those of comm, and the master sees them as
+ * ordinary workers. Messages between the master and the local workers
+ * are handed over in memory, in queues protected by one lock, so the
+ * local workers can only talk to the master. The master checks its queue
+ * and comm in turn, backing off like the MPI communicator while there
+ * are no messages, so that it is still interrupted by signals.
+ */
+class LocalCommunicator : public Communicator {
+private:
+    friend class LocalWorkerCommunicator;
+
+    Communicator *comm;
+    int first;
+    pthread_mutex_t lock;
+    unsigned long bytes_sent;
+    unsigned long bytes_recvd;
+
+    // The messages waiting for the master, followed by those waiting
+    // for each local worker, and the conditions they wait on
+    vector<list<LocalEnvelope> > inboxes;
+    pthread_cond_t *posted;
+    vector<LocalWorkerCommunicator *> workers;
+
+    unsigned index(int rank);
+    bool waiting(int rank, int kind);
+    void post(int dest, int kind, int tag, int source, char *msg, unsigned msgsize);
+    bool take(int rank, int kind, LocalEnvelope &envelope, double timeout);
+    Message *take_message(int rank, int kind, double timeout);
+
+public:
+    LocalCommunicator(Communicator *comm, unsigned workers);
+    virtual ~LocalCommunicator();
+    unsigned local_workers() { return workers.size(); }
+    // The communicator of the i-th local worker
+    Communicator *worker(unsigned i);
+    virtual void send_message(Message *message, int dest);
+    virtual void send_message_async(Message *message, int dest);
+    virtual void wait_for_sends();
+    virtual Message *broadcast_message(Message *message, int root);
+    virtual vector<Message *> gather_messages(Message *message, int root);
+    virtual Message *recv_message(double timeout = 0);
+    virtual bool message_waiting();
+    virtual void barrier();
+    virtual void abort(int exitcode);
+    virtual int rank();
+    virtual int size();
+    virtual unsigned long sent();
+    virtual unsigned long recvd();
+    virtual bool supports_threads() { return comm->supports_threads(); }
+    virtual double clock() { return comm->clock(); }
+};
+
+/* The side of a LocalCommunicator that one local worker uses */
+class LocalWorkerCommunicator : public Communicator {
+private:
+    LocalCommunicator *local;
+    int myrank;
+    unsigned long bytes_sent;
+    unsigned long bytes_recvd;
+
+public:
+    LocalWorkerCommunicator(LocalCommunicator *local, int rank);
+    virtual void send_message(Message *message, int dest);
+    virtual void send_message_async(Message *message, int dest);
+    virtual void wait_for_sends() {}
+    virtual Message *broadcast_message(Message *message, int root);
+    virtual vector<Message *> gather_messages(Message *message, int root);
+    virtual Message *recv_message(double timeout = 0);
+    virtual bool message_waiting();
+    virtual void barrier();
+    virtual void abort(int exitcode);
+    virtual int rank();
+    virtual int size();
+    virtual unsigned long sent();
+    virtual unsigned long recvd();
+};
+
+#endif /* LOCALCOMM_H */
@@ -1,17 +1,44 @@
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
 #include "time.h"
+#include "pthread.h"
 #include "sys/time.h"
 
+#include <vector>
+#include <algorithm>
+
 #include "log.h"
 
+// The functions are defined here, not the macros
+#undef log_debug
+#undef log_trace
+
 #define MAX_LOG_MESSAGE 8192
 
 // This is set to stderr so that it works nicely with Pegasus
 #define DEFAULT_LOG_FILE stderr
 
-static int loglevel = LOG_INFO;
+int log_current_level = LOG_INFO;
 static FILE *logfile = DEFAULT_LOG_FILE;
 
+/*
+ * With log_start_async(), formatted messages are appended to a ring of
+ * bytes and written by a background thread, so that the caller does not
+ * wait for stdio. Messages are formatted by the caller, which keeps the
+ * time stamps accurate and the time spent holding the lock short.
+ */
+static bool async = false;
+static bool async_stopping = false;
+static bool async_writing = false;
+static std::vector<char> ring;
+static size_t ring_head = 0;
+static size_t ring_count = 0;
+static pthread_t async_writer;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_drained = PTHREAD_COND_INITIALIZER;
+
 static const char * const loglabels[] = {
     "fatal",
     "error",
@@ -22,14 +49,19 @@ static const char * const loglabels[] = {
 };
 
 void log_set_level(int level) {
-    loglevel = level;
+    log_current_level = level;
 }
 
 int log_get_level() {
-    return loglevel;
+    return log_current_level;
 }
 
+static void async_flush();
+
 void log_set_file(FILE *log) {
+    if (async) {
+        async_flush();
+    }
     logfile = log;
 }
 
@@ -47,6 +79,115 @@ static void timestr(char *dest) {
         t->tm_hour, t->tm_min, t->tm_sec, ms, t->tm_zone);
 }
 
+/* Copy a formatted message into the ring, waiting while it is full */
+static void async_append(const char *message, size_t length) {
+    pthread_mutex_lock(&async_lock);
+    while (length > 0) {
+        while (ring_count == ring.size()) {
+            pthread_cond_signal(&async_wakeup);
+            pthread_cond_wait(&async_drained, &async_lock);
+        }
+        size_t tail = (ring_head + ring_count) % ring.size();
+        size_t n = std::min(length, std::min(ring.size() - ring_count, ring.size() - tail));
+        memcpy(&ring[tail], message, n);
+        ring_count += n;
+        message += n;
+        length -= n;
+    }
+    if (ring_count >= ring.size() / 2) {
+        pthread_cond_signal(&async_wakeup);
+    }
+    pthread_mutex_unlock(&async_lock);
+}
+
+/* Wait until the writer thread has written everything in the ring */
+static void async_flush() {
+    pthread_mutex_lock(&async_lock);
+    while (ring_count > 0 || async_writing) {
+        pthread_cond_signal(&async_wakeup);
+        pthread_cond_wait(&async_drained, &async_lock);
+    }
+    fflush(logfile);
+    pthread_mutex_unlock(&async_lock);
+}
+
+static void *async_main(void *arg) {
+    pthread_mutex_lock(&async_lock);
+    while (true) {
+        if (ring_count == 0) {
+            if (async_stopping) {
+                break;
+            }
+            pthread_cond_wait(&async_wakeup, &async_lock);
+            continue;
+        }
+
+        // The lock is not held while writing. Only this thread removes
+        // bytes from the ring, so the bytes being written stay put.
+        size_t n = std::min(ring_count, ring.size() - ring_head);
+        const char *data = &ring[ring_head];
+        async_writing = true;
+        pthread_mutex_unlock(&async_lock);
+        fwrite(data, 1, n, logfile);
+        if (n == ring_count) {
+            fflush(logfile);
+        }
+        pthread_mutex_lock(&async_lock);
+        async_writing = false;
+        ring_head = (ring_head + n) % ring.size();
+        ring_count -= n;
+        pthread_cond_broadcast(&async_drained);
+    }
+    pthread_mutex_unlock(&async_lock);
+    return NULL;
+}
+
+/* A forked child has no writer thread, so it logs synchronously */
+static void async_child() {
+    async = false;
+    pthread_mutex_init(&async_lock, NULL);
+}
+
+/*
+ * Write log messages from a background thread through a ring of
+ * capacity bytes. Fatal and error messages are still written before the
+ * call returns, after the messages before them.
+ */
+void log_start_async(size_t capacity) {
+    if (async) {
+        return;
+    }
+    ring.assign(capacity < MAX_LOG_MESSAGE ? MAX_LOG_MESSAGE : capacity, 0);
+    ring_head = 0;
+    ring_count = 0;
+    async_stopping = false;
+    if (pthread_create(&async_writer, NULL, async_main, NULL) != 0) {
+        log_warn("Unable to start log thread, logging synchronously");
+        return;
+    }
+    static bool registered = false;
+    if (!registered) {
+        pthread_atfork(NULL, NULL, async_child);
+        atexit(log_stop_async);
+        registered = true;
+    }
+    async = true;
+}
+
+/* Write the messages in the ring and go back to logging synchronously */
+void log_stop_async() {
+    if (!async) {
+        return;
+    }
+    pthread_mutex_lock(&async_lock);
+    async_stopping = true;
+    pthread_cond_signal(&async_wakeup);
+    pthread_mutex_unlock(&async_lock);
+    pthread_join(async_writer, NULL);
+    async = false;
+    fflush(logfile);
+}
+
 void log_message(int level, const char *message, va_list args) {
     // Filter log messages that are unnecessary
     if (!log_test(level)) {
@@ -70,7 +211,27 @@ void log_message(int level, const char *message, va_list args) {
                  ts, loglabels[level], message);
     }
     
-    vfprintf(logfile, logformat, args);
+    if (!async) {
+        vfprintf(logfile, logformat, args);
+        return;
+    }
+
+    char formatted[MAX_LOG_MESSAGE];
+    int length = vsnprintf(formatted, MAX_LOG_MESSAGE, logformat, args);
+    if (length < 0) {
+        return;
+    }
+    if (length >= MAX_LOG_MESSAGE) {
+        // Keep the newline of truncated messages
+        length = MAX_LOG_MESSAGE - 1;
+        formatted[length - 1] = '\n';
+    }
+    async_append(formatted, length);
+
+    // Errors are often followed by an abort, so they are written now
+    if (level <= LOG_ERROR) {
+        async_flush();
+    }
 }
 
 #define __LOG_MESSAGE(level) \
@@ -104,7 +265,7 @@ void log_trace(const char *format, ...) {
 }
 
 bool log_test(int level) {
-    return (level <= loglevel);
+    return (level <= log_current_level);
 }
 
 bool log_fatal() {
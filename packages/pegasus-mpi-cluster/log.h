@@ -35,5 +35,27 @@ bool log_info();
 bool log_debug();
 bool log_trace();
 
+void log_start_async(size_t capacity = 1024 * 1024);
+void log_stop_async();
+
+// Exported so that the macros below can check the level inline
+extern int log_current_level;
+
+/*
+ * Debug and trace messages are logged from hot paths. These macros check
+ * the level before the arguments are evaluated, so a disabled message
+ * costs one comparison. The macros expand to the functions of the same
+ * name, so log_debug() and log_trace() still test the level. Building
+ * with -DNO_TRACE_LOG removes trace messages altogether.
+ */
+#define log_debug(...) \
+    (LOG_DEBUG <= log_current_level && (log_debug(__VA_ARGS__), true))
+#ifdef NO_TRACE_LOG
+#define log_trace(...) (false && (log_trace(__VA_ARGS__), true))
+#else
+#define log_trace(...) \
+    (LOG_TRACE <= log_current_level && (log_trace(__VA_ARGS__), true))
+#endif
+
 
 #endif /* LOG_H */
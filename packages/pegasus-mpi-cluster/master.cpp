@@ -1,9 +1,19 @@
 #include <map>
+#include <algorithm>
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
 #include <math.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
 
 #include "master.h"
 #include "failure.h"
@@ -11,6 +21,8 @@
 #include "protocol.h"
 #include "log.h"
 #include "tools.h"
+#include "config.h"
+#include "strlib.h"
 
 using std::string;
 using std::vector;
@@ -18,6 +30,18 @@ using std::map;
 
 #define MESSAGE_DUMP_FILE "pmc.message.dmp"
 
+// Seconds between reads of the DAG stream when no results arrive
+#define DAG_STREAM_POLL_INTERVAL 0.1
+
+// Maximum number of tasks in a --bundle-time bundle, which limits the size
+// of the message and the work that is lost if the worker dies
+#define MAX_BUNDLE_SIZE 1024
+
+// Seconds the master waits for the host scripts before it warns about
+// the hosts that are not ready. This is longer than the workers give
+// the scripts, so normally every host has reported by then.
+#define HOST_READY_TIMEOUT 90.0
+
 static bool ABORT = false;
 
 static void on_signal(int signo) {
@@ -28,6 +52,11 @@ static void on_signal(int signo) {
     ABORT = true;
 }
 
+/* The CPUs that count against the share of the workflow of task */
+static unsigned task_share(Task *task) {
+    return std::max(task->cpus, (cpu_t)1) * task->hosts;
+}
+
 static void log_invalid_message(Message *mesg) {
     /* Log as much information about the message as we can */
     log_error("Master got invalid message: size=%u, source=%d", 
@@ -48,35 +77,196 @@ static void log_invalid_message(Message *mesg) {
     }
 }
 
-Host::Host(const string &host_name, unsigned int memory, cpu_t threads, cpu_t cores, cpu_t sockets) {
+Host::Host(const string &host_name, unsigned int memory, cpu_t threads, cpu_t cores, cpu_t sockets,
+        const vector<cpu_t> &cpu_cores, const vector<cpu_t> &cpu_sockets, cpu_t gpus,
+        unsigned int staging) {
     this->host_name = host_name;
     this->memory = memory;
     this->threads = threads;
     this->cores = cores;
     this->sockets = sockets;
+    this->gpus = gpus;
+    this->staging = staging;
     this->slots = 1;
+    this->submaster_rank = 0;
+    this->host_index = 0;
+    this->log_id = 0;
+    this->log_registered = false;
+    this->failures_in_row = 0;
+    this->task_failures = 0;
+    this->task_successes = 0;
+    this->quarantine_until = 0.0;
+    this->host_ready = true;
 
     this->memory_free = memory;
     this->cpus_free = threads;
+    this->gpus_free = gpus;
     this->slots_free = slots;
+    this->gpus_unbound.assign(gpus, true);
+
+    if (this->cores == 0) {
+        this->cores = 1;
+    }
+    if (this->sockets == 0) {
+        this->sockets = 1;
+    }
 
-    this->cpus = new Task*[threads];
-    for (unsigned i=0; i<threads; i++) {
-        cpus[i] = NULL;
+    // Without a topology from the worker, or if it doesn't match the
+    // counts, assume that the CPUs of each core and socket are numbered
+    // contiguously
+    bool contiguous = cpu_cores.size() != threads || cpu_sockets.size() != threads;
+    for (unsigned i = 0; !contiguous && i < threads; i++) {
+        contiguous = cpu_cores[i] >= this->cores || cpu_sockets[i] >= this->sockets;
+    }
+    if (contiguous && !cpu_cores.empty()) {
+        log_warn("Invalid CPU topology for host %s: assuming contiguous numbering", 
+                host_name.c_str());
+    }
+
+    core_cpus.resize(this->cores);
+    socket_cpus.resize(this->sockets);
+    socket_cores.resize(this->sockets);
+    unsigned threads_per_core = std::max(threads / this->cores, 1);
+    unsigned threads_per_socket = std::max(threads / this->sockets, 1);
+    vector<int> core_socket(this->cores, -1);
+    for (unsigned i = 0; i < threads; i++) {
+        unsigned core = contiguous ? std::min(i / threads_per_core, this->cores - 1u) : cpu_cores[i];
+        unsigned socket = contiguous ? std::min(i / threads_per_socket, this->sockets - 1u) : cpu_sockets[i];
+        core_cpus[core].set(i);
+        socket_cpus[socket].set(i);
+        if (core_socket[core] < 0) {
+            core_socket[core] = socket;
+            socket_cores[socket].push_back(core);
+        }
+        cpus_unbound.set(i);
     }
 }
 
 Host::~Host() {
-    delete[] cpus;
 }
 
 /* Check to see if the host has enough resources to run the task */
 bool Host::can_run(Task *task) {
-    return memory_free >= task->memory && cpus_free >= task->cpus;
+    return memory_free >= task->memory && cpus_free >= task->cpus && gpus_free >= task->gpus;
+}
+
+/*
+ * Find count unbound CPUs in one socket. Whole cores are used where
+ * possible, and any remaining CPUs are taken from the core with the
+ * fewest unbound CPUs that has enough of them (best fit), so that free
+ * cores are not split up.
+ */
+bool Host::find_cpus_in_socket(cpu_t socket, unsigned count, CPUSet &result) {
+    unsigned threads_per_core = std::max(threads / cores, 1);
+    unsigned whole_cores = count / threads_per_core;
+    unsigned rest = count % threads_per_core;
+
+    CPUSet chosen;
+    int best = -1;
+    unsigned best_unbound = 0;
+    const vector<cpu_t> &socket_core_list = socket_cores[socket];
+    for (unsigned i = 0; i < socket_core_list.size(); i++) {
+        cpu_t core = socket_core_list[i];
+        CPUSet unbound = cpus_unbound & core_cpus[core];
+        if (whole_cores > 0 && unbound == core_cpus[core]) {
+            chosen |= unbound;
+            whole_cores--;
+        } else if (rest > 0 && unbound.count() >= rest && 
+                (best < 0 || unbound.count() < best_unbound)) {
+            best = core;
+            best_unbound = unbound.count();
+        }
+    }
+    if (whole_cores > 0) {
+        return false;
+    }
+
+    if (rest > 0) {
+        if (best < 0) {
+            // Use a core that was not needed as a whole core
+            for (unsigned i = 0; i < socket_core_list.size() && best < 0; i++) {
+                cpu_t core = socket_core_list[i];
+                CPUSet unbound = cpus_unbound & core_cpus[core] & ~chosen;
+                if (unbound.count() >= rest) {
+                    best = core;
+                }
+            }
+            if (best < 0) {
+                return false;
+            }
+        }
+        CPUSet unbound = cpus_unbound & core_cpus[best] & ~chosen;
+        for (unsigned i = 0; i < threads && rest > 0; i++) {
+            if (unbound.test(i)) {
+                chosen.set(i);
+                rest--;
+            }
+        }
+    }
+
+    result |= chosen;
+    return true;
+}
+
+/*
+ * Find count unbound CPUs that use as few sockets and cores as possible.
+ * Tasks that need at least a socket get whole free sockets, and the rest
+ * of the CPUs come from the socket with the fewest unbound CPUs that can
+ * hold them (best fit). With the spread and least-loaded policies they
+ * come from the socket with the most unbound CPUs instead, and with
+ * first-fit from the first socket that can hold them.
+ */
+bool Host::find_cpus(unsigned count, CPUSet &result, PlacementPolicy policy) {
+    unsigned threads_per_socket = std::max(threads / sockets, 1);
+    unsigned whole_sockets = count / threads_per_socket;
+    unsigned rest = count % threads_per_socket;
+
+    vector<bool> used(sockets, false);
+    for (unsigned s = 0; s < sockets && whole_sockets > 0; s++) {
+        if ((cpus_unbound & socket_cpus[s]) == socket_cpus[s]) {
+            result |= socket_cpus[s];
+            used[s] = true;
+            whole_sockets--;
+        }
+    }
+    if (whole_sockets > 0) {
+        return false;
+    }
+
+    if (rest > 0) {
+        int best = -1;
+        unsigned best_unbound = 0;
+        CPUSet best_cpus;
+        for (unsigned s = 0; s < sockets; s++) {
+            unsigned unbound = (cpus_unbound & socket_cpus[s]).count();
+            if (used[s] || unbound < rest) {
+                continue;
+            }
+            if (best >= 0) {
+                bool spread = policy == PLACEMENT_SPREAD || policy == PLACEMENT_LEAST_LOADED;
+                if (policy == PLACEMENT_FIRST_FIT || (spread && unbound <= best_unbound) ||
+                        (!spread && unbound >= best_unbound)) {
+                    continue;
+                }
+            }
+            CPUSet cpus;
+            if (find_cpus_in_socket(s, rest, cpus)) {
+                best = s;
+                best_unbound = unbound;
+                best_cpus = cpus;
+            }
+        }
+        if (best < 0) {
+            return false;
+        }
+        result |= best_cpus;
+    }
+
+    return true;
 }
 
-/* Allocate resources to a task */
-vector<cpu_t> Host::allocate_resources(Task *task) {
+/* Allocate resources to a task, binding its CPUs according to policy */
+vector<cpu_t> Host::allocate_resources(Task *task, PlacementPolicy policy) {
     if (!can_run(task)) {
         myfailure("Host cannot run task %s", task->name.c_str());
     }
@@ -84,8 +274,21 @@ vector<cpu_t> Host::allocate_resources(Task *task) {
     // Use up the resources
     memory_free -= task->memory;
     cpus_free -= task->cpus;
+    gpus_free -= task->gpus;
     slots_free -= 1;
 
+    // Every GPU is given to at most one task at a time
+    if (task->gpus > 0) {
+        vector<cpu_t> &allocation = gpu_allocations[task];
+        for (cpu_t i = 0; i < gpus && allocation.size() < task->gpus; i++) {
+            if (gpus_unbound[i]) {
+                gpus_unbound[i] = false;
+                allocation.push_back(i);
+                log_trace("Assigned GPU %u to task %s", i, task->name.c_str());
+            }
+        }
+    }
+
     // This records all of the cpus that we will use for the task
     vector<cpu_t> bindings;
 
@@ -95,59 +298,24 @@ vector<cpu_t> Host::allocate_resources(Task *task) {
         return bindings;
     }
 
-    cpu_t threads_per_core = threads / cores;
-    cpu_t threads_per_socket = threads / sockets;
-    cpu_t threads_needed = task->cpus;
-    cpu_t cores_needed = task->cpus / threads_per_core;
-    cpu_t sockets_needed = task->cpus / threads_per_socket;
-    log_trace("Task %s requires %" PRIcpu_t " sockets, %" PRIcpu_t " cores, and %" PRIcpu_t " threads\n",
-              task->name.c_str(), sockets_needed, cores_needed, threads_needed);
-
-    // Determine what the aligned unit step size is
-    cpu_t alignment;
-    if (sockets_needed >= 1) {
-        alignment = threads_per_socket;
-    } else if (cores_needed >= 1) {
-        alignment = threads_per_core;
-    } else {
-        alignment = 1;
-    }
-
-    // This tries to find a contiguous set of cpus that are aligned on a
-    // thread, core, or socket boundary. For example, if we need one socket
-    // full of cpus, then it will try to find a solution that takes up one full
-    // socket, and not part of two or more sockets.
-    for (cpu_t i=0; i<threads; i+=alignment) {
-        for (cpu_t j=0; j<task->cpus && i+j<threads; j++) {
-            if (cpus[i+j] == NULL) {
-                bindings.push_back(i+j);
-            } else {
-                // One of the cpus is occupied, no solution possible
-                break;
-            }
-        }
-
-        if (bindings.size() == task->cpus) {
-            // We found a solution, stop looking
-            break;
-        } else {
-            // No solution, try the next aligned segment
-            bindings.clear();
-        }
-    }
-
-    // If we didn't get a contiguous solution above, then don't bind anything
-    if (bindings.size() != task->cpus) {
-        bindings.clear();
+    // If the unbound CPUs are too fragmented to bind the task to a
+    // minimal number of cores and sockets, then don't bind anything
+    CPUSet chosen;
+    if (!find_cpus(task->cpus, chosen, policy)) {
         log_warn("CPU fragmentation detected when scheduling task %s: not setting affinity", task->name.c_str());
+        return bindings;
     }
 
     // Mark all the cpus that were allocated to the task
-    for (vector<cpu_t>::iterator i=bindings.begin(); i!=bindings.end(); i++) {
-        cpu_t j = *i;
-        cpus[j] = task;
-        log_trace("Assigned CPU %" PRIcpu_t " to task %s", j, task->name.c_str());
+    cpus_unbound &= ~chosen;
+    for (unsigned i = 0; i < threads; i++) {
+        if (chosen.test(i)) {
+            bindings.push_back(i);
+            log_trace("Assigned CPU %u to task %s", i, task->name.c_str());
+        }
     }
+    vector<cpu_t> &allocation = allocations[task];
+    allocation.insert(allocation.end(), bindings.begin(), bindings.end());
 
     return bindings;
 }
@@ -155,15 +323,61 @@ vector<cpu_t> Host::allocate_resources(Task *task) {
 /* Deallocate all the resources we used for the task */
 void Host::release_resources(Task *task) {
     cpus_free += task->cpus;
+    gpus_free += task->gpus;
     memory_free += task->memory;
     slots_free += 1;
 
-    // Clear any cores occupied by this task
-    for (unsigned i=0; i<threads; i++) {
-        if (cpus[i] == task) {
-            cpus[i] = NULL;
+    map<Task *, vector<cpu_t> >::iterator g = gpu_allocations.find(task);
+    if (g != gpu_allocations.end()) {
+        for (unsigned i = 0; i < g->second.size(); i++) {
+            gpus_unbound[g->second[i]] = true;
+        }
+        gpu_allocations.erase(g);
+    }
+
+    // Unbind any cpus occupied by this task
+    map<Task *, vector<cpu_t> >::iterator a = allocations.find(task);
+    if (a != allocations.end()) {
+        for (unsigned i = 0; i < a->second.size(); i++) {
+            cpus_unbound.set(a->second[i]);
         }
+        allocations.erase(a);
+    }
+}
+
+/* Return the cpus that were allocated to task */
+vector<cpu_t> Host::bindings(Task *task) {
+    map<Task *, vector<cpu_t> >::iterator a = allocations.find(task);
+    if (a == allocations.end()) {
+        return vector<cpu_t>();
+    }
+    return a->second;
+}
+
+/* Return the gpus that were allocated to task */
+vector<cpu_t> Host::gpu_bindings(Task *task) {
+    map<Task *, vector<cpu_t> >::iterator g = gpu_allocations.find(task);
+    if (g == gpu_allocations.end()) {
+        return vector<cpu_t>();
     }
+    return g->second;
+}
+
+/* Hand the resources allocated to one task over to another task in the same class */
+void Host::transfer_resources(Task *from, Task *to) {
+    map<Task *, vector<cpu_t> >::iterator g = gpu_allocations.find(from);
+    if (g != gpu_allocations.end()) {
+        gpu_allocations[to] = g->second;
+        gpu_allocations.erase(g);
+    }
+
+    map<Task *, vector<cpu_t> >::iterator a = allocations.find(from);
+    if (a == allocations.end()) {
+        return;
+    }
+    vector<cpu_t> &allocation = allocations[to];
+    allocation.insert(allocation.end(), a->second.begin(), a->second.end());
+    allocations.erase(a);
 }
 
 void Host::add_slot() {
@@ -171,8 +385,33 @@ void Host::add_slot() {
     this->slots_free += 1;
 }
 
-/* Log the number of resources this host currently has */
-void Host::log_resources(FILE *resource_log) {
+void Host::remove_slot() {
+    this->slots -= 1;
+    this->slots_free -= 1;
+}
+
+void Host::add_idle_slot(Slot *slot) {
+    idle_slots.push_back(slot);
+}
+
+void Host::remove_idle_slot(Slot *slot) {
+    idle_slots.remove(slot);
+}
+
+Slot *Host::take_idle_slot() {
+    if (idle_slots.empty()) {
+        myfailure("Host %s has no idle slots", host_name.c_str());
+    }
+    Slot *slot = idle_slots.front();
+    idle_slots.pop_front();
+    return slot;
+}
+
+/*
+ * Log the number of resources this host currently has, and the placement
+ * policy that chose the host if the change was caused by placing a task
+ */
+void Host::log_resources(ResourceLog *resource_log, PlacementPolicy policy) {
     log_trace("Host %s now has %u MB, %u CPUs, and %u slots free", 
         this->host_name.c_str(), this->memory_free, this->cpus_free, this->slots_free);
 
@@ -180,677 +419,4505 @@ void Host::log_resources(FILE *resource_log) {
         return;
     }
 
-    struct timeval ts;
+    if (!log_registered) {
+        log_id = resource_log->add_host(host_name);
+        log_registered = true;
+    }
+    resource_log->log(log_id, slots_free, cpus_free, memory_free, policy);
+}
 
-    gettimeofday(&ts, NULL);
-    double timestamp = ts.tv_sec + (ts.tv_usec / 1.0e6);
+void Host::record_success() {
+    task_successes++;
+    failures_in_row = 0;
+}
 
-    fprintf(resource_log, "%lf,%u,%u,%u,%s\n", 
-            timestamp, slots_free, cpus_free, memory_free, host_name.c_str());
+/* Count a failed task and return the number of failures in a row */
+unsigned int Host::record_failure() {
+    task_failures++;
+    return ++failures_in_row;
 }
 
-JobstateLog::JobstateLog(const string &path) {
-    this->path = path;
-    this->logfile = NULL;
+/* The host gets a fresh start when it comes out of quarantine */
+void Host::end_quarantine() {
+    quarantine_until = 0.0;
+    failures_in_row = 0;
 }
 
-JobstateLog::~JobstateLog() {
-    close();
+void ResourceIndex::insert(Host *host) {
+    if (keys.find(host) != keys.end()) {
+        myfailure("Host %s is already indexed", host->name());
+    }
+
+    // Hosts without an idle slot cannot run anything, so they
+    // are left out of the index until a slot is released. Quarantined
+    // hosts are left out until the quarantine ends, and hosts whose
+    // host script has not finished until it has.
+    if (!host->has_idle_slot() || host->quarantined() || !host->ready()) {
+        return;
+    }
+
+    unsigned int cpus = host->free_cpus();
+    unsigned int memory = host->free_memory();
+    buckets[cpus].insert(std::make_pair(memory, host));
+    keys[host] = std::make_pair(cpus, memory);
 }
 
-void JobstateLog::open() {
-    if (this->logfile != NULL) {
+void ResourceIndex::remove(Host *host) {
+    map<Host *, pair<unsigned int, unsigned int> >::iterator k = keys.find(host);
+    if (k == keys.end()) {
         return;
     }
-    
-    this->logfile = fopen(path.c_str(), "a");
-    if (this->logfile == NULL) {
-        myfailures("Unable to open %s", path.c_str());
+
+    unsigned int cpus = k->second.first;
+    unsigned int memory = k->second.second;
+    keys.erase(k);
+
+    CPUBuckets::iterator b = buckets.find(cpus);
+    b->second.erase(std::make_pair(memory, host));
+    if (b->second.empty()) {
+        buckets.erase(b);
     }
 }
 
-void JobstateLog::close() {
-    if (logfile != NULL) {
-        fclose(logfile);
-        logfile = NULL;
+/*
+ * Find a host that can run the task according to policy. Pack finds the
+ * host with the fewest free resources that can still run the task, and
+ * spread the one with the most. First-fit and least-loaded have to look
+ * at every host in the index. Hosts are not indexed by GPUs, so tasks
+ * that need GPUs skip the hosts that don't have enough of them.
+ */
+Host *ResourceIndex::find(Task *task, PlacementPolicy policy) {
+    if (policy == PLACEMENT_SPREAD) {
+        for (CPUBuckets::reverse_iterator b = buckets.rbegin(); 
+                b != buckets.rend() && b->first >= task->cpus; b++) {
+            for (MemoryBucket::reverse_iterator h = b->second.rbegin();
+                    h != b->second.rend() && h->first >= task->memory; h++) {
+                if (h->second->free_gpus() >= task->gpus) {
+                    return h->second;
+                }
+            }
+        }
+        return NULL;
     }
-}
 
-void JobstateLog::on_event(WorkflowEvent event, Task *task) {
-    if (!logfile) {
-        open();
+    if (policy == PLACEMENT_FIRST_FIT || policy == PLACEMENT_LEAST_LOADED) {
+        Host *best = NULL;
+        for (map<Host *, pair<unsigned int, unsigned int> >::iterator k = keys.begin();
+                k != keys.end(); k++) {
+            Host *host = k->first;
+            if (k->second.first < task->cpus || k->second.second < task->memory ||
+                    host->free_gpus() < task->gpus) {
+                continue;
+            }
+            if (best == NULL) {
+                best = host;
+            } else if (policy == PLACEMENT_FIRST_FIT) {
+                if (host->index() < best->index()) {
+                    best = host;
+                }
+            } else {
+                // Compare the fractions of free CPUs without dividing
+                unsigned long free = (unsigned long)host->free_cpus() * best->total_cpus();
+                unsigned long best_free = (unsigned long)best->free_cpus() * host->total_cpus();
+                if (free > best_free || (free == best_free && 
+                            host->free_memory() > best->free_memory())) {
+                    best = host;
+                }
+            }
+        }
+        return best;
     }
-    
-    double now = current_time();
-    switch (event) {
-        case TASK_QUEUED:
-            fprintf(logfile, "%0.6lf %s SUBMIT %d.0 - - %u\n", now, 
-                    task->name.c_str(), task->submit_seq, task->submit_seq);
-            break;
-        case TASK_SUBMIT:
-            fprintf(logfile, "%0.6lf %s EXECUTE %d.0 - - %u\n", now, 
-                    task->name.c_str(), task->submit_seq, task->submit_seq);
-            break;
-        case TASK_SUCCESS:
-            fprintf(logfile, "%0.6lf %s JOB_TERMINATED %d.0 - - %u\n", now, 
-                    task->name.c_str(), task->submit_seq, task->submit_seq);
-            fprintf(logfile, "%0.6lf %s JOB_SUCCESS %d - - %u\n", now, 
-                    task->name.c_str(), task->last_exitcode, task->submit_seq);
-            break;
-        case TASK_FAILURE:
-            fprintf(logfile, "%0.6lf %s JOB_TERMINATED %d.0 - - %u\n", now, 
-                    task->name.c_str(), task->submit_seq, task->submit_seq);
-            fprintf(logfile, "%0.6lf %s JOB_FAILURE %d - - %u\n", now,
-                    task->name.c_str(), task->last_exitcode, task->submit_seq);
-            break;
-        case WORKFLOW_START:
-            fprintf(logfile, "%0.6lf INTERNAL *** PMC_STARTED ***\n", now);
-            break;
-        case WORKFLOW_SUCCESS:
-            fprintf(logfile, "%0.6lf INTERNAL *** PMC_FINISHED 0 ***\n", now);
-            break;
-        case WORKFLOW_FAILURE:
-            fprintf(logfile, "%0.6lf INTERNAL *** PMC_FINISHED 1 ***\n", now);
-            break;
+
+    for (CPUBuckets::iterator b = buckets.lower_bound(task->cpus); b != buckets.end(); b++) {
+        MemoryBucket::iterator h = b->second.lower_bound(
+                std::make_pair(task->memory, (Host *)NULL));
+        for (; h != b->second.end(); h++) {
+            if (h->second->free_gpus() >= task->gpus) {
+                return h->second;
+            }
+        }
     }
+    return NULL;
 }
 
-DAGManLog::DAGManLog(const string &logpath, const string &dagpath) {
-    this->logpath = logpath;
-    this->dagpath = filename(dagpath);
-    this->logfile = NULL;
+bool ResourceClass::operator<(const ResourceClass &other) const {
+    if (cpus != other.cpus) {
+        return cpus < other.cpus;
+    }
+    if (memory != other.memory) {
+        return memory < other.memory;
+    }
+    if (gpus != other.gpus) {
+        return gpus < other.gpus;
+    }
+    return hosts < other.hosts;
 }
 
-DAGManLog::~DAGManLog() {
-    close();
+/* Remove the head of class rc, whose tasks are in queue, from the heads */
+void ReadyQueue::unlink(const ResourceClass &rc, TaskQueue &queue) {
+    if (queue.empty()) {
+        return;
+    }
+    map<ResourceClass, ClassAge>::iterator a = ages.find(rc);
+    if (a != ages.end() && a->second.age == AGE_STARVING) {
+        StarvingHead head(a->second.since, rc);
+        if (starving_heads.erase(head) == 0) {
+            blocked_starving.erase(head);
+        }
+        return;
+    }
+    int age = a == ages.end() ? 0 : a->second.age;
+    ClassHead head(queue.top()->priority + age, rc);
+    if (heads.erase(head) == 0) {
+        blocked_heads.erase(head);
+    }
 }
 
-void DAGManLog::open() {
-    if (this->logfile != NULL) {
+/* Add the head of class rc, whose tasks are in queue, to the heads */
+void ReadyQueue::link(const ResourceClass &rc, TaskQueue &queue) {
+    if (queue.empty()) {
         return;
     }
-    
-    this->logfile = fopen(logpath.c_str(), "w");
-    if (this->logfile == NULL) {
-        myfailures("Unable to open %s", logpath.c_str());
+    bool unblocked = blocked.find(rc) == blocked.end();
+    map<ResourceClass, ClassAge>::iterator a = ages.find(rc);
+    if (a != ages.end() && a->second.age == AGE_STARVING) {
+        StarvingHead head(a->second.since, rc);
+        if (unblocked) {
+            starving_heads.insert(head);
+        } else {
+            blocked_starving.insert(head);
+        }
+        return;
+    }
+    int age = a == ages.end() ? 0 : a->second.age;
+    ClassHead head(queue.top()->priority + age, rc);
+    if (unblocked) {
+        heads.insert(head);
+    } else {
+        blocked_heads.insert(head);
     }
 }
 
-void DAGManLog::close() {
-    if (logfile != NULL) {
-        fclose(logfile);
-        logfile = NULL;
+void ReadyQueue::push(Task *task) {
+    ResourceClass rc(task);
+    if (aging() && ages.find(rc) == ages.end()) {
+        ClassAge &age = ages[rc];
+        age.since = now;
+        schedule(rc, age);
     }
+    TaskQueue &queue = classes[rc];
+    unlink(rc, queue);
+    queue.push(task);
+    link(rc, queue);
+    count++;
 }
 
-void DAGManLog::on_event(WorkflowEvent event, Task *task) {
-    if (!logfile) {
-        open();
+void ReadyQueue::set_aging(double interval, double starvation) {
+    this->aging_interval = interval;
+    this->starvation_time = starvation;
+}
+
+/*
+ * Queue the next time that the age of class rc changes: after another
+ * aging interval, or when it starts to starve, whichever comes first
+ */
+void ReadyQueue::schedule(const ResourceClass &rc, ClassAge &age) {
+    age.next = -1.0;
+    if (age.age == AGE_STARVING) {
+        return;
     }
-    
-    /* Format the timestamp for the log file entry */
-    time_t ts;
-    ::time(&ts);
-    struct tm now;
-    ::localtime_r(&ts, &now);
-    char date[18];
-    sprintf(date, /*mm/dd/yy hh:mm:ss*/ "%02d/%02d/%02d %02d:%02d:%02d", 
-            now.tm_mon+1, now.tm_mday, now.tm_year-100, 
-            now.tm_hour, now.tm_min, now.tm_sec);
-    
-    switch (event) {
-        case TASK_QUEUED:
-            fprintf(logfile, "%s Submitting Condor Node %s job(s)...\n", 
-                    date, task->name.c_str());
-            fprintf(logfile, "%s Event: ULOG_SUBMIT for Condor Node %s (%d.0)\n",
-                    date, task->name.c_str(), task->submit_seq);
-            break;
-        case TASK_SUBMIT:
-            fprintf(logfile, "%s Event: ULOG_EXECUTE for Condor Node %s (%d.0)\n",
-                    date, task->name.c_str(), task->submit_seq);
-            break;
-        case TASK_SUCCESS:
-            fprintf(logfile, "%s Event: ULOG_JOB_TERMINATED for Condor Node %s (%d.0)\n",
-                    date, task->name.c_str(), task->submit_seq);
-            fprintf(logfile, "%s Node %s job proc (%d.0) completed successfully.\n",
-                    date, task->name.c_str(), task->submit_seq);
-            break;
-        case TASK_FAILURE:
-            fprintf(logfile, "%s Event: ULOG_JOB_TERMINATED for Condor Node %s (%d.0)\n",
-                    date, task->name.c_str(), task->submit_seq);
-            fprintf(logfile, "%s Node %s job proc (%d.0) failed with status %d.\n",
-                    date, task->name.c_str(), task->submit_seq, task->last_exitcode);
-            break;
-        case WORKFLOW_START:
-            fprintf(logfile, "%s This is a fake DAGMan log file generated by PMC "
-                    "for the purpose of tricking monitord\n", date);
-            fprintf(logfile, "%s ** condor_scheduniv_exec.0.0 (CONDOR_DAGMAN) "
-                    "STARTING UP\n", date);
-            fprintf(logfile, "%s ** PID = %d\n", date, getpid());
-            fprintf(logfile, "%s Parsing %s ...\n", date, dagpath.c_str()); 
-            break;
-        case WORKFLOW_SUCCESS:
-            fprintf(logfile, "%s **** condor_scheduniv_exec.0.0 (condor_DAGMAN) "
-                    "pid %d EXITING WITH STATUS 0\n", date, getpid());
-            break;
-        case WORKFLOW_FAILURE:
-            fprintf(logfile, "%s **** condor_scheduniv_exec.0.0 (condor_DAGMAN) "
-                    "pid %d EXITING WITH STATUS 1\n", date, getpid());
-            break;
+    if (aging_interval > 0) {
+        age.next = age.since + (age.age + 1) * aging_interval;
+    }
+    if (starvation_time > 0 && (age.next < 0 || age.since + starvation_time < age.next)) {
+        age.next = age.since + starvation_time;
+    }
+    if (age.next >= 0) {
+        deadlines.insert(std::make_pair(age.next, rc));
     }
 }
 
-Master::Master(Communicator *comm, const string &program, Engine &engine,
-        DAG &dag, const string &dagfile, const string &outfile,
-        const string &errfile, bool has_host_script, double max_wall_time,
-        const string &resourcefile, bool per_task_stdio, int maxfds) {
-    this->comm = comm;
-    this->program = program;
-    this->dagfile = dagfile;
-    this->outfile = outfile;
-    this->errfile = errfile;
-    this->engine = &engine;
-    this->dag = &dag;
-    this->has_host_script = has_host_script;
-    this->max_wall_time = max_wall_time;
+/*
+ * Move the classes whose age changed since the last call. Priorities go
+ * up by one for every aging interval that a class waits, and starving
+ * classes go before all the others, the one that has waited the longest
+ * first.
+ */
+void ReadyQueue::refresh() {
+    while (!deadlines.empty() && deadlines.begin()->first <= now) {
+        ResourceClass rc = deadlines.begin()->second;
+        deadlines.erase(deadlines.begin());
 
-    this->submitted_count = 0;
-    this->success_count = 0;
-    this->failed_count = 0;
+        map<ResourceClass, TaskQueue>::iterator c = classes.find(rc);
+        if (c != classes.end()) {
+            unlink(c->first, c->second);
+        }
+        ClassAge &age = ages[rc];
+        double wait = now - age.since;
+        if (starvation_time > 0 && (wait >= starvation_time || 
+                    age.next == age.since + starvation_time)) {
+            age.age = AGE_STARVING;
+        } else {
+            age.age = std::max(age.age + 1, (int)floor(wait / aging_interval));
+        }
+        schedule(rc, age);
+        if (c != classes.end()) {
+            link(c->first, c->second);
+        }
+    }
+}
 
-    this->start_time = 0.0;
-    this->finish_time = 0.0;
-    this->wall_time = 0.0;
-
-    this->total_cpus = 0;
-    this->total_runtime = 0.0;
+/* Return the highest priority task from all of the unblocked classes */
+Task *ReadyQueue::top() {
+    refresh();
+    if (!starving_heads.empty()) {
+        current = starving_heads.begin()->second;
+        return classes[current].top();
+    }
+    if (heads.empty()) {
+        return NULL;
+    }
+    current = heads.begin()->second;
+    return classes[current].top();
+}
 
-    // Determine the number of workers we have
-    int numprocs = comm->size();
-    this->numworkers = numprocs - 1;
-    if (numworkers == 0) {
-        myfailure("Need at least 1 worker");
+/* Return the highest priority task, including those in blocked classes */
+Task *ReadyQueue::first() {
+    refresh();
+    if (!starving_heads.empty() || !blocked_starving.empty()) {
+        const StarvingHead *starving = NULL;
+        if (!starving_heads.empty()) {
+            starving = &*starving_heads.begin();
+        }
+        if (!blocked_starving.empty() && (starving == NULL || 
+                    *blocked_starving.begin() < *starving)) {
+            starving = &*blocked_starving.begin();
+        }
+        return classes[starving->second].top();
     }
+    const ClassHead *head = NULL;
+    if (!heads.empty()) {
+        head = &*heads.begin();
+    }
+    if (!blocked_heads.empty() && (head == NULL || 
+                ClassHeadOrder()(*blocked_heads.begin(), *head))) {
+        head = &*blocked_heads.begin();
+    }
+    if (head == NULL) {
+        return NULL;
+    }
+    return classes[head->second].top();
+}
 
-    if (resourcefile == "") {
-        this->resource_log = NULL;
-    } else {
-        this->resource_log = fopen(resourcefile.c_str(), "a");
+/* Remove the task returned by the last call to top() */
+void ReadyQueue::pop() {
+    map<ResourceClass, TaskQueue>::iterator c = classes.find(current);
+    if (c == classes.end()) {
+        myfailure("No ready task to pop");
+    }
+    unlink(c->first, c->second);
+    c->second.pop();
+    link(c->first, c->second);
+    count--;
+    if (c->second.empty()) {
+        classes.erase(c);
     }
+}
 
-    this->per_task_stdio = per_task_stdio;
+/*
+ * Remove and return the next task in the same class as the task returned
+ * by the last call to top(), or NULL if there are no more tasks in it
+ */
+Task *ReadyQueue::pop_current() {
+    return pop_class(current);
+}
 
-    // Task submit sequence starts at 1
-    this->task_submit_seq = 1;
+/* Remove and return the highest priority task in rc, or NULL if there are none */
+Task *ReadyQueue::pop_class(const ResourceClass &rc) {
+    map<ResourceClass, TaskQueue>::iterator c = classes.find(rc);
+    if (c == classes.end()) {
+        return NULL;
+    }
+    Task *task = c->second.top();
+    unlink(c->first, c->second);
+    c->second.pop();
+    link(c->first, c->second);
+    count--;
+    if (c->second.empty()) {
+        classes.erase(c);
+    }
+    return task;
+}
 
-    this->fdcache = new FDCache(maxfds);
+/* Block the class of the task returned by the last call to top() */
+void ReadyQueue::block() {
+    map<ResourceClass, TaskQueue>::iterator c = classes.find(current);
+    if (c == classes.end()) {
+        blocked.insert(current);
+        return;
+    }
+    unlink(c->first, c->second);
+    blocked.insert(current);
+    link(c->first, c->second);
 }
 
-Master::~Master() {
-    vector<Slot *>::iterator s;
-    for (s = slots.begin(); s != slots.end(); s++) {
-        delete *s;
+/* Unblock all the classes that could run on host */
+void ReadyQueue::unblock(Host *host) {
+    set<ResourceClass>::iterator b = blocked.begin();
+    while (b != blocked.end()) {
+        if (b->cpus <= host->free_cpus() && b->memory <= host->free_memory() &&
+                b->gpus <= host->free_gpus()) {
+            map<ResourceClass, TaskQueue>::iterator c = classes.find(*b);
+            if (c != classes.end()) {
+                unlink(c->first, c->second);
+            }
+            blocked.erase(b++);
+            if (c != classes.end()) {
+                link(c->first, c->second);
+            }
+        } else {
+            b++;
+        }
     }
+}
 
-    vector<Host *>::iterator h;
-    for (h = hosts.begin(); h != hosts.end(); h++) {
-        delete *h;
+/*
+ * Restart the aging of the class of task, which was just started, or
+ * stop it if the class has no more tasks
+ */
+void ReadyQueue::started(Task *task) {
+    if (ages.empty()) {
+        return;
     }
+    ResourceClass rc(task);
+    map<ResourceClass, TaskQueue>::iterator c = classes.find(rc);
+    map<ResourceClass, ClassAge>::iterator a = ages.find(rc);
+    if (c != classes.end()) {
+        unlink(c->first, c->second);
+    }
+    if (a != ages.end()) {
+        deadlines.erase(std::make_pair(a->second.next, rc));
+        ages.erase(a);
+    }
+    if (c != classes.end()) {
+        ClassAge &age = ages[rc];
+        age.since = now;
+        schedule(rc, age);
+        link(c->first, c->second);
+    }
+}
 
-    if (resource_log != NULL && fileno(resource_log) > 2) {
-        log_trace("Closing resource log");
-        fclose(resource_log);
+/* Has the class of task been waiting for longer than the starvation time? */
+bool ReadyQueue::starving(Task *task) {
+    return starvation_time > 0 && waiting_time(task) >= starvation_time;
+}
+
+/* How long the class of task has been waiting to start a task */
+double ReadyQueue::waiting_time(Task *task) {
+    if (ages.empty()) {
+        return 0.0;
     }
+    map<ResourceClass, ClassAge>::iterator a = ages.find(ResourceClass(task));
+    if (a == ages.end()) {
+        return 0.0;
+    }
+    return now - a->second.since;
+}
 
-    if (fdcache != NULL) {
-        fdcache->close();
-        delete fdcache;
-        fdcache = NULL;
+unsigned ReadyQueue::blocked_size() {
+    unsigned n = 0;
+    set<ResourceClass>::iterator b;
+    for (b = blocked.begin(); b != blocked.end(); b++) {
+        map<ResourceClass, TaskQueue>::iterator c = classes.find(*b);
+        if (c != classes.end()) {
+            n += c->second.size();
+        }
     }
+    return n;
 }
 
-void Master::add_listener(WorkflowEventListener *l) {
+WorkflowEventRecord::WorkflowEventRecord(WorkflowEvent event, Task *task) {
+    this->event = event;
+    this->timestamp = current_time();
+    this->rank = 0;
+    this->runtime = 0.0;
+    if (task == NULL) {
+        this->submit_seq = 0;
+        this->exitcode = 0;
+    } else {
+        this->task = task->name;
+        this->submit_seq = task->submit_seq;
+        this->exitcode = task->last_exitcode;
+    }
+}
+
+EventPublisher::EventPublisher() {
+    this->interval = 0;
+    this->running = false;
+    this->stopping = false;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wakeup, NULL);
+}
+
+EventPublisher::~EventPublisher() {
+    stop();
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&lock);
+}
+
+void EventPublisher::add_listener(WorkflowEventListener *l) {
     listeners.push_back(l);
 }
 
-void Master::publish_event(WorkflowEvent event, Task *task) {
-    list<WorkflowEventListener *>::iterator i;
-    for (i=listeners.begin(); i!=listeners.end(); i++) {
-        (*i)->on_event(event, task);
+void EventPublisher::start(unsigned interval) {
+    if (running) {
+        myfailure("Event thread already started");
+    }
+
+    this->interval = interval;
+    this->stopping = false;
+    this->running = true;
+    if (pthread_create(&thread, NULL, thread_main, this) != 0) {
+        myfailure("Unable to start event thread");
     }
 }
 
-void Master::submit_task(Task *task, int rank, const vector<cpu_t> &bindings) {
-    log_debug("Submitting task %s to slot %d", task->name.c_str(), rank);
+void EventPublisher::publish(const WorkflowEventRecord &record) {
+    if (!running) {
+        list<WorkflowEventListener *>::iterator i;
+        for (i=listeners.begin(); i!=listeners.end(); i++) {
+            (*i)->on_event(record);
+        }
+        return;
+    }
 
-    CommandMessage cmd(task->name, task->args, task->pegasus_id, 
-            task->memory, task->cpus, bindings, task->pipe_forwards, task->file_forwards);
-    comm->send_message(&cmd, rank);
+    pthread_mutex_lock(&lock);
+    queued.push_back(record);
+    pthread_mutex_unlock(&lock);
+}
 
-    publish_event(TASK_SUBMIT, task);
+/* Deliver all the queued events and wait for the thread to exit */
+void EventPublisher::stop() {
+    if (!running) {
+        return;
+    }
 
-    this->submitted_count++;
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+    if (pthread_join(thread, NULL) != 0) {
+        myfailure("Unable to join event thread");
+    }
+    running = false;
 }
 
-void Master::wait_for_results() {
-    // This will process all the waiting messages. If there are none 
-    // waiting, then it will block until one arrives. If there are 
-    // several waiting, then it will process them all and return without 
-    // waiting.
-    unsigned int tasks = 0;
-    unsigned int messages = 0;
-    do {
-        
-        /* If the user specifies a maximum wall time for the workflow, then 
-         * the master sets a timeout by calling alarm(), which causes the 
-         * kernel to send a SIGALRM when the timer expires. Also, on most 
-         * PBS systems when the max wall time is reached PBS sends the 
-         * process a SIGTERM. When PMC catches these signals it sets the 
-         * ABORT flag. In many MPI implementations, however, signals do 
-         * not interrupt blocking message calls such as MPI_Recv. So we 
-         * cannot be waiting in MPI_Recv when the signal is caught or we 
-         * cannot respond to it. So we give a timeout to recv_message so 
-         * that it does not block forever.
-         */
-        double timeout = 0;
-        if (max_wall_time > 0) {
-            double now = current_time();
-            double deadline = start_time + (max_wall_time * 60.0);
-            timeout = deadline - now;
-        }
-        log_trace("Waiting for result");
-        Message *mesg = comm->recv_message(timeout);
-        if (mesg == NULL || ABORT) {
-            ABORT = true;
-            return;
+void *EventPublisher::thread_main(void *arg) {
+    static_cast<EventPublisher *>(arg)->run_thread();
+    return NULL;
+}
+
+void EventPublisher::run_thread() {
+    pthread_mutex_lock(&lock);
+    while (true) {
+        if (!stopping) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            unsigned long usec = now.tv_usec + (interval % 1000) * 1000;
+            struct timespec deadline;
+            deadline.tv_sec = now.tv_sec + interval / 1000 + usec / 1000000;
+            deadline.tv_nsec = (usec % 1000000) * 1000;
+            pthread_cond_timedwait(&wakeup, &lock, &deadline);
         }
-        messages++;
-        if (ResultMessage *res = dynamic_cast<ResultMessage *>(mesg)) {
-            process_result(res);
-            tasks++;
-        } else if (IODataMessage *iod = dynamic_cast<IODataMessage *>(mesg)) {
-            process_iodata(iod);
-        } else {
-            myfailure("Expected result or I/O data message");
+
+        vector<WorkflowEventRecord> records;
+        records.swap(queued);
+        bool last = stopping;
+        pthread_mutex_unlock(&lock);
+
+        deliver(records);
+
+        pthread_mutex_lock(&lock);
+        if (last && queued.empty()) {
+            break;
         }
-        delete mesg;
-        
-        // We need to do this while tasks == 0 because the caller
-        // of this method assumes that it will process at least one
-        // task before returning
-    } while (comm->message_waiting() || tasks == 0);
-    
-    log_trace("Processed %u task(s) and %u message(s) this cycle", 
-            tasks, messages);
+    }
+    pthread_mutex_unlock(&lock);
 }
 
-void Master::process_iodata(IODataMessage *mesg) {
-    /* Perform some sanity checks on the message. This
-     * was added because of an issue with mangled messages
-     * on TACC Stampede.
-     */
-    if (mesg->size > mesg->msgsize) {
-        log_invalid_message(mesg);
-        myfailure("Invalid I/O message: invalid size");
+void EventPublisher::deliver(const vector<WorkflowEventRecord> &records) {
+    if (records.empty()) {
+        return;
     }
-    if (mesg->filename.size() == 0) {
-        log_invalid_message(mesg);
-        myfailure("Invalid I/O message: bad filename");
+    list<WorkflowEventListener *>::iterator i;
+    for (i=listeners.begin(); i!=listeners.end(); i++) {
+        for (unsigned r=0; r<records.size(); r++) {
+            (*i)->on_event(records[r]);
+        }
+        (*i)->flush();
     }
-    if (mesg->task.size() == 0) {
-        log_invalid_message(mesg);
-        myfailure("Invalid I/O message: bad task name");
+}
+
+JobstateLog::JobstateLog(const string &path) {
+    this->path = path;
+    this->logfile = NULL;
+}
+
+JobstateLog::~JobstateLog() {
+    close();
+}
+
+void JobstateLog::open() {
+    if (this->logfile != NULL) {
+        return;
     }
     
-    log_trace("Got %u bytes for file %s", mesg->size, mesg->filename.c_str());
-    
-    if (fdcache->write(mesg->filename, mesg->data, mesg->size) < 0) {
-        log_error("Error writing %d bytes to %s for task %s", mesg->size,
-                mesg->filename.c_str(), mesg->task.c_str());
-        
-        Task *task = this->dag->get_task(mesg->task);
-        if (task == NULL) {
-            // If the task is not found then there is a problem, but
-            // we can probably just ignore it at this point.
-            myfailure("Unable to find task %s for I/O failure", 
-                      mesg->task.c_str());
-        }
-        
-        task->io_failed = true;
+    this->logfile = fopen(path.c_str(), "a");
+    if (this->logfile == NULL) {
+        myfailures("Unable to open %s", path.c_str());
     }
 }
 
-void Master::process_result(ResultMessage *mesg) {
-    string name = mesg->name;
-    int exitcode = mesg->exitcode;
-    int rank = mesg->source;
-    double task_runtime = mesg->runtime;
-    
-    total_runtime += task_runtime;
-    
-    Task *task = this->dag->get_task(name);
+void JobstateLog::close() {
+    if (logfile != NULL) {
+        fclose(logfile);
+        logfile = NULL;
+    }
+}
 
-    if (task->io_failed) {
-        // If there was an error processing I/O data for this task, 
-        // then record it as a failure
-        
-        log_error("Task %s failed due to collective I/O errors", name.c_str());
-        this->failed_count++;
-        
-        // Set the exitcode to something non-zero to force the failure
-        exitcode = 256;
-        
-        // Reset the flag so that, if the task is retried, it won't
-        // automatically fail again
-        task->io_failed = false;
-    } else if (exitcode == 0) {
-        log_debug("Task %s finished with exitcode %d", name.c_str(), exitcode);
-        this->success_count++;
-    } else {
-        log_error("Task %s failed with exitcode %d", name.c_str(), exitcode);
-        this->failed_count++;
+void JobstateLog::on_event(const WorkflowEventRecord &record) {
+    if (!logfile) {
+        open();
     }
     
-    task->last_exitcode = exitcode;
-    
-    this->engine->mark_task_finished(task, exitcode);
-    
-    if (exitcode == 0) {
-        publish_event(TASK_SUCCESS, task);
-    } else {
-        publish_event(TASK_FAILURE, task);
+    double now = record.timestamp;
+    const char *name = record.task.c_str();
+    switch (record.event) {
+        case TASK_QUEUED:
+            fprintf(logfile, "%0.6lf %s SUBMIT %d.0 - - %u\n", now, 
+                    name, record.submit_seq, record.submit_seq);
+            break;
+        case TASK_SUBMIT:
+            fprintf(logfile, "%0.6lf %s EXECUTE %d.0 - - %u\n", now, 
+                    name, record.submit_seq, record.submit_seq);
+            break;
+        case TASK_SUCCESS:
+            fprintf(logfile, "%0.6lf %s JOB_TERMINATED %d.0 - - %u\n", now, 
+                    name, record.submit_seq, record.submit_seq);
+            fprintf(logfile, "%0.6lf %s JOB_SUCCESS %d - - %u\n", now, 
+                    name, record.exitcode, record.submit_seq);
+            break;
+        case TASK_FAILURE:
+            fprintf(logfile, "%0.6lf %s JOB_TERMINATED %d.0 - - %u\n", now, 
+                    name, record.submit_seq, record.submit_seq);
+            fprintf(logfile, "%0.6lf %s JOB_FAILURE %d - - %u\n", now,
+                    name, record.exitcode, record.submit_seq);
+            break;
+        case WORKFLOW_START:
+            fprintf(logfile, "%0.6lf INTERNAL *** PMC_STARTED ***\n", now);
+            break;
+        case WORKFLOW_SUCCESS:
+            fprintf(logfile, "%0.6lf INTERNAL *** PMC_FINISHED 0 ***\n", now);
+            break;
+        case WORKFLOW_FAILURE:
+            fprintf(logfile, "%0.6lf INTERNAL *** PMC_FINISHED 1 ***\n", now);
+            break;
+    }
+}
+
+void JobstateLog::flush() {
+    if (logfile != NULL) {
+        fflush(logfile);
+    }
+}
+
+DAGManLog::DAGManLog(const string &logpath, const string &dagpath) {
+    this->logpath = logpath;
+    this->dagpath = filename(dagpath);
+    this->logfile = NULL;
+}
+
+DAGManLog::~DAGManLog() {
+    close();
+}
+
+void DAGManLog::open() {
+    if (this->logfile != NULL) {
+        return;
     }
     
-    // Mark slot idle
-    log_trace("Worker %d is idle", rank);
-    Slot *slot = slots[rank-1];
-    
-    // Return resources to host
-    slot->host->release_resources(task);
-    slot->host->log_resources(resource_log);
+    this->logfile = fopen(logpath.c_str(), "w");
+    if (this->logfile == NULL) {
+        myfailures("Unable to open %s", logpath.c_str());
+    }
+}
+
+void DAGManLog::close() {
+    if (logfile != NULL) {
+        fclose(logfile);
+        logfile = NULL;
+    }
+}
+
+void DAGManLog::on_event(const WorkflowEventRecord &record) {
+    if (!logfile) {
+        open();
+    }
+    
+    /* Format the timestamp for the log file entry */
+    time_t ts = (time_t)record.timestamp;
+    const char *name = record.task.c_str();
+    struct tm now;
+    ::localtime_r(&ts, &now);
+    char date[18];
+    sprintf(date, /*mm/dd/yy hh:mm:ss*/ "%02d/%02d/%02d %02d:%02d:%02d", 
+            now.tm_mon+1, now.tm_mday, now.tm_year-100, 
+            now.tm_hour, now.tm_min, now.tm_sec);
+    
+    switch (record.event) {
+        case TASK_QUEUED:
+            fprintf(logfile, "%s Submitting Condor Node %s job(s)...\n", 
+                    date, name);
+            fprintf(logfile, "%s Event: ULOG_SUBMIT for Condor Node %s (%d.0)\n",
+                    date, name, record.submit_seq);
+            break;
+        case TASK_SUBMIT:
+            fprintf(logfile, "%s Event: ULOG_EXECUTE for Condor Node %s (%d.0)\n",
+                    date, name, record.submit_seq);
+            break;
+        case TASK_SUCCESS:
+            fprintf(logfile, "%s Event: ULOG_JOB_TERMINATED for Condor Node %s (%d.0)\n",
+                    date, name, record.submit_seq);
+            fprintf(logfile, "%s Node %s job proc (%d.0) completed successfully.\n",
+                    date, name, record.submit_seq);
+            break;
+        case TASK_FAILURE:
+            fprintf(logfile, "%s Event: ULOG_JOB_TERMINATED for Condor Node %s (%d.0)\n",
+                    date, name, record.submit_seq);
+            fprintf(logfile, "%s Node %s job proc (%d.0) failed with status %d.\n",
+                    date, name, record.submit_seq, record.exitcode);
+            break;
+        case WORKFLOW_START:
+            fprintf(logfile, "%s This is a fake DAGMan log file generated by PMC "
+                    "for the purpose of tricking monitord\n", date);
+            fprintf(logfile, "%s ** condor_scheduniv_exec.0.0 (CONDOR_DAGMAN) "
+                    "STARTING UP\n", date);
+            fprintf(logfile, "%s ** PID = %d\n", date, getpid());
+            fprintf(logfile, "%s Parsing %s ...\n", date, dagpath.c_str()); 
+            break;
+        case WORKFLOW_SUCCESS:
+            fprintf(logfile, "%s **** condor_scheduniv_exec.0.0 (condor_DAGMAN) "
+                    "pid %d EXITING WITH STATUS 0\n", date, getpid());
+            break;
+        case WORKFLOW_FAILURE:
+            fprintf(logfile, "%s **** condor_scheduniv_exec.0.0 (condor_DAGMAN) "
+                    "pid %d EXITING WITH STATUS 1\n", date, getpid());
+            break;
+    }
+}
+
+void DAGManLog::flush() {
+    if (logfile != NULL) {
+        fflush(logfile);
+    }
+}
+
+// Marks the start of each run in an event stream
+#define EVENT_STREAM_MAGIC "PMCEVNT1"
+#define EVENT_STREAM_MAGIC_SIZE 8
+
+// Records bigger than this are not valid
+#define EVENT_STREAM_MAX_RECORD (1024*1024)
+
+// With --event-interval 0, the events are written when this much is buffered
+#define EVENT_STREAM_BUFFER (64*1024)
+
+/* The fixed fields at the start of each record in an event stream */
+struct EventStreamRecord {
+    double timestamp;
+    uint32_t event;
+    uint32_t submit_seq;
+    int32_t exitcode;
+    int32_t rank;
+    double runtime;
+    double utime;
+    double stime;
+    uint64_t maxrss;
+    uint32_t name_size;
+    uint32_t host_size;
+};
+
+static const char *event_names[] = {
+    "WORKFLOW_START",
+    "WORKFLOW_SUCCESS",
+    "WORKFLOW_FAILURE",
+    "TASK_QUEUED",
+    "TASK_SUBMIT",
+    "TASK_SUCCESS",
+    "TASK_FAILURE"
+};
+
+EventStream::EventStream(const string &path) {
+    this->path = path;
+    this->fd = -1;
+    this->socket = false;
+}
+
+EventStream::~EventStream() {
+    flush();
+    close();
+}
+
+void EventStream::open() {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        struct sockaddr_un addr;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            myfailure("Event stream socket path is too long: %s", path.c_str());
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path.c_str());
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            myfailures("Unable to connect to event stream %s", path.c_str());
+        }
+        socket = true;
+    } else {
+        fd = ::open(path.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0644);
+        if (fd < 0) {
+            myfailures("Unable to open %s", path.c_str());
+        }
+    }
+    buffer.append(EVENT_STREAM_MAGIC, EVENT_STREAM_MAGIC_SIZE);
+}
+
+void EventStream::close() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void EventStream::on_event(const WorkflowEventRecord &record) {
+    if (fd < 0) {
+        open();
+    }
+
+    EventStreamRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.timestamp = record.timestamp;
+    rec.event = record.event;
+    rec.submit_seq = record.submit_seq;
+    rec.exitcode = record.exitcode;
+    rec.rank = record.rank;
+    rec.runtime = record.runtime;
+    rec.utime = record.usage.utime;
+    rec.stime = record.usage.stime;
+    rec.maxrss = record.usage.maxrss;
+    rec.name_size = record.task.size();
+    rec.host_size = record.host.size();
+
+    uint32_t size = sizeof(rec) + rec.name_size + rec.host_size;
+    buffer.append((char *)&size, sizeof(size));
+    buffer.append((char *)&rec, sizeof(rec));
+    buffer.append(record.task);
+    buffer.append(record.host);
+
+    if (buffer.size() >= EVENT_STREAM_BUFFER) {
+        flush();
+    }
+}
+
+/*
+ * Write the buffered events. If the reader of the socket goes away, or
+ * the file can't be written, then the rest of the events are dropped
+ * instead of failing the workflow.
+ */
+void EventStream::flush() {
+    size_t done = 0;
+    while (fd >= 0 && done < buffer.size()) {
+        ssize_t n;
+        if (socket) {
+            n = send(fd, buffer.data() + done, buffer.size() - done, MSG_NOSIGNAL);
+        } else {
+            n = write(fd, buffer.data() + done, buffer.size() - done);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Unable to write event stream %s: %s", path.c_str(),
+                    strerror(errno));
+            close();
+            break;
+        }
+        done += n;
+    }
+    buffer.clear();
+}
+
+/*
+ * Write the events in the stream at path, or stdin if path is "-", to out
+ * as lines of: timestamp event task submit_seq exitcode rank host runtime
+ * utime stime maxrss. Missing tasks and hosts are written as "-". Returns
+ * -1 if the stream can't be read or is corrupt.
+ */
+int EventStream::convert(const string &path, FILE *out) {
+    FILE *in = path == "-" ? stdin : fopen(path.c_str(), "rb");
+    if (in == NULL) {
+        return -1;
+    }
+
+    int rc = 0;
+    uint32_t size;
+    vector<char> buf;
+    while (fread(&size, sizeof(size), 1, in) == 1) {
+        if (memcmp(&size, EVENT_STREAM_MAGIC, sizeof(size)) == 0) {
+            char rest[EVENT_STREAM_MAGIC_SIZE - sizeof(size)];
+            if (fread(rest, sizeof(rest), 1, in) != 1 ||
+                    memcmp(rest, EVENT_STREAM_MAGIC + sizeof(size), sizeof(rest)) != 0) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+
+        if (size < sizeof(EventStreamRecord) || size > EVENT_STREAM_MAX_RECORD) {
+            rc = -1;
+            break;
+        }
+        buf.resize(size);
+        if (fread(&buf[0], size, 1, in) != 1) {
+            rc = -1;
+            break;
+        }
+
+        EventStreamRecord rec;
+        memcpy(&rec, &buf[0], sizeof(rec));
+        if (rec.event > TASK_FAILURE ||
+                (uint64_t)sizeof(rec) + rec.name_size + rec.host_size > size) {
+            rc = -1;
+            break;
+        }
+        const char *strings = &buf[0] + sizeof(rec);
+        string name(strings, rec.name_size);
+        string host(strings + rec.name_size, rec.host_size);
+
+        fprintf(out, "%0.6lf %s %s %u %d %d %s %0.6lf %0.6lf %0.6lf %llu\n",
+                rec.timestamp, event_names[rec.event],
+                name.empty() ? "-" : name.c_str(), rec.submit_seq, rec.exitcode,
+                rec.rank, host.empty() ? "-" : host.c_str(), rec.runtime,
+                rec.utime, rec.stime, (unsigned long long)rec.maxrss);
+    }
+
+    if (ferror(in)) {
+        rc = -1;
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    return rc;
+}
+
+Master::Master(Communicator *comm, const string &program, Engine &engine,
+        DAG &dag, const string &dagfile, const string &outfile,
+        const string &errfile, bool has_host_script, double max_wall_time,
+        const string &resourcefile, bool per_task_stdio, int maxfds) {
+    this->comm = comm;
+    this->receiver = NULL;
+    this->program = program;
+    this->dagfile = dagfile;
+    this->outfile = outfile;
+    this->errfile = errfile;
+    this->engine = &engine;
+    this->dag = &dag;
+    this->dag_stream = NULL;
+    this->workflows.push_back(new Workflow("", &dag, &engine, outfile, errfile));
+    this->has_host_script = has_host_script;
+    this->host_ready_deadline = 0.0;
+    this->hosts_changed = false;
+    this->max_wall_time = max_wall_time;
+    this->drain_deadline = 0.0;
+    this->wall_draining = false;
+
+    this->submitted_count = 0;
+    this->success_count = 0;
+    this->failed_count = 0;
+
+    this->start_time = 0.0;
+    this->finish_time = 0.0;
+    this->wall_time = 0.0;
+
+    this->total_cpus = 0;
+    this->total_runtime = 0.0;
+    this->total_launch = 0.0;
+    this->launch_count = 0;
+
+    this->free_slots = 0;
+
+    this->reserved_host = NULL;
+    this->reserved_until = 0.0;
+
+    this->broadcast_tasks = 0;
+    this->io_credits_due = false;
+
+    this->cancelled_slots = 0;
+    this->median = 0.0;
+    this->median_count = 0;
+    this->speculate_time = 0.0;
+    this->locality_time = 0.0;
+    this->locality_tasks = 0;
+    this->locality_hits = 0;
+    this->released_count = 0;
+    this->release_time = 0.0;
+    this->bundled_tasks = 0;
+    this->bundle_count = 0;
+    this->drain_task = NULL;
+    this->gang_count = 0;
+    this->drain_count = 0;
+    this->starving_task = NULL;
+    this->starving_since = 0.0;
+    this->starvation_count = 0;
+    this->starvation_wait = 0.0;
+    this->deferred_cycles = 0;
+    ready_queue.set_aging(config.aging_interval, config.starvation_time);
+    this->quarantine_count = 0;
+    this->quarantine_time = 0.0;
+    this->estimated_tasks = 0;
+    this->estimate_oom_retries = 0;
+    this->total_cpu_time = 0.0;
+    this->overcommit_count = 0;
+    this->oom_retries = 0;
+
+    this->result_cache = NULL;
+    if (!config.result_cache.empty()) {
+        vector<string> env;
+        if (!config.cache_env.empty()) {
+            split(env, config.cache_env, ",");
+        }
+        this->result_cache = new ResultCache(config.result_cache, env);
+    }
+
+    this->throttled_count = 0;
+    this->iodata_bytes = 0;
+    this->iodata_stall = 0.0;
+    this->status_time = 0.0;
+    this->direct_bytes = 0;
+    this->direct_count = 0;
+
+    for (int i = 0; i < IDLE_REASONS; i++) {
+        this->idle_clock[i] = 0.0;
+    }
+    this->idle_clock_time = 0.0;
+    this->idle_reason = IDLE_NO_WORK;
+
+    this->tracer = NULL;
+    if (!config.trace_file.empty()) {
+        this->tracer = new Tracer(config.trace_file);
+    }
+
+    // Determine the number of workers we have
+    int numprocs = comm->size();
+    this->numworkers = numprocs - 1;
+    if (numworkers == 0) {
+        myfailure("Need at least 1 worker");
+    }
+
+    if (resourcefile == "") {
+        this->resource_log = NULL;
+    } else {
+        this->resource_log = new ResourceLog(resourcefile,
+                config.resource_log_binary, config.resource_log_interval);
+    }
+
+    this->per_task_stdio = per_task_stdio;
+
+    // Task submit sequence starts at 1
+    this->task_submit_seq = 1;
+
+    this->fdcache = new FDCache(maxfds);
+    if (config.write_behind > 0) {
+        this->fdcache->start_writer(config.write_behind, config.writer_threads);
+    }
+    if (config.master_memory > 0) {
+        this->fdcache->credit_records();
+    }
+}
+
+Master::~Master() {
+    delete receiver;
+
+    vector<Slot *>::iterator s;
+    for (s = slots.begin(); s != slots.end(); s++) {
+        delete *s;
+    }
+
+    vector<Host *>::iterator h;
+    for (h = hosts.begin(); h != hosts.end(); h++) {
+        delete *h;
+    }
+
+    // Chunks from tasks that were running when the workflow was aborted
+    map<string, vector<IORecord *> >::iterator p;
+    for (p = provisional_io.begin(); p != provisional_io.end(); p++) {
+        for (unsigned i = 0; i < p->second.size(); i++) {
+            delete p->second[i];
+        }
+    }
+    map<pair<int, string>, vector<IORecord *> >::iterator c;
+    for (c = held_io.begin(); c != held_io.end(); c++) {
+        for (unsigned i = 0; i < c->second.size(); i++) {
+            delete c->second[i];
+        }
+    }
+
+    delete resource_log;
+
+    if (fdcache != NULL) {
+        fdcache->close();
+        delete fdcache;
+        fdcache = NULL;
+    }
+
+    delete tracer;
+    delete result_cache;
+
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        delete workflows[i];
+    }
+}
+
+void Master::add_listener(WorkflowEventListener *l) {
+    events.add_listener(l);
+}
+
+void Master::set_dag_stream(DAGStream *stream) {
+    this->dag_stream = stream;
+    this->engine->set_streaming(stream != NULL);
+}
+
+/*
+ * Run another DAG in the same allocation. The names of the tasks of
+ * every DAG must have been prefixed with DAG::set_workflow, so that the
+ * workers and the master can tell them apart.
+ */
+void Master::add_workflow(DAG &dag, Engine &engine, const string &outfile,
+        const string &errfile) {
+    string name = workflows[0]->dag->prefix();
+    workflows[0]->name = name.substr(0, name.size() - 1);
+    name = dag.prefix();
+    workflows.push_back(new Workflow(name.substr(0, name.size() - 1), &dag,
+                &engine, outfile, errfile));
+}
+
+void Master::set_weight(unsigned workflow, double weight) {
+    workflows[workflow]->weight = weight;
+}
+
+Task *Master::find_task(const string &name) {
+    if (workflows.size() == 1) {
+        return dag->get_task(name);
+    }
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        const string &prefix = workflows[i]->dag->prefix();
+        if (name.compare(0, prefix.size(), prefix) == 0) {
+            Task *task = workflows[i]->dag->get_task(name);
+            if (task != NULL) {
+                return task;
+            }
+        }
+    }
+    return NULL;
+}
+
+bool Master::workflows_finished() {
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        if (!workflows[i]->engine->is_finished()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The earliest time when one of the rescue logs has to be committed */
+double Master::rescue_flush_time() {
+    double flush_time = 0.0;
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        double t = workflows[i]->engine->rescue_flush_time();
+        if (t > 0 && (flush_time <= 0 || t < flush_time)) {
+            flush_time = t;
+        }
+    }
+    return flush_time;
+}
+
+void Master::flush_rescue() {
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        workflows[i]->engine->flush_rescue();
+    }
+}
+
+void Master::publish_event(WorkflowEvent event, Task *task, int rank, double runtime) {
+    if (events.empty()) {
+        return;
+    }
+    WorkflowEventRecord record(event, task);
+    if (rank > 0) {
+        record.rank = rank;
+        record.host = slots[(rank-1) * config.worker_slots]->host->name();
+    }
+    record.runtime = runtime;
+    if (event == TASK_SUCCESS || event == TASK_FAILURE) {
+        map<Task *, TaskUsage>::iterator u = task_usage.find(task);
+        if (u != task_usage.end()) {
+            record.usage = u->second;
+            task_usage.erase(u);
+        }
+    }
+    events.publish(record);
+}
+
+/*
+ * Send tasks to the worker with the given rank. If there is more than one
+ * task, then the tasks are sent in one batch that the worker runs in order.
+ * A copy of a task that is already running is not submitted again as far
+ * as the logs are concerned.
+ */
+void Master::submit_tasks(const TaskList &tasks, int rank, const vector<cpu_t> &bindings,
+        const vector<cpu_t> &gpu_bindings, bool copy) {
+    vector<Message *> commands;
+    vector<int> ranks;
+    vector<string> stage_paths;
+    vector<int> stage_ranks;
+    for (TaskList::const_iterator t = tasks.begin(); t != tasks.end(); t++) {
+        Task *task = *t;
+
+        log_debug("Submitting task %s to slot %d", task->name.c_str(), rank);
+
+        stage_inputs(task, rank, stage_paths, stage_ranks);
+
+        // An estimate of the memory is only used to place the task, so it
+        // does not become the limit of the task's cgroup
+        unsigned memory = task->memory;
+        if (estimated_memory.find(task) != estimated_memory.end()) {
+            memory = 0;
+        }
+
+        map<Task *, vector<Slot *> >::iterator g = gang_slots.find(task);
+        if (g != gang_slots.end()) {
+            // The hosts of the task are not in the task table
+            vector<string> hosts;
+            for (unsigned i = 0; i < g->second.size(); i++) {
+                hosts.push_back(g->second[i]->host->name());
+            }
+            commands.push_back(new CommandMessage(task->name, task->args, task->pegasus_id, 
+                    memory, task->cpus, bindings, task->pipe_forwards, task->file_forwards,
+                    task->max_runtime, task->gpus, gpu_bindings, hosts, task->threads));
+        } else if (task->index < broadcast_tasks) {
+            // The worker already has everything else in its task table
+            commands.push_back(new TaskMessage(task->index, bindings, gpu_bindings));
+        } else {
+            commands.push_back(new CommandMessage(task->name, task->args, task->pegasus_id, 
+                    memory, task->cpus, bindings, task->pipe_forwards, task->file_forwards,
+                    task->max_runtime, task->gpus, gpu_bindings, vector<string>(),
+                    task->threads));
+        }
+        ranks.push_back(rank);
+
+        if (copy) {
+            continue;
+        }
+
+        if (tracer != NULL) {
+            map<Task *, double>::iterator q = queued_times.find(task);
+            if (q != queued_times.end()) {
+                tracer->async_span(task->name, "queue", task->submit_seq, q->second,
+                        current_time());
+                queued_times.erase(q);
+            }
+        }
+
+        ready_queue.started(task);
+        if (task == starving_task) {
+            starvation_wait += comm->clock() - starving_since;
+            starving_task = NULL;
+        }
+
+        publish_event(TASK_SUBMIT, task, rank);
+
+        this->submitted_count++;
+    }
+
+    Message *mesg = commands.front();
+    if (commands.size() > 1) {
+        mesg = new BatchMessage(commands, ranks);
+        for (unsigned i = 0; i < commands.size(); i++) {
+            delete commands[i];
+        }
+    }
+
+    // The worker copies the files before it gets the commands
+    if (!stage_paths.empty()) {
+        send_to_worker(new StageMessage(stage_paths, stage_ranks), rank);
+    }
+    send_to_worker(mesg, rank);
+}
+
+void Master::send_to_worker(Message *mesg, int rank) {
+    int submaster = worker_hosts[rank-1]->submaster();
+    if (submaster > 0) {
+        // Messages for hosts with a sub-master are sent in one batch
+        // at the end of the scheduling cycle
+        batch_messages[submaster].push_back(mesg);
+        batch_ranks[submaster].push_back(rank);
+    } else {
+        // Don't wait for busy workers to receive their messages
+        comm->send_message_async(mesg, rank);
+    }
+}
+
+void Master::flush_batches() {
+    map<int, vector<Message *> >::iterator b;
+    for (b = batch_messages.begin(); b != batch_messages.end(); b++) {
+        int submaster = b->first;
+        vector<Message *> &messages = b->second;
+        if (messages.empty()) {
+            continue;
+        }
+
+        log_trace("Sending batch of %u messages to sub-master %d", 
+                messages.size(), submaster);
+
+        comm->send_message_async(new BatchMessage(messages, batch_ranks[submaster]), submaster);
+
+        for (unsigned i = 0; i < messages.size(); i++) {
+            delete messages[i];
+        }
+        messages.clear();
+        batch_ranks[submaster].clear();
+    }
+}
+
+void Master::wait_for_results() {
+    // This will process all the waiting messages. If there are none 
+    // waiting, then it will block until one arrives. If there are 
+    // several waiting, then it will process them all and return without 
+    // waiting.
+    unsigned int tasks = 0;
+    unsigned int messages = 0;
+    hosts_changed = false;
+    do {
+        
+        /* If the user specifies a maximum wall time for the workflow, then 
+         * the master sets a timeout by calling alarm(), which causes the 
+         * kernel to send a SIGALRM when the timer expires. Also, on most 
+         * PBS systems when the max wall time is reached PBS sends the 
+         * process a SIGTERM. When PMC catches these signals it sets the 
+         * ABORT flag. In many MPI implementations, however, signals do 
+         * not interrupt blocking message calls such as MPI_Recv. So we 
+         * cannot be waiting in MPI_Recv when the signal is caught or we 
+         * cannot respond to it. So we give a timeout to recv_message so 
+         * that it does not block forever.
+         */
+        double timeout = 0;
+        if (max_wall_time > 0) {
+            double now = current_time();
+            double deadline = start_time + (max_wall_time * 60.0);
+            timeout = deadline - now;
+        }
+
+        // Wake up in time to commit buffered rescue records
+        bool rescue_timeout = false;
+        double flush_time = rescue_flush_time();
+        if (flush_time > 0) {
+            double wait = flush_time - current_time();
+            if (wait <= 0) {
+                flush_rescue();
+            } else if (timeout <= 0 || wait < timeout) {
+                timeout = wait;
+                rescue_timeout = true;
+            }
+        }
+
+        // Wake up to read new tasks from the DAG stream
+        bool stream_timeout = false;
+        if (dag_stream != NULL && !dag_stream->ended() && 
+                (timeout <= 0 || DAG_STREAM_POLL_INTERVAL < timeout)) {
+            timeout = DAG_STREAM_POLL_INTERVAL;
+            stream_timeout = true;
+            rescue_timeout = false;
+        }
+
+        // Wake up when a running task becomes a straggler, when a task
+        // has waited long enough for the host that has its inputs, or
+        // when the status file is due
+        bool speculate_timeout = false;
+        double wakeup = speculate_time;
+        if (locality_time > 0 && (wakeup <= 0 || locality_time < wakeup)) {
+            wakeup = locality_time;
+        }
+        if (release_time > 0 && (wakeup <= 0 || release_time < wakeup)) {
+            wakeup = release_time;
+        }
+        if (status_time > 0 && (wakeup <= 0 || status_time < wakeup)) {
+            wakeup = status_time;
+        }
+        if (drain_deadline > 0 && !wall_draining && (wakeup <= 0 || drain_deadline < wakeup)) {
+            wakeup = drain_deadline;
+        }
+        if (quarantine_time > 0 && (wakeup <= 0 || quarantine_time < wakeup)) {
+            wakeup = quarantine_time;
+        }
+        if (host_ready_deadline > 0 && (wakeup <= 0 || host_ready_deadline < wakeup)) {
+            wakeup = host_ready_deadline;
+        }
+        if (wakeup > 0) {
+            double wait = std::max(wakeup - current_time(), 0.001);
+            if (timeout <= 0 || wait < timeout) {
+                timeout = wait;
+                speculate_timeout = true;
+                stream_timeout = false;
+                rescue_timeout = false;
+            }
+        }
+
+        log_trace("Waiting for result");
+        tick_idle_clock();
+        Message *mesg = comm->recv_message(timeout);
+        if (mesg == NULL && rescue_timeout && !ABORT) {
+            flush_rescue();
+            continue;
+        }
+        if (mesg == NULL && (stream_timeout || speculate_timeout) && !ABORT) {
+            return;
+        }
+        if (mesg == NULL || ABORT) {
+            ABORT = true;
+            return;
+        }
+        messages++;
+        tasks += process_message(mesg);
+        delete mesg;
+        
+        // We need to do this while tasks == 0 because the caller
+        // of this method assumes that it will process at least one
+        // task before returning. The exceptions are when workers are
+        // waiting for credit to send more chunks of I/O data, and when a
+        // host can take tasks because its host script has finished.
+    } while (comm->message_waiting() || (tasks == 0 && !io_credits_due && !hosts_changed));
+    
+    log_trace("Processed %u task(s) and %u message(s) this cycle", 
+            tasks, messages);
+}
+
+/*
+ * Process a result, I/O data, or a batch of them from a worker or a
+ * sub-master. Returns the number of results processed.
+ */
+unsigned Master::process_message(Message *mesg) {
+    messages_received[mesg->tag()]++;
+    switch (mesg->tag()) {
+        case RESULT:
+            process_result(static_cast<ResultMessage *>(mesg));
+            return 1;
+        case IODATA:
+            process_iodata(static_cast<IODataMessage *>(mesg));
+            return 0;
+        case READY:
+            host_ready(static_cast<ReadyMessage *>(mesg));
+            return 0;
+        case RESERVE:
+            reserve_regions(static_cast<ReserveMessage *>(mesg));
+            return 0;
+        case COMMIT:
+            commit_regions(static_cast<CommitMessage *>(mesg));
+            return 0;
+        case BATCH: {
+            // The source of each message in the batch is the worker that
+            // sent it. Batches relayed by a sub-master may contain batches
+            // from the workers.
+            BatchMessage *batch = static_cast<BatchMessage *>(mesg);
+            unsigned tasks = 0;
+            for (unsigned i = 0; i < batch->messages.size(); i++) {
+                tasks += process_message(batch->messages[i]);
+            }
+            return tasks;
+        }
+        default:
+            myfailure("Expected result or I/O data message");
+    }
+    return 0;
+}
+
+void Master::process_iodata(IODataMessage *mesg) {
+    /* Perform some sanity checks on the message. This
+     * was added because of an issue with mangled messages
+     * on TACC Stampede.
+     */
+    if (mesg->size > mesg->msgsize) {
+        log_invalid_message(mesg);
+        myfailure("Invalid I/O message: invalid size");
+    }
+    if (mesg->filename[0] == '\0') {
+        log_invalid_message(mesg);
+        myfailure("Invalid I/O message: bad filename");
+    }
+    if (mesg->task[0] == '\0') {
+        log_invalid_message(mesg);
+        myfailure("Invalid I/O message: bad task name");
+    }
+    
+    log_trace("Got %u bytes for file %s", mesg->size, mesg->filename);
+    iodata_bytes += mesg->size;
+
+    if (result_cache != NULL) {
+        capture_iodata(mesg);
+    }
+    
+    if (config.speculate > 0 && hold_iodata(mesg)) {
+        return;
+    }
+    
+    if (mesg->provisional) {
+        process_provisional_iodata(mesg);
+        return;
+    }
+    
+    string filename = iodata_filename(mesg->filename, mesg->task);
+
+    if (config.direct_forwards) {
+        if (direct_files.find(filename) != direct_files.end()) {
+            if (relay_region(mesg, filename)) {
+                return;
+            }
+            myfailure("File %s is written both by workers and by the master",
+                    filename.c_str());
+        }
+        forwarded_files.insert(filename);
+    }
+    
+    // The data is buffered so that all the records for a file in
+    // this cycle can be written at once
+    fdcache->enqueue(filename, mesg->task, mesg->data, mesg->size,
+            mesg->source, mesg->seq, mesg->last, mesg->aborted);
+
+    // The worker is waiting for credit to send more chunks
+    if (mesg->chunked() || config.master_memory > 0) {
+        io_credits_due = true;
+    }
+}
+
+/* Task stdout/stderr go to the task stdout/stderr of their workflow */
+string Master::iodata_filename(const string &filename, const string &task) {
+    if (filename == IODATA_STDOUT || filename == IODATA_STDERR) {
+        Workflow *w = workflows[0];
+        if (workflows.size() > 1) {
+            w = workflow_of(find_task(task));
+        }
+        return filename == IODATA_STDOUT ? w->task_stdout : w->task_stderr;
+    }
+    return filename;
+}
+
+/*
+ * The I/O data of a task that has more than one copy running is held
+ * until one of the copies wins, and the data from a copy that was
+ * cancelled is dropped. The worker gets credit for held chunks right
+ * away, like provisional chunks. Returns true if the data was held or
+ * dropped.
+ */
+bool Master::hold_iodata(IODataMessage *mesg) {
+    Task *task = find_task(mesg->task);
+    bool copied = copies.find(task) != copies.end();
+    bool cancelled = cancelled_slots > 0 && find_slot(mesg->source, task)->cancelled;
+    if (!copied && !cancelled) {
+        if (mesg->chunked()) {
+            streamed.insert(task->name);
+        }
+        return false;
+    }
+
+    if (mesg->chunked() || mesg->provisional) {
+        provisional_credits[mesg->source]++;
+        io_credits_due = true;
+    }
+
+    if (cancelled) {
+        log_trace("Dropping I/O data from cancelled task %s on worker %d", 
+                task->name.c_str(), mesg->source);
+        return true;
+    }
+
+    held_io[std::make_pair(mesg->source, task->name)].push_back(new IORecord(
+                iodata_filename(mesg->filename, mesg->task), mesg->task, mesg->data, mesg->size, 
+                -1, mesg->seq, mesg->last, mesg->aborted));
+    return true;
+}
+
+/* Throw away the I/O data held for the copy of task on a worker */
+void Master::drop_held_iodata(int rank, Task *task) {
+    map<pair<int, string>, vector<IORecord *> >::iterator h;
+    h = held_io.find(std::make_pair(rank, task->name));
+    if (h == held_io.end()) {
+        return;
+    }
+    for (unsigned i = 0; i < h->second.size(); i++) {
+        delete h->second[i];
+    }
+    held_io.erase(h);
+}
+
+/*
+ * Provisional chunks are sent while a task is running. They are kept
+ * until the last chunk arrives, and then written in one piece, or thrown
+ * away if the last chunk is aborted. The worker gets its credit back
+ * right away, because the chunks are not going to be written until the
+ * task finishes.
+ */
+void Master::process_provisional_iodata(IODataMessage *mesg) {
+    provisional_credits[mesg->source]++;
+    io_credits_due = true;
+    
+    vector<IORecord *> &records = provisional_io[mesg->task];
+    records.push_back(new IORecord(mesg->filename, mesg->task, mesg->data, 
+                mesg->size, -1, mesg->seq, mesg->last));
+    if (!mesg->last) {
+        return;
+    }
+    
+    // Commit the chunks for this file, and keep the ones for other files
+    vector<IORecord *> others;
+    for (vector<IORecord *>::iterator r = records.begin(); r != records.end(); r++) {
+        IORecord *record = *r;
+        if (record->filename != mesg->filename) {
+            others.push_back(record);
+            continue;
+        }
+        if (mesg->aborted) {
+            delete record;
+            continue;
+        }
+        fdcache->enqueue(record->filename, record->task, record->data.data(), 
+                record->data.size(), -1, record->seq, record->last);
+        delete record;
+    }
+    if (others.empty()) {
+        provisional_io.erase(mesg->task);
+    } else {
+        records.swap(others);
+    }
+}
+
+/* Throw away provisional chunks that were never committed */
+void Master::discard_provisional_iodata(Task *task) {
+    map<string, vector<IORecord *> >::iterator p = provisional_io.find(task->name);
+    if (p == provisional_io.end()) {
+        return;
+    }
+    
+    log_debug("Discarding %u provisional I/O chunks from task %s", 
+            (unsigned)p->second.size(), task->name.c_str());
+    for (vector<IORecord *>::iterator r = p->second.begin(); r != p->second.end(); r++) {
+        delete *r;
+    }
+    provisional_io.erase(p);
+}
+
+void Master::process_result(ResultMessage *mesg) {
+    Task *task = find_task(mesg->name);
+
+    total_launch += mesg->launch;
+    launch_count++;
+    iodata_stall += mesg->stall;
+
+    if (tracer != NULL) {
+        trace_result(mesg, task);
+    }
+
+    if (mesg->timeout) {
+        log_error("Task %s was killed on worker %d after exceeding its maximum runtime",
+                task->name.c_str(), mesg->source);
+    }
+
+    record_usage(task, mesg);
+
+    if (mesg->usage.oom_kills > 0 && (overcommitted.find(task) != overcommitted.end() ||
+                estimated_memory.find(task) != estimated_memory.end())) {
+        oom_killed.insert(task);
+    }
+
+    if (config.speculate > 0 && !resolve_copies(task, mesg)) {
+        return;
+    }
+    
+    // If the task failed, then the data it sent while running is not used
+    discard_provisional_iodata(task);
+
+    if (!events.empty()) {
+        task_usage[task] = mesg->usage;
+    }
+
+    if (config.monitor) {
+        write_invocation(task, mesg);
+    }
+
+    // The worker sends the I/O data for a task before its result. If that
+    // data is still buffered, then the result cannot be committed until
+    // the data is written, so the result waits for the barrier at the
+    // end of this cycle.
+    if (fdcache->pending(task->name) || direct_pending(task)) {
+        PendingResult result;
+        result.task = task;
+        result.exitcode = mesg->exitcode;
+        result.rank = mesg->source;
+        result.runtime = mesg->runtime;
+        pending_results.push_back(result);
+        return;
+    }
+
+    finish_task(task, mesg->exitcode, mesg->source, mesg->runtime);
+}
+
+/*
+ * Decide what to do with a result from a task that was cancelled or that
+ * has more than one copy running. The first copy that succeeds wins: its
+ * held I/O data is written, and the other copies are cancelled. A failed
+ * copy is ignored while another copy is still running. Returns true if
+ * the result should be processed as the result of the task, and false if
+ * it only releases the slot of the copy that sent it.
+ */
+bool Master::resolve_copies(Task *task, ResultMessage *mesg) {
+    int rank = mesg->source;
+    Slot *slot = find_slot(rank, task);
+
+    if (slot->cancelled) {
+        log_debug("Cancelled task %s exited on worker %d", task->name.c_str(), rank);
+        slot->cancelled = false;
+        cancelled_slots--;
+        total_runtime += mesg->runtime;
+        release_slot(slot, task);
+        return false;
+    }
+
+    map<Task *, unsigned>::iterator c = copies.find(task);
+    if (c == copies.end()) {
+        return true;
+    }
+
+    if (mesg->exitcode != 0 && c->second > 1) {
+        log_info("Copy of task %s failed on worker %d, waiting for another copy", 
+                task->name.c_str(), rank);
+        c->second--;
+        drop_held_iodata(rank, task);
+        total_runtime += mesg->runtime;
+        release_slot(slot, task);
+        return false;
+    }
+    copies.erase(c);
+
+    for (vector<Slot *>::iterator s = slots.begin(); s != slots.end(); s++) {
+        Slot *other = *s;
+        if (other == slot || other->task != task || other->cancelled) {
+            continue;
+        }
+        log_info("Task %s finished on worker %d, cancelling it on worker %d",
+                task->name.c_str(), rank, other->rank);
+        drop_held_iodata(other->rank, task);
+        other->cancelled = true;
+        cancelled_slots++;
+        send_to_worker(new CancelMessage(task->name), other->rank);
+    }
+    flush_batches();
+
+    map<pair<int, string>, vector<IORecord *> >::iterator h;
+    h = held_io.find(std::make_pair(rank, task->name));
+    if (h != held_io.end()) {
+        for (unsigned i = 0; i < h->second.size(); i++) {
+            IORecord *record = h->second[i];
+            fdcache->enqueue(record->filename, record->task, record->data.data(), 
+                    record->data.size(), -1, record->seq, record->last, record->aborted);
+            delete record;
+        }
+        held_io.erase(h);
+    }
+
+    return true;
+}
+
+/*
+ * Write the collective I/O data received in this cycle, and then commit
+ * the results that were waiting for it. In write-behind mode the data
+ * is only flushed here if a result is waiting for it.
+ */
+void Master::commit_pending_results() {
+    if (!pending_results.empty() || !fdcache->write_behind() || io_credits_due) {
+        log_trace("Flushing I/O data for %lu result(s)", 
+                (unsigned long)pending_results.size());
+        fdcache->flush();
+    }
+    if (!relayed_regions.empty()) {
+        commit_relayed_regions();
+    }
+    
+    // Data for some tasks may still be held up by another task that
+    // is streaming to the same file
+    vector<PendingResult> waiting;
+    for (vector<PendingResult>::iterator r = pending_results.begin(); 
+            r != pending_results.end(); r++) {
+        if (fdcache->pending(r->task->name) || direct_pending(r->task)) {
+            waiting.push_back(*r);
+        } else {
+            finish_task(r->task, r->exitcode, r->rank, r->runtime);
+        }
+    }
+    pending_results.swap(waiting);
+}
+
+/*
+ * Reserve regions at the end of the files that a task forwards with
+ * --direct-forwards, so that its worker can write them while other
+ * workers write the regions before and after them.
+ */
+void Master::reserve_regions(ReserveMessage *mesg) {
+    vector<unsigned long long> offsets;
+    vector<pair<string, unsigned long long> > &regions = direct_regions[mesg->task];
+    regions.clear();
+    for (unsigned i = 0; i < mesg->filenames.size(); i++) {
+        const string &filename = mesg->filenames[i];
+        if (forwarded_files.find(filename) != forwarded_files.end()) {
+            myfailure("File %s is written both by workers and by the master",
+                    filename.c_str());
+        }
+
+        map<string, DirectFile>::iterator f = direct_files.find(filename);
+        if (f == direct_files.end()) {
+            // The regions are appended to whatever is in the file already
+            DirectFile file;
+            struct stat st;
+            if (stat(filename.c_str(), &st) == 0) {
+                file.end = file.committed = st.st_size;
+            }
+            f = direct_files.insert(std::make_pair(filename, file)).first;
+        }
+
+        DirectFile &file = f->second;
+        unsigned long long size = mesg->sizes[i];
+        file.regions.insert(std::make_pair(file.end, DirectRegion(size)));
+        offsets.push_back(file.end);
+        regions.push_back(std::make_pair(filename, file.end));
+        log_trace("Reserved %llu bytes of %s at offset %llu for task %s",
+                size, filename.c_str(), file.end, mesg->task.c_str());
+        file.end += size;
+        direct_bytes += size;
+    }
+    direct_count++;
+
+    send_to_worker(new RegionMessage(offsets), mesg->source);
+    flush_batches();
+}
+
+/*
+ * Data for a region of a --direct-forwards file that the worker could not
+ * write itself. It is written into the region by the FDCache, like other
+ * forwarded data, and the region is committed when it has been written.
+ * Returns false if the task has no region in the file.
+ */
+bool Master::relay_region(IODataMessage *mesg, const string &filename) {
+    map<string, vector<pair<string, unsigned long long> > >::iterator r =
+        direct_regions.find(mesg->task);
+    if (r == direct_regions.end()) {
+        return false;
+    }
+    vector<pair<string, unsigned long long> > &regions = r->second;
+    for (unsigned i = 0; i < regions.size(); i++) {
+        if (regions[i].first != filename) {
+            continue;
+        }
+        unsigned long long offset = regions[i].second;
+        DirectRegion &region = direct_files[filename].regions.find(offset)->second;
+        if (mesg->aborted || region.relayed + mesg->size > region.size) {
+            myfailure("Task %s was unable to write its region of %s at offset %llu",
+                    mesg->task, filename.c_str(), offset);
+        }
+        fdcache->enqueue(filename, mesg->task, mesg->data, mesg->size, mesg->source,
+                mesg->seq, mesg->last, false, offset + region.relayed);
+        region.relayed += mesg->size;
+        if (mesg->chunked() || config.master_memory > 0) {
+            io_credits_due = true;
+        }
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Mark a region as complete, and move the committed offset of the file
+ * past the regions that have been written in order.
+ */
+void Master::commit_region(const string &filename, unsigned long long offset) {
+    DirectFile &file = direct_files[filename];
+    file.regions.find(offset)->second.committed = true;
+    while (!file.regions.empty() && file.regions.begin()->second.committed) {
+        file.committed = file.regions.begin()->first + file.regions.begin()->second.size;
+        file.regions.erase(file.regions.begin());
+    }
+}
+
+/*
+ * Commit the regions written by a task. Regions that were sent to the
+ * master are committed once the FDCache has written them. A region that
+ * was not written at all would leave a hole in the file that later tasks
+ * write past, so the workflow is aborted.
+ */
+void Master::commit_regions(CommitMessage *mesg) {
+    map<string, vector<pair<string, unsigned long long> > >::iterator r =
+        direct_regions.find(mesg->task);
+    if (r == direct_regions.end()) {
+        myfailure("Task %s has no regions to commit", mesg->task.c_str());
+    }
+
+    vector<pair<string, unsigned long long> > &regions = r->second;
+    for (unsigned i = 0; i < regions.size(); i++) {
+        DirectRegion &region = direct_files[regions[i].first].regions.find(
+                regions[i].second)->second;
+        if (!mesg->ok || (region.relayed > 0 && region.relayed != region.size)) {
+            myfailure("Task %s was unable to write its region of %s at offset %llu",
+                    mesg->task.c_str(), regions[i].first.c_str(), regions[i].second);
+        }
+        if (region.relayed > 0) {
+            relayed_regions.insert(mesg->task);
+        } else {
+            commit_region(regions[i].first, regions[i].second);
+        }
+    }
+}
+
+/* Commit the regions sent to the master that the FDCache has written */
+void Master::commit_relayed_regions() {
+    set<string>::iterator t = relayed_regions.begin();
+    while (t != relayed_regions.end()) {
+        if (fdcache->pending(*t)) {
+            t++;
+            continue;
+        }
+        vector<pair<string, unsigned long long> > &regions = direct_regions[*t];
+        for (unsigned i = 0; i < regions.size(); i++) {
+            DirectFile &file = direct_files[regions[i].first];
+            map<unsigned long long, DirectRegion>::iterator region =
+                file.regions.find(regions[i].second);
+            if (region != file.regions.end() && !region->second.committed) {
+                commit_region(regions[i].first, regions[i].second);
+            }
+        }
+        relayed_regions.erase(t++);
+    }
+}
+
+/*
+ * The result of a task can't be committed to the rescue log until the
+ * regions it wrote, and all the regions before them, have been written.
+ */
+bool Master::direct_pending(Task *task) {
+    if (direct_regions.empty()) {
+        return false;
+    }
+    map<string, vector<pair<string, unsigned long long> > >::iterator r =
+        direct_regions.find(task->name);
+    if (r == direct_regions.end()) {
+        return false;
+    }
+    vector<pair<string, unsigned long long> > &regions = r->second;
+    for (unsigned i = 0; i < regions.size(); i++) {
+        if (direct_files[regions[i].first].committed <= regions[i].second) {
+            return true;
+        }
+    }
+    direct_regions.erase(r);
+    return false;
+}
+
+/* Let workers send more chunks for every chunk that has been written */
+void Master::send_io_credits() {
+    io_credits_due = false;
+
+    map<int, unsigned> credits;
+    credits.swap(provisional_credits);
+    fdcache->take_credits(credits);
+    for (map<int, unsigned>::iterator c = credits.begin(); c != credits.end(); c++) {
+        log_trace("Sending %u I/O credits to worker %d", c->second, c->first);
+        send_to_worker(new CreditMessage(c->second), c->first);
+    }
+    flush_batches();
+}
+
+/* Find the slot of the worker with the given rank that is running task */
+Slot *Master::find_slot(int rank, Task *task) {
+    unsigned first = (rank-1) * config.worker_slots;
+    for (unsigned i = first; i < first + config.worker_slots; i++) {
+        if (slots[i]->task == task) {
+            return slots[i];
+        }
+    }
+    myfailure("Worker %d is not running task %s", rank, task->name.c_str());
+    return NULL;
+}
+
+void Master::finish_task(Task *task, int exitcode, int rank, double task_runtime) {
+    const string &name = task->name;
+    bool retry = false;
+    
+    total_runtime += task_runtime;
+    
+    // Taking the failure resets it so that, if the task is retried,
+    // it won't automatically fail again
+    if (fdcache->take_failure(name)) {
+        // If there was an error processing I/O data for this task, 
+        // then record it as a failure
+        
+        log_error("Task %s failed due to collective I/O errors", name.c_str());
+        this->failed_count++;
+        
+        // Set the exitcode to something non-zero to force the failure
+        exitcode = 256;
+    } else if (exitcode == 0) {
+        log_debug("Task %s finished with exitcode %d", name.c_str(), exitcode);
+        this->success_count++;
+        if (config.speculate > 0) {
+            runtimes.push_back(task_runtime);
+        }
+        if (rank != 0) {
+            TaskHistory &history = task_history[history_key(task)];
+            history.total += task_runtime;
+            history.count++;
+        }
+    } else if (oom_killed.find(task) != oom_killed.end() &&
+            overcommitted.find(task) != overcommitted.end()) {
+        // The task is run again with the memory it asked for, which is
+        // restored when it is queued, and it does not use up a try
+        log_warn("Task %s ran out of its overcommitted memory, running it again with %u MB",
+                name.c_str(), overcommitted[task]);
+        oom_retries++;
+        retry = true;
+    } else if (oom_killed.find(task) != oom_killed.end() &&
+            estimated_memory.find(task) != estimated_memory.end()) {
+        // The host ran out of memory because the estimate was too small.
+        // The estimate is dropped when the task is queued again, and the
+        // task does not use up a try.
+        log_warn("Task %s was killed for lack of memory with an estimate of %u MB, "
+                "running it again without the estimate", name.c_str(), task->memory);
+        estimate_oom_retries++;
+        retry = true;
+    } else {
+        log_error("Task %s failed with exitcode %d", name.c_str(), exitcode);
+        this->failed_count++;
+    }
+    
+    task->last_exitcode = exitcode;
+    streamed.erase(name);
+    if (result_cache != NULL) {
+        cache_result(task, exitcode, rank);
+    }
+    if (tracer != NULL) {
+        uncommitted.push_back(std::make_pair(task, current_time()));
+    }
+    
+    Workflow *w = workflow_of(task);
+    w->active -= std::min(w->active, task_share(task));
+    if (!categories.empty() && rank != 0) {
+        release_category(task);
+    }
+    if (retry) {
+        w->engine->retry_task(task);
+    } else {
+        w->engine->mark_task_finished(task, exitcode);
+    
+        if (exitcode == 0) {
+            publish_event(TASK_SUCCESS, task, rank, task_runtime);
+        } else {
+            publish_event(TASK_FAILURE, task, rank, task_runtime);
+        }
+
+        // The result and the rescue record are committed, so a sweep
+        // task gives back its arguments until it is ready again, if ever
+        w->dag->collapse(task);
+    }
+
+    // Tasks found in the result cache did not run on a worker
+    if (rank == 0) {
+        if (exitcode == 0) {
+            release_inputs(task);
+        }
+        return;
+    }
+    
+    Slot *slot = find_slot(rank, task);
+    Host *host = slot->host;
+
+    // Running out of overcommitted or estimated memory is not the fault
+    // of the host
+    if (!retry) {
+        record_health(host, task, exitcode);
+    }
+
+    // Later tasks that read the outputs of this task prefer this host
+    if (exitcode == 0 && task->outputs != NULL) {
+        for (unsigned i = 0; i < task->outputs->size(); i++) {
+            file_hosts[(*task->outputs)[i]] = host;
+        }
+    }
+    if (exitcode == 0) {
+        stage_outputs(task, host, rank);
+        release_inputs(task);
+    }
+
+    // If the task was part of a batch, then the next task in the batch
+    // takes over its resources and the slot stays busy
+    if (!slot->queued.empty()) {
+        Task *next = slot->queued.front();
+        slot->queued.pop_front();
+        host->transfer_resources(task, next);
+        slot->task = next;
+        slot->start = current_time();
+        log_trace("Worker %d is running task %s", rank, next->name.c_str());
+        return;
+    }
+
+    release_gang(task);
+    release_slot(slot, task);
+}
+
+/* Mark the slot running task idle and return the resources of the task */
+void Master::release_slot(Slot *slot, Task *task) {
+    Host *host = slot->host;
+
+    // Mark slot idle
+    log_trace("Worker %d is idle", slot->rank);
+    slot->task = NULL;
+    
+    // Return resources to host. The host has to be taken out of
+    // the index while its resources change.
+    free_hosts.remove(host);
+    host->release_resources(task);
+    host->log_resources(resource_log);
+
+    // Mark slot as free
+    host->add_idle_slot(slot);
+    free_hosts.insert(host);
+    free_slots++;
+    slot_idle(slot);
+
+    // Tasks that did not fit before may fit on this host now
+    ready_queue.unblock(host);
+}
+
+/*
+ * Add the time since the clocks were last advanced to the reason that
+ * idle slots had then, and find the reason they have now. This is called
+ * whenever a slot changes state and before the master waits for
+ * messages, which is when most of the idle time passes.
+ */
+void Master::tick_idle_clock() {
+    double now = comm->clock();
+    if (idle_clock_time > 0) {
+        idle_clock[idle_reason] += now - idle_clock_time;
+    }
+    idle_clock_time = now;
+
+    if (ready_queue.empty()) {
+        idle_reason = IDLE_NO_WORK;
+    } else if (ready_queue.blocked_size() == ready_queue.size()) {
+        idle_reason = IDLE_BLOCKED;
+    } else {
+        idle_reason = IDLE_DISPATCH;
+    }
+}
+
+void Master::slot_idle(Slot *slot) {
+    tick_idle_clock();
+    if (slot->busy_since > 0) {
+        slot->busy_time += idle_clock_time - slot->busy_since;
+        slot->busy_since = 0.0;
+    }
+    for (int i = 0; i < IDLE_REASONS; i++) {
+        slot->idle_mark[i] = idle_clock[i];
+    }
+    slot->idle = true;
+}
+
+void Master::slot_busy(Slot *slot) {
+    close_idle(slot);
+    slot->busy_since = idle_clock_time;
+}
+
+/* Stop counting the idle time of a slot */
+void Master::close_idle(Slot *slot) {
+    tick_idle_clock();
+    if (!slot->idle) {
+        return;
+    }
+    for (int i = 0; i < IDLE_REASONS; i++) {
+        slot->idle_time[i] += idle_clock[i] - slot->idle_mark[i];
+    }
+    slot->idle = false;
+}
+
+static const char *IDLE_REASON_KEYS[IDLE_REASONS] = {
+    "idle_dispatch", "idle_no_work", "idle_blocked"
+};
+
+/*
+ * Log how the slots spent their time: running tasks, or idle while
+ * ready tasks were being dispatched (scheduling and dispatch latency),
+ * while no tasks were ready (the shape of the DAG), or while no ready
+ * task fit in the free resources (fragmentation)
+ */
+void Master::log_utilization() {
+    double busy = 0.0;
+    double idle[IDLE_REASONS] = {0.0, 0.0, 0.0};
+    for (unsigned i = 0; i < slots.size(); i++) {
+        busy += slots[i]->busy_time;
+        for (int r = 0; r < IDLE_REASONS; r++) {
+            idle[r] += slots[i]->idle_time[r];
+        }
+    }
+    double total = busy + idle[IDLE_DISPATCH] + idle[IDLE_NO_WORK] + idle[IDLE_BLOCKED];
+    if (total <= 0) {
+        return;
+    }
+    log_info("Slot time: %.1lf%% busy, %.1lf%% idle with ready tasks, "
+            "%.1lf%% idle with no ready tasks, %.1lf%% idle with blocked tasks",
+            100 * busy / total, 100 * idle[IDLE_DISPATCH] / total,
+            100 * idle[IDLE_NO_WORK] / total, 100 * idle[IDLE_BLOCKED] / total);
+}
+
+static void write_slot_times(FILE *f, double busy, const double *idle) {
+    fprintf(f, "\"busy\": %.6lf", busy);
+    for (int r = 0; r < IDLE_REASONS; r++) {
+        fprintf(f, ", \"%s\": %.6lf", IDLE_REASON_KEYS[r], idle[r]);
+    }
+}
+
+/* Write the time of each slot and host to the --utilization-file as JSON */
+void Master::write_utilization() {
+    FILE *f = fopen(config.utilization_file.c_str(), "w");
+    if (f == NULL) {
+        log_error("Unable to open utilization file %s: %s",
+                config.utilization_file.c_str(), strerror(errno));
+        return;
+    }
+
+    map<Host *, unsigned> host_slots;
+    map<Host *, double> host_busy;
+    map<Host *, vector<double> > host_idle;
+    double busy = 0.0;
+    double idle[IDLE_REASONS] = {0.0, 0.0, 0.0};
+
+    fprintf(f, "{\n  \"slots\": [\n");
+    bool first = true;
+    for (unsigned i = 0; i < slots.size(); i++) {
+        Slot *slot = slots[i];
+        double total = slot->busy_time;
+        for (int r = 0; r < IDLE_REASONS; r++) {
+            total += slot->idle_time[r];
+        }
+        // Slots of sub-masters never run tasks
+        if (total <= 0) {
+            continue;
+        }
+        fprintf(f, "%s    {\"rank\": %u, \"index\": %u, \"host\": \"%s\", ",
+                first ? "" : ",\n", slot->rank, slot->index, slot->host->name());
+        write_slot_times(f, slot->busy_time, slot->idle_time);
+        fprintf(f, "}");
+        first = false;
+
+        vector<double> &hidle = host_idle[slot->host];
+        hidle.resize(IDLE_REASONS, 0.0);
+        host_slots[slot->host]++;
+        host_busy[slot->host] += slot->busy_time;
+        busy += slot->busy_time;
+        for (int r = 0; r < IDLE_REASONS; r++) {
+            hidle[r] += slot->idle_time[r];
+            idle[r] += slot->idle_time[r];
+        }
+    }
+
+    fprintf(f, "\n  ],\n  \"hosts\": [\n");
+    first = true;
+    for (unsigned i = 0; i < hosts.size(); i++) {
+        Host *host = hosts[i];
+        if (host_slots.find(host) == host_slots.end()) {
+            continue;
+        }
+        fprintf(f, "%s    {\"host\": \"%s\", \"slots\": %u, ", first ? "" : ",\n",
+                host->name(), host_slots[host]);
+        write_slot_times(f, host_busy[host], &host_idle[host][0]);
+        fprintf(f, "}");
+        first = false;
+    }
+
+    fprintf(f, "\n  ],\n  \"total\": {");
+    write_slot_times(f, busy, idle);
+    fprintf(f, "}\n}\n");
+    fclose(f);
+}
+
+/*
+ * Keep track of the tasks that fail on each host and, with --quarantine,
+ * stop using a host where too many tasks have failed in a row. A task
+ * that has already failed on another host is likely broken itself, so
+ * its failures are not held against the hosts it is retried on.
+ */
+void Master::record_health(Host *host, Task *task, int exitcode) {
+    if (exitcode == 0) {
+        host->record_success();
+        failed_hosts.erase(task);
+        return;
+    }
+
+    set<Host *> &failed = failed_hosts[task];
+    bool blame = failed.empty() || (failed.size() == 1 && failed.count(host) > 0);
+    failed.insert(host);
+    if (!blame) {
+        log_debug("Task %s has failed on %lu hosts, not counting it against host %s",
+                task->name.c_str(), (unsigned long)failed.size(), host->name());
+        return;
+    }
+
+    unsigned failures = host->record_failure();
+    if (config.quarantine_failures == 0 || failures < config.quarantine_failures ||
+            host->quarantined()) {
+        return;
+    }
+
+    // The last healthy host is never quarantined, or nothing could run
+    unsigned healthy = 0;
+    for (vector<Host *>::iterator h = hosts.begin(); h != hosts.end(); h++) {
+        if (!(*h)->quarantined()) {
+            healthy++;
+        }
+    }
+    if (healthy <= 1) {
+        if (failures > config.quarantine_failures) {
+            return;
+        }
+        log_warn("%u tasks failed in a row on host %s, but it is the last healthy host",
+                failures, host->name());
+        return;
+    }
+
+    double until = current_time() + config.quarantine_time;
+    log_warn("Quarantining host %s for %lf seconds after %u tasks failed on it in a row",
+            host->name(), config.quarantine_time, failures);
+    free_hosts.remove(host);
+    host->quarantine(until);
+    quarantine_count++;
+    if (quarantine_time <= 0 || until < quarantine_time) {
+        quarantine_time = until;
+    }
+}
+
+/*
+ * Start using a host when its host script has finished. If the script
+ * failed, the host is not used, and the workflow fails if that leaves
+ * a task without a host that can run it.
+ */
+void Master::host_ready(ReadyMessage *mesg) {
+    Host *host = worker_hosts[mesg->source - 1];
+    if (pending_hosts.erase(host) == 0) {
+        log_warn("Unexpected host script status from worker %d", mesg->source);
+        return;
+    }
+    double elapsed = current_time() - start_time;
+
+    if (mesg->status != 0) {
+        log_error("Host script failed on host %s with status %d after %.1f seconds, "
+                "not using the host", host->name(), mesg->status, elapsed);
+        unusable_hosts.insert(host);
+        if (unusable_hosts.size() == hosts.size()) {
+            myfailure("Host script failed on every host");
+        }
+        host_classes.clear();
+        feasible_classes.clear();
+        for (unsigned i = 0; i < workflows.size(); i++) {
+            DAG *d = workflows[i]->dag;
+            for (DAG::iterator t = d->begin(); t != d->end(); t++) {
+                check_can_run(*t);
+            }
+        }
+    } else {
+        log_info("Host %s is ready after %.1f seconds", host->name(), elapsed);
+        host->set_ready(true);
+        free_hosts.insert(host);
+        ready_queue.unblock(host);
+        hosts_changed = true;
+    }
+
+    if (pending_hosts.empty()) {
+        host_ready_deadline = 0.0;
+    }
+}
+
+/*
+ * Warn about the hosts whose host script has not finished in time. They
+ * are used if it finishes later, but the workflow fails if no host is
+ * ready at all.
+ */
+void Master::check_pending_hosts() {
+    host_ready_deadline = 0.0;
+    if (pending_hosts.size() + unusable_hosts.size() == hosts.size()) {
+        myfailure("No host finished its host script in %.0f seconds", HOST_READY_TIMEOUT);
+    }
+    for (set<Host *>::iterator h = pending_hosts.begin(); h != pending_hosts.end(); h++) {
+        log_warn("Host script has not finished on host %s after %.0f seconds, "
+                "not using the host until it does", (*h)->name(), HOST_READY_TIMEOUT);
+    }
+}
+
+/* Put the hosts whose quarantine has ended back into use */
+void Master::end_quarantines() {
+    double now = current_time();
+    quarantine_time = 0.0;
+    for (vector<Host *>::iterator h = hosts.begin(); h != hosts.end(); h++) {
+        Host *host = *h;
+        if (!host->quarantined()) {
+            continue;
+        }
+        double until = host->quarantine_end();
+        if (until > now) {
+            if (quarantine_time <= 0 || until < quarantine_time) {
+                quarantine_time = until;
+            }
+            continue;
+        }
+        log_info("Host %s is no longer quarantined", host->name());
+        host->end_quarantine();
+        free_hosts.insert(host);
+        ready_queue.unblock(host);
+    }
+}
+
+/*
+ * Find a host for task, avoiding the hosts it has already failed on as
+ * long as another host can run it
+ */
+Host *Master::find_host(Task *task, PlacementPolicy policy) {
+    Host *host = free_hosts.find(task, policy);
+    map<Task *, set<Host *> >::iterator f = failed_hosts.find(task);
+    if (host == NULL || f == failed_hosts.end() || f->second.count(host) == 0) {
+        return host;
+    }
+
+    // The hosts it failed on are taken out of the index while looking
+    vector<Host *> skipped;
+    Host *other = host;
+    while (other != NULL && f->second.count(other) > 0) {
+        free_hosts.remove(other);
+        skipped.push_back(other);
+        other = free_hosts.find(task, policy);
+    }
+    for (vector<Host *>::iterator h = skipped.begin(); h != skipped.end(); h++) {
+        free_hosts.insert(*h);
+    }
+    return other != NULL ? other : host;
+}
+
+/*
+ * Find task->hosts different hosts that can run the task, and take a slot
+ * and the resources of the task on each of them. Returns false, and takes
+ * nothing, if there are not enough hosts. The task is sent to the worker
+ * of the first slot, which launches it on all the hosts.
+ */
+bool Master::schedule_gang(Task *task) {
+    PlacementPolicy policy = placement(task);
+
+    // Hosts are taken out of the index as they are found so that each
+    // one is only found once
+    vector<Host *> hosts;
+    while (hosts.size() < task->hosts) {
+        Host *host = free_hosts.find(task, policy);
+        if (host == NULL) {
+            break;
+        }
+        free_hosts.remove(host);
+        hosts.push_back(host);
+    }
+
+    if (hosts.size() < task->hosts) {
+        log_trace("Only %lu of the %u hosts needed by task %s are free",
+                hosts.size(), task->hosts, task->name.c_str());
+        for (unsigned i = 0; i < hosts.size(); i++) {
+            free_hosts.insert(hosts[i]);
+        }
+        return false;
+    }
+
+    vector<Slot *> &gang = gang_slots[task];
+    vector<cpu_t> bindings;
+    vector<cpu_t> gpu_bindings;
+    for (unsigned i = 0; i < hosts.size(); i++) {
+        Host *host = hosts[i];
+        Slot *slot = host->take_idle_slot();
+        free_slots--;
+        slot_busy(slot);
+
+        vector<cpu_t> host_bindings = host->allocate_resources(task, policy);
+        host->log_resources(resource_log, policy);
+        free_hosts.insert(host);
+
+        slot->task = task;
+        slot->start = current_time();
+        gang.push_back(slot);
+
+        if (i == 0) {
+            bindings = host_bindings;
+            gpu_bindings = host->gpu_bindings(task);
+        }
+
+        log_trace("Matched task %s to slot %d on host %s", 
+            task->name.c_str(), slot->rank, host->name());
+    }
+
+    gang_count++;
+
+    TaskList tasks;
+    tasks.push_back(task);
+    submit_tasks(tasks, gang[0]->rank, bindings, gpu_bindings);
+
+    return true;
+}
+
+/* Release the slots that task held on its other hosts, if it had any */
+void Master::release_gang(Task *task) {
+    map<Task *, vector<Slot *> >::iterator g = gang_slots.find(task);
+    if (g == gang_slots.end()) {
+        return;
+    }
+    for (unsigned i = 1; i < g->second.size(); i++) {
+        release_slot(g->second[i], task);
+    }
+    gang_slots.erase(g);
+}
+
+/*
+ * Set up the files where the stdout/stderr of tasks are written. The 
+ * workers send them to the master as I/O data, so they are written by 
+ * the file descriptor cache like any other forwarded file.
+ */
+void Master::open_task_stdio() {
+    if (per_task_stdio || config.rank_stdio) {
+        return;
+    }
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        open_task_stdio(workflows[i]);
+    }
+}
+
+void Master::open_task_stdio(Workflow *w) {
+    // The master's own stdout/stderr are used as they are, otherwise
+    // the files are truncated here because the data is appended
+    if (w->outfile == "stdout") {
+        w->task_stdout = IODATA_STDOUT;
+        fdcache->pin(w->task_stdout, stdout);
+    } else {
+        w->task_stdout = w->outfile;
+        FILE *f = fopen(w->outfile.c_str(), "w");
+        if (f == NULL) {
+            myfailures("Unable to open stdout file: %s\n", w->outfile.c_str());
+        }
+        fclose(f);
+    }
+
+    if (w->errfile == "stderr") {
+        w->task_stderr = IODATA_STDERR;
+        fdcache->pin(w->task_stderr, stderr);
+    } else if (w->errfile == w->outfile) {
+        w->task_stderr = w->task_stdout;
+    } else {
+        w->task_stderr = w->errfile;
+        FILE *f = fopen(w->errfile.c_str(), "w");
+        if (f == NULL) {
+            myfailures("Unable to open stderr file: %s\n", w->errfile.c_str());
+        }
+        fclose(f);
+    }
+}
+
+/*
+ * With rank-stdio, each worker writes task stdout/stderr to its own
+ * files, which are appended to the task stdout/stderr of the master in
+ * rank order.
+ */
+void Master::merge_all_task_stdio() {
+    log_info("Merging task stdio from workers...");
+    double start = current_time();
+    
+    vector<string> outfiles;
+    vector<string> errfiles;
+    char rankstr[10];
+    for (int i=1; i<=numworkers; i++) {
+        sprintf(rankstr, "%d", i);
+        outfiles.push_back(this->dagfile + ".out." + rankstr);
+        if (errfile == outfile) {
+            outfiles.push_back(this->dagfile + ".err." + rankstr);
+        } else {
+            errfiles.push_back(this->dagfile + ".err." + rankstr);
+        }
+    }
+    
+    merge_task_stdio(outfile, outfiles, "stdout");
+    if (errfile != outfile) {
+        merge_task_stdio(errfile, errfiles, "stderr");
+    }
+
+    log_info("Merged task stdio in %lf seconds", current_time() - start);
+}
+
+void Master::merge_task_stdio(const string &dest, const vector<string> &srcfiles, const string &stream) {
+    int fd;
+    if (dest == "stdout") {
+        fflush(stdout);
+        fd = STDOUT_FILENO;
+    } else if (dest == "stderr") {
+        fflush(stderr);
+        fd = STDERR_FILENO;
+    } else {
+        fd = open(dest.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0000644);
+        if (fd < 0) {
+            myfailures("Unable to open %s file: %s", stream.c_str(), dest.c_str());
+        }
+    }
+    
+    if (merge_files(fd, srcfiles, config.merge_threads) < 0) {
+        myfailure("Unable to merge task %s files", stream.c_str());
+    }
+    
+    if (fd > STDERR_FILENO) {
+        close(fd);
+    }
+    
+    for (unsigned i = 0; i < srcfiles.size(); i++) {
+        if (unlink(srcfiles[i].c_str()) && errno != ENOENT) {
+            myfailures("Unable to delete task %s file: %s", stream.c_str(), srcfiles[i].c_str());
+        }
+    }
+}
+
+void Master::write_cluster_summary(bool failed) {
+    // pegasus cluster output - used for provenance
+    char date[32];
+    iso2date(start_time, date, sizeof(date));
+    
+    unsigned ntasks = 0;
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        ntasks += workflows[i]->dag->size();
+    }
+
+    char summary[BUFSIZ];
+    sprintf(summary, "[cluster-summary stat=\"%s\", tasks=%u, submitted=%u, succeeded=%u, failed=%u, extra=0,"
+                 " start=\"%s\", duration=%.3f, pid=%d, app=\"%s\", runtime=%.3f, slots=%d, cpus=%u]\n",
+                 failed ? "failed" : "ok", 
+                 ntasks,
+                 this->submitted_count,
+                 this->success_count, 
+                 this->failed_count,
+                 date,
+                 wall_time,
+                 getpid(),
+                 this->program.c_str(),
+                 total_runtime,
+                 this->numworkers * config.worker_slots,
+                 this->total_cpus);
+    
+    int len = strlen(summary);
+
+    // XXX This should probably be written to the task_stdout, but for most
+    // pegasus workflows task_stdout = stdout
+    int w = fwrite(summary, 1, len, stdout);
+    if (w < len) {
+        myfailures("Error writing cluster-summary");
+    }
+}
+
+/*
+ * Record the life of a task on its slot. The worker's times are only
+ * comparable with the master's if the clocks of the hosts are in sync.
+ */
+void Master::trace_result(ResultMessage *mesg, Task *task) {
+    double now = current_time();
+    int rank = mesg->source;
+    Slot *slot = find_slot(rank, task);
+    const vector<double> &t = mesg->trace;
+    if (t.size() < TRACE_POINTS) {
+        tracer->span(task->name, "task", rank, slot->index, slot->start, now);
+        return;
+    }
+    tracer->span("dispatch", "dispatch", rank, slot->index, slot->start, t[TRACE_RECEIVED]);
+    tracer->span("launch", "launch", rank, slot->index, t[TRACE_LAUNCH], t[TRACE_FORKED]);
+    tracer->span(task->name, "task", rank, slot->index, t[TRACE_FORKED], t[TRACE_EXITED]);
+    tracer->span("result", "result", rank, slot->index, t[TRACE_EXITED], now);
+}
+
+/* Record the time from when tasks finished until they were in the rescue log */
+void Master::trace_commits() {
+    if (tracer == NULL || uncommitted.empty() || rescue_flush_time() > 0) {
+        return;
+    }
+    double now = current_time();
+    for (unsigned i = 0; i < uncommitted.size(); i++) {
+        Task *task = uncommitted[i].first;
+        tracer->async_span(task->name, "rescue", task->submit_seq, uncommitted[i].second, now);
+    }
+    uncommitted.clear();
+}
+
+void Master::close_trace() {
+    if (tracer == NULL) {
+        return;
+    }
+    tracer->process_name(0, "master");
+    for (unsigned i = 0; i < worker_hosts.size(); i++) {
+        char name[HOST_NAME_MAX + 32];
+        snprintf(name, sizeof(name), "worker %u (%s)", i + 1, worker_hosts[i]->name());
+        tracer->process_name(i + 1, name);
+    }
+    tracer->close();
+}
+
+static const char *message_type_name(int tag) {
+    switch (tag) {
+        case RESULT: return "result";
+        case IODATA: return "iodata";
+        case BATCH: return "batch";
+        case READY: return "ready";
+        default: return "other";
+    }
+}
+
+static void write_histogram(FILE *f, const char *name, const char *help,
+        const Histogram &h) {
+    fprintf(f, "# HELP %s %s\n", name, help);
+    fprintf(f, "# TYPE %s histogram\n", name);
+    unsigned long total = 0;
+    for (unsigned i = 0; i < h.bounds.size(); i++) {
+        total += h.counts[i];
+        fprintf(f, "%s_bucket{le=\"%g\"} %lu\n", name, h.bounds[i], total);
+    }
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %lu\n", name, h.count);
+    fprintf(f, "%s_sum %lf\n", name, h.sum);
+    fprintf(f, "%s_count %lu\n", name, h.count);
+}
+
+/*
+ * Write the current state of the master to the status file in the
+ * Prometheus text format. The file is written under a temporary name and
+ * renamed so that readers never see a partial file.
+ */
+void Master::write_status() {
+    double now = current_time();
+    status_time = now + config.status_interval;
+
+    string tmpfile = config.status_file + ".tmp";
+    FILE *f = fopen(tmpfile.c_str(), "w");
+    if (f == NULL) {
+        log_error("Unable to open status file %s: %s", tmpfile.c_str(), strerror(errno));
+        return;
+    }
+
+    fprintf(f, "# HELP pmc_uptime_seconds Time since the master started\n");
+    fprintf(f, "# TYPE pmc_uptime_seconds gauge\n");
+    fprintf(f, "pmc_uptime_seconds %lf\n", now - start_time);
+
+    fprintf(f, "# HELP pmc_tasks_total Tasks by state\n");
+    fprintf(f, "# TYPE pmc_tasks_total counter\n");
+    fprintf(f, "pmc_tasks_total{state=\"submitted\"} %u\n", submitted_count);
+    fprintf(f, "pmc_tasks_total{state=\"succeeded\"} %u\n", success_count);
+    fprintf(f, "pmc_tasks_total{state=\"failed\"} %u\n", failed_count);
+
+    fprintf(f, "# HELP pmc_ready_tasks Tasks waiting in the ready queue\n");
+    fprintf(f, "# TYPE pmc_ready_tasks gauge\n");
+    fprintf(f, "pmc_ready_tasks %u\n", ready_queue.size());
+
+    if (!categories.empty()) {
+        unsigned throttled = 0;
+        for (map<string, Category>::iterator c = categories.begin(); c != categories.end(); c++) {
+            throttled += c->second.throttled.size();
+        }
+        fprintf(f, "# HELP pmc_throttled_tasks Ready tasks held by the limits of their categories\n");
+        fprintf(f, "# TYPE pmc_throttled_tasks gauge\n");
+        fprintf(f, "pmc_throttled_tasks %u\n", throttled);
+        fprintf(f, "# HELP pmc_throttled_tasks_total Ready tasks that were held by the limits of their categories\n");
+        fprintf(f, "# TYPE pmc_throttled_tasks_total counter\n");
+        fprintf(f, "pmc_throttled_tasks_total %lu\n", throttled_count);
+    }
+
+    fprintf(f, "# HELP pmc_deferred_task_cycles_total Ready tasks left waiting at the end of each scheduling cycle\n");
+    fprintf(f, "# TYPE pmc_deferred_task_cycles_total counter\n");
+    fprintf(f, "pmc_deferred_task_cycles_total %lu\n", deferred_cycles);
+    if (config.starvation_time > 0) {
+        fprintf(f, "# HELP pmc_starvation_drains_total Hosts drained for starving tasks\n");
+        fprintf(f, "# TYPE pmc_starvation_drains_total counter\n");
+        fprintf(f, "pmc_starvation_drains_total %u\n", starvation_count);
+        fprintf(f, "# HELP pmc_starvation_wait_seconds_total Time starving tasks waited for the drained hosts\n");
+        fprintf(f, "# TYPE pmc_starvation_wait_seconds_total counter\n");
+        fprintf(f, "pmc_starvation_wait_seconds_total %lf\n", starvation_wait);
+    }
+
+    fprintf(f, "# HELP pmc_free_slots Idle worker slots\n");
+    fprintf(f, "# TYPE pmc_free_slots gauge\n");
+    fprintf(f, "pmc_free_slots %u\n", free_slots);
+    if (config.release_idle > 0) {
+        fprintf(f, "# HELP pmc_released_workers Workers shut down because they were idle\n");
+        fprintf(f, "# TYPE pmc_released_workers gauge\n");
+        fprintf(f, "pmc_released_workers %u\n", released_count);
+    }
+
+    fprintf(f, "# HELP pmc_host_free_slots Idle slots on each host\n");
+    fprintf(f, "# TYPE pmc_host_free_slots gauge\n");
+    for (unsigned i = 0; i < hosts.size(); i++) {
+        fprintf(f, "pmc_host_free_slots{host=\"%s\"} %u\n", hosts[i]->name(),
+                hosts[i]->free_slots());
+    }
+    fprintf(f, "# HELP pmc_host_free_cpus Free CPUs on each host\n");
+    fprintf(f, "# TYPE pmc_host_free_cpus gauge\n");
+    for (unsigned i = 0; i < hosts.size(); i++) {
+        fprintf(f, "pmc_host_free_cpus{host=\"%s\"} %u\n", hosts[i]->name(),
+                hosts[i]->free_cpus());
+    }
+    fprintf(f, "# HELP pmc_host_free_gpus Free GPUs on each host\n");
+    fprintf(f, "# TYPE pmc_host_free_gpus gauge\n");
+    for (unsigned i = 0; i < hosts.size(); i++) {
+        fprintf(f, "pmc_host_free_gpus{host=\"%s\"} %u\n", hosts[i]->name(),
+                hosts[i]->free_gpus());
+    }
+    fprintf(f, "# HELP pmc_host_free_memory_megabytes Free memory on each host\n");
+    fprintf(f, "# TYPE pmc_host_free_memory_megabytes gauge\n");
+    for (unsigned i = 0; i < hosts.size(); i++) {
+        fprintf(f, "pmc_host_free_memory_megabytes{host=\"%s\"} %u\n",
+                hosts[i]->name(), hosts[i]->free_memory());
+    }
+    fprintf(f, "# HELP pmc_host_task_failures_total Tasks that failed on each host\n");
+    fprintf(f, "# TYPE pmc_host_task_failures_total counter\n");
+    for (unsigned i = 0; i < hosts.size(); i++) {
+        fprintf(f, "pmc_host_task_failures_total{host=\"%s\"} %u\n",
+                hosts[i]->name(), hosts[i]->failures());
+    }
+    if (config.quarantine_failures > 0) {
+        fprintf(f, "# HELP pmc_host_quarantined Whether each host is quarantined\n");
+        fprintf(f, "# TYPE pmc_host_quarantined gauge\n");
+        for (unsigned i = 0; i < hosts.size(); i++) {
+            fprintf(f, "pmc_host_quarantined{host=\"%s\"} %d\n",
+                    hosts[i]->name(), hosts[i]->quarantined() ? 1 : 0);
+        }
+    }
+    if (!config.staging_dir.empty()) {
+        fprintf(f, "# HELP pmc_host_staging_megabytes Capacity of the staging area on each host\n");
+        fprintf(f, "# TYPE pmc_host_staging_megabytes gauge\n");
+        for (unsigned i = 0; i < hosts.size(); i++) {
+            fprintf(f, "pmc_host_staging_megabytes{host=\"%s\"} %u\n",
+                    hosts[i]->name(), hosts[i]->staging_capacity());
+        }
+        fprintf(f, "# HELP pmc_staged_files Intermediate files in the staging areas\n");
+        fprintf(f, "# TYPE pmc_staged_files gauge\n");
+        fprintf(f, "pmc_staged_files %lu\n", (unsigned long)staged_files.size());
+    }
+
+    write_histogram(f, "pmc_schedule_seconds",
+            "Time spent scheduling tasks in each cycle of the master", schedule_times);
+
+    fprintf(f, "# HELP pmc_messages_received_total Messages received from workers by type\n");
+    fprintf(f, "# TYPE pmc_messages_received_total counter\n");
+    map<int, unsigned long>::iterator m;
+    for (m = messages_received.begin(); m != messages_received.end(); m++) {
+        fprintf(f, "pmc_messages_received_total{type=\"%s\"} %lu\n",
+                message_type_name(m->first), m->second);
+    }
+
+    fprintf(f, "# HELP pmc_sent_bytes_total Bytes sent to workers\n");
+    fprintf(f, "# TYPE pmc_sent_bytes_total counter\n");
+    fprintf(f, "pmc_sent_bytes_total %lu\n", comm->sent());
+    fprintf(f, "# HELP pmc_received_bytes_total Bytes received from workers\n");
+    fprintf(f, "# TYPE pmc_received_bytes_total counter\n");
+    fprintf(f, "pmc_received_bytes_total %lu\n", comm->recvd());
+    fprintf(f, "# HELP pmc_iodata_bytes_total Bytes of task I/O data received\n");
+    fprintf(f, "# TYPE pmc_iodata_bytes_total counter\n");
+    fprintf(f, "pmc_iodata_bytes_total %lu\n", iodata_bytes);
+    fprintf(f, "# HELP pmc_iodata_stall_seconds_total Time workers waited for I/O credit\n");
+    fprintf(f, "# TYPE pmc_iodata_stall_seconds_total counter\n");
+    fprintf(f, "pmc_iodata_stall_seconds_total %lf\n", iodata_stall);
+    if (config.direct_forwards) {
+        fprintf(f, "# HELP pmc_direct_bytes_total Bytes of forwarded files written directly by workers\n");
+        fprintf(f, "# TYPE pmc_direct_bytes_total counter\n");
+        fprintf(f, "pmc_direct_bytes_total %llu\n", direct_bytes);
+    }
+
+    write_histogram(f, "pmc_rescue_commit_seconds",
+            "Time spent committing records to the rescue log", engine->rescue_latency());
+
+    fprintf(f, "# HELP pmc_fdcache_hit_ratio File descriptor cache hit rate\n");
+    fprintf(f, "# TYPE pmc_fdcache_hit_ratio gauge\n");
+    fprintf(f, "pmc_fdcache_hit_ratio %lf\n", fdcache->hitrate());
+
+    if (fclose(f) != 0) {
+        log_error("Unable to write status file %s: %s", tmpfile.c_str(), strerror(errno));
+        return;
+    }
+    if (rename(tmpfile.c_str(), config.status_file.c_str()) < 0) {
+        log_error("Unable to rename status file %s: %s", tmpfile.c_str(), strerror(errno));
+    }
+}
+
+/*
+ * Register all workers, create hosts, create slots. Assign a host-centric 
+ * rank to each of the workers. The worker with the lowest global rank on 
+ * each host is given host rank 0, the next lowest is given host rank 1, 
+ * and so on. The master is not given a host rank.
+ */
+void Master::register_workers() {
+    typedef map<string, Host *> HostMap;
+    HostMap hostmap;
+    
+    typedef map<int, string> HostnameMap;
+    HostnameMap hostnames;
+    
+    // Collect host names from all workers in one gather, create host
+    // objects. The registrations are processed in rank order.
+    vector<Message *> registrations = comm->gather_messages(NULL, 0);
+    for (int rank=1; rank<=numworkers; rank++) {
+        
+        RegistrationMessage *msg = dynamic_cast<RegistrationMessage *>(registrations[rank]);
+        if (msg == NULL) {
+            myfailure("Expected registration message from worker %d", rank);
+        }
+        string hostname = msg->hostname;
+        unsigned int memory = msg->memory;
+        unsigned int threads = msg->threads;
+        unsigned int cores = msg->cores;
+        unsigned int sockets = msg->sockets;
+        vector<cpu_t> cpu_cores = msg->cpu_cores;
+        vector<cpu_t> cpu_sockets = msg->cpu_sockets;
+        unsigned int gpus = msg->gpus;
+        unsigned int staging = msg->staging;
+        delete msg;
+
+        hostnames[rank] = hostname;
+
+        if (hostmap.find(hostname) == hostmap.end()) {
+            // If the host is not found, create a new one
+            log_debug("Got new host: name=%s, mem=%u, threads/cpus=%u, cores=%u, sockets=%u, gpus=%u, staging=%u",
+                    hostname.c_str(), memory, threads, cores, sockets, gpus, staging);
+            Host *newhost = new Host(hostname, memory, threads, cores, sockets,
+                    cpu_cores, cpu_sockets, gpus, staging);
+            newhost->set_index(hosts.size());
+            hosts.push_back(newhost);
+            hostmap[hostname] = newhost;
+            for (unsigned s=1; s<config.worker_slots; s++) {
+                newhost->add_slot();
+            }
+        } else {
+            // Otherwise, increment the number of slots available
+            Host *host = hostmap[hostname];
+            for (unsigned s=0; s<config.worker_slots; s++) {
+                host->add_slot();
+            }
+        }
+        
+        log_debug("Slot %d on host %s", rank, hostname.c_str());
+    }
+    
+    typedef map<string, int> RankMap;
+    RankMap ranks;
+
+    // Count the workers on each host
+    RankMap host_workers;
+    for (HostnameMap::iterator h = hostnames.begin(); h != hostnames.end(); h++) {
+        host_workers[h->second] += 1;
+    }
+    
+    // Create slots, assign a host rank to each worker
+    vector<int> masters;
+    for (int rank=1; rank<=numworkers; rank++) {
+        string hostname = hostnames.find(rank)->second;
+        
+        // Find host
+        Host *host = hostmap.find(hostname)->second;
+        worker_hosts.push_back(host);
+        
+        // Create new slots. A worker can run several tasks at once.
+        vector<Slot *> worker_slots;
+        for (unsigned s=0; s<config.worker_slots; s++) {
+            Slot *slot = new Slot(rank, host);
+            slot->index = s;
+            slots.push_back(slot);
+            worker_slots.push_back(slot);
+        }
+        
+        // Compute hostrank for this slot
+        RankMap::iterator nextrank = ranks.find(hostname);
+        int hostrank = 0;
+        if (nextrank != ranks.end()) {
+            hostrank = nextrank->second;
+        }
+        ranks[hostname] = hostrank + 1;
+
+        // In sub-master mode the worker with host rank 0 on each host
+        // that has more than one worker relays messages for the host
+        // instead of running tasks
+        if (config.submasters && hostrank == 0 && host_workers[hostname] > 1) {
+            log_debug("Worker %d is the sub-master for host %s", rank, hostname.c_str());
+            host->set_submaster(rank);
+            for (unsigned s=0; s<worker_slots.size(); s++) {
+                host->remove_slot();
+            }
+        } else {
+            for (unsigned s=0; s<worker_slots.size(); s++) {
+                host->add_idle_slot(worker_slots[s]);
+                free_slots++;
+                slot_idle(worker_slots[s]);
+            }
+        }
+        
+        worker_host_ranks.push_back(hostrank);
+        masters.push_back(host->submaster());
+        
+        log_debug("Host rank of worker %d is %d", rank, hostrank);
+    }
+
+    // Every worker gets its host rank from one broadcast
+    HostrankMessage hrmsg(worker_host_ranks, masters);
+    comm->broadcast_message(&hrmsg, 0);
+    
+    idle_since.assign(numworkers, 0.0);
+    released.assign(numworkers, false);
+
+    // Log the initial resource freeability and index the hosts. With a
+    // host script, each host is used once its script has finished.
+    for (vector<Host *>::iterator i = hosts.begin(); i!=hosts.end(); i++) {
+        Host *host = *i;
+        host->log_resources(resource_log);
+        if (has_host_script) {
+            host->set_ready(false);
+            pending_hosts.insert(host);
+        }
+        free_hosts.insert(host);
+    }
+    if (has_host_script) {
+        host_ready_deadline = current_time() + HOST_READY_TIMEOUT;
+    }
+}
+
+/*
+ * Send the commands for all the tasks to the workers in one broadcast so
+ * that tasks can be submitted by index.
+ */
+void Master::broadcast_task_table() {
+    vector<Message *> commands(dag->size());
+    vector<cpu_t> nobindings;
+    for (DAG::iterator t = dag->begin(); t != dag->end(); t++) {
+        Task *task = *t;
+        // The workers need the command of every task up front, but the
+        // master only needs it again once the task is ready
+        dag->expand(task);
+        commands[task->index] = new CommandMessage(task->name, task->args, 
+                task->pegasus_id, task->memory, task->cpus, nobindings, 
+                task->pipe_forwards, task->file_forwards, task->max_runtime, task->gpus,
+                vector<cpu_t>(), vector<string>(), task->threads);
+        dag->collapse(task);
+    }
+
+    TaskTableMessage table(commands);
+    for (unsigned i = 0; i < commands.size(); i++) {
+        delete commands[i];
+    }
+
+    log_info("Broadcasting %u tasks to workers (%u bytes)", 
+            table.size(), table.msgsize);
+    comm->broadcast_message(&table, 0);
+
+    this->broadcast_tasks = commands.size();
+}
+
+/* Files waiting to be broadcast in the next message */
+struct PendingFiles {
+    vector<BroadcastFile> files;
+    // The data of the files, which they point to
+    list<string> data;
+    unsigned size;
+    unsigned long long total;
+    unsigned messages;
+};
+
+static void send_files(Communicator *comm, PendingFiles &pending, bool last) {
+    FilesMessage mesg(pending.files, last);
+    comm->broadcast_message(&mesg, 0);
+    pending.files.clear();
+    pending.data.clear();
+    pending.size = 0;
+    pending.messages++;
+}
+
+static void add_file(Communicator *comm, PendingFiles &pending, char type,
+        unsigned mode, const string &rel, unsigned long long offset, const string &data) {
+    pending.data.push_back(data);
+    BroadcastFile file;
+    file.type = type;
+    file.mode = mode;
+    file.offset = offset;
+    file.path = rel;
+    file.data = pending.data.back().data();
+    file.size = data.size();
+    pending.files.push_back(file);
+    pending.size += rel.size() + data.size();
+    pending.total += data.size();
+    if (pending.size >= BROADCAST_FILES_CHUNK) {
+        send_files(comm, pending, false);
+    }
+}
+
+/* Add path, and everything under it if it is a directory, as rel */
+static void add_path(Communicator *comm, PendingFiles &pending, const string &path,
+        const string &rel) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) < 0) {
+        myfailures("Unable to stat %s", path.c_str());
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(path.c_str(), target, sizeof(target));
+        if (n < 0) {
+            myfailures("Unable to read link %s", path.c_str());
+        }
+        add_file(comm, pending, 'l', 0, rel, 0, string(target, n));
+    } else if (S_ISDIR(st.st_mode)) {
+        add_file(comm, pending, 'd', st.st_mode & 07777, rel, 0, "");
+        DIR *dir = opendir(path.c_str());
+        if (dir == NULL) {
+            myfailures("Unable to open directory %s", path.c_str());
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            string name = entry->d_name;
+            if (name != "." && name != "..") {
+                add_path(comm, pending, path + "/" + name, rel + "/" + name);
+            }
+        }
+        closedir(dir);
+    } else if (S_ISREG(st.st_mode)) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            myfailures("Unable to open %s", path.c_str());
+        }
+        // Big files are split so that each message stays about the same size
+        unsigned long long offset = 0;
+        string chunk;
+        do {
+            chunk.resize(BROADCAST_FILES_CHUNK);
+            ssize_t n = read(fd, &chunk[0], chunk.size());
+            if (n < 0) {
+                myfailures("Unable to read %s", path.c_str());
+            }
+            chunk.resize(n);
+            if (n > 0 || offset == 0) {
+                add_file(comm, pending, 'f', st.st_mode & 07777, rel, offset, chunk);
+            }
+            offset += n;
+        } while (chunk.size() > 0);
+        close(fd);
+    } else {
+        log_warn("Not broadcasting %s: not a regular file, directory or link",
+                path.c_str());
+    }
+}
+
+/*
+ * Read the --broadcast-files once and send them to the workers in a
+ * series of broadcasts. One worker on each host writes them to node-local
+ * storage, so that the tasks do not all read them from the shared file
+ * system. Tasks do not start until every host has its copy.
+ */
+void Master::broadcast_files() {
+    double start = current_time();
+    PendingFiles pending;
+    pending.size = 0;
+    pending.total = 0;
+    pending.messages = 0;
+    for (unsigned i = 0; i < config.broadcast_files.size(); i++) {
+        const string &path = config.broadcast_files[i];
+        add_path(comm, pending, path, filename(path));
+    }
+    send_files(comm, pending, true);
+    comm->barrier();
+
+    log_info("Broadcast %llu bytes of files to %s in %u messages in %f seconds",
+            pending.total, config.broadcast_dir.c_str(), pending.messages,
+            current_time() - start);
+}
+
+/*
+ * Estimate when host will have enough free resources to run task based
+ * on the runtime estimates of the tasks running there. Returns HUGE_VAL
+ * if that depends on a task without an estimate.
+ */
+double Master::drain_time(Host *host, Task *task) {
+    double now = current_time();
+
+    vector<pair<double, Task *> > running;
+    for (vector<Slot *>::iterator s = slots.begin(); s != slots.end(); s++) {
+        Slot *slot = *s;
+        if (slot->host != host || slot->task == NULL) {
+            continue;
+        }
+        Task *t = slot->task;
+        double finish = HUGE_VAL;
+        if (t->runtime > 0) {
+            // Tasks that have overrun their estimate could finish any time
+            finish = std::max(now, slot->start + t->runtime);
+        }
+
+        // The slot is not released until the rest of its batch finishes
+        for (TaskList::iterator q = slot->queued.begin(); q != slot->queued.end(); q++) {
+            if ((*q)->runtime > 0) {
+                finish += (*q)->runtime;
+            } else {
+                finish = HUGE_VAL;
+            }
+        }
+        running.push_back(std::make_pair(finish, t));
+    }
+    std::sort(running.begin(), running.end());
+
+    unsigned cpus = host->free_cpus();
+    unsigned memory = host->free_memory();
+    unsigned gpus = host->free_gpus();
+    bool slot = host->has_idle_slot();
+    double when = now;
+    vector<pair<double, Task *> >::iterator r = running.begin();
+    while (!slot || cpus < task->cpus || memory < task->memory || gpus < task->gpus) {
+        if (r == running.end()) {
+            return HUGE_VAL;
+        }
+        cpus += r->second->cpus;
+        memory += r->second->memory;
+        gpus += r->second->gpus;
+        slot = true;
+        when = r->first;
+        r++;
+    }
+
+    return when;
+}
+
+/* The placement policy of the task, or the one of the workflow */
+PlacementPolicy Master::placement(Task *task) {
+    if (task->placement != PLACEMENT_DEFAULT) {
+        return task->placement;
+    }
+    return config.placement;
+}
+
+/*
+ * Can task finish before the wall time is up if it is started now? Tasks
+ * without a runtime estimate are started until the master drains.
+ */
+bool Master::finishes_in_time(Task *task) {
+    if (max_wall_time <= 0) {
+        return true;
+    }
+    double now = current_time();
+    double runtime = estimated_runtime(task);
+    if (runtime <= 0) {
+        return drain_deadline <= 0 || now < drain_deadline;
+    }
+    return now + runtime <= start_time + max_wall_time * 60.0;
+}
+
+/* The number of slots that are running a task */
+unsigned Master::busy_slots() {
+    unsigned busy = 0;
+    for (vector<Slot *>::iterator s = slots.begin(); s != slots.end(); s++) {
+        if ((*s)->task != NULL || (*s)->cancelled) {
+            busy++;
+        }
+    }
+    return busy;
+}
+
+/*
+ * Reserve the host that will be able to run task the soonest. The host is
+ * taken out of the index so that it is only given tasks that will finish
+ * before the reservation starts.
+ */
+void Master::reserve_host(Task *task) {
+    Host *best = NULL;
+    double best_time = HUGE_VAL;
+    for (vector<Host *>::iterator h = hosts.begin(); h != hosts.end(); h++) {
+        Host *host = *h;
+        if (host->total_cpus() < task->cpus || host->total_memory() < task->memory ||
+                host->total_gpus() < task->gpus || host->quarantined() || !host->ready()) {
+            continue;
+        }
+        double when = drain_time(host, task);
+        if (best == NULL || when < best_time ||
+                (when == best_time && host->free_cpus() > best->free_cpus())) {
+            best = host;
+            best_time = when;
+        }
+    }
+
+    if (best == NULL) {
+        return;
+    }
+
+    log_debug("Reserving host %s for task %s (available in %lf seconds)",
+            best->name(), task->name.c_str(), best_time - current_time());
+
+    reserved_host = best;
+    reserved_until = best_time;
+    free_hosts.remove(best);
+}
+
+void Master::clear_reservation() {
+    if (reserved_host == NULL) {
+        return;
+    }
+
+    free_hosts.insert(reserved_host);
+
+    // Classes may have been blocked only because the host was reserved
+    ready_queue.unblock(reserved_host);
+
+    reserved_host = NULL;
+    reserved_until = 0.0;
+}
+
+/* Can task run on the reserved host without delaying the reservation? */
+bool Master::can_backfill(Task *task) {
+    if (reserved_host == NULL || reserved_until == HUGE_VAL || task->runtime <= 0) {
+        return false;
+    }
+    if (!reserved_host->has_idle_slot() || !reserved_host->can_run(task) ||
+            reserved_host->quarantined()) {
+        return false;
+    }
+    return current_time() + task->runtime <= reserved_until;
+}
+
+void Master::schedule_tasks() {
+    log_debug("Scheduling %d tasks on %d slots...", 
+        ready_queue.size(), free_slots);
+
+    int scheduled = 0;
+
+    // Tasks that are waiting for the host that has their inputs
+    TaskList waiting;
+    locality_time = 0.0;
+
+    ready_queue.set_time(comm->clock());
+
+    // If the highest priority task needs several hosts and they are not
+    // free yet, then the hosts are drained for it: nothing else is started
+    // until enough hosts are free at the same time, so that it is not
+    // starved by smaller tasks
+    Task *first = ready_queue.first();
+    Task *drained = drain_task;
+    drain_task = NULL;
+    if (first != NULL && first->hosts > 1 && finishes_in_time(first)) {
+        if (schedule_gang(first)) {
+            ready_queue.pop_class(ResourceClass(first));
+            scheduled++;
+        } else {
+            drain_task = first;
+            if (drained != first) {
+                log_info("Draining hosts for task %s, which needs %u hosts",
+                        first->name.c_str(), first->hosts);
+                drain_count++;
+            }
+        }
+    }
+
+    // If the highest priority task does not fit anywhere, then reserve
+    // a host for it so that it is not starved by smaller tasks. Tasks
+    // that are starving get a host drained for them even without
+    // --backfill.
+    first = ready_queue.first();
+    bool starving = first != NULL && ready_queue.starving(first);
+    if ((config.backfill || starving) && drain_task == NULL && first != NULL &&
+            first->hosts == 1 && free_hosts.find(first) == NULL) {
+        reserve_host(first);
+        if (starving && reserved_host != NULL && starving_task != first) {
+            log_info("Draining host %s for task %s, which has waited %lf seconds",
+                    reserved_host->name(), first->name.c_str(), ready_queue.waiting_time(first));
+            starving_task = first;
+            starving_since = comm->clock();
+            starvation_count++;
+        }
+    }
+
+    while (free_slots > 0 && drain_task == NULL) {
+        Task *task = ready_queue.top();
+        if (task == NULL) {
+            break;
+        }
+
+        log_trace("Scheduling task %s", task->name.c_str());
+
+        // Near the end of the wall time, tasks that are not expected to
+        // finish in time are passed over for shorter ones
+        if (!finishes_in_time(task)) {
+            log_trace("Task %s would not finish before the wall time", task->name.c_str());
+            ready_queue.pop();
+            waiting.push_back(task);
+            continue;
+        }
+
+        // Tasks that need several hosts are not batched or backfilled
+        if (task->hosts > 1) {
+            if (schedule_gang(task)) {
+                ready_queue.pop();
+                scheduled++;
+            } else {
+                ready_queue.block();
+            }
+            continue;
+        }
+
+        // Tasks whose inputs were written on another host wait a while for
+        // that host to have room before they are run anywhere else
+        Host *local = NULL;
+        if (config.locality_delay > 0 && task->inputs != NULL) {
+            local = local_host(task);
+            if (local != NULL && (local->quarantined() || !local->ready())) {
+                local = NULL;
+            }
+        }
+        Host *host = NULL;
+        if (local != NULL && local != reserved_host && local->has_idle_slot() && 
+                local->can_run(task)) {
+            host = local;
+        } else if (local != NULL) {
+            double now = current_time();
+            map<Task *, double>::iterator w = locality_waits.find(task);
+            if (w == locality_waits.end()) {
+                w = locality_waits.insert(std::make_pair(task, now)).first;
+            }
+            double deadline = w->second + config.locality_delay;
+            if (now < deadline) {
+                log_trace("Task %s is waiting for host %s", 
+                        task->name.c_str(), local->name());
+                ready_queue.pop();
+                waiting.push_back(task);
+                if (locality_time == 0.0 || deadline < locality_time) {
+                    locality_time = deadline;
+                }
+                continue;
+            }
+        }
+
+        PlacementPolicy policy = placement(task);
+        if (host == NULL) {
+            host = find_host(task, policy);
+        }
+        if (host == NULL && config.backfill && reserved_host == NULL &&
+                task == ready_queue.first()) {
+            reserve_host(task);
+        } else if (host == NULL && can_backfill(task)) {
+            // Tasks can only use the reserved host if they finish in time
+            log_trace("Backfilling task %s on host %s", 
+                    task->name.c_str(), reserved_host->name());
+            host = reserved_host;
+        }
+
+        if (host == NULL) {
+            // If the task could not be scheduled, then none of the tasks
+            // in its class can be scheduled either. The class is skipped
+            // until a host with enough free resources is released.
+            log_trace("No slot found for task %s", task->name.c_str());
+            ready_queue.block();
+            continue;
+        }
+
+        ready_queue.pop();
+
+        if (local != NULL) {
+            locality_tasks++;
+            if (host == local) {
+                locality_hits++;
+            }
+            locality_waits.erase(task);
+        }
+
+        Slot *slot = host->take_idle_slot();
+        free_slots--;
+        slot_busy(slot);
+
+        log_trace("Matched task %s to slot %d on host %s", 
+            task->name.c_str(), slot->rank, host->name());
+
+        // Reserve the resources. The reserved host is not in the index.
+        if (host != reserved_host) {
+            free_hosts.remove(host);
+        }
+        vector<cpu_t> bindings = host->allocate_resources(task, policy);
+        host->log_resources(resource_log, policy);
+        if (host != reserved_host) {
+            free_hosts.insert(host);
+        }
+
+        slot->task = task;
+        slot->start = current_time();
+
+        // Tasks in the same resource class can share the allocation and
+        // are sent along in one batch if there are more ready tasks than
+        // free slots. Batches are not used for backfill because the
+        // batch could delay the reservation. With --bundle-time, short
+        // tasks are added to the batch until their expected runtime adds
+        // up to the bundle time, so that the cost of sending each task
+        // is spread over more work.
+        TaskList batch;
+        batch.push_back(task);
+        double bundle_runtime = 0.0;
+        if (config.bundle_time > 0) {
+            bundle_runtime = estimated_runtime(task);
+        }
+        bool bundling = bundle_runtime > 0 && bundle_runtime < config.bundle_time;
+        while ((batch.size() < config.batch_size || bundling) && 
+                host != reserved_host && ready_queue.size() > free_slots) {
+            Task *next = ready_queue.pop_current();
+            if (next == NULL) {
+                break;
+            }
+            if (!finishes_in_time(next)) {
+                ready_queue.push(next);
+                break;
+            }
+            if (batch.size() >= config.batch_size) {
+                double runtime = estimated_runtime(next);
+                if (runtime <= 0 || bundle_runtime + runtime > config.bundle_time ||
+                        batch.size() >= MAX_BUNDLE_SIZE) {
+                    ready_queue.push(next);
+                    break;
+                }
+                bundle_runtime += runtime;
+            }
+            log_trace("Batching task %s with task %s", 
+                next->name.c_str(), task->name.c_str());
+            batch.push_back(next);
+            slot->queued.push_back(next);
+        }
+        if (bundling && batch.size() > 1) {
+            bundled_tasks += batch.size();
+            bundle_count++;
+        }
+
+        submit_tasks(batch, slot->rank, bindings, host->gpu_bindings(task));
+
+        scheduled += batch.size();
+    }
+
+    for (TaskList::iterator t = waiting.begin(); t != waiting.end(); t++) {
+        ready_queue.push(*t);
+    }
+
+    // Any tasks left over could not be placed on an idle slot. Tasks are
+    // not sent ahead of time while hosts are drained.
+    if (config.prefetch > 0 && !ready_queue.empty() && drain_task == NULL) {
+        prefetch_tasks();
+    }
+
+    // Slots that are left over can run copies of stragglers
+    speculate_time = 0.0;
+    if (config.speculate > 0 && ready_queue.empty() && free_slots > 0) {
+        speculate_time = speculate_tasks();
+    }
+
+    flush_batches();
+
+    // Reservations are recomputed every cycle
+    clear_reservation();
+
+    deferred_cycles += ready_queue.size();
+
+    log_debug("Scheduled %d tasks and deferred %d tasks", scheduled, 
+            ready_queue.blocked_size());
+}
+
+/*
+ * Send tasks to busy slots ahead of time so that the worker can start
+ * the next task as soon as the current one finishes, without waiting for
+ * the master. A slot only gets tasks in the same resource class as the
+ * task it is running, so that they can take over its allocation. Slots on
+ * the reserved host are skipped so that the reservation is not delayed.
+ */
+void Master::prefetch_tasks() {
+    for (vector<Slot *>::iterator s = slots.begin(); s != slots.end(); s++) {
+        Slot *slot = *s;
+        if (slot->task == NULL || slot->host == reserved_host || slot->task->hosts > 1 ||
+                slot->host->quarantined()) {
+            continue;
+        }
+
+        ResourceClass rc(slot->task);
+        while (slot->queued.size() < config.prefetch) {
+            Task *task = ready_queue.pop_class(rc);
+            if (task == NULL) {
+                break;
+            }
+            if (!finishes_in_time(task)) {
+                ready_queue.push(task);
+                break;
+            }
+
+            log_trace("Prefetching task %s on slot %d", task->name.c_str(), slot->rank);
+
+            slot->queued.push_back(task);
+
+            TaskList tasks;
+            tasks.push_back(task);
+            submit_tasks(tasks, slot->rank, slot->host->bindings(slot->task),
+                    slot->host->gpu_bindings(slot->task));
+        }
+
+        if (ready_queue.empty()) {
+            break;
+        }
+    }
+}
+
+/*
+ * Start a copy of the tasks that have been running config.speculate times
+ * longer than their runtime estimate, or than the median runtime of the
+ * tasks that succeeded if they don't have an estimate. Each task gets at
+ * most one copy. Returns the time when the next running task becomes a
+ * straggler, or 0 if there is none.
+ */
+double Master::speculate_tasks() {
+    double now = current_time();
+    double next = 0.0;
+    for (vector<Slot *>::iterator s = slots.begin(); s != slots.end() && free_slots > 0; s++) {
+        Slot *slot = *s;
+        Task *task = slot->task;
+        if (task == NULL || slot->cancelled || copies.find(task) != copies.end() ||
+                streamed.find(task->name) != streamed.end() || task->hosts > 1) {
+            continue;
+        }
+
+        double expected = task->runtime > 0 ? task->runtime : median_runtime();
+        if (expected <= 0) {
+            continue;
+        }
+        double deadline = slot->start + config.speculate * expected;
+        if (deadline > now) {
+            if (next == 0.0 || deadline < next) {
+                next = deadline;
+            }
+            continue;
+        }
+
+        Host *host = find_copy_host(slot);
+        if (host == NULL) {
+            continue;
+        }
+
+        Slot *copy = host->take_idle_slot();
+        free_slots--;
+        slot_busy(copy);
+
+        PlacementPolicy policy = placement(task);
+        free_hosts.remove(host);
+        vector<cpu_t> bindings = host->allocate_resources(task, policy);
+        host->log_resources(resource_log, policy);
+        free_hosts.insert(host);
+
+        copy->task = task;
+        copy->start = now;
+        copies[task] = 2;
+
+        log_info("Task %s has been running for %lf seconds, starting a copy on worker %d",
+                task->name.c_str(), now - slot->start, copy->rank);
+
+        TaskList tasks;
+        tasks.push_back(task);
+        submit_tasks(tasks, copy->rank, bindings, host->gpu_bindings(task), true);
+    }
+    return next;
+}
+
+/*
+ * Return the host that wrote the most inputs of task, or NULL if none of
+ * its inputs were written by another task
+ */
+Host *Master::local_host(Task *task) {
+    vector<pair<Host *, unsigned> > counts;
+    for (unsigned i = 0; i < task->inputs->size(); i++) {
+        map<const string *, Host *>::iterator f = file_hosts.find((*task->inputs)[i]);
+        // Hosts whose workers were all released can't run anything
+        if (f == file_hosts.end() || f->second->total_slots() == 0) {
+            continue;
+        }
+        unsigned j = 0;
+        while (j < counts.size() && counts[j].first != f->second) {
+            j++;
+        }
+        if (j == counts.size()) {
+            counts.push_back(std::make_pair(f->second, 0u));
+        }
+        counts[j].second++;
+    }
+
+    Host *best = NULL;
+    unsigned best_count = 0;
+    for (unsigned j = 0; j < counts.size(); j++) {
+        if (counts[j].second > best_count) {
+            best = counts[j].first;
+            best_count = counts[j].second;
+        }
+    }
+    return best;
+}
+
+/* The median runtime of the tasks that succeeded so far */
+double Master::median_runtime() {
+    if (runtimes.empty()) {
+        return 0.0;
+    }
+    if (median_count != runtimes.size()) {
+        vector<double>::iterator mid = runtimes.begin() + runtimes.size() / 2;
+        std::nth_element(runtimes.begin(), mid, runtimes.end());
+        median = *mid;
+        median_count = runtimes.size();
+    }
+    return median;
+}
+
+/*
+ * The expected runtime of task for --bundle-time: the estimate from the
+ * DAG, or the average runtime of the tasks that ran the same
+ * transformation, or 0 if it is not known
+ */
+double Master::estimated_runtime(Task *task) {
+    if (task->runtime > 0) {
+        return task->runtime;
+    }
+    map<const string *, TaskHistory>::iterator h = task_history.find(history_key(task));
+    if (h == task_history.end()) {
+        return 0.0;
+    }
+    return h->second.average();
+}
+
+/*
+ * Tasks are compared with the other tasks of their transformation from
+ * the #@ record, or with the tasks that run the same executable if they
+ * don't have one
+ */
+const string *Master::history_key(Task *task) {
+    if (task->transformation != NULL) {
+        return task->transformation;
+    }
+    // The executable of a sweep task may have its index in it, which
+    // is not interned, so the tasks of a sweep are compared together
+    if (task->sweep != NULL) {
+        return task->sweep->args.front();
+    }
+    return task->args.front();
+}
+
+/* Keep the peak memory of tasks that succeeded for --estimate-resources */
+void Master::record_usage(Task *task, ResultMessage *mesg) {
+    log_debug("Task %s used %lu KB of memory and %f seconds of CPU time",
+            task->name.c_str(), mesg->usage.maxrss, mesg->usage.utime + mesg->usage.stime);
+
+    total_cpu_time += mesg->usage.utime + mesg->usage.stime;
+
+    if (mesg->exitcode != 0) {
+        return;
+    }
+    unsigned memory = (mesg->usage.maxrss + 1023) / 1024;
+    TaskHistory &history = task_history[history_key(task)];
+    if (memory > history.memory) {
+        history.memory = memory;
+    }
+}
+
+/* Append value to yaml as the contents of a double-quoted YAML string */
+static void yaml_quote(string &yaml, const string &value) {
+    char buf[8];
+    for (unsigned i = 0; i < value.size(); i++) {
+        unsigned char c = value[i];
+        if (c == '"' || c == '\\') {
+            yaml += '\\';
+            yaml += c;
+        } else if (c < 0x20 || c == 0x7f) {
+            snprintf(buf, sizeof(buf), "\\x%02x", c);
+            yaml += buf;
+        } else {
+            yaml += c;
+        }
+    }
+}
+
+/*
+ * With --monitor, write a kickstart invocation record for the task to the
+ * task stdout. The worker measured the task the way pegasus-kickstart
+ * would, so tasks do not have to be wrapped in it. The record goes through
+ * the file descriptor cache like the output of the task, so the records
+ * of a cycle are written together, and the result is not committed until
+ * its record is written.
+ */
+void Master::write_invocation(Task *task, ResultMessage *mesg) {
+    char buf[BUFSIZ];
+    char date[64];
+    string yaml;
+
+    iso2date(mesg->start, date, sizeof(date));
+    snprintf(buf, sizeof(buf),
+            "- invocation: True\n"
+            "  version: 3.0\n"
+            "  start: %s\n"
+            "  duration: %.3f\n",
+            date, mesg->runtime);
+    yaml += buf;
+    if (task->transformation != NULL) {
+        yaml += "  transformation: \"";
+        yaml_quote(yaml, *task->transformation);
+        yaml += "\"\n";
+    }
+    snprintf(buf, sizeof(buf),
+            "  hostname: %s\n"
+            "  mainjob:\n"
+            "    start: %s\n"
+            "    duration: %.3f\n"
+            "    usage:\n"
+            "      utime: %.3f\n"
+            "      stime: %.3f\n"
+            "      maxrss: %lu\n"
+            "      inblock: %lu\n"
+            "      outblock: %lu\n"
+            "    status:\n"
+            "      raw: %d\n",
+            slots[(mesg->source - 1) * config.worker_slots]->host->name(), date,
+            mesg->runtime, mesg->usage.utime, mesg->usage.stime, mesg->usage.maxrss,
+            mesg->usage.inblock, mesg->usage.oublock, mesg->exitcode);
+    yaml += buf;
+
+    int status = mesg->exitcode;
+    if (status < 0) {
+        snprintf(buf, sizeof(buf), "      failure_error: %d\n", status);
+    } else if (WIFEXITED(status)) {
+        snprintf(buf, sizeof(buf), "      regular_exitcode: %d\n", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        snprintf(buf, sizeof(buf), "      signalled_signal: %d\n", WTERMSIG(status));
+    } else {
+        buf[0] = '\0';
+    }
+    yaml += buf;
+
+    yaml += "    executable:\n"
+            "      file_name: \"";
+    yaml_quote(yaml, *task->args.front());
+    yaml += "\"\n"
+            "    argument_vector:\n";
+    for (unsigned i = 1; i < task->args.size(); i++) {
+        yaml += "      - \"";
+        yaml_quote(yaml, *task->args[i]);
+        yaml += "\"\n";
+    }
+
+    if (!mesg->files.empty()) {
+        yaml += "    files:\n";
+        for (unsigned i = 0; i < mesg->files.size(); i++) {
+            FileUsage &f = mesg->files[i];
+            yaml += "      \"";
+            yaml_quote(yaml, f.path);
+            snprintf(buf, sizeof(buf),
+                    "\":\n"
+                    "        size: %llu\n"
+                    "        bread: %llu\n"
+                    "        bwrite: %llu\n",
+                    f.size, f.bread, f.bwrite);
+            yaml += buf;
+        }
+    }
+
+    fdcache->enqueue(workflow_of(task)->task_stdout, task->name, yaml.data(),
+            yaml.size(), -1);
+}
+
+/*
+ * With --estimate-resources, a task without -r or -m that becomes ready
+ * gets the average runtime and the peak memory of the tasks of its
+ * transformation that already ran. The estimate has to be set before the
+ * task is queued because the memory decides its resource class. A memory
+ * estimate that no host could satisfy is not used. A task that is queued
+ * again is estimated again, from the tasks that ran since, unless it was
+ * killed for lack of memory, in which case its memory is not estimated.
+ */
+void Master::estimate_resources(Task *task) {
+    if (estimated_memory.erase(task) > 0) {
+        task->memory = 0;
+    }
+
+    map<const string *, TaskHistory>::iterator h = task_history.find(history_key(task));
+    if (h == task_history.end()) {
+        return;
+    }
+    TaskHistory &history = h->second;
+
+    bool estimated = false;
+    if (task->runtime <= 0 && history.count > 0) {
+        task->runtime = history.average();
+        estimated = true;
+    }
+    if (task->memory == 0 && history.memory > 0 && oom_killed.find(task) == oom_killed.end()) {
+        task->memory = history.memory;
+        bool fits = false;
+        for (unsigned i = 0; i < hosts.size() && !fits; i++) {
+            fits = hosts[i]->can_run(task);
+        }
+        if (fits) {
+            estimated_memory.insert(task);
+            estimated = true;
+        } else {
+            task->memory = 0;
+        }
+    }
+    if (estimated) {
+        log_trace("Estimated task %s needs %u MB for %f seconds",
+                task->name.c_str(), task->memory, task->runtime);
+        estimated_tasks++;
+    }
+}
+
+/*
+ * Find a host for a copy of the task running in slot. The copy goes to
+ * another host if possible. Because CPUs and GPUs are allocated to tasks,
+ * and results are matched to slots by rank, the same host can only be
+ * used if the task doesn't need bindings and each worker has one slot.
+ */
+Host *Master::find_copy_host(Slot *slot) {
+    Host *host = slot->host;
+    bool indexed = host->has_idle_slot();
+    if (indexed) {
+        free_hosts.remove(host);
+    }
+    Host *other = free_hosts.find(slot->task, placement(slot->task));
+    if (indexed) {
+        free_hosts.insert(host);
+    }
+    if (other != NULL) {
+        return other;
+    }
+
+    if (indexed && slot->task->cpus == 1 && slot->task->gpus == 0 && 
+            config.worker_slots == 1 && host->can_run(slot->task)) {
+        return host;
+    }
+    return NULL;
+}
+
+/*
+ * Add the tasks that are available from the DAG stream to the workflow.
+ * The workflow is not finished until the stream ends.
+ */
+void Master::read_dag_stream() {
+    if (dag_stream == NULL || dag_stream->ended()) {
+        return;
+    }
+
+    unsigned first = dag->size();
+    dag_stream->read(dag);
+    if (dag->size() > first) {
+        log_info("Read %u new tasks from DAG stream", dag->size() - first);
+        for (DAG::iterator t = dag->begin() + first; t != dag->end(); t++) {
+            check_can_run(*t);
+            count_readers(*t);
+        }
+        engine->add_tasks(first);
+        set_category_limits();
+    }
+
+    if (dag_stream->ended()) {
+        log_info("DAG stream ended");
+        engine->set_streaming(false);
+    }
+}
+
+/*
+ * Take the next ready task from the engines, or return NULL. With more
+ * than one workflow, tasks are only taken while there are free slots
+ * for them, and the next one comes from the workflow that uses the
+ * fewest CPUs for its weight, so that the tail of one workflow is
+ * filled with the tasks of the others.
+ */
+Task *Master::next_ready_task() {
+    if (workflows.size() == 1) {
+        if (!engine->has_ready_task()) {
+            return NULL;
+        }
+        return engine->next_ready_task();
+    }
+
+    if (ready_queue.size() - ready_queue.blocked_size() > free_slots) {
+        return NULL;
+    }
+
+    Workflow *next = NULL;
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        Workflow *w = workflows[i];
+        if (w->engine->has_ready_task() && (next == NULL ||
+                    w->active / w->weight < next->active / next->weight)) {
+            next = w;
+        }
+    }
+    if (next == NULL) {
+        return NULL;
+    }
+    Task *task = next->engine->next_ready_task();
+    next->active += task_share(task);
+    return task;
+}
+
+void Master::queue_ready_tasks() {
+    vector<Task *> cached;
+    ready_queue.set_time(comm->clock());
+    while (true) {
+        Task *task;
+        while ((task = next_ready_task()) != NULL) {
+
+            // The tasks of a parameter sweep get their arguments when
+            // they are ready
+            workflow_of(task)->dag->expand(task);
+
+            // Assign a submit sequence number to this task
+            task->submit_seq = this->task_submit_seq++;
+
+            if (result_cache != NULL && replay_cached_result(task)) {
+                cached.push_back(task);
+                continue;
+            }
+
+            if (config.estimate_resources) {
+                estimate_resources(task);
+            }
+            if (config.overcommit_memory > 0) {
+                overcommit_memory(task);
+            }
+
+            if (!categories.empty() && throttle_task(task)) {
+                continue;
+            }
+
+            queue_task(task);
+        }
+
+        if (cached.empty()) {
+            break;
+        }
+
+        // The replayed data has to be written before the tasks are
+        // committed to the rescue log. Finishing them can make more
+        // tasks ready, which may also be in the cache.
+        fdcache->flush();
+        for (unsigned i = 0; i < cached.size(); i++) {
+            task = cached[i];
+            if (fdcache->pending(task->name)) {
+                // Held up by a task that is streaming to the same file
+                PendingResult result;
+                result.task = task;
+                result.exitcode = 0;
+                result.rank = 0;
+                result.runtime = 0.0;
+                pending_results.push_back(result);
+            } else {
+                finish_task(task, 0, 0, 0.0);
+            }
+        }
+        cached.clear();
+    }
+}
+
+void Master::queue_task(Task *task) {
+    log_debug("Queueing task %s", task->name.c_str());
+
+    ready_queue.push(task);
+    if (tracer != NULL) {
+        queued_times[task] = current_time();
+    }
+
+    publish_event(TASK_QUEUED, task);
+}
+
+/*
+ * Take the MAXJOBS limits of the categories from the DAGs, and from
+ * --max-jobs, which overrides them. If several DAGs limit the same
+ * category, then the lowest limit is used.
+ */
+void Master::set_category_limits() {
+    map<string, unsigned> limits;
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        map<string, unsigned> &maxjobs = workflows[i]->dag->maxjobs;
+        for (map<string, unsigned>::iterator m = maxjobs.begin(); m != maxjobs.end(); m++) {
+            map<string, unsigned>::iterator l = limits.find(m->first);
+            if (m->second > 0 && (l == limits.end() || m->second < l->second)) {
+                limits[m->first] = m->second;
+            }
+        }
+    }
+    for (map<string, unsigned>::iterator m = config.max_jobs.begin(); 
+            m != config.max_jobs.end(); m++) {
+        limits[m->first] = m->second;
+    }
+
+    for (map<string, unsigned>::iterator l = limits.begin(); l != limits.end(); l++) {
+        Category &category = categories[l->first];
+        if (category.limit != l->second) {
+            log_debug("Category %s is limited to %u tasks", l->first.c_str(), l->second);
+            category.limit = l->second;
+            admit_throttled(&category);
+        }
+    }
+}
+
+/* The category of a task that has a limit, or NULL */
+Category *Master::task_category(Task *task) {
+    const string *name = task->category != NULL ? task->category : task->transformation;
+    if (name == NULL) {
+        return NULL;
+    }
+    map<string, Category>::iterator c = categories.find(*name);
+    if (c == categories.end() || c->second.limit == 0) {
+        return NULL;
+    }
+    return &c->second;
+}
+
+/*
+ * Count a ready task against the limit of its category, or hold it in
+ * the queue of the category if the limit has been reached. Returns true
+ * if the task is held.
+ */
+bool Master::throttle_task(Task *task) {
+    Category *category = task_category(task);
+    if (category == NULL) {
+        return false;
+    }
+    if (category->active < category->limit) {
+        category->active++;
+        return false;
+    }
+
+    log_trace("Task %s is held by the limit of its category", task->name.c_str());
+    category->throttled.push(task);
+    throttled_count++;
+
+    // The task does not count against the share of its workflow until
+    // it is queued
+    Workflow *w = workflow_of(task);
+    w->active -= std::min(w->active, task_share(task));
+    return true;
+}
+
+/* Let the next task of the category of a finished task be queued */
+void Master::release_category(Task *task) {
+    Category *category = task_category(task);
+    if (category == NULL) {
+        return;
+    }
+    if (category->active > 0) {
+        category->active--;
+    }
+    admit_throttled(category);
+}
+
+/* Queue the highest priority tasks of the category up to its limit */
+void Master::admit_throttled(Category *category) {
+    while ((category->limit == 0 || category->active < category->limit) &&
+            !category->throttled.empty()) {
+        Task *task = category->throttled.top();
+        category->throttled.pop();
+        category->active++;
+        workflow_of(task)->active += task_share(task);
+        queue_task(task);
+    }
+}
+
+/*
+ * Look up the result of a task in the result cache. If it is there, then
+ * the I/O data that the task forwarded when it ran is written again and
+ * the task does not run. Otherwise, the key of the task is saved so that
+ * its result can be stored when it succeeds.
+ */
+bool Master::replay_cached_result(Task *task) {
+    string key;
+    if (!result_cache->key(task, key)) {
+        return false;
+    }
+
+    vector<CachedOutput> outputs;
+    if (!result_cache->lookup(task, key, outputs)) {
+        cache_keys[task] = key;
+        cache_outputs.erase(task);
+        return false;
+    }
+
+    log_debug("Task %s found in the result cache", task->name.c_str());
+    for (unsigned i = 0; i < outputs.size(); i++) {
+        CachedOutput &output = outputs[i];
+        fdcache->enqueue(iodata_filename(output.filename, task->name), task->name,
+                output.data.data(), output.data.size(), -1);
+    }
+    return true;
+}
+
+/* Keep the I/O data of tasks that can be cached until they finish */
+void Master::capture_iodata(IODataMessage *mesg) {
+    Task *task = find_task(mesg->task);
+    if (cache_keys.find(task) == cache_keys.end()) {
+        return;
+    }
+    vector<CachedOutput> &outputs = cache_outputs[task];
+    if (!outputs.empty() && outputs.back().filename == mesg->filename) {
+        outputs.back().data.append(mesg->data, mesg->size);
+    } else {
+        outputs.push_back(CachedOutput(mesg->filename, string(mesg->data, mesg->size)));
+    }
+}
 
-    // Mark slot as free
-    free_slots.push_back(slot);
+/* Store the result of a task in the cache if it succeeded on a worker */
+void Master::cache_result(Task *task, int exitcode, int rank) {
+    map<Task *, string>::iterator k = cache_keys.find(task);
+    if (k == cache_keys.end()) {
+        return;
+    }
+    if (exitcode == 0 && rank != 0) {
+        result_cache->store(k->second, cache_outputs[task]);
+    }
+    cache_keys.erase(k);
+    cache_outputs.erase(task);
 }
 
-void Master::merge_all_task_stdio() {
-    // If we have per task stdio we don't need to merge the outputs
-    if (per_task_stdio) {
+/*
+ * With --overcommit-memory, a task with -m reserves the peak memory used
+ * by the earlier tasks of its transformation, times the safety margin, if
+ * that is less than what it asked for. The reservation is also the limit
+ * of the cgroup of the task on the worker. A task that went over it is
+ * given the memory it asked for when it is queued again.
+ */
+void Master::overcommit_memory(Task *task) {
+    // An estimate is not a request that could be reduced
+    if (estimated_memory.find(task) != estimated_memory.end()) {
         return;
     }
-    
-    log_info("Merging task stdio from workers...");
-    
-    FILE *task_stdout = stdout;
-    FILE *task_stderr = stderr;
-    
-    // Open task stdout
-    if (outfile == "stdout") {
-        task_stdout = stdout;
-    } else {
-        task_stdout = fopen(this->outfile.c_str(), "w");
-        if (task_stdout == NULL) {
-            myfailures("Unable to open stdout file: %s\n", this->outfile.c_str());
-        }
+    map<Task *, unsigned>::iterator o = overcommitted.find(task);
+    unsigned requested = o != overcommitted.end() ? o->second : task->memory;
+    if (requested == 0) {
+        return;
     }
-    
-    // Open task stderr
-    if (errfile == "stderr") {
-        task_stderr = stderr;
-    } else if (errfile == outfile) {
-        task_stderr = task_stdout;
-    } else {
-        task_stderr = fopen(this->errfile.c_str(), "w");
-        if (task_stderr == NULL) {
-            myfailures("Unable to open stderr file: %s\n", this->outfile.c_str());
+    if (oom_killed.find(task) != oom_killed.end()) {
+        task->memory = requested;
+        if (o != overcommitted.end()) {
+            overcommitted.erase(o);
         }
+        return;
     }
-    
-    char rankstr[10];
-    for (int i=1; i<=numworkers; i++) {
-        log_debug("Merging stdio from worker %d...", i);
 
-        sprintf(rankstr, "%d", i);
-        
-        string task_outfile = this->dagfile + ".out." + rankstr;
-        this->merge_task_stdio(task_stdout, task_outfile, "stdout");
-        
-        string task_errfile = this->dagfile + ".err." + rankstr;
-        this->merge_task_stdio(task_stderr, task_errfile, "stderr");
+    map<const string *, TaskHistory>::iterator h = task_history.find(history_key(task));
+    if (h == task_history.end() || h->second.memory == 0) {
+        return;
     }
-    
-    if (fileno(task_stdout) > 2) {
-        fclose(task_stdout);
+    unsigned reservation = (unsigned)ceil(h->second.memory * config.overcommit_memory);
+    if (reservation >= requested) {
+        return;
     }
-    
-    if (fileno(task_stderr) > 2) {
-        fclose(task_stderr);
+
+    if (o == overcommitted.end()) {
+        overcommitted[task] = requested;
+        overcommit_count++;
     }
+    log_trace("Reserving %u MB of the %u MB requested by task %s", reservation,
+            requested, task->name.c_str());
+    task->memory = reservation;
 }
 
-void Master::merge_task_stdio(FILE *dest, const string &srcfile, const string &stream) {
-    log_trace("Merging %s file: %s", stream.c_str(), srcfile.c_str());
-    
-    FILE *src = fopen(srcfile.c_str(), "r");
-    if (src == NULL) {
-        // The file may not exist if the worker didn't run any tasks, just print a warning
-        if (errno == ENOENT) {
-            log_warn("No %s file: %s", stream.c_str(), srcfile.c_str());
-            return;
-        } else {
-            myfailures("Unable to open task %s file: %s", stream.c_str(), srcfile.c_str());
-        }
+void Master::check_can_run(Task *task) {
+    ResourceClass rc(task);
+    if (feasible_classes.count(rc) > 0) {
+        return;
     }
-    
-    char buf[BUFSIZ];
-    while (1) {
-        int r = fread(buf, 1, BUFSIZ, src);
-        if (r < 0) {
-            myfailures("Error reading source file: %s", srcfile.c_str());
-        }
-        if (r == 0) {
-            break;
+
+    // Group the hosts by size the first time
+    if (host_classes.empty()) {
+        for (unsigned h=0; h<hosts.size(); h++) {
+            Host *host = hosts[h];
+            if (unusable_hosts.count(host) > 0) {
+                continue;
+            }
+            ResourceClass size;
+            size.cpus = host->total_cpus();
+            size.memory = host->total_memory();
+            size.gpus = host->total_gpus();
+            host_classes[size]++;
         }
-        int w = fwrite(buf, 1, r, dest);
-        if (w < r) {
-            myfailures("Error writing to dest file");
+    }
+
+    // Check all the sizes of hosts for enough that can run the task
+    unsigned capable = 0;
+    map<ResourceClass, unsigned>::iterator c;
+    for (c = host_classes.begin(); c != host_classes.end(); c++) {
+        const ResourceClass &size = c->first;
+        if (size.cpus >= rc.cpus && size.memory >= rc.memory && size.gpus >= rc.gpus) {
+            capable += c->second;
+            if (capable >= rc.hosts) {
+                feasible_classes.insert(rc);
+                return;
+            }
         }
     }
     
-    fclose(src);
-    
-    if (unlink(srcfile.c_str())) {
-        myfailures("Unable to delete task %s file: %s", stream.c_str(), srcfile.c_str());
+    // There were not enough hosts found that were capable of executing
+    // the task, so we must abort
+    if (task->hosts > 1) {
+        myfailure("FATAL ERROR: Task %s needs %u hosts, but only %u can run it",
+            task->name.c_str(), task->hosts, capable);
     }
+    myfailure("FATAL ERROR: No host is capable of running task %s", 
+        task->name.c_str());
 }
 
-void Master::write_cluster_summary(bool failed) {
-    // pegasus cluster output - used for provenance
-    char date[32];
-    iso2date(start_time, date, sizeof(date));
-    
-    char summary[BUFSIZ];
-    sprintf(summary, "[cluster-summary stat=\"%s\", tasks=%u, submitted=%u, succeeded=%u, failed=%u, extra=0,"
-                 " start=\"%s\", duration=%.3f, pid=%d, app=\"%s\", runtime=%.3f, slots=%d, cpus=%u]\n",
-                 failed ? "failed" : "ok", 
-                 this->dag->size(),
-                 this->submitted_count,
-                 this->success_count, 
-                 this->failed_count,
-                 date,
-                 wall_time,
-                 getpid(),
-                 this->program.c_str(),
-                 total_runtime,
-                 this->numworkers,
-                 this->total_cpus);
-    
-    int len = strlen(summary);
-
-    // XXX This should probably be written to the task_stdout, but for most
-    // pegasus workflows task_stdout = stdout
-    int w = fwrite(summary, 1, len, stdout);
-    if (w < len) {
-        myfailures("Error writing cluster-summary");
+void Master::count_readers(Task *task) {
+    if (task->intermediates != NULL && config.staging_dir.empty()) {
+        myfailure("Task %s has intermediate files, but there is no --staging-dir",
+                task->name.c_str());
+    }
+    if (task->inputs != NULL) {
+        for (unsigned i = 0; i < task->inputs->size(); i++) {
+            readers[(*task->inputs)[i]]++;
+        }
     }
 }
 
 /*
- * Register all workers, create hosts, create slots. Assign a host-centric 
- * rank to each of the workers. The worker with the lowest global rank on 
- * each host is given host rank 0, the next lowest is given host rank 1, 
- * and so on. The master is not given a host rank.
+ * Find the intermediate files that the task reads that are not on the
+ * host of the worker, and the workers they can be copied from
  */
-void Master::register_workers() {
-    typedef map<string, Host *> HostMap;
-    HostMap hostmap;
-    
-    typedef map<int, string> HostnameMap;
-    HostnameMap hostnames;
-    
-    // Collect host names from all workers, create host objects
-    for (int i=0; i<numworkers; i++) {
-        
-        RegistrationMessage *msg = dynamic_cast<RegistrationMessage *>(comm->recv_message());
-        if (msg == NULL) {
-            myfailure("Expected registration message");
+void Master::stage_inputs(Task *task, int rank, vector<string> &paths, vector<int> &ranks) {
+    if (task->inputs == NULL || staged_files.empty()) {
+        return;
+    }
+    Host *host = worker_hosts[rank-1];
+    for (unsigned i = 0; i < task->inputs->size(); i++) {
+        const string *path = (*task->inputs)[i];
+        map<const string *, StagedFile>::iterator s = staged_files.find(path);
+        if (s == staged_files.end()) {
+            continue;
         }
-        int rank = msg->source;
-        string hostname = msg->hostname;
-        unsigned int memory = msg->memory;
-        unsigned int threads = msg->threads;
-        unsigned int cores = msg->cores;
-        unsigned int sockets = msg->sockets;
-        delete msg;
-
-        hostnames[rank] = hostname;
+        StagedFile &file = s->second;
+        if (file.host == host) {
+            continue;
+        }
+        log_debug("Task %s needs %s from worker %d", task->name.c_str(), 
+                path->c_str(), file.rank);
+        paths.push_back(*path);
+        ranks.push_back(file.rank);
 
-        if (hostmap.find(hostname) == hostmap.end()) {
-            // If the host is not found, create a new one
-            log_debug("Got new host: name=%s, mem=%u, threads/cpus=%u, cores=%u, sockets=%u",
-                    hostname.c_str(), memory, threads, cores, sockets);
-            Host *newhost = new Host(hostname, memory, threads, cores, sockets);
-            hosts.push_back(newhost);
-            hostmap[hostname] = newhost;
-        } else {
-            // Otherwise, increment the number of slots available
-            Host *host = hostmap[hostname];
-            host->add_slot();
+        // The worker skips files that are already on its host, so the
+        // copy is recorded now for deleting it later
+        if (file.copies.find(host) == file.copies.end()) {
+            file.copies[host] = rank;
         }
-        
-        log_debug("Slot %d on host %s", rank, hostname.c_str());
     }
-    
-    typedef map<string, int> RankMap;
-    RankMap ranks;
-    
-    // Create slots, assign a host rank to each worker
-    for (int rank=1; rank<=numworkers; rank++) {
-        string hostname = hostnames.find(rank)->second;
-        
-        // Find host
-        Host *host = hostmap.find(hostname)->second;
-        
-        // Create new slot
-        Slot *slot = new Slot(rank, host);
-        slots.push_back(slot);
-        free_slots.push_back(slot);
-        
-        // Compute hostrank for this slot
-        RankMap::iterator nextrank = ranks.find(hostname);
-        int hostrank = 0;
-        if (nextrank != ranks.end()) {
-            hostrank = nextrank->second;
-        }
-        ranks[hostname] = hostrank + 1;
-        
-        HostrankMessage hrmsg(hostrank);
-        comm->send_message(&hrmsg, rank);
-        
-        log_debug("Host rank of worker %d is %d", rank, hostrank);
+}
+
+/* Record the intermediate files that a task left on its host */
+void Master::stage_outputs(Task *task, Host *host, int rank) {
+    if (task->intermediates == NULL) {
+        return;
     }
-    
-    // Log the initial resource freeability
-    for (vector<Host *>::iterator i = hosts.begin(); i!=hosts.end(); i++) {
-        Host *host = *i;
-        host->log_resources(resource_log);
+    for (unsigned i = 0; i < task->intermediates->size(); i++) {
+        const string *path = (*task->intermediates)[i];
+        StagedFile &file = staged_files[path];
+        file.rank = rank;
+        file.host = host;
+        file.readers = readers[path];
+        file.copies[host] = rank;
+        log_debug("Intermediate file %s is on host %s", path->c_str(), host->name());
+        if (file.readers == 0) {
+            unstage_file(path);
+        }
     }
 }
 
-void Master::schedule_tasks() {
-    log_debug("Scheduling %d tasks on %d slots...", 
-        ready_queue.size(), free_slots.size());
-
-    int scheduled = 0;
-    TaskList deferred_tasks;
-
-    while (ready_queue.size() > 0 && free_slots.size() > 0) {
-        Task *task = ready_queue.top();
-        ready_queue.pop();
-
-        log_trace("Scheduling task %s", task->name.c_str());
-
-        bool match = false;
+/* Delete the intermediate files that no other task needs */
+void Master::release_inputs(Task *task) {
+    if (task->inputs == NULL || staged_files.empty()) {
+        return;
+    }
+    for (unsigned i = 0; i < task->inputs->size(); i++) {
+        const string *path = (*task->inputs)[i];
+        map<const string *, StagedFile>::iterator s = staged_files.find(path);
+        if (s == staged_files.end()) {
+            continue;
+        }
+        if (s->second.readers > 0) {
+            s->second.readers--;
+        }
+        if (s->second.readers == 0) {
+            unstage_file(path);
+        }
+    }
+}
 
-        for (SlotList::iterator s = free_slots.begin(); s != free_slots.end(); s++) {
-            Slot *slot = *s;
-            Host *host = slot->host;
+void Master::unstage_file(const string *path) {
+    map<const string *, StagedFile>::iterator s = staged_files.find(path);
+    log_debug("Deleting intermediate file %s", path->c_str());
+    vector<string> paths(1, *path);
+    for (map<Host *, int>::iterator c = s->second.copies.begin(); 
+            c != s->second.copies.end(); c++) {
+        // This is not ordered with the commands, so it doesn't need to go
+        // through the sub-master
+        comm->send_message_async(new UnstageMessage(paths), c->second);
+    }
+    staged_files.erase(s);
+}
 
-            // If the task fits, schedule it
-            if (host->can_run(task)) {
+/*
+ * Shut down the workers that have been idle for --release-idle seconds
+ * when no tasks are waiting for a slot, so that a long tail of the
+ * workflow doesn't hold on to idle hosts
+ */
+void Master::release_workers() {
+    release_time = 0.0;
 
-                log_trace("Matched task %s to slot %d on host %s", 
-                    task->name.c_str(), slot->rank, host->name());
+    // More tasks could arrive from the stream at any time
+    if (!ready_queue.empty() || (dag_stream != NULL && !dag_stream->ended())) {
+        return;
+    }
 
-                // Reserve the resources
-                vector<cpu_t> bindings = host->allocate_resources(task);
-                host->log_resources(resource_log);
+    double now = current_time();
+    for (int rank = 1; rank <= numworkers; rank++) {
+        if (released[rank-1] || worker_hosts[rank-1]->submaster() == rank) {
+            continue;
+        }
 
-                submit_task(task, slot->rank, bindings);
+        bool idle = true;
+        for (unsigned s = 0; s < config.worker_slots; s++) {
+            Slot *slot = slots[(rank-1) * config.worker_slots + s];
+            if (slot->task != NULL || slot->cancelled) {
+                idle = false;
+            }
+        }
+        if (!idle) {
+            idle_since[rank-1] = 0.0;
+            continue;
+        }
+        if (idle_since[rank-1] == 0.0) {
+            idle_since[rank-1] = now;
+        }
 
-                s = free_slots.erase(s);
+        double deadline = idle_since[rank-1] + config.release_idle;
+        if (now < deadline) {
+            if (release_time == 0.0 || deadline < release_time) {
+                release_time = deadline;
+            }
+            continue;
+        }
 
-                // so that the s++ in the loop doesn't skip one
-                s--;
+        if (can_release(rank)) {
+            release_worker(rank, now - idle_since[rank-1]);
+        }
+    }
+}
 
-                match = true;
-                scheduled += 1;
+/* Check that the workflow can still finish without the worker */
+bool Master::can_release(int rank) {
+    // Keep at least one worker
+    unsigned active = 0;
+    for (int r = 1; r <= numworkers; r++) {
+        if (!released[r-1] && worker_hosts[r-1]->submaster() != r) {
+            active++;
+        }
+    }
+    if (active <= 1) {
+        return false;
+    }
 
-                // This is to break out of the slot loop so that we can 
-                // consider the next task
-                break;
+    // Other workers need the intermediate files of this one
+    map<const string *, StagedFile>::iterator f;
+    for (f = staged_files.begin(); f != staged_files.end(); f++) {
+        if (f->second.rank == rank) {
+            return false;
+        }
+        map<Host *, int>::iterator c;
+        for (c = f->second.copies.begin(); c != f->second.copies.end(); c++) {
+            if (c->second == rank) {
+                return false;
             }
         }
+    }
 
-        if (!match) {
-            // If the task could not be scheduled, then we save it 
-            // and move on to the next one. It will be requeued later.
-            log_trace("No slot found for task %s", task->name.c_str());
-            deferred_tasks.push_back(task);
+    Host *host = worker_hosts[rank-1];
+    if (host->total_slots() > config.worker_slots) {
+        // The host script of the host runs until its first worker exits
+        return !has_host_script || worker_host_ranks[rank-1] != 0;
+    }
+
+    // The last worker on a host can only go if another host can run
+    // anything it can run
+    for (unsigned h = 0; h < hosts.size(); h++) {
+        Host *other = hosts[h];
+        if (other != host && other->total_slots() > 0 &&
+                other->total_cpus() >= host->total_cpus() &&
+                other->total_memory() >= host->total_memory() &&
+                other->total_gpus() >= host->total_gpus()) {
+            return true;
         }
     }
+    return false;
+}
 
-    log_debug("Scheduled %d tasks and deferred %d tasks", scheduled, deferred_tasks.size());
+void Master::release_worker(int rank, double idle) {
+    Host *host = worker_hosts[rank-1];
+    log_info("Releasing worker %d on host %s after %.1f idle seconds",
+            rank, host->name(), idle);
 
-    // Requeue all the deferred tasks
-    for (TaskList::iterator t = deferred_tasks.begin(); t != deferred_tasks.end(); t++) {
-        ready_queue.push(*t);
+    // The host is not in the index while its slots change, and it
+    // stays out of it once it has no slots left
+    free_hosts.remove(host);
+    for (unsigned s = 0; s < config.worker_slots; s++) {
+        Slot *slot = slots[(rank-1) * config.worker_slots + s];
+        host->remove_idle_slot(slot);
+        host->remove_slot();
+        free_slots--;
+        close_idle(slot);
+    }
+    if (host->total_slots() > 0) {
+        free_hosts.insert(host);
+    } else {
+        log_info("Host %s has no workers left", host->name());
     }
-}
 
-void Master::queue_ready_tasks() {
-    while (this->engine->has_ready_task()) {
-        Task *task = this->engine->next_ready_task();
+    ShutdownMessage shmsg;
+    comm->send_message(&shmsg, rank);
 
-        log_debug("Queueing task %s", task->name.c_str());
-        
-        // Assign a submit sequence number to this task
-        task->submit_seq = this->task_submit_seq++;
-        
-        ready_queue.push(task);
-        
-        publish_event(TASK_QUEUED, task);
+    released[rank-1] = true;
+    released_count++;
+}
+
+/* Delete the intermediate files of tasks that failed or never ran */
+void Master::unstage_all() {
+    map<int, vector<string> > paths;
+    map<const string *, StagedFile>::iterator s;
+    for (s = staged_files.begin(); s != staged_files.end(); s++) {
+        for (map<Host *, int>::iterator c = s->second.copies.begin(); 
+                c != s->second.copies.end(); c++) {
+            paths[c->second].push_back(*s->first);
+        }
     }
+    for (map<int, vector<string> >::iterator p = paths.begin(); p != paths.end(); p++) {
+        comm->send_message_async(new UnstageMessage(p->second), p->first);
+    }
+    staged_files.clear();
 }
 
 int Master::run() {
@@ -858,6 +4925,9 @@ int Master::run() {
     
     start_time = current_time();
 
+    if (config.event_interval > 0 && !events.empty()) {
+        events.start(config.event_interval);
+    }
     publish_event(WORKFLOW_START, NULL);
     
     // Install signal handlers
@@ -877,56 +4947,144 @@ int Master::run() {
         log_info("Setting max walltime to %lf minutes", this->max_wall_time);
         alarm((unsigned)ceil(max_wall_time * 60.0));
     }
+    if (config.wall_time_margin > 0) {
+        drain_deadline = start_time + (max_wall_time - config.wall_time_margin) * 60.0;
+    }
     
+    open_task_stdio();
+
     register_workers();
     
     // Check to make sure that there is at least one host capable
     // of executing every task
-    for (DAG::iterator t = dag->begin(); t != dag->end(); t++){
-        Task *task = (*t).second;
-        
-        // Check all the hosts for one that can run the task
-        bool match = false;
-        for (unsigned h=0; h<hosts.size(); h++) {
-            Host *host = hosts[h];
-            if (host->can_run(task)) {
-                match = true;
-                break;
-            }
-        }
-        
-        if (!match) {
-            // There was no host found that was capable of executing the
-            // task, so we must abort
-            myfailure("FATAL ERROR: No host is capable of running task %s", 
-                task->name.c_str());
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        DAG *d = workflows[i]->dag;
+        for (DAG::iterator t = d->begin(); t != d->end(); t++) {
+            check_can_run(*t);
+            count_readers(*t);
         }
     }
     
-    // If there is a host script, wait here for it to run
-    if (has_host_script) {
-        comm->barrier();
+    set_category_limits();
+
+    if (config.broadcast_dag) {
+        broadcast_task_table();
+    }
+
+    if (!config.broadcast_files.empty()) {
+        broadcast_files();
     }
     
+    // Results are received and decoded in the background while the
+    // master schedules tasks and writes their output
+    if (config.recv_thread) {
+        if (comm->supports_threads()) {
+            receiver = new ThreadedCommunicator(comm);
+            receiver->start();
+            comm = receiver;
+        } else {
+            log_warn("MPI does not support threads, ignoring --recv-thread");
+        }
+    }
+
     log_info("Starting workflow");
     double makespan_start = current_time();
+    if (!config.status_file.empty()) {
+        write_status();
+    }
     // Keep executing tasks until the workflow is finished or the master
     // needs to abort the workflow due to a signal being caught
-    while (!this->engine->is_finished() && !ABORT) {
+    while (!workflows_finished() && !ABORT) {
+        read_dag_stream();
         queue_ready_tasks();
-        schedule_tasks();
+        if (quarantine_time > 0 && current_time() >= quarantine_time) {
+            end_quarantines();
+        }
+        if (host_ready_deadline > 0 && current_time() >= host_ready_deadline) {
+            check_pending_hosts();
+        }
+        // The rest of the tasks may have been found in the result cache
+        if (workflows_finished()) {
+            break;
+        }
+        // When the wall time is almost up, no more tasks are started and
+        // the master exits when the running tasks have finished, so that
+        // their results are in the rescue log for the next run
+        if (drain_deadline > 0 && current_time() >= drain_deadline) {
+            unsigned busy = busy_slots();
+            if (!wall_draining) {
+                log_warn("Wall time is almost up, waiting for %u running tasks", busy);
+                wall_draining = true;
+            }
+            if (busy == 0) {
+                break;
+            }
+        } else {
+            double schedule_start = current_time();
+            schedule_tasks();
+            schedule_times.observe(current_time() - schedule_start);
+        }
+        if (config.release_idle > 0) {
+            release_workers();
+        }
+        wait_for_results();
+        commit_pending_results();
+        send_io_credits();
+        trace_commits();
+        if (status_time > 0 && current_time() >= status_time) {
+            write_status();
+        }
+    }
+
+    // Wait for the workers to kill the copies of tasks that were cancelled
+    while (cancelled_slots > 0 && !ABORT) {
         wait_for_results();
+        send_io_credits();
+    }
+    if (receiver != NULL) {
+        receiver->stop();
     }
 	double makespan_finish = current_time();
+
+    // Count the time of the slots up to the end of the workflow
+    for (unsigned i = 0; i < slots.size(); i++) {
+        Slot *slot = slots[i];
+        if (slot->idle) {
+            close_idle(slot);
+        } else if (slot->busy_since > 0) {
+            slot->busy_time += idle_clock_time - slot->busy_since;
+            slot->busy_since = 0.0;
+        }
+    }
+
+    // Make sure the rescue file is up to date, especially if the
+    // workflow was aborted because the wall time was exceeded
+    flush_rescue();
+    trace_commits();
+    close_trace();
     
+    bool drained = wall_draining && !workflows_finished();
     if (ABORT) {
         log_error("Aborting workflow");
+    } else if (drained) {
+        log_error("Workflow stopped before the wall time, %u ready tasks were not started",
+                ready_queue.size());
     } else {
         log_info("Workflow finished");
     }
     
-    if (this->engine->max_failures_reached()) {
-        log_error("Max failures reached: DAG prematurely aborted");
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        Workflow *w = workflows[i];
+        if (workflows.size() > 1) {
+            const char *state = "did not finish";
+            if (w->engine->is_finished()) {
+                state = w->engine->is_failed() ? "failed" : "succeeded";
+            }
+            log_info("Workflow %s %s", w->name.c_str(), state);
+        }
+        if (w->engine->max_failures_reached()) {
+            log_error("Max failures reached: DAG prematurely aborted");
+        }
     }
     
     // This must be done before write_cluster_summary so that the
@@ -940,8 +5098,9 @@ int Master::run() {
     fdcache->close();
     
     // Compute resource utilization
-    double master_util = total_runtime / (wall_time * (numworkers+1));
-    double worker_util = total_runtime / (wall_time * numworkers);
+    unsigned worker_slots = numworkers * config.worker_slots;
+    double master_util = total_runtime / (wall_time * (worker_slots+1));
+    double worker_util = total_runtime / (wall_time * worker_slots);
     if (total_runtime <= 0) {
         master_util = 0.0;
         worker_util = 0.0;
@@ -950,30 +5109,96 @@ int Master::run() {
     log_info("Resource utilization (with master): %lf", master_util);
     log_info("Resource utilization (without master): %lf", worker_util);
     log_info("Total runtime of tasks: %lf seconds (%lf minutes)", total_runtime, total_runtime/60.0);
+    log_info("Total CPU time of tasks: %lf seconds", total_cpu_time);
+    if (launch_count > 0) {
+        log_info("Average task launch time: %lf seconds", total_launch/launch_count);
+    }
     log_info("Wall time: %lf seconds (%lf minutes)", wall_time, wall_time/60.0);
+    log_info("Master CPU time: %lf seconds", cpu_time());
     log_info("Makespan: %lf seconds (%lf minutes)", makespan, makespan/60.0);
     log_info("Throughput: %lf tasks/second", success_count/makespan);
     log_info("Bytes sent to workers: %lu", comm->sent());
     log_info("Bytes received from workers: %lu", comm->recvd());
     log_info("File descriptor cache hit rate: %lf", fdcache->hitrate());
+    log_utilization();
+    if (locality_tasks > 0) {
+        log_info("Tasks run on the host that wrote their inputs: %u of %u",
+                locality_hits, locality_tasks);
+    }
+    if (released_count > 0) {
+        log_info("Workers released while idle: %u of %d", released_count, numworkers);
+    }
+    if (bundle_count > 0) {
+        log_info("Tasks sent in bundles: %u in %u bundles", bundled_tasks, bundle_count);
+    }
+    if (config.estimate_resources) {
+        log_info("Tasks with estimated resources: %u, %u ran out of memory",
+                estimated_tasks, estimate_oom_retries);
+    }
+    if (config.overcommit_memory > 0) {
+        log_info("Tasks with overcommitted memory: %u, %u ran out of memory",
+                overcommit_count, oom_retries);
+    }
+    if (gang_count > 0 || drain_count > 0) {
+        log_info("Tasks that ran on several hosts: %u, hosts were drained %u times",
+                gang_count, drain_count);
+    }
+    if (throttled_count > 0) {
+        log_info("Tasks held by the limits of their categories: %lu", throttled_count);
+    }
+    if (starvation_count > 0) {
+        log_info("Starving tasks that hosts were drained for: %u, waited %lf seconds for the hosts",
+                starvation_count, starvation_wait);
+    }
+    if (iodata_stall > 0) {
+        log_info("Workers waited %lf seconds for I/O credit", iodata_stall);
+    }
+    if (direct_count > 0) {
+        log_info("Forwarded files written directly by workers: %u tasks, %llu bytes",
+                direct_count, direct_bytes);
+    }
+    if (quarantine_count > 0) {
+        log_info("Hosts quarantined: %u times", quarantine_count);
+    }
+    if (result_cache != NULL) {
+        log_info("Tasks found in the result cache: %u of %u, %u results stored",
+                result_cache->hits, result_cache->hits + result_cache->misses,
+                result_cache->stored);
+    }
+
+    if (!config.status_file.empty()) {
+        write_status();
+    }
+    if (!config.utilization_file.empty()) {
+        write_utilization();
+    }
 
-    bool failed = ABORT || this->engine->is_failed();
+    bool failed = ABORT || drained;
+    for (unsigned i = 0; i < workflows.size(); i++) {
+        failed = failed || workflows[i]->engine->is_failed();
+    }
     write_cluster_summary(failed);
     
-    if (!per_task_stdio) merge_all_task_stdio();
+    if (!per_task_stdio && config.rank_stdio) merge_all_task_stdio();
+
+    unstage_all();
     
     log_info("Sending workers shutdown messages...");
     for (int i=1; i<=numworkers; i++) {
+        if (released[i-1]) {
+            continue;
+        }
         log_debug("Sending shutdown message to worker %d", i);
-        ShutdownMessage shmsg;
-        comm->send_message(&shmsg, i);
+        comm->send_message_async(new ShutdownMessage(), i);
     }
+    comm->wait_for_sends();
     
     if (failed) {
         publish_event(WORKFLOW_FAILURE, NULL);
     } else {
         publish_event(WORKFLOW_SUCCESS, NULL);
     }
+    events.stop();
     
     if (ABORT) {
         myfailure("Workflow aborted");
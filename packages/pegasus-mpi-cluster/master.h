@@ -4,56 +4,211 @@
 #include <list>
 #include <vector>
 #include <map>
+#include <set>
+#include <bitset>
+#include <pthread.h>
 
 #include "engine.h"
 #include "dag.h"
 #include "protocol.h"
 #include "comm.h"
+#include "threadcomm.h"
 #include "fdcache.h"
+#include "resourcelog.h"
+#include "tracer.h"
+#include "resultcache.h"
 
 using std::string;
 using std::vector;
 using std::priority_queue;
 using std::list;
 using std::map;
+using std::set;
+using std::pair;
+
+class Slot;
+
+typedef list<Slot *> SlotList;
+typedef list<Task *> TaskList;
+
+// A set of CPUs on a host. cpu_t limits hosts to 256 CPUs.
+typedef std::bitset<256> CPUSet;
 
 class Host {
 private:
-    Task **cpus;
+    // The CPUs that are not bound to a task, and the ones bound to each task
+    CPUSet cpus_unbound;
+    map<Task *, vector<cpu_t> > allocations;
+
+    // The CPUs of each core and socket, and the cores of each socket
+    vector<CPUSet> core_cpus;
+    vector<CPUSet> socket_cpus;
+    vector<vector<cpu_t> > socket_cores;
+
+    // GPUs are always allocated to the tasks that request them
+    vector<bool> gpus_unbound;
+    map<Task *, vector<cpu_t> > gpu_allocations;
 
     string host_name;
     unsigned int memory;
     cpu_t threads;
     cpu_t cores;
     cpu_t sockets;
+    cpu_t gpus;
     unsigned int slots;
+    // Capacity of the staging area in MB
+    unsigned int staging;
 
     unsigned int memory_free;
     unsigned int cpus_free;
+    unsigned int gpus_free;
     unsigned int slots_free;
 
+    SlotList idle_slots;
+
+    // Rank of the sub-master that relays messages for this host, or 0
+    int submaster_rank;
+
+    // Position of the host in the order hosts registered, for first-fit
+    unsigned int host_index;
+
+    // Id of the host in the resource log, assigned when it is first logged
+    uint32_t log_id;
+    bool log_registered;
+
+    // Results of the tasks run on the host, and when it comes out of
+    // quarantine, or 0 if it is not quarantined
+    unsigned int failures_in_row;
+    unsigned int task_failures;
+    unsigned int task_successes;
+    double quarantine_until;
+
+    // False until the host script of the host has finished
+    bool host_ready;
+
+    bool find_cpus_in_socket(cpu_t socket, unsigned count, CPUSet &result);
+    bool find_cpus(unsigned count, CPUSet &result, PlacementPolicy policy);
 public:
-    Host(const string &host_name, unsigned int memory, cpu_t threads, cpu_t cores, cpu_t sockets);
+    Host(const string &host_name, unsigned int memory, cpu_t threads, cpu_t cores, cpu_t sockets,
+            const vector<cpu_t> &cpu_cores = vector<cpu_t>(), 
+            const vector<cpu_t> &cpu_sockets = vector<cpu_t>(), cpu_t gpus = 0,
+            unsigned int staging = 0);
     ~Host();
     const char *name() { return host_name.c_str(); }
+    unsigned int free_memory() { return memory_free; }
+    unsigned int free_cpus() { return cpus_free; }
+    unsigned int free_gpus() { return gpus_free; }
+    unsigned int free_slots() { return slots_free; }
+    unsigned int total_memory() { return memory; }
+    unsigned int total_cpus() { return threads; }
+    unsigned int total_gpus() { return gpus; }
+    unsigned int total_slots() { return slots; }
+    unsigned int staging_capacity() { return staging; }
     void add_slot();
+    void remove_slot();
+    int submaster() { return submaster_rank; }
+    void set_submaster(int rank) { submaster_rank = rank; }
+    unsigned int index() { return host_index; }
+    void set_index(unsigned int index) { host_index = index; }
+    void add_idle_slot(Slot *slot);
+    void remove_idle_slot(Slot *slot);
+    Slot *take_idle_slot();
+    bool has_idle_slot() { return !idle_slots.empty(); }
     bool can_run(Task *task);
-    vector<cpu_t> allocate_resources(Task *task);
+    vector<cpu_t> allocate_resources(Task *task, PlacementPolicy policy = PLACEMENT_PACK);
     void release_resources(Task *task);
-    void log_resources(FILE *resource_log);
+    void transfer_resources(Task *from, Task *to);
+    vector<cpu_t> bindings(Task *task);
+    vector<cpu_t> gpu_bindings(Task *task);
+    void log_resources(ResourceLog *resource_log, PlacementPolicy policy = PLACEMENT_DEFAULT);
+    void record_success();
+    unsigned int record_failure();
+    unsigned int failures() { return task_failures; }
+    unsigned int successes() { return task_successes; }
+    void quarantine(double until) { quarantine_until = until; }
+    void end_quarantine();
+    bool quarantined() { return quarantine_until > 0; }
+    double quarantine_end() { return quarantine_until; }
+    bool ready() { return host_ready; }
+    void set_ready(bool ready) { host_ready = ready; }
 };
 
+/* Why a slot is idle, for the utilization breakdown */
+typedef enum {
+    IDLE_DISPATCH,  // Some ready tasks fit, but have not been sent yet
+    IDLE_NO_WORK,   // No task is ready
+    IDLE_BLOCKED,   // No ready task fits in the free resources of any host
+    IDLE_REASONS
+} IdleReason;
+
 class Slot {
 public:
     unsigned int rank;
     Host *host;
+    // The position of the slot in its worker, from 0 to --worker-slots
+    unsigned int index;
+
+    // The task currently running in this slot, and when it was submitted
+    Task *task;
+    double start;
+
+    // Tasks that were sent to the slot in the same batch as task and
+    // will run after it, in order
+    TaskList queued;
+    // Set when the task was cancelled because a copy of it finished
+    // first. The slot is busy until the worker has killed the task.
+    bool cancelled;
+
+    // Time the slot was busy, and idle for each reason. While the slot
+    // is idle, idle_mark has the idle clocks of the master when it
+    // became idle.
+    double busy_time;
+    double busy_since;
+    double idle_time[IDLE_REASONS];
+    double idle_mark[IDLE_REASONS];
+    bool idle;
     
     Slot(unsigned int rank, Host *host) {
         this->rank = rank;
         this->host = host;
+        this->index = 0;
+        this->task = NULL;
+        this->start = 0.0;
+        this->cancelled = false;
+        this->busy_time = 0.0;
+        this->busy_since = 0.0;
+        for (int i = 0; i < IDLE_REASONS; i++) {
+            this->idle_time[i] = 0.0;
+            this->idle_mark[i] = 0.0;
+        }
+        this->idle = false;
     }
 };
 
+/*
+ * Index of hosts that have at least one idle slot and are not in
+ * quarantine. Hosts are bucketed by the number of free CPUs and, within
+ * each bucket, ordered by the amount of free memory so that a host that
+ * can run a task is found without scanning every idle slot. A host must
+ * be removed from the index before its resources change and re-inserted
+ * afterwards.
+ */
+class ResourceIndex {
+private:
+    typedef set<pair<unsigned int, Host *> > MemoryBucket;
+    typedef map<unsigned int, MemoryBucket> CPUBuckets;
+
+    CPUBuckets buckets;
+    map<Host *, pair<unsigned int, unsigned int> > keys;
+
+public:
+    void insert(Host *host);
+    void remove(Host *host);
+    Host *find(Task *task, PlacementPolicy policy = PLACEMENT_PACK);
+    bool empty() { return keys.empty(); }
+    unsigned size() { return keys.size(); }
+};
+
 class TaskPriority {
 public:
     bool operator ()(const Task *x, const Task *y){
@@ -71,9 +226,63 @@ typedef enum {
     TASK_FAILURE
 } WorkflowEvent;
 
+/*
+ * A workflow event with a copy of the task fields that listeners use,
+ * so that the event can be handled after the task has moved on
+ */
+class WorkflowEventRecord {
+public:
+    WorkflowEvent event;
+    double timestamp;
+    string task;
+    unsigned submit_seq;
+    int exitcode;
+    // Where the task ran and what it used, if the event is about a
+    // task that was submitted to or finished on a worker
+    int rank;
+    string host;
+    double runtime;
+    TaskUsage usage;
+
+    WorkflowEventRecord(WorkflowEvent event, Task *task);
+};
+
 class WorkflowEventListener {
 public:
-    virtual void on_event(WorkflowEvent event, Task *task) = 0;
+    virtual ~WorkflowEventListener() {}
+    virtual void on_event(const WorkflowEventRecord &record) = 0;
+    // Called after each batch of events has been delivered
+    virtual void flush() {}
+};
+
+/*
+ * Delivers workflow events to the listeners. Once start() is called,
+ * events are queued by publish() and handed to the listeners in batches
+ * by a separate thread, which wakes up at least every interval ms, so
+ * that writing the logs does not slow down the master. Otherwise the
+ * events are delivered by publish() itself.
+ */
+class EventPublisher {
+    list<WorkflowEventListener *> listeners;
+    unsigned interval;
+    bool running;
+    bool stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    vector<WorkflowEventRecord> queued;
+
+    static void *thread_main(void *arg);
+    void run_thread();
+    void deliver(const vector<WorkflowEventRecord> &records);
+public:
+    EventPublisher();
+    ~EventPublisher();
+    void add_listener(WorkflowEventListener *l);
+    bool empty() { return listeners.empty(); }
+    void start(unsigned interval);
+    void publish(const WorkflowEventRecord &record);
+    void stop();
 };
 
 class JobstateLog : public WorkflowEventListener {
@@ -86,7 +295,8 @@ private:
 public:
     JobstateLog(const string &path);
     ~JobstateLog();
-    void on_event(WorkflowEvent event, Task *task);
+    void on_event(const WorkflowEventRecord &record);
+    void flush();
 };
 
 class DAGManLog : public WorkflowEventListener {
@@ -100,16 +310,264 @@ private:
 public:
     DAGManLog(const string &logpath, const string &dagpath);
     ~DAGManLog();
-    void on_event(WorkflowEvent event, Task *task);
+    void on_event(const WorkflowEventRecord &record);
+    void flush();
+};
+
+/*
+ * Writes workflow events to PATH as length-prefixed binary records, so
+ * that monitoring tools do not have to parse the text of jobstate.log.
+ * If PATH is a Unix domain socket, then the events are sent to whoever
+ * is listening on it, otherwise they are appended to the file. Each run
+ * starts with a magic number. Each record is a 32-bit length followed
+ * by that many bytes: the fixed fields of EventStreamRecord, the name
+ * of the task and the name of its host. New fields will only be added
+ * after the host, so readers should skip what is left of the record.
+ * Use convert() to turn the stream into text.
+ */
+class EventStream : public WorkflowEventListener {
+private:
+    string path;
+    int fd;
+    bool socket;
+    string buffer;
+
+    void open();
+    void close();
+public:
+    EventStream(const string &path);
+    ~EventStream();
+    void on_event(const WorkflowEventRecord &record);
+    void flush();
+    static int convert(const string &path, FILE *out);
 };
 
 typedef priority_queue<Task *, vector<Task *>, TaskPriority> TaskQueue;
 
-typedef list<Slot *> SlotList;
-typedef list<Task *> TaskList;
+/* Tasks in the same class have identical CPU, memory and GPU requirements */
+class ResourceClass {
+public:
+    cpu_t cpus;
+    unsigned memory;
+    cpu_t gpus;
+    unsigned hosts;
+
+    ResourceClass() : cpus(0), memory(0), gpus(0), hosts(1) {}
+    ResourceClass(Task *task) : cpus(task->cpus), memory(task->memory), gpus(task->gpus), 
+        hosts(task->hosts) {}
+    bool operator<(const ResourceClass &other) const;
+};
+
+/* The priority of the first task in a class, and the class */
+typedef pair<int, ResourceClass> ClassHead;
+
+/* Orders class heads by priority, highest first, then by class */
+class ClassHeadOrder {
+public:
+    bool operator ()(const ClassHead &x, const ClassHead &y) const {
+        if (x.first != y.first) {
+            return x.first > y.first;
+        }
+        return x.second < y.second;
+    }
+};
+
+/*
+ * When a class of ready tasks started waiting, the number of aging
+ * intervals it has waited since, or AGE_STARVING once it has waited for
+ * the starvation time, and when that changes next, or -1 if it doesn't
+ */
+#define AGE_STARVING -1
+
+class ClassAge {
+public:
+    double since;
+    int age;
+    double next;
+
+    ClassAge() : since(0.0), age(0), next(-1.0) {}
+};
+
+/* When a starving class started waiting, and the class */
+typedef pair<double, ResourceClass> StarvingHead;
+
+/*
+ * Ready queue split by resource class. If no host can currently satisfy
+ * a class, then the class is blocked and skipped as a whole until a host
+ * with enough free resources is released, which avoids popping and
+ * re-pushing every deferred task on each scheduling cycle.
+ *
+ * Classes age while none of their tasks are started: their priority
+ * goes up by one for every aging interval since the class last started
+ * a task, or since its first task was queued, and once they have waited
+ * for the starvation time they go before all the other classes, the one
+ * that has waited the longest first.
+ *
+ * The heads of the classes are kept in order of priority after aging so
+ * that top() and first() do not have to look at every class, of which
+ * there can be thousands when tasks ask for different amounts of memory.
+ * A class is only moved when its age changes, which happens at most
+ * once per aging interval, and starving classes are kept apart in the
+ * order they started waiting.
+ */
+class ReadyQueue {
+private:
+    map<ResourceClass, TaskQueue> classes;
+    set<ResourceClass> blocked;
+    set<ClassHead, ClassHeadOrder> heads;
+    set<ClassHead, ClassHeadOrder> blocked_heads;
+    set<StarvingHead> starving_heads;
+    set<StarvingHead> blocked_starving;
+    ResourceClass current;
+    unsigned count;
+
+    // The age of each waiting class, when the age of a class changes
+    // next, and the time of the current scheduling cycle
+    map<ResourceClass, ClassAge> ages;
+    set<pair<double, ResourceClass> > deadlines;
+    double aging_interval;
+    double starvation_time;
+    double now;
+
+    bool aging() { return aging_interval > 0 || starvation_time > 0; }
+    void schedule(const ResourceClass &rc, ClassAge &age);
+    void refresh();
+    void unlink(const ResourceClass &rc, TaskQueue &queue);
+    void link(const ResourceClass &rc, TaskQueue &queue);
+
+public:
+    ReadyQueue() : count(0), aging_interval(0.0), starvation_time(0.0), now(0.0) {}
+    void set_aging(double interval, double starvation);
+    void set_time(double now) { this->now = now; }
+    void push(Task *task);
+    Task *top();
+    Task *first();
+    void pop();
+    Task *pop_current();
+    Task *pop_class(const ResourceClass &rc);
+    void block();
+    void unblock(Host *host);
+    unsigned size() { return count; }
+    unsigned blocked_size();
+    bool empty() { return count == 0; }
+    void started(Task *task);
+    bool starving(Task *task);
+    double waiting_time(Task *task);
+};
+
+/* A result that has been received but not committed */
+class PendingResult {
+public:
+    Task *task;
+    int exitcode;
+    int rank;
+    double runtime;
+};
+
+/*
+ * The observed runtimes and peak memory of the tasks that run one
+ * transformation, or one executable if the tasks have no transformation
+ */
+class TaskHistory {
+public:
+    double total;
+    unsigned count;
+    // Largest resident set size of any of the tasks in MB
+    unsigned memory;
+
+    TaskHistory() : total(0.0), count(0), memory(0) {}
+    double average() const { return count > 0 ? total / count : 0.0; }
+};
+
+/* An --intermediate file in the staging area of the host that wrote it */
+class StagedFile {
+public:
+    // The worker that wrote the file, and its host
+    int rank;
+    Host *host;
+    // The number of tasks that read the file and have not finished yet
+    unsigned readers;
+    // A worker on each host that has a copy of the file
+    map<Host *, int> copies;
+
+    StagedFile() : rank(0), host(NULL), readers(0) {}
+};
+
+/*
+ * A region of a --direct-forwards file that a worker is writing, and the
+ * number of bytes of it that the worker sent to the master instead
+ */
+class DirectRegion {
+public:
+    unsigned long long size;
+    unsigned long long relayed;
+    bool committed;
+
+    DirectRegion(unsigned long long size) : size(size), relayed(0), committed(false) {}
+};
+
+/*
+ * A file that workers write directly with --direct-forwards. Regions
+ * are reserved at the end of the file in the order they are requested.
+ * The file is complete up to the committed offset, which only moves past
+ * a region when all the regions before it have been written.
+ */
+class DirectFile {
+public:
+    unsigned long long end;
+    unsigned long long committed;
+    map<unsigned long long, DirectRegion> regions;
+
+    DirectFile() : end(0), committed(0) {}
+};
+
+/*
+ * A category of tasks with a limit on how many of them can be queued or
+ * running at the same time, like the MAXJOBS of DAGMan. Tasks over the
+ * limit wait in the queue of the category instead of the ready queue, so
+ * that the scheduler does not skip them over and over.
+ */
+class Category {
+public:
+    unsigned limit;
+    unsigned active;
+    TaskQueue throttled;
+
+    Category() : limit(0), active(0) {}
+};
+
+/*
+ * One of the DAGs run by the master. Each workflow has its own engine,
+ * rescue file and task stdout/stderr, and gets a share of the slots in
+ * proportion to its weight.
+ */
+class Workflow {
+public:
+    string name;
+    DAG *dag;
+    Engine *engine;
+    double weight;
+    string outfile;
+    string errfile;
+
+    // Where the stdout/stderr of the tasks of this workflow are written
+    string task_stdout;
+    string task_stderr;
+
+    // CPUs used by the tasks of this workflow that are queued or running
+    unsigned active;
+
+    Workflow(const string &name, DAG *dag, Engine *engine,
+            const string &outfile, const string &errfile) :
+        name(name), dag(dag), engine(engine), weight(1.0),
+        outfile(outfile), errfile(errfile), active(0) {}
+};
 
 class Master {
     Communicator *comm;
+
+    // Receives messages in the background with --recv-thread
+    ThreadedCommunicator *receiver;
     
     string program;
     string dagfile;
@@ -117,16 +575,29 @@ class Master {
     string errfile;
     DAG *dag;
     Engine *engine;
+    DAGStream *dag_stream;
+
+    // The DAGs that run in this allocation. The first one is dag, which
+    // is the only one that can be streamed or broadcast.
+    vector<Workflow *> workflows;
     
-    FILE *resource_log;
+    ResourceLog *resource_log;
     
     vector<Slot *> slots;
     vector<Host *> hosts;
-    SlotList free_slots;
-    TaskQueue ready_queue;
+    // The host of each worker, by rank-1
+    vector<Host *> worker_hosts;
+    ResourceIndex free_hosts;
+    unsigned free_slots;
+    ReadyQueue ready_queue;
     
     int numworkers;
     double max_wall_time;
+
+    // With --wall-time-margin, when the master stops starting tasks and
+    // waits for the running ones to finish before the wall time is up
+    double drain_deadline;
+    bool wall_draining;
     
     unsigned submitted_count;
     unsigned success_count;
@@ -134,8 +605,24 @@ class Master {
     
     unsigned total_cpus;
     double total_runtime;
+    double total_launch;
+    unsigned launch_count;
     
     bool has_host_script;
+
+    // With a host script, the hosts whose script has not finished yet,
+    // the ones where it failed, when the master stops waiting for the
+    // rest, and whether a host became ready while waiting for results
+    set<Host *> pending_hosts;
+    set<Host *> unusable_hosts;
+
+    // The number of usable hosts of each size, and the resource classes
+    // that enough of them can run. Tasks are checked by class, so that
+    // startup does not compare every task with every host.
+    map<ResourceClass, unsigned> host_classes;
+    set<ResourceClass> feasible_classes;
+    double host_ready_deadline;
+    bool hosts_changed;
     
     double start_time;
     double finish_time;
@@ -144,22 +631,271 @@ class Master {
     FDCache *fdcache;
     
     bool per_task_stdio;
+
+    // Backfill reservation for the highest priority task that does not fit
+    Host *reserved_host;
+    double reserved_until;
     
-    list<WorkflowEventListener *> listeners;
+    EventPublisher events;
     unsigned task_submit_seq;
+    // Usage of the tasks whose results are waiting to be committed, for
+    // the events published when they finish
+    map<Task *, TaskUsage> task_usage;
+
+    // Messages waiting to be sent to each sub-master in one batch
+    map<int, vector<Message *> > batch_messages;
+    map<int, vector<int> > batch_ranks;
+
+    // Number of tasks in the task table that was broadcast to the workers
+    unsigned broadcast_tasks;
+
+    // Results that are waiting for their I/O data to be written
+    vector<PendingResult> pending_results;
+
+    // Set when chunks of I/O data arrive, so that the workers that sent
+    // them get credit to send more
+    bool io_credits_due;
+
+    // Chunks of I/O data sent by tasks that are still running, by task
+    // name, and the credits owed for them
+    map<string, vector<IORecord *> > provisional_io;
+    map<int, unsigned> provisional_credits;
+
+    // Tasks that have a speculative copy, and how many of their copies
+    // are still running. The I/O data of each copy is held, by rank and
+    // task name, until one of the copies wins.
+    map<Task *, unsigned> copies;
+    map<pair<int, string>, vector<IORecord *> > held_io;
+    unsigned cancelled_slots;
+
+    // Tasks that sent chunks of I/O data, which can't be held back, so
+    // they are not copied
+    set<string> streamed;
+
+    // Runtimes of the tasks that succeeded, for finding stragglers
+    vector<double> runtimes;
+    double median;
+    unsigned median_count;
+
+    // When the next running task becomes a straggler, or 0
+    double speculate_time;
+
+    // The host that wrote each --output file, when each task was first
+    // held back to wait for the host that has its inputs, and when the
+    // next of those tasks can run anywhere, or 0
+    map<const string *, Host *> file_hosts;
+    map<Task *, double> locality_waits;
+    double locality_time;
+    unsigned locality_tasks;
+    unsigned locality_hits;
+
+    // The number of tasks that read each --input file, and the
+    // intermediate files that are in the staging areas of the hosts
+    map<const string *, unsigned> readers;
+    map<const string *, StagedFile> staged_files;
+
+    // When each worker last became idle, or 0 if it is busy, and the
+    // workers that were shut down because they were idle too long. The
+    // host rank of each worker is kept so that the worker that runs the
+    // host script is the last one released on its host.
+    vector<double> idle_since;
+    vector<bool> released;
+    vector<int> worker_host_ranks;
+    unsigned released_count;
+    double release_time;
+
+    // The runtimes and memory of the tasks that succeeded, for estimating
+    // the resources of tasks without -r and -m, and the number of tasks
+    // that were given estimates with --estimate-resources. The memory of
+    // estimated tasks is not a limit, and those killed for lack of memory
+    // are run again without an estimate.
+    map<const string *, TaskHistory> task_history;
+    unsigned estimated_tasks;
+    set<Task *> estimated_memory;
+    unsigned estimate_oom_retries;
+    double total_cpu_time;
+
+    // With --overcommit-memory, the -m of the tasks whose reservation was
+    // reduced, the tasks that went over the reduced reservation, which
+    // are run again with their -m, and the number of times that happened.
+    // Tasks with estimated memory that were killed are in oom_killed too.
+    map<Task *, unsigned> overcommitted;
+    set<Task *> oom_killed;
+    unsigned overcommit_count;
+    unsigned oom_retries;
+    unsigned bundled_tasks;
+    unsigned bundle_count;
+
+    // The slots of the running tasks that need several hosts, starting
+    // with the slot that launches the task. While drain_task is set, it
+    // is the highest priority ready task and does not fit yet, so no
+    // other tasks are started until enough hosts are free for it.
+    map<Task *, vector<Slot *> > gang_slots;
+    Task *drain_task;
+    unsigned gang_count;
+    unsigned drain_count;
+
+    // With --starvation-time, the task that a host was last reserved for
+    // because it was starving and when that was, the number of starving
+    // tasks that hosts were reserved for, and how long they waited for
+    // the host. The ready tasks left waiting are added up over all the
+    // scheduling cycles.
+    Task *starving_task;
+    double starving_since;
+    unsigned starvation_count;
+    double starvation_wait;
+    unsigned long deferred_cycles;
+
+    // With --quarantine, the hosts each task failed on, which the task
+    // avoids when it is retried, the number of times hosts were put in
+    // quarantine, and when the next quarantine ends
+    map<Task *, set<Host *> > failed_hosts;
+    unsigned quarantine_count;
+    double quarantine_time;
+
+    // With --result-cache, the key of each queued task that can be
+    // cached, and the I/O data it has forwarded so far
+    ResultCache *result_cache;
+    map<Task *, string> cache_keys;
+    map<Task *, vector<CachedOutput> > cache_outputs;
+
+    // The categories with a MAXJOBS limit, and the number of tasks that
+    // had to wait for the limit
+    map<string, Category> categories;
+    unsigned long throttled_count;
+
+    // With --direct-forwards, the files that workers write directly, the
+    // regions reserved by each task that may not be complete yet, the
+    // tasks whose regions were sent to the master and are written by the
+    // FDCache, and the files written through the master, which can't be
+    // written directly too
+    map<string, DirectFile> direct_files;
+    map<string, vector<pair<string, unsigned long long> > > direct_regions;
+    set<string> relayed_regions;
+    set<string> forwarded_files;
+    unsigned long long direct_bytes;
+    unsigned direct_count;
+
+    // Counters for the status file, and when it is written next
+    Histogram schedule_times;
+    map<int, unsigned long> messages_received;
+    unsigned long iodata_bytes;
+    double iodata_stall;
+    double status_time;
+
+    // Total time spent in each reason for idle slots, when the clocks
+    // were last advanced, and the reason since then. The idle time of a
+    // slot for each reason is the difference of these clocks between
+    // when it became idle and when it became busy.
+    double idle_clock[IDLE_REASONS];
+    double idle_clock_time;
+    IdleReason idle_reason;
+
+    // When each ready task was queued, and the tasks that finished but
+    // may not be committed to the rescue log yet, for --trace
+    Tracer *tracer;
+    map<Task *, double> queued_times;
+    vector<pair<Task *, double> > uncommitted;
     
     void register_workers();
+    void check_can_run(Task *task);
+    void count_readers(Task *task);
+    void stage_inputs(Task *task, int rank, vector<string> &paths, vector<int> &ranks);
+    void stage_outputs(Task *task, Host *host, int rank);
+    void release_inputs(Task *task);
+    void unstage_file(const string *path);
+    void unstage_all();
+    void release_workers();
+    bool can_release(int rank);
+    void release_worker(int rank, double idle);
+    void read_dag_stream();
+    void broadcast_task_table();
+    void broadcast_files();
     void schedule_tasks();
+    void prefetch_tasks();
+    double speculate_tasks();
+    Host *local_host(Task *task);
+    double median_runtime();
+    double estimated_runtime(Task *task);
+    const string *history_key(Task *task);
+    void record_usage(Task *task, ResultMessage *mesg);
+    void write_invocation(Task *task, ResultMessage *mesg);
+    void estimate_resources(Task *task);
+    void overcommit_memory(Task *task);
+    Host *find_copy_host(Slot *slot);
+    PlacementPolicy placement(Task *task);
+    double drain_time(Host *host, Task *task);
+    void reserve_host(Task *task);
+    void clear_reservation();
+    bool can_backfill(Task *task);
     void wait_for_results();
+    unsigned process_message(Message *mesg);
     void process_result(ResultMessage *mesg);
     void process_iodata(IODataMessage *mesg);
+    string iodata_filename(const string &filename, const string &task);
+    bool hold_iodata(IODataMessage *mesg);
+    bool resolve_copies(Task *task, ResultMessage *mesg);
+    void drop_held_iodata(int rank, Task *task);
+    void process_provisional_iodata(IODataMessage *mesg);
+    void discard_provisional_iodata(Task *task);
+    void commit_pending_results();
+    void reserve_regions(ReserveMessage *mesg);
+    void commit_regions(CommitMessage *mesg);
+    bool relay_region(IODataMessage *mesg, const string &filename);
+    void commit_region(const string &filename, unsigned long long offset);
+    void commit_relayed_regions();
+    bool direct_pending(Task *task);
+    void send_io_credits();
+    void send_to_worker(Message *mesg, int rank);
+    Slot *find_slot(int rank, Task *task);
+    void finish_task(Task *task, int exitcode, int rank, double runtime);
+    void release_slot(Slot *slot, Task *task);
+    void tick_idle_clock();
+    void slot_idle(Slot *slot);
+    void slot_busy(Slot *slot);
+    void close_idle(Slot *slot);
+    void log_utilization();
+    void write_utilization();
+    bool schedule_gang(Task *task);
+    Host *find_host(Task *task, PlacementPolicy policy);
+    void record_health(Host *host, Task *task, int exitcode);
+    void end_quarantines();
+    void host_ready(ReadyMessage *mesg);
+    void check_pending_hosts();
+    bool finishes_in_time(Task *task);
+    unsigned busy_slots();
+    void release_gang(Task *task);
     void queue_ready_tasks();
-    void submit_task(Task *t, int worker, const vector<cpu_t> &bindings);
+    void queue_task(Task *task);
+    void set_category_limits();
+    Category *task_category(Task *task);
+    bool throttle_task(Task *task);
+    void release_category(Task *task);
+    void admit_throttled(Category *category);
+    Task *next_ready_task();
+    Task *find_task(const string &name);
+    Workflow *workflow_of(Task *task) { return workflows[task->workflow]; }
+    bool workflows_finished();
+    double rescue_flush_time();
+    void flush_rescue();
+    bool replay_cached_result(Task *task);
+    void capture_iodata(IODataMessage *mesg);
+    void cache_result(Task *task, int exitcode, int rank);
+    void submit_tasks(const TaskList &tasks, int worker, const vector<cpu_t> &bindings,
+            const vector<cpu_t> &gpu_bindings, bool copy = false);
+    void flush_batches();
+    void open_task_stdio();
+    void open_task_stdio(Workflow *w);
     void merge_all_task_stdio();
-    void merge_task_stdio(FILE *dest, const string &src, const string &stream);
+    void merge_task_stdio(const string &dest, const vector<string> &srcfiles, const string &stream);
     void write_cluster_summary(bool failed);
+    void write_status();
+    void trace_result(ResultMessage *mesg, Task *task);
+    void trace_commits();
+    void close_trace();
 
-    void publish_event(WorkflowEvent event, Task *task);
+    void publish_event(WorkflowEvent event, Task *task, int rank = 0,
+            double runtime = 0.0);
     bool wall_time_exceeded();
 public:
     Master(Communicator *comm, const string &program, Engine &engine, DAG &dag, const string &dagfile, 
@@ -169,6 +905,10 @@ public:
     ~Master();
     int run();
     void add_listener(WorkflowEventListener *l);
+    void set_dag_stream(DAGStream *stream);
+    void add_workflow(DAG &dag, Engine &engine, const string &outfile,
+            const string &errfile);
+    void set_weight(unsigned workflow, double weight);
 };
 
 #endif /* MASTER_H */
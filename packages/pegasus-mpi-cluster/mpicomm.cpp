@@ -1,5 +1,12 @@
 /* mpi.h must come before stdio.h for Intel MPI */
 #include <mpi.h>
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef HAS_ZLIB
+#include <zlib.h>
+#endif
 
 #include "mpicomm.h"
 #include "protocol.h"
@@ -7,30 +14,287 @@
 #include "tools.h"
 #include "log.h"
 
-MPICommunicator::MPICommunicator(int *argc, char ***argv) {
-    MPI_Init(argc, argv);
+/*
+ * If threads is true, then MPI is asked to allow calls from different
+ * threads, which it might not support
+ */
+MPICommunicator::MPICommunicator(int *argc, char ***argv, bool threads) {
+    if (threads) {
+        MPI_Init_thread(argc, argv, MPI_THREAD_SERIALIZED, &thread_level);
+    } else {
+        MPI_Init(argc, argv);
+        thread_level = MPI_THREAD_SINGLE;
+    }
     MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_ARE_FATAL);
     MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
     MPI_Comm_size(MPI_COMM_WORLD, &mysize);
     bytes_sent = 0;
     bytes_recvd = 0;
     sleep_on_recv = true;
+    max_recv_sleep = DEFAULT_MAX_RECV_SLEEP;
+    compress_threshold = 0;
 }
 
 MPICommunicator::~MPICommunicator() {
+    wait_for_sends();
     MPI_Finalize();
 }
 
+/*
+ * If message is at least compress_threshold bytes, then compress it into
+ * a buffer from alloc_buffer(), which starts with the size of the
+ * message. The compressed size is stored in size. Returns NULL if the
+ * message is too small, or if it does not get any smaller. The buffer
+ * can be freed with the compressed size because it is never larger
+ * than the buffer that was allocated.
+ */
+char *MPICommunicator::compress(Message *message, unsigned *size) {
+#ifdef HAS_ZLIB
+    if (compress_threshold == 0 || message->msgsize < compress_threshold) {
+        return NULL;
+    }
+
+    uLongf zsize = compressBound(message->msgsize);
+    unsigned bufsize = sizeof(unsigned) + zsize;
+    char *buffer = alloc_buffer(bufsize);
+    memcpy(buffer, &message->msgsize, sizeof(unsigned));
+    int rc = compress2((Bytef *)(buffer + sizeof(unsigned)), &zsize,
+            (const Bytef *)message->msg, message->msgsize, Z_BEST_SPEED);
+    if (rc != Z_OK || sizeof(unsigned) + zsize >= message->msgsize) {
+        free_buffer(buffer, bufsize);
+        return NULL;
+    }
+
+    *size = sizeof(unsigned) + zsize;
+    log_trace("Rank %d: Compressed %u byte message to %u bytes",
+              myrank, message->msgsize, *size);
+    return buffer;
+#else
+    return NULL;
+#endif
+}
+
+/* Replace the compressed message in msg with the original message */
+static char *decompress(char *msg, unsigned *msgsize) {
+#ifdef HAS_ZLIB
+    unsigned size;
+    if (*msgsize < sizeof(unsigned)) {
+        myfailure("Invalid compressed message");
+    }
+    memcpy(&size, msg, sizeof(unsigned));
+    char *buffer = alloc_buffer(size);
+    uLongf dsize = size;
+    int rc = uncompress((Bytef *)buffer, &dsize, (const Bytef *)(msg + sizeof(unsigned)),
+            *msgsize - sizeof(unsigned));
+    if (rc != Z_OK || dsize != size) {
+        myfailure("Unable to decompress message: %d", rc);
+    }
+    free_buffer(msg, *msgsize);
+    *msgsize = size;
+    return buffer;
+#else
+    myfailure("Received a compressed message, but compression is not supported");
+    return NULL;
+#endif
+}
+
 void MPICommunicator::send_message(Message *message, int dest) {
     char *msg = message->msg;
     unsigned msgsize = message->msgsize;
     int tag = message->tag();
 
+    char *compressed = compress(message, &msgsize);
+    if (compressed != NULL) {
+        msg = compressed;
+        tag |= COMPRESSED_TAG;
+    }
+
     log_trace("Rank %d: Sending %d byte message of type %d to %d",
               myrank, msgsize, tag, dest);
 
     MPI_Send(msg, msgsize, MPI_CHAR, dest, tag, MPI_COMM_WORLD);
     bytes_sent += msgsize;
+
+    free_buffer(compressed, msgsize);
+}
+
+/*
+ * Send a message without waiting for the transfer to finish. The
+ * communicator takes ownership of message and deletes it when the send
+ * completes. If there are too many sends in flight, then this blocks
+ * until one of them completes. Messages sent to the same rank are
+ * received in the order they were sent, whether they were sent with
+ * send_message or send_message_async.
+ */
+void MPICommunicator::send_message_async(Message *message, int dest) {
+    if (send_requests.size() >= MAX_PENDING_SENDS) {
+        progress_sends(true);
+    }
+
+    char *msg = message->msg;
+    unsigned msgsize = message->msgsize;
+    int tag = message->tag();
+
+    char *compressed = compress(message, &msgsize);
+    if (compressed != NULL) {
+        msg = compressed;
+        tag |= COMPRESSED_TAG;
+    }
+
+    log_trace("Rank %d: Sending %d byte message of type %d to %d asynchronously",
+              myrank, msgsize, tag, dest);
+
+    MPI_Request request;
+    MPI_Isend(msg, msgsize, MPI_CHAR, dest, tag, MPI_COMM_WORLD, &request);
+    bytes_sent += msgsize;
+
+    send_requests.push_back(request);
+    send_messages.push_back(message);
+    send_buffers.push_back(std::make_pair(compressed, msgsize));
+}
+
+/*
+ * Free the messages for all the asynchronous sends that have completed.
+ * If block is true, then wait for at least one send to complete.
+ */
+void MPICommunicator::progress_sends(bool block) {
+    if (send_requests.empty()) {
+        return;
+    }
+
+    int count = send_requests.size();
+    int outcount = 0;
+    vector<int> indices(count);
+    if (block) {
+        MPI_Waitsome(count, &send_requests[0], &outcount, &indices[0], MPI_STATUSES_IGNORE);
+    } else {
+        MPI_Testsome(count, &send_requests[0], &outcount, &indices[0], MPI_STATUSES_IGNORE);
+    }
+    if (outcount <= 0) {
+        return;
+    }
+
+    for (int i = 0; i < outcount; i++) {
+        delete send_messages[indices[i]];
+        send_messages[indices[i]] = NULL;
+        free_buffer(send_buffers[indices[i]].first, send_buffers[indices[i]].second);
+    }
+
+    // Remove the completed sends, keeping the rest in order
+    unsigned j = 0;
+    for (unsigned i = 0; i < send_requests.size(); i++) {
+        if (send_messages[i] != NULL) {
+            send_requests[j] = send_requests[i];
+            send_messages[j] = send_messages[i];
+            send_buffers[j] = send_buffers[i];
+            j++;
+        }
+    }
+    send_requests.resize(j);
+    send_messages.resize(j);
+    send_buffers.resize(j);
+}
+
+/* Wait for all the asynchronous sends to complete */
+void MPICommunicator::wait_for_sends() {
+    while (!send_requests.empty()) {
+        progress_sends(true);
+    }
+}
+
+/*
+ * Send message from root to all the other ranks. All ranks must call
+ * this. The root passes the message to send and gets NULL back, the
+ * other ranks pass NULL and get back the message they received.
+ */
+Message *MPICommunicator::broadcast_message(Message *message, int root) {
+    unsigned header[2] = {0, 0};
+    if (myrank == root) {
+        header[0] = message->tag();
+        header[1] = message->msgsize;
+    }
+    MPI_Bcast(header, 2, MPI_UNSIGNED, root, MPI_COMM_WORLD);
+
+    int tag = header[0];
+    unsigned msgsize = header[1];
+    char *msg = (myrank == root) ? message->msg : alloc_buffer(msgsize);
+
+    log_trace("Rank %d: Broadcasting %u byte message of type %d from %d",
+              myrank, msgsize, tag, root);
+
+    for (unsigned off = 0; off < msgsize; off += MAX_BROADCAST_CHUNK) {
+        int count = std::min(msgsize - off, (unsigned)MAX_BROADCAST_CHUNK);
+        MPI_Bcast(msg + off, count, MPI_CHAR, root, MPI_COMM_WORLD);
+    }
+
+    if (myrank == root) {
+        bytes_sent += msgsize;
+        return NULL;
+    }
+
+    bytes_recvd += msgsize;
+    return create_message(tag, msg, msgsize, root);
+}
+
+/*
+ * Collect a message from every rank at root. All ranks must call this.
+ * The other ranks pass the message to send and get back an empty list,
+ * and the root passes NULL and gets back the message from each rank,
+ * indexed by rank, with NULL for itself.
+ */
+vector<Message *> MPICommunicator::gather_messages(Message *message, int root) {
+    int header[2] = {0, 0};
+    if (myrank != root) {
+        header[0] = message->tag();
+        header[1] = message->msgsize;
+    }
+
+    vector<int> headers;
+    if (myrank == root) {
+        headers.resize(2 * mysize);
+    }
+    MPI_Gather(header, 2, MPI_INT, myrank == root ? &headers[0] : NULL, 2, MPI_INT,
+            root, MPI_COMM_WORLD);
+
+    vector<int> counts;
+    vector<int> displs;
+    vector<char> data;
+    if (myrank == root) {
+        counts.resize(mysize);
+        displs.resize(mysize);
+        int total = 0;
+        for (int r = 0; r < mysize; r++) {
+            counts[r] = headers[2 * r + 1];
+            displs[r] = total;
+            total += counts[r];
+        }
+        data.resize(std::max(total, 1));
+    }
+
+    log_trace("Rank %d: Gathering %d byte message of type %d at %d",
+              myrank, header[1], header[0], root);
+
+    MPI_Gatherv(myrank == root ? NULL : message->msg, header[1], MPI_CHAR,
+            myrank == root ? &data[0] : NULL, myrank == root ? &counts[0] : NULL,
+            myrank == root ? &displs[0] : NULL, MPI_CHAR, root, MPI_COMM_WORLD);
+
+    vector<Message *> messages;
+    if (myrank != root) {
+        bytes_sent += header[1];
+        return messages;
+    }
+
+    messages.resize(mysize, NULL);
+    for (int r = 0; r < mysize; r++) {
+        if (r == root) {
+            continue;
+        }
+        char *msg = alloc_buffer(counts[r]);
+        memcpy(msg, &data[displs[r]], counts[r]);
+        messages[r] = create_message(headers[2 * r], msg, counts[r], r);
+        bytes_recvd += counts[r];
+    }
+    return messages;
 }
 
 Message *MPICommunicator::recv_message(double timeout) {
@@ -53,51 +317,64 @@ Message *MPICommunicator::recv_message(double timeout) {
     // Get the size of the message and allocate a buffer for it
     int msgsize = 0;
     MPI_Get_count(&status, MPI_CHAR, &msgsize);
-    char *msg = new char[msgsize];
+    char *msg = alloc_buffer(msgsize);
 
     log_trace("Rank %d: Receiving %d byte message of type %d from %d",
               myrank, msgsize, tag, source);
 
     // Recieve the message
+#ifdef HAVE_MATCHED_PROBE
+    MPI_Mrecv(msg, msgsize, MPI_CHAR, &matched, &status);
+#else
     MPI_Recv(msg, msgsize, MPI_CHAR, source, tag, MPI_COMM_WORLD, &status);
+#endif
     bytes_recvd += msgsize;
 
-    // Create the right type of message
-    Message *message = NULL;
-    MessageType type = (MessageType)tag;
-    switch(type) {
-        case SHUTDOWN:
-            message = new ShutdownMessage(msg, msgsize, source);
-            break;
-        case COMMAND:
-            message = new CommandMessage(msg, msgsize, source);
-            break;
-        case RESULT:
-            // The extra zero is just for disambiguation
-            message = new ResultMessage(msg, msgsize, source, 0);
-            break;
-        case REGISTRATION:
-            message = new RegistrationMessage(msg, msgsize, source);
-            break;
-        case HOSTRANK:
-            message = new HostrankMessage(msg, msgsize, source);
-            break;
-        case IODATA:
-            message = new IODataMessage(msg, msgsize, source);
-            break;
-        default:
-            myfailure("Unknown message type: %d", type);
+    if (tag & COMPRESSED_TAG) {
+        unsigned size = msgsize;
+        msg = decompress(msg, &size);
+        msgsize = size;
+        tag &= ~COMPRESSED_TAG;
     }
 
-    return message;
+    // Create the right type of message
+    return create_message(tag, msg, msgsize, source);
 }
 
 bool MPICommunicator::message_waiting() {
+    progress_sends(false);
+
     int flag;
     MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
     return flag != 0;
 }
 
+/*
+ * Check for a message from any source. If there is one, then its status
+ * is stored in status and, with MPI 3, the message is matched so that the
+ * following receive gets exactly that message. Returns 1 if there is a
+ * message. If block is true, then this waits until there is one.
+ */
+int MPICommunicator::probe(MPI_Status &status, bool block) {
+    int message = 0;
+#ifdef HAVE_MATCHED_PROBE
+    if (block) {
+        MPI_Mprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &matched, &status);
+        message = 1;
+    } else {
+        MPI_Improbe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &message, &matched, &status);
+    }
+#else
+    if (block) {
+        MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+        message = 1;
+    } else {
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &message, &status);
+    }
+#endif
+    return message;
+}
+
 int MPICommunicator::wait_for_message(MPI_Status &status, double timeout) {
     /* On many MPI implementations MPI_Probe uses a busy wait loop. This
      * really wreaks havoc on the load and CPU utilization of the workers 
@@ -105,23 +382,23 @@ int MPICommunicator::wait_for_message(MPI_Status &status, double timeout) {
      * limited resource availability (memory and CPUs), and of the master
      * when there are no tasks to schedule or all slots are busy. In order
      * to avoid that we check here to see if there are any messages first,
-     * and if there are not, then we wait for a few millis before checking
-     * again and keep doing that until there is a message waiting. This 
-     * should reduce the load/CPU usage on the system significantly. It
-     * decreases responsiveness a bit, but it is a fair tradeoff.
+     * and if there are not, then we wait for a little while before checking
+     * again and keep doing that until there is a message waiting. The wait
+     * starts at a few usec and doubles every time no message is found, up
+     * to max_recv_sleep, so that a process that has been idle for a while
+     * uses little CPU, but still notices a message within max_recv_sleep.
      */
 
     log_trace("Rank %d: waiting for message", myrank);
 
     if (sleep_on_recv || timeout > 0) {
         double start = current_time();
-        unsigned i = 0;
+        useconds_t sleeptime = std::min((unsigned)MIN_RECV_SLEEP, max_recv_sleep);
         while (1) {
-            i++;
+            // Finish any sends that are in progress while we wait
+            progress_sends(false);
 
-            int message = 0;
-            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &message, &status);
-            if (message) {
+            if (probe(status, false)) {
                 // We got the message
                 return 1;
             }
@@ -133,25 +410,20 @@ int MPICommunicator::wait_for_message(MPI_Status &status, double timeout) {
                 }
             }
 
-            // This causes the loop to spin rapidly for 1 second
-            useconds_t sleeptime = 10; // Default is 10 usec
-            if (i > 1e5) {
-                // Increase sleep time to 0.5 sec after 
-                // 1e5 x 10 usec = 1 second has elapsed
-                // This is only approximate of course
-                sleeptime = 5e5;
-            }
-
             if (usleep(sleeptime)) {
                 // The sleep was interrupted by a signal
                 return 0;
             }
+
+            // Back off while there are no messages
+            sleeptime = std::min(2 * sleeptime, (useconds_t)max_recv_sleep);
         }
     } else {
+        progress_sends(false);
+
         // This call blocks, potentially in a busy loop depending on the
         // MPI implementation used
-        MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-        return 1;
+        return probe(status, true);
     }
 
     myfailure("Reached end of wait_for_message");
@@ -181,3 +453,6 @@ unsigned long MPICommunicator::recvd() {
     return bytes_recvd;
 }
 
+bool MPICommunicator::supports_threads() {
+    return thread_level >= MPI_THREAD_SERIALIZED;
+}
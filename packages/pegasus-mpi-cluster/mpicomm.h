@@ -1,22 +1,64 @@
 #ifndef MPICOMM_H
 #define MPICOMM_H
 
+#include <vector>
+
 #include "comm.h"
 
+using std::vector;
+using std::pair;
+
+// Maximum number of asynchronous sends that can be in flight at once
+#define MAX_PENDING_SENDS 1024
+
+// Broadcasts are sent in pieces so that the count fits in an int
+#define MAX_BROADCAST_CHUNK (1 << 30)
+
+// Bounds on the time to sleep between checks for messages in usec
+#define MIN_RECV_SLEEP 10
+#define DEFAULT_MAX_RECV_SLEEP 10000
+
+// Compressed messages are sent with this bit set in the tag. The MPI
+// standard guarantees that tags up to 32767 can be used.
+#define COMPRESSED_TAG 0x4000
+
+// MPI 3 can receive exactly the message that was probed
+#if MPI_VERSION >= 3
+#define HAVE_MATCHED_PROBE 1
+#endif
+
 class MPICommunicator : public Communicator {
 private:
     int myrank;
     int mysize;
     unsigned long bytes_sent;
     unsigned long bytes_recvd;
+    vector<MPI_Request> send_requests;
+    vector<Message *> send_messages;
+    // Compressed copies of the messages in send_messages, or NULL
+    vector<pair<char *, unsigned> > send_buffers;
+#ifdef HAVE_MATCHED_PROBE
+    MPI_Message matched;
+#endif
+    int thread_level;
     virtual int wait_for_message(MPI_Status &status, double timeout);
+    int probe(MPI_Status &status, bool block);
+    void progress_sends(bool block);
+    char *compress(Message *message, unsigned *size);
     
 public:
     bool sleep_on_recv;
+    unsigned max_recv_sleep;
+    // Messages of at least this many bytes are compressed, or 0
+    unsigned compress_threshold;
     
-    MPICommunicator(int *argc, char ***argv);
+    MPICommunicator(int *argc, char ***argv, bool threads = false);
     virtual ~MPICommunicator();
     virtual void send_message(Message *message, int dest);
+    virtual void send_message_async(Message *message, int dest);
+    virtual void wait_for_sends();
+    virtual Message *broadcast_message(Message *message, int root);
+    virtual vector<Message *> gather_messages(Message *message, int root);
     virtual Message *recv_message(double timeout = 0);
     virtual bool message_waiting();
     virtual void barrier();
@@ -25,6 +67,7 @@ public:
     virtual int size();
     virtual unsigned long sent();
     virtual unsigned long recvd();
+    virtual bool supports_threads();
 };
 
 #endif /* MPICOMM_H */
@@ -1,5 +1,7 @@
+#ifndef NO_MPI
 /* mpi.h must come before stdio.h for Intel MPI */
 #include <mpi.h>
+#endif
 #include <stdio.h>
 #include <list>
 #include <stdlib.h>
@@ -13,10 +15,17 @@
 #include "worker.h"
 #include "failure.h"
 #include "log.h"
+#ifndef NO_MPI
 #include "mpicomm.h"
+#endif
+#include "shmcomm.h"
+#include "simcomm.h"
+#include "localcomm.h"
 #include "protocol.h"
 #include "tools.h"
+#include "strlib.h"
 #include "config.h"
+#include "resourcelog.h"
 
 using std::string;
 using std::list;
@@ -24,6 +33,7 @@ using std::exception;
 
 static char *program = NULL;
 static int rank = 0;
+static bool use_mpi = false;
 
 void version() {
     if (rank == 0) {
@@ -34,9 +44,17 @@ void version() {
 #ifdef __VERSION__
         fprintf(stderr, "Compiler: %s\n", __VERSION__);
 #endif
-        int major, minor;
-        MPI_Get_version(&major, &minor);
-        fprintf(stderr, "MPI: %d.%d\n", major, minor);
+#ifndef NO_MPI
+        if (use_mpi) {
+            int major, minor;
+            MPI_Get_version(&major, &minor);
+            fprintf(stderr, "MPI: %d.%d\n", major, minor);
+        } else {
+            fprintf(stderr, "MPI: not used\n");
+        }
+#else
+        fprintf(stderr, "MPI: not supported\n");
+#endif
 #ifdef MPICH_VERSION
         fprintf(stderr, "MPICH: %s\n", MPICH_VERSION);
 #endif
@@ -55,7 +73,7 @@ void version() {
 void usage() {
     if (rank == 0) {
         fprintf(stderr,
-            "Usage: %s [options] DAGFILE\n"
+            "Usage: %s [options] DAGFILE [DAGFILE...]\n"
             "\n"
             "Options:\n"
             "   -h|--help            Print this message\n"
@@ -74,26 +92,209 @@ void usage() {
             "   --host-cpus N        Number of CPUs per host\n"
             "   --strict-limits      Enforce strict task resource limits\n"
             "   --max-wall-time T    Maximum wall time of the job in minutes\n"
+            "   --wall-time-margin T Stop starting tasks T minutes before the\n"
+            "                        --max-wall-time and exit when they finish\n"
             "   --per-task-stdio     Write each task's stdout/stderr to a different file\n"
             "   --jobstate-log       Generate jobstate.log\n"
             "   --monitord-hack      Generate a .dagman.out file to trick monitord\n"
+            "   --event-stream PATH  Write binary workflow events to file or socket PATH\n"
+            "   --event-stream-text PATH\n"
+            "                        Convert event stream PATH to text on stdout\n"
+            "                        and exit\n"
+            "   --event-interval T   Write events to the logs in the background\n"
+            "                        every T ms, or as they happen if T is 0\n"
+            "   --status-file PATH   Write metrics about the master to PATH\n"
+            "   --status-interval T  Rewrite the status file every T seconds\n"
+            "   --trace PATH         Write a timeline of the tasks to PATH in the\n"
+            "                        Chrome trace event format\n"
+            "   --utilization-file PATH\n"
+            "                        Write the busy and idle time of each slot and\n"
+            "                        host to PATH at the end of the workflow\n"
             "   --no-resource-log    Do not generate a log of resource usage\n"
+            "   --resource-log-binary\n"
+            "                        Write the resource log as binary samples\n"
+            "   --resource-log-interval T\n"
+            "                        Log the resources of each host at most once\n"
+            "                        every T seconds\n"
+            "   --resource-log-csv PATH\n"
+            "                        Convert binary resource log PATH to CSV on\n"
+            "                        stdout and exit\n"
+            "   --async-log          Write log messages from a background thread\n"
+            "   --compress-messages N\n"
+            "                        Compress MPI messages of N bytes or more\n"
             "   --no-sleep-on-recv   Do not sleep on message receive\n"
+            "   --max-recv-sleep N   Maximum sleep on message receive in usec\n"
             "   --maxfds             Maximum cached file descriptors\n"
             "   --keep-affinity      Keep inherited CPU and memory affinity\n"
-            "   --set-affinity       Set CPU affinity for multicore tasks\n",
+            "   --set-affinity       Set CPU affinity for multicore tasks\n"
+            "   --memory-affinity MODE\n"
+            "                        Allocate the memory of tasks bound to one NUMA\n"
+            "                        node on that node, where MODE is one of: none,\n"
+            "                        preferred, bind\n"
+            "   --no-thread-env      Do not set OMP_NUM_THREADS and the like from\n"
+            "                        the CPUs of tasks\n"
+            "   --backfill           Reserve hosts for large tasks and backfill\n"
+            "                        them using task runtime estimates\n"
+            "   --aging-interval T   Raise the priority of deferred tasks by one\n"
+            "                        every T seconds\n"
+            "   --starvation-time T  Drain a host for tasks that have been deferred\n"
+            "                        for T seconds\n"
+            "   --max-jobs CAT=N     Run up to N tasks of category CAT at the same\n"
+            "                        time, overriding MAXJOBS in the DAG\n"
+            "   --placement POLICY   Choose hosts for tasks, where POLICY is one of:\n"
+            "                        pack, spread, first-fit, least-loaded\n"
+            "   --quarantine N       Stop using a host for a while after N tasks\n"
+            "                        fail on it in a row\n"
+            "   --quarantine-time T  Quarantine hosts for T seconds [default: 300]\n"
+            "   --priority-mode MODE Compute task priorities from the DAG, where MODE\n"
+            "                        is one of: user, critical-path, bfs, dfs\n"
+            "   --sub-masters        Use one worker per host to relay messages\n"
+            "   --master-cores N     Keep N CPUs of the master's host for the master\n"
+            "                        and run tasks on the others in the master process\n"
+            "   --batch-size N       Send up to N tasks to a worker at once\n"
+            "   --prefetch N         Queue up to N tasks on busy workers\n"
+            "   --broadcast-dag      Send the task table to workers once at startup\n"
+            "   --broadcast-files PATH\n"
+            "                        Copy file or directory PATH to --broadcast-dir\n"
+            "                        on each host at startup\n"
+            "   --broadcast-dir DIR  Node-local directory for --broadcast-files\n"
+            "   --dag-cache          Load the DAG from DAGFILE.pmcb if it is up to date\n"
+            "   --rescue-batch N     Commit up to N rescue records at once\n"
+            "   --rescue-interval T  Commit rescue records at least every T ms\n"
+            "   --binary-rescue      Write task indexes to the rescue log instead of names\n"
+            "   --dag-stream PATH    Read more tasks from PATH while the workflow runs\n"
+            "   --dag-weights W      Share the slots among several DAGFILEs in\n"
+            "                        proportion to the weights W, separated by commas\n"
+            "   --write-behind T     Write collective I/O in the background every T ms\n"
+            "   --writer-threads N   Use N threads to write collective I/O\n"
+            "   --stream-pipes       Send pipe forward data while tasks are running\n"
+            "   --direct-forwards    Let workers write file forwards directly into\n"
+            "                        their destinations on a shared file system\n"
+            "   --master-memory MB   Limit the task I/O data waiting to be written\n"
+            "                        by the master to about MB megabytes\n"
+            "   --rank-stdio         Write task stdio to a file for each worker and\n"
+            "                        merge them at the end of the workflow\n"
+            "   --merge-threads N    Use N threads to merge the files of --rank-stdio\n"
+            "   --worker-slots N     Run up to N tasks at the same time in each worker\n"
+            "   --vfork              Launch tasks with vfork instead of fork\n"
+            "   --speculate F        Start a copy of tasks that run F times longer\n"
+            "                        than expected when there are free slots\n"
+            "   --locality-delay T   Wait up to T seconds to run tasks on the host\n"
+            "                        that wrote their --input files\n"
+            "   --staging-dir DIR    Keep --intermediate files in DIR on each host\n"
+            "   --staging-size MB    Capacity of the staging area on each host\n"
+            "   --release-idle T     Shut down workers that are idle for T seconds\n"
+            "                        when no tasks are waiting\n"
+            "   --bundle-time T      Send short tasks to a worker in bundles that\n"
+            "                        are expected to run for up to T seconds\n"
+            "   --recv-thread        Receive messages in a separate thread in the\n"
+            "                        master\n"
+            "   --estimate-resources Estimate the runtime and memory of tasks without\n"
+            "                        -r and -m from earlier tasks of the same\n"
+            "                        transformation\n"
+            "   --cgroup DIR         Limit the memory of tasks with cgroups created\n"
+            "                        in the cgroup v2 directory DIR\n"
+            "   --overcommit-memory F\n"
+            "                        Reserve F times the peak memory of earlier tasks\n"
+            "                        of the same transformation if it is less than -m\n"
+            "   --result-cache DIR   Skip tasks whose results are stored in DIR from\n"
+            "                        an earlier run, and store new results there\n"
+            "   --cache-env VARS     Environment variables, separated by commas,\n"
+            "                        that are part of the key of cached results\n"
+            "   --max-runtime T      Kill tasks that run longer than T seconds unless\n"
+            "                        they have their own limit\n"
+            "   --monitor            Write a kickstart invocation record for each task\n"
+            "                        to the task stdout\n"
+            "   --monitor-interpose LIB\n"
+            "                        Record the files used by tasks with the\n"
+            "                        libinterpose library LIB for --monitor\n"
+            "   --workers N          Fork N workers when not started by an MPI\n"
+            "                        launcher [default: number of CPUs]\n"
+            "   --simulate LOG       Do not run the tasks, but predict the makespan\n"
+            "                        with simulated workers, using the runtimes in\n"
+            "                        the task stdout or jobstate.log LOG of an\n"
+            "                        earlier run\n"
+            "   --simulate-hosts PATH\n"
+            "                        Simulate the hosts in the resource log PATH of\n"
+            "                        an earlier run\n",
             program
         );
     }
 }
 
+/*
+ * Set up the simulated hosts: the ones in the resource log of an earlier
+ * run, or as many as are needed for --workers with --host-cpus CPUs and
+ * --host-memory each. Returns 0, or 1 if the log could not be read.
+ */
+int simulate_hosts(SimCommunicator &sim, const string &hostlog,
+        bool explicit_workers, cpu_t host_cpus, unsigned host_memory) {
+    int nworkers = sim.size() - 1;
+    unsigned hosts = 0, slots = 0, cpus = 0, memory = 0;
+    if (hostlog != "") {
+        if (read_simulated_hosts(hostlog, hosts, slots, cpus, memory) < 0) {
+            fprintf(stderr, "Unable to read resource log %s\n", hostlog.c_str());
+            return 1;
+        }
+    }
+    if (host_cpus == 0) {
+        host_cpus = cpus > 0 ? cpus : get_host_cpuinfo().threads;
+    }
+    if (host_memory == 0) {
+        host_memory = memory > 0 ? memory : get_host_memory() / (1024*1024);
+    }
+    unsigned per_host = std::max(1u, (slots > 0 ? slots : host_cpus) / config.worker_slots);
+    if (hosts > 0 && !explicit_workers) {
+        nworkers = hosts * per_host;
+    }
+    sim.set_hosts(nworkers, per_host, host_cpus, host_memory);
+    return 0;
+}
+
+/*
+ * Run the master with simulated workers, and report what the makespan
+ * and utilization would be. The tasks run for as long as they did in
+ * the logs, or for their -r estimates if they are not in the logs.
+ */
+int simulate(SimCommunicator &sim, Master &master, DAG &dag,
+        const vector<string> &logs, double max_wall_time) {
+    sim.set_dag(&dag);
+    unsigned found = 0;
+    for (unsigned i = 0; i < logs.size(); i++) {
+        found = sim.read_runtimes(logs[i]);
+    }
+    if (found < dag.size()) {
+        log_warn("%u of %u tasks are not in the logs, using their -r estimates",
+                dag.size() - found, dag.size());
+    }
+
+    int rc = master.run();
+
+    double makespan = sim.virtual_time();
+    unsigned slots = (sim.size() - 1) * config.worker_slots;
+    unsigned cpus = sim.hosts() * sim.cpus_per_host();
+    printf("Simulated hosts: %u with %u CPUs and %u MB each, %d workers, %u slots\n",
+            sim.hosts(), (unsigned)sim.cpus_per_host(), sim.memory_per_host(),
+            sim.size() - 1, slots);
+    printf("Predicted makespan: %.3lf seconds (%.3lf minutes)\n", makespan, makespan / 60.0);
+    if (makespan > 0) {
+        printf("Predicted slot utilization: %.3lf\n", sim.busy_slot_time() / (makespan * slots));
+        printf("Predicted CPU utilization: %.3lf\n", sim.busy_cpu_time() / (makespan * cpus));
+    }
+    printf("Predicted core hours: %.3lf\n", makespan * cpus / 3600.0);
+    if (max_wall_time > 0 && makespan > max_wall_time * 60.0) {
+        printf("The workflow would not finish in --max-wall-time\n");
+    }
+    return rc;
+}
+
 void argerror(const string message) {
     if (rank == 0) {
         fprintf(stderr, "%s\n", message.c_str());
     }
 }
 
-int mpidag(int argc, char *argv[], MPICommunicator &comm) {
+int mpidag(int argc, char *argv[], Communicator &comm) {
     rank = comm.rank();
     int numprocs = comm.size();
 
@@ -110,19 +311,30 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
     int max_failures = 0;
     int tries = 1;
     bool lock = true;
+    bool dag_cache = false;
     string rescuefile = "";
     string host_script = "";
     unsigned host_memory = 0;
     cpu_t host_cpus = 0;
+    unsigned master_cores = 0;
     bool strict_limits = false;
     double max_wall_time = 0.0;
     bool per_task_stdio = false;
+    bool async_log = false;
     bool jobstate_log = false;
+    string event_stream = "";
     bool monitord_hack = false;
+    string dag_weights = "";
+    vector<string> simulate_logs;
+    string simulated_hosts = "";
+    bool explicit_workers = false;
     bool log_resources = true;
     bool sleep_on_recv = true;
+    unsigned max_recv_sleep = 0;
+    unsigned compress_threshold = 0;
     int maxfds = 0;
     bool clear_affinity = true;
+    PriorityMode priority_mode = PRIORITY_USER;
     config.set_affinity = false;
 
     // Environment variable defaults
@@ -270,6 +482,21 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
                 argerror("Invalid value for --max-wall-time");
                 return 1;
             }
+        } else if (flag == "--wall-time-margin") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--wall-time-margin requires T");
+                return 1;
+            }
+            string margin_string = flags.front();
+            if (sscanf(margin_string.c_str(), "%lf", &config.wall_time_margin) != 1) {
+                argerror("Invalid value for --wall-time-margin");
+                return 1;
+            }
+            if (config.wall_time_margin < 0) {
+                argerror("--wall-time-margin must be >= 0");
+                return 1;
+            }
         } else if (flag == "--per-task-stdio") {
             per_task_stdio = true;
         } else if (flag == "--jobstate-log") {
@@ -277,10 +504,109 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
         } else if (flag == "--monitord-hack") {
             monitord_hack = true;
             per_task_stdio = true;
+        } else if (flag == "--event-stream") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--event-stream requires PATH");
+                return 1;
+            }
+            event_stream = flags.front();
         } else if (flag == "--no-resource-log") {
             log_resources = false;
+        } else if (flag == "--resource-log-binary") {
+            config.resource_log_binary = true;
+        } else if (flag == "--resource-log-interval") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--resource-log-interval requires T");
+                return 1;
+            }
+            string interval_string = flags.front();
+            if (sscanf(interval_string.c_str(), "%lf", &config.resource_log_interval) != 1) {
+                argerror("Invalid value for --resource-log-interval");
+                return 1;
+            }
+            if (config.resource_log_interval < 0) {
+                argerror("--resource-log-interval must be positive");
+                return 1;
+            }
+        } else if (flag == "--event-interval") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--event-interval requires T");
+                return 1;
+            }
+            string interval_string = flags.front();
+            if (sscanf(interval_string.c_str(), "%u", &config.event_interval) != 1) {
+                argerror("Invalid value for --event-interval");
+                return 1;
+            }
+        } else if (flag == "--status-file") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--status-file requires PATH");
+                return 1;
+            }
+            config.status_file = flags.front();
+        } else if (flag == "--status-interval") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--status-interval requires T");
+                return 1;
+            }
+            string interval_string = flags.front();
+            if (sscanf(interval_string.c_str(), "%lf", &config.status_interval) != 1) {
+                argerror("Invalid value for --status-interval");
+                return 1;
+            }
+            if (config.status_interval <= 0) {
+                argerror("--status-interval must be positive");
+                return 1;
+            }
+        } else if (flag == "--trace") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--trace requires PATH");
+                return 1;
+            }
+            config.trace_file = flags.front();
+        } else if (flag == "--utilization-file") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--utilization-file requires PATH");
+                return 1;
+            }
+            config.utilization_file = flags.front();
+        } else if (flag == "--async-log") {
+            async_log = true;
+        } else if (flag == "--compress-messages") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--compress-messages requires N");
+                return 1;
+            }
+            string compress_string = flags.front();
+            if (sscanf(compress_string.c_str(), "%u", &compress_threshold) != 1) {
+                argerror("Invalid value for --compress-messages");
+                return 1;
+            }
+#ifndef HAS_ZLIB
+            argerror("--compress-messages requires zlib");
+            return 1;
+#endif
         } else if (flag == "--no-sleep-on-recv") {
             sleep_on_recv = false;
+        } else if (flag == "--max-recv-sleep") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--max-recv-sleep requires N");
+                return 1;
+            }
+            string sleep_string = flags.front();
+            if (sscanf(sleep_string.c_str(), "%u", &max_recv_sleep) != 1) {
+                argerror("Invalid value for --max-recv-sleep");
+                return 1;
+            }
         } else if (flag == "--maxfds") {
             flags.pop_front();
             if (flags.size() == 0) {
@@ -300,6 +626,487 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
             clear_affinity = false;
         } else if (flag == "--set-affinity") {
             config.set_affinity = true;
+        } else if (flag == "--no-thread-env") {
+            config.thread_env = false;
+        } else if (flag == "--memory-affinity") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--memory-affinity requires MODE");
+                return 1;
+            }
+            string mode = flags.front();
+            if (mode == "none") {
+                config.memory_affinity = MEMORY_AFFINITY_NONE;
+            } else if (mode == "preferred") {
+                config.memory_affinity = MEMORY_AFFINITY_PREFERRED;
+            } else if (mode == "bind") {
+                config.memory_affinity = MEMORY_AFFINITY_BIND;
+            } else {
+                argerror("Invalid value for --memory-affinity");
+                return 1;
+            }
+        } else if (flag == "--backfill") {
+            config.backfill = true;
+        } else if (flag == "--aging-interval") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--aging-interval requires T");
+                return 1;
+            }
+            string aging_string = flags.front();
+            if (sscanf(aging_string.c_str(), "%lf", &config.aging_interval) != 1) {
+                argerror("Invalid value for --aging-interval");
+                return 1;
+            }
+            if (config.aging_interval <= 0) {
+                argerror("--aging-interval must be positive");
+                return 1;
+            }
+        } else if (flag == "--starvation-time") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--starvation-time requires T");
+                return 1;
+            }
+            string starvation_string = flags.front();
+            if (sscanf(starvation_string.c_str(), "%lf", &config.starvation_time) != 1) {
+                argerror("Invalid value for --starvation-time");
+                return 1;
+            }
+            if (config.starvation_time <= 0) {
+                argerror("--starvation-time must be positive");
+                return 1;
+            }
+        } else if (flag == "--max-jobs") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--max-jobs requires CAT=N");
+                return 1;
+            }
+            string limit_string = flags.front();
+            size_t eq = limit_string.rfind('=');
+            unsigned limit;
+            if (eq == string::npos || eq == 0 ||
+                    sscanf(limit_string.c_str() + eq + 1, "%u", &limit) != 1) {
+                argerror("Invalid value for --max-jobs");
+                return 1;
+            }
+            config.max_jobs[limit_string.substr(0, eq)] = limit;
+        } else if (flag == "--placement") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--placement requires POLICY");
+                return 1;
+            }
+            if (!parse_placement(flags.front(), config.placement)) {
+                argerror("Invalid value for --placement");
+                return 1;
+            }
+        } else if (flag == "--quarantine") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--quarantine requires N");
+                return 1;
+            }
+            string quarantine_string = flags.front();
+            if (sscanf(quarantine_string.c_str(), "%u", &config.quarantine_failures) != 1) {
+                argerror("Invalid value for --quarantine");
+                return 1;
+            }
+        } else if (flag == "--quarantine-time") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--quarantine-time requires T");
+                return 1;
+            }
+            string quarantine_time_string = flags.front();
+            if (sscanf(quarantine_time_string.c_str(), "%lf", &config.quarantine_time) != 1) {
+                argerror("Invalid value for --quarantine-time");
+                return 1;
+            }
+            if (config.quarantine_time <= 0) {
+                argerror("--quarantine-time must be > 0");
+                return 1;
+            }
+        } else if (flag == "--dag-cache") {
+            dag_cache = true;
+        } else if (flag == "--broadcast-dag") {
+            config.broadcast_dag = true;
+        } else if (flag == "--broadcast-files") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--broadcast-files requires PATH");
+                return 1;
+            }
+            string path = flags.front();
+            while (path.size() > 1 && path[path.size() - 1] == '/') {
+                path.erase(path.size() - 1);
+            }
+            if (path[0] != '/' || path == "/") {
+                argerror("--broadcast-files requires an absolute PATH");
+                return 1;
+            }
+            config.broadcast_files.push_back(path);
+        } else if (flag == "--broadcast-dir") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--broadcast-dir requires DIR");
+                return 1;
+            }
+            config.broadcast_dir = flags.front();
+        } else if (flag == "--sub-masters") {
+            config.submasters = true;
+        } else if (flag == "--master-cores") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--master-cores requires N");
+                return 1;
+            }
+            string master_cores_string = flags.front();
+            if (sscanf(master_cores_string.c_str(), "%u", &master_cores) != 1 ||
+                    master_cores < 1) {
+                argerror("--master-cores must be an integer >= 1");
+                return 1;
+            }
+        } else if (flag == "--batch-size") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--batch-size requires N");
+                return 1;
+            }
+            string batch_string = flags.front();
+            if (sscanf(batch_string.c_str(), "%u", &config.batch_size) != 1) {
+                argerror("Invalid value for --batch-size");
+                return 1;
+            }
+            if (config.batch_size < 1) {
+                argerror("--batch-size must be at least 1");
+                return 1;
+            }
+        } else if (flag == "--prefetch") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--prefetch requires N");
+                return 1;
+            }
+            string prefetch_string = flags.front();
+            if (sscanf(prefetch_string.c_str(), "%u", &config.prefetch) != 1) {
+                argerror("Invalid value for --prefetch");
+                return 1;
+            }
+        } else if (flag == "--dag-stream") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--dag-stream requires PATH");
+                return 1;
+            }
+            config.dag_stream = flags.front();
+        } else if (flag == "--dag-weights") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--dag-weights requires W");
+                return 1;
+            }
+            dag_weights = flags.front();
+        } else if (flag == "--binary-rescue") {
+            config.binary_rescue = true;
+        } else if (flag == "--rescue-batch") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--rescue-batch requires N");
+                return 1;
+            }
+            string batch_string = flags.front();
+            if (sscanf(batch_string.c_str(), "%u", &config.rescue_batch) != 1) {
+                argerror("Invalid value for --rescue-batch");
+                return 1;
+            }
+            if (config.rescue_batch < 1) {
+                argerror("--rescue-batch must be at least 1");
+                return 1;
+            }
+        } else if (flag == "--rescue-interval") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--rescue-interval requires T");
+                return 1;
+            }
+            string interval_string = flags.front();
+            if (sscanf(interval_string.c_str(), "%u", &config.rescue_interval) != 1) {
+                argerror("Invalid value for --rescue-interval");
+                return 1;
+            }
+        } else if (flag == "--write-behind") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--write-behind requires T");
+                return 1;
+            }
+            string interval_string = flags.front();
+            if (sscanf(interval_string.c_str(), "%u", &config.write_behind) != 1) {
+                argerror("Invalid value for --write-behind");
+                return 1;
+            }
+            if (config.write_behind < 1) {
+                argerror("--write-behind must be at least 1");
+                return 1;
+            }
+        } else if (flag == "--stream-pipes") {
+            config.stream_pipes = true;
+        } else if (flag == "--direct-forwards") {
+            config.direct_forwards = true;
+        } else if (flag == "--master-memory") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--master-memory requires MB");
+                return 1;
+            }
+            string memory_string = flags.front();
+            if (sscanf(memory_string.c_str(), "%u", &config.master_memory) != 1) {
+                argerror("Invalid value for --master-memory");
+                return 1;
+            }
+            if (config.master_memory < 1) {
+                argerror("--master-memory must be at least 1");
+                return 1;
+            }
+        } else if (flag == "--writer-threads") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--writer-threads requires N");
+                return 1;
+            }
+            string threads_string = flags.front();
+            if (sscanf(threads_string.c_str(), "%u", &config.writer_threads) != 1) {
+                argerror("Invalid value for --writer-threads");
+                return 1;
+            }
+            if (config.writer_threads < 1) {
+                argerror("--writer-threads must be at least 1");
+                return 1;
+            }
+        } else if (flag == "--rank-stdio") {
+            config.rank_stdio = true;
+        } else if (flag == "--merge-threads") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--merge-threads requires N");
+                return 1;
+            }
+            string threads_string = flags.front();
+            if (sscanf(threads_string.c_str(), "%u", &config.merge_threads) != 1) {
+                argerror("Invalid value for --merge-threads");
+                return 1;
+            }
+            if (config.merge_threads < 1) {
+                argerror("--merge-threads must be at least 1");
+                return 1;
+            }
+        } else if (flag == "--worker-slots") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--worker-slots requires N");
+                return 1;
+            }
+            string slots_string = flags.front();
+            if (sscanf(slots_string.c_str(), "%u", &config.worker_slots) != 1) {
+                argerror("Invalid value for --worker-slots");
+                return 1;
+            }
+            if (config.worker_slots < 1) {
+                argerror("--worker-slots must be at least 1");
+                return 1;
+            }
+        } else if (flag == "--vfork") {
+            config.vfork = true;
+        } else if (flag == "--speculate") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--speculate requires F");
+                return 1;
+            }
+            string factor_string = flags.front();
+            if (sscanf(factor_string.c_str(), "%lf", &config.speculate) != 1) {
+                argerror("Invalid value for --speculate");
+                return 1;
+            }
+            if (config.speculate < 1.0) {
+                argerror("--speculate must be at least 1");
+                return 1;
+            }
+        } else if (flag == "--locality-delay") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--locality-delay requires T");
+                return 1;
+            }
+            string delay_string = flags.front();
+            if (sscanf(delay_string.c_str(), "%lf", &config.locality_delay) != 1) {
+                argerror("Invalid value for --locality-delay");
+                return 1;
+            }
+            if (config.locality_delay < 0) {
+                argerror("--locality-delay must be positive");
+                return 1;
+            }
+        } else if (flag == "--release-idle") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--release-idle requires T");
+                return 1;
+            }
+            string idle_string = flags.front();
+            if (sscanf(idle_string.c_str(), "%lf", &config.release_idle) != 1) {
+                argerror("Invalid value for --release-idle");
+                return 1;
+            }
+            if (config.release_idle < 0) {
+                argerror("--release-idle must be positive");
+                return 1;
+            }
+        } else if (flag == "--bundle-time") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--bundle-time requires T");
+                return 1;
+            }
+            string bundle_string = flags.front();
+            if (sscanf(bundle_string.c_str(), "%lf", &config.bundle_time) != 1) {
+                argerror("Invalid value for --bundle-time");
+                return 1;
+            }
+            if (config.bundle_time < 0) {
+                argerror("--bundle-time must be positive");
+                return 1;
+            }
+        } else if (flag == "--recv-thread") {
+            config.recv_thread = true;
+        } else if (flag == "--estimate-resources") {
+            config.estimate_resources = true;
+        } else if (flag == "--cgroup") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--cgroup requires DIR");
+                return 1;
+            }
+            config.cgroup_dir = flags.front();
+        } else if (flag == "--overcommit-memory") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--overcommit-memory requires F");
+                return 1;
+            }
+            string overcommit_string = flags.front();
+            if (sscanf(overcommit_string.c_str(), "%lf", &config.overcommit_memory) != 1) {
+                argerror("Invalid value for --overcommit-memory");
+                return 1;
+            }
+            if (config.overcommit_memory < 1.0) {
+                argerror("--overcommit-memory must be at least 1.0");
+                return 1;
+            }
+        } else if (flag == "--result-cache") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--result-cache requires DIR");
+                return 1;
+            }
+            config.result_cache = flags.front();
+        } else if (flag == "--cache-env") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--cache-env requires VARS");
+                return 1;
+            }
+            config.cache_env = flags.front();
+        } else if (flag == "--staging-dir") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--staging-dir requires DIR");
+                return 1;
+            }
+            config.staging_dir = flags.front();
+        } else if (flag == "--staging-size") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--staging-size requires MB");
+                return 1;
+            }
+            string size_string = flags.front();
+            if (sscanf(size_string.c_str(), "%u", &config.staging_size) != 1) {
+                argerror("Invalid value for --staging-size");
+                return 1;
+            }
+        } else if (flag == "--max-runtime") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--max-runtime requires T");
+                return 1;
+            }
+            string runtime_string = flags.front();
+            if (sscanf(runtime_string.c_str(), "%lf", &config.max_runtime) != 1) {
+                argerror("Invalid value for --max-runtime");
+                return 1;
+            }
+            if (config.max_runtime < 0) {
+                argerror("--max-runtime must be positive");
+                return 1;
+            }
+        } else if (flag == "--monitor") {
+            config.monitor = true;
+        } else if (flag == "--monitor-interpose") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--monitor-interpose requires LIB");
+                return 1;
+            }
+            config.monitor_interpose = flags.front();
+        } else if (flag == "--workers") {
+            // This is handled in main() because the workers have to be
+            // started before the arguments are parsed
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--workers requires N");
+                return 1;
+            }
+            if (use_mpi && rank == 0) {
+                log_warn("--workers is ignored when running under MPI");
+            }
+            explicit_workers = true;
+        } else if (flag == "--simulate") {
+            // The communicator is created in main(), this adds a log
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--simulate requires LOG");
+                return 1;
+            }
+            simulate_logs.push_back(flags.front());
+        } else if (flag == "--simulate-hosts") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--simulate-hosts requires PATH");
+                return 1;
+            }
+            simulated_hosts = flags.front();
+        } else if (flag == "--priority-mode") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--priority-mode requires MODE");
+                return 1;
+            }
+            string mode = flags.front();
+            if (mode == "user") {
+                priority_mode = PRIORITY_USER;
+            } else if (mode == "critical-path") {
+                priority_mode = PRIORITY_CRITICAL_PATH;
+            } else if (mode == "bfs") {
+                priority_mode = PRIORITY_BFS;
+            } else if (mode == "dfs") {
+                priority_mode = PRIORITY_DFS;
+            } else {
+                argerror("Invalid value for --priority-mode");
+                return 1;
+            }
         } else if (flag[0] == '-') {
             string message = "Unrecognized argument: ";
             message += flag;
@@ -316,20 +1123,127 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
         return 1;
     }
 
-    if (args.size() > 1) {
-        argerror("Invalid argument\n");
-        return 1;
+    vector<string> dagfiles(args.begin(), args.end());
+    string dagfile = dagfiles[0];
+
+    vector<double> weights(dagfiles.size(), 1.0);
+    if (dag_weights != "") {
+        vector<string> values;
+        split(values, dag_weights, ",");
+        if (values.size() != dagfiles.size()) {
+            argerror("--dag-weights requires one weight for each DAGFILE");
+            return 1;
+        }
+        for (unsigned i = 0; i < values.size(); i++) {
+            if (sscanf(values[i].c_str(), "%lf", &weights[i]) != 1 || weights[i] <= 0) {
+                argerror("Invalid value for --dag-weights");
+                return 1;
+            }
+        }
     }
 
-    string dagfile = args.front();
+    // The tasks of each DAG are named after the DAG file, without the
+    // .dag extension, so that they can be told apart
+    vector<string> workflow_names;
+    for (unsigned i = 0; i < dagfiles.size(); i++) {
+        string name = filename(dagfiles[i]);
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".dag") == 0) {
+            name.erase(name.size() - 4);
+        }
+        for (unsigned j = 0; j < i; j++) {
+            if (workflow_names[j] == name) {
+                argerror("DAGFILEs must have different names: " + name);
+                return 1;
+            }
+        }
+        workflow_names.push_back(name);
+    }
 
     log_set_level(loglevel);
+    if (async_log) {
+        log_start_async();
+    }
 
-    if (numprocs < 2) {
+    if (numprocs < 2 && master_cores == 0) {
         fprintf(stderr, "At least one worker process is required\n");
         return 1;
     }
 
+    // A simulation does not run anything on the hosts, or write to any
+    // of the files of the workflow
+    SimCommunicator *sim = dynamic_cast<SimCommunicator *>(&comm);
+    if (simulated_hosts != "" && sim == NULL) {
+        fprintf(stderr, "--simulate-hosts requires --simulate\n");
+        return 1;
+    }
+    if (sim != NULL) {
+        if (dagfiles.size() > 1 || !config.dag_stream.empty() ||
+                !config.result_cache.empty() || config.rank_stdio ||
+                jobstate_log || monitord_hack || event_stream != "") {
+            fprintf(stderr, "--simulate cannot be used with more than one DAGFILE, "
+                    "--dag-stream, --result-cache, --rank-stdio, --jobstate-log, "
+                    "--monitord-hack or --event-stream\n");
+            return 1;
+        }
+        host_script = "";
+        lock = false;
+        log_resources = false;
+        outfile = "stdout";
+        errfile = "stderr";
+    }
+
+    // Each DAG has its own rescue file and task stdout/stderr, and the
+    // options that write one file for the whole run, or that send the
+    // task table to the workers, only work with one DAG
+    if (dagfiles.size() > 1) {
+        if (rescuefile != "" || outfile != "stdout" || errfile != "stderr") {
+            fprintf(stderr, "-r, -o and -e cannot be used with more than one DAGFILE\n");
+            return 1;
+        }
+        if (per_task_stdio || config.rank_stdio || jobstate_log || monitord_hack ||
+                config.broadcast_dag || !config.dag_stream.empty()) {
+            fprintf(stderr, "--per-task-stdio, --rank-stdio, --jobstate-log, --monitord-hack, "
+                    "--broadcast-dag and --dag-stream cannot be used with more than one DAGFILE\n");
+            return 1;
+        }
+        outfile = dagfile + ".out";
+        errfile = dagfile + ".err";
+    }
+
+    // Each of the files is copied to broadcast_dir under its own name
+    if (!config.broadcast_files.empty()) {
+        if (config.broadcast_dir.empty()) {
+            fprintf(stderr, "--broadcast-files requires --broadcast-dir\n");
+            return 1;
+        }
+        if (sim != NULL) {
+            fprintf(stderr, "--broadcast-files cannot be used with --simulate\n");
+            return 1;
+        }
+        set<string> names;
+        for (unsigned i = 0; i < config.broadcast_files.size(); i++) {
+            if (!names.insert(filename(config.broadcast_files[i])).second) {
+                fprintf(stderr, "--broadcast-files paths must have different names\n");
+                return 1;
+            }
+        }
+    }
+
+    // The workers in the master process can only talk to the master, and
+    // the master's alarm and signals can't be shared with a host script.
+    // Without MPI the master's host already has a worker for every CPU.
+    if (master_cores > 0) {
+        if (sim != NULL || dynamic_cast<ShmCommunicator *>(&comm) != NULL) {
+            fprintf(stderr, "--master-cores can only be used with MPI\n");
+            return 1;
+        }
+        if (host_script != "" || config.submasters || !config.staging_dir.empty()) {
+            fprintf(stderr, "--master-cores cannot be used with --host-script, "
+                    "--sub-masters or --staging-dir\n");
+            return 1;
+        }
+    }
+
     // You can't specify --host-cpus and --set-affinity because that would
     // break stuff
     if (config.set_affinity && host_cpus > 0) {
@@ -337,7 +1251,105 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
         return 1;
     }
 
-    comm.sleep_on_recv = sleep_on_recv;
+    // Memory is only bound for tasks that are bound to CPUs
+    if (config.memory_affinity != MEMORY_AFFINITY_NONE && !config.set_affinity) {
+        fprintf(stderr, "--memory-affinity requires --set-affinity\n");
+        return 1;
+    }
+
+    // Tasks from the stream change the task indexes and priorities
+    if (!config.dag_stream.empty()) {
+        if (config.binary_rescue) {
+            fprintf(stderr, "--dag-stream is not compatible with --binary-rescue\n");
+            return 1;
+        }
+        if (priority_mode != PRIORITY_USER) {
+            fprintf(stderr, "--dag-stream is not compatible with --priority-mode\n");
+            return 1;
+        }
+    }
+
+    if (config.writer_threads > 1 && config.write_behind == 0) {
+        fprintf(stderr, "--writer-threads requires --write-behind\n");
+        return 1;
+    }
+
+    // Batched and prefetched tasks are run in order in the slot they
+    // were sent to, which a worker with several slots can't tell apart
+    if (config.worker_slots > 1 && (config.batch_size > 1 || config.prefetch > 0 ||
+                config.bundle_time > 0)) {
+        fprintf(stderr, "--worker-slots cannot be used with --batch-size, --prefetch or --bundle-time\n");
+        return 1;
+    }
+    if (config.speculate > 0 && (config.batch_size > 1 || config.prefetch > 0 ||
+                config.bundle_time > 0)) {
+        fprintf(stderr, "--speculate cannot be used with --batch-size, --prefetch or --bundle-time\n");
+        return 1;
+    }
+    // The outputs of copies of a task can't be told apart when they are
+    // saved in the cache
+    if (config.speculate > 0 && !config.result_cache.empty()) {
+        fprintf(stderr, "--speculate cannot be used with --result-cache\n");
+        return 1;
+    }
+    // Copies of a task would write the same files, and the outputs of
+    // cached tasks are replayed through the master
+    if (config.direct_forwards && (config.speculate > 0 || !config.result_cache.empty())) {
+        fprintf(stderr, "--direct-forwards cannot be used with --speculate or --result-cache\n");
+        return 1;
+    }
+    if (!config.cache_env.empty() && config.result_cache.empty()) {
+        fprintf(stderr, "--cache-env requires --result-cache\n");
+        return 1;
+    }
+    // The memory estimate is the resident set size, which would be too
+    // small for the address space limit
+    if (config.estimate_resources && strict_limits) {
+        fprintf(stderr, "--estimate-resources cannot be used with --strict-limits\n");
+        return 1;
+    }
+    if (!config.cgroup_dir.empty() && strict_limits) {
+        fprintf(stderr, "--cgroup cannot be used with --strict-limits\n");
+        return 1;
+    }
+    // Without a cgroup, a task that uses more than its reservation would
+    // take memory from the other tasks on the host
+    if (config.overcommit_memory > 0 && config.cgroup_dir.empty()) {
+        fprintf(stderr, "--overcommit-memory requires --cgroup\n");
+        return 1;
+    }
+
+    // The records are written to the task stdout by the master
+    if (config.monitor && (per_task_stdio || config.rank_stdio)) {
+        fprintf(stderr, "--monitor cannot be used with --per-task-stdio or --rank-stdio\n");
+        return 1;
+    }
+    if (!config.monitor_interpose.empty() && !config.monitor) {
+        fprintf(stderr, "--monitor-interpose requires --monitor\n");
+        return 1;
+    }
+
+    // The margin can come before or after the wall time, which can also
+    // come from PMC_MAX_WALL_TIME
+    if (config.wall_time_margin > 0 && max_wall_time <= 0) {
+        fprintf(stderr, "--wall-time-margin requires --max-wall-time\n");
+        return 1;
+    }
+    if (config.wall_time_margin > 0 && config.wall_time_margin >= max_wall_time) {
+        fprintf(stderr, "--wall-time-margin must be less than --max-wall-time\n");
+        return 1;
+    }
+
+#ifndef NO_MPI
+    MPICommunicator *mpicomm = dynamic_cast<MPICommunicator *>(&comm);
+    if (mpicomm != NULL) {
+        mpicomm->sleep_on_recv = sleep_on_recv;
+        if (max_recv_sleep > 0) {
+            mpicomm->max_recv_sleep = max_recv_sleep;
+        }
+        mpicomm->compress_threshold = compress_threshold;
+    }
+#endif
 
     version();
 
@@ -362,7 +1374,7 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
     // this point. Once we get here the different processes can diverge 
     // in their behavior for many reasons (file systems issues, bad nodes,
     // etc.), so be careful how failures are handled after this point
-    // and make sure MPI_Abort is called when something bad happens.
+    // and make sure comm.abort() is called when something bad happens.
 
     if (rank == 0) {
 
@@ -374,10 +1386,13 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
         string oldrescue = rescuefile;
         string newrescue = rescuefile;
 
-        if (skiprescue) {
+        if (skiprescue || sim != NULL) {
             // User does not want to read old rescue file
             oldrescue = "";
         }
+        if (sim != NULL) {
+            newrescue = "";
+        }
 
         log_debug("Using old rescue file: %s", oldrescue.c_str());
         log_debug("Using new rescue file: %s", newrescue.c_str());
@@ -389,24 +1404,116 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
 
         bool has_host_script = ("" != host_script);
 
-        DAG dag(dagfile, oldrescue, lock, tries);
+        // The wall time of a simulation is not the wall time of the
+        // workflow, which is compared with the predicted makespan instead
+        double wall_time_limit = max_wall_time;
+        if (sim != NULL) {
+            max_wall_time = 0.0;
+            config.wall_time_margin = 0.0;
+            if (simulate_hosts(*sim, simulated_hosts, explicit_workers,
+                        host_cpus, host_memory) != 0) {
+                return 1;
+            }
+        }
+
+        string cachefile;
+        if (dag_cache) {
+            cachefile = dagfile + ".pmcb";
+        }
+
+        // The listeners must outlive the master, which delivers
+        // events to them until it is done
+        string jobstate_path = dirname(dagfile) + "/jobstate.log";
+        JobstateLog jslog(jobstate_path);
+        DAGManLog dagmanlog(dagfile + ".dagman.out", dagfile);
+        EventStream eventstream(event_stream);
+
+        DAG dag(dagfile, oldrescue, lock, tries, cachefile);
+        dag.compute_priorities(priority_mode);
         Engine engine(dag, newrescue, max_failures);
-        Master master(&comm, program, engine, dag, dagfile, outfile, errfile,
+
+        // The rest of the CPUs of this host are used by workers in threads
+        // of the master, which get the ranks after the MPI workers
+        Communicator *master_comm = &comm;
+        LocalCommunicator *local = NULL;
+        LocalWorkers *local_workers = NULL;
+        if (master_cores > 0) {
+            unsigned cpus = host_cpus > 0 ? host_cpus : get_host_cpuinfo().threads;
+            if (master_cores < cpus) {
+                cpu_t local_cpus = cpus - master_cores;
+                local = new LocalCommunicator(&comm,
+                        std::max(1u, local_cpus / config.worker_slots));
+                local_workers = new LocalWorkers(local, dagfile, host_memory, local_cpus,
+                        strict_limits, per_task_stdio);
+                local_workers->start();
+                master_comm = local;
+            } else {
+                log_warn("The host of the master only has %u CPUs, not running "
+                        "tasks on it", cpus);
+            }
+        }
+
+        Master master(master_comm, program, engine, dag, dagfile, outfile, errfile,
                 has_host_script, max_wall_time, resource_log, per_task_stdio,
                 maxfds);
 
-        string jobstate_path = dirname(dagfile) + "/jobstate.log";
-        JobstateLog jslog(jobstate_path);
         if (jobstate_log) {
             master.add_listener(&jslog);
         }
 
-        DAGManLog dagmanlog(dagfile + ".dagman.out", dagfile);
         if (monitord_hack) {
             master.add_listener(&dagmanlog);
         }
 
-        return master.run();
+        if (event_stream != "") {
+            master.add_listener(&eventstream);
+        }
+
+        // The other DAGs share the workers with the first one
+        vector<DAG *> dags;
+        vector<Engine *> engines;
+        if (dagfiles.size() > 1) {
+            dag.set_workflow(0, workflow_names[0] + ".");
+            master.set_weight(0, weights[0]);
+            for (unsigned i = 1; i < dagfiles.size(); i++) {
+                string rescue = dagfiles[i] + ".rescue";
+                string cache;
+                if (dag_cache) {
+                    cache = dagfiles[i] + ".pmcb";
+                }
+                DAG *d = new DAG(dagfiles[i], skiprescue ? "" : rescue, lock, tries, cache);
+                d->compute_priorities(priority_mode);
+                d->set_workflow(i, workflow_names[i] + ".");
+                Engine *e = new Engine(*d, rescue, max_failures);
+                master.add_workflow(*d, *e, dagfiles[i] + ".out", dagfiles[i] + ".err");
+                master.set_weight(i, weights[i]);
+                dags.push_back(d);
+                engines.push_back(e);
+            }
+        }
+
+        DAGStream *stream = NULL;
+        if (!config.dag_stream.empty()) {
+            stream = new DAGStream(config.dag_stream);
+            master.set_dag_stream(stream);
+        }
+
+        if (sim != NULL) {
+            return simulate(*sim, master, dag, simulate_logs, wall_time_limit);
+        }
+
+        int rc = master.run();
+        if (local_workers != NULL) {
+            local_workers->join();
+            delete local_workers;
+            delete local;
+        }
+        delete stream;
+        for (unsigned i = 0; i < engines.size(); i++) {
+            delete engines[i];
+            delete dags[i];
+        }
+        return rc;
     } else {
 
         Worker worker(&comm, dagfile, host_script, host_memory, host_cpus, 
@@ -416,6 +1523,31 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
     }
 }
 
+/*
+ * Check whether this process was started by an MPI launcher. If it was not,
+ * then the workers are forked by this process and talk to the master
+ * through shared memory.
+ */
+bool mpi_environment() {
+    const char *vars[] = {
+        "OMPI_COMM_WORLD_SIZE", // Open MPI
+        "PMI_SIZE",             // MPICH, Intel MPI, Slurm
+        "PMI_RANK",
+        "PMIX_RANK",            // PMIx
+        "MPI_LOCALNRANKS",      // MPICH Hydra
+        "MV2_COMM_WORLD_SIZE",  // MVAPICH2
+        "PALS_RANKID",          // Cray PALS
+        "ALPS_APP_PE",          // Cray ALPS
+        NULL
+    };
+    for (int i = 0; vars[i] != NULL; i++) {
+        if (getenv(vars[i]) != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void out_of_memory() {
     myfailure("Unable to allocate memory");
 }
@@ -434,23 +1566,93 @@ int main(int argc, char *argv[]) {
             usage();
             return 0;
         }
+        // Converting a binary resource log or event stream does not need MPI either
+        if (flag == "--resource-log-csv") {
+            if (i + 1 == argc) {
+                fprintf(stderr, "--resource-log-csv requires PATH\n");
+                return 1;
+            }
+            if (ResourceLog::convert(argv[i+1], stdout) < 0) {
+                fprintf(stderr, "Unable to convert resource log %s\n", argv[i+1]);
+                return 1;
+            }
+            return 0;
+        }
+        if (flag == "--event-stream-text") {
+            if (i + 1 == argc) {
+                fprintf(stderr, "--event-stream-text requires PATH\n");
+                return 1;
+            }
+            if (EventStream::convert(argv[i+1], stdout) < 0) {
+                fprintf(stderr, "Unable to convert event stream %s\n", argv[i+1]);
+                return 1;
+            }
+            return 0;
+        }
+    }
+
+    // Without an MPI launcher, fork one worker per CPU, or --workers.
+    // MPI has to be initialized differently for --recv-thread.
+    int workers = 0;
+    bool threads = false;
+    bool simulate = false;
+    for (int i=1; i<argc; i++) {
+        string flag = argv[i];
+        if (flag == "--recv-thread") {
+            threads = true;
+        }
+        if (flag == "--simulate") {
+            simulate = true;
+        }
+        if (flag == "--workers") {
+            if (i + 1 == argc) {
+                fprintf(stderr, "--workers requires N\n");
+                return 1;
+            }
+            if (sscanf(argv[i+1], "%d", &workers) != 1 || workers < 1) {
+                fprintf(stderr, "Invalid value for --workers\n");
+                return 1;
+            }
+        }
+    }
+    if (workers == 0) {
+        workers = get_host_cpuinfo().threads;
+    }
+
+#ifndef NO_MPI
+    use_mpi = mpi_environment() && !simulate;
+#endif
+
+    // A simulation has no workers, the master runs them in virtual time
+    Communicator *comm;
+#ifndef NO_MPI
+    if (use_mpi) {
+        comm = new MPICommunicator(&argc, &argv, threads);
+    } else
+#endif
+    if (simulate) {
+        comm = new SimCommunicator(NULL, workers, 1, 1, 0);
+    } else {
+        comm = new ShmCommunicator(workers + 1);
     }
 
-    MPICommunicator comm(&argc, &argv);
     try {
         std::set_new_handler(out_of_memory);
-        int rc = mpidag(argc, argv, comm);
+        int rc = mpidag(argc, argv, *comm);
+        delete comm;
+        log_stop_async();
         return rc;
     } catch (exception &error) {
         // If we catch an execption here, then one of the
         // processes has hit an unsolvable problem and we
         // need to abort the entire workflow.
+        log_stop_async();
         fprintf(stderr, "ABORT: %s\n", error.what());
         // ensure that abort() is not eating our errors
         fflush(stdout);
         fflush(stderr);
         sleep(1);
-        comm.abort(1);
+        comm->abort(1);
     }
 }
 
@@ -0,0 +1,139 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
+
+#include "poller.h"
+#include "log.h"
+
+Poller::Poller() {
+    this->epfd = -1;
+    this->count = 0;
+#ifdef LINUX
+    this->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        log_warn("Unable to create epoll instance, using poll(): %s", strerror(errno));
+    }
+#endif
+}
+
+Poller::~Poller() {
+    if (epfd >= 0) {
+        close(epfd);
+    }
+}
+
+/* Start watching fd. Returns -1 if it could not be added. */
+int Poller::add(int fd) {
+#ifdef LINUX
+    if (epfd >= 0) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            log_error("Unable to add descriptor %d to epoll: %s", fd, strerror(errno));
+            return -1;
+        }
+        count++;
+        return 0;
+    }
+#endif
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    fds.push_back(pfd);
+    count++;
+    return 0;
+}
+
+/* Stop watching fd. This has to be called before fd is closed. */
+void Poller::remove(int fd) {
+#ifdef LINUX
+    if (epfd >= 0) {
+        if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+            log_error("Unable to remove descriptor %d from epoll: %s", fd, strerror(errno));
+            return;
+        }
+        count--;
+        return;
+    }
+#endif
+    for (vector<struct pollfd>::iterator p = fds.begin(); p != fds.end(); p++) {
+        if (p->fd == fd) {
+            fds.erase(p);
+            count--;
+            return;
+        }
+    }
+}
+
+/*
+ * Wait up to timeout ms, or forever if timeout is negative, for one of
+ * the descriptors to be ready. The ready descriptors and their events
+ * are put in ready. Returns the number of ready descriptors, or -1 on
+ * error.
+ */
+int Poller::wait(int timeout, vector<struct pollfd> &ready) {
+    ready.clear();
+#ifdef LINUX
+    if (epfd >= 0) {
+        struct epoll_event events[64];
+        int rc = epoll_wait(epfd, events, 64, timeout);
+        for (int i = 0; i < rc; i++) {
+            struct pollfd pfd;
+            pfd.fd = events[i].data.fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (events[i].events & EPOLLIN) {
+                pfd.revents |= POLLIN;
+            }
+            if (events[i].events & EPOLLHUP) {
+                pfd.revents |= POLLHUP;
+            }
+            if (events[i].events & EPOLLERR) {
+                pfd.revents |= POLLERR;
+            }
+            ready.push_back(pfd);
+        }
+        return rc;
+    }
+#endif
+    if (fds.empty()) {
+        // poll() with no descriptors just sleeps
+        return poll(NULL, 0, timeout);
+    }
+    int rc = poll(&fds[0], fds.size(), timeout);
+    if (rc <= 0) {
+        return rc;
+    }
+    for (vector<struct pollfd>::iterator p = fds.begin(); p != fds.end(); p++) {
+        if (p->revents != 0) {
+            ready.push_back(*p);
+            p->revents = 0;
+        }
+    }
+    return ready.size();
+}
+
+/*
+ * Return a descriptor that becomes readable when process pid exits, or
+ * -1 if the kernel does not support it, in which case the caller has to
+ * check for the exit with waitpid().
+ */
+int open_pidfd(pid_t pid) {
+#if defined(LINUX) && defined(SYS_pidfd_open)
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0) {
+        log_trace("Unable to open pidfd for process %d: %s", pid, strerror(errno));
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
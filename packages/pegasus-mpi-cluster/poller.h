@@ -0,0 +1,36 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <vector>
+#include <poll.h>
+#include <sys/types.h>
+
+using std::vector;
+
+/*
+ * Waits for a set of descriptors to be readable. Descriptors are added
+ * when they are opened and removed before they are closed, instead of
+ * the set being rebuilt for every wait. On Linux this uses epoll, so a
+ * wait only costs as much as the number of descriptors that are ready.
+ * Elsewhere, or if epoll is not available, it uses poll(). The events
+ * are reported as pollfds with POLLIN, POLLHUP and POLLERR.
+ */
+class Poller {
+private:
+    int epfd;
+    // The descriptors for poll(), or the ones that epoll reported
+    vector<struct pollfd> fds;
+    unsigned count;
+
+public:
+    Poller();
+    ~Poller();
+    bool empty() { return count == 0; }
+    int add(int fd);
+    void remove(int fd);
+    int wait(int timeout, vector<struct pollfd> &ready);
+};
+
+int open_pidfd(pid_t pid);
+
+#endif /* POLLER_H */
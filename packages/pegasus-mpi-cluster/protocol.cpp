@@ -1,11 +1,66 @@
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "tools.h"
 #include "protocol.h"
 #include "failure.h"
 #include "log.h"
 
+/*
+ * Pool of message buffers. Buffers are allocated in power of two sizes
+ * so that a freed buffer can be reused for any message of about the same
+ * size, which avoids allocating a new buffer for every message sent and
+ * received. The pool is locked because messages can be received in one
+ * thread and deleted in another.
+ */
+static vector<char *> buffer_pool[32];
+static pthread_mutex_t buffer_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned buffer_class(unsigned size) {
+    unsigned c = 6;
+    while ((1u << c) < size) {
+        c++;
+    }
+    return c;
+}
+
+char *alloc_buffer(unsigned size) {
+    if (size > MAX_POOLED_BUFFER) {
+        return new char[size];
+    }
+    unsigned c = buffer_class(size);
+    char *buffer = NULL;
+    pthread_mutex_lock(&buffer_pool_lock);
+    if (!buffer_pool[c].empty()) {
+        buffer = buffer_pool[c].back();
+        buffer_pool[c].pop_back();
+    }
+    pthread_mutex_unlock(&buffer_pool_lock);
+    if (buffer == NULL) {
+        buffer = new char[1u << c];
+    }
+    return buffer;
+}
+
+void free_buffer(char *buffer, unsigned size) {
+    if (buffer == NULL) {
+        return;
+    }
+    if (size > MAX_POOLED_BUFFER) {
+        delete [] buffer;
+        return;
+    }
+    unsigned c = buffer_class(size);
+    pthread_mutex_lock(&buffer_pool_lock);
+    if (buffer_pool[c].size() < MAX_POOL_BUFFERS) {
+        buffer_pool[c].push_back(buffer);
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&buffer_pool_lock);
+    delete [] buffer;
+}
+
 Message::Message() {
     this->msg = NULL;
     this->msgsize = 0;
@@ -19,7 +74,7 @@ Message::Message(char *msg, unsigned msgsize, int source) {
 }
 
 Message::~Message() {
-    delete [] msg;
+    free_buffer(msg, msgsize);
 }
 
 ShutdownMessage::ShutdownMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
@@ -59,6 +114,18 @@ CommandMessage::CommandMessage(char *msg, unsigned msgsize, int source) : Messag
     memcpy(&cpus, msg + off, sizeof(cpus));
     off += sizeof(cpus);
 
+    // Get the gpu requirement
+    memcpy(&gpus, msg + off, sizeof(gpus));
+    off += sizeof(gpus);
+
+    // Get the number of threads
+    memcpy(&threads, msg + off, sizeof(threads));
+    off += sizeof(threads);
+
+    // Get the runtime limit
+    memcpy(&max_runtime, msg + off, sizeof(max_runtime));
+    off += sizeof(max_runtime);
+
     // Get the number of bindings
     cpu_t nbindings;
     memcpy(&nbindings, msg + off, sizeof(nbindings));
@@ -72,6 +139,13 @@ CommandMessage::CommandMessage(char *msg, unsigned msgsize, int source) : Messag
         off += sizeof(binding);
     }
 
+    // Get the GPU bindings
+    cpu_t ngpu_bindings;
+    memcpy(&ngpu_bindings, msg + off, sizeof(ngpu_bindings));
+    off += sizeof(ngpu_bindings);
+    gpu_bindings.assign(msg + off, msg + off + ngpu_bindings);
+    off += ngpu_bindings;
+
     // Get the number of pipe forwards
     unsigned char npipes;
     memcpy(&npipes, msg + off, sizeof(npipes));
@@ -99,23 +173,51 @@ CommandMessage::CommandMessage(char *msg, unsigned msgsize, int source) : Messag
         off += destfile.length() + 1;
         file_forwards[srcfile] = destfile;
     }
+
+    // Get the hosts
+    unsigned nhosts;
+    memcpy(&nhosts, msg + off, sizeof(nhosts));
+    off += sizeof(nhosts);
+    for (unsigned i = 0; i<nhosts; i++) {
+        string host = msg + off;
+        off += host.length() + 1;
+        hosts.push_back(host);
+    }
 }
 
-CommandMessage::CommandMessage(const string &name, const list<string> &args, const string &id, unsigned memory, cpu_t cpus, const vector<cpu_t> &bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards) {
-    this->name = name;
+CommandMessage::CommandMessage(const string &name, const list<string> &args, const string &id, unsigned memory, cpu_t cpus, const vector<cpu_t> &bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards, double max_runtime, cpu_t gpus, const vector<cpu_t> &gpu_bindings, const vector<string> &hosts, cpu_t threads) {
     this->args = args;
+    encode(name, id, memory, cpus, gpus, threads, max_runtime, bindings, gpu_bindings, pipe_forwards, file_forwards, hosts);
+}
+
+CommandMessage::CommandMessage(const string &name, const vector<const string *> &args, const string &id, unsigned memory, cpu_t cpus, const vector<cpu_t> &bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards, double max_runtime, cpu_t gpus, const vector<cpu_t> &gpu_bindings, const vector<string> &hosts, cpu_t threads) {
+    for (unsigned i = 0; i < args.size(); i++) {
+        this->args.push_back(*args[i]);
+    }
+    encode(name, id, memory, cpus, gpus, threads, max_runtime, bindings, gpu_bindings, pipe_forwards, file_forwards, hosts);
+}
+
+void CommandMessage::encode(const string &name, const string &id, unsigned memory, cpu_t cpus, cpu_t gpus, cpu_t threads, double max_runtime, const vector<cpu_t> &bindings, const vector<cpu_t> &gpu_bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards, const vector<string> &hosts) {
+    this->name = name;
     this->id = id;
     this->memory = memory;
     this->cpus = cpus;
+    this->gpus = gpus;
+    this->threads = threads;
+    this->max_runtime = max_runtime;
     this->bindings = bindings;
+    this->gpu_bindings = gpu_bindings;
     if (pipe_forwards) this->pipe_forwards = *pipe_forwards;
     if (file_forwards) this->file_forwards = *file_forwards;
+    this->hosts = hosts;
 
     // Compute the size of the variable length sections
     unsigned nargs = this->args.size();
     cpu_t nbindings = this->bindings.size();
+    cpu_t ngpu_bindings = this->gpu_bindings.size();
     unsigned char npipes = this->pipe_forwards.size();
     unsigned char nfiles = this->file_forwards.size();
+    unsigned nhosts = this->hosts.size();
 
     // The constant part of the message size
     msgsize = name.length() + 1 +
@@ -123,9 +225,14 @@ CommandMessage::CommandMessage(const string &name, const list<string> &args, con
               id.length() + 1 +
               sizeof(memory) +
               sizeof(cpus) +
+              sizeof(gpus) +
+              sizeof(threads) +
+              sizeof(max_runtime) +
               sizeof(nbindings) + (nbindings * sizeof(cpu_t)) +
+              sizeof(ngpu_bindings) + (ngpu_bindings * sizeof(cpu_t)) +
               sizeof(npipes) +
-              sizeof(nfiles);
+              sizeof(nfiles) +
+              sizeof(nhosts);
 
     // Add the size of the arguments section
     list<string>::iterator l;
@@ -146,8 +253,13 @@ CommandMessage::CommandMessage(const string &name, const list<string> &args, con
         msgsize += m->second.length() + 1;
     }
 
+    // Add the size of the hosts section
+    for (unsigned i = 0; i < nhosts; i++) {
+        msgsize += this->hosts[i].length() + 1;
+    }
+
     // Now allocate an appropriate-sized buffer
-    msg = new char[msgsize];
+    msg = alloc_buffer(msgsize);
 
     // This keeps track of where we are writing to the message buffer
     int off = 0;
@@ -176,6 +288,18 @@ CommandMessage::CommandMessage(const string &name, const list<string> &args, con
     memcpy(msg + off, &cpus, sizeof(cpus));
     off += sizeof(cpus);
 
+    // Add the GPU requirement
+    memcpy(msg + off, &gpus, sizeof(gpus));
+    off += sizeof(gpus);
+
+    // Add the number of threads
+    memcpy(msg + off, &threads, sizeof(threads));
+    off += sizeof(threads);
+
+    // Add the runtime limit
+    memcpy(msg + off, &max_runtime, sizeof(max_runtime));
+    off += sizeof(max_runtime);
+
     // Add the bindings
     memcpy(msg + off, &nbindings, sizeof(nbindings));
     off += sizeof(nbindings);
@@ -185,6 +309,13 @@ CommandMessage::CommandMessage(const string &name, const list<string> &args, con
         off += sizeof(binding);
     }
 
+    // Add the GPU bindings
+    memcpy(msg + off, &ngpu_bindings, sizeof(ngpu_bindings));
+    off += sizeof(ngpu_bindings);
+    for (cpu_t i = 0; i < ngpu_bindings; i++) {
+        msg[off++] = this->gpu_bindings[i];
+    }
+
     // Add the pipe forwards
     memcpy(msg + off, &npipes, sizeof(npipes));
     off += sizeof(npipes);
@@ -208,33 +339,117 @@ CommandMessage::CommandMessage(const string &name, const list<string> &args, con
         strcpy(msg + off, destfile->c_str());
         off += destfile->length() + 1;
     }
+
+    // Add the hosts
+    memcpy(msg + off, &nhosts, sizeof(nhosts));
+    off += sizeof(nhosts);
+    for (unsigned i = 0; i < nhosts; i++) {
+        strcpy(msg + off, this->hosts[i].c_str());
+        off += this->hosts[i].length() + 1;
+    }
 }
 
 ResultMessage::ResultMessage(char *msg, unsigned msgsize, int source, int _dummy_) : Message(msg, msgsize, source) {
     int off = 0;
     name = msg;
-    off += name.length() + 1;
+    off += strlen(name) + 1;
     memcpy(&exitcode, msg + off, sizeof(exitcode));
     off += sizeof(exitcode);
     memcpy(&runtime, msg + off, sizeof(runtime));
-    //off += sizeof(runtime);
+    off += sizeof(runtime);
+    memcpy(&launch, msg + off, sizeof(launch));
+    off += sizeof(launch);
+    timeout = msg[off] != 0;
+    off += 1;
+    memcpy(&usage, msg + off, sizeof(usage));
+    off += sizeof(usage);
+    unsigned char ntimes = msg[off];
+    off += 1;
+    trace.resize(ntimes);
+    for (unsigned i = 0; i < ntimes; i++) {
+        memcpy(&trace[i], msg + off, sizeof(double));
+        off += sizeof(double);
+    }
+    memcpy(&start, msg + off, sizeof(start));
+    off += sizeof(start);
+    unsigned nfiles;
+    memcpy(&nfiles, msg + off, sizeof(nfiles));
+    off += sizeof(nfiles);
+    files.resize(nfiles);
+    for (unsigned i = 0; i < nfiles; i++) {
+        FileUsage &f = files[i];
+        f.path = msg + off;
+        off += f.path.length() + 1;
+        memcpy(&f.size, msg + off, sizeof(f.size));
+        off += sizeof(f.size);
+        memcpy(&f.bread, msg + off, sizeof(f.bread));
+        off += sizeof(f.bread);
+        memcpy(&f.bwrite, msg + off, sizeof(f.bwrite));
+        off += sizeof(f.bwrite);
+    }
+    memcpy(&stall, msg + off, sizeof(stall));
+    off += sizeof(stall);
 }
 
-ResultMessage::ResultMessage(const string &name, int exitcode, double runtime) {
-    this->name = name;
+ResultMessage::ResultMessage(const string &name, int exitcode, double runtime, double launch,
+        bool timeout, const vector<double> &trace, const TaskUsage &usage, double start,
+        const vector<FileUsage> &files, double stall) {
     this->exitcode = exitcode;
     this->runtime = runtime;
+    this->launch = launch;
+    this->timeout = timeout;
+    this->usage = usage;
+    this->trace = trace;
+    this->start = start;
+    this->files = files;
+    this->stall = stall;
 
-    this->msgsize = name.length() + 1 + sizeof(exitcode) + sizeof(runtime);
-    this->msg = new char[this->msgsize];
+    unsigned nfiles = files.size();
+    this->msgsize = name.length() + 1 + sizeof(exitcode) + sizeof(runtime) + sizeof(launch) + 1 +
+        sizeof(usage) + 1 + trace.size() * sizeof(double) + sizeof(start) + sizeof(nfiles) +
+        sizeof(stall);
+    for (unsigned i = 0; i < nfiles; i++) {
+        this->msgsize += files[i].path.length() + 1 + 3 * sizeof(unsigned long long);
+    }
+    this->msg = alloc_buffer(this->msgsize);
     
     int off = 0;
     strcpy(msg + off, name.c_str());
+    this->name = msg + off;
     off += name.length() + 1;
     memcpy(msg + off, &exitcode, sizeof(exitcode));
     off += sizeof(exitcode);
     memcpy(msg + off, &runtime, sizeof(runtime));
-    //off += sizeof(runtime);
+    off += sizeof(runtime);
+    memcpy(msg + off, &launch, sizeof(launch));
+    off += sizeof(launch);
+    msg[off] = timeout ? 1 : 0;
+    off += 1;
+    memcpy(msg + off, &usage, sizeof(usage));
+    off += sizeof(usage);
+    msg[off] = (unsigned char)trace.size();
+    off += 1;
+    for (unsigned i = 0; i < trace.size(); i++) {
+        memcpy(msg + off, &trace[i], sizeof(double));
+        off += sizeof(double);
+    }
+    memcpy(msg + off, &start, sizeof(start));
+    off += sizeof(start);
+    memcpy(msg + off, &nfiles, sizeof(nfiles));
+    off += sizeof(nfiles);
+    for (unsigned i = 0; i < nfiles; i++) {
+        const FileUsage &f = files[i];
+        strcpy(msg + off, f.path.c_str());
+        off += f.path.length() + 1;
+        memcpy(msg + off, &f.size, sizeof(f.size));
+        off += sizeof(f.size);
+        memcpy(msg + off, &f.bread, sizeof(f.bread));
+        off += sizeof(f.bread);
+        memcpy(msg + off, &f.bwrite, sizeof(f.bwrite));
+        off += sizeof(f.bwrite);
+    }
+    memcpy(msg + off, &stall, sizeof(stall));
+    off += sizeof(stall);
 }
 
 RegistrationMessage::RegistrationMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
@@ -247,18 +462,40 @@ RegistrationMessage::RegistrationMessage(char *msg, unsigned msgsize, int source
     memcpy(&cores, msg + off, sizeof(cores));
     off += sizeof(cores);
     memcpy(&sockets, msg + off, sizeof(sockets));
-    //off += sizeof(sockets);
+    off += sizeof(sockets);
+    unsigned ncpus;
+    memcpy(&ncpus, msg + off, sizeof(ncpus));
+    off += sizeof(ncpus);
+    cpu_cores.assign(msg + off, msg + off + ncpus);
+    off += ncpus;
+    cpu_sockets.assign(msg + off, msg + off + ncpus);
+    off += ncpus;
+    memcpy(&gpus, msg + off, sizeof(gpus));
+    off += sizeof(gpus);
+    memcpy(&staging, msg + off, sizeof(staging));
+    //off += sizeof(staging);
 }
 
-RegistrationMessage::RegistrationMessage(const string &hostname, unsigned memory, cpu_t threads, cpu_t cores, cpu_t sockets) {
+RegistrationMessage::RegistrationMessage(const string &hostname, unsigned memory, cpu_t threads, cpu_t cores, cpu_t sockets,
+        const vector<cpu_t> &cpu_cores, const vector<cpu_t> &cpu_sockets, cpu_t gpus,
+        unsigned staging) {
     this->hostname = hostname;
     this->memory = memory;
     this->threads = threads;
     this->cores = cores;
     this->sockets = sockets;
+    this->cpu_cores = cpu_cores;
+    this->cpu_sockets = cpu_sockets;
+    this->gpus = gpus;
+    this->staging = staging;
+    if (cpu_sockets.size() != cpu_cores.size()) {
+        myfailure("Topology must have a core and a socket for each CPU");
+    }
+    unsigned ncpus = cpu_cores.size();
 
-    this->msgsize = hostname.length() + 1 + sizeof(memory) + sizeof(threads) + sizeof(cores) + sizeof(sockets);
-    this->msg = new char[this->msgsize];
+    this->msgsize = hostname.length() + 1 + sizeof(memory) + sizeof(threads) + sizeof(cores) + sizeof(sockets) +
+        sizeof(ncpus) + 2 * ncpus + sizeof(gpus) + sizeof(staging);
+    this->msg = alloc_buffer(this->msgsize);
 
     int off = 0;
     strcpy(msg + off, hostname.c_str());
@@ -270,49 +507,603 @@ RegistrationMessage::RegistrationMessage(const string &hostname, unsigned memory
     memcpy(msg + off, &cores, sizeof(cores));
     off += sizeof(cores);
     memcpy(msg + off, &sockets, sizeof(sockets));
-    //off += sizeof(sockets);
+    off += sizeof(sockets);
+    memcpy(msg + off, &ncpus, sizeof(ncpus));
+    off += sizeof(ncpus);
+    for (unsigned i = 0; i < ncpus; i++) {
+        msg[off + i] = cpu_cores[i];
+        msg[off + ncpus + i] = cpu_sockets[i];
+    }
+    off += 2 * ncpus;
+    memcpy(msg + off, &gpus, sizeof(gpus));
+    off += sizeof(gpus);
+    memcpy(msg + off, &staging, sizeof(staging));
+    //off += sizeof(staging);
 }
 
 HostrankMessage::HostrankMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
-    memcpy(&hostrank, msg, sizeof(hostrank));
+    unsigned count;
+    memcpy(&count, msg, sizeof(count));
+    int off = sizeof(count);
+    hostranks.resize(count);
+    masters.resize(count);
+    if (count > 0) {
+        memcpy(&hostranks[0], msg + off, count * sizeof(int));
+        off += count * sizeof(int);
+        memcpy(&masters[0], msg + off, count * sizeof(int));
+    }
 }
 
-HostrankMessage::HostrankMessage(int hostrank) {
-    this->hostrank = hostrank;
-    
-    this->msgsize = sizeof(hostrank);
-    this->msg = new char [this->msgsize];
-    
-    memcpy(msg, &hostrank, sizeof(hostrank));
+HostrankMessage::HostrankMessage(const vector<int> &hostranks, const vector<int> &masters) {
+    this->hostranks = hostranks;
+    this->masters = masters;
+
+    unsigned count = hostranks.size();
+    this->msgsize = sizeof(count) + 2 * count * sizeof(int);
+    this->msg = alloc_buffer(this->msgsize);
+
+    int off = 0;
+    memcpy(msg + off, &count, sizeof(count));
+    off += sizeof(count);
+    if (count > 0) {
+        memcpy(msg + off, &hostranks[0], count * sizeof(int));
+        off += count * sizeof(int);
+        memcpy(msg + off, &masters[0], count * sizeof(int));
+    }
 }
 
 IODataMessage::IODataMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
     int off = 0;
     task = msg + off;
-    off += task.length() + 1;
+    off += strlen(task) + 1;
     filename = msg + off;
-    off += filename.length() + 1;
+    off += strlen(filename) + 1;
+    memcpy(&seq, msg + off, sizeof(seq));
+    off += sizeof(seq);
+    last = (msg[off] & 1) != 0;
+    provisional = (msg[off] & 2) != 0;
+    aborted = (msg[off] & 4) != 0;
+    off += 1;
     memcpy(&size, msg + off, sizeof(size));
     off += sizeof(size);
     data = msg + off;
 }
 
-IODataMessage::IODataMessage(const string &task, const string &filename, const char *data, unsigned size) {
-    this->task = task;
-    this->filename = filename;
-    this->data = data;
+IODataMessage::IODataMessage(const string &task, const string &filename, const char *data, unsigned size, unsigned seq, bool last, bool provisional, bool aborted) {
+    this->seq = seq;
+    this->last = last;
+    this->provisional = provisional;
+    this->aborted = aborted;
     this->size = size;
 
-    this->msgsize = task.length() + 1 + filename.length() + 1 + sizeof(size) + size;
-    this->msg = new char [this->msgsize];
+    this->msgsize = task.length() + 1 + filename.length() + 1 + sizeof(seq) + 1 + sizeof(size) + size;
+    this->msg = alloc_buffer(this->msgsize);
     
     int off = 0;
     strcpy(msg + off, task.c_str());
+    this->task = msg + off;
     off += task.length() + 1;
     strcpy(msg + off, filename.c_str());
+    this->filename = msg + off;
     off += filename.length() + 1;
+    memcpy(msg + off, &seq, sizeof(seq));
+    off += sizeof(seq);
+    msg[off] = (last ? 1 : 0) | (provisional ? 2 : 0) | (aborted ? 4 : 0);
+    off += 1;
     memcpy(msg + off, &size, sizeof(size));
     off += sizeof(size);
     memcpy(msg + off, data, size);
+    this->data = msg + off;
+}
+
+
+CreditMessage::CreditMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    memcpy(&credits, msg, sizeof(credits));
+}
+
+CreditMessage::CreditMessage(unsigned credits) {
+    this->credits = credits;
+
+    this->msgsize = sizeof(credits);
+    this->msg = alloc_buffer(this->msgsize);
+
+    memcpy(msg, &credits, sizeof(credits));
+}
+
+CancelMessage::CancelMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    name = msg;
 }
 
+CancelMessage::CancelMessage(const string &name) {
+    this->name = name;
+
+    this->msgsize = name.length() + 1;
+    this->msg = alloc_buffer(this->msgsize);
+
+    strcpy(msg, name.c_str());
+}
+
+StageMessage::StageMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    unsigned off = 0;
+    unsigned count;
+    memcpy(&count, msg + off, sizeof(count));
+    off += sizeof(count);
+    for (unsigned i = 0; i < count; i++) {
+        int rank;
+        memcpy(&rank, msg + off, sizeof(rank));
+        off += sizeof(rank);
+        string path = msg + off;
+        off += path.length() + 1;
+        ranks.push_back(rank);
+        paths.push_back(path);
+    }
+}
+
+StageMessage::StageMessage(const vector<string> &paths, const vector<int> &ranks) {
+    this->paths = paths;
+    this->ranks = ranks;
+
+    unsigned count = paths.size();
+    this->msgsize = sizeof(count);
+    for (unsigned i = 0; i < count; i++) {
+        this->msgsize += sizeof(int) + paths[i].length() + 1;
+    }
+    this->msg = alloc_buffer(this->msgsize);
+
+    unsigned off = 0;
+    memcpy(msg + off, &count, sizeof(count));
+    off += sizeof(count);
+    for (unsigned i = 0; i < count; i++) {
+        memcpy(msg + off, &ranks[i], sizeof(int));
+        off += sizeof(int);
+        strcpy(msg + off, paths[i].c_str());
+        off += paths[i].length() + 1;
+    }
+}
+
+FetchMessage::FetchMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    path = msg;
+}
+
+FetchMessage::FetchMessage(const string &path) {
+    this->path = path;
+
+    this->msgsize = path.length() + 1;
+    this->msg = alloc_buffer(this->msgsize);
+
+    strcpy(msg, path.c_str());
+}
+
+StagedMessage::StagedMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    int off = 0;
+    path = msg + off;
+    off += strlen(path) + 1;
+    found = msg[off] != 0;
+    off += 1;
+    memcpy(&size, msg + off, sizeof(size));
+    off += sizeof(size);
+    data = msg + off;
+}
+
+StagedMessage::StagedMessage(const string &path, bool found, const char *data, unsigned size) {
+    this->found = found;
+    this->size = size;
+
+    this->msgsize = path.length() + 1 + 1 + sizeof(size) + size;
+    this->msg = alloc_buffer(this->msgsize);
+
+    int off = 0;
+    strcpy(msg + off, path.c_str());
+    this->path = msg + off;
+    off += path.length() + 1;
+    msg[off] = found ? 1 : 0;
+    off += 1;
+    memcpy(msg + off, &size, sizeof(size));
+    off += sizeof(size);
+    if (size > 0) {
+        memcpy(msg + off, data, size);
+    }
+    this->data = msg + off;
+}
+
+UnstageMessage::UnstageMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    unsigned off = 0;
+    while (off < msgsize) {
+        string path = msg + off;
+        off += path.length() + 1;
+        paths.push_back(path);
+    }
+}
+
+UnstageMessage::UnstageMessage(const vector<string> &paths) {
+    this->paths = paths;
+
+    this->msgsize = 0;
+    for (unsigned i = 0; i < paths.size(); i++) {
+        this->msgsize += paths[i].length() + 1;
+    }
+    this->msg = alloc_buffer(this->msgsize);
+
+    unsigned off = 0;
+    for (unsigned i = 0; i < paths.size(); i++) {
+        strcpy(msg + off, paths[i].c_str());
+        off += paths[i].length() + 1;
+    }
+}
+
+ReserveMessage::ReserveMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    unsigned off = 0;
+    task = msg + off;
+    off += task.length() + 1;
+    while (off < msgsize) {
+        unsigned long long size;
+        memcpy(&size, msg + off, sizeof(size));
+        off += sizeof(size);
+        string filename = msg + off;
+        off += filename.length() + 1;
+        sizes.push_back(size);
+        filenames.push_back(filename);
+    }
+}
+
+ReserveMessage::ReserveMessage(const string &task, const vector<string> &filenames,
+        const vector<unsigned long long> &sizes) {
+    this->task = task;
+    this->filenames = filenames;
+    this->sizes = sizes;
+
+    this->msgsize = task.length() + 1;
+    for (unsigned i = 0; i < filenames.size(); i++) {
+        this->msgsize += sizeof(unsigned long long) + filenames[i].length() + 1;
+    }
+    this->msg = alloc_buffer(this->msgsize);
+
+    unsigned off = 0;
+    strcpy(msg + off, task.c_str());
+    off += task.length() + 1;
+    for (unsigned i = 0; i < filenames.size(); i++) {
+        memcpy(msg + off, &sizes[i], sizeof(unsigned long long));
+        off += sizeof(unsigned long long);
+        strcpy(msg + off, filenames[i].c_str());
+        off += filenames[i].length() + 1;
+    }
+}
+
+RegionMessage::RegionMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    unsigned count = msgsize / sizeof(unsigned long long);
+    offsets.resize(count);
+    if (count > 0) {
+        memcpy(&offsets[0], msg, count * sizeof(unsigned long long));
+    }
+}
+
+RegionMessage::RegionMessage(const vector<unsigned long long> &offsets) {
+    this->offsets = offsets;
+
+    this->msgsize = offsets.size() * sizeof(unsigned long long);
+    this->msg = alloc_buffer(this->msgsize);
+
+    if (!offsets.empty()) {
+        memcpy(msg, &offsets[0], msgsize);
+    }
+}
+
+CommitMessage::CommitMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    ok = msg[0] != 0;
+    task = msg + 1;
+}
+
+CommitMessage::CommitMessage(const string &task, bool ok) {
+    this->task = task;
+    this->ok = ok;
+
+    this->msgsize = 1 + task.length() + 1;
+    this->msg = alloc_buffer(this->msgsize);
+
+    msg[0] = ok ? 1 : 0;
+    strcpy(msg + 1, task.c_str());
+}
+
+FilesMessage::FilesMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    unsigned off = 0;
+    last = msg[off] != 0;
+    off += 1;
+    while (off < msgsize) {
+        BroadcastFile file;
+        file.type = msg[off];
+        off += 1;
+        memcpy(&file.mode, msg + off, sizeof(file.mode));
+        off += sizeof(file.mode);
+        memcpy(&file.offset, msg + off, sizeof(file.offset));
+        off += sizeof(file.offset);
+        memcpy(&file.size, msg + off, sizeof(file.size));
+        off += sizeof(file.size);
+        file.path = msg + off;
+        off += file.path.length() + 1;
+        file.data = msg + off;
+        off += file.size;
+        files.push_back(file);
+    }
+}
+
+FilesMessage::FilesMessage(const vector<BroadcastFile> &files, bool last) {
+    this->files = files;
+    this->last = last;
+
+    this->msgsize = 1;
+    for (unsigned i = 0; i < files.size(); i++) {
+        this->msgsize += 1 + sizeof(files[i].mode) + sizeof(files[i].offset) +
+            sizeof(files[i].size) + files[i].path.length() + 1 + files[i].size;
+    }
+    this->msg = alloc_buffer(this->msgsize);
+
+    unsigned off = 0;
+    msg[off] = last ? 1 : 0;
+    off += 1;
+    for (unsigned i = 0; i < files.size(); i++) {
+        const BroadcastFile &file = files[i];
+        msg[off] = file.type;
+        off += 1;
+        memcpy(msg + off, &file.mode, sizeof(file.mode));
+        off += sizeof(file.mode);
+        memcpy(msg + off, &file.offset, sizeof(file.offset));
+        off += sizeof(file.offset);
+        memcpy(msg + off, &file.size, sizeof(file.size));
+        off += sizeof(file.size);
+        strcpy(msg + off, file.path.c_str());
+        off += file.path.length() + 1;
+        if (file.size > 0) {
+            memcpy(msg + off, file.data, file.size);
+        }
+        this->files[i].data = msg + off;
+        off += file.size;
+    }
+}
+
+ReadyMessage::ReadyMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    memcpy(&status, msg, sizeof(status));
+}
+
+ReadyMessage::ReadyMessage(int status) {
+    this->status = status;
+
+    this->msgsize = sizeof(status);
+    this->msg = alloc_buffer(this->msgsize);
+
+    memcpy(msg, &status, sizeof(status));
+}
+
+BatchMessage::BatchMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    unsigned off = 0;
+    unsigned count;
+    memcpy(&count, msg + off, sizeof(count));
+    off += sizeof(count);
+
+    for (unsigned i = 0; i < count; i++) {
+        int tag;
+        int rank;
+        unsigned size;
+        memcpy(&tag, msg + off, sizeof(tag));
+        off += sizeof(tag);
+        memcpy(&rank, msg + off, sizeof(rank));
+        off += sizeof(rank);
+        memcpy(&size, msg + off, sizeof(size));
+        off += sizeof(size);
+
+        // Each message owns its buffer, so it needs a copy
+        char *data = alloc_buffer(size);
+        memcpy(data, msg + off, size);
+        off += size;
+
+        messages.push_back(create_message(tag, data, size, rank));
+    }
+}
+
+BatchMessage::BatchMessage(const vector<Message *> &messages, const vector<int> &ranks) {
+    unsigned count = messages.size();
+
+    this->msgsize = sizeof(count);
+    for (unsigned i = 0; i < count; i++) {
+        this->msgsize += sizeof(int) + sizeof(int) + sizeof(unsigned) + messages[i]->msgsize;
+    }
+    this->msg = alloc_buffer(this->msgsize);
+
+    unsigned off = 0;
+    memcpy(msg + off, &count, sizeof(count));
+    off += sizeof(count);
+    for (unsigned i = 0; i < count; i++) {
+        Message *m = messages[i];
+        int tag = m->tag();
+        int rank = ranks[i];
+        unsigned size = m->msgsize;
+        memcpy(msg + off, &tag, sizeof(tag));
+        off += sizeof(tag);
+        memcpy(msg + off, &rank, sizeof(rank));
+        off += sizeof(rank);
+        memcpy(msg + off, &size, sizeof(size));
+        off += sizeof(size);
+        memcpy(msg + off, m->msg, size);
+        off += size;
+    }
+}
+
+BatchMessage::~BatchMessage() {
+    for (unsigned i = 0; i < messages.size(); i++) {
+        delete messages[i];
+    }
+}
+
+TaskTableMessage::TaskTableMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    unsigned off = 0;
+    unsigned count;
+    memcpy(&count, msg + off, sizeof(count));
+    off += sizeof(count);
+
+    // Just record where each command is, they are decoded on demand
+    offsets.reserve(count);
+    for (unsigned i = 0; i < count; i++) {
+        unsigned size;
+        offsets.push_back(off);
+        memcpy(&size, msg + off, sizeof(size));
+        off += sizeof(size) + size;
+    }
+}
+
+TaskTableMessage::TaskTableMessage(const vector<Message *> &commands) {
+    unsigned count = commands.size();
+
+    this->msgsize = sizeof(count);
+    for (unsigned i = 0; i < count; i++) {
+        this->msgsize += sizeof(unsigned) + commands[i]->msgsize;
+    }
+    this->msg = alloc_buffer(this->msgsize);
+
+    unsigned off = 0;
+    memcpy(msg + off, &count, sizeof(count));
+    off += sizeof(count);
+    for (unsigned i = 0; i < count; i++) {
+        unsigned size = commands[i]->msgsize;
+        offsets.push_back(off);
+        memcpy(msg + off, &size, sizeof(size));
+        off += sizeof(size);
+        memcpy(msg + off, commands[i]->msg, size);
+        off += size;
+    }
+}
+
+/* Decode the command for the task at index. The caller must delete it. */
+CommandMessage *TaskTableMessage::command(unsigned index) {
+    if (index >= offsets.size()) {
+        myfailure("Invalid task index: %u", index);
+    }
+    unsigned off = offsets[index];
+    unsigned size;
+    memcpy(&size, msg + off, sizeof(size));
+    off += sizeof(size);
+
+    char *data = alloc_buffer(size);
+    memcpy(data, msg + off, size);
+    return new CommandMessage(data, size, source);
+}
+
+TaskMessage::TaskMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    unsigned off = 0;
+    memcpy(&index, msg + off, sizeof(index));
+    off += sizeof(index);
+
+    cpu_t nbindings;
+    memcpy(&nbindings, msg + off, sizeof(nbindings));
+    off += sizeof(nbindings);
+    for (cpu_t i = 0; i < nbindings; i++) {
+        cpu_t binding;
+        memcpy(&binding, msg + off, sizeof(binding));
+        off += sizeof(binding);
+        bindings.push_back(binding);
+    }
+
+    cpu_t ngpu_bindings;
+    memcpy(&ngpu_bindings, msg + off, sizeof(ngpu_bindings));
+    off += sizeof(ngpu_bindings);
+    gpu_bindings.assign(msg + off, msg + off + ngpu_bindings);
+}
+
+TaskMessage::TaskMessage(unsigned index, const vector<cpu_t> &bindings,
+        const vector<cpu_t> &gpu_bindings) {
+    this->index = index;
+    this->bindings = bindings;
+    this->gpu_bindings = gpu_bindings;
+
+    cpu_t nbindings = bindings.size();
+    cpu_t ngpu_bindings = gpu_bindings.size();
+    this->msgsize = sizeof(index) + sizeof(nbindings) + nbindings * sizeof(cpu_t) +
+        sizeof(ngpu_bindings) + ngpu_bindings * sizeof(cpu_t);
+    this->msg = alloc_buffer(this->msgsize);
+
+    unsigned off = 0;
+    memcpy(msg + off, &index, sizeof(index));
+    off += sizeof(index);
+    memcpy(msg + off, &nbindings, sizeof(nbindings));
+    off += sizeof(nbindings);
+    for (cpu_t i = 0; i < nbindings; i++) {
+        cpu_t binding = bindings[i];
+        memcpy(msg + off, &binding, sizeof(binding));
+        off += sizeof(binding);
+    }
+    memcpy(msg + off, &ngpu_bindings, sizeof(ngpu_bindings));
+    off += sizeof(ngpu_bindings);
+    for (cpu_t i = 0; i < ngpu_bindings; i++) {
+        msg[off++] = gpu_bindings[i];
+    }
+}
+
+/* Create the right type of message for tag. The message takes ownership of msg. */
+Message *create_message(int tag, char *msg, unsigned msgsize, int source) {
+    Message *message = NULL;
+    MessageType type = (MessageType)tag;
+    switch(type) {
+        case SHUTDOWN:
+            message = new ShutdownMessage(msg, msgsize, source);
+            break;
+        case COMMAND:
+            message = new CommandMessage(msg, msgsize, source);
+            break;
+        case RESULT:
+            // The extra zero is just for disambiguation
+            message = new ResultMessage(msg, msgsize, source, 0);
+            break;
+        case REGISTRATION:
+            message = new RegistrationMessage(msg, msgsize, source);
+            break;
+        case HOSTRANK:
+            message = new HostrankMessage(msg, msgsize, source);
+            break;
+        case IODATA:
+            message = new IODataMessage(msg, msgsize, source);
+            break;
+        case BATCH:
+            message = new BatchMessage(msg, msgsize, source);
+            break;
+        case TASKTABLE:
+            message = new TaskTableMessage(msg, msgsize, source);
+            break;
+        case TASK:
+            message = new TaskMessage(msg, msgsize, source);
+            break;
+        case CREDIT:
+            message = new CreditMessage(msg, msgsize, source);
+            break;
+        case CANCEL:
+            message = new CancelMessage(msg, msgsize, source);
+            break;
+        case STAGE:
+            message = new StageMessage(msg, msgsize, source);
+            break;
+        case FETCH:
+            message = new FetchMessage(msg, msgsize, source);
+            break;
+        case STAGED:
+            message = new StagedMessage(msg, msgsize, source);
+            break;
+        case UNSTAGE:
+            message = new UnstageMessage(msg, msgsize, source);
+            break;
+        case READY:
+            message = new ReadyMessage(msg, msgsize, source);
+            break;
+        case RESERVE:
+            message = new ReserveMessage(msg, msgsize, source);
+            break;
+        case REGION:
+            message = new RegionMessage(msg, msgsize, source);
+            break;
+        case COMMIT:
+            message = new CommitMessage(msg, msgsize, source);
+            break;
+        case FILES:
+            message = new FilesMessage(msg, msgsize, source);
+            break;
+        default:
+            myfailure("Unknown message type: %d", type);
+    }
+    return message;
+}
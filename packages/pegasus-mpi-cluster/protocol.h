@@ -19,9 +19,51 @@ enum MessageType {
     SHUTDOWN     = 3,
     REGISTRATION = 4,
     HOSTRANK     = 5,
-    IODATA       = 6
+    IODATA       = 6,
+    BATCH        = 7,
+    TASKTABLE    = 8,
+    TASK         = 9,
+    CREDIT       = 10,
+    CANCEL       = 11,
+    STAGE        = 12,
+    FETCH        = 13,
+    STAGED       = 14,
+    UNSTAGE      = 15,
+    READY        = 16,
+    RESERVE      = 17,
+    REGION       = 18,
+    COMMIT       = 19,
+    FILES        = 20
 };
 
+// Message buffers up to this size are kept in a pool for reuse
+#define MAX_POOLED_BUFFER (4*1024*1024)
+
+// Maximum number of free buffers kept for each size
+#define MAX_POOL_BUFFERS 64
+
+// Forwarded data larger than this is sent in chunks of this size
+#define IODATA_CHUNK_SIZE (1024*1024)
+
+// Files broadcast to the hosts at startup are sent in messages of about this size
+#define BROADCAST_FILES_CHUNK (4*1024*1024)
+
+// Number of chunks a worker can send before the master has written them
+#define IODATA_CREDITS 4
+
+// Destinations used to send task stdout/stderr to the master, which
+// writes them to its own task stdout/stderr
+#define IODATA_STDOUT "<stdout>"
+#define IODATA_STDERR "<stderr>"
+
+char *alloc_buffer(unsigned size);
+void free_buffer(char *buffer, unsigned size);
+
+/*
+ * A message owns its buffer, msg, which must have been allocated with
+ * alloc_buffer(msgsize). The buffer is returned to the pool when the
+ * message is deleted.
+ */
 class Message {
 public:
     int source;
@@ -48,23 +90,92 @@ public:
     string id;
     unsigned memory;
     cpu_t cpus;
+    cpu_t gpus;
+    // The threads the task runs, or 0 for one per CPU
+    cpu_t threads;
+    double max_runtime;
     vector<cpu_t> bindings;
+    vector<cpu_t> gpu_bindings;
     map<string, string> pipe_forwards;
     map<string, string> file_forwards;
+    // The hosts of a task that runs on several hosts, starting with the
+    // host of the worker that launches it
+    vector<string> hosts;
 
     CommandMessage(char *msg, unsigned msgsize, int source);
-    CommandMessage(const string &name, const list<string> &args, const string &id, unsigned memory, cpu_t cpus, const vector<cpu_t> &bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards);
+    CommandMessage(const string &name, const list<string> &args, const string &id, unsigned memory, cpu_t cpus, const vector<cpu_t> &bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards, double max_runtime = 0.0, cpu_t gpus = 0, const vector<cpu_t> &gpu_bindings = vector<cpu_t>(), const vector<string> &hosts = vector<string>(), cpu_t threads = 0);
+    CommandMessage(const string &name, const vector<const string *> &args, const string &id, unsigned memory, cpu_t cpus, const vector<cpu_t> &bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards, double max_runtime = 0.0, cpu_t gpus = 0, const vector<cpu_t> &gpu_bindings = vector<cpu_t>(), const vector<string> &hosts = vector<string>(), cpu_t threads = 0);
     virtual int tag() const { return COMMAND; };
+private:
+    void encode(const string &name, const string &id, unsigned memory, cpu_t cpus, cpu_t gpus, cpu_t threads, double max_runtime, const vector<cpu_t> &bindings, const vector<cpu_t> &gpu_bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards, const vector<string> &hosts);
+};
+
+/* Times recorded by the worker for --trace, in the order they happen */
+enum TracePoint {
+    TRACE_RECEIVED = 0,
+    TRACE_LAUNCH   = 1,
+    TRACE_FORKED   = 2,
+    TRACE_EXITED   = 3,
+    TRACE_SENT     = 4,
+    TRACE_POINTS   = 5
 };
 
+/* The resources a task used, from wait4() on the worker */
+class TaskUsage {
+public:
+    // Peak resident set size in KB
+    unsigned long maxrss;
+    // User and system CPU time in seconds
+    double utime;
+    double stime;
+    // Blocks read and written by the file system
+    unsigned long inblock;
+    unsigned long oublock;
+    // Processes of the task killed for going over its --cgroup limit
+    unsigned oom_kills;
+
+    TaskUsage() : maxrss(0), utime(0.0), stime(0.0), inblock(0), oublock(0), oom_kills(0) {}
+};
+
+/* The I/O of a task on one file, from libinterpose with --monitor-interpose */
+class FileUsage {
+public:
+    string path;
+    unsigned long long size;
+    unsigned long long bread;
+    unsigned long long bwrite;
+
+    FileUsage() : size(0), bread(0), bwrite(0) {}
+};
+
+/*
+ * Results and I/O data are the messages the master handles most, so
+ * their strings point into the message buffer instead of being copied.
+ * They are only valid as long as the message exists.
+ */
 class ResultMessage: public Message {
 public:
-    string name;
+    const char *name;
     int exitcode;
     double runtime;
+    double launch;
+    // Set if the task was killed because it ran out of time
+    bool timeout;
+    TaskUsage usage;
+    // The time of each TracePoint, if the worker is tracing
+    vector<double> trace;
+    // When the task started on the worker, and the files it used if
+    // the worker runs tasks with --monitor-interpose
+    double start;
+    vector<FileUsage> files;
+    // Time the worker waited for I/O credit to send the task's data
+    double stall;
 
     ResultMessage(char *msg, unsigned msgsize, int source, int _dummy_);
-    ResultMessage(const string &name, int exitcode, double runtime);
+    ResultMessage(const string &name, int exitcode, double runtime, double launch = 0.0,
+            bool timeout = false, const vector<double> &trace = vector<double>(),
+            const TaskUsage &usage = TaskUsage(), double start = 0.0,
+            const vector<FileUsage> &files = vector<FileUsage>(), double stall = 0.0);
     virtual int tag() const { return RESULT; };
 };
 
@@ -76,31 +187,261 @@ public:
     cpu_t cores;
     cpu_t sockets;
 
+    // The core and socket of each CPU, if the worker knows the topology
+    vector<cpu_t> cpu_cores;
+    vector<cpu_t> cpu_sockets;
+
+    // The number of GPUs the worker found
+    cpu_t gpus;
+
+    // Capacity of the host's staging area in MB, or 0 if there is none
+    unsigned staging;
+
     RegistrationMessage(char *msg, unsigned msgsize, int source);
-    RegistrationMessage(const string &hostname, unsigned memory, cpu_t threads, cpu_t cores, cpu_t sockets);
+    RegistrationMessage(const string &hostname, unsigned memory, cpu_t threads, cpu_t cores, cpu_t sockets,
+            const vector<cpu_t> &cpu_cores = vector<cpu_t>(), 
+            const vector<cpu_t> &cpu_sockets = vector<cpu_t>(), cpu_t gpus = 0,
+            unsigned staging = 0);
     virtual int tag() const { return REGISTRATION; };
 };
 
+/*
+ * The host rank of every worker, broadcast to all the workers at startup.
+ * Both lists are indexed by worker rank - 1.
+ */
 class HostrankMessage: public Message {
 public:
-    int hostrank;
+    vector<int> hostranks;
+    // The rank that results should be sent to: either the master (0),
+    // or the sub-master for the worker's host
+    vector<int> masters;
 
     HostrankMessage(char *msg, unsigned msgsize, int source);
-    HostrankMessage(int hostrank);
+    HostrankMessage(const vector<int> &hostranks, const vector<int> &masters);
     virtual int tag() const { return HOSTRANK; };
 };
 
+/*
+ * Forwarded data for one destination file. Data that fits in one message
+ * has seq 0 and last set. Larger data is sent as a stream of chunks
+ * numbered from 0, and the last chunk has last set. Provisional chunks
+ * are sent while the task is still running, and are only written if the
+ * last chunk arrives, which the worker sends if the task succeeds. If the
+ * worker cannot finish a stream, then the last chunk is empty and has
+ * aborted set, and the master throws away the chunks it already got.
+ */
 class IODataMessage: public Message {
 public:
-    string task;
-    string filename;
+    const char *task;
+    const char *filename;
+    unsigned seq;
+    bool last;
+    bool provisional;
+    bool aborted;
     const char *data;
     unsigned size;
 
     IODataMessage(char *msg, unsigned msgsize, int source);
-    IODataMessage(const string &task, const string &filename, const char *data, unsigned size);
+    IODataMessage(const string &task, const string &filename, const char *data, unsigned size, unsigned seq = 0, bool last = true, bool provisional = false, bool aborted = false);
+    bool chunked() const { return seq > 0 || !last; }
     virtual int tag() const { return IODATA; }
 };
 
+/* Allows a worker to send more chunks of forwarded data */
+class CreditMessage: public Message {
+public:
+    unsigned credits;
+
+    CreditMessage(char *msg, unsigned msgsize, int source);
+    CreditMessage(unsigned credits);
+    virtual int tag() const { return CREDIT; }
+};
+
+/* Tells a worker to kill a task because a copy of it finished elsewhere */
+class CancelMessage: public Message {
+public:
+    string name;
+
+    CancelMessage(char *msg, unsigned msgsize, int source);
+    CancelMessage(const string &name);
+    virtual int tag() const { return CANCEL; }
+};
+
+/*
+ * Tells a worker to copy intermediate files into its host's staging area
+ * from the workers that have them before it runs its next task
+ */
+class StageMessage: public Message {
+public:
+    vector<string> paths;
+    vector<int> ranks;
+
+    StageMessage(char *msg, unsigned msgsize, int source);
+    StageMessage(const vector<string> &paths, const vector<int> &ranks);
+    virtual int tag() const { return STAGE; }
+};
+
+/* Asks another worker for an intermediate file in its staging area */
+class FetchMessage: public Message {
+public:
+    string path;
+
+    FetchMessage(char *msg, unsigned msgsize, int source);
+    FetchMessage(const string &path);
+    virtual int tag() const { return FETCH; }
+};
+
+/* The contents of an intermediate file, sent in reply to a fetch */
+class StagedMessage: public Message {
+public:
+    const char *path;
+    // False if the worker did not have the file
+    bool found;
+    const char *data;
+    unsigned size;
+
+    StagedMessage(char *msg, unsigned msgsize, int source);
+    StagedMessage(const string &path, bool found, const char *data, unsigned size);
+    virtual int tag() const { return STAGED; }
+};
+
+/* Tells a worker to delete intermediate files that are no longer needed */
+class UnstageMessage: public Message {
+public:
+    vector<string> paths;
+
+    UnstageMessage(char *msg, unsigned msgsize, int source);
+    UnstageMessage(const vector<string> &paths);
+    virtual int tag() const { return UNSTAGE; }
+};
+
+/* Tells the master that the host script of a host has finished */
+class ReadyMessage: public Message {
+public:
+    int status;
+
+    ReadyMessage(char *msg, unsigned msgsize, int source);
+    ReadyMessage(int status);
+    virtual int tag() const { return READY; }
+};
+
+/*
+ * Asks the master for a region at the end of each destination file that
+ * the worker can write the forwarded files of a task into directly
+ */
+class ReserveMessage: public Message {
+public:
+    string task;
+    vector<string> filenames;
+    vector<unsigned long long> sizes;
+
+    ReserveMessage(char *msg, unsigned msgsize, int source);
+    ReserveMessage(const string &task, const vector<string> &filenames,
+            const vector<unsigned long long> &sizes);
+    virtual int tag() const { return RESERVE; }
+};
+
+/* The offsets of the regions reserved for a task, in the order requested */
+class RegionMessage: public Message {
+public:
+    vector<unsigned long long> offsets;
+
+    RegionMessage(char *msg, unsigned msgsize, int source);
+    RegionMessage(const vector<unsigned long long> &offsets);
+    virtual int tag() const { return REGION; }
+};
+
+/* Tells the master whether the regions of a task were written */
+class CommitMessage: public Message {
+public:
+    string task;
+    bool ok;
+
+    CommitMessage(char *msg, unsigned msgsize, int source);
+    CommitMessage(const string &task, bool ok);
+    virtual int tag() const { return COMMIT; }
+};
+
+/*
+ * A directory, symlink or piece of a file broadcast to the hosts at
+ * startup. The path is relative to the directory the files are written
+ * to. For a symlink the data is its target.
+ */
+class BroadcastFile {
+public:
+    char type;
+    unsigned mode;
+    unsigned long long offset;
+    string path;
+    const char *data;
+    unsigned size;
+
+    BroadcastFile() : type(0), mode(0), offset(0), data(NULL), size(0) {}
+};
+
+/*
+ * Files that the master broadcasts to one worker on each host at startup.
+ * The files are sent in several messages, and the last one has last set.
+ * The data of the decoded files points into the message.
+ */
+class FilesMessage: public Message {
+public:
+    vector<BroadcastFile> files;
+    bool last;
+
+    FilesMessage(char *msg, unsigned msgsize, int source);
+    FilesMessage(const vector<BroadcastFile> &files, bool last);
+    virtual int tag() const { return FILES; }
+};
+
+/*
+ * A batch of messages exchanged between the master and a sub-master. For
+ * each message the batch records the rank it is for: the destination for
+ * batches sent by the master, and the source for batches sent by a
+ * sub-master. When a batch is decoded the source of each message is set
+ * to that rank.
+ */
+class BatchMessage: public Message {
+public:
+    vector<Message *> messages;
+
+    BatchMessage(char *msg, unsigned msgsize, int source);
+    BatchMessage(const vector<Message *> &messages, const vector<int> &ranks);
+    virtual ~BatchMessage();
+    virtual int tag() const { return BATCH; }
+};
+
+/*
+ * The commands for every task in the DAG, indexed by Task::index, with no
+ * bindings. The master broadcasts this once so that it can send workers
+ * a TaskMessage instead of a full CommandMessage. Commands are decoded
+ * from the table when they are needed.
+ */
+class TaskTableMessage: public Message {
+public:
+    vector<unsigned> offsets;
+
+    TaskTableMessage(char *msg, unsigned msgsize, int source);
+    TaskTableMessage(const vector<Message *> &commands);
+    unsigned size() { return offsets.size(); }
+    CommandMessage *command(unsigned index);
+    virtual int tag() const { return TASKTABLE; }
+};
+
+/* Run the task at index in the task table using the given bindings */
+class TaskMessage: public Message {
+public:
+    unsigned index;
+    vector<cpu_t> bindings;
+    vector<cpu_t> gpu_bindings;
+
+    TaskMessage(char *msg, unsigned msgsize, int source);
+    TaskMessage(unsigned index, const vector<cpu_t> &bindings,
+            const vector<cpu_t> &gpu_bindings = vector<cpu_t>());
+    virtual int tag() const { return TASK; }
+};
+
+Message *create_message(int tag, char *msg, unsigned msgsize, int source);
+
 #endif /* PROTOCOL_H */
 
@@ -0,0 +1,302 @@
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <sys/time.h>
+
+#include "resourcelog.h"
+#include "log.h"
+#include "failure.h"
+#include "tools.h"
+
+// Marks the start of each run in a binary log. Runs written before
+// samples had a placement policy start with the old magic, and their
+// records are shorter.
+#define RESOURCE_LOG_MAGIC "PMCRLOG2"
+#define RESOURCE_LOG_MAGIC_V1 "PMCRLOG1"
+#define RESOURCE_LOG_MAGIC_SIZE 8
+#define RESOURCE_SAMPLE_SIZE_V1 24
+
+// A record with this bit set in the host field is followed by the
+// name of the host, and its slots field is the length of the name
+#define RESOURCE_HOST_NAME 0x80000000u
+
+// The writer thread drains the ring at least this often (in seconds)
+#define RESOURCE_LOG_FLUSH 1
+
+static bool sample_before(const ResourceSample &a, const ResourceSample &b) {
+    return a.timestamp < b.timestamp;
+}
+
+ResourceLog::ResourceLog(const string &path, bool binary, double interval,
+        unsigned capacity) {
+    this->binary = binary;
+    this->interval = interval;
+    this->stopping = false;
+    this->ring.resize(capacity < 2 ? 2 : capacity);
+    this->head = 0;
+    this->count = 0;
+    this->latest_bucket = 0.0;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wakeup, NULL);
+    pthread_cond_init(&drained, NULL);
+
+    this->file = fopen(path.c_str(), binary ? "ab" : "a");
+    if (file == NULL) {
+        log_error("Unable to open resource log %s: %s", path.c_str(), strerror(errno));
+        return;
+    }
+
+    if (binary) {
+        fwrite(RESOURCE_LOG_MAGIC, RESOURCE_LOG_MAGIC_SIZE, 1, file);
+    }
+
+    if (pthread_create(&writer, NULL, writer_main, this) != 0) {
+        myfailure("Unable to start resource log thread");
+    }
+}
+
+ResourceLog::~ResourceLog() {
+    close();
+    pthread_cond_destroy(&drained);
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&lock);
+}
+
+/* Register a host and return the id used to log samples for it */
+uint32_t ResourceLog::add_host(const string &name) {
+    pthread_mutex_lock(&lock);
+    uint32_t id = hosts.size();
+    hosts.push_back(name);
+    pthread_mutex_unlock(&lock);
+    return id;
+}
+
+/*
+ * Record the free resources of a host. This only blocks if the ring is
+ * full and the writer thread has not caught up yet.
+ */
+void ResourceLog::log(uint32_t host, unsigned slots, unsigned cpus, unsigned memory,
+        PlacementPolicy policy) {
+    if (file == NULL) {
+        return;
+    }
+
+    ResourceSample sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.timestamp = current_time();
+    sample.host = host;
+    sample.slots = slots;
+    sample.cpus = cpus;
+    sample.memory = memory;
+    sample.policy = policy;
+
+    pthread_mutex_lock(&lock);
+    while (count == ring.size()) {
+        pthread_cond_signal(&wakeup);
+        pthread_cond_wait(&drained, &lock);
+    }
+    ring[(head + count) % ring.size()] = sample;
+    count++;
+    if (count == ring.size() / 2) {
+        pthread_cond_signal(&wakeup);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Write the remaining samples and close the log */
+void ResourceLog::close() {
+    if (file == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+    if (pthread_join(writer, NULL) != 0) {
+        myfailure("Unable to join resource log thread");
+    }
+
+    log_trace("Closing resource log");
+    fclose(file);
+    file = NULL;
+}
+
+void *ResourceLog::writer_main(void *arg) {
+    static_cast<ResourceLog *>(arg)->run_writer();
+    return NULL;
+}
+
+void ResourceLog::run_writer() {
+    pthread_mutex_lock(&lock);
+    while (true) {
+        if (!stopping && count < ring.size() / 2) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            struct timespec deadline;
+            deadline.tv_sec = now.tv_sec + RESOURCE_LOG_FLUSH;
+            deadline.tv_nsec = now.tv_usec * 1000;
+            pthread_cond_timedwait(&wakeup, &lock, &deadline);
+        }
+
+        // Take everything out of the ring so that log() can go on
+        // while the samples are written
+        vector<ResourceSample> samples;
+        samples.reserve(count);
+        for (unsigned i = 0; i < count; i++) {
+            samples.push_back(ring[(head + i) % ring.size()]);
+        }
+        head = 0;
+        count = 0;
+        vector<string> added(hosts.begin() + names.size(), hosts.end());
+        bool last = stopping;
+        pthread_cond_broadcast(&drained);
+        pthread_mutex_unlock(&lock);
+
+        write_hosts(added);
+        write_samples(samples, last);
+        fflush(file);
+
+        pthread_mutex_lock(&lock);
+        if (last && count == 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void ResourceLog::write_hosts(const vector<string> &added) {
+    for (unsigned i = 0; i < added.size(); i++) {
+        if (binary) {
+            ResourceSample record;
+            memset(&record, 0, sizeof(record));
+            record.host = names.size() | RESOURCE_HOST_NAME;
+            record.slots = added[i].length();
+            fwrite(&record, sizeof(record), 1, file);
+            fwrite(added[i].c_str(), added[i].length(), 1, file);
+        }
+        names.push_back(added[i]);
+    }
+}
+
+/*
+ * Write samples in time order. When downsampling, the last sample of
+ * each host is held until a sample from a later interval arrives, and
+ * all held samples are written at the end.
+ */
+void ResourceLog::write_samples(const vector<ResourceSample> &samples, bool last) {
+    if (interval <= 0) {
+        for (unsigned i = 0; i < samples.size(); i++) {
+            write_sample(samples[i]);
+        }
+        return;
+    }
+
+    vector<ResourceSample> out;
+    for (unsigned i = 0; i < samples.size(); i++) {
+        const ResourceSample &s = samples[i];
+        double bucket = floor(s.timestamp / interval);
+        map<uint32_t, ResourceSample>::iterator p = pending.find(s.host);
+        if (p != pending.end() && floor(p->second.timestamp / interval) != bucket) {
+            out.push_back(p->second);
+        }
+        pending[s.host] = s;
+        if (bucket > latest_bucket) {
+            latest_bucket = bucket;
+        }
+    }
+
+    // Hosts that have not changed since an earlier interval are
+    // written now so that the log stays in order
+    map<uint32_t, ResourceSample>::iterator p = pending.begin();
+    while (p != pending.end()) {
+        if (last || floor(p->second.timestamp / interval) < latest_bucket) {
+            out.push_back(p->second);
+            pending.erase(p++);
+        } else {
+            p++;
+        }
+    }
+
+    std::stable_sort(out.begin(), out.end(), sample_before);
+    for (unsigned i = 0; i < out.size(); i++) {
+        write_sample(out[i]);
+    }
+}
+
+void ResourceLog::write_sample(const ResourceSample &sample) {
+    if (binary) {
+        fwrite(&sample, sizeof(sample), 1, file);
+    } else {
+        fprintf(file, "%lf,%u,%u,%u,%s,%s\n", sample.timestamp, sample.slots,
+                sample.cpus, sample.memory, names[sample.host].c_str(),
+                placement_name((PlacementPolicy)sample.policy));
+    }
+}
+
+/*
+ * Convert a binary resource log to the CSV format. Returns 0 on success,
+ * or -1 if the log could not be read.
+ */
+int ResourceLog::convert(const string &path, FILE *out) {
+    FILE *in = fopen(path.c_str(), "rb");
+    if (in == NULL) {
+        return -1;
+    }
+
+    int rc = 0;
+    vector<string> names;
+    char buf[sizeof(ResourceSample)];
+    size_t size = sizeof(ResourceSample);
+    while (fread(buf, RESOURCE_LOG_MAGIC_SIZE, 1, in) == 1) {
+        if (memcmp(buf, RESOURCE_LOG_MAGIC, RESOURCE_LOG_MAGIC_SIZE) == 0) {
+            names.clear();
+            size = sizeof(ResourceSample);
+            continue;
+        }
+        if (memcmp(buf, RESOURCE_LOG_MAGIC_V1, RESOURCE_LOG_MAGIC_SIZE) == 0) {
+            names.clear();
+            size = RESOURCE_SAMPLE_SIZE_V1;
+            continue;
+        }
+
+        ResourceSample sample;
+        memset(buf + RESOURCE_LOG_MAGIC_SIZE, 0, sizeof(buf) - RESOURCE_LOG_MAGIC_SIZE);
+        if (fread(buf + RESOURCE_LOG_MAGIC_SIZE, size - RESOURCE_LOG_MAGIC_SIZE, 1, in) != 1) {
+            rc = -1;
+            break;
+        }
+        memcpy(&sample, buf, sizeof(sample));
+
+        if (sample.host & RESOURCE_HOST_NAME) {
+            string name(sample.slots, '\0');
+            if (sample.slots > 0 && fread(&name[0], sample.slots, 1, in) != 1) {
+                rc = -1;
+                break;
+            }
+            uint32_t id = sample.host & ~RESOURCE_HOST_NAME;
+            if (id >= names.size()) {
+                names.resize(id + 1);
+            }
+            names[id] = name;
+            continue;
+        }
+
+        if (sample.host >= names.size() || sample.policy > PLACEMENT_LEAST_LOADED) {
+            rc = -1;
+            break;
+        }
+
+        fprintf(out, "%lf,%u,%u,%u,%s,%s\n", sample.timestamp, sample.slots,
+                sample.cpus, sample.memory, names[sample.host].c_str(),
+                placement_name((PlacementPolicy)sample.policy));
+    }
+
+    if (ferror(in)) {
+        rc = -1;
+    }
+    fclose(in);
+    return rc;
+}
@@ -0,0 +1,74 @@
+#ifndef RESOURCELOG_H
+#define RESOURCELOG_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "config.h"
+
+using std::string;
+using std::vector;
+using std::map;
+
+/*
+ * The free resources of a host at some point in time, and the placement
+ * policy that chose the host if the sample was caused by placing a task
+ */
+struct ResourceSample {
+    double timestamp;
+    uint32_t host;
+    uint32_t slots;
+    uint32_t cpus;
+    uint32_t memory;
+    uint32_t policy;
+};
+
+/*
+ * Log of the free resources of each host. Samples are recorded in a
+ * fixed-size ring buffer and written to the log by a background thread,
+ * either as CSV or as binary records that can be converted to CSV later
+ * with convert(). If interval is greater than 0, then only the last
+ * sample of each host in every interval seconds is written.
+ */
+class ResourceLog {
+    FILE *file;
+    bool binary;
+    double interval;
+
+    // Everything below is protected by lock
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t drained;
+    bool stopping;
+    vector<ResourceSample> ring;
+    unsigned head;
+    unsigned count;
+    vector<string> hosts;
+
+    // Only used by the writer thread
+    vector<string> names;
+    map<uint32_t, ResourceSample> pending;
+    double latest_bucket;
+
+    static void *writer_main(void *arg);
+    void run_writer();
+    void write_samples(const vector<ResourceSample> &samples, bool last);
+    void write_sample(const ResourceSample &sample);
+    void write_hosts(const vector<string> &added);
+public:
+    ResourceLog(const string &path, bool binary = false, double interval = 0.0,
+            unsigned capacity = 8192);
+    ~ResourceLog();
+    uint32_t add_host(const string &name);
+    void log(uint32_t host, unsigned slots, unsigned cpus, unsigned memory,
+            PlacementPolicy policy = PLACEMENT_DEFAULT);
+    void close();
+    static int convert(const string &path, FILE *out);
+};
+
+#endif /* RESOURCELOG_H */
@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "resultcache.h"
+#include "failure.h"
+#include "tools.h"
+#include "log.h"
+
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t hash, const char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * FNV64_PRIME;
+    }
+    return hash;
+}
+
+static string hex(uint64_t value) {
+    char buf[17];
+    sprintf(buf, "%016llx", (unsigned long long)value);
+    return buf;
+}
+
+/* Add a field to a key. The length makes the key unambiguous. */
+static void add_field(string &key, const char *name, const string &value) {
+    char len[32];
+    sprintf(len, " %lu ", (unsigned long)value.size());
+    key += name;
+    key += len;
+    key += value;
+    key += '\n';
+}
+
+ResultCache::ResultCache(const string &dir, const vector<string> &env) {
+    this->dir = dir;
+    this->env = env;
+    this->hits = 0;
+    this->misses = 0;
+    this->stored = 0;
+
+    if (mkdirs(dir.c_str()) < 0) {
+        myfailures("Unable to create result cache %s", dir.c_str());
+    }
+}
+
+/* Compute the digest of a file, unless it hasn't changed since it was last read */
+bool ResultCache::digest_file(const string &path, uint64_t &digest) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+        return false;
+    }
+
+    map<string, FileDigest>::iterator d = digests.find(path);
+    if (d != digests.end()) {
+        FileDigest &old = d->second;
+        if (old.dev == st.st_dev && old.ino == st.st_ino &&
+                old.size == st.st_size && old.mtime == st.st_mtime) {
+            digest = old.digest;
+            return true;
+        }
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    uint64_t hash = FNV64_OFFSET;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        hash = hash_bytes(hash, buf, n);
+    }
+    close(fd);
+    if (n < 0) {
+        return false;
+    }
+
+    FileDigest &entry = digests[path];
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    entry.digest = hash;
+    digest = hash;
+    return true;
+}
+
+/*
+ * Compute the key of a task. Returns false if the result of the task
+ * can't be cached, because it writes intermediate files that are only
+ * in the staging area of a worker, or because one of its inputs can't
+ * be read.
+ */
+bool ResultCache::key(Task *task, string &result) {
+    if (task->intermediates != NULL) {
+        return false;
+    }
+
+    result.clear();
+    for (unsigned i = 0; i < task->args.size(); i++) {
+        add_field(result, "arg", *task->args[i]);
+    }
+    if (task->pipe_forwards != NULL) {
+        map<string, string>::iterator p;
+        for (p = task->pipe_forwards->begin(); p != task->pipe_forwards->end(); p++) {
+            add_field(result, "pipe", p->first + "=" + p->second);
+        }
+    }
+    if (task->file_forwards != NULL) {
+        map<string, string>::iterator f;
+        for (f = task->file_forwards->begin(); f != task->file_forwards->end(); f++) {
+            add_field(result, "file", f->first + "=" + f->second);
+        }
+    }
+    for (unsigned i = 0; i < env.size(); i++) {
+        const char *value = getenv(env[i].c_str());
+        if (value == NULL) {
+            add_field(result, "unset", env[i]);
+        } else {
+            add_field(result, "env", env[i] + "=" + value);
+        }
+    }
+    if (task->inputs != NULL) {
+        for (unsigned i = 0; i < task->inputs->size(); i++) {
+            const string &path = *(*task->inputs)[i];
+            uint64_t digest;
+            if (!digest_file(path, digest)) {
+                log_debug("Unable to read input %s of task %s, not using the result cache",
+                        path.c_str(), task->name.c_str());
+                return false;
+            }
+            add_field(result, "input", path + "=" + hex(digest));
+        }
+    }
+    return true;
+}
+
+string ResultCache::entry_path(const string &key) {
+    return dir + "/" + hex(hash_bytes(FNV64_OFFSET, key.data(), key.size()));
+}
+
+/*
+ * Find the result of a task with the given key. The outputs of the task
+ * have to exist, otherwise the task has to run again to create them.
+ */
+bool ResultCache::lookup(Task *task, const string &key, vector<CachedOutput> &outputs) {
+    outputs.clear();
+
+    if (task->outputs != NULL) {
+        for (unsigned i = 0; i < task->outputs->size(); i++) {
+            struct stat st;
+            if (stat((*task->outputs)[i]->c_str(), &st) < 0) {
+                misses++;
+                return false;
+            }
+        }
+    }
+
+    string path = entry_path(key);
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL) {
+        misses++;
+        return false;
+    }
+    string contents;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        contents.append(buf, n);
+    }
+    bool error = ferror(f);
+    fclose(f);
+    if (error) {
+        log_warn("Unable to read result cache entry %s", path.c_str());
+        misses++;
+        return false;
+    }
+
+    // The entry is a header, the key and then each output, with the
+    // length of every variable part written before it
+    const char *p = contents.c_str();
+    const char *end = p + contents.size();
+    char magic[5];
+    unsigned version;
+    unsigned long keylen;
+    int used;
+    if (sscanf(p, "%4s %u %lu%n", magic, &version, &keylen, &used) != 3 || p[used] != '\n' ||
+            strcmp(magic, RESULT_CACHE_MAGIC) != 0 || version != RESULT_CACHE_VERSION) {
+        log_warn("Invalid result cache entry %s", path.c_str());
+        misses++;
+        return false;
+    }
+    p += used + 1;
+    if ((unsigned long)(end - p) < keylen || key.compare(0, string::npos, p, keylen) != 0) {
+        // Another task with the same hash
+        misses++;
+        return false;
+    }
+    p += keylen;
+
+    while (p < end) {
+        unsigned long namelen, datalen;
+        if (sscanf(p, "%lu %lu%n", &namelen, &datalen, &used) != 2 || p[used] != '\n' ||
+                (unsigned long)(end - p - used - 1) < namelen + datalen) {
+            log_warn("Invalid result cache entry %s", path.c_str());
+            outputs.clear();
+            misses++;
+            return false;
+        }
+        p += used + 1;
+        outputs.push_back(CachedOutput(string(p, namelen), string(p + namelen, datalen)));
+        p += namelen + datalen;
+    }
+
+    hits++;
+    return true;
+}
+
+/*
+ * Save the outputs of a task that succeeded. The entry is written to a
+ * temporary file and renamed, so that a run that fails part way through
+ * doesn't leave a partial entry. It is not an error if this fails, the
+ * task just runs again next time.
+ */
+void ResultCache::store(const string &key, const vector<CachedOutput> &outputs) {
+    string path = entry_path(key);
+    char suffix[32];
+    sprintf(suffix, ".tmp.%d", (int)getpid());
+    string temp = path + suffix;
+
+    FILE *f = fopen(temp.c_str(), "wb");
+    if (f == NULL) {
+        log_warn("Unable to create result cache entry %s: %s", temp.c_str(), strerror(errno));
+        return;
+    }
+    fprintf(f, "%s %u %lu\n", RESULT_CACHE_MAGIC, RESULT_CACHE_VERSION, (unsigned long)key.size());
+    fwrite(key.data(), 1, key.size(), f);
+    for (unsigned i = 0; i < outputs.size(); i++) {
+        const CachedOutput &output = outputs[i];
+        fprintf(f, "%lu %lu\n", (unsigned long)output.filename.size(),
+                (unsigned long)output.data.size());
+        fwrite(output.filename.data(), 1, output.filename.size(), f);
+        fwrite(output.data.data(), 1, output.data.size(), f);
+    }
+    bool error = ferror(f);
+    if (fclose(f) != 0 || error) {
+        log_warn("Unable to write result cache entry %s", temp.c_str());
+        unlink(temp.c_str());
+        return;
+    }
+    if (rename(temp.c_str(), path.c_str()) < 0) {
+        log_warn("Unable to rename result cache entry %s: %s", temp.c_str(), strerror(errno));
+        unlink(temp.c_str());
+        return;
+    }
+    stored++;
+}
@@ -0,0 +1,69 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "dag.h"
+
+using std::string;
+using std::vector;
+using std::map;
+
+// Identifies the format of the entries in the cache directory
+#define RESULT_CACHE_MAGIC "PMCC"
+#define RESULT_CACHE_VERSION 1
+
+/* Data that a task forwarded to the master, and where it was written */
+class CachedOutput {
+public:
+    string filename;
+    string data;
+
+    CachedOutput(const string &filename, const string &data) : filename(filename), data(data) {}
+};
+
+/* The digest of an --input file, and the version of the file it is for */
+class FileDigest {
+public:
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    uint64_t digest;
+};
+
+/*
+ * A cache of the results of tasks that succeeded, stored in a directory
+ * that is kept between runs of a workflow. The key of a task describes
+ * everything that the result of the task depends on: its arguments, the
+ * files it forwards, the values of the environment variables given to
+ * the cache, and the contents of its --input files. Each entry is a file
+ * named after the hash of the key that contains the key itself, so that
+ * a hash collision is never mistaken for a hit, followed by the I/O data
+ * that the task forwarded to the master.
+ */
+class ResultCache {
+    string dir;
+    vector<string> env;
+
+    // Digests of the input files that were already read
+    map<string, FileDigest> digests;
+
+    bool digest_file(const string &path, uint64_t &digest);
+    string entry_path(const string &key);
+public:
+    unsigned hits;
+    unsigned misses;
+    unsigned stored;
+
+    ResultCache(const string &dir, const vector<string> &env = vector<string>());
+    bool key(Task *task, string &result);
+    bool lookup(Task *task, const string &key, vector<CachedOutput> &outputs);
+    void store(const string &key, const vector<CachedOutput> &outputs);
+};
+
+#endif /* RESULTCACHE_H */
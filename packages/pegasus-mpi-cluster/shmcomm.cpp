@@ -0,0 +1,458 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+
+#include "shmcomm.h"
+#include "protocol.h"
+#include "failure.h"
+#include "tools.h"
+#include "log.h"
+
+// What a record in an inbox is for
+enum ShmKind {
+    SHM_MESSAGE   = 0,
+    SHM_BROADCAST = 1,
+    SHM_BARRIER   = 2,
+    SHM_GATHER    = 3
+};
+
+// Written before the contents of each message
+struct ShmHeader {
+    int source;
+    int kind;
+    int tag;
+    unsigned size;
+};
+
+ShmCommunicator::ShmCommunicator(int size) {
+    if (size < 2) {
+        myfailure("At least one worker is required");
+    }
+
+    myrank = 0;
+    mysize = size;
+    bytes_sent = 0;
+    bytes_recvd = 0;
+    barriers = 0;
+    partial = NULL;
+    partial_size = 0;
+    partial_read = 0;
+    partial_source = 0;
+    partial_tag = 0;
+    partial_kind = 0;
+
+    // Anonymous mappings are zeroed, so the inboxes start out empty
+    region_size = size * sizeof(ShmInbox) + size * sizeof(pid_t);
+    void *region = mmap(NULL, region_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_ANON, -1, 0);
+    if (region == MAP_FAILED) {
+        myfailures("Unable to create shared memory for %d processes", size);
+    }
+    inboxes = (ShmInbox *)region;
+    pids = (pid_t *)(inboxes + size);
+
+    master_pid = getpid();
+    pids[0] = master_pid;
+
+    // Don't let the workers write what is buffered a second time
+    fflush(NULL);
+
+    for (int r = 1; r < size; r++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            myfailures("Unable to fork worker %d", r);
+        }
+        if (pid == 0) {
+            myrank = r;
+            break;
+        }
+        pids[r] = pid;
+    }
+}
+
+ShmCommunicator::~ShmCommunicator() {
+    if (myrank == 0) {
+        // Wait for the workers so that they don't outlive the master
+        for (int r = 1; r < mysize; r++) {
+            if (pids[r] > 0) {
+                waitpid(pids[r], NULL, 0);
+            }
+        }
+    }
+
+    if (partial != NULL) {
+        free_buffer(partial, partial_size);
+    }
+    while (!received.empty()) {
+        delete received.front();
+        received.pop_front();
+    }
+    while (!broadcasts.empty()) {
+        delete broadcasts.front();
+        broadcasts.pop_front();
+    }
+    while (!gathered.empty()) {
+        delete gathered.front();
+        gathered.pop_front();
+    }
+
+    munmap(inboxes, region_size);
+}
+
+/*
+ * Write a message to the inbox of dest. While the inbox is locked by
+ * another process, or full, this process keeps reading its own inbox so
+ * that the process it is waiting for can make progress.
+ */
+void ShmCommunicator::write_message(int dest, int kind, int tag, const char *msg,
+        unsigned msgsize) {
+    if (dest < 0 || dest >= mysize || dest == myrank) {
+        myfailure("Rank %d: Invalid destination: %d", myrank, dest);
+    }
+
+    ShmInbox *inbox = &inboxes[dest];
+    unsigned spins = 0;
+    useconds_t sleeptime = SHM_MIN_RECV_SLEEP;
+    while (__sync_lock_test_and_set(&inbox->lock, 1)) {
+        read_inbox();
+        wait(spins, sleeptime);
+    }
+
+    ShmHeader header;
+    header.source = myrank;
+    header.kind = kind;
+    header.tag = tag;
+    header.size = msgsize;
+
+    const char *pieces[2] = {(const char *)&header, msg};
+    unsigned sizes[2] = {sizeof(header), msgsize};
+    for (int p = 0; p < 2; p++) {
+        const char *buf = pieces[p];
+        unsigned size = sizes[p];
+        unsigned off = 0;
+        spins = 0;
+        sleeptime = SHM_MIN_RECV_SLEEP;
+        while (off < size) {
+            uint64_t head = inbox->head;
+            uint64_t tail = inbox->tail;
+            __sync_synchronize();
+            unsigned room = SHM_INBOX_SIZE - (unsigned)(head - tail);
+            if (room == 0) {
+                read_inbox();
+                wait(spins, sleeptime);
+                continue;
+            }
+
+            // Copy as much as fits, up to the end of the ring
+            unsigned pos = head % SHM_INBOX_SIZE;
+            unsigned count = std::min(std::min(size - off, room), SHM_INBOX_SIZE - pos);
+            memcpy(inbox->data + pos, buf + off, count);
+            __sync_synchronize();
+            inbox->head = head + count;
+            off += count;
+        }
+    }
+
+    __sync_lock_release(&inbox->lock);
+}
+
+/* Copy size bytes out of this process's inbox. They must be there. */
+void ShmCommunicator::read_bytes(char *buf, unsigned size) {
+    ShmInbox *inbox = &inboxes[myrank];
+    uint64_t tail = inbox->tail;
+    unsigned off = 0;
+    while (off < size) {
+        unsigned pos = (tail + off) % SHM_INBOX_SIZE;
+        unsigned count = std::min(size - off, SHM_INBOX_SIZE - pos);
+        memcpy(buf + off, inbox->data + pos, count);
+        off += count;
+    }
+    __sync_synchronize();
+    inbox->tail = tail + size;
+}
+
+/*
+ * Read what has been written to this process's inbox. Returns true if
+ * any message was completed.
+ */
+bool ShmCommunicator::read_inbox() {
+    ShmInbox *inbox = &inboxes[myrank];
+    bool completed = false;
+    while (true) {
+        uint64_t head = inbox->head;
+        __sync_synchronize();
+        unsigned avail = (unsigned)(head - inbox->tail);
+
+        if (partial == NULL) {
+            ShmHeader header;
+            if (avail < sizeof(header)) {
+                break;
+            }
+            read_bytes((char *)&header, sizeof(header));
+            avail -= sizeof(header);
+            partial_source = header.source;
+            partial_kind = header.kind;
+            partial_tag = header.tag;
+            partial_size = header.size;
+            partial_read = 0;
+            partial = alloc_buffer(partial_size);
+        }
+
+        // The rest of the message comes from the same writer, because
+        // it holds the lock until the whole message is written
+        unsigned count = std::min(avail, partial_size - partial_read);
+        if (count > 0) {
+            read_bytes(partial + partial_read, count);
+            partial_read += count;
+        }
+        if (partial_read < partial_size) {
+            break;
+        }
+
+        char *msg = partial;
+        partial = NULL;
+        completed = true;
+
+        log_trace("Rank %d: Receiving %u byte message of type %d from %d",
+                  myrank, partial_size, partial_tag, partial_source);
+
+        if (partial_kind == SHM_BARRIER) {
+            free_buffer(msg, partial_size);
+            barriers++;
+            continue;
+        }
+
+        bytes_recvd += partial_size;
+        Message *message = create_message(partial_tag, msg, partial_size, partial_source);
+        if (partial_kind == SHM_BROADCAST) {
+            broadcasts.push_back(message);
+        } else if (partial_kind == SHM_GATHER) {
+            gathered.push_back(message);
+        } else {
+            received.push_back(message);
+        }
+    }
+    return completed;
+}
+
+/*
+ * Wait a little before checking for messages again. The first checks
+ * only yield the CPU, so that a message is noticed within microseconds
+ * while the processes are busy exchanging messages. After that the sleep
+ * doubles every time, up to SHM_MAX_RECV_SLEEP, so that idle processes
+ * use little CPU. Returns false if the sleep was interrupted by a signal.
+ */
+bool ShmCommunicator::wait(unsigned &spins, useconds_t &sleeptime) {
+    if (spins < SHM_RECV_SPINS) {
+        spins++;
+        sched_yield();
+        return true;
+    }
+
+    check_processes();
+
+    if (usleep(sleeptime)) {
+        return false;
+    }
+    sleeptime = std::min(2 * sleeptime, (useconds_t)SHM_MAX_RECV_SLEEP);
+    return true;
+}
+
+/*
+ * Make sure the other processes are still there. MPI would abort the
+ * job if one of them failed, and this does the same.
+ */
+void ShmCommunicator::check_processes() {
+    if (myrank != 0) {
+        if (getppid() != master_pid) {
+            myfailure("Rank %d: Master exited unexpectedly", myrank);
+        }
+        return;
+    }
+
+    for (int r = 1; r < mysize; r++) {
+        if (pids[r] <= 0) {
+            continue;
+        }
+        int status;
+        pid_t pid = waitpid(pids[r], &status, WNOHANG);
+        if (pid <= 0) {
+            continue;
+        }
+        pids[r] = 0;
+
+        // Workers only exit cleanly when they have been told to
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            myfailure("Worker %d exited unexpectedly", r);
+        }
+    }
+}
+
+void ShmCommunicator::send_message(Message *message, int dest) {
+    log_trace("Rank %d: Sending %d byte message of type %d to %d",
+              myrank, message->msgsize, message->tag(), dest);
+
+    write_message(dest, SHM_MESSAGE, message->tag(), message->msg, message->msgsize);
+    bytes_sent += message->msgsize;
+}
+
+/*
+ * The message is copied into the inbox of dest before this returns, so
+ * it is deleted right away
+ */
+void ShmCommunicator::send_message_async(Message *message, int dest) {
+    send_message(message, dest);
+    delete message;
+}
+
+/*
+ * Send message from root to all the other ranks. All ranks must call
+ * this. The root passes the message to send and gets NULL back, the
+ * other ranks pass NULL and get back the message they received.
+ */
+Message *ShmCommunicator::broadcast_message(Message *message, int root) {
+    if (myrank == root) {
+        log_trace("Rank %d: Broadcasting %u byte message of type %d",
+                  myrank, message->msgsize, message->tag());
+        for (int r = 0; r < mysize; r++) {
+            if (r != root) {
+                write_message(r, SHM_BROADCAST, message->tag(), message->msg,
+                        message->msgsize);
+            }
+        }
+        bytes_sent += message->msgsize;
+        return NULL;
+    }
+
+    unsigned spins = 0;
+    useconds_t sleeptime = SHM_MIN_RECV_SLEEP;
+    while (broadcasts.empty()) {
+        if (!read_inbox()) {
+            wait(spins, sleeptime);
+        }
+    }
+    Message *result = broadcasts.front();
+    broadcasts.pop_front();
+    return result;
+}
+
+/*
+ * Collect a message from every rank at root. All ranks must call this.
+ * The other ranks pass the message to send and get back an empty list,
+ * and the root passes NULL and gets back the message from each rank,
+ * indexed by rank, with NULL for itself.
+ */
+vector<Message *> ShmCommunicator::gather_messages(Message *message, int root) {
+    vector<Message *> messages;
+    if (myrank != root) {
+        write_message(root, SHM_GATHER, message->tag(), message->msg, message->msgsize);
+        bytes_sent += message->msgsize;
+        return messages;
+    }
+
+    messages.resize(mysize, NULL);
+    unsigned spins = 0;
+    useconds_t sleeptime = SHM_MIN_RECV_SLEEP;
+    for (int count = 1; count < mysize;) {
+        if (gathered.empty() && !read_inbox()) {
+            wait(spins, sleeptime);
+        }
+        while (!gathered.empty()) {
+            Message *mesg = gathered.front();
+            gathered.pop_front();
+            messages[mesg->source] = mesg;
+            count++;
+        }
+    }
+    return messages;
+}
+
+Message *ShmCommunicator::recv_message(double timeout) {
+    log_trace("Rank %d: waiting for message", myrank);
+
+    double start = current_time();
+    unsigned spins = 0;
+    useconds_t sleeptime = SHM_MIN_RECV_SLEEP;
+    while (received.empty()) {
+        if (read_inbox()) {
+            continue;
+        }
+
+        if (timeout > 0 && current_time() - start >= timeout) {
+            log_trace("Rank %d: No message waiting", myrank);
+            return NULL;
+        }
+
+        if (!wait(spins, sleeptime)) {
+            // The wait was interrupted by a signal
+            return NULL;
+        }
+    }
+
+    Message *message = received.front();
+    received.pop_front();
+    return message;
+}
+
+bool ShmCommunicator::message_waiting() {
+    if (received.empty()) {
+        read_inbox();
+    }
+    return !received.empty();
+}
+
+/* Every rank tells the master it is there, and the master lets them go */
+void ShmCommunicator::barrier() {
+    unsigned needed = (myrank == 0) ? mysize - 1 : 1;
+    if (myrank != 0) {
+        write_message(0, SHM_BARRIER, 0, NULL, 0);
+    }
+
+    unsigned spins = 0;
+    useconds_t sleeptime = SHM_MIN_RECV_SLEEP;
+    while (barriers < needed) {
+        if (!read_inbox()) {
+            wait(spins, sleeptime);
+        }
+    }
+    barriers -= needed;
+
+    if (myrank == 0) {
+        for (int r = 1; r < mysize; r++) {
+            write_message(r, SHM_BARRIER, 0, NULL, 0);
+        }
+    }
+}
+
+/* Kill all the processes, like MPI_Abort */
+void ShmCommunicator::abort(int exitcode) {
+    for (int r = 0; r < mysize; r++) {
+        if (r != myrank && pids[r] > 0) {
+            kill(pids[r], SIGKILL);
+        }
+    }
+    _exit(exitcode);
+}
+
+int ShmCommunicator::rank() {
+    return myrank;
+}
+
+int ShmCommunicator::size() {
+    return mysize;
+}
+
+unsigned long ShmCommunicator::sent() {
+    return bytes_sent;
+}
+
+unsigned long ShmCommunicator::recvd() {
+    return bytes_recvd;
+}
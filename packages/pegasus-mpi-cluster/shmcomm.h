@@ -0,0 +1,99 @@
+#ifndef SHMCOMM_H
+#define SHMCOMM_H
+
+#include <list>
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "comm.h"
+
+using std::list;
+
+// Size of the ring buffer that each process receives messages in.
+// Larger messages are written in pieces as the receiver reads them.
+#define SHM_INBOX_SIZE (256*1024)
+
+// Number of times to check for a message before sleeping
+#define SHM_RECV_SPINS 1000
+
+// Bounds on the time to sleep between checks for messages in usec
+#define SHM_MIN_RECV_SLEEP 10
+#define SHM_MAX_RECV_SLEEP 1000
+
+/*
+ * The inbox of one process. Any process can write to it while holding the
+ * lock, and only the owner reads from it, so the reader never waits for
+ * the writers. head is the number of bytes written and tail is the number
+ * of bytes read since the start.
+ */
+struct ShmInbox {
+    volatile int lock;
+    volatile uint64_t head;
+    volatile uint64_t tail;
+    char data[SHM_INBOX_SIZE];
+};
+
+/*
+ * A communicator for running the master and the workers on one host
+ * without MPI. The master creates an inbox for each process in shared
+ * memory and forks the workers, and each process gets the rank it would
+ * have had with MPI. Messages from each sender are received in the order
+ * they were sent. A sender that is waiting for room in an inbox keeps
+ * reading its own, so two processes that send to each other can't
+ * deadlock.
+ */
+class ShmCommunicator : public Communicator {
+private:
+    int myrank;
+    int mysize;
+    unsigned long bytes_sent;
+    unsigned long bytes_recvd;
+
+    ShmInbox *inboxes;
+    size_t region_size;
+
+    // The process of each rank
+    pid_t *pids;
+    pid_t master_pid;
+
+    // Messages read from the inbox that have not been received yet
+    list<Message *> received;
+
+    // Broadcasts, gathered messages and barrier releases that arrived early
+    list<Message *> broadcasts;
+    list<Message *> gathered;
+    unsigned barriers;
+
+    // A message that has only been partly read
+    char *partial;
+    unsigned partial_size;
+    unsigned partial_read;
+    int partial_source;
+    int partial_tag;
+    int partial_kind;
+
+    void write_message(int dest, int kind, int tag, const char *msg, unsigned msgsize);
+    bool read_inbox();
+    void read_bytes(char *buf, unsigned size);
+    bool wait(unsigned &spins, useconds_t &sleeptime);
+    void check_processes();
+
+public:
+    ShmCommunicator(int size);
+    virtual ~ShmCommunicator();
+    virtual void send_message(Message *message, int dest);
+    virtual void send_message_async(Message *message, int dest);
+    virtual void wait_for_sends() {}
+    virtual Message *broadcast_message(Message *message, int root);
+    virtual vector<Message *> gather_messages(Message *message, int root);
+    virtual Message *recv_message(double timeout = 0);
+    virtual bool message_waiting();
+    virtual void barrier();
+    virtual void abort(int exitcode);
+    virtual int rank();
+    virtual int size();
+    virtual unsigned long sent();
+    virtual unsigned long recvd();
+};
+
+#endif /* SHMCOMM_H */
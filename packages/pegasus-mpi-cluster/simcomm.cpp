@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+
+#include "simcomm.h"
+#include "strlib.h"
+#include "resourcelog.h"
+#include "failure.h"
+#include "log.h"
+#include "config.h"
+
+using std::map;
+using std::set;
+
+/*
+ * The DAG can be NULL if it is not loaded yet, in which case set_dag()
+ * has to be called before the master starts.
+ */
+SimCommunicator::SimCommunicator(DAG *dag, int nworkers, unsigned workers_per_host,
+        cpu_t host_cpus, unsigned host_memory) {
+    this->dag = NULL;
+    this->nmeasured = 0;
+    set_hosts(nworkers, workers_per_host, host_cpus, host_memory);
+    if (dag != NULL) {
+        set_dag(dag);
+    }
+    this->next_seq = 0;
+    this->now = 0.0;
+    this->bytes_sent = 0;
+    this->bytes_recvd = 0;
+    this->slot_time = 0.0;
+    this->cpu_time = 0.0;
+    this->last_recv = 0.0;
+}
+
+void SimCommunicator::set_dag(DAG *dag) {
+    this->dag = dag;
+    this->tasks.resize(dag->size());
+    this->durations.resize(dag->size());
+    this->measured.assign(dag->size(), false);
+    this->nmeasured = 0;
+    for (DAG::iterator t = dag->begin(); t != dag->end(); t++) {
+        tasks[(*t)->index] = *t;
+        durations[(*t)->index] = (*t)->runtime;
+    }
+}
+
+void SimCommunicator::set_hosts(int nworkers, unsigned workers_per_host,
+        cpu_t host_cpus, unsigned host_memory) {
+    this->nworkers = nworkers;
+    this->workers_per_host = workers_per_host;
+    this->host_cpus = host_cpus;
+    this->host_memory = host_memory;
+    this->workers.assign(nworkers + 1, SimWorker());
+}
+
+/*
+ * Read the runtimes of the tasks from the log of an earlier run: the
+ * cluster-task records that the workers write to the task stdout, or the
+ * EXECUTE and JOB_TERMINATED events of a jobstate.log. If a task ran
+ * more than once, its last run counts. Returns the number of tasks of
+ * the DAG that have been found in this log and the ones read before.
+ */
+unsigned SimCommunicator::read_runtimes(const string &path) {
+    std::ifstream infile(path.c_str());
+    if (!infile.good()) {
+        myfailures("Unable to open log %s", path.c_str());
+    }
+
+    map<string, double> executed;
+    vector<Task *> found;
+    string rec;
+    while (getline(infile, rec)) {
+        size_t p = rec.find("[cluster-task ");
+        if (p != string::npos) {
+            size_t name = rec.find("name=", p);
+            size_t duration = rec.find(", duration=", p);
+            if (name == string::npos || duration == string::npos) {
+                continue;
+            }
+            name += 5;
+            Task *task = dag->get_task(rec.substr(name, rec.find(',', name) - name));
+            double runtime;
+            if (task != NULL && sscanf(rec.c_str() + duration + 11, "%lf", &runtime) == 1) {
+                durations[task->index] = runtime;
+                found.push_back(task);
+            }
+            continue;
+        }
+
+        vector<string> v;
+        split(v, rec, " ", 3);
+        double timestamp;
+        if (v.size() < 3 || sscanf(v[0].c_str(), "%lf", &timestamp) != 1) {
+            continue;
+        }
+        if (v[2] == "EXECUTE") {
+            executed[v[1]] = timestamp;
+        } else if (v[2] == "JOB_TERMINATED") {
+            map<string, double>::iterator e = executed.find(v[1]);
+            Task *task = dag->get_task(v[1]);
+            if (e != executed.end() && task != NULL) {
+                durations[task->index] = timestamp - e->second;
+                found.push_back(task);
+            }
+        }
+    }
+    if (infile.bad()) {
+        myfailures("Error reading log %s", path.c_str());
+    }
+
+    for (unsigned i = 0; i < found.size(); i++) {
+        if (!measured[found[i]->index]) {
+            measured[found[i]->index] = true;
+            nmeasured++;
+        }
+    }
+    return nmeasured;
+}
+
+/*
+ * Find the hosts of an earlier run in its resource log, which can be in
+ * the CSV or the binary format. The size of a host is the most free
+ * slots, CPUs and memory it had, which it had before its first task
+ * started. Returns the number of hosts and the size of the largest, or
+ * -1 if the log could not be read.
+ */
+int read_simulated_hosts(const string &path, unsigned &hosts, unsigned &slots,
+        unsigned &cpus, unsigned &memory) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    // Binary logs are converted to CSV first
+    char magic[8];
+    if (fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, "PMCRLOG", 7) == 0) {
+        fclose(f);
+        f = tmpfile();
+        if (f == NULL || ResourceLog::convert(path, f) < 0) {
+            if (f != NULL) {
+                fclose(f);
+            }
+            return -1;
+        }
+    }
+    rewind(f);
+
+    set<string> names;
+    slots = cpus = memory = 0;
+    char line[BUFSIZ];
+    char name[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        double timestamp;
+        unsigned s, c, m;
+        if (sscanf(line, "%lf,%u,%u,%u,%255[^,]", &timestamp, &s, &c, &m, name) != 5) {
+            continue;
+        }
+        names.insert(name);
+        slots = std::max(slots, s);
+        cpus = std::max(cpus, c);
+        memory = std::max(memory, m);
+    }
+    fclose(f);
+
+    hosts = names.size();
+    return hosts > 0 ? 0 : -1;
+}
+
+SimCommunicator::~SimCommunicator() {
+    while (!events.empty()) {
+        delete events.top().message;
+        events.pop();
+    }
+}
+
+void SimCommunicator::post(double time, Message *message) {
+    events.push(SimEvent(time, next_seq++, message));
+}
+
+void SimCommunicator::start_task(int rank, Task *task) {
+    workers[rank].running++;
+    double runtime = durations[task->index];
+    slot_time += runtime;
+    cpu_time += runtime * std::max(task->cpus, (cpu_t)1);
+    ResultMessage *result = new ResultMessage(task->name, 0, runtime);
+    result->source = rank;
+    post(now + runtime, result);
+}
+
+void SimCommunicator::queue_task(int rank, Task *task) {
+    SimWorker &worker = workers[rank];
+    if (worker.running < config.worker_slots) {
+        start_task(rank, task);
+    } else {
+        worker.waiting.push_back(task);
+    }
+}
+
+/* Act on a message from the master as the worker would */
+void SimCommunicator::deliver(Message *message, int dest) {
+    bytes_sent += message->msgsize;
+
+    switch (message->tag()) {
+        case COMMAND: {
+            CommandMessage *cmd = static_cast<CommandMessage *>(message);
+            queue_task(dest, dag->get_task(cmd->name));
+            break;
+        }
+        case TASK: {
+            TaskMessage *tmsg = static_cast<TaskMessage *>(message);
+            queue_task(dest, tasks[tmsg->index]);
+            break;
+        }
+        case BATCH: {
+            // The messages in a batch are for the ranks recorded in it
+            char *copy = alloc_buffer(message->msgsize);
+            memcpy(copy, message->msg, message->msgsize);
+            BatchMessage batch(copy, message->msgsize, 0);
+            for (unsigned i = 0; i < batch.messages.size(); i++) {
+                Message *m = batch.messages[i];
+                bytes_sent -= m->msgsize;
+                deliver(m, m->source);
+            }
+            break;
+        }
+        default:
+            // Host ranks, credits, cancels and shutdowns need no answer
+            break;
+    }
+}
+
+void SimCommunicator::send_message(Message *message, int dest) {
+    deliver(message, dest);
+}
+
+void SimCommunicator::send_message_async(Message *message, int dest) {
+    deliver(message, dest);
+    delete message;
+}
+
+Message *SimCommunicator::broadcast_message(Message *message, int root) {
+    bytes_sent += message->msgsize * nworkers;
+    return NULL;
+}
+
+/* Every worker registers with the master when it starts */
+vector<Message *> SimCommunicator::gather_messages(Message *message, int root) {
+    vector<Message *> messages(nworkers + 1, NULL);
+    char hostname[64];
+    for (int rank = 1; rank <= nworkers; rank++) {
+        snprintf(hostname, sizeof(hostname), "host%u", (rank - 1) / workers_per_host);
+        Message *reg = new RegistrationMessage(hostname, host_memory, host_cpus,
+                host_cpus, 1);
+        reg->source = rank;
+        bytes_recvd += reg->msgsize;
+        messages[rank] = reg;
+    }
+    return messages;
+}
+
+/*
+ * Return the next message in virtual time. The timeout is ignored
+ * because time only passes when a message is received.
+ */
+Message *SimCommunicator::recv_message(double timeout) {
+    double start = current_time();
+    if (last_recv > 0) {
+        cycles.push_back(start - last_recv);
+    }
+
+    if (events.empty()) {
+        log_error("Simulated master is waiting, but no worker is busy");
+        return NULL;
+    }
+
+    SimEvent event = events.top();
+    events.pop();
+    if (event.time > now) {
+        now = event.time;
+    }
+
+    Message *message = event.message;
+    bytes_recvd += message->msgsize;
+
+    // The worker starts the next task it was sent when one finishes
+    if (message->tag() == RESULT) {
+        SimWorker &worker = workers[message->source];
+        worker.running--;
+        if (!worker.waiting.empty()) {
+            Task *next = worker.waiting.front();
+            worker.waiting.pop_front();
+            start_task(message->source, next);
+        }
+    }
+
+    last_recv = current_time();
+    return message;
+}
+
+bool SimCommunicator::message_waiting() {
+    return !events.empty() && events.top().time <= now;
+}
+
+void SimCommunicator::abort(int exitcode) {
+    exit(exitcode);
+}
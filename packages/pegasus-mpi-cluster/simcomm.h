@@ -0,0 +1,128 @@
+#ifndef SIMCOMM_H
+#define SIMCOMM_H
+
+#include <vector>
+#include <list>
+#include <queue>
+#include <string>
+
+#include "comm.h"
+#include "dag.h"
+#include "tools.h"
+
+using std::vector;
+using std::list;
+using std::priority_queue;
+using std::string;
+
+/* A message that a virtual worker sends to the master at some time */
+class SimEvent {
+public:
+    double time;
+    unsigned long seq;
+    Message *message;
+
+    SimEvent(double time, unsigned long seq, Message *message) {
+        this->time = time;
+        this->seq = seq;
+        this->message = message;
+    }
+    bool operator<(const SimEvent &other) const {
+        // priority_queue puts the largest first, so this is reversed
+        if (time != other.time) {
+            return time > other.time;
+        }
+        return seq > other.seq;
+    }
+};
+
+/* A virtual worker and the tasks it has been sent */
+class SimWorker {
+public:
+    unsigned running;
+    list<Task *> waiting;
+
+    SimWorker() : running(0) {}
+};
+
+/*
+ * A communicator for the master that simulates the workers in the same
+ * process. Each task "runs" for its runtime estimate (-r) in virtual
+ * time, or for the runtime it had in an earlier run if that was read
+ * with read_runtimes(), and its result is received by the master when
+ * the virtual clock reaches the end of the task. This is used to measure
+ * how fast the master schedules tasks without a large allocation, and to
+ * predict the makespan of a workflow with other settings. Each virtual
+ * worker runs up to --worker-slots tasks at once, and hosts have
+ * workers_per_host workers each.
+ */
+class SimCommunicator : public Communicator {
+    DAG *dag;
+    vector<Task *> tasks;
+    // How long each task runs, by index, and whether that was read from
+    // the log of an earlier run
+    vector<double> durations;
+    vector<bool> measured;
+    unsigned nmeasured;
+    int nworkers;
+    unsigned workers_per_host;
+    cpu_t host_cpus;
+    unsigned host_memory;
+
+    vector<SimWorker> workers;
+    priority_queue<SimEvent> events;
+    unsigned long next_seq;
+    double now;
+
+    unsigned long bytes_sent;
+    unsigned long bytes_recvd;
+
+    // Time that the simulated tasks occupied slots and CPUs
+    double slot_time;
+    double cpu_time;
+
+    // Real time spent by the master between receiving one message and
+    // asking for the next one
+    double last_recv;
+    vector<double> cycles;
+
+    void post(double time, Message *message);
+    void deliver(Message *message, int dest);
+    void start_task(int rank, Task *task);
+    void queue_task(int rank, Task *task);
+public:
+    SimCommunicator(DAG *dag, int nworkers, unsigned workers_per_host,
+            cpu_t host_cpus, unsigned host_memory);
+    ~SimCommunicator();
+    void set_dag(DAG *dag);
+    void set_hosts(int nworkers, unsigned workers_per_host, cpu_t host_cpus,
+            unsigned host_memory);
+    unsigned read_runtimes(const string &path);
+    void send_message(Message *message, int dest);
+    void send_message_async(Message *message, int dest);
+    void wait_for_sends() {}
+    Message *broadcast_message(Message *message, int root);
+    vector<Message *> gather_messages(Message *message, int root);
+    Message *recv_message(double timeout = 0);
+    bool message_waiting();
+    void barrier() {}
+    void abort(int exitcode);
+    int rank() { return 0; }
+    int size() { return nworkers + 1; }
+    unsigned long sent() { return bytes_sent; }
+    unsigned long recvd() { return bytes_recvd; }
+
+    double clock() { return now; }
+    double virtual_time() { return now; }
+    const vector<double> &cycle_times() { return cycles; }
+    unsigned hosts() { return (nworkers + workers_per_host - 1) / workers_per_host; }
+    cpu_t cpus_per_host() { return host_cpus; }
+    unsigned memory_per_host() { return host_memory; }
+    double busy_slot_time() { return slot_time; }
+    double busy_cpu_time() { return cpu_time; }
+};
+
+int read_simulated_hosts(const string &path, unsigned &hosts, unsigned &slots,
+        unsigned &cpus, unsigned &memory);
+
+#endif /* SIMCOMM_H */
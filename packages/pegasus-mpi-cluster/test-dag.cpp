@@ -1,8 +1,13 @@
 #include <string>
 #include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "stdlib.h"
 #include "dag.h"
+#include "engine.h"
+#include "gendag.h"
 #include "failure.h"
 #include "log.h"
 
@@ -15,16 +20,16 @@ void test_dag() {
     if (alpha == NULL) {
         myfailure("Didn't parse Alpha");
     }
-    if (alpha->args.front().compare("/bin/echo") != 0) {
-        myfailure("Command failed for Alpha: %s", alpha->args.front().c_str());
+    if (alpha->args.front()->compare("/bin/echo") != 0) {
+        myfailure("Command failed for Alpha: %s", alpha->args.front()->c_str());
     }
     
     Task *beta = dag.get_task("Beta");
     if (beta == NULL) {
         myfailure("Didn't parse Beta");
     }
-    if (beta->args.front().compare("/bin/echo") != 0) {
-        myfailure("Command failed for Beta: %s", beta->args.front().c_str());
+    if (beta->args.front()->compare("/bin/echo") != 0) {
+        myfailure("Command failed for Beta: %s", beta->args.front()->c_str());
     }
     
     if (alpha->children[0] != beta) {
@@ -69,22 +74,23 @@ void test_pegasus_dag() {
     if (a->pegasus_id.compare("1") != 0) {
         myfailure("A should have had pegasus_id");
     }
-    /*
-    if (a->pegasus_transformation.compare("mDiffFit:3.3") != 0) {
-        myfailure("A should have had pegasus_transformation");
+    if (a->transformation == NULL || *a->transformation != "mDiffFit:3.3") {
+        myfailure("A should have had transformation");
     }
-    */
     
     Task *b = dag.get_task("B");
     
     if (b->pegasus_id.compare("2") != 0) {
         myfailure("B should have had pegasus_id");
     }
-    /*
-    if (b->pegasus_transformation.compare("mDiff:3.3") != 0) {
-        myfailure("B should have had pegasus_transformation");
+    if (b->transformation == NULL || *b->transformation != "mDiff:3.3") {
+        myfailure("B should have had transformation");
+    }
+
+    // Tasks of the same transformation share it
+    if (dag.get_task("D")->transformation != a->transformation) {
+        myfailure("A and D should have had the same transformation");
     }
-    */
 }
 
 void test_memory_dag() {
@@ -140,6 +146,96 @@ void test_cpu_dag() {
     }
 }
 
+void test_gpu_dag() {
+    DAG dag("test/gpus.dag");
+
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+    Task *c = dag.get_task("C");
+
+    if (a->gpus != 1) {
+        myfailure("A should require 1 GPU");
+    }
+
+    if (b->gpus != 2 || b->cpus != 1) {
+        myfailure("B should require 2 GPUs and 1 CPU");
+    }
+
+    if (c->gpus != 0) {
+        myfailure("C should not require any GPUs");
+    }
+}
+
+void test_threads_dag() {
+    DAG dag("test/threads.dag");
+
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+
+    if (a->threads != 0 || a->cpus != 2) {
+        myfailure("A should run one thread per CPU");
+    }
+
+    if (b->threads != 3 || b->cpus != 1) {
+        myfailure("B should run 3 threads on 1 CPU");
+    }
+}
+
+void test_locality_dag() {
+    DAG dag("test/locality.dag");
+
+    Task *p = dag.get_task("P");
+    Task *l = dag.get_task("L");
+    Task *c = dag.get_task("C");
+
+    if (p->inputs != NULL || p->outputs == NULL || p->outputs->size() != 1 ||
+            *(*p->outputs)[0] != "locality.out") {
+        myfailure("P should write locality.out");
+    }
+
+    if (l->inputs != NULL || l->outputs != NULL) {
+        myfailure("L should not have any inputs or outputs");
+    }
+
+    if (c->outputs != NULL || c->inputs == NULL || c->inputs->size() != 2 ||
+            *(*c->inputs)[0] != "locality.out" || *(*c->inputs)[1] != "locality.in") {
+        myfailure("C should read locality.out and locality.in");
+    }
+
+    // Paths are interned, so the same file is the same string
+    if ((*p->outputs)[0] != (*c->inputs)[0]) {
+        myfailure("P and C should share the path of locality.out");
+    }
+}
+
+void test_staging_dag() {
+    DAG dag("test/staging.dag");
+
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+    Task *c = dag.get_task("C");
+
+    if (a->intermediates == NULL || a->intermediates->size() != 1 ||
+            *(*a->intermediates)[0] != "a.txt") {
+        myfailure("A should write intermediate file a.txt");
+    }
+
+    // Intermediate files are outputs too
+    if (a->outputs == NULL || a->outputs->size() != 1 ||
+            (*a->outputs)[0] != (*a->intermediates)[0]) {
+        myfailure("a.txt should be an output of A");
+    }
+
+    if (b->intermediates != NULL || b->inputs == NULL || 
+            (*b->inputs)[0] != (*a->intermediates)[0]) {
+        myfailure("B should read a.txt");
+    }
+
+    if (c->intermediates == NULL || *(*c->intermediates)[0] != "dir/c.txt") {
+        myfailure("C should write intermediate file dir/c.txt");
+    }
+}
+
 void test_tries_dag() {
     DAG dag("test/tries.dag", "", true, 3);
     
@@ -203,6 +299,206 @@ void test_priority_dag() {
     }
 }
 
+void test_runtime_dag() {
+    DAG dag("test/backfill.dag");
+    
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+    Task *e = dag.get_task("E");
+    
+    if (a->runtime != 2.0) {
+        myfailure("A should have runtime 2");
+    }
+    
+    if (b->runtime != 0.5) {
+        myfailure("B should have runtime 0.5");
+    }
+    
+    if (e->runtime != 0.0) {
+        myfailure("E should not have a runtime estimate");
+    }
+}
+
+void test_max_runtime_dag() {
+    DAG dag("test/timeout.dag");
+    
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+    Task *c = dag.get_task("C");
+    
+    if (a->max_runtime != 1.0) {
+        myfailure("A should have maximum runtime 1");
+    }
+    
+    if (b->max_runtime != 30.0) {
+        myfailure("B should have maximum runtime 30");
+    }
+    
+    if (c->max_runtime != 0.0) {
+        myfailure("C should not have a maximum runtime");
+    }
+}
+
+void test_placement_dag() {
+    DAG dag("test/placement.dag");
+
+    if (dag.get_task("A")->placement != PLACEMENT_SPREAD) {
+        myfailure("A should use spread placement");
+    }
+
+    if (dag.get_task("B")->placement != PLACEMENT_FIRST_FIT) {
+        myfailure("B should use first-fit placement");
+    }
+
+    if (dag.get_task("C")->placement != PLACEMENT_DEFAULT) {
+        myfailure("C should use the default placement");
+    }
+}
+
+void test_gang_dag() {
+    DAG dag("test/gang.dag");
+
+    if (dag.get_task("G")->hosts != 2) {
+        myfailure("G should need 2 hosts");
+    }
+
+    if (dag.get_task("A")->hosts != 1) {
+        myfailure("A should need 1 host");
+    }
+}
+
+void test_category_dag() {
+    DAG dag("test/category.dag", "", false);
+
+    Task *l1 = dag.get_task("L1");
+    if (l1->category == NULL || *l1->category != "load") {
+        myfailure("L1 should be in category load");
+    }
+
+    Task *l3 = dag.get_task("L3");
+    if (l3->category != NULL || l3->transformation == NULL || *l3->transformation != "load") {
+        myfailure("L3 should only have transformation load");
+    }
+
+    if (dag.maxjobs.size() != 1 || dag.maxjobs["load"] != 1) {
+        myfailure("Category load should have MAXJOBS 1");
+    }
+}
+
+void test_sweep_dag() {
+    DAG dag("test/sweep.dag");
+
+    if (dag.size() != 10) {
+        myfailure("Sweep DAG should have 10 tasks");
+    }
+
+    Task *sim = dag.get_task("sim[2]");
+    if (sim == NULL || sim->sweep == NULL || sim->sweep->name != "sim[0:4]" ||
+            !sim->args.empty()) {
+        myfailure("sim[2] should not be expanded until it is ready");
+    }
+    if (sim->outputs == NULL || *(*sim->outputs)[0] != "out.2") {
+        myfailure("sim[2] should write out.2");
+    }
+    dag.expand(sim);
+    if (sim->args.size() != 3 || *sim->args[2] != "2") {
+        myfailure("sim[2] should have its index in its arguments");
+    }
+    dag.expand(sim);
+    if (sim->args.size() != 3) {
+        myfailure("sim[2] should only be expanded once");
+    }
+    Task *sim0 = dag.get_task("sim[0]");
+    dag.expand(sim0);
+    if (sim0->args[0] != sim->args[0] || *sim0->args[2] != "0") {
+        myfailure("Sweep tasks should share arguments without {i}");
+    }
+    if (dag.has_task("sim[4]") || dag.has_task("sim[0:4]")) {
+        myfailure("sim[0:4] should not include sim[4]");
+    }
+
+    Task *check = dag.get_task("check[12]");
+    if (check->parents.size() != 1 || check->parents[0] != sim) {
+        myfailure("check[12] should be the child of sim[2]");
+    }
+    if (dag.get_task("setup")->children.size() != 4 || 
+            dag.get_task("merge")->parents.size() != 4) {
+        myfailure("setup and merge should be connected to the whole sweep");
+    }
+}
+
+void test_sweep_collapse() {
+    DAG dag("test/sweep_forward.dag");
+
+    Task *sim = dag.get_task("sim[1]");
+    dag.expand(sim);
+    if (sim->args.size() != 3 || *sim->args[2] != "1" || sim->pegasus_id != "1" ||
+            sim->pipe_forwards == NULL || (*sim->pipe_forwards)["SIM"] != "sim.1.out" ||
+            sim->file_forwards == NULL || (*sim->file_forwards)["sim.1"] != "out.1") {
+        myfailure("sim[1] should be expanded with its index");
+    }
+
+    // A finished sweep task should give back what it was expanded with
+    dag.collapse(sim);
+    if (!sim->args.empty() || sim->sweep_args != NULL || sim->pipe_forwards != NULL ||
+            sim->file_forwards != NULL || !sim->pegasus_id.empty()) {
+        myfailure("sim[1] should give back its state when it is collapsed");
+    }
+
+    // A task that is retried is expanded again
+    dag.expand(sim);
+    if (sim->args.size() != 3 || *sim->args[2] != "1" || sim->pegasus_id != "1") {
+        myfailure("sim[1] should be expanded again after it is collapsed");
+    }
+
+    // Tasks that are not in a sweep keep their state
+    DAG plain("test/diamond.dag");
+    Task *a = plain.get_task("A");
+    plain.collapse(a);
+    if (a->args.empty()) {
+        myfailure("Tasks that are not in a sweep should not be collapsed");
+    }
+}
+
+void test_critical_path_dag() {
+    DAG dag("test/critical.dag");
+    dag.compute_priorities(PRIORITY_CRITICAL_PATH);
+    
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+    Task *c = dag.get_task("C");
+    Task *d = dag.get_task("D");
+    Task *e = dag.get_task("E");
+    
+    if (!(a->priority > b->priority && b->priority > c->priority && c->priority > d->priority)) {
+        myfailure("Critical path priorities should be A > B > C > D");
+    }
+    
+    if (d->priority != e->priority) {
+        myfailure("D and E should have the same priority");
+    }
+}
+
+void test_level_dag() {
+    DAG bfs("test/critical.dag", "", false);
+    bfs.compute_priorities(PRIORITY_BFS);
+    
+    if (!(bfs.get_task("A")->priority > bfs.get_task("B")->priority &&
+          bfs.get_task("B")->priority == bfs.get_task("C")->priority &&
+          bfs.get_task("C")->priority > bfs.get_task("D")->priority)) {
+        myfailure("BFS priorities should decrease with level");
+    }
+    
+    DAG dfs("test/critical.dag", "", false);
+    dfs.compute_priorities(PRIORITY_DFS);
+    
+    if (!(dfs.get_task("A")->priority < dfs.get_task("B")->priority &&
+          dfs.get_task("B")->priority == dfs.get_task("C")->priority &&
+          dfs.get_task("C")->priority < dfs.get_task("D")->priority)) {
+        myfailure("DFS priorities should increase with level");
+    }
+}
+
 void test_pipe_forward() {
     DAG dag("test/forward.dag");
     
@@ -273,6 +569,219 @@ void test_file_forward() {
     }
 }
 
+void test_complex_args() {
+    DAG dag("test/complexargs.dag");
+    
+    Task *a = dag.get_task("A");
+    
+    if (a->args.size() != 4) {
+        myfailure("A should have 4 arguments, not %u", a->args.size());
+    }
+    if (*a->args[1] != "a < b || c > d") {
+        myfailure("Quoted argument parsed incorrectly: %s", a->args[1]->c_str());
+    }
+    if (*a->args[3] != "bar baz") {
+        myfailure("Quoted argument parsed incorrectly: %s", a->args[3]->c_str());
+    }
+}
+
+bool same_files(FileList *x, FileList *y) {
+    if (x == NULL || y == NULL) {
+        return x == y;
+    }
+    if (x->size() != y->size()) {
+        return false;
+    }
+    for (unsigned i = 0; i < x->size(); i++) {
+        if (*(*x)[i] != *(*y)[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool same_forwards(map<string,string> *x, map<string,string> *y) {
+    if (x == NULL || y == NULL) {
+        return x == y;
+    }
+    return *x == *y;
+}
+
+void check_same_dag(DAG &x, DAG &y) {
+    if (x.size() != y.size()) {
+        myfailure("Cached DAG has %u tasks, not %u", y.size(), x.size());
+    }
+    if (x.maxjobs != y.maxjobs) {
+        myfailure("Cached DAG has different MAXJOBS limits");
+    }
+    for (DAG::iterator i = x.begin(); i != x.end(); i++) {
+        Task *a = *i;
+        Task *b = y.get_task(a->name);
+        if (b == NULL) {
+            myfailure("Cached DAG is missing task %s", a->name.c_str());
+        }
+        if ((a->sweep == NULL) != (b->sweep == NULL) || 
+                (a->sweep != NULL && (b->sweep->name != a->sweep->name || 
+                                      b->sweep_index != a->sweep_index))) {
+            myfailure("Cached task %s is in a different sweep", a->name.c_str());
+        }
+        x.expand(a);
+        y.expand(b);
+        if (b->index != a->index || b->memory != a->memory || 
+                b->cpus != a->cpus || b->gpus != a->gpus || b->threads != a->threads || b->hosts != a->hosts || b->tries != a->tries || 
+                b->priority != a->priority || b->runtime != a->runtime ||
+                b->max_runtime != a->max_runtime || b->placement != a->placement) {
+            myfailure("Cached task %s has different resources", a->name.c_str());
+        }
+        if (b->pegasus_id != a->pegasus_id || (a->transformation == NULL) != (b->transformation == NULL) ||
+                (a->transformation != NULL && *b->transformation != *a->transformation)) {
+            myfailure("Cached task %s has a different Pegasus id", a->name.c_str());
+        }
+        if ((a->category == NULL) != (b->category == NULL) ||
+                (a->category != NULL && *b->category != *a->category)) {
+            myfailure("Cached task %s has a different category", a->name.c_str());
+        }
+        if (b->args.size() != a->args.size()) {
+            myfailure("Cached task %s has different arguments", a->name.c_str());
+        }
+        for (unsigned j = 0; j < a->args.size(); j++) {
+            if (*b->args[j] != *a->args[j]) {
+                myfailure("Cached task %s has different arguments", a->name.c_str());
+            }
+        }
+        if (!same_forwards(a->pipe_forwards, b->pipe_forwards) || 
+                !same_forwards(a->file_forwards, b->file_forwards)) {
+            myfailure("Cached task %s has different forwards", a->name.c_str());
+        }
+        if (!same_files(a->inputs, b->inputs) || !same_files(a->outputs, b->outputs) ||
+                !same_files(a->intermediates, b->intermediates)) {
+            myfailure("Cached task %s has different inputs or outputs", a->name.c_str());
+        }
+        if (b->children.size() != a->children.size() || 
+                b->parents.size() != a->parents.size()) {
+            myfailure("Cached task %s has different edges", a->name.c_str());
+        }
+        for (unsigned j = 0; j < a->children.size(); j++) {
+            if (b->children[j]->name != a->children[j]->name) {
+                myfailure("Cached task %s has different children", a->name.c_str());
+            }
+        }
+        for (unsigned j = 0; j < a->parents.size(); j++) {
+            if (b->parents[j]->name != a->parents[j]->name) {
+                myfailure("Cached task %s has different parents", a->name.c_str());
+            }
+        }
+    }
+}
+
+void test_dag_cache() {
+    const char *dags[] = {"test/diamond.dag", "test/file_forward.dag", "test/memory.dag", 
+        "test/timeout.dag", "test/gpus.dag", "test/locality.dag", "test/staging.dag",
+        "test/pegasus.dag", "test/placement.dag", "test/gang.dag", "test/sweep.dag",
+        "test/sweep_forward.dag", "test/category.dag", "test/threads.dag"};
+    for (unsigned i = 0; i < 14; i++) {
+        string dagfile = dags[i];
+        string cachefile = "test/scratch.pmcb";
+        unlink(cachefile.c_str());
+
+        DAG parsed(dagfile, "", false);
+
+        // The first time the cache is written, the second time it is read
+        DAG written(dagfile, "", false, 1, cachefile);
+        if (access(cachefile.c_str(), R_OK) != 0) {
+            myfailure("DAG cache was not written for %s", dagfile.c_str());
+        }
+        DAG cached(dagfile, "", false, 1, cachefile);
+
+        check_same_dag(parsed, written);
+        check_same_dag(parsed, cached);
+
+        // An invalid cache should be ignored
+        FILE *f = fopen(cachefile.c_str(), "w");
+        fprintf(f, "garbage");
+        fclose(f);
+        DAG invalid(dagfile, "", false, 1, cachefile);
+        check_same_dag(parsed, invalid);
+
+        unlink(cachefile.c_str());
+    }
+
+    // A DAG that is rewritten in the same second with the same size
+    // should not be loaded from the cache of the old one
+    string dagfile = "test/scratch.dag";
+    string cachefile = "test/scratch.pmcb";
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = 1000000000;
+    times[0].tv_nsec = times[1].tv_nsec = 100;
+    FILE *f = fopen(dagfile.c_str(), "w");
+    fprintf(f, "TASK A /bin/true\n");
+    fclose(f);
+    utimensat(AT_FDCWD, dagfile.c_str(), times, 0);
+    DAG old(dagfile, "", false, 1, cachefile);
+    f = fopen(dagfile.c_str(), "w");
+    fprintf(f, "TASK B /bin/true\n");
+    fclose(f);
+    times[0].tv_nsec = times[1].tv_nsec = 200;
+    utimensat(AT_FDCWD, dagfile.c_str(), times, 0);
+    DAG rewritten(dagfile, "", false, 1, cachefile);
+    if (rewritten.get_task("B") == NULL) {
+        myfailure("DAG cache was used for a DAG rewritten in the same second");
+    }
+    unlink(dagfile.c_str());
+    unlink(cachefile.c_str());
+}
+
+void test_generated_dags() {
+    const char *shapes[] = {"levels", "wide", "chain", "butterfly", "tree"};
+    string dagfile = "test/scratch";
+    for (unsigned s = 0; s < 5; s++) {
+        DAGGenerator gen;
+        if (!parse_dag_shape(shapes[s], &gen.shape)) {
+            myfailure("Unknown shape %s", shapes[s]);
+        }
+        gen.tasks = 100;
+        gen.width = 8;
+        gen.fanin = 3;
+        gen.write(dagfile);
+
+        DAG dag(dagfile, "", false);
+        if (dag.size() != 100) {
+            myfailure("%s DAG should have 100 tasks", shapes[s]);
+        }
+        unsigned long edges = 0;
+        for (DAG::iterator t = dag.begin(); t != dag.end(); t++) {
+            edges += (*t)->parents.size();
+        }
+        if (edges != gen.edges) {
+            myfailure("%s DAG should have %lu edges, not %lu", shapes[s],
+                    gen.edges, edges);
+        }
+
+        // Every task should finish when the DAG is run in order
+        Engine engine(dag);
+        unsigned finished = 0;
+        while (engine.has_ready_task()) {
+            engine.mark_task_finished(engine.next_ready_task(), 0);
+            finished++;
+        }
+        if (finished != 100 || !engine.is_finished()) {
+            myfailure("Only %u tasks of the %s DAG finished", finished, shapes[s]);
+        }
+    }
+
+    // Chains have no parallelism, so the critical path is all of them
+    DAGGenerator chain;
+    chain.shape = SHAPE_CHAIN;
+    chain.tasks = 10;
+    chain.width = 1;
+    chain.write(dagfile);
+    if (chain.edges != 9 || chain.critical_path != chain.total_runtime) {
+        myfailure("Chain DAG is wrong");
+    }
+
+    unlink(dagfile.c_str());
+}
+
 int main(int argc, char *argv[]) {
     try {
         log_set_level(LOG_ERROR);
@@ -281,10 +790,26 @@ int main(int argc, char *argv[]) {
         test_pegasus_dag();
         test_memory_dag();
         test_cpu_dag();
+        test_gpu_dag();
+        test_threads_dag();
+        test_locality_dag();
+        test_staging_dag();
         test_tries_dag();
         test_priority_dag();
+        test_runtime_dag();
+        test_max_runtime_dag();
+        test_placement_dag();
+        test_gang_dag();
+        test_category_dag();
+        test_sweep_dag();
+        test_sweep_collapse();
+        test_critical_path_dag();
+        test_level_dag();
+        test_generated_dags();
         test_pipe_forward();
         test_file_forward();
+        test_complex_args();
+        test_dag_cache();
         return 0;
     } catch (exception &error) {
         log_error("ERROR: %s", error.what());
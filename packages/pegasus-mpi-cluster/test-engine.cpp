@@ -6,6 +6,7 @@
 #include "dag.h"
 #include "engine.h"
 #include "failure.h"
+#include "config.h"
 
 void diamond_dag() {
     DAG dag("test/diamond.dag");
@@ -179,6 +180,101 @@ void diamond_dag_newrescue() {
     }
 }
 
+void diamond_dag_group_rescue() {
+    char temp[1024];
+    sprintf(temp,"file_XXXXXX");
+    mkstemp(temp);
+
+    config.rescue_batch = 3;
+    config.rescue_interval = 60000;
+    
+    DAG dag("test/diamond.dag");
+    Engine engine(dag, temp);
+
+    char buf[1024];
+
+    Task *a = engine.next_ready_task();
+    engine.mark_task_finished(a, 0);
+    Task *bc = engine.next_ready_task();
+    engine.mark_task_finished(bc, 0);
+
+    if (engine.rescue_flush_time() == 0) {
+        myfailure("Rescue records should be buffered");
+    }
+    read_file(temp, buf);
+    if (strcmp(buf, "") != 0) {
+        myfailure("Rescue records should not be committed yet: %s", buf);
+    }
+
+    Task *cb = engine.next_ready_task();
+    engine.mark_task_finished(cb, 0);
+    read_file(temp, buf);
+    if (strcmp(buf, "\nDONE A\nDONE B\nDONE C") != 0) {
+        myfailure("Rescue records should be committed in a batch: %s", buf);
+    }
+
+    Task *d = engine.next_ready_task();
+    engine.mark_task_finished(d, 0);
+    engine.flush_rescue();
+    read_file(temp, buf);
+    if (strcmp(buf, "\nDONE A\nDONE B\nDONE C\nDONE D") != 0) {
+        myfailure("Rescue record should be committed by flush: %s", buf);
+    }
+
+    unlink(temp);
+
+    config.rescue_batch = 1;
+    config.rescue_interval = 1000;
+}
+
+void diamond_dag_binary_rescue() {
+    char temp[1024];
+    sprintf(temp,"file_XXXXXX");
+    mkstemp(temp);
+
+    config.binary_rescue = true;
+    {
+        DAG dag("test/diamond.dag");
+        Engine engine(dag, temp);
+
+        Task *a = engine.next_ready_task();
+        engine.mark_task_finished(a, 0);
+        Task *bc = engine.next_ready_task();
+        engine.mark_task_finished(bc, 0);
+    }
+
+    // Restarting should leave only the task that did not run
+    {
+        DAG dag("test/diamond.dag", temp);
+        if (!dag.get_task("A")->success || !dag.get_task("B")->success || 
+                dag.get_task("C")->success) {
+            myfailure("Binary rescue file should mark A and B done");
+        }
+        Engine engine(dag, temp);
+        Task *cb = engine.next_ready_task();
+        engine.mark_task_finished(cb, 0);
+    }
+    config.binary_rescue = false;
+
+    // Restarting without --binary-rescue converts it to text
+    {
+        DAG dag("test/diamond.dag", temp);
+        if (dag.get_task("D")->success || !dag.get_task("B")->success || 
+                !dag.get_task("C")->success) {
+            myfailure("Binary rescue file was not appended to");
+        }
+        Engine engine(dag, temp);
+    }
+
+    char buf[1024];
+    read_file(temp, buf);
+    if (strcmp(buf, "\nDONE A\nDONE B\nDONE C") != 0) {
+        myfailure("Binary rescue file not converted to text: %s", buf);
+    }
+
+    unlink(temp);
+}
+
 void diamond_dag_oldrescue() {
     char temp[1024];
     sprintf(temp, "file_XXXXXX");
@@ -315,6 +411,26 @@ void diamond_dag_retries2() {
     }
 }
 
+/* A retried task runs again without using up its tries */
+void diamond_dag_retry_task() {
+    DAG dag("test/diamond.dag");
+    Engine engine(dag);
+
+    Task *a = engine.next_ready_task();
+    engine.retry_task(a);
+    if (!engine.has_ready_task() || engine.next_ready_task() != a) {
+        myfailure("A should have been ready again");
+    }
+    if (a->failures != 0) {
+        myfailure("A should not have failed");
+    }
+
+    engine.mark_task_finished(a, 1);
+    if (!engine.is_failed()) {
+        myfailure("A should have failed");
+    }
+}
+
 int main(int argc, char *argv[]) {
     diamond_dag();
     diamond_dag_failure();
@@ -323,6 +439,9 @@ int main(int argc, char *argv[]) {
     diamond_dag_retries2();
     diamond_dag_oldrescue();
     diamond_dag_newrescue();
+    diamond_dag_group_rescue();
+    diamond_dag_binary_rescue();
     diamond_dag_rescue();
+    diamond_dag_retry_task();
     return 0;
 }
@@ -268,6 +268,315 @@ void test_write() {
     cache.close();
 }
 
+void test_coalesce() {
+    FDCache cache;
+    unlink("test/scratch/test_coalesce.1");
+    unlink("test/scratch/test_coalesce.2");
+    cache.enqueue("test/scratch/test_coalesce.1", "A", "a1", 2);
+    cache.enqueue("test/scratch/test_coalesce.2", "A", "b1", 2);
+    cache.enqueue("test/scratch/test_coalesce.1", "B", "a2", 2);
+    cache.enqueue("test/scratch/test_coalesce.2", "B", "", 0);
+    cache.enqueue("test/scratch/test_coalesce.1", "C", "a3", 2);
+    if (!cache.pending("A") || !cache.pending("C")) {
+        myfailure("data should be pending until flush");
+    }
+    cache.flush();
+    if (cache.pending("A") || cache.pending("B") || cache.pending("C")) {
+        myfailure("data should have been written");
+    }
+
+    // Each file is opened once for the whole group
+    if (cache.misses != 2 || cache.hits != 0) {
+        myfailure("expected 2 misses and no hits");
+    }
+
+    char buf[16];
+    FILE *f = fopen("test/scratch/test_coalesce.1", "r");
+    if (f == NULL) {
+        myfailures("unable to open test_coalesce.1");
+    }
+    size_t size = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (size != 6 || strncmp(buf, "a1a2a3", 6) != 0) {
+        myfailure("wrong data in test_coalesce.1");
+    }
+
+    // Data that is not flushed is written on close
+    cache.enqueue("test/scratch/test_coalesce.2", "D", "b2", 2);
+    cache.close();
+    f = fopen("test/scratch/test_coalesce.2", "r");
+    if (f == NULL) {
+        myfailures("unable to open test_coalesce.2");
+    }
+    size = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (size != 4 || strncmp(buf, "b1b2", 4) != 0) {
+        myfailure("wrong data in test_coalesce.2");
+    }
+}
+
+void test_streams() {
+    FDCache cache;
+    unlink("test/scratch/test_streams");
+    cache.enqueue("test/scratch/test_streams", "A", "a0", 2, 1, 0, false);
+    cache.enqueue("test/scratch/test_streams", "B", "b", 1, 2);
+    cache.enqueue("test/scratch/test_streams", "C", "c0", 2, 3, 0, false);
+    cache.flush();
+
+    // B and C have to wait until A is done
+    if (cache.pending("A") || !cache.pending("B") || !cache.pending("C")) {
+        myfailure("B and C should be held");
+    }
+    map<int, unsigned> credits;
+    cache.take_credits(credits);
+    if (credits.size() != 1 || credits[1] != 1) {
+        myfailure("A should have one credit");
+    }
+
+    cache.enqueue("test/scratch/test_streams", "A", "a1", 2, 1, 1, true);
+    cache.enqueue("test/scratch/test_streams", "C", "c1", 2, 3, 1, true);
+    cache.flush();
+    if (cache.pending("A") || cache.pending("B") || cache.pending("C")) {
+        myfailure("nothing should be held");
+    }
+    credits.clear();
+    cache.take_credits(credits);
+    if (credits[1] != 1 || credits[3] != 2 || credits.count(2) != 0) {
+        myfailure("wrong credits");
+    }
+
+    char buf[16];
+    FILE *f = fopen("test/scratch/test_streams", "r");
+    if (f == NULL) {
+        myfailures("unable to open test_streams");
+    }
+    size_t size = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (size != 9 || strncmp(buf, "a0a1bc0c1", 9) != 0) {
+        myfailure("wrong data in test_streams");
+    }
+
+    // Chunks have to arrive in order
+    bool failed = false;
+    try {
+        cache.enqueue("test/scratch/test_streams", "D", "d1", 2, 1, 1, false);
+    } catch (exception &error) {
+        failed = true;
+    }
+    if (!failed) {
+        myfailure("out of order chunk should fail");
+    }
+    cache.close();
+}
+
+void test_aborted_streams() {
+    FDCache cache;
+    unlink("test/scratch/test_aborted_streams");
+    cache.enqueue("test/scratch/test_aborted_streams", "A", "a", 1, 1);
+    cache.enqueue("test/scratch/test_aborted_streams", "B", "b0", 2, 2, 0, false);
+    cache.enqueue("test/scratch/test_aborted_streams", "C", "c", 1, 3);
+    cache.flush();
+
+    // The chunk that was written is removed, and C is let in
+    cache.enqueue("test/scratch/test_aborted_streams", "B", "", 0, 2, 1, true, true);
+    cache.flush();
+
+    // Chunks that were not written yet are dropped
+    cache.enqueue("test/scratch/test_aborted_streams", "D", "d0", 2, 4, 0, false);
+    cache.enqueue("test/scratch/test_aborted_streams", "D", "", 0, 4, 1, true, true);
+    cache.flush();
+    if (cache.pending("B") || cache.pending("C") || cache.pending("D")) {
+        myfailure("nothing should be pending");
+    }
+    map<int, unsigned> credits;
+    cache.take_credits(credits);
+    if (credits[2] != 2 || credits[4] != 2) {
+        myfailure("aborted chunks should earn credit");
+    }
+
+    char buf[16];
+    FILE *f = fopen("test/scratch/test_aborted_streams", "r");
+    if (f == NULL) {
+        myfailures("unable to open test_aborted_streams");
+    }
+    size_t size = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (size != 2 || strncmp(buf, "ac", 2) != 0) {
+        myfailure("wrong data in test_aborted_streams");
+    }
+    cache.close();
+}
+
+void test_offsets() {
+    FDCache cache;
+    FILE *f = fopen("test/scratch/test_offsets", "w");
+    fprintf(f, "......");
+    fclose(f);
+
+    // Records with an offset are written there, not appended
+    cache.enqueue("test/scratch/test_offsets", "A", "a", 1, 1, 0, true, false, 4);
+    cache.enqueue("test/scratch/test_offsets", "B", "b0", 2, 2, 0, false, false, 0);
+    cache.enqueue("test/scratch/test_offsets", "B", "b1", 2, 2, 1, true, false, 2);
+    cache.flush();
+
+    char buf[16];
+    f = fopen("test/scratch/test_offsets", "r");
+    if (f == NULL) {
+        myfailures("unable to open test_offsets");
+    }
+    size_t size = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (size != 6 || strncmp(buf, "b0b1a.", 6) != 0) {
+        myfailure("wrong data in test_offsets");
+    }
+    cache.close();
+}
+
+void test_credit_records() {
+    FDCache cache;
+    cache.credit_records();
+    unlink("test/scratch/test_credit_records");
+    cache.enqueue("test/scratch/test_credit_records", "A", "a", 1, 1);
+    cache.enqueue("test/scratch/test_credit_records", "B", "b0", 2, 2, 0, false);
+    cache.enqueue("test/scratch/test_credit_records", "C", "c", 1, -1);
+    cache.flush();
+
+    // Every record from a worker earns credit, chunked or not
+    map<int, unsigned> credits;
+    cache.take_credits(credits);
+    if (credits.size() != 2 || credits[1] != 1 || credits[2] != 1) {
+        myfailure("A and B should have one credit each");
+    }
+    cache.close();
+}
+
+void test_write_behind() {
+    FDCache cache;
+    cache.start_writer(1000);
+    unlink("test/scratch/test_write_behind");
+    cache.enqueue("test/scratch/test_write_behind", "A", "foo\n", 4);
+    cache.enqueue("test/scratch/test_write_behind", "B", "bar\n", 4);
+    if (!cache.pending("A") || !cache.pending("B")) {
+        myfailure("data should be pending");
+    }
+    cache.flush();
+    if (cache.pending("A") || cache.pending("B")) {
+        myfailure("data should have been flushed");
+    }
+
+    char buf[16];
+    FILE *f = fopen("test/scratch/test_write_behind", "r");
+    if (f == NULL) {
+        myfailures("unable to open test_write_behind");
+    }
+    size_t size = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (size != 8 || strncmp(buf, "foo\nbar\n", 8) != 0) {
+        myfailure("wrong data in test_write_behind");
+    }
+
+    // Errors are reported for the task that wrote the data
+    cache.enqueue("/dev/null/test_write_behind", "C", "baz\n", 4);
+    cache.flush();
+    if (cache.take_failure("A")) {
+        myfailure("A should not have failed");
+    }
+    if (!cache.take_failure("C")) {
+        myfailure("C should have failed");
+    }
+    if (cache.take_failure("C")) {
+        myfailure("failure should have been cleared");
+    }
+
+    // Buffered data is written on close
+    cache.enqueue("test/scratch/test_write_behind", "D", "qux\n", 4);
+    cache.close();
+    if (cache.write_behind()) {
+        myfailure("writer should have stopped");
+    }
+    f = fopen("test/scratch/test_write_behind", "r");
+    if (f == NULL) {
+        myfailures("unable to open test_write_behind");
+    }
+    size = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (size != 12) {
+        myfailure("close did not write buffered data");
+    }
+}
+
+void test_writer_threads() {
+    FDCache cache(16);
+    cache.start_writer(1000, 4);
+    char name[64];
+    for (int i = 0; i < 8; i++) {
+        sprintf(name, "test/scratch/test_writer_threads.%d", i);
+        unlink(name);
+        for (int j = 0; j < 10; j++) {
+            cache.enqueue(name, "A", "0123456789", j + 1);
+        }
+    }
+    cache.flush();
+    if (cache.pending("A")) {
+        myfailure("data should have been flushed");
+    }
+
+    // Records for each file are written in order
+    for (int i = 0; i < 8; i++) {
+        sprintf(name, "test/scratch/test_writer_threads.%d", i);
+        FILE *f = fopen(name, "r");
+        if (f == NULL) {
+            myfailures("unable to open %s", name);
+        }
+        char buf[64];
+        size_t size = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        if (size != 55 || strncmp(buf, "001012012301234", 15) != 0) {
+            myfailure("wrong data in %s", name);
+        }
+    }
+
+    cache.enqueue("/dev/null/test_writer_threads", "B", "x", 1);
+    cache.flush();
+    if (!cache.take_failure("B") || cache.take_failure("A")) {
+        myfailure("failure not reported for the right task");
+    }
+
+    cache.close();
+    if (cache.misses != 9) {
+        myfailure("expected 9 misses, got %u", cache.misses);
+    }
+}
+
+void test_pin() {
+    FILE *out = fopen("test/scratch/test_pin", "w");
+    if (out == NULL) {
+        myfailures("unable to open test/scratch/test_pin");
+    }
+
+    FDCache cache(2);
+    cache.pin("<stdout>", out);
+    cache.start_writer(1000, 2);
+    cache.enqueue("<stdout>", "A", "foo", 3);
+    cache.enqueue("test/scratch/test_pin.1", "A", "x", 1);
+    cache.enqueue("test/scratch/test_pin.2", "A", "x", 1);
+    cache.enqueue("<stdout>", "B", "bar", 3);
+    cache.close();
+
+    // The pinned file is still open after the cache is closed
+    if (fputs("baz", out) < 0 || fclose(out) != 0) {
+        myfailure("pinned file was closed");
+    }
+
+    FILE *f = fopen("test/scratch/test_pin", "r");
+    char buf[64];
+    size_t size = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (size != 9 || strncmp(buf, "foobarbaz", 9) != 0) {
+        myfailure("wrong data in pinned file");
+    }
+}
+
 int main(int argc, char **argv) {
 #ifdef __MACH__
     /* On recent versions of OSX we have to do this because some library
@@ -297,6 +606,22 @@ int main(int argc, char **argv) {
         test_open();
         log_trace("test_write");
         test_write();
+        log_trace("test_coalesce");
+        test_coalesce();
+        log_trace("test_streams");
+        test_streams();
+        log_trace("test_aborted_streams");
+        test_aborted_streams();
+        log_trace("test_offsets");
+        test_offsets();
+        log_trace("test_credit_records");
+        test_credit_records();
+        log_trace("test_write_behind");
+        test_write_behind();
+        log_trace("test_writer_threads");
+        test_writer_threads();
+        log_trace("test_pin");
+        test_pin();
         return 0;
     } catch (exception &error) {
         log_error("ERROR: %s", error.what());
@@ -0,0 +1,162 @@
+#include <string>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "localcomm.h"
+#include "shmcomm.h"
+#include "protocol.h"
+#include "failure.h"
+#include "log.h"
+
+using std::exception;
+using std::string;
+
+#define MESSAGES 1000
+
+// Rank 1 is a process, ranks 2 and 3 are threads of the master
+#define LOCAL_WORKERS 2
+
+static void worker(Communicator &comm, bool local) {
+    // Register with the master, and get a broadcast back
+    CreditMessage registration(comm.rank());
+    comm.gather_messages(&registration, 0);
+    Message *mesg = comm.broadcast_message(NULL, 0);
+    CreditMessage *broadcast = dynamic_cast<CreditMessage *>(mesg);
+    if (broadcast == NULL || broadcast->credits != 42 || broadcast->source != 0) {
+        myfailure("Rank %d: Expected a broadcast from the master", comm.rank());
+    }
+    delete mesg;
+
+    // Local workers can't reach the other workers
+    if (local) {
+        CreditMessage other(0);
+        bool failed = false;
+        try {
+            comm.send_message(&other, 1);
+        } catch (exception &error) {
+            failed = true;
+        }
+        if (!failed) {
+            myfailure("Local worker %d should not send to rank 1", comm.rank());
+        }
+    }
+
+    for (unsigned i = 0; i < MESSAGES; i++) {
+        if (i % 2 == 0) {
+            CreditMessage credit(i);
+            comm.send_message(&credit, 0);
+        } else {
+            comm.send_message_async(new CreditMessage(i), 0);
+        }
+    }
+
+    Message *reply = comm.recv_message();
+    if (dynamic_cast<ShutdownMessage *>(reply) == NULL) {
+        myfailure("Rank %d: Expected a shutdown message", comm.rank());
+    }
+    delete reply;
+    if (comm.message_waiting()) {
+        myfailure("Rank %d: Unexpected message waiting", comm.rank());
+    }
+}
+
+static void *local_worker(void *arg) {
+    Communicator *comm = static_cast<Communicator *>(arg);
+    try {
+        worker(*comm, true);
+    } catch (exception &error) {
+        log_error("ERROR: Rank %d: %s", comm->rank(), error.what());
+        comm->abort(1);
+    }
+    return NULL;
+}
+
+static void master(Communicator &comm) {
+    LocalCommunicator local(&comm, LOCAL_WORKERS);
+    if (local.size() != comm.size() + LOCAL_WORKERS) {
+        myfailure("Local workers should be added to the ranks");
+    }
+
+    pthread_t threads[LOCAL_WORKERS];
+    for (unsigned i = 0; i < LOCAL_WORKERS; i++) {
+        if (local.worker(i)->rank() != comm.size() + (int)i) {
+            myfailure("Local worker %u has the wrong rank", i);
+        }
+        pthread_create(&threads[i], NULL, local_worker, local.worker(i));
+    }
+
+    vector<Message *> registrations = local.gather_messages(NULL, 0);
+    if (registrations.size() != (unsigned)local.size() || registrations[0] != NULL) {
+        myfailure("Wrong number of registrations");
+    }
+    for (int r = 1; r < local.size(); r++) {
+        CreditMessage *credit = dynamic_cast<CreditMessage *>(registrations[r]);
+        if (credit == NULL || credit->credits != (unsigned)r || credit->source != r) {
+            myfailure("Wrong registration from rank %d", r);
+        }
+        delete credit;
+    }
+
+    CreditMessage broadcast(42);
+    local.broadcast_message(&broadcast, 0);
+
+    // Messages from each worker arrive in the order they were sent
+    unsigned next[1 + 1 + LOCAL_WORKERS] = {0, 0, 0, 0};
+    for (unsigned i = 0; i < (1 + LOCAL_WORKERS) * MESSAGES; i++) {
+        Message *mesg = local.recv_message();
+        CreditMessage *credit = dynamic_cast<CreditMessage *>(mesg);
+        if (credit == NULL) {
+            myfailure("Expected a credit message");
+        }
+        if (credit->credits != next[credit->source]) {
+            myfailure("Message %u from %d arrived out of order", credit->credits, credit->source);
+        }
+        next[credit->source]++;
+        delete mesg;
+    }
+
+    if (local.message_waiting()) {
+        myfailure("Unexpected message waiting");
+    }
+    if (local.recv_message(0.01) != NULL) {
+        myfailure("recv_message should time out");
+    }
+
+    for (int r = 1; r < local.size(); r++) {
+        if (r % 2 == 0) {
+            ShutdownMessage mesg;
+            local.send_message(&mesg, r);
+        } else {
+            local.send_message_async(new ShutdownMessage(), r);
+        }
+    }
+    local.wait_for_sends();
+
+    for (unsigned i = 0; i < LOCAL_WORKERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (local.recvd() <= comm.recvd() || local.sent() <= comm.sent()) {
+        myfailure("Local messages were not counted");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        log_set_level(LOG_ERROR);
+        ShmCommunicator comm(2);
+        try {
+            if (comm.rank() == 0) {
+                master(comm);
+            } else {
+                worker(comm, false);
+            }
+        } catch (exception &error) {
+            log_error("ERROR: Rank %d: %s", comm.rank(), error.what());
+            comm.abort(1);
+        }
+        return 0;
+    } catch (exception &error) {
+        log_error("ERROR: %s", error.what());
+        return 1;
+    }
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "log.h"
 #include "failure.h"
@@ -31,6 +32,35 @@ int main(int argc, char *argv[]) {
     log_set_file(NULL);
     log_warn("OK");
 
+    // The arguments of disabled messages are not evaluated
+    int evaluated = 0;
+    log_set_level(LOG_INFO);
+    log_debug("NOT OK %d", evaluated++);
+    log_trace("NOT OK %d", evaluated++);
+    if (evaluated != 0) abort();
+
+    // Messages logged asynchronously are all written, in order, through
+    // a ring that is smaller than the messages
+    FILE *async = tmpfile();
+    log_set_file(async);
+    log_start_async(1);
+    for (int i = 0; i < 1000; i++) {
+        log_info("message %d", i);
+    }
+    log_stop_async();
+    rewind(async);
+    char line[256];
+    for (int i = 0; i < 1000; i++) {
+        char expected[64];
+        snprintf(expected, sizeof(expected), "[info] message %d\n", i);
+        if (fgets(line, sizeof(line), async) == NULL || strstr(line, expected) == NULL) {
+            abort();
+        }
+    }
+    if (fgets(line, sizeof(line), async) != NULL) abort();
+    log_set_file(NULL);
+    fclose(async);
+
     /* Test the timestamp stuff
     FILE *logf = fopen("/tmp/foo.log","w");
     log_set_file(logf);
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "poller.h"
+#include "failure.h"
+#include "log.h"
+
+using std::exception;
+
+void test_pipe() {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        myfailures("Unable to create pipe");
+    }
+
+    Poller poller;
+    poller.add(fds[0]);
+
+    vector<struct pollfd> ready;
+    if (poller.wait(0, ready) != 0 || !ready.empty()) {
+        myfailure("Empty pipe should not be ready");
+    }
+
+    if (write(fds[1], "x", 1) != 1) {
+        myfailures("Unable to write to pipe");
+    }
+    if (poller.wait(1000, ready) != 1 || ready[0].fd != fds[0] ||
+            !(ready[0].revents & POLLIN)) {
+        myfailure("Pipe should be readable");
+    }
+    char c;
+    if (read(fds[0], &c, 1) != 1) {
+        myfailures("Unable to read from pipe");
+    }
+
+    close(fds[1]);
+    if (poller.wait(1000, ready) != 1 || !(ready[0].revents & POLLHUP)) {
+        myfailure("Pipe should be hung up");
+    }
+
+    poller.remove(fds[0]);
+    if (!poller.empty()) {
+        myfailure("Poller should be empty");
+    }
+    close(fds[0]);
+}
+
+void test_pidfd() {
+    pid_t pid = fork();
+    if (pid < 0) {
+        myfailures("Unable to fork");
+    }
+    if (pid == 0) {
+        usleep(10000);
+        _exit(0);
+    }
+
+    int pidfd = open_pidfd(pid);
+    if (pidfd >= 0) {
+        Poller poller;
+        poller.add(pidfd);
+        vector<struct pollfd> ready;
+        if (poller.wait(5000, ready) != 1 || !(ready[0].revents & POLLIN)) {
+            myfailure("pidfd should be readable when the process exits");
+        }
+        poller.remove(pidfd);
+        close(pidfd);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid) {
+        myfailures("Unable to wait for child");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        log_set_level(LOG_ERROR);
+        test_pipe();
+        test_pidfd();
+        return 0;
+    } catch (exception &error) {
+        log_error("ERROR: %s", error.what());
+        return 1;
+    }
+}
@@ -9,7 +9,7 @@
 using std::exception;
 
 char *msgcopy(char *msg, int msgsize) {
-    char *message = new char[msgsize];
+    char *message = alloc_buffer(msgsize);
     memcpy(message, msg, msgsize);
     return message;
 }
@@ -29,7 +29,16 @@ void test_command() {
     pipe_forwards["FOO"] = "BAR";
     map<string,string> file_forwards;
     file_forwards["BAZ"] = "BOO";
-    CommandMessage input(name, args, id, memory, cpus, bindings, &pipe_forwards, &file_forwards);
+    double max_runtime = 60.5;
+    cpu_t gpus = 2;
+    vector<cpu_t> gpu_bindings;
+    gpu_bindings.push_back(1);
+    gpu_bindings.push_back(3);
+    vector<string> hosts;
+    hosts.push_back("hosta");
+    hosts.push_back("hostb");
+    cpu_t threads = 6;
+    CommandMessage input(name, args, id, memory, cpus, bindings, &pipe_forwards, &file_forwards, max_runtime, gpus, gpu_bindings, hosts, threads);
     CommandMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
     if (input.name != output.name) {
         myfailure("names don't match");
@@ -49,27 +58,43 @@ void test_command() {
     if (input.cpus != output.cpus) {
         myfailure("cpus don't match");
     }
+    if (input.max_runtime != output.max_runtime) {
+        myfailure("max runtimes don't match");
+    }
     if (output.bindings.size() != input.bindings.size()) {
         myfailure("number of bindings don't match");
     }
     if (output.bindings[0] != input.bindings[0] || output.bindings[1] != input.bindings[1]) {
         myfailure("bindings don't match");
     }
+    if (output.gpus != input.gpus) {
+        myfailure("gpus don't match");
+    }
+    if (output.gpu_bindings != input.gpu_bindings) {
+        myfailure("gpu bindings don't match");
+    }
+    if (output.threads != input.threads) {
+        myfailure("threads don't match");
+    }
     if (output.pipe_forwards["FOO"] != input.pipe_forwards["FOO"]) {
         myfailure("pipe forwards don't match");
     }
     if (output.file_forwards["BAZ"] != input.file_forwards["BAZ"]) {
         myfailure("file forwards don't match");
     }
+    if (output.hosts != input.hosts) {
+        myfailure("hosts don't match");
+    }
 }
 
 void test_result() {
     string name = "name";
     int exitcode = 127;
     double runtime = 123.456;
-    ResultMessage input(name, exitcode, runtime);
+    double launch = 0.0125;
+    ResultMessage input(name, exitcode, runtime, launch, true);
     ResultMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0, 0);
-    if (output.name != input.name) {
+    if (strcmp(output.name, input.name)) {
         myfailure("name does not match");
     }
     if (output.exitcode != input.exitcode) {
@@ -78,6 +103,78 @@ void test_result() {
     if (output.runtime != input.runtime) {
         myfailure("runtime does not match");
     }
+    if (output.launch != input.launch) {
+        myfailure("launch does not match");
+    }
+    if (!output.timeout) {
+        myfailure("timeout does not match");
+    }
+    if (!output.trace.empty()) {
+        myfailure("trace should be empty");
+    }
+
+    vector<double> trace;
+    for (int i = 0; i < TRACE_POINTS; i++) {
+        trace.push_back(1000.0 + i);
+    }
+    ResultMessage traced(name, exitcode, runtime, launch, false, trace);
+    ResultMessage traced_output(msgcopy(traced.msg, traced.msgsize), traced.msgsize, 0, 0);
+    if (traced_output.timeout) {
+        myfailure("timeout does not match");
+    }
+    if (traced_output.trace != trace) {
+        myfailure("trace does not match");
+    }
+
+    TaskUsage usage;
+    usage.maxrss = 204800;
+    usage.utime = 1.5;
+    usage.stime = 0.25;
+    usage.inblock = 8;
+    usage.oublock = 16;
+    ResultMessage measured(name, exitcode, runtime, launch, false, trace, usage);
+    ResultMessage measured_output(msgcopy(measured.msg, measured.msgsize), measured.msgsize, 0, 0);
+    if (measured_output.usage.maxrss != usage.maxrss || measured_output.usage.utime != usage.utime ||
+            measured_output.usage.stime != usage.stime || measured_output.usage.inblock != usage.inblock ||
+            measured_output.usage.oublock != usage.oublock) {
+        myfailure("usage does not match");
+    }
+    if (measured_output.trace != trace) {
+        myfailure("trace does not match");
+    }
+    if (!measured_output.files.empty()) {
+        myfailure("files should be empty");
+    }
+
+    vector<FileUsage> files(2);
+    files[0].path = "/data/input.txt";
+    files[0].size = 4096;
+    files[0].bread = 4096;
+    files[1].path = "output.txt";
+    files[1].size = 100;
+    files[1].bwrite = 100;
+    ResultMessage monitored(name, exitcode, runtime, launch, false, trace, usage, 1700000000.5,
+            files, 0.25);
+    ResultMessage monitored_output(msgcopy(monitored.msg, monitored.msgsize), monitored.msgsize, 0, 0);
+    if (monitored_output.start != 1700000000.5) {
+        myfailure("start does not match");
+    }
+    if (monitored_output.stall != 0.25) {
+        myfailure("stall does not match");
+    }
+    if (monitored_output.files.size() != 2) {
+        myfailure("wrong number of files");
+    }
+    for (unsigned i = 0; i < files.size(); i++) {
+        FileUsage &f = monitored_output.files[i];
+        if (f.path != files[i].path || f.size != files[i].size ||
+                f.bread != files[i].bread || f.bwrite != files[i].bwrite) {
+            myfailure("file %u does not match", i);
+        }
+    }
+    if (monitored_output.usage.maxrss != usage.maxrss) {
+        myfailure("usage does not match");
+    }
 }
 
 void test_shutdown() {
@@ -108,14 +205,48 @@ void test_registration() {
     if (input.sockets != output.sockets) {
         myfailure("sockets do not match");
     }
+    if (!output.cpu_cores.empty() || !output.cpu_sockets.empty()) {
+        myfailure("topology should be empty by default");
+    }
+    if (output.gpus != 0) {
+        myfailure("gpus should be 0 by default");
+    }
+    if (output.staging != 0) {
+        myfailure("staging should be 0 by default");
+    }
+
+    // Hyperthreads of core 0 are CPUs 0 and 2
+    vector<cpu_t> cpu_cores;
+    vector<cpu_t> cpu_sockets;
+    for (cpu_t i = 0; i < 4; i++) {
+        cpu_cores.push_back(i % 2);
+        cpu_sockets.push_back(0);
+    }
+    RegistrationMessage topo(hostname, memory, 4, 2, 1, cpu_cores, cpu_sockets, 3, 1024);
+    RegistrationMessage topocopy(msgcopy(topo.msg, topo.msgsize), topo.msgsize, 0);
+    if (topocopy.cpu_cores != cpu_cores || topocopy.cpu_sockets != cpu_sockets) {
+        myfailure("topology does not match");
+    }
+    if (topocopy.hostname != hostname || topocopy.threads != 4 || topocopy.gpus != 3 ||
+            topocopy.staging != 1024) {
+        myfailure("registration with topology does not match");
+    }
 }
 
 void test_hostrank() {
-    int hostrank = 17;
-    HostrankMessage input(hostrank);
+    vector<int> hostranks;
+    vector<int> masters;
+    hostranks.push_back(0);
+    hostranks.push_back(17);
+    masters.push_back(0);
+    masters.push_back(3);
+    HostrankMessage input(hostranks, masters);
     HostrankMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
-    if (input.hostrank != output.hostrank) {
-        myfailure("hostrank does not match");
+    if (output.hostranks != hostranks) {
+        myfailure("hostranks do not match");
+    }
+    if (output.masters != masters) {
+        myfailure("masters do not match");
     }
 }
 
@@ -127,10 +258,10 @@ void test_iodata() {
     IODataMessage input(task, filename, data.c_str(), size);
     IODataMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
 
-    if (input.task != output.task) {
+    if (strcmp(input.task, output.task)) {
         myfailure("task does not match");
     }
-    if (input.filename != output.filename) {
+    if (strcmp(input.filename, output.filename)) {
         myfailure("filename does not match");
     }
     if (input.size != output.size) {
@@ -139,6 +270,251 @@ void test_iodata() {
     if (strncmp(input.data, output.data, size)) {
         myfailure("data does not match");
     }
+    if (output.seq != 0 || !output.last || output.chunked() || output.provisional ||
+            output.aborted) {
+        myfailure("unchunked data does not match");
+    }
+
+    IODataMessage chunk(task, filename, data.c_str(), size, 3, false, true);
+    IODataMessage chunkout(msgcopy(chunk.msg, chunk.msgsize), chunk.msgsize, 0);
+    if (chunkout.seq != 3 || chunkout.last || !chunkout.chunked() || !chunkout.provisional) {
+        myfailure("chunk does not match");
+    }
+    if (chunkout.size != size || strncmp(chunkout.data, data.c_str(), size)) {
+        myfailure("chunk data does not match");
+    }
+    IODataMessage abort(task, filename, "", 0, 4, true, false, true);
+    IODataMessage abortout(msgcopy(abort.msg, abort.msgsize), abort.msgsize, 0);
+    if (abortout.seq != 4 || !abortout.last || abortout.provisional || !abortout.aborted ||
+            abortout.size != 0) {
+        myfailure("aborted chunk does not match");
+    }
+}
+
+void test_credit() {
+    CreditMessage input(7);
+    CreditMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
+    if (output.credits != 7) {
+        myfailure("credits do not match");
+    }
+}
+
+void test_ready() {
+    ReadyMessage input(256);
+    ReadyMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
+    if (output.status != 256) {
+        myfailure("status does not match");
+    }
+}
+
+void test_cancel() {
+    CancelMessage input("task");
+    CancelMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
+    if (output.name != "task") {
+        myfailure("name does not match");
+    }
+}
+
+void test_staging() {
+    vector<string> paths;
+    paths.push_back("a.txt");
+    paths.push_back("dir/b.txt");
+    vector<int> ranks;
+    ranks.push_back(3);
+    ranks.push_back(12);
+
+    StageMessage stage(paths, ranks);
+    StageMessage stageout(msgcopy(stage.msg, stage.msgsize), stage.msgsize, 0);
+    if (stageout.paths != paths || stageout.ranks != ranks) {
+        myfailure("stage does not match");
+    }
+
+    FetchMessage fetch("dir/b.txt");
+    FetchMessage fetchout(msgcopy(fetch.msg, fetch.msgsize), fetch.msgsize, 0);
+    if (fetchout.path != "dir/b.txt") {
+        myfailure("fetch does not match");
+    }
+
+    StagedMessage staged("dir/b.txt", true, "data", 4);
+    StagedMessage stagedout(msgcopy(staged.msg, staged.msgsize), staged.msgsize, 0);
+    if (strcmp(stagedout.path, "dir/b.txt") || !stagedout.found || 
+            stagedout.size != 4 || strncmp(stagedout.data, "data", 4)) {
+        myfailure("staged file does not match");
+    }
+
+    StagedMessage missing("a.txt", false, NULL, 0);
+    StagedMessage missingout(msgcopy(missing.msg, missing.msgsize), missing.msgsize, 0);
+    if (strcmp(missingout.path, "a.txt") || missingout.found || missingout.size != 0) {
+        myfailure("missing staged file does not match");
+    }
+
+    UnstageMessage unstage(paths);
+    UnstageMessage unstageout(msgcopy(unstage.msg, unstage.msgsize), unstage.msgsize, 0);
+    if (unstageout.paths != paths) {
+        myfailure("unstage does not match");
+    }
+}
+
+void test_direct() {
+    vector<string> filenames;
+    filenames.push_back("out.dat");
+    filenames.push_back("dir/log.txt");
+    vector<unsigned long long> sizes;
+    sizes.push_back(5000000000ULL);
+    sizes.push_back(12);
+
+    ReserveMessage reserve("task", filenames, sizes);
+    ReserveMessage reserveout(msgcopy(reserve.msg, reserve.msgsize), reserve.msgsize, 0);
+    if (reserveout.task != "task" || reserveout.filenames != filenames || 
+            reserveout.sizes != sizes) {
+        myfailure("reserve does not match");
+    }
+
+    vector<unsigned long long> offsets;
+    offsets.push_back(0);
+    offsets.push_back(6000000000ULL);
+    RegionMessage region(offsets);
+    RegionMessage regionout(msgcopy(region.msg, region.msgsize), region.msgsize, 0);
+    if (regionout.offsets != offsets) {
+        myfailure("region does not match");
+    }
+
+    CommitMessage commit("task", false);
+    CommitMessage commitout(msgcopy(commit.msg, commit.msgsize), commit.msgsize, 0);
+    if (commitout.task != "task" || commitout.ok) {
+        myfailure("commit does not match");
+    }
+}
+
+void test_files() {
+    vector<BroadcastFile> files(3);
+    files[0].type = 'd';
+    files[0].mode = 0755;
+    files[0].path = "app";
+    files[1].type = 'f';
+    files[1].mode = 0644;
+    files[1].offset = 5000000000ULL;
+    files[1].path = "app/lib.so";
+    files[1].data = "data";
+    files[1].size = 4;
+    files[2].type = 'l';
+    files[2].path = "app/lib.so.1";
+    files[2].data = "lib.so";
+    files[2].size = 6;
+
+    FilesMessage input(files, true);
+    FilesMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
+    if (!output.last || output.files.size() != 3) {
+        myfailure("files do not match");
+    }
+    for (unsigned i = 0; i < files.size(); i++) {
+        BroadcastFile &f = output.files[i];
+        if (f.type != files[i].type || f.mode != files[i].mode ||
+                f.offset != files[i].offset || f.path != files[i].path ||
+                f.size != files[i].size || memcmp(f.data, files[i].data, f.size)) {
+            myfailure("file %u does not match", i);
+        }
+    }
+
+    FilesMessage empty(vector<BroadcastFile>(), false);
+    FilesMessage emptyout(msgcopy(empty.msg, empty.msgsize), empty.msgsize, 0);
+    if (emptyout.last || emptyout.files.size() != 0) {
+        myfailure("empty files message does not match");
+    }
+}
+
+void test_batch() {
+    ResultMessage result("task", 1, 2.5);
+    IODataMessage iodata("task", "filename", "data", 4);
+
+    vector<Message *> messages;
+    messages.push_back(&iodata);
+    messages.push_back(&result);
+    vector<int> ranks;
+    ranks.push_back(5);
+    ranks.push_back(6);
+
+    BatchMessage input(messages, ranks);
+    BatchMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 1);
+
+    if (output.messages.size() != 2) {
+        myfailure("batch size does not match");
+    }
+
+    IODataMessage *iod = dynamic_cast<IODataMessage *>(output.messages[0]);
+    if (iod == NULL || iod->source != 5 || strcmp(iod->filename, "filename") ||
+            strncmp(iod->data, "data", 4)) {
+        myfailure("iodata in batch does not match");
+    }
+
+    ResultMessage *res = dynamic_cast<ResultMessage *>(output.messages[1]);
+    if (res == NULL || res->source != 6 || strcmp(res->name, "task") ||
+            res->exitcode != 1 || res->runtime != 2.5) {
+        myfailure("result in batch does not match");
+    }
+}
+
+void test_task_table() {
+    list<string> args;
+    args.push_back("/bin/true");
+    vector<cpu_t> nobindings;
+    CommandMessage a("A", args, "ida", 1, 1, nobindings, NULL, NULL);
+    args.push_back("arg");
+    CommandMessage b("B", args, "idb", 2, 4, nobindings, NULL, NULL, 0.0, 1);
+
+    vector<Message *> commands;
+    commands.push_back(&a);
+    commands.push_back(&b);
+
+    TaskTableMessage input(commands);
+    TaskTableMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
+    if (output.size() != 2) {
+        myfailure("task table size does not match");
+    }
+
+    CommandMessage *cmd = output.command(1);
+    if (cmd->name != "B" || cmd->id != "idb" || cmd->args.size() != 2 ||
+            cmd->memory != 2 || cmd->cpus != 4 || cmd->gpus != 1 || !cmd->gpu_bindings.empty()) {
+        myfailure("command in task table does not match");
+    }
+    delete cmd;
+
+    vector<cpu_t> bindings;
+    bindings.push_back(3);
+    vector<cpu_t> gpu_bindings;
+    gpu_bindings.push_back(2);
+    TaskMessage task(1, bindings, gpu_bindings);
+    TaskMessage task_output(msgcopy(task.msg, task.msgsize), task.msgsize, 0);
+    if (task_output.index != 1 || task_output.bindings.size() != 1 || 
+            task_output.bindings[0] != 3 || task_output.gpu_bindings != gpu_bindings) {
+        myfailure("task message does not match");
+    }
+}
+
+void test_buffer_pool() {
+    // A freed buffer is reused for a message of about the same size
+    char *a = alloc_buffer(100);
+    free_buffer(a, 100);
+    char *b = alloc_buffer(120);
+    if (a != b) {
+        myfailure("buffer was not reused");
+    }
+    free_buffer(b, 120);
+
+    // Messages return their buffers to the pool
+    ResultMessage *result = new ResultMessage("task", 0, 1.0);
+    char *buffer = result->msg;
+    unsigned size = result->msgsize;
+    delete result;
+    char *c = alloc_buffer(size);
+    if (c != buffer) {
+        myfailure("message buffer was not reused");
+    }
+    free_buffer(c, size);
+
+    // Large buffers are not pooled
+    char *d = alloc_buffer(MAX_POOLED_BUFFER + 1);
+    free_buffer(d, MAX_POOLED_BUFFER + 1);
 }
 
 int main(int argc, char *argv[]) {
@@ -150,6 +526,15 @@ int main(int argc, char *argv[]) {
         test_registration();
         test_hostrank();
         test_iodata();
+        test_credit();
+    test_ready();
+        test_cancel();
+        test_staging();
+        test_direct();
+        test_files();
+        test_batch();
+        test_task_table();
+        test_buffer_pool();
         return 0;
     } catch (exception &error) {
         log_error("ERROR: %s", error.what());
@@ -0,0 +1,214 @@
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "resourcelog.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+using std::exception;
+using std::string;
+using std::vector;
+
+#define LOGFILE "test/scratch.resource"
+#define CSVFILE "test/scratch.resource.csv"
+
+static vector<string> read_lines(const char *path) {
+    vector<string> lines;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        myfailures("Unable to open %s", path);
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lines.push_back(line);
+    }
+    fclose(f);
+    return lines;
+}
+
+static string host_of(const string &line) {
+    size_t end = line.rfind(',');
+    size_t start = line.rfind(',', end - 1) + 1;
+    return line.substr(start, end - start);
+}
+
+void test_csv() {
+    unlink(LOGFILE);
+
+    ResourceLog log(LOGFILE);
+    unsigned a = log.add_host("hosta");
+    unsigned b = log.add_host("hostb");
+    log.log(a, 1, 2, 3);
+    log.log(b, 4, 5, 6, PLACEMENT_SPREAD);
+    log.log(a, 7, 8, 9);
+    log.close();
+
+    vector<string> lines = read_lines(LOGFILE);
+    if (lines.size() != 3) {
+        myfailure("Expected 3 lines, got %lu", lines.size());
+    }
+    unsigned slots, cpus, memory;
+    char host[64];
+    char policy[64];
+    if (sscanf(lines[1].c_str(), "%*f,%u,%u,%u,%63[^,],%63s", &slots, &cpus, &memory,
+                host, policy) != 5) {
+        myfailure("Invalid line: %s", lines[1].c_str());
+    }
+    if (slots != 4 || cpus != 5 || memory != 6 || string(host) != "hostb" ||
+            string(policy) != "spread") {
+        myfailure("Wrong sample: %s", lines[1].c_str());
+    }
+    if (host_of(lines[0]) != "hosta" || lines[0][lines[0].length() - 2] != ',') {
+        myfailure("Sample without a policy should have an empty policy: %s", lines[0].c_str());
+    }
+
+    unlink(LOGFILE);
+}
+
+void test_ring_full() {
+    unlink(LOGFILE);
+
+    // The ring only holds 4 samples, so log() has to wait for the writer
+    ResourceLog log(LOGFILE, false, 0.0, 4);
+    unsigned a = log.add_host("hosta");
+    for (unsigned i = 0; i < 100; i++) {
+        log.log(a, i, 0, 0);
+    }
+    log.close();
+
+    vector<string> lines = read_lines(LOGFILE);
+    if (lines.size() != 100) {
+        myfailure("Expected 100 lines, got %lu", lines.size());
+    }
+    for (unsigned i = 0; i < lines.size(); i++) {
+        unsigned slots;
+        if (sscanf(lines[i].c_str(), "%*f,%u,", &slots) != 1 || slots != i) {
+            myfailure("Sample %u out of order: %s", i, lines[i].c_str());
+        }
+    }
+
+    unlink(LOGFILE);
+}
+
+void test_binary() {
+    unlink(LOGFILE);
+
+    // Two runs appended to the same log
+    for (int run = 0; run < 2; run++) {
+        ResourceLog log(LOGFILE, true);
+        unsigned a = log.add_host(run == 0 ? "hosta" : "hostc");
+        log.log(a, 1, 2, 3);
+        unsigned b = log.add_host("hostb");
+        log.log(b, 4, 5, 6);
+        log.close();
+    }
+
+    FILE *csv = fopen(CSVFILE, "w");
+    if (ResourceLog::convert(LOGFILE, csv) != 0) {
+        myfailure("Unable to convert binary log");
+    }
+    fclose(csv);
+
+    vector<string> lines = read_lines(CSVFILE);
+    if (lines.size() != 4) {
+        myfailure("Expected 4 lines, got %lu", lines.size());
+    }
+    if (host_of(lines[0]) != "hosta" || host_of(lines[1]) != "hostb" ||
+            host_of(lines[2]) != "hostc" || host_of(lines[3]) != "hostb") {
+        myfailure("Wrong host names in converted log");
+    }
+    unsigned slots, cpus, memory;
+    if (sscanf(lines[3].c_str(), "%*f,%u,%u,%u,", &slots, &cpus, &memory) != 3 ||
+            slots != 4 || cpus != 5 || memory != 6) {
+        myfailure("Wrong sample: %s", lines[3].c_str());
+    }
+
+    if (ResourceLog::convert("test/doesnotexist.resource", stdout) == 0) {
+        myfailure("Converting a missing log should fail");
+    }
+
+    unlink(LOGFILE);
+    unlink(CSVFILE);
+}
+
+void test_binary_v1() {
+    // Logs written before samples had a policy have shorter records
+    FILE *f = fopen(LOGFILE, "wb");
+    fwrite("PMCRLOG1", 8, 1, f);
+    double timestamp = 0.0;
+    uint32_t name[4] = {0x80000000u, 5, 0, 0};
+    fwrite(&timestamp, sizeof(timestamp), 1, f);
+    fwrite(name, sizeof(name), 1, f);
+    fwrite("hosta", 5, 1, f);
+    uint32_t sample[4] = {0, 1, 2, 3};
+    timestamp = 1.0;
+    fwrite(&timestamp, sizeof(timestamp), 1, f);
+    fwrite(sample, sizeof(sample), 1, f);
+    fclose(f);
+
+    FILE *csv = fopen(CSVFILE, "w");
+    if (ResourceLog::convert(LOGFILE, csv) != 0) {
+        myfailure("Unable to convert old binary log");
+    }
+    fclose(csv);
+
+    vector<string> lines = read_lines(CSVFILE);
+    unsigned slots, cpus, memory;
+    if (lines.size() != 1 || host_of(lines[0]) != "hosta" ||
+            sscanf(lines[0].c_str(), "%*f,%u,%u,%u,", &slots, &cpus, &memory) != 3 ||
+            slots != 1 || cpus != 2 || memory != 3) {
+        myfailure("Wrong sample in converted old log");
+    }
+
+    unlink(LOGFILE);
+    unlink(CSVFILE);
+}
+
+void test_interval() {
+    unlink(LOGFILE);
+
+    // Everything logged within one interval collapses to the last
+    // sample of each host
+    ResourceLog log(LOGFILE, false, 1.0e9);
+    unsigned a = log.add_host("hosta");
+    unsigned b = log.add_host("hostb");
+    for (unsigned i = 1; i <= 10; i++) {
+        log.log(a, i, 0, 0);
+        log.log(b, 0, i, 0);
+    }
+    log.close();
+
+    vector<string> lines = read_lines(LOGFILE);
+    if (lines.size() != 2) {
+        myfailure("Expected 2 lines, got %lu", lines.size());
+    }
+    unsigned slots, cpus;
+    if (sscanf(lines[0].c_str(), "%*f,%u,%u,", &slots, &cpus) != 2 ||
+            slots != 10 || cpus != 0) {
+        myfailure("Wrong sample for hosta: %s", lines[0].c_str());
+    }
+    if (sscanf(lines[1].c_str(), "%*f,%u,%u,", &slots, &cpus) != 2 ||
+            slots != 0 || cpus != 10) {
+        myfailure("Wrong sample for hostb: %s", lines[1].c_str());
+    }
+
+    unlink(LOGFILE);
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        log_set_level(LOG_ERROR);
+        test_csv();
+        test_ring_full();
+        test_binary();
+        test_binary_v1();
+        test_interval();
+        return 0;
+    } catch (exception &error) {
+        log_error("ERROR: %s", error.what());
+        return 1;
+    }
+}
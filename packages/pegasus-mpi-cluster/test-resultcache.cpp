@@ -0,0 +1,135 @@
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "resultcache.h"
+#include "dag.h"
+#include "failure.h"
+#include "log.h"
+
+using std::exception;
+using std::string;
+
+static string tempdir;
+
+static void create_file(const string &path, const string &data) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL) {
+        myfailures("Unable to create %s", path.c_str());
+    }
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+}
+
+static void test_cache() {
+    string input = tempdir + "/input";
+    string output = tempdir + "/output";
+    string dagfile = tempdir + "/cache.dag";
+    create_file(input, "foo");
+    create_file(dagfile,
+        "TASK A -i " + input + " -o " + output + " -F out=" + tempdir + "/out /bin/cat " + input + "\n"
+        "TASK B -i " + input + " /bin/cat " + input + "\n"
+        "TASK C -i " + tempdir + "/missing /bin/true\n"
+        "TASK D -I staged /bin/true\n");
+    DAG dag(dagfile, "", false);
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+
+    ResultCache cache(tempdir + "/cache");
+
+    string key_a, key_b, key;
+    if (!cache.key(a, key_a) || !cache.key(b, key_b)) {
+        myfailure("Tasks A and B should have keys");
+    }
+    if (key_a == key_b) {
+        myfailure("Tasks with different forwards should have different keys");
+    }
+    if (cache.key(dag.get_task("C"), key)) {
+        myfailure("Task C has a missing input, it should not have a key");
+    }
+    if (cache.key(dag.get_task("D"), key)) {
+        myfailure("Task D has intermediate files, it should not have a key");
+    }
+
+    vector<CachedOutput> outputs;
+    if (cache.lookup(b, key_b, outputs)) {
+        myfailure("The cache should be empty");
+    }
+
+    vector<CachedOutput> stored;
+    stored.push_back(CachedOutput("<stdout>", "foo\n"));
+    stored.push_back(CachedOutput(tempdir + "/out", string("bar\0baz\n", 8)));
+    cache.store(key_b, stored);
+    if (!cache.lookup(b, key_b, outputs)) {
+        myfailure("Task B should be in the cache");
+    }
+    if (outputs.size() != 2 || outputs[0].filename != "<stdout>" || outputs[0].data != "foo\n" ||
+            outputs[1].filename != tempdir + "/out" || outputs[1].data != stored[1].data) {
+        myfailure("Cached outputs are wrong");
+    }
+
+    // A task is not in the cache until its outputs exist
+    cache.store(key_a, vector<CachedOutput>());
+    if (cache.lookup(a, key_a, outputs)) {
+        myfailure("Task A should not be found without its output");
+    }
+    create_file(output, "");
+    if (!cache.lookup(a, key_a, outputs) || !outputs.empty()) {
+        myfailure("Task A should be in the cache");
+    }
+
+    // Changing an input changes the key
+    sleep(1);
+    create_file(input, "bar");
+    if (!cache.key(b, key) || key == key_b) {
+        myfailure("The key should change when an input changes");
+    }
+    if (cache.lookup(b, key, outputs)) {
+        myfailure("Task B should not be found after its input changed");
+    }
+
+    if (cache.hits != 2 || cache.misses != 3 || cache.stored != 2) {
+        myfailure("Wrong counts: %u hits, %u misses, %u stored",
+                cache.hits, cache.misses, cache.stored);
+    }
+}
+
+static void test_env() {
+    string dagfile = tempdir + "/env.dag";
+    create_file(dagfile, "TASK A /bin/true\n");
+    DAG dag(dagfile, "", false);
+    Task *a = dag.get_task("A");
+
+    vector<string> env(1, "PMC_CACHE_TEST");
+    ResultCache cache(tempdir + "/cache", env);
+
+    string unset, foo, bar;
+    unsetenv("PMC_CACHE_TEST");
+    cache.key(a, unset);
+    setenv("PMC_CACHE_TEST", "foo", 1);
+    cache.key(a, foo);
+    setenv("PMC_CACHE_TEST", "bar", 1);
+    cache.key(a, bar);
+    if (unset == foo || foo == bar || unset == bar) {
+        myfailure("Environment variables should be part of the key");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char dir[] = "/tmp/test-resultcache.XXXXXX";
+    try {
+        log_set_level(LOG_ERROR);
+        if (mkdtemp(dir) == NULL) {
+            myfailures("Unable to create temporary directory");
+        }
+        tempdir = dir;
+        test_cache();
+        test_env();
+        system(("rm -rf " + tempdir).c_str());
+        return 0;
+    } catch (exception &error) {
+        log_error("ERROR: %s", error.what());
+        return 1;
+    }
+}
@@ -1,5 +1,8 @@
 #include "failure.h"
 #include "master.h"
+#include "engine.h"
+#include "simcomm.h"
+#include "config.h"
 #include "dag.h"
 #include "log.h"
 
@@ -133,11 +136,636 @@ void test_scheduler_2222_4() {
     }
 }
 
+void test_scheduler_topology() {
+    // Hyperthreads are numbered the way Linux does it: CPU i and i+4
+    // share a core, and cores 0 and 1 are on the first socket
+    unsigned memory = 8192;
+    cpu_t threads = 8;
+    cpu_t cores = 4;
+    cpu_t sockets = 2;
+    vector<cpu_t> cpu_cores;
+    vector<cpu_t> cpu_sockets;
+    for (cpu_t i = 0; i < threads; i++) {
+        cpu_cores.push_back(i % 4);
+        cpu_sockets.push_back((i % 4) / 2);
+    }
+    Host h("localhost", memory, threads, cores, sockets, cpu_cores, cpu_sockets);
+
+    DAG dag("test/PM953.dag");
+    Task *two = dag.get_task("two");
+    Task *two2 = dag.get_task("two2");
+    Task *two3 = dag.get_task("two3");
+    Task *four = dag.get_task("four");
+
+    vector<cpu_t> rtwo = h.allocate_resources(two);
+    if (rtwo.size() != 2 || rtwo[0] != 0 || rtwo[1] != 4) {
+        myfailure("task two was not bound to one core");
+    }
+
+    // The socket with the fewest free CPUs is the best fit
+    vector<cpu_t> rtwo2 = h.allocate_resources(two2);
+    if (rtwo2.size() != 2 || rtwo2[0] != 1 || rtwo2[1] != 5) {
+        myfailure("task two2 was not bound to the best fit core");
+    }
+
+    h.release_resources(two);
+    if (h.bindings(two).size() != 0) {
+        myfailure("task two still has bindings");
+    }
+
+    vector<cpu_t> rtwo3 = h.allocate_resources(two3);
+    if (rtwo3.size() != 2 || rtwo3[0] != 0 || rtwo3[1] != 4) {
+        myfailure("task two3 was not bound to the released core");
+    }
+
+    vector<cpu_t> rfour = h.allocate_resources(four);
+    if (rfour.size() != 4 || rfour[0] != 2 || rfour[1] != 3 || rfour[2] != 6 || rfour[3] != 7) {
+        myfailure("task four was not bound to the free socket");
+    }
+}
+
+void test_scheduler_gpus() {
+    Host cpuhost("cpuhost", 1000, 4, 4, 1);
+    Host gpuhost("gpuhost", 1000, 4, 4, 1, vector<cpu_t>(), vector<cpu_t>(), 2);
+    Slot s1(1, &cpuhost);
+    Slot s2(2, &gpuhost);
+    Slot s3(3, &gpuhost);
+    cpuhost.add_idle_slot(&s1);
+    gpuhost.add_slot();
+    gpuhost.add_idle_slot(&s2);
+    gpuhost.add_idle_slot(&s3);
+
+    ResourceIndex index;
+    index.insert(&cpuhost);
+    index.insert(&gpuhost);
+
+    DAG dag("test/gpus.dag");
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+    Task *c = dag.get_task("C");
+
+    if (cpuhost.can_run(a) || !gpuhost.can_run(a) || !cpuhost.can_run(c)) {
+        myfailure("only the GPU host should be able to run task A");
+    }
+    if (index.find(a) != &gpuhost || index.find(b) != &gpuhost) {
+        myfailure("tasks that need GPUs should be matched to the GPU host");
+    }
+
+    index.remove(&gpuhost);
+    gpuhost.take_idle_slot();
+    gpuhost.allocate_resources(a);
+    index.insert(&gpuhost);
+
+    vector<cpu_t> ga = gpuhost.gpu_bindings(a);
+    if (ga.size() != 1 || ga[0] != 0 || gpuhost.free_gpus() != 1) {
+        myfailure("task A should have GPU 0");
+    }
+    if (gpuhost.can_run(b) || index.find(b) != NULL) {
+        myfailure("task B should not fit while task A has a GPU");
+    }
+    if (index.find(c) == NULL) {
+        myfailure("task C does not need a GPU");
+    }
+
+    index.remove(&gpuhost);
+    gpuhost.release_resources(a);
+    gpuhost.add_idle_slot(&s2);
+    index.insert(&gpuhost);
+    if (!gpuhost.gpu_bindings(a).empty() || gpuhost.free_gpus() != 2) {
+        myfailure("task A's GPU was not released");
+    }
+
+    gpuhost.allocate_resources(b);
+    vector<cpu_t> gb = gpuhost.gpu_bindings(b);
+    if (gb.size() != 2 || gb[0] != 0 || gb[1] != 1) {
+        myfailure("task B should have GPUs 0 and 1");
+    }
+
+    // Tasks that need GPUs are not in the same class as those that don't
+    ResourceClass ra(a);
+    ResourceClass rc(c);
+    if (!(ra < rc) && !(rc < ra)) {
+        myfailure("tasks A and C should be in different classes");
+    }
+}
+
+void test_resource_index() {
+    Host small("small", 50, 1, 1, 1);
+    Host large("large", 200, 2, 2, 1);
+    Slot s1(1, &small);
+    Slot s2(2, &large);
+    small.add_idle_slot(&s1);
+    large.add_idle_slot(&s2);
+
+    ResourceIndex index;
+    index.insert(&small);
+    index.insert(&large);
+
+    DAG dag("test/cpus.dag");
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+    Task *c = dag.get_task("C");
+
+    if (index.find(a) != &small) {
+        myfailure("task A should fit best on the small host");
+    }
+    if (index.find(b) != &large) {
+        myfailure("task B should only fit on the large host");
+    }
+    if (index.find(c) != &large) {
+        myfailure("task C should only fit on the large host");
+    }
+
+    // Once the large host is busy nothing with 2 cpus fits
+    index.remove(&large);
+    large.take_idle_slot();
+    large.allocate_resources(c);
+    index.insert(&large);
+    if (index.size() != 1) {
+        myfailure("busy host should not be indexed");
+    }
+    if (index.find(b) != NULL) {
+        myfailure("task B should not fit anywhere");
+    }
+
+    // Releasing the host makes it schedulable again
+    index.remove(&large);
+    large.release_resources(c);
+    large.add_idle_slot(&s2);
+    index.insert(&large);
+    if (index.find(b) != &large) {
+        myfailure("task B should fit on the released host");
+    }
+}
+
+void test_quarantine() {
+    Host small("small", 50, 1, 1, 1);
+    Host large("large", 200, 2, 2, 1);
+    Slot s1(1, &small);
+    Slot s2(2, &large);
+    small.add_idle_slot(&s1);
+    large.add_idle_slot(&s2);
+
+    if (small.record_failure() != 1 || small.record_failure() != 2) {
+        myfailure("failures in a row were not counted");
+    }
+    small.record_success();
+    if (small.record_failure() != 1 || small.failures() != 3 || small.successes() != 1) {
+        myfailure("a success should reset the failures in a row");
+    }
+
+    // Quarantined hosts are not indexed until the quarantine ends
+    small.quarantine(100.0);
+    ResourceIndex index;
+    index.insert(&small);
+    index.insert(&large);
+    DAG dag("test/cpus.dag");
+    Task *a = dag.get_task("A");
+    if (index.size() != 1 || index.find(a) != &large) {
+        myfailure("quarantined host should not be indexed");
+    }
+
+    index.remove(&large);
+    small.end_quarantine();
+    index.insert(&small);
+    index.insert(&large);
+    if (small.quarantined() || index.find(a) != &small) {
+        myfailure("host should be used again after the quarantine");
+    }
+    if (small.record_failure() != 1) {
+        myfailure("failures in a row should be reset after the quarantine");
+    }
+}
+
+void test_placement() {
+    Host small("small", 50, 1, 1, 1);
+    Host medium("medium", 100, 2, 2, 1);
+    Host large("large", 200, 4, 4, 1);
+    medium.set_index(0);
+    small.set_index(1);
+    large.set_index(2);
+    Slot s1(1, &small);
+    Slot s2(2, &medium);
+    Slot s3(3, &large);
+    Slot s4(4, &large);
+    small.add_idle_slot(&s1);
+    medium.add_idle_slot(&s2);
+    large.add_idle_slot(&s3);
+    large.add_idle_slot(&s4);
+
+    ResourceIndex index;
+    index.insert(&small);
+    index.insert(&medium);
+    index.insert(&large);
+
+    DAG dag("test/cpus.dag");
+    Task *a = dag.get_task("A");
+    Task *c = dag.get_task("C");
+
+    if (index.find(a, PLACEMENT_PACK) != &small) {
+        myfailure("pack should choose the host with the fewest free resources");
+    }
+    if (index.find(a, PLACEMENT_SPREAD) != &large) {
+        myfailure("spread should choose the host with the most free resources");
+    }
+    if (index.find(a, PLACEMENT_FIRST_FIT) != &medium) {
+        myfailure("first-fit should choose the first host");
+    }
+    if (index.find(c, PLACEMENT_FIRST_FIT) != &medium) {
+        myfailure("first-fit should choose the first host that fits");
+    }
+
+    // Half of the large host is busy, so the medium host has the largest
+    // fraction of free CPUs and more free memory than the small host
+    index.remove(&large);
+    large.take_idle_slot();
+    large.allocate_resources(c);
+    index.insert(&large);
+    if (index.find(a, PLACEMENT_LEAST_LOADED) != &medium) {
+        myfailure("least-loaded should choose the least loaded host");
+    }
+
+    // Spread puts the rest of a multicore task on the emptiest socket
+    vector<cpu_t> cpu_cores;
+    vector<cpu_t> cpu_sockets;
+    for (cpu_t i = 0; i < 8; i++) {
+        cpu_cores.push_back(i % 4);
+        cpu_sockets.push_back((i % 4) / 2);
+    }
+    Host h("localhost", 8192, 8, 4, 2, cpu_cores, cpu_sockets);
+    DAG pm953("test/PM953.dag");
+    h.allocate_resources(pm953.get_task("two"), PLACEMENT_PACK);
+    vector<cpu_t> rtwo2 = h.allocate_resources(pm953.get_task("two2"), PLACEMENT_SPREAD);
+    if (rtwo2.size() != 2 || rtwo2[0] != 2 || rtwo2[1] != 6) {
+        myfailure("task two2 was not bound to the emptiest socket");
+    }
+}
+
+void test_ready_queue_class() {
+    DAG dag("test/priority.dag");
+
+    ReadyQueue queue;
+    queue.push(dag.get_task("N"));
+    queue.push(dag.get_task("I"));
+    queue.push(dag.get_task("D"));
+    queue.push(dag.get_task("G"));
+
+    // Tasks batched with G come from the single-cpu class in priority order
+    if (queue.top() != dag.get_task("G")) {
+        myfailure("G should be the highest priority task");
+    }
+    queue.pop();
+    if (queue.pop_current() != dag.get_task("I")) {
+        myfailure("I should be the next task in G's class");
+    }
+    if (queue.pop_current() != dag.get_task("N")) {
+        myfailure("N should be the last task in G's class");
+    }
+    if (queue.pop_current() != NULL) {
+        myfailure("G's class should be empty");
+    }
+    if (queue.size() != 1 || queue.top() != dag.get_task("D")) {
+        myfailure("Only D should be left");
+    }
+}
+
+void test_ready_queue_heads() {
+    DAG dag("test/priority.dag");
+    Task *g = dag.get_task("G");
+    Task *d = dag.get_task("D");
+
+    ReadyQueue queue;
+    queue.push(dag.get_task("N"));
+    queue.push(dag.get_task("I"));
+    queue.push(d);
+    queue.push(g);
+
+    // first() still sees the head of a blocked class
+    if (queue.top() != g) {
+        myfailure("G should be the highest priority task");
+    }
+    queue.block();
+    if (queue.top() != d || queue.first() != g) {
+        myfailure("D should be the top task and G the first");
+    }
+    queue.pop();
+    if (queue.top() != NULL || queue.first() != g) {
+        myfailure("Only G's class should be left, blocked");
+    }
+
+    // Tasks pushed into a blocked class stay blocked, in priority order
+    queue.push(dag.get_task("E"));
+    if (queue.top() != NULL) {
+        myfailure("E should be blocked");
+    }
+    Host host("localhost", 100, 1, 1, 1);
+    queue.unblock(&host);
+    const char *order[] = { "G", "I", "E", "N" };
+    for (int i = 0; i < 4; i++) {
+        if (queue.top() != dag.get_task(order[i])) {
+            myfailure("Expected %s", order[i]);
+        }
+        queue.pop();
+    }
+    if (!queue.empty() || queue.first() != NULL) {
+        myfailure("The queue should be empty");
+    }
+}
+
+void test_ready_queue() {
+    DAG dag("test/priority.dag");
+    Task *n = dag.get_task("N");
+    Task *i = dag.get_task("I");
+    Task *d = dag.get_task("D");
+    Task *g = dag.get_task("G");
+
+    ReadyQueue queue;
+    queue.push(n);
+    queue.push(i);
+    queue.push(d);
+    queue.push(g);
+
+    if (queue.top() != g) {
+        myfailure("G should be the highest priority task");
+    }
+    queue.pop();
+    if (queue.top() != i) {
+        myfailure("I should be the next highest priority task");
+    }
+
+    // Blocking the single-cpu class leaves only D
+    queue.block();
+    if (queue.top() != d) {
+        myfailure("D should be the only unblocked task");
+    }
+    if (queue.blocked_size() != 2) {
+        myfailure("I and N should be blocked");
+    }
+    queue.block();
+    if (queue.top() != NULL) {
+        myfailure("All classes should be blocked");
+    }
+
+    // A host with one free cpu only unblocks the single-cpu class
+    Host host("localhost", 100, 1, 1, 1);
+    queue.unblock(&host);
+    if (queue.top() != i) {
+        myfailure("I should be unblocked");
+    }
+    queue.pop();
+    if (queue.top() != n) {
+        myfailure("N should be unblocked");
+    }
+    queue.pop();
+    if (queue.size() != 1 || queue.top() != NULL) {
+        myfailure("Only D should be left, and it should be blocked");
+    }
+}
+
+void test_ready_queue_aging() {
+    DAG dag("test/priority.dag");
+    Task *i = dag.get_task("I");
+    Task *d = dag.get_task("D");
+
+    ReadyQueue queue;
+    queue.set_aging(1.0, 5.0);
+    queue.set_time(0.0);
+    queue.push(d);
+    if (queue.top() != d) {
+        myfailure("D should be the only task");
+    }
+
+    // I has a higher priority than D until D has aged 2 intervals more
+    queue.set_time(1.5);
+    queue.push(i);
+    if (queue.top() != i) {
+        myfailure("I should go before D after 1.5 seconds");
+    }
+    queue.set_time(2.0);
+    if (queue.top() != d || queue.first() != d) {
+        myfailure("D should go before I after 2 seconds");
+    }
+    queue.set_time(2.5);
+    if (queue.top() != i) {
+        myfailure("I should catch up with D after 2.5 seconds");
+    }
+
+    // Once D starves it goes first even if I has aged more
+    queue.set_time(6.0);
+    if (queue.waiting_time(d) != 6.0 || !queue.starving(d) || queue.starving(i)) {
+        myfailure("D should be starving and I should not");
+    }
+    if (queue.top() != d) {
+        myfailure("D should go first once it starves");
+    }
+    queue.block();
+    if (queue.top() != i || queue.first() != d) {
+        myfailure("I should be the top task and D the first");
+    }
+
+    // Starting a task restarts the aging of its class
+    queue.pop();
+    queue.started(i);
+    queue.push(dag.get_task("E"));
+    if (queue.waiting_time(i) != 0.0) {
+        myfailure("The class of I should start waiting again");
+    }
+    Host host("localhost", 100, 2, 2, 1);
+    queue.unblock(&host);
+    queue.set_time(9.0);
+    if (queue.top() != d || queue.first() != d) {
+        myfailure("D should still be starving");
+    }
+}
+
+void test_simulated_master() {
+    DAG dag("test/critical.dag", "", false);
+    Engine engine(dag);
+    SimCommunicator comm(&dag, 2, 2, 2, 1024);
+    Master master(&comm, "test-scheduler", engine, dag, "test/critical.dag",
+            "/dev/null", "/dev/null");
+
+    if (master.run() != 0) {
+        myfailure("Simulated workflow failed");
+    }
+
+    // A, then B and C in parallel, then D. E runs at the start.
+    if (comm.virtual_time() != 11.0) {
+        myfailure("Simulated makespan should be 11, not %lf", comm.virtual_time());
+    }
+    if (comm.cycle_times().empty()) {
+        myfailure("Simulator should record the master's cycles");
+    }
+}
+
+void test_simulated_runtimes() {
+    DAG dag("test/critical.dag", "", false);
+    Engine engine(dag);
+    SimCommunicator comm(&dag, 2, 2, 2, 1024);
+    if (comm.read_runtimes("test/critical.log") != 2) {
+        myfailure("The runtimes of A and B should be read from the log");
+    }
+    Master master(&comm, "test-scheduler", engine, dag, "test/critical.dag",
+            "/dev/null", "/dev/null");
+
+    if (master.run() != 0) {
+        myfailure("Simulated workflow failed");
+    }
+
+    // A runs for 3 seconds, as in the jobstate log, and B for 2, as in
+    // its cluster-task record, so B and C finish at 5
+    if (comm.virtual_time() != 5.0) {
+        myfailure("Simulated makespan with runtimes from the log should be 5, not %lf",
+                comm.virtual_time());
+    }
+    if (comm.busy_slot_time() != 6.0) {
+        myfailure("Simulated tasks should use 6 slot seconds, not %lf",
+                comm.busy_slot_time());
+    }
+}
+
+void test_gang() {
+    DAG dag("test/gang.dag", "", false);
+    Engine engine(dag);
+    SimCommunicator comm(&dag, 2, 1, 1, 1024);
+    Master master(&comm, "test-scheduler", engine, dag, "test/gang.dag",
+            "/dev/null", "/dev/null");
+
+    if (master.run() != 0) {
+        myfailure("Simulated workflow failed");
+    }
+
+    // A and B start on the two hosts, G runs on both when A finishes
+    // at 4, and C runs after G
+    if (comm.virtual_time() != 7.0) {
+        myfailure("Simulated makespan with a gang task should be 7, not %lf",
+                comm.virtual_time());
+    }
+}
+
+double simulate_locality(double delay) {
+    DAG dag("test/locality.dag", "", false);
+    Engine engine(dag);
+    SimCommunicator comm(&dag, 2, 1, 1, 1024);
+    Master master(&comm, "test-scheduler", engine, dag, "test/locality.dag",
+            "/dev/null", "/dev/null");
+
+    config.locality_delay = delay;
+    int result = master.run();
+    config.locality_delay = 0;
+    if (result != 0) {
+        myfailure("Simulated workflow failed");
+    }
+    return comm.virtual_time();
+}
+
+void test_locality() {
+    // P and L start on the two hosts. When P finishes, M takes P's host
+    // and C, which reads P's output, can run on L's host at 1.5.
+    double makespan = simulate_locality(0);
+    if (makespan != 2.5) {
+        myfailure("Makespan without locality should be 2.5, not %lf", makespan);
+    }
+
+    // With a delay, C waits for P's host to finish M instead
+    makespan = simulate_locality(60);
+    if (makespan != 3.0) {
+        myfailure("Makespan with locality should be 3, not %lf", makespan);
+    }
+}
+
+double simulate_starvation(double aging, double starvation, bool backfill) {
+    DAG dag("test/starvation.dag", "", false);
+    Engine engine(dag);
+    SimCommunicator comm(&dag, 2, 2, 2, 1024);
+    comm.read_runtimes("test/starvation.log");
+
+    config.aging_interval = aging;
+    config.starvation_time = starvation;
+    config.backfill = backfill;
+    Master master(&comm, "test-scheduler", engine, dag, "test/starvation.dag",
+            "/dev/null", "/dev/null");
+    int result = master.run();
+    config.aging_interval = 0;
+    config.starvation_time = 0;
+    config.backfill = false;
+    if (result != 0) {
+        myfailure("Simulated workflow failed");
+    }
+    return comm.virtual_time();
+}
+
+void test_starvation() {
+    // B only gets the whole host when S6 finishes at 3.5, and X runs
+    // after it
+    double makespan = simulate_starvation(0, 0, false);
+    if (makespan != 6.5) {
+        myfailure("Makespan without aging should be 6.5, not %lf", makespan);
+    }
+
+    // After waiting 2 seconds, the host is drained for B, which runs
+    // when S4 finishes at 2.5
+    makespan = simulate_starvation(0, 2, false);
+    if (makespan != 5.5) {
+        myfailure("Makespan with a starvation time should be 5.5, not %lf", makespan);
+    }
+
+    // With aging, B becomes the highest priority task, so the backfill
+    // scheduler reserves the host for it
+    makespan = simulate_starvation(0.1, 0, true);
+    if (makespan != 5.5) {
+        myfailure("Makespan with aging should be 5.5, not %lf", makespan);
+    }
+}
+
+double simulate_category() {
+    DAG dag("test/category.dag", "", false);
+    Engine engine(dag);
+    SimCommunicator comm(&dag, 2, 2, 2, 1024);
+    Master master(&comm, "test-scheduler", engine, dag, "test/category.dag",
+            "/dev/null", "/dev/null");
+    if (master.run() != 0) {
+        myfailure("Simulated workflow failed");
+    }
+    return comm.virtual_time();
+}
+
+void test_category() {
+    // The loaders run one after the other, and A runs next to them
+    double makespan = simulate_category();
+    if (makespan != 3.0) {
+        myfailure("Makespan with MAXJOBS 1 should be 3.0, not %lf", makespan);
+    }
+
+    // --max-jobs overrides the DAG
+    config.max_jobs["load"] = 2;
+    makespan = simulate_category();
+    config.max_jobs.clear();
+    if (makespan != 2.0) {
+        myfailure("Makespan with --max-jobs 2 should be 2.0, not %lf", makespan);
+    }
+}
+
 int main(int argc, char **argv) {
     log_set_level(LOG_WARN);
     test_scheduler_124_8();
     test_scheduler_44_2();
     test_scheduler_2222_4();
+    test_scheduler_topology();
+    test_scheduler_gpus();
+    test_resource_index();
+    test_quarantine();
+    test_placement();
+    test_ready_queue();
+    test_ready_queue_heads();
+    test_ready_queue_class();
+    test_ready_queue_aging();
+    test_simulated_master();
+    test_simulated_runtimes();
+    test_gang();
+    test_locality();
+    test_starvation();
+    test_category();
     return 0;
 }
 
@@ -0,0 +1,129 @@
+#include <string>
+#include <string.h>
+#include <stdio.h>
+
+#include "shmcomm.h"
+#include "protocol.h"
+#include "failure.h"
+#include "log.h"
+
+using std::exception;
+using std::string;
+
+// Larger than an inbox, so it has to be written in pieces
+#define LARGE_SIZE (SHM_INBOX_SIZE * 3 + 17)
+
+static string pattern(unsigned size, int seed) {
+    string data(size, '\0');
+    for (unsigned i = 0; i < size; i++) {
+        data[i] = (char)((i * 31 + seed) & 0xff);
+    }
+    return data;
+}
+
+static void check_data(Message *mesg, const string &expected, int source) {
+    IODataMessage *data = dynamic_cast<IODataMessage *>(mesg);
+    if (data == NULL) {
+        myfailure("Expected an IODataMessage");
+    }
+    if (data->source != source) {
+        myfailure("Expected a message from %d, got %d", source, data->source);
+    }
+    if (data->size != expected.size() || memcmp(data->data, expected.data(), data->size) != 0) {
+        myfailure("Message data from %d is wrong", source);
+    }
+    delete mesg;
+}
+
+static void test_messages(ShmCommunicator &comm) {
+    int rank = comm.rank();
+    string small = pattern(100, rank);
+
+    if (rank == 0) {
+        // Every worker sends one small message
+        for (int r = 1; r < comm.size(); r++) {
+            Message *mesg = comm.recv_message();
+            IODataMessage *data = dynamic_cast<IODataMessage *>(mesg);
+            if (data == NULL) {
+                myfailure("Expected an IODataMessage");
+            }
+            check_data(mesg, pattern(100, data->source), data->source);
+        }
+        if (comm.message_waiting()) {
+            myfailure("Unexpected message waiting");
+        }
+        if (comm.recv_message(0.01) != NULL) {
+            myfailure("recv_message should time out");
+        }
+    } else {
+        IODataMessage mesg("task", "small", small.data(), small.size());
+        comm.send_message(&mesg, 0);
+    }
+
+    comm.barrier();
+
+    // The master and worker 1 send large messages to each other at the
+    // same time, which only works if the senders keep reading
+    if (rank == 0 || rank == 1) {
+        int peer = 1 - rank;
+        string large = pattern(LARGE_SIZE, rank);
+        comm.send_message_async(new IODataMessage("task", "large", large.data(), large.size()), peer);
+        check_data(comm.recv_message(), pattern(LARGE_SIZE, peer), peer);
+    }
+
+    comm.barrier();
+}
+
+static void test_broadcast(ShmCommunicator &comm) {
+    string data = pattern(LARGE_SIZE, 42);
+    if (comm.rank() == 0) {
+        IODataMessage mesg("task", "broadcast", data.data(), data.size());
+        if (comm.broadcast_message(&mesg, 0) != NULL) {
+            myfailure("Root should not get a broadcast back");
+        }
+    } else {
+        check_data(comm.broadcast_message(NULL, 0), data, 0);
+    }
+    comm.barrier();
+}
+
+static void test_gather(ShmCommunicator &comm) {
+    string data = pattern(100 * comm.rank(), comm.rank());
+    if (comm.rank() == 0) {
+        vector<Message *> messages = comm.gather_messages(NULL, 0);
+        if (messages.size() != (unsigned)comm.size() || messages[0] != NULL) {
+            myfailure("Gathered the wrong number of messages");
+        }
+        for (int r = 1; r < comm.size(); r++) {
+            check_data(messages[r], pattern(100 * r, r), r);
+        }
+    } else {
+        IODataMessage mesg("task", "gather", data.data(), data.size());
+        if (!comm.gather_messages(&mesg, 0).empty()) {
+            myfailure("Only the root should get the gathered messages");
+        }
+    }
+    comm.barrier();
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        log_set_level(LOG_ERROR);
+        ShmCommunicator comm(3);
+        try {
+            test_messages(comm);
+            test_broadcast(comm);
+            test_gather(comm);
+            if (comm.rank() == 0 && comm.sent() == 0) {
+                myfailure("Bytes sent were not counted");
+            }
+        } catch (exception &error) {
+            log_error("ERROR: Rank %d: %s", comm.rank(), error.what());
+            comm.abort(1);
+        }
+        return 0;
+    } catch (exception &error) {
+        log_error("ERROR: %s", error.what());
+        return 1;
+    }
+}
@@ -0,0 +1,85 @@
+#include <string>
+#include <stdio.h>
+
+#include "threadcomm.h"
+#include "shmcomm.h"
+#include "protocol.h"
+#include "failure.h"
+#include "log.h"
+
+using std::exception;
+using std::string;
+
+// More than fit in the queue, so the receiver has to wait for the consumer
+#define MESSAGES (RECV_QUEUE_SIZE + 100)
+
+static void worker(Communicator &comm) {
+    for (unsigned i = 0; i < MESSAGES; i++) {
+        CreditMessage mesg(i);
+        comm.send_message(&mesg, 0);
+    }
+
+    // Wait for the master to answer through the threaded communicator
+    Message *reply = comm.recv_message();
+    if (dynamic_cast<ShutdownMessage *>(reply) == NULL) {
+        myfailure("Expected a shutdown message");
+    }
+    delete reply;
+}
+
+static void master(Communicator &comm) {
+    ThreadedCommunicator threaded(&comm);
+    threaded.start();
+
+    // Messages from each worker arrive in the order they were sent
+    unsigned next[3] = {0, 0, 0};
+    for (unsigned i = 0; i < 2 * MESSAGES; i++) {
+        Message *mesg = threaded.recv_message();
+        CreditMessage *credit = dynamic_cast<CreditMessage *>(mesg);
+        if (credit == NULL) {
+            myfailure("Expected a credit message");
+        }
+        if (credit->credits != next[credit->source]) {
+            myfailure("Message %u from %d arrived out of order", credit->credits, credit->source);
+        }
+        next[credit->source]++;
+        delete mesg;
+    }
+
+    if (threaded.message_waiting()) {
+        myfailure("Unexpected message waiting");
+    }
+    if (threaded.recv_message(0.01) != NULL) {
+        myfailure("recv_message should time out");
+    }
+
+    for (int r = 1; r < comm.size(); r++) {
+        ShutdownMessage mesg;
+        threaded.send_message(&mesg, r);
+    }
+    threaded.stop();
+    if (threaded.recvd() != comm.recvd()) {
+        myfailure("Received bytes were not counted");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        log_set_level(LOG_ERROR);
+        ShmCommunicator comm(3);
+        try {
+            if (comm.rank() == 0) {
+                master(comm);
+            } else {
+                worker(comm);
+            }
+        } catch (exception &error) {
+            log_error("ERROR: Rank %d: %s", comm.rank(), error.what());
+            comm.abort(1);
+        }
+        return 0;
+    } catch (exception &error) {
+        log_error("ERROR: %s", error.what());
+        return 1;
+    }
+}
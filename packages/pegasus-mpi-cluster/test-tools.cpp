@@ -1,11 +1,15 @@
 #include <string>
+#include <vector>
 #include <unistd.h>
 #include <sys/param.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <assert.h>
 
 #include "tools.h"
 
 using std::string;
+using std::vector;
 
 void test_is_executable() {
     assert(is_executable("./test-tools"));
@@ -41,6 +45,80 @@ void test_mkdirs() {
     chdir("../..");
 }
 
+void test_merge_files() {
+    assert(mkdirs("test/scratch") >= 0);
+
+    // Files of different sizes, and one that does not exist
+    vector<string> srcfiles;
+    string expected = "head";
+    char name[64];
+    for (int i = 0; i < 10; i++) {
+        sprintf(name, "test/scratch/merge.%d", i);
+        srcfiles.push_back(name);
+        if (i == 5) {
+            continue;
+        }
+        string data(i * 1000, 'a' + i);
+        FILE *f = fopen(name, "w");
+        fwrite(data.data(), 1, data.size(), f);
+        fclose(f);
+        expected += data;
+    }
+    expected += "tail";
+
+    for (unsigned nthreads = 1; nthreads <= 4; nthreads += 3) {
+        int fd = open("test/scratch/merged", O_RDWR|O_CREAT|O_TRUNC, 0644);
+        assert(fd >= 0);
+        assert(write(fd, "head", 4) == 4);
+        assert(merge_files(fd, srcfiles, nthreads) == 0);
+        assert(write(fd, "tail", 4) == 4);
+        close(fd);
+
+        char buf[64000];
+        assert(read_file("test/scratch/merged", buf, sizeof(buf)) == (int)expected.size());
+        assert(string(buf, expected.size()) == expected);
+    }
+}
+
+void test_write_file() {
+    mkdirs("test/scratch");
+    close(open("test/scratch/written", O_WRONLY|O_CREAT|O_TRUNC, 0644));
+    assert(write_file("test/scratch/written", "max\n") == 4);
+    char buf[16];
+    assert(read_file("test/scratch/written", buf, sizeof(buf)) == 4);
+    assert(string(buf, 4) == "max\n");
+
+    // The file has to exist already
+    assert(write_file("test/scratch/missing/written", "max\n") < 0);
+}
+
+void test_histogram() {
+    Histogram h;
+    assert(h.bounds.size() == 7);
+    h.observe(0.000001);
+    h.observe(0.00001);
+    h.observe(0.5);
+    h.observe(100);
+    assert(h.count == 4);
+    assert(h.counts[0] == 2);
+    assert(h.counts[5] == 1);
+    assert(h.counts[7] == 1);
+}
+
+void test_parse_cpu_list() {
+    vector<cpu_t> cpus;
+    assert(parse_cpu_list("0-3,8,10-11\n", cpus));
+    assert(cpus.size() == 7);
+    assert(cpus[0] == 0 && cpus[3] == 3 && cpus[4] == 8 && cpus[6] == 11);
+    assert(parse_cpu_list("", cpus));
+    assert(cpus.empty());
+    assert(!parse_cpu_list("3-1", cpus));
+    assert(!parse_cpu_list("0,x", cpus));
+
+    // Tasks that are not bound have no NUMA node
+    assert(get_numa_node(vector<cpu_t>()) == -1);
+}
+
 int main(int argc, char *argv[]) {
     get_host_memory();
     get_host_cpuinfo();
@@ -49,4 +127,8 @@ int main(int argc, char *argv[]) {
     test_mkdirs();
     test_is_executable();
     test_pathfind();
+    test_merge_files();
+    test_write_file();
+    test_histogram();
+    test_parse_cpu_list();
 }
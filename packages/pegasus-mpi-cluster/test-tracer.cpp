@@ -0,0 +1,70 @@
+#include <string>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "tracer.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+using std::exception;
+using std::string;
+
+#define TRACEFILE "test/scratch.trace"
+
+static string read_trace() {
+    char buf[4096];
+    int size = read_file(TRACEFILE, buf, sizeof(buf) - 1);
+    if (size < 0) {
+        myfailures("Unable to read %s", TRACEFILE);
+    }
+    return string(buf, size);
+}
+
+void test_empty() {
+    Tracer tracer(TRACEFILE);
+    tracer.close();
+    if (read_trace() != "[\n\n]\n") {
+        myfailure("Empty trace is wrong: %s", read_trace().c_str());
+    }
+    unlink(TRACEFILE);
+}
+
+void test_events() {
+    Tracer tracer(TRACEFILE);
+    tracer.process_name(1, "worker 1");
+    tracer.span("task \"A\"", "task", 1, 2, 10.0, 10.5);
+    tracer.async_span("B", "queue", 7, 11.0, 12.0);
+    // Spans without a start time or that end before they start are skipped
+    tracer.span("C", "task", 1, 0, 0.0, 1.0);
+    tracer.span("D", "task", 1, 0, 2.0, 1.0);
+    tracer.close();
+
+    string expected =
+        "[\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"worker 1\"}},\n"
+        "{\"name\":\"task \\\"A\\\"\",\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,\"tid\":2,"
+            "\"ts\":10000000,\"dur\":500000},\n"
+        "{\"name\":\"B\",\"cat\":\"queue\",\"ph\":\"b\",\"pid\":0,\"tid\":0,"
+            "\"ts\":11000000,\"id\":7},\n"
+        "{\"name\":\"B\",\"cat\":\"queue\",\"ph\":\"e\",\"pid\":0,\"tid\":0,"
+            "\"ts\":12000000,\"id\":7}\n"
+        "]\n";
+    string trace = read_trace();
+    if (trace != expected) {
+        myfailure("Trace is wrong: %s", trace.c_str());
+    }
+    unlink(TRACEFILE);
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        log_set_level(LOG_ERROR);
+        test_empty();
+        test_events();
+        return 0;
+    } catch (exception &error) {
+        log_error("ERROR: %s", error.what());
+        return 1;
+    }
+}
@@ -0,0 +1,166 @@
+#!/bin/bash
+#
+# End-to-end throughput benchmark. Runs pegasus-mpi-cluster on a generated
+# DAG of independent pegasus-keg tasks and reports the task throughput, the
+# master's CPU time, the dispatch latency from the --trace timeline, and
+# the time taken to merge the task stdio at the end of the run.
+#
+# Any arguments after -- are passed to pegasus-mpi-cluster.
+#
+set -e
+
+export RDMAV_FORK_SAFE=1
+
+PMC=./pegasus-mpi-cluster
+KEG=../pegasus-keg/pegasus-keg
+
+TASKS=1000
+RANKS=4
+DURATION=0
+SIZE=0
+IO=stdio
+CPUS=1
+MEMORY=0
+KEEP=0
+WORKDIR=
+TEMPDIR=0
+
+function usage {
+    cat <<END
+Usage: test/bench.sh [options] [-- PMC options]
+
+Options:
+  -n N       Number of tasks [$TASKS]
+  -N N       Number of MPI ranks, including the master [$RANKS]
+  -t T       Seconds of CPU time each task spins for (keg -T) [$DURATION]
+  -s SIZE    Output of each task, e.g. 100K or 1M [$SIZE]
+  -i MODE    Where the output goes: stdio, file (-F) or pipe (-f) [$IO]
+  -c LIST    Comma-separated cpus of the tasks, used in turn [$CPUS]
+  -m LIST    Comma-separated memory of the tasks in MB, used in turn [$MEMORY]
+  -k PATH    Path to pegasus-keg [$KEG]
+  -d DIR     Directory for the DAG and its outputs [temporary]
+  -K         Keep the temporary directory
+END
+}
+
+while getopts "n:N:t:s:i:c:m:k:d:Kh" opt; do
+    case $opt in
+        n) TASKS=$OPTARG ;;
+        N) RANKS=$OPTARG ;;
+        t) DURATION=$OPTARG ;;
+        s) SIZE=$OPTARG ;;
+        i) IO=$OPTARG ;;
+        c) CPUS=$OPTARG ;;
+        m) MEMORY=$OPTARG ;;
+        k) KEG=$OPTARG ;;
+        d) WORKDIR=$OPTARG ;;
+        K) KEEP=1 ;;
+        *) usage; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ "$1" == "--" ]; then
+    shift
+fi
+
+case $IO in
+    stdio|file|pipe) ;;
+    *) echo "Invalid I/O mode: $IO"; usage; exit 1 ;;
+esac
+
+if ! [ -x "$KEG" ]; then
+    KEG=$(which pegasus-keg 2>/dev/null || true)
+    if [ -z "$KEG" ]; then
+        echo "pegasus-keg not found: build it in ../pegasus-keg or use -k"
+        exit 1
+    fi
+fi
+KEG=$(cd $(dirname $KEG) && pwd)/$(basename $KEG)
+
+if [ -z "$WORKDIR" ]; then
+    WORKDIR=$(mktemp -d /tmp/pmc-bench.XXXXXX)
+    TEMPDIR=1
+else
+    mkdir -p $WORKDIR
+fi
+DAG=$WORKDIR/bench.dag
+mkdir -p $WORKDIR/scratch
+
+IFS=, read -a CPULIST <<< "$CPUS"
+IFS=, read -a MEMLIST <<< "$MEMORY"
+
+# Forwarded outputs go to a few shared files so that the master's file
+# descriptor cache is exercised
+FORWARD_FILES=16
+
+rm -f $DAG
+for ((i = 0; i < TASKS; i++)); do
+    cpus=${CPULIST[$((i % ${#CPULIST[@]}))]}
+    memory=${MEMLIST[$((i % ${#MEMLIST[@]}))]}
+
+    opts="-c $cpus -m $memory"
+    keg="$KEG -a t$i"
+    if [ "$DURATION" != "0" ]; then
+        keg="$keg -T $DURATION"
+    fi
+    if [ "$memory" != "0" ]; then
+        keg="$keg -m $memory"
+    fi
+
+    case $IO in
+        stdio)
+            if [ "$SIZE" != "0" ]; then
+                keg="$keg -o /dev/stdout=$SIZE"
+            fi
+            ;;
+        file)
+            keg="$keg -o $WORKDIR/scratch/t$i=$SIZE"
+            opts="$opts -F $WORKDIR/scratch/t$i=$WORKDIR/forward.$((i % FORWARD_FILES))"
+            ;;
+        pipe)
+            opts="$opts -f OUT=$WORKDIR/pipe.$((i % FORWARD_FILES))"
+            keg="/bin/sh -c 'exec $keg -o /dev/fd/\$OUT=$SIZE'"
+            ;;
+    esac
+
+    echo "TASK t$i $opts $keg"
+done > $DAG
+
+echo "Running $TASKS tasks on $RANKS ranks in $WORKDIR"
+
+LOG=$WORKDIR/bench.log
+TRACE=$WORKDIR/bench.trace
+START=$(date +%s.%N)
+if ! mpiexec -np $RANKS $PMC --rank-stdio --trace $TRACE \
+        -o $WORKDIR/bench.out -e $WORKDIR/bench.err "$@" $DAG > $LOG 2>&1; then
+    tail -20 $LOG
+    echo "ERROR: pegasus-mpi-cluster failed, see $LOG"
+    exit 1
+fi
+END=$(date +%s.%N)
+
+function logged {
+    sed -n "s/.*$1 \([0-9.]*\).*/\1/p" $LOG | tail -1
+}
+
+# Dispatch is the time from the master sending a task to the worker
+# receiving it. The trace records durations in microseconds.
+grep -o '"cat":"dispatch"[^}]*"dur":[0-9]*' $TRACE | sed 's/.*"dur"://' | \
+    sort -n > $WORKDIR/dispatch.txt
+
+echo "Total time:        $(awk "BEGIN { print $END - $START }") seconds (including MPI startup)"
+echo "Makespan:          $(logged 'Makespan:') seconds"
+echo "Throughput:        $(logged 'Throughput:') tasks/second"
+echo "Master CPU time:   $(logged 'Master CPU time:') seconds"
+echo "Stdio merge time:  $(logged 'Merged task stdio in') seconds"
+awk '{ d[NR] = $1 / 1000.0 }
+    END {
+        if (NR == 0) { print "Dispatch latency:  no dispatch events"; exit }
+        printf "Dispatch latency:  p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            d[int(0.50 * (NR - 1)) + 1], d[int(0.90 * (NR - 1)) + 1],
+            d[int(0.99 * (NR - 1)) + 1], d[NR]
+    }' $WORKDIR/dispatch.txt
+
+if [ $TEMPDIR -eq 1 ] && [ $KEEP -eq 0 ]; then
+    rm -rf $WORKDIR
+fi
@@ -0,0 +1,5 @@
+#!/bin/bash
+
+# Ignore SIGTERM so that the task has to be killed with SIGKILL
+trap "" TERM
+sleep 60
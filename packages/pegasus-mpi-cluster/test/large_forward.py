@@ -0,0 +1,15 @@
+#!/usr/bin/env python3
+
+import os
+import sys
+
+# Write about 6 MB of lines to the file so that it is forwarded in chunks
+fname = sys.argv[1]
+name = sys.argv[2]
+dname = os.path.dirname(fname)
+if not os.path.isdir(dname):
+    os.makedirs(dname)
+f = open(fname, "w")
+for i in range(600000):
+    f.write("%s %08d\n" % (name, i))
+f.close()
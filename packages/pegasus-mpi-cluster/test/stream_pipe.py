@@ -0,0 +1,14 @@
+#!/usr/bin/env python3
+
+import os
+import sys
+
+# Write about 3 MB to the pipe so that it is streamed in chunks, and
+# then exit with the given status
+var = sys.argv[1]
+status = int(sys.argv[2])
+fd = int(os.getenv(var))
+for i in range(300000):
+    os.write(fd, bytes("%s %08d\n" % (var, i), 'utf-8'))
+os.close(fd)
+sys.exit(status)
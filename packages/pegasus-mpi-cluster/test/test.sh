@@ -45,6 +45,28 @@ function test_help_no_mpi {
     fi
 }
 
+# Without mpiexec the master should fork the workers itself
+function test_no_mpi {
+    output=$($PMC --workers 2 -s test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$output"
+        return 1
+    fi
+
+    n=$(echo "$output" | grep "status=0" | wc -l)
+    if [ $n -ne 4 ]; then
+        echo "$output"
+        return 1
+    fi
+
+    if ! [[ "$output" =~ "Master starting with 2 workers" ]]; then
+        echo "$output"
+        return 1
+    fi
+}
+
 # Make sure it requires at least one worker
 function test_one_worker_required {
     result=$(mpiexec -np 1 $PMC test/diamond.dag 2>&1)
@@ -258,6 +280,80 @@ function test_strict_limits_failure {
     fi
 }
 
+# Tasks should start as many threads as they have CPUs, unless they ask
+# for a different number with --threads
+function test_thread_env {
+    mkdir -p test/scratch
+
+    OUTPUT=$(mpiexec -np 2 $PMC -s -o test/scratch/stdout --host-cpus 2 test/threads.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Thread environment test failed"
+        return 1
+    fi
+
+    if ! grep -q "^A=2,2,2$" test/scratch/stdout || ! grep -q "^B=3,3,3$" test/scratch/stdout; then
+        cat test/scratch/stdout
+        echo "ERROR: Tasks did not get the right thread environment"
+        return 1
+    fi
+
+    # Variables set for the workflow are kept, except with --threads
+    OUTPUT=$(OMP_NUM_THREADS=1 mpiexec -np 2 -x OMP_NUM_THREADS $PMC -s -o test/scratch/stdout --host-cpus 2 test/threads.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ] || ! grep -q "^A=1,2,2$" test/scratch/stdout ||
+            ! grep -q "^B=3,3,3$" test/scratch/stdout; then
+        echo "$OUTPUT"
+        cat test/scratch/stdout
+        echo "ERROR: Task did not keep OMP_NUM_THREADS of the workflow"
+        return 1
+    fi
+
+    OUTPUT=$(mpiexec -np 2 $PMC -s -o test/scratch/stdout --host-cpus 2 --no-thread-env test/threads.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ] || ! grep -q "^A=,,$" test/scratch/stdout; then
+        echo "$OUTPUT"
+        cat test/scratch/stdout
+        echo "ERROR: --no-thread-env did not leave the environment alone"
+        return 1
+    fi
+}
+
+# Tasks that request GPUs should only see the GPUs allocated to them
+function test_gpus {
+    mkdir -p test/scratch
+
+    OUTPUT=$(CUDA_VISIBLE_DEVICES=3,5 mpiexec -np 2 -x CUDA_VISIBLE_DEVICES $PMC -o test/scratch/stdout test/gpus.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: GPU test failed"
+        return 1
+    fi
+
+    if ! grep -q "^A=3$" test/scratch/stdout || ! grep -q "^B=3,5$" test/scratch/stdout ||
+            ! grep -q "^C=0:$" test/scratch/stdout; then
+        cat test/scratch/stdout
+        echo "ERROR: Tasks did not get the right GPUs"
+        return 1
+    fi
+
+    # Task B needs 2 GPUs
+    OUTPUT=$(CUDA_VISIBLE_DEVICES=3 mpiexec -np 2 -x CUDA_VISIBLE_DEVICES $PMC -o /dev/null test/gpus.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ] || ! [[ "$OUTPUT" =~ "FATAL ERROR: No host is capable of running task B" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Task B should not run without enough GPUs"
+        return 1
+    fi
+}
+
 # Test to make sure cpus are scheduled properly
 function test_cpus_limit {
     OUTPUT=$(mpiexec -np 2 $PMC -s test/cpus.dag -o /dev/null -e /dev/null --host-memory 100 --host-cpus 2 2>&1)
@@ -278,221 +374,1305 @@ function test_insufficient_cpus {
     # This test should fail because 1 CPU isn't enough to run the tasks in the DAG
     if [ $RC -eq 0 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Insufficient CPUs test failed (1)"
+        echo "ERROR: Insufficient CPUs test failed (1)"
+        return 1
+    fi
+    
+    if ! [[ "$OUTPUT" =~ "FATAL ERROR: No host is capable of running task" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Insufficient CPUs test failed (2)"
+        return 1
+    fi
+}
+
+# Make sure a failure occurs if there are not enough hosts for a task
+function test_insufficient_hosts {
+    OUTPUT=$(mpiexec -np 3 $PMC -s test/gang.dag -o /dev/null -e /dev/null 2>&1)
+    RC=$?
+
+    # This test should fail because all the workers are on one host
+    if [ $RC -eq 0 ] || ! [[ "$OUTPUT" =~ "FATAL ERROR: Task G needs 2 hosts, but only 1 can run it" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Task G should not run without enough hosts"
+        return 1
+    fi
+}
+
+# Make sure retries work
+function test_tries {
+    OUTPUT=$(mpiexec -np 2 $PMC -s test/tries.dag -o /dev/null -e /dev/null -t 3 2>&1)
+    RC=$?
+    
+    # This test should fail because task B will fail twice
+    if [ $RC -eq 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Tries test failed"
+        return 1
+    fi
+    
+    if [ $(echo "$OUTPUT" | grep "Task B failed" | wc -l) -ne 5 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Tries test failed"
+        return 1
+    fi
+    
+    if [ $(echo "$OUTPUT" | grep "Task C failed" | wc -l) -ne 3 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Tries test failed"
+        return 1
+    fi
+}
+
+# Make sure that task priorities are honored
+function test_priority {
+    OUTPUT=$(mpiexec -np 2 $PMC -v -v -s test/priority.dag -o /dev/null -e /dev/null --host-cpus 2 2>&1)
+    RC=$?
+    
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Priority test failed"
+        return 1
+    fi
+    
+    DESIRED="[trace] Scheduling task G
+[trace] Scheduling task I
+[trace] Scheduling task D
+[trace] Scheduling task E
+[trace] Scheduling task O
+[trace] Scheduling task N"
+    
+    ACTUAL=$(echo "$OUTPUT" | grep "Scheduling task ")
+    
+    if [ "$ACTUAL" != "$DESIRED" ]; then
+        echo "$OUTPUT"
+        echo "Actual: $ACTUAL"
+        echo "Desired: $DESIRED"
+        echo "ERROR: Priority test failed"
+        return 1
+    fi
+}
+
+# Make sure that tasks on the critical path go first with --priority-mode critical-path
+function test_critical_path {
+    OUTPUT=$(mpiexec -np 2 $PMC -v -s --priority-mode critical-path test/critical.dag -o /dev/null -e /dev/null 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Critical path test failed"
+        return 1
+    fi
+
+    # B is on the critical path, so it should run before C even
+    # though C has a higher user priority
+    ACTUAL=$(echo "$OUTPUT" | grep "Submitting task" | head -n 3 | awk '{print $4}' | tr -d '\n')
+    if [ "$ACTUAL" != "ABC" ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Critical path test submitted tasks in the wrong order: $ACTUAL"
+        return 1
+    fi
+}
+
+# Make sure that --backfill starts short tasks while a larger one waits for CPUs
+function test_backfill {
+    OUTPUT=$(mpiexec -np 4 $PMC -v -s --backfill --host-cpus 2 test/backfill.dag -o /dev/null -e /dev/null 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Backfill test failed"
+        return 1
+    fi
+
+    # B is short enough to run before C, D and E have to wait for C
+    ACTUAL=$(echo "$OUTPUT" | grep "Submitting task" | head -n 3 | awk '{print $4}' | tr -d '\n')
+    if [ "$ACTUAL" != "ABC" ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Backfill test submitted tasks in the wrong order: $ACTUAL"
+        return 1
+    fi
+}
+
+function test_submasters {
+    OUTPUT=$(mpiexec -np 4 $PMC -v -s --sub-masters test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Sub-master test failed"
+        return 1
+    fi
+
+    n=$(echo "$OUTPUT" | grep "status=0" | wc -l)
+    if [ $n -ne 4 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Sub-master test did not run all tasks"
+        return 1
+    fi
+
+    # Worker 1 relays for the host, so it should not run any tasks
+    if echo "$OUTPUT" | grep "slot=1," >/dev/null; then
+        echo "$OUTPUT"
+        echo "ERROR: Sub-master ran a task"
+        return 1
+    fi
+}
+
+function test_batch_size {
+    for flags in "" "--sub-masters"; do
+        OUTPUT=$(mpiexec -np 4 $PMC -v -v -s --batch-size 4 $flags test/batch.dag 2>&1)
+        RC=$?
+
+        if [ $RC -ne 0 ]; then
+            echo "$OUTPUT"
+            echo "ERROR: Batch test failed"
+            return 1
+        fi
+
+        n=$(echo "$OUTPUT" | grep "status=0" | wc -l)
+        if [ $n -ne 9 ]; then
+            echo "$OUTPUT"
+            echo "ERROR: Batch test did not run all tasks"
+            return 1
+        fi
+
+        if ! echo "$OUTPUT" | grep "Batching task" >/dev/null; then
+            echo "$OUTPUT"
+            echo "ERROR: Tasks were not batched"
+            return 1
+        fi
+    done
+}
+
+function test_prefetch {
+    OUTPUT=$(mpiexec -np 3 $PMC -v -v -s --prefetch 1 test/batch.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Prefetch test failed"
+        return 1
+    fi
+
+    n=$(echo "$OUTPUT" | grep "status=0" | wc -l)
+    if [ $n -ne 9 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Prefetch test did not run all tasks"
+        return 1
+    fi
+
+    if ! echo "$OUTPUT" | grep "Prefetching task" >/dev/null; then
+        echo "$OUTPUT"
+        echo "ERROR: Tasks were not prefetched"
+        return 1
+    fi
+}
+
+function test_broadcast_dag {
+    for flags in "" "--sub-masters --batch-size 4"; do
+        OUTPUT=$(mpiexec -np 4 $PMC -s --broadcast-dag $flags test/batch.dag 2>&1)
+        RC=$?
+
+        if [ $RC -ne 0 ]; then
+            echo "$OUTPUT"
+            echo "ERROR: Broadcast DAG test failed"
+            return 1
+        fi
+
+        n=$(echo "$OUTPUT" | grep "status=0" | wc -l)
+        if [ $n -ne 9 ]; then
+            echo "$OUTPUT"
+            echo "ERROR: Broadcast DAG test did not run all tasks"
+            return 1
+        fi
+    done
+
+    # Forwarding still works when tasks are sent by index
+    OUTPUT=$(mpiexec -np 2 $PMC -s --broadcast-dag test/forward.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Broadcast DAG forward test failed"
+        return 1
+    fi
+
+    if ! [ -f test/forward.dag.foo ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Broadcast DAG forward test did not forward data"
+        return 1
+    fi
+    rm -f test/forward.dag.*
+}
+
+# Make sure files are copied to each host and tasks use the copies
+function test_broadcast_files {
+    rm -rf test/scratch/app test/scratch/local
+    mkdir -p test/scratch/app/bin test/scratch/app/lib
+    APP=$PWD/test/scratch/app
+    printf '#!/bin/sh\necho "$0 $PMC_BROADCAST_DIR"\n' > $APP/bin/hello.sh
+    chmod +x $APP/bin/hello.sh
+    ln -s hello.sh $APP/bin/hi
+    # Bigger than one message
+    head -c 9000000 /dev/urandom > $APP/lib/big
+
+    cat > test/scratch/broadcast.dag <<END
+TASK A $APP/bin/hello.sh
+TASK B hi
+TASK C /bin/sh -c "echo C=\$LD_LIBRARY_PATH"
+END
+
+    for flags in "" "--sub-masters"; do
+        OUTPUT=$(PATH=$APP/bin:$PATH LD_LIBRARY_PATH=$APP/lib mpiexec -np 3 $PMC -s \
+            -o test/scratch/stdout --broadcast-files $APP/ \
+            --broadcast-dir test/scratch/local $flags test/scratch/broadcast.dag 2>&1)
+        RC=$?
+
+        if [ $RC -ne 0 ]; then
+            echo "$OUTPUT"
+            echo "ERROR: Broadcast files test failed"
+            return 1
+        fi
+
+        if ! cmp -s $APP/lib/big test/scratch/local/app/lib/big ||
+                ! [ -x test/scratch/local/app/bin/hello.sh ] ||
+                [ "$(readlink test/scratch/local/app/bin/hi)" != "hello.sh" ]; then
+            ls -lR test/scratch/local
+            echo "ERROR: Files were not broadcast"
+            return 1
+        fi
+
+        if ! grep -q "^test/scratch/local/app/bin/hello.sh test/scratch/local$" test/scratch/stdout ||
+                ! grep -q "^test/scratch/local/app/bin/hi " test/scratch/stdout ||
+                ! grep -q "^C=test/scratch/local/app/lib$" test/scratch/stdout; then
+            cat test/scratch/stdout
+            echo "ERROR: Tasks did not use the broadcast files"
+            return 1
+        fi
+    done
+
+    OUTPUT=$(mpiexec -np 2 $PMC --broadcast-files $APP test/scratch/broadcast.dag 2>&1)
+    if [ $? -eq 0 ] || ! [[ "$OUTPUT" =~ "requires --broadcast-dir" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: --broadcast-files should require --broadcast-dir"
+        return 1
+    fi
+}
+
+# Make sure tasks that run out of time are killed
+function test_max_runtime {
+    START=$(date +%s)
+    OUTPUT=$(mpiexec -np 2 $PMC -v test/timeout.dag 2>&1)
+    RC=$?
+    ELAPSED=$(($(date +%s) - START))
+
+    if [ $RC -eq 0 ] || [ $ELAPSED -ge 20 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Max runtime test failed ($ELAPSED seconds)"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Task A was killed on worker 1 after exceeding its maximum runtime" ]] ||
+            [ $(grep -c "^DONE" test/timeout.dag.rescue) -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Max runtime test failed (wrong tasks failed)"
+        return 1
+    fi
+
+    OUTPUT=$(mpiexec -np 2 $PMC -v --worker-slots 2 --host-cpus 4 --max-runtime 0.5 test/sleep.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ] || ! [[ "$OUTPUT" =~ "exceeding its maximum runtime" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Max runtime test failed (default limit)"
+        return 1
+    fi
+}
+
+# Make sure the master drains before the wall time so that no work is lost
+function test_wall_time_margin {
+    OUTPUT=$(mpiexec -np 3 $PMC -s test/drain.dag --max-wall-time 0.1 --wall-time-margin 0.05 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ] || [[ "$OUTPUT" =~ "Aborting workflow" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Workflow should stop without aborting"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Workflow stopped before the wall time, 2 ready tasks were not started" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Workflow should stop with B and D left"
+        return 1
+    fi
+
+    if [ "$(grep -c "^DONE" test/drain.dag.rescue)" -ne 2 ] || ! grep -q "^DONE C$" test/drain.dag.rescue; then
+        cat test/drain.dag.rescue
+        echo "ERROR: A and C should be in the rescue log"
+        return 1
+    fi
+}
+
+# Make sure that PMC aborts if the workflow takes too long
+function test_max_wall_time {
+    OUTPUT=$(mpiexec -np 3 $PMC -s test/walltime.dag --host-cpus 2 --max-wall-time 0.05 2>&1)
+    RC=$?
+    
+    if [ $RC -eq 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Max wall time test failed on exitcode"
+        return 1
+    fi
+    
+    if ! [[ "$OUTPUT" =~ "Aborting workflow" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Max wall time test failed on aborting"
+        return 1
+    fi
+    
+    if ! [[ "$OUTPUT" =~ "TASK stdout" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Max wall time test failed on task stdout"
+        return 1
+    fi
+    
+    if ! [[ "$OUTPUT" =~ "TASK stderr" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Max wall time test failed on task stderr"
+        return 1
+    fi
+    
+    ELAPSED=$(echo "$OUTPUT" | grep "Wall time:" | cut -d" " -f4)
+    if [ $(echo "$ELAPSED > 4.0" | bc -q) -eq 1 ]; then
+        echo "$OUTPUT"
+        echo "Ran in $ELAPSED seconds"
+        echo "ERROR: Max wall time test took too long"
+        return 1
+    fi
+}
+
+# Make sure that the resource log gets generated correctly
+function test_resource_log {
+    OUTPUT=$(mpiexec -np 3 $PMC -s test/sleep.dag --host-cpus 4 --host-memory 100 2>&1)
+    RC=$?
+    
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Resource log test failed"
+        return 1
+    fi
+    
+    LINES=$(cat test/sleep.dag.resource | wc -l)
+    
+    if [ $LINES -ne 3 ]; then
+        echo "ERROR: Expected 3 lines in the resource log got $LINES"
+        return 1
+    fi
+}
+
+# Make sure that a binary resource log converts to the same CSV lines
+function test_resource_log_binary {
+    OUTPUT=$(mpiexec -np 3 $PMC -s test/sleep.dag --host-cpus 4 --host-memory 100 --resource-log-binary 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Binary resource log test failed"
+        return 1
+    fi
+
+    CSV=$($PMC --resource-log-csv test/sleep.dag.resource)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "ERROR: Unable to convert binary resource log"
+        return 1
+    fi
+
+    LINES=$(echo "$CSV" | grep -c ',4,100,')
+
+    if [ $LINES -ne 2 ]; then
+        echo "$CSV"
+        echo "ERROR: Expected 2 idle samples in the converted log got $LINES"
+        return 1
+    fi
+
+    if [ $(echo "$CSV" | wc -l) -ne 3 ]; then
+        echo "$CSV"
+        echo "ERROR: Expected 3 lines in the converted log"
+        return 1
+    fi
+}
+
+# Make sure that failures are counted against the host, but that the only
+# host is never quarantined
+function test_quarantine {
+    mkdir -p test/scratch
+
+    OUTPUT=$(mpiexec -np 2 $PMC -s test/tries.dag -o /dev/null -e /dev/null -t 3 --quarantine 3 --status-file test/scratch/status 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ] || [ $(echo "$OUTPUT" | grep "Task B failed" | wc -l) -ne 5 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Task B should be tried 5 times"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "but it is the last healthy host" ]] || [[ "$OUTPUT" =~ "Quarantining host" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: The last host should not be quarantined"
+        return 1
+    fi
+
+    if ! grep -q '^pmc_host_task_failures_total{host=".*"} 8$' test/scratch/status ||
+            ! grep -q '^pmc_host_quarantined{host=".*"} 0$' test/scratch/status; then
+        cat test/scratch/status
+        echo "ERROR: Status file does not show 8 failures on the host"
+        return 1
+    fi
+}
+
+# Make sure that the status file has the final state of the workflow
+function test_status_file {
+    mkdir -p test/scratch
+
+    OUTPUT=$(mpiexec -np 3 $PMC --status-file test/scratch/status --status-interval 0.1 test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Status file test failed"
+        return 1
+    fi
+
+    if ! grep -q '^pmc_tasks_total{state="succeeded"} 4$' test/scratch/status; then
+        cat test/scratch/status
+        echo "ERROR: Status file does not show 4 tasks succeeded"
+        return 1
+    fi
+
+    if ! grep -q '^pmc_schedule_seconds_count [1-9]' test/scratch/status ||
+            ! grep -q '^pmc_host_free_slots{host=' test/scratch/status; then
+        cat test/scratch/status
+        echo "ERROR: Status file is missing metrics"
+        return 1
+    fi
+
+    if [ -f test/scratch/status.tmp ]; then
+        echo "ERROR: Temporary status file was left behind"
+        return 1
+    fi
+}
+
+# Make sure that the utilization breakdown is written
+function test_utilization_file {
+    mkdir -p test/scratch
+    rm -f test/scratch/utilization.json
+
+    OUTPUT=$(mpiexec -np 3 $PMC --utilization-file test/scratch/utilization.json test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Utilization file test failed"
+        return 1
+    fi
+
+    for key in slots hosts total idle_no_work; do
+        if ! grep -q "\"$key\"" test/scratch/utilization.json; then
+            cat test/scratch/utilization.json
+            echo "ERROR: Utilization file is missing $key"
+            return 1
+        fi
+    done
+}
+
+# Make sure that the trace has the life of every task
+function test_trace {
+    mkdir -p test/scratch
+
+    OUTPUT=$(mpiexec -np 3 $PMC --trace test/scratch/trace.json test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Trace test failed"
+        return 1
+    fi
+
+    for cat in task launch dispatch result; do
+        N=$(grep -c "\"cat\":\"$cat\",\"ph\":\"X\"" test/scratch/trace.json)
+        if [ $N -ne 4 ]; then
+            cat test/scratch/trace.json
+            echo "ERROR: Expected 4 $cat events in the trace got $N"
+            return 1
+        fi
+    done
+
+    for cat in queue rescue; do
+        N=$(grep -c "\"cat\":\"$cat\",\"ph\":\"e\"" test/scratch/trace.json)
+        if [ $N -ne 4 ]; then
+            cat test/scratch/trace.json
+            echo "ERROR: Expected 4 $cat spans in the trace got $N"
+            return 1
+        fi
+    done
+
+    if [ "$(tail -1 test/scratch/trace.json)" != "]" ]; then
+        echo "ERROR: Trace was not closed"
+        return 1
+    fi
+}
+
+# Make sure task stdout/stderr are sent to the master
+function test_forward_stdio {
+    mkdir -p test/scratch
+    echo "onefish my stdout" > test/scratch/stdout
+
+    OUTPUT=$(mpiexec -np 3 $PMC -v -o test/scratch/stdout -e test/scratch/stderr test/stdio.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward stdio test failed"
+        return 1
+    fi
+
+    if grep -q "onefish" test/scratch/stdout; then
+        echo "ERROR: stdout file was not truncated"
+        return 1
+    fi
+
+    if [ $(grep -c "TASK stdout" test/scratch/stdout) -ne 2 ] || 
+       [ $(grep -c "TASK stderr" test/scratch/stderr) -ne 2 ]; then
+        echo "ERROR: task stdout/stderr missing"
+        return 1
+    fi
+
+    if [ $(grep -a -c "\[cluster-task" test/scratch/stdout) -ne 3 ]; then
+        echo "ERROR: cluster-task records missing"
+        return 1
+    fi
+
+    # The large output is sent in chunks
+    if [ $(tr -cd '\000' < test/scratch/stdout | wc -c) -ne 3000000 ]; then
+        echo "ERROR: large task stdout was not forwarded"
+        return 1
+    fi
+
+    if ls test/stdio.dag.out.* test/stdio.dag.err.* >/dev/null 2>&1; then
+        echo "ERROR: workers created stdio files"
+        return 1
+    fi
+}
+
+# Make sure the stdio files of the workers are merged in rank order
+function test_rank_stdio {
+    mkdir -p test/scratch
+    echo "onefish my stdout" > test/diamond.dag.out.1
+    echo "twofish my stdout" > test/diamond.dag.out.2
+    echo "redfish my stderr" > test/diamond.dag.err.1
+
+    OUTPUT=$(mpiexec -np 3 $PMC -v --rank-stdio --merge-threads 2 -o test/scratch/stdout -e test/scratch/stderr test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Rank stdio test failed"
+        return 1
+    fi
+
+    if [ "$(grep fish test/scratch/stdout | tr '\n' ' ')" != "onefish my stdout twofish my stdout " ]; then
+        cat test/scratch/stdout
+        echo "ERROR: stdout not merged in rank order"
+        return 1
+    fi
+
+    if [ $(grep -c "\[cluster-task" test/scratch/stdout) -ne 4 ]; then
+        echo "ERROR: cluster-task records missing"
+        return 1
+    fi
+
+    if ! grep -q "redfish my stderr" test/scratch/stderr; then
+        echo "ERROR: stderr not merged"
+        return 1
+    fi
+
+    if ls test/diamond.dag.out.* test/diamond.dag.err.* >/dev/null 2>&1; then
+        echo "ERROR: worker stdio files were not deleted"
+        return 1
+    fi
+}
+
+# Make sure a worker can run several tasks at the same time
+function test_worker_slots {
+    mkdir -p test/scratch
+
+    START=$(date +%s)
+    OUTPUT=$(mpiexec -np 2 $PMC -v --worker-slots 4 --host-cpus 4 -o test/scratch/stdout test/slots.dag 2>&1)
+    RC=$?
+    ELAPSED=$(($(date +%s) - START))
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Worker slots test failed"
+        return 1
+    fi
+
+    if [ $ELAPSED -ge 6 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Tasks did not run at the same time ($ELAPSED seconds)"
+        return 1
+    fi
+
+    if [ $(grep -c "slot=1," test/scratch/stdout) -ne 4 ] || 
+       [ $(grep -c "TASK stdout" test/scratch/stdout) -ne 2 ]; then
+        cat test/scratch/stdout
+        echo "ERROR: task stdout missing"
+        return 1
+    fi
+
+    OUTPUT=$(mpiexec -np 2 $PMC --worker-slots 4 --batch-size 2 test/slots.dag 2>&1)
+    if [ $? -eq 0 ] || ! [[ "$OUTPUT" =~ "cannot be used with" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: --worker-slots should not be allowed with --batch-size"
+        return 1
+    fi
+}
+
+# Make sure the master can run tasks on the rest of its host
+function test_master_cores {
+    OUTPUT=$(mpiexec -np 1 $PMC -s -v --master-cores 1 --host-cpus 3 test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Master cores test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Master starting with 2 workers" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Master should run 2 workers in its process"
+        return 1
+    fi
+
+    OUTPUT=$(mpiexec -np 2 $PMC -s -v --master-cores 2 --host-cpus 3 test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ] || ! [[ "$OUTPUT" =~ "Master starting with 2 workers" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Master cores test with MPI workers failed"
+        return 1
+    fi
+
+    OUTPUT=$(mpiexec -np 2 $PMC --master-cores 1 --sub-masters test/diamond.dag 2>&1)
+    if [ $? -eq 0 ] || ! [[ "$OUTPUT" =~ "cannot be used with" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: --master-cores should not be allowed with --sub-masters"
+        return 1
+    fi
+}
+
+# Make sure I/O forwarding works
+function test_forward {
+    OUTPUT=$(mpiexec -np 2 $PMC -v test/forward.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward test failed"
+        return 1
+    fi
+    
+    FOO=$(grep "Variable FOO" test/forward.dag.foo | wc -l)
+    if [ $? -ne 0 ] || [ $FOO -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward test failed (foo problem)"
+        return 1
+    fi
+    
+    BAR=$(grep "Variable BAR" test/forward.dag.bar | wc -l)
+    if [ $? -ne 0 ] || [ $BAR -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward test failed (bar problem)"
+        return 1
+    fi
+}
+
+# Make sure a copy of a straggler is started, and the straggler is killed
+function test_speculate {
+    mkdir -p test/scratch
+
+    START=$(date +%s)
+    OUTPUT=$(mpiexec -np 3 $PMC -v --speculate 2 --host-cpus 2 -o test/scratch/stdout test/speculate.dag 2>&1)
+    RC=$?
+    ELAPSED=$(($(date +%s) - START))
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Speculate test failed"
+        return 1
+    fi
+
+    if [ $ELAPSED -ge 20 ] || ! [[ "$OUTPUT" =~ "starting a copy" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: No copy of the straggler was started ($ELAPSED seconds)"
+        return 1
+    fi
+
+    if [ $(grep -c "Task S finished" test/scratch/stdout) -ne 1 ] ||
+            [ $(grep -c "^DONE S$" test/speculate.dag.rescue) -ne 1 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Straggler did not finish exactly once"
+        return 1
+    fi
+}
+
+# Make sure intermediate files stay in the staging area until they are read
+function test_staging {
+    rm -rf test/scratch/staging
+    mkdir -p test/scratch
+
+    OUTPUT=$(mpiexec -np 3 $PMC -v --staging-dir test/scratch/staging --staging-size 64 -o test/scratch/stdout test/staging.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Staging test failed"
+        return 1
+    fi
+
+    if [ $(grep -c "^hello$" test/scratch/stdout) -ne 2 ]; then
+        cat test/scratch/stdout
+        echo "ERROR: Tasks did not read the intermediate files"
+        return 1
+    fi
+
+    if [ -n "$(find test/scratch/staging -type f)" ]; then
+        find test/scratch/staging -type f
+        echo "ERROR: Intermediate files were not deleted"
+        return 1
+    fi
+
+    OUTPUT=$(mpiexec -np 2 $PMC -o /dev/null test/staging.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ] || ! [[ "$OUTPUT" =~ "there is no --staging-dir" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Intermediate files should require --staging-dir"
+        return 1
+    fi
+}
+
+# Make sure idle workers are shut down during the tail of the workflow
+function test_release_idle {
+    OUTPUT=$(mpiexec -np 4 $PMC --release-idle 1 -o /dev/null test/release.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Release idle test failed"
+        return 1
+    fi
+
+    # Task L runs alone for 3 seconds, and its worker has to stay for D
+    if [ $(echo "$OUTPUT" | grep -c "Releasing worker") -ne 2 ] ||
+            ! [[ "$OUTPUT" =~ "Workers released while idle: 2 of 3" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Two idle workers should have been released"
+        return 1
+    fi
+}
+
+# Short tasks should be sent in bundles based on their runtime estimates,
+# and then on the runtimes of earlier tasks that ran the same program
+function test_bundle_time {
+    OUTPUT=$(mpiexec -np 3 $PMC -s --bundle-time 1 -o /dev/null test/bundle.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Bundle test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Tasks sent in bundles: 14 in 2 bundles" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Tasks were not bundled"
+        return 1
+    fi
+
+    # Each task still gets its own rescue record
+    if [ $(grep -c "^DONE" test/bundle.dag.rescue) -ne 17 ]; then
+        cat test/bundle.dag.rescue
+        echo "ERROR: Bundled tasks are missing from the rescue log"
+        return 1
+    fi
+}
+
+# Tasks should be given the resources used by earlier tasks of their
+# transformation, unless they have their own
+function test_estimate_resources {
+    OUTPUT=$(mpiexec -np 2 $PMC -v -s --estimate-resources test/estimate.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Estimate test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Task A used" ]] || ! [[ "$OUTPUT" =~ "Tasks with estimated resources: 1" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Resources were not estimated"
+        return 1
+    fi
+}
+
+# The master should write an invocation record for each task after its output
+function test_monitor {
+    OUTPUT=$(mpiexec -np 2 $PMC -s --monitor test/pegasus.dag 2>/dev/null)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Monitor test failed"
+        return 1
+    fi
+
+    if [ $(echo "$OUTPUT" | grep -c "^- invocation: True") -ne 4 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Wrong number of invocation records"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ 'transformation: "mDiffFit:3.3"' ]] ||
+            ! [[ "$OUTPUT" =~ 'file_name: "/bin/echo"' ]] ||
+            ! [[ "$OUTPUT" =~ "regular_exitcode: 0" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Invocation records are missing fields"
+        return 1
+    fi
+}
+
+# Tasks should reserve the memory used by the first task, and run again
+# with their -m if they go over it
+function test_overcommit_memory {
+    OUTPUT=$(mpiexec -np 2 $PMC -s --cgroup $PMC_TEST_CGROUP --overcommit-memory 1.5 test/overcommit.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Overcommit test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Tasks with overcommitted memory: 2, 1 ran out of memory" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Memory was not overcommitted"
+        return 1
+    fi
+}
+
+# Tasks that already ran should be skipped, and their output written again
+function test_result_cache {
+    mkdir -p test/scratch
+    echo "foo" > test/scratch/cache.in
+
+    OUTPUT=$(mpiexec -np 2 $PMC -s --result-cache test/scratch/cache -o test/cache.dag.out test/cache.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ] || ! [[ "$OUTPUT" =~ "Tasks found in the result cache: 0 of 3, 3 results stored" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Results were not stored in the cache"
+        return 1
+    fi
+    mv test/cache.dag.out test/cache.dag.out.1
+    mv test/cache.dag.foo test/cache.dag.foo.1
+
+    OUTPUT=$(mpiexec -np 2 $PMC -s --result-cache test/scratch/cache -o test/cache.dag.out test/cache.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ] || ! [[ "$OUTPUT" =~ "Tasks found in the result cache: 3 of 3, 0 results stored" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Tasks were not found in the cache"
+        return 1
+    fi
+
+    if ! diff test/cache.dag.out.1 test/cache.dag.out || ! diff test/cache.dag.foo.1 test/cache.dag.foo; then
+        echo "ERROR: Cached output was not written"
+        return 1
+    fi
+
+    # Only the task that reads the input runs again when it changes
+    echo "bar" > test/scratch/cache.in
+    OUTPUT=$(mpiexec -np 2 $PMC -s --result-cache test/scratch/cache -o test/cache.dag.out test/cache.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ] || ! [[ "$OUTPUT" =~ "Tasks found in the result cache: 2 of 3, 1 results stored" ]] ||
+            ! grep -q "^bar$" test/cache.dag.out; then
+        echo "$OUTPUT"
+        echo "ERROR: Changed input did not invalidate the cache"
+        return 1
+    fi
+}
+
+# The master should give the same results when it receives in a thread
+function test_recv_thread {
+    OUTPUT=$(mpiexec -np 3 $PMC -v -s --recv-thread test/batch.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Receiver thread test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Receiving messages in a separate thread" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Receiver thread was not started"
+        return 1
+    fi
+
+    n=$(echo "$OUTPUT" | grep "status=0" | wc -l)
+    if [ $n -ne 9 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Receiver thread test did not run all tasks"
+        return 1
+    fi
+}
+
+# Make sure tasks launched with vfork get their pipes and environment
+function test_vfork {
+    OUTPUT=$(mpiexec -np 2 $PMC -v --vfork test/forward.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: vfork test failed"
+        return 1
+    fi
+
+    FOO=$(grep "Variable FOO" test/forward.dag.foo | wc -l)
+    BAR=$(grep "Variable BAR" test/forward.dag.bar | wc -l)
+    if [ $FOO -ne 2 ] || [ $BAR -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: vfork test failed (missing data)"
         return 1
     fi
-    
-    if ! [[ "$OUTPUT" =~ "FATAL ERROR: No host is capable of running task" ]]; then
+
+    if ! [[ "$OUTPUT" =~ "Average task launch time" ]]; then
         echo "$OUTPUT"
-        echo "ERROR: Insufficient CPUs test failed (2)"
+        echo "ERROR: vfork test did not report the launch time"
         return 1
     fi
-}
 
-# Make sure retries work
-function test_tries {
-    OUTPUT=$(mpiexec -np 2 $PMC -s test/tries.dag -o /dev/null -e /dev/null -t 3 2>&1)
+    OUTPUT=$(mpiexec -n 8 $PMC --vfork --host-cpus 8 test/PM953.dag 2>&1)
     RC=$?
-    
-    # This test should fail because task B will fail twice
-    if [ $RC -eq 0 ]; then
+
+    if [ $RC -ne 0 ] || ! [[ "$OUTPUT" =~ "eight 0,1,2,3,4,5,6,7" ]]; then
         echo "$OUTPUT"
-        echo "ERROR: Tries test failed"
+        echo "ERROR: vfork test failed (affinity)"
         return 1
     fi
-    
-    if [ $(echo "$OUTPUT" | grep "Task B failed" | wc -l) -ne 5 ]; then
+}
+
+# Make sure I/O forwarding works when the data is written in the background
+function test_write_behind {
+    OUTPUT=$(mpiexec -np 2 $PMC -v --write-behind 10 test/forward.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Tries test failed"
+        echo "ERROR: Write-behind test failed"
         return 1
     fi
     
-    if [ $(echo "$OUTPUT" | grep "Task C failed" | wc -l) -ne 3 ]; then
+    FOO=$(grep "Variable FOO" test/forward.dag.foo | wc -l)
+    BAR=$(grep "Variable BAR" test/forward.dag.bar | wc -l)
+    if [ $FOO -ne 2 ] || [ $BAR -ne 2 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Tries test failed"
+        echo "ERROR: Write-behind test failed (missing data)"
         return 1
     fi
 }
 
-# Make sure that task priorities are honored
-function test_priority {
-    OUTPUT=$(mpiexec -np 2 $PMC -v -v -s test/priority.dag -o /dev/null -e /dev/null --host-cpus 2 2>&1)
+# Make sure I/O forwarding works with several writer threads
+function test_writer_threads {
+    OUTPUT=$(mpiexec -np 2 $PMC -v --write-behind 10 --writer-threads 3 test/forward.dag 2>&1)
     RC=$?
-    
+
     if [ $RC -ne 0 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Priority test failed"
+        echo "ERROR: Writer threads test failed"
         return 1
     fi
     
-    DESIRED="[trace] Scheduling task G
-[trace] Scheduling task I
-[trace] Scheduling task D
-[trace] Scheduling task E
-[trace] Scheduling task O
-[trace] Scheduling task N"
-    
-    ACTUAL=$(echo "$OUTPUT" | grep "Scheduling task ")
-    
-    if [ "$ACTUAL" != "$DESIRED" ]; then
+    FOO=$(grep "Variable FOO" test/forward.dag.foo | wc -l)
+    BAR=$(grep "Variable BAR" test/forward.dag.bar | wc -l)
+    if [ $FOO -ne 2 ] || [ $BAR -ne 2 ]; then
         echo "$OUTPUT"
-        echo "Actual: $ACTUAL"
-        echo "Desired: $DESIRED"
-        echo "ERROR: Priority test failed"
+        echo "ERROR: Writer threads test failed (missing data)"
         return 1
     fi
 }
 
-# Make sure that PMC aborts if the workflow takes too long
-function test_max_wall_time {
-    OUTPUT=$(mpiexec -np 3 $PMC -s test/walltime.dag --host-cpus 2 --max-wall-time 0.05 2>&1)
+# Make sure pipe data sent while a task runs is only kept if the task succeeds
+function test_stream_pipes {
+    OUTPUT=$(mpiexec -np 2 $PMC -v --stream-pipes test/stream_pipe.dag 2>&1)
     RC=$?
-    
+
     if [ $RC -eq 0 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Max wall time test failed on exitcode"
+        echo "ERROR: Stream pipes test should have failed"
         return 1
     fi
     
-    if ! [[ "$OUTPUT" =~ "Aborting workflow" ]]; then
+    FOO=$(grep -c "^FOO" test/stream_pipe.dag.out)
+    BAR=$(grep -c "^BAR" test/stream_pipe.dag.out)
+    if [ "$FOO" != "300000" ] || [ "$BAR" != "0" ]; then
         echo "$OUTPUT"
-        echo "ERROR: Max wall time test failed on aborting"
+        echo "ERROR: Stream pipes test failed (got $FOO FOO and $BAR BAR lines)"
         return 1
     fi
-    
-    if ! [[ "$OUTPUT" =~ "TASK stdout" ]]; then
+}
+
+# Make sure I/O forwarding failures cause task to fail
+function test_forward_fail {
+    OUTPUT=$(mpiexec -np 2 $PMC -v test/forward_fail.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Max wall time test failed on task stdout"
+        echo "ERROR: Forward failure test failed"
         return 1
     fi
     
-    if ! [[ "$OUTPUT" =~ "TASK stderr" ]]; then
+    if ! [[ "$OUTPUT" =~ "Task A failed due to collective I/O errors" ]]; then
         echo "$OUTPUT"
-        echo "ERROR: Max wall time test failed on task stderr"
+        echo "ERROR: Forward failure test failed"
         return 1
     fi
-    
-    ELAPSED=$(echo "$OUTPUT" | grep "Wall time:" | cut -d" " -f4)
-    if [ $(echo "$ELAPSED > 4.0" | bc -q) -eq 1 ]; then
+}
+
+# Tasks can be added from a stream while the workflow runs
+function test_dag_stream {
+    for flags in "" "--broadcast-dag"; do
+        STREAM=test/stream.dag.input
+        printf "TASK C echo C\nEDGE B C\n" > $STREAM
+        ( sleep 2; printf "COMMIT\nTASK D echo D\nEDGE A D\nEDGE C D\nEND\n" >> $STREAM ) &
+        OUTPUT=$(mpiexec -np 2 $PMC -s $flags --dag-stream $STREAM test/stream.dag 2>&1)
+        RC=$?
+        wait
+
+        if [ $RC -ne 0 ]; then
+            echo "$OUTPUT"
+            echo "ERROR: DAG stream test failed"
+            return 1
+        fi
+
+        n=$(echo "$OUTPUT" | grep "status=0" | wc -l)
+        if [ $n -ne 4 ]; then
+            echo "$OUTPUT"
+            echo "ERROR: DAG stream test did not run all tasks"
+            return 1
+        fi
+
+        if ! [[ "$OUTPUT" =~ "name=D" ]]; then
+            echo "$OUTPUT"
+            echo "ERROR: DAG stream test did not run D"
+            return 1
+        fi
+        rm -f test/stream.dag.*
+    done
+}
+
+# The tasks of a parameter sweep get their own index in their arguments
+function test_sweep {
+    mkdir -p test/scratch
+
+    for flags in "" "--broadcast-dag"; do
+        rm -f test/scratch/stdout
+        OUTPUT=$(mpiexec -np 2 $PMC -s $flags -o test/scratch/stdout test/sweep.dag 2>&1)
+        RC=$?
+
+        if [ $RC -ne 0 ]; then
+            echo "$OUTPUT"
+            echo "ERROR: Sweep test failed"
+            return 1
+        fi
+
+        if [ "$(grep -c "^sim [0-3]$" test/scratch/stdout)" -ne 4 ] || 
+                [ "$(grep -c "^check 1[0-3]$" test/scratch/stdout)" -ne 4 ]; then
+            cat test/scratch/stdout
+            echo "ERROR: Sweep tasks did not get their indices"
+            return 1
+        fi
+    done
+
+    # A task that is also in a sweep is reported with the sweep
+    OUTPUT=$(mpiexec -np 2 $PMC -s test/sweep_duplicate.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ] || ! [[ "$OUTPUT" =~ "Duplicate task: sim[2] is also in sweep sim[0:4]" ]]; then
         echo "$OUTPUT"
-        echo "Ran in $ELAPSED seconds"
-        echo "ERROR: Max wall time test took too long"
+        echo "ERROR: Sweep duplicate test failed"
         return 1
     fi
 }
 
-# Make sure that the resource log gets generated correctly
-function test_resource_log {
-    OUTPUT=$(mpiexec -np 3 $PMC -s test/sleep.dag --host-cpus 4 --host-memory 100 2>&1)
+# Several DAGs should share the workers and keep their own rescue and output files
+function test_multi_dag {
+    mkdir -p test/scratch
+    cp test/diamond.dag test/scratch/one.dag
+    cp test/diamond.dag test/scratch/two.dag
+
+    OUTPUT=$(mpiexec -np 2 $PMC --dag-weights 2,1 test/scratch/one.dag test/scratch/two.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Multi-DAG test failed"
+        return 1
+    fi
+
+    for dag in one two; do
+        n=$(grep "name=$dag\." test/scratch/$dag.dag.out | wc -l)
+        d=$(grep "^DONE [A-D]$" test/scratch/$dag.dag.rescue | wc -l)
+        if [ $n -ne 4 ] || [ $d -ne 4 ]; then
+            echo "$OUTPUT"
+            echo "ERROR: Multi-DAG test did not run all the tasks of $dag"
+            return 1
+        fi
+    done
+}
+
+# Make sure I/O forwarding works with files
+function test_file_forward {
+    OUTPUT=$(mpiexec -np 2 $PMC -v test/file_forward.dag 2>&1)
     RC=$?
     
     if [ $RC -ne 0 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Resource log test failed"
+        echo "ERROR: File forward test failed"
         return 1
     fi
     
-    LINES=$(cat test/sleep.dag.resource | wc -l)
+    FOO=$(grep "foo" test/forward.dag.foo | wc -l)
+    if [ $? -ne 0 ] || [ $FOO -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: File forward test failed (foo problem)"
+        return 1
+    fi
     
-    if [ $LINES -ne 3 ]; then
-        echo "ERROR: Expected 3 lines in the resource log got $LINES"
+    BAR=$(grep "bar" test/forward.dag.bar | wc -l)
+    if [ $? -ne 0 ] || [ $BAR -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: File forward test failed (bar problem)"
         return 1
     fi
 }
 
-# Make sure that stdio is appended to existing files
-function test_append_stdio {
-    echo "onefish my stdout" > test/diamond.dag.out.1
-    echo "twofish my stderr" > test/diamond.dag.err.1
-    
-    OUTPUT=$(mpiexec -np 2 $PMC -v test/diamond.dag 2>&1)
+# Make sure large files are forwarded in chunks without being interleaved
+function test_large_file_forward {
+    OUTPUT=$(mpiexec -np 3 $PMC -v test/large_forward.dag 2>&1)
     RC=$?
-
+    
     if [ $RC -ne 0 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Append test failed"
+        echo "ERROR: Large file forward test failed"
         return 1
     fi
-
-    if ! [[ "$OUTPUT" =~ "onefish my stdout" ]]; then
+    
+    LINES=$(cat test/large_forward.dag.out | wc -l)
+    if [ $LINES -ne 1800000 ]; then
         echo "$OUTPUT"
-        echo "ERROR: stdout not appended"
+        echo "ERROR: Large file forward test failed (got $LINES lines)"
         return 1
     fi
-
-    if ! [[ "$OUTPUT" =~ "twofish my stderr" ]]; then
+    
+    # The output of each task should be in one piece
+    RUNS=$(cut -d' ' -f1 test/large_forward.dag.out | uniq | wc -l)
+    if [ $RUNS -ne 3 ]; then
         echo "$OUTPUT"
-        echo "ERROR: stderr not appended"
+        echo "ERROR: Large file forward test failed (output is interleaved)"
         return 1
     fi
 }
 
-# Make sure I/O forwarding works
-function test_forward {
-    OUTPUT=$(mpiexec -np 2 $PMC -v test/forward.dag 2>&1)
+# Make sure workers can write file forwards directly into their own
+# regions of the destination
+function test_direct_forwards {
+    OUTPUT=$(mpiexec -np 4 $PMC -v --direct-forwards test/large_forward.dag 2>&1)
     RC=$?
-
+    
     if [ $RC -ne 0 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Forward test failed"
+        echo "ERROR: Direct forwards test failed"
         return 1
     fi
     
-    FOO=$(grep "Variable FOO" test/forward.dag.foo | wc -l)
-    if [ $? -ne 0 ] || [ $FOO -ne 2 ]; then
+    if ! [[ "$OUTPUT" =~ "written directly by workers: 3 tasks" ]]; then
         echo "$OUTPUT"
-        echo "ERROR: Forward test failed (foo problem)"
+        echo "ERROR: Direct forwards test did not write the files directly"
         return 1
     fi
     
-    BAR=$(grep "Variable BAR" test/forward.dag.bar | wc -l)
-    if [ $? -ne 0 ] || [ $BAR -ne 2 ]; then
+    LINES=$(cat test/large_forward.dag.out | wc -l)
+    RUNS=$(cut -d' ' -f1 test/large_forward.dag.out | uniq | wc -l)
+    if [ $LINES -ne 1800000 ] || [ $RUNS -ne 3 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Forward test failed (bar problem)"
+        echo "ERROR: Direct forwards test failed (got $LINES lines in $RUNS runs)"
         return 1
     fi
 }
 
-# Make sure I/O forwarding failures cause task to fail
-function test_forward_fail {
-    OUTPUT=$(mpiexec -np 2 $PMC -v test/forward_fail.dag 2>&1)
+# Make sure forwarded data arrives intact when workers have to wait for
+# the master to write it
+function test_master_memory {
+    OUTPUT=$(mpiexec -np 4 $PMC -v --master-memory 1 test/large_forward.dag 2>&1)
     RC=$?
-
-    if [ $RC -eq 0 ]; then
+    
+    if [ $RC -ne 0 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Forward failure test failed"
+        echo "ERROR: Master memory test failed"
         return 1
     fi
     
-    if ! [[ "$OUTPUT" =~ "Task A failed due to collective I/O errors" ]]; then
+    LINES=$(cat test/large_forward.dag.out | wc -l)
+    RUNS=$(cut -d' ' -f1 test/large_forward.dag.out | uniq | wc -l)
+    if [ $LINES -ne 1800000 ] || [ $RUNS -ne 3 ]; then
         echo "$OUTPUT"
-        echo "ERROR: Forward failure test failed"
+        echo "ERROR: Master memory test failed (got $LINES lines in $RUNS runs)"
         return 1
     fi
 }
 
-# Make sure I/O forwarding works with files
-function test_file_forward {
-    OUTPUT=$(mpiexec -np 2 $PMC -v test/file_forward.dag 2>&1)
+# Make sure forwarded data arrives intact, and in fewer bytes, when
+# messages are compressed
+function test_compress_messages {
+    OUTPUT=$(mpiexec -np 3 $PMC --compress-messages 1024 test/large_forward.dag 2>&1)
     RC=$?
-    
+
     if [ $RC -ne 0 ]; then
         echo "$OUTPUT"
-        echo "ERROR: File forward test failed"
+        echo "ERROR: Compressed messages test failed"
         return 1
     fi
-    
-    FOO=$(grep "foo" test/forward.dag.foo | wc -l)
-    if [ $? -ne 0 ] || [ $FOO -ne 2 ]; then
+
+    LINES=$(cat test/large_forward.dag.out | wc -l)
+    if [ $LINES -ne 1800000 ]; then
         echo "$OUTPUT"
-        echo "ERROR: File forward test failed (foo problem)"
+        echo "ERROR: Compressed messages test failed (got $LINES lines)"
         return 1
     fi
-    
-    BAR=$(grep "bar" test/forward.dag.bar | wc -l)
-    if [ $? -ne 0 ] || [ $BAR -ne 2 ]; then
+
+    SIZE=$(stat -c %s test/large_forward.dag.out)
+    RECVD=$(echo "$OUTPUT" | sed -n 's/.*Bytes received from workers: //p')
+    if [ -z "$RECVD" ] || [ $RECVD -ge $SIZE ]; then
         echo "$OUTPUT"
-        echo "ERROR: File forward test failed (bar problem)"
+        echo "ERROR: Forwarded data should be compressed ($RECVD bytes for $SIZE)"
         return 1
     fi
 }
@@ -515,6 +1695,29 @@ function test_file_forward_fail {
     fi
 }
 
+# The data of a task that fails because a file could not be forwarded
+# should not be written
+function test_file_forward_partial {
+    mkdir -p test/scratch
+    rm -f test/scratch/partial.out test/scratch/partial.cpus test/scratch/partial.pipe
+
+    OUTPUT=$(mpiexec -np 2 $PMC -v test/file_forward_partial.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ] || ! [[ "$OUTPUT" =~ "file is truncated" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Partial file forward test failed"
+        return 1
+    fi
+
+    if [ -s test/scratch/partial.out ] || [ -s test/scratch/partial.cpus ] ||
+            [ -s test/scratch/partial.pipe ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Data of a failed task was forwarded"
+        return 1
+    fi
+}
+
 function test_per_task_stdio {
     mkdir -p test/scratch
     cp test/diamond.dag test/scratch/
@@ -555,6 +1758,71 @@ function test_jobstate_log {
         echo "ERROR: jobstate.log file was not created"
         return 1
     fi
+
+    # 4 events for each task plus start and finish
+    LINES=$(cat test/scratch/jobstate.log | wc -l)
+    if [ $LINES -ne 18 ]; then
+        cat test/scratch/jobstate.log
+        echo "ERROR: Expected 18 lines in jobstate.log got $LINES"
+        return 1
+    fi
+}
+
+# Events delivered as they happen should give the same log
+function test_jobstate_log_sync {
+    mkdir -p test/scratch
+    cp test/diamond.dag test/scratch/
+
+    OUTPUT=$(mpiexec -np 2 $PMC -v --jobstate-log --event-interval 0 test/scratch/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: jobstate.log sync test failed"
+        return 1
+    fi
+
+    EVENTS=$(cut -d' ' -f2- test/scratch/jobstate.log | grep -c "SUBMIT\|EXECUTE\|JOB_\|PMC_")
+    if [ $EVENTS -ne 18 ]; then
+        cat test/scratch/jobstate.log
+        echo "ERROR: Expected 18 events in jobstate.log got $EVENTS"
+        return 1
+    fi
+}
+
+function test_event_stream {
+    mkdir -p test/scratch
+    rm -f test/scratch/events
+
+    OUTPUT=$(mpiexec -np 2 $PMC -v -s --event-stream test/scratch/events --event-interval 0 test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: event stream test failed"
+        return 1
+    fi
+
+    EVENTS=$($PMC --event-stream-text test/scratch/events)
+    if [ $? -ne 0 ] || [ $(echo "$EVENTS" | wc -l) -ne 14 ]; then
+        echo "$EVENTS"
+        echo "ERROR: Expected 14 events in the event stream"
+        return 1
+    fi
+
+    if ! echo "$EVENTS" | grep -q "^[0-9.]* TASK_SUCCESS D 4 0 1 $(hostname) "; then
+        echo "$EVENTS"
+        echo "ERROR: Event stream is missing the result of task D"
+        return 1
+    fi
+
+    # Each run is appended to the stream
+    OUTPUT=$(mpiexec -np 2 $PMC -s --event-stream test/scratch/events test/diamond.dag 2>&1)
+    if [ $($PMC --event-stream-text test/scratch/events | grep -c WORKFLOW_SUCCESS) -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Expected two runs in the event stream"
+        return 1
+    fi
 }
 
 function test_monitord_hack {
@@ -691,6 +1959,30 @@ function test_affinity_env {
     fi
 }
 
+function test_memory_affinity_args {
+    OUTPUT=$(mpiexec -n 2 $PMC --memory-affinity bind test/diamond.dag 2>&1)
+    if [ $? -eq 0 ] || ! [[ "$OUTPUT" =~ "--memory-affinity requires --set-affinity" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: --memory-affinity should require --set-affinity"
+        return 1
+    fi
+
+    OUTPUT=$(mpiexec -n 2 $PMC --set-affinity --memory-affinity local test/diamond.dag 2>&1)
+    if [ $? -eq 0 ] || ! [[ "$OUTPUT" =~ "Invalid value for --memory-affinity" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: --memory-affinity should reject invalid modes"
+        return 1
+    fi
+
+    # --set-affinity does not work with PMC_HOST_CPUS
+    OUTPUT=$(env -u PMC_HOST_CPUS mpiexec -n 2 $PMC --set-affinity --memory-affinity preferred test/diamond.dag 2>&1)
+    if [ $? -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: --memory-affinity preferred failed"
+        return 1
+    fi
+}
+
 function test_PM954 {
     OUTPUT=$(mpiexec -n 2 $PMC test/PM954.dag 2>&1)
     RC=$?
@@ -741,9 +2033,15 @@ run_test ./test-engine
 run_test ./test-fdcache
 run_test ./test-protocol
 run_test ./test-scheduler
+run_test ./test-resourcelog
+run_test ./test-tracer
+run_test ./test-shmcomm
+run_test ./test-threadcomm
+run_test ./test-resultcache
 run_test test_PM954
 run_test test_help
 run_test test_help_no_mpi
+run_test test_no_mpi
 run_test test_one_worker_required
 run_test test_run_diamond
 run_test test_out_err
@@ -753,27 +2051,70 @@ run_test test_insufficient_memory
 run_test test_strict_limits
 run_test test_cpus_limit
 run_test test_insufficient_cpus
+run_test test_insufficient_hosts
+run_test test_gpus
+run_test test_thread_env
 run_test test_tries
+run_test test_quarantine
 run_test test_priority
+run_test test_backfill
+run_test test_critical_path
+run_test test_submasters
+run_test test_batch_size
+run_test test_prefetch
+run_test test_broadcast_dag
+run_test test_broadcast_files
+run_test test_dag_stream
+run_test test_sweep
+run_test test_multi_dag
 run_test test_host_script
 run_test test_fail_script
 run_test test_fork_script
 run_test test_resource_log
-run_test test_append_stdio
+run_test test_resource_log_binary
+run_test test_status_file
+run_test test_trace
+run_test test_utilization_file
+run_test test_forward_stdio
+run_test test_rank_stdio
+run_test test_worker_slots
+run_test test_master_cores
 run_test test_forward
+run_test test_vfork
+run_test test_speculate
+run_test test_staging
+run_test test_release_idle
+run_test test_bundle_time
+run_test test_estimate_resources
+run_test test_monitor
+run_test test_recv_thread
+run_test test_result_cache
 run_test test_forward_fail
+run_test test_write_behind
+run_test test_writer_threads
+run_test test_stream_pipes
 run_test test_file_forward
 run_test test_file_forward_fail
+run_test test_file_forward_partial
+run_test test_large_file_forward
+run_test test_direct_forwards
+run_test test_master_memory
+run_test test_compress_messages
 run_test test_per_task_stdio
 run_test test_jobstate_log
+run_test test_jobstate_log_sync
+run_test test_event_stream
 run_test test_monitord_hack
 run_test test_monitord_hack_failure
+run_test test_max_runtime
 run_test test_max_wall_time
+run_test test_wall_time_margin
 run_test test_hang_script
 run_test test_maxfds
 run_test test_complex_args
 run_test test_PM848
 run_test test_affinity_env
+run_test test_memory_affinity_args
 
 # setrlimit is broken on Darwin, so the strict limits test won't work
 if [ $(uname -s) != "Darwin" ]; then
@@ -803,3 +2144,8 @@ if ! [ -z "$(which numactl)" ]; then
     fi
 fi
 
+# The overcommit test needs a cgroup v2 directory with the memory
+# controller that the tests can create cgroups in
+if ! [ -z "$PMC_TEST_CGROUP" ]; then
+    run_test test_overcommit_memory
+fi
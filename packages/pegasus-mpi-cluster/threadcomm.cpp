@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+
+#include <algorithm>
+#include <exception>
+
+#include "threadcomm.h"
+#include "failure.h"
+#include "tools.h"
+#include "log.h"
+
+ThreadedCommunicator::ThreadedCommunicator(Communicator *comm) {
+    this->comm = comm;
+    this->running = false;
+    this->stopping = 0;
+    this->head = 0;
+    this->tail = 0;
+    this->waiting = 0;
+    pthread_mutex_init(&lock, NULL);
+    if (pipe(wakeup) < 0) {
+        myfailures("Unable to create pipe for receiver thread");
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fcntl(wakeup[i], F_SETFL, O_NONBLOCK) < 0 ||
+                fcntl(wakeup[i], F_SETFD, FD_CLOEXEC) < 0) {
+            myfailures("Unable to set flags on receiver thread pipe");
+        }
+    }
+}
+
+ThreadedCommunicator::~ThreadedCommunicator() {
+    stop();
+    Message *message;
+    while ((message = pop()) != NULL) {
+        delete message;
+    }
+    close(wakeup[0]);
+    close(wakeup[1]);
+    pthread_mutex_destroy(&lock);
+}
+
+void ThreadedCommunicator::start() {
+    if (running) {
+        return;
+    }
+    stopping = 0;
+    if (pthread_create(&thread, NULL, thread_main, this) != 0) {
+        myfailure("Unable to start receiver thread");
+    }
+    running = true;
+    log_debug("Receiving messages in a separate thread");
+}
+
+/* Stop receiving. Messages that were already received are kept. */
+void ThreadedCommunicator::stop() {
+    if (!running) {
+        return;
+    }
+    stopping = 1;
+    if (pthread_join(thread, NULL) != 0) {
+        myfailure("Unable to join receiver thread");
+    }
+    running = false;
+}
+
+void *ThreadedCommunicator::thread_main(void *arg) {
+    // Signals are handled by the consumer, which is interrupted by them
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    ThreadedCommunicator *self = static_cast<ThreadedCommunicator *>(arg);
+    try {
+        self->run_thread();
+    } catch (std::exception &error) {
+        // The consumer can't catch this, so give up on the whole job
+        log_fatal("Receiver thread: %s", error.what());
+        self->comm->abort(1);
+    }
+    return NULL;
+}
+
+void ThreadedCommunicator::run_thread() {
+    useconds_t sleeptime = RECV_THREAD_MIN_SLEEP;
+    while (!stopping) {
+        Message *message = NULL;
+        pthread_mutex_lock(&lock);
+        if (comm->message_waiting()) {
+            message = comm->recv_message();
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (message == NULL) {
+            // Back off while there are no messages
+            usleep(sleeptime);
+            sleeptime = std::min(2 * sleeptime, (useconds_t)RECV_THREAD_MAX_SLEEP);
+            continue;
+        }
+        sleeptime = RECV_THREAD_MIN_SLEEP;
+
+        // If the consumer falls behind, then stop receiving until it
+        // catches up
+        while (!push(message)) {
+            if (stopping) {
+                delete message;
+                return;
+            }
+            usleep(RECV_THREAD_MAX_SLEEP);
+        }
+    }
+}
+
+/* Add a message to the ring. Only called by the receiver thread. */
+bool ThreadedCommunicator::push(Message *message) {
+    unsigned long h = head;
+    if (h - tail >= RECV_QUEUE_SIZE) {
+        return false;
+    }
+    queue[h % RECV_QUEUE_SIZE] = message;
+    __sync_synchronize();
+    head = h + 1;
+
+    // The consumer sets waiting before it checks the ring for the last
+    // time, so either it sees the message or we see that it is waiting
+    __sync_synchronize();
+    if (waiting) {
+        char c = 0;
+        if (write(wakeup[1], &c, 1) < 0 && errno != EAGAIN) {
+            myfailures("Unable to wake up receiving thread");
+        }
+    }
+    return true;
+}
+
+/* Take a message from the ring, or return NULL if it is empty */
+Message *ThreadedCommunicator::pop() {
+    unsigned long t = tail;
+    if (t == head) {
+        return NULL;
+    }
+    __sync_synchronize();
+    Message *message = queue[t % RECV_QUEUE_SIZE];
+    __sync_synchronize();
+    tail = t + 1;
+    return message;
+}
+
+void ThreadedCommunicator::drain_wakeup() {
+    char buf[64];
+    while (read(wakeup[0], buf, sizeof(buf)) > 0);
+}
+
+Message *ThreadedCommunicator::recv_message(double timeout) {
+    Message *message = pop();
+    if (message != NULL) {
+        return message;
+    }
+
+    if (!running) {
+        pthread_mutex_lock(&lock);
+        message = comm->recv_message(timeout);
+        pthread_mutex_unlock(&lock);
+        return message;
+    }
+
+    double start = current_time();
+    while (true) {
+        waiting = 1;
+        __sync_synchronize();
+        message = pop();
+        if (message != NULL) {
+            waiting = 0;
+            return message;
+        }
+
+        int wait = -1;
+        if (timeout > 0) {
+            double remaining = timeout - (current_time() - start);
+            if (remaining <= 0) {
+                waiting = 0;
+                return NULL;
+            }
+            wait = (int)ceil(remaining * 1000);
+        }
+
+        struct pollfd fds;
+        fds.fd = wakeup[0];
+        fds.events = POLLIN;
+        fds.revents = 0;
+        int rc = poll(&fds, 1, wait);
+        int error = errno;
+        waiting = 0;
+        drain_wakeup();
+        if (rc < 0) {
+            if (error == EINTR) {
+                // The wait was interrupted by a signal
+                return NULL;
+            }
+            myfailure("Unable to wait for messages: %s", strerror(error));
+        }
+
+        message = pop();
+        if (message != NULL) {
+            return message;
+        }
+    }
+}
+
+bool ThreadedCommunicator::message_waiting() {
+    if (head != tail) {
+        return true;
+    }
+    if (running) {
+        return false;
+    }
+    pthread_mutex_lock(&lock);
+    bool result = comm->message_waiting();
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void ThreadedCommunicator::send_message(Message *message, int dest) {
+    pthread_mutex_lock(&lock);
+    comm->send_message(message, dest);
+    pthread_mutex_unlock(&lock);
+}
+
+void ThreadedCommunicator::send_message_async(Message *message, int dest) {
+    pthread_mutex_lock(&lock);
+    comm->send_message_async(message, dest);
+    pthread_mutex_unlock(&lock);
+}
+
+void ThreadedCommunicator::wait_for_sends() {
+    pthread_mutex_lock(&lock);
+    comm->wait_for_sends();
+    pthread_mutex_unlock(&lock);
+}
+
+/* Collective operations would block the receiver, so it must be stopped */
+Message *ThreadedCommunicator::broadcast_message(Message *message, int root) {
+    if (running) {
+        myfailure("Cannot broadcast while the receiver thread is running");
+    }
+    return comm->broadcast_message(message, root);
+}
+
+vector<Message *> ThreadedCommunicator::gather_messages(Message *message, int root) {
+    if (running) {
+        myfailure("Cannot gather while the receiver thread is running");
+    }
+    return comm->gather_messages(message, root);
+}
+
+void ThreadedCommunicator::barrier() {
+    if (running) {
+        myfailure("Cannot wait at a barrier while the receiver thread is running");
+    }
+    comm->barrier();
+}
+
+/* This does not take the lock because the receiver might be holding it */
+void ThreadedCommunicator::abort(int exitcode) {
+    comm->abort(exitcode);
+}
+
+int ThreadedCommunicator::rank() {
+    return comm->rank();
+}
+
+int ThreadedCommunicator::size() {
+    return comm->size();
+}
+
+unsigned long ThreadedCommunicator::sent() {
+    pthread_mutex_lock(&lock);
+    unsigned long result = comm->sent();
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+unsigned long ThreadedCommunicator::recvd() {
+    pthread_mutex_lock(&lock);
+    unsigned long result = comm->recvd();
+    pthread_mutex_unlock(&lock);
+    return result;
+}
@@ -0,0 +1,71 @@
+#ifndef THREADCOMM_H
+#define THREADCOMM_H
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "comm.h"
+
+// Number of received messages that can wait for the consumer
+#define RECV_QUEUE_SIZE 4096
+
+// Bounds on the time the receiver sleeps between checks for messages in usec
+#define RECV_THREAD_MIN_SLEEP 10
+#define RECV_THREAD_MAX_SLEEP 1000
+
+/*
+ * A communicator that receives and decodes messages in a separate thread
+ * while the thread that owns it does other work. Calls to the underlying
+ * communicator are serialized by a lock, so it only needs to support
+ * threads at the level of MPI_THREAD_SERIALIZED. Received messages are
+ * passed to the consumer through a single producer, single consumer ring
+ * that doesn't need a lock. The consumer sleeps in poll() on a pipe when
+ * the ring is empty, so that it still wakes up on signals like it would
+ * with the underlying communicator. Only one thread may receive.
+ */
+class ThreadedCommunicator : public Communicator {
+private:
+    Communicator *comm;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool running;
+    volatile int stopping;
+
+    // The ring of received messages. head is only written by the
+    // receiver and tail only by the consumer.
+    Message *queue[RECV_QUEUE_SIZE];
+    volatile unsigned long head;
+    volatile unsigned long tail;
+
+    // Set by the consumer when it is about to sleep, so that the
+    // receiver knows to write to the pipe
+    volatile int waiting;
+    int wakeup[2];
+
+    static void *thread_main(void *arg);
+    void run_thread();
+    bool push(Message *message);
+    Message *pop();
+    void drain_wakeup();
+
+public:
+    ThreadedCommunicator(Communicator *comm);
+    virtual ~ThreadedCommunicator();
+    void start();
+    void stop();
+    virtual void send_message(Message *message, int dest);
+    virtual void send_message_async(Message *message, int dest);
+    virtual void wait_for_sends();
+    virtual Message *broadcast_message(Message *message, int root);
+    virtual vector<Message *> gather_messages(Message *message, int root);
+    virtual Message *recv_message(double timeout = 0);
+    virtual bool message_waiting();
+    virtual void barrier();
+    virtual void abort(int exitcode);
+    virtual int rank();
+    virtual int size();
+    virtual unsigned long sent();
+    virtual unsigned long recvd();
+};
+
+#endif /* THREADCOMM_H */
@@ -1,5 +1,7 @@
 #include <string>
 #include <fstream>
+#include <algorithm>
+#include <map>
 #include <errno.h>
 #include <math.h>
 #include <stdio.h>
@@ -10,6 +12,7 @@
 # include <sys/sysctl.h>
 #endif
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <limits.h>
 #include <sstream>
@@ -17,10 +20,14 @@
 #include <libgen.h>
 #ifdef LINUX
 # include <sched.h>
+# include <sys/sendfile.h>
 # ifdef HAS_LIBNUMA
 #  include <numaif.h>
 # endif
 #endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
 
 #include "tools.h"
 #include "failure.h"
@@ -28,6 +35,15 @@
 
 using std::string;
 using std::vector;
+using std::map;
+
+#if defined(LINUX) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+# define HAVE_COPY_FILE_RANGE
+#endif
+
+// Size of the buffer used to copy files when the kernel can't do it
+#define COPY_BUFFER_SIZE (4*1024*1024)
 
 /* purpose: formats ISO 8601 timestamp into given buffer (simplified)
  * paramtr: seconds (IN): time stamp
@@ -93,6 +109,16 @@ double current_time() {
     return ts;
 }
 
+/* Get the user and system CPU time used by this process in seconds */
+double cpu_time() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        myfailures("Unable to get CPU usage");
+    }
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
 
 /* Get the total amount of physical memory in bytes */
 unsigned long get_host_memory() {
@@ -335,6 +361,26 @@ int read_file(const string &file, char *buf, size_t size) {
     return read;
 }
 
+/* Write data with one write() call, which files in /sys and /proc need */
+int write_file(const string &file, const string &data) {
+    int fd = open(file.c_str(), O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ssize_t written = write(fd, data.data(), data.size());
+    int err = errno;
+    if (close(fd) < 0 && written >= 0) {
+        return -1;
+    }
+    if (written < 0) {
+        errno = err;
+        return -1;
+    }
+
+    return written;
+}
+
 string pathfind(const string &file) {
     if (file.size() == 0) {
         return file;
@@ -396,11 +442,31 @@ string filename(const string &path) {
 
 /* Set the cpu affinity to values in bindings */
 int set_cpu_affinity(vector<cpu_t> &bindings) {
+#ifdef LINUX
+    size_t cpusetsize;
+    void *cpuset = alloc_cpu_affinity(bindings, &cpusetsize);
+    if (cpuset == NULL) {
+        return -1;
+    }
+
+    int rc = apply_cpu_affinity(cpuset, cpusetsize);
+    free_cpu_affinity(cpuset);
+    if (rc < 0) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Build the CPU set for bindings without applying it. This allows the
+ * set to be created before a fork and applied in the child with a single
+ * system call. */
+void *alloc_cpu_affinity(vector<cpu_t> &bindings, size_t *size) {
 #ifdef LINUX
     struct cpuinfo c = get_host_cpuinfo();
     cpu_set_t *cpuset = CPU_ALLOC(c.threads);
     if (cpuset == NULL) {
-        return -1;
+        return NULL;
     }
     size_t cpusetsize = CPU_ALLOC_SIZE(c.threads);
     CPU_ZERO_S(cpusetsize, cpuset);
@@ -410,18 +476,35 @@ int set_cpu_affinity(vector<cpu_t> &bindings) {
         if (j >= c.threads) {
             CPU_FREE(cpuset);
             errno = ERANGE;
-            return -1;
+            return NULL;
         }
         CPU_SET_S(j, cpusetsize, cpuset);
     }
 
-    int rc = sched_setaffinity(0, cpusetsize, cpuset);
-    CPU_FREE(cpuset);
-    if (rc < 0) {
-        return -1;
+    *size = cpusetsize;
+    return cpuset;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+/* Apply a CPU set from alloc_cpu_affinity to the calling process */
+int apply_cpu_affinity(const void *cpuset, size_t size) {
+#ifdef LINUX
+    return sched_setaffinity(0, size, (const cpu_set_t *)cpuset);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void free_cpu_affinity(void *cpuset) {
+#ifdef LINUX
+    if (cpuset != NULL) {
+        CPU_FREE((cpu_set_t *)cpuset);
     }
 #endif
-    return 0;
 }
 
 int clear_cpu_affinity() {
@@ -456,3 +539,500 @@ int clear_memory_affinity() {
 #endif
     return 0;
 }
+
+/*
+ * Get the core and socket of each CPU from sysfs, numbered from 0 in the
+ * order they are found. The hyperthreads of a core are not always
+ * numbered next to each other, so this is needed to bind tasks to whole
+ * cores. Returns false if the topology could not be read.
+ */
+bool get_host_topology(cpu_t threads, vector<cpu_t> &cpu_cores, vector<cpu_t> &cpu_sockets) {
+    cpu_cores.clear();
+    cpu_sockets.clear();
+#ifdef LINUX
+    map<int, cpu_t> socket_ids;
+    map<std::pair<int, int>, cpu_t> core_ids;
+    for (unsigned cpu = 0; cpu < threads; cpu++) {
+        char path[256];
+        char buf[32];
+        int package;
+        int core;
+
+        snprintf(path, sizeof(path), 
+                "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+        int size = read_file(path, buf, sizeof(buf) - 1);
+        if (size <= 0) {
+            return false;
+        }
+        buf[size] = '\0';
+        if (sscanf(buf, "%d", &package) != 1) {
+            return false;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/core_id", cpu);
+        size = read_file(path, buf, sizeof(buf) - 1);
+        if (size <= 0) {
+            return false;
+        }
+        buf[size] = '\0';
+        if (sscanf(buf, "%d", &core) != 1) {
+            return false;
+        }
+
+        if (socket_ids.find(package) == socket_ids.end()) {
+            cpu_t id = socket_ids.size();
+            socket_ids[package] = id;
+        }
+        // Core ids are only unique within a package
+        std::pair<int, int> key(package, core);
+        if (core_ids.find(key) == core_ids.end()) {
+            cpu_t id = core_ids.size();
+            core_ids[key] = id;
+        }
+
+        cpu_sockets.push_back(socket_ids[package]);
+        cpu_cores.push_back(core_ids[key]);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Get the names of the GPUs that tasks on this host can use. If
+ * CUDA_VISIBLE_DEVICES is set, then only those devices are used, otherwise
+ * there is one GPU for each /dev/nvidiaN device. The names are the values
+ * that CUDA_VISIBLE_DEVICES should be set to for a task to use each GPU.
+ */
+void get_host_gpus(vector<string> &devices) {
+    devices.clear();
+
+    const char *visible = getenv("CUDA_VISIBLE_DEVICES");
+    if (visible != NULL) {
+        std::istringstream list(visible);
+        string device;
+        while (std::getline(list, device, ',')) {
+            // CUDA stops at the first invalid device, such as -1
+            if (device.empty() || device[0] == '-') {
+                break;
+            }
+            devices.push_back(device);
+        }
+        return;
+    }
+
+    DIR *dir = opendir("/dev");
+    if (dir == NULL) {
+        return;
+    }
+    vector<int> numbers;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int number;
+        char extra;
+        if (sscanf(entry->d_name, "nvidia%d%c", &number, &extra) == 1 && number >= 0) {
+            numbers.push_back(number);
+        }
+    }
+    closedir(dir);
+
+    std::sort(numbers.begin(), numbers.end());
+    for (unsigned i = 0; i < numbers.size(); i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "%d", numbers[i]);
+        devices.push_back(name);
+    }
+}
+
+/* Parse a list of CPUs like "0-3,8,10-11", as used in sysfs */
+bool parse_cpu_list(const string &list, vector<cpu_t> &cpus) {
+    cpus.clear();
+    const char *p = list.c_str();
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        unsigned long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtoul(p, &end, 10);
+            if (end == p || last < first) {
+                return false;
+            }
+            p = end;
+        }
+        if (last > 255) {
+            return false;
+        }
+        for (unsigned long c = first; c <= last; c++) {
+            cpus.push_back(c);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Return the NUMA node that has all of the CPUs in bindings, or -1 if
+ * they span several nodes or the NUMA topology is not known.
+ */
+int get_numa_node(const vector<cpu_t> &bindings) {
+    if (bindings.empty()) {
+        return -1;
+    }
+#ifdef LINUX
+    const char *nodedir = "/sys/devices/system/node";
+    DIR *dir = opendir(nodedir);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int result = -1;
+    struct dirent *entry;
+    while (result < 0 && (entry = readdir(dir)) != NULL) {
+        int node;
+        char extra;
+        if (sscanf(entry->d_name, "node%d%c", &node, &extra) != 1) {
+            continue;
+        }
+
+        char buf[4096];
+        string path = string(nodedir) + "/" + entry->d_name + "/cpulist";
+        int size = read_file(path, buf, sizeof(buf) - 1);
+        if (size < 0) {
+            continue;
+        }
+        buf[size] = '\0';
+
+        vector<cpu_t> cpus;
+        if (!parse_cpu_list(buf, cpus)) {
+            continue;
+        }
+
+        unsigned found = 0;
+        for (unsigned i = 0; i < bindings.size(); i++) {
+            if (std::find(cpus.begin(), cpus.end(), bindings[i]) != cpus.end()) {
+                found++;
+            }
+        }
+        if (found == bindings.size()) {
+            result = node;
+        }
+    }
+
+    closedir(dir);
+    return result;
+#else
+    return -1;
+#endif
+}
+
+/* Build the node mask for node without applying it. Like the CPU set,
+ * this is done before the fork so that the child only makes a system
+ * call. */
+void *alloc_memory_affinity(int node, unsigned long *maxnode) {
+#ifdef HAS_LIBNUMA
+    if (node < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    unsigned long bits = 8 * sizeof(unsigned long);
+    unsigned long words = node / bits + 1;
+    unsigned long *nodemask = (unsigned long *)calloc(words, sizeof(unsigned long));
+    if (nodemask == NULL) {
+        return NULL;
+    }
+    nodemask[node / bits] |= 1UL << (node % bits);
+    // The kernel ignores the last bit of maxnode, like libnuma does
+    *maxnode = words * bits + 1;
+    return nodemask;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+/* Apply a node mask from alloc_memory_affinity to the calling process.
+ * If strict is true, allocations must come from the node, otherwise they
+ * only prefer it. */
+int apply_memory_affinity(const void *nodemask, unsigned long maxnode, bool strict) {
+#ifdef HAS_LIBNUMA
+    return set_mempolicy(strict ? MPOL_BIND : MPOL_PREFERRED,
+            (const unsigned long *)nodemask, maxnode);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void free_memory_affinity(void *nodemask) {
+    free(nodemask);
+}
+
+/* True if the kernel could not copy the data, but read/write would work */
+static bool copy_unsupported(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS || 
+           err == EOPNOTSUPP || err == ENOTSUP;
+}
+
+/*
+ * Copy size bytes from the start of src to dest. If offset is negative
+ * the data is written at the current position of dest, otherwise it
+ * is written at offset without changing the position, so that several
+ * files can be copied into dest at the same time.
+ */
+int copy_file(int src, int dest, off_t offset, size_t size) {
+    size_t done = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    if (offset >= 0) {
+        loff_t inoff = 0;
+        loff_t outoff = offset;
+        while (done < size) {
+            ssize_t rc = copy_file_range(src, &inoff, dest, &outoff, size - done, 0);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc < 0 && copy_unsupported(errno)) {
+                break;
+            }
+            if (rc <= 0) {
+                if (rc == 0) errno = EIO;
+                return -1;
+            }
+            done += rc;
+        }
+    }
+#endif
+#ifdef LINUX
+    if (offset < 0) {
+        off_t inoff = 0;
+        while (done < size) {
+            ssize_t rc = sendfile(dest, src, &inoff, size - done);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc < 0 && copy_unsupported(errno)) {
+                break;
+            }
+            if (rc <= 0) {
+                if (rc == 0) errno = EIO;
+                return -1;
+            }
+            done += rc;
+        }
+    }
+#endif
+
+    if (done == size) {
+        return 0;
+    }
+
+    char *buf = new char[COPY_BUFFER_SIZE];
+    int result = 0;
+    while (done < size) {
+        size_t count = size - done;
+        if (count > COPY_BUFFER_SIZE) {
+            count = COPY_BUFFER_SIZE;
+        }
+        ssize_t rc = pread(src, buf, count, done);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            if (rc == 0) errno = EIO;
+            result = -1;
+            break;
+        }
+        ssize_t written = 0;
+        while (written < rc) {
+            ssize_t w;
+            if (offset >= 0) {
+                w = pwrite(dest, buf + written, rc - written, offset + done + written);
+            } else {
+                w = write(dest, buf + written, rc - written);
+            }
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w < 0) {
+                result = -1;
+                break;
+            }
+            written += w;
+        }
+        if (result < 0) {
+            break;
+        }
+        done += rc;
+    }
+    delete [] buf;
+
+    return result;
+}
+
+struct MergeState {
+    int dest;
+    const vector<string> *srcfiles;
+    vector<off_t> offsets;
+    vector<size_t> sizes;
+    unsigned next;
+    int result;
+    pthread_mutex_t lock;
+};
+
+/* Copy files until there are none left. Run by each merge thread. */
+static void *merge_thread(void *arg) {
+    MergeState *state = (MergeState *)arg;
+    while (true) {
+        pthread_mutex_lock(&state->lock);
+        unsigned i = state->next++;
+        pthread_mutex_unlock(&state->lock);
+        if (i >= state->srcfiles->size()) {
+            break;
+        }
+        if (state->sizes[i] == 0) {
+            continue;
+        }
+
+        const string &srcfile = (*state->srcfiles)[i];
+        int rc = -1;
+        int src = open(srcfile.c_str(), O_RDONLY);
+        if (src < 0) {
+            log_error("Unable to open %s: %s", srcfile.c_str(), strerror(errno));
+        } else {
+            rc = copy_file(src, state->dest, state->offsets[i], state->sizes[i]);
+            if (rc < 0) {
+                log_error("Unable to copy %s: %s", srcfile.c_str(), strerror(errno));
+            }
+            close(src);
+        }
+        if (rc < 0) {
+            pthread_mutex_lock(&state->lock);
+            state->result = -1;
+            pthread_mutex_unlock(&state->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Append the source files to dest in order. Files that don't exist are
+ * skipped. If dest is a regular file, the offset of each file in dest is
+ * computed from the file sizes and up to nthreads files are copied at
+ * the same time. Otherwise, for example if dest is a pipe, the files
+ * are copied one at a time.
+ */
+int merge_files(int dest, const vector<string> &srcfiles, unsigned nthreads) {
+    MergeState state;
+    state.dest = dest;
+    state.srcfiles = &srcfiles;
+    state.next = 0;
+    state.result = 0;
+
+    size_t total = 0;
+    for (unsigned i = 0; i < srcfiles.size(); i++) {
+        struct stat st;
+        if (stat(srcfiles[i].c_str(), &st) < 0) {
+            if (errno != ENOENT) {
+                log_error("Unable to stat %s: %s", srcfiles[i].c_str(), strerror(errno));
+                return -1;
+            }
+            log_warn("No such file: %s", srcfiles[i].c_str());
+            st.st_size = 0;
+        }
+        state.sizes.push_back(st.st_size);
+        total += st.st_size;
+    }
+
+    // Positioned writes are only possible for regular files that are not
+    // opened for append
+    struct stat st;
+    if (fstat(dest, &st) < 0) {
+        return -1;
+    }
+    int flags = fcntl(dest, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+    off_t start = -1;
+    if (S_ISREG(st.st_mode) && !(flags & O_APPEND)) {
+        start = lseek(dest, 0, SEEK_CUR);
+        if (start < 0) {
+            return -1;
+        }
+    }
+
+    off_t offset = start;
+    for (unsigned i = 0; i < srcfiles.size(); i++) {
+        state.offsets.push_back(offset);
+        if (offset >= 0) {
+            offset += state.sizes[i];
+        }
+    }
+
+    if (start < 0 || nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > srcfiles.size()) {
+        nthreads = srcfiles.size();
+    }
+
+    log_debug("Merging %lu bytes from %lu files using %u threads", 
+            (unsigned long)total, (unsigned long)srcfiles.size(), nthreads);
+
+    pthread_mutex_init(&state.lock, NULL);
+    if (nthreads <= 1) {
+        merge_thread(&state);
+    } else {
+        vector<pthread_t> threads(nthreads);
+        unsigned started = 0;
+        for (; started < nthreads; started++) {
+            if (pthread_create(&threads[started], NULL, merge_thread, &state) != 0) {
+                break;
+            }
+        }
+        if (started == 0) {
+            merge_thread(&state);
+        }
+        for (unsigned i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    pthread_mutex_destroy(&state.lock);
+
+    // Anything written to dest later goes after the merged files
+    if (state.result == 0 && start >= 0 && lseek(dest, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    return state.result;
+}
+
+Histogram::Histogram() {
+    for (double b = 0.00001; b < 11; b *= 10) {
+        bounds.push_back(b);
+    }
+    // The last count is for values larger than every bound
+    counts.resize(bounds.size() + 1, 0);
+    count = 0;
+    sum = 0.0;
+}
+
+void Histogram::observe(double value) {
+    unsigned i = 0;
+    while (i < bounds.size() && value > bounds[i]) {
+        i++;
+    }
+    counts[i]++;
+    count++;
+    sum += value;
+}
@@ -24,17 +24,44 @@ struct cpuinfo {
 char * isodate(time_t seconds, char* buffer, size_t size);
 char * iso2date(double seconds_wf, char* buffer, size_t size);
 double current_time();
+double cpu_time();
 void get_host_name(std::string &hostname);
 unsigned long get_host_memory();
 struct cpuinfo get_host_cpuinfo();
+bool get_host_topology(cpu_t threads, std::vector<cpu_t> &cpu_cores, 
+        std::vector<cpu_t> &cpu_sockets);
+void get_host_gpus(std::vector<std::string> &devices);
 int mkdirs(const char *path);
 bool is_executable(const std::string &file);
 std::string pathfind(const std::string &file);
 int read_file(const std::string &file, char *buf, size_t size);
+int write_file(const std::string &file, const std::string &data);
 std::string dirname(const std::string &path);
 std::string filename(const std::string &path);
 int set_cpu_affinity(std::vector<cpu_t> &bindings);
+void *alloc_cpu_affinity(std::vector<cpu_t> &bindings, size_t *size);
+int apply_cpu_affinity(const void *cpuset, size_t size);
+void free_cpu_affinity(void *cpuset);
 int clear_cpu_affinity();
 int clear_memory_affinity();
+bool parse_cpu_list(const std::string &list, std::vector<cpu_t> &cpus);
+int get_numa_node(const std::vector<cpu_t> &bindings);
+void *alloc_memory_affinity(int node, unsigned long *maxnode);
+int apply_memory_affinity(const void *nodemask, unsigned long maxnode, bool strict);
+void free_memory_affinity(void *nodemask);
+int copy_file(int src, int dest, off_t offset, size_t size);
+int merge_files(int dest, const std::vector<std::string> &srcfiles, unsigned nthreads);
+
+/* Durations in seconds counted in buckets from 10us to 10s */
+class Histogram {
+public:
+    std::vector<double> bounds;
+    std::vector<unsigned long> counts;
+    unsigned long count;
+    double sum;
+
+    Histogram();
+    void observe(double value);
+};
 
 #endif /* _TOOLS_H */
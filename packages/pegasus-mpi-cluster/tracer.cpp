@@ -0,0 +1,104 @@
+#include <cerrno>
+#include <cstring>
+
+#include "tracer.h"
+#include "failure.h"
+#include "log.h"
+
+Tracer::Tracer(const string &path) {
+    this->first = true;
+    this->file = fopen(path.c_str(), "w");
+    if (file == NULL) {
+        myfailures("Unable to open trace file %s", path.c_str());
+    }
+    fprintf(file, "[\n");
+}
+
+Tracer::~Tracer() {
+    close();
+}
+
+static void write_json_string(FILE *file, const string &s) {
+    fputc('"', file);
+    for (unsigned i = 0; i < s.length(); i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            fputc('\\', file);
+            fputc(c, file);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+void Tracer::begin_event(const string &name, const char *cat, const char *phase,
+        int pid, int tid, double ts) {
+    if (!first) {
+        fprintf(file, ",\n");
+    }
+    first = false;
+    fprintf(file, "{\"name\":");
+    write_json_string(file, name);
+    fprintf(file, ",\"cat\":\"%s\",\"ph\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.0lf",
+            cat, phase, pid, tid, ts * 1e6);
+}
+
+void Tracer::end_event() {
+    fprintf(file, "}");
+}
+
+/* Record something that took from start to end on one slot */
+void Tracer::span(const string &name, const char *cat, int pid, int tid,
+        double start, double end) {
+    if (file == NULL || start <= 0 || end < start) {
+        return;
+    }
+    begin_event(name, cat, "X", pid, tid, start);
+    fprintf(file, ",\"dur\":%.0lf", (end - start) * 1e6);
+    end_event();
+}
+
+/*
+ * Record something that overlaps with other events of the master, such
+ * as a task waiting in the ready queue. Spans with the same id are
+ * shown on the same track.
+ */
+void Tracer::async_span(const string &name, const char *cat, unsigned id,
+        double start, double end) {
+    if (file == NULL || start <= 0 || end < start) {
+        return;
+    }
+    begin_event(name, cat, "b", 0, 0, start);
+    fprintf(file, ",\"id\":%u", id);
+    end_event();
+    begin_event(name, cat, "e", 0, 0, end);
+    fprintf(file, ",\"id\":%u", id);
+    end_event();
+}
+
+void Tracer::process_name(int pid, const string &name) {
+    if (file == NULL) {
+        return;
+    }
+    if (!first) {
+        fprintf(file, ",\n");
+    }
+    first = false;
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", pid);
+    write_json_string(file, name);
+    fprintf(file, "}}");
+}
+
+void Tracer::close() {
+    if (file == NULL) {
+        return;
+    }
+    fprintf(file, "\n]\n");
+    if (fclose(file) != 0) {
+        log_error("Error closing trace file: %s", strerror(errno));
+    }
+    file = NULL;
+}
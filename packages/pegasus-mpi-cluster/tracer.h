@@ -0,0 +1,33 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <string>
+#include <cstdio>
+
+using std::string;
+
+/*
+ * Writes a trace of the workflow in the Chrome trace event format, which
+ * can be opened in chrome://tracing or Perfetto. Each process in the
+ * trace is an MPI rank, and each thread is a slot. Timestamps are in
+ * seconds since the epoch, as returned by current_time().
+ */
+class Tracer {
+    FILE *file;
+    bool first;
+
+    void begin_event(const string &name, const char *cat, const char *phase,
+            int pid, int tid, double ts);
+    void end_event();
+public:
+    Tracer(const string &path);
+    ~Tracer();
+    void span(const string &name, const char *cat, int pid, int tid,
+            double start, double end);
+    void async_span(const string &name, const char *cat, unsigned id,
+            double start, double end);
+    void process_name(int pid, const string &name);
+    void close();
+};
+
+#endif /* TRACER_H */
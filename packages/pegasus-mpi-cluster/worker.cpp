@@ -9,9 +9,13 @@
 #include <signal.h>
 #include <math.h>
 #include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <stdint.h>
 #include <map>
 #include <poll.h>
 #include <memory>
+#include <algorithm>
 
 #include "worker.h"
 #include "comm.h"
@@ -28,15 +32,205 @@ using std::list;
 
 extern char **environ;
 
+/*
+ * The parts of the libinterpose trace file format that are read for
+ * --monitor-interpose. These have to match tracefile.h in
+ * pegasus-kickstart: a header, then extents claimed by the processes of
+ * the task. Each process writes a chain of extents holding records that
+ * start with their type and size. Paths are stored in string records and
+ * referred to by an id that is local to the chain.
+ */
+#define INTERPOSE_MAGIC 0x5254534b
+#define INTERPOSE_EXTENT_MAGIC 0x5845534b
+#define INTERPOSE_VERSION 2
+#define INTERPOSE_EXTENT (64 * 1024)
+#define INTERPOSE_STRING 1
+#define INTERPOSE_FILE 12
+
+struct InterposeHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t end;
+};
+
+struct InterposeExtent {
+    uint32_t magic;
+    int32_t pid;
+    uint64_t size;
+    uint64_t used;
+    uint64_t next;
+    uint32_t first;
+    uint32_t pad;
+};
+
+struct InterposeRecord {
+    uint16_t type;
+    uint16_t pad;
+    uint32_t size;
+};
+
+// Followed by the NUL-terminated string
+struct InterposeString {
+    InterposeRecord r;
+    uint32_t id;
+    uint32_t length;
+};
+
+struct InterposeFile {
+    InterposeRecord r;
+    uint32_t path;
+    uint32_t pad;
+    uint64_t size;
+    uint64_t bread;
+    uint64_t bwrite;
+};
+
+/* Return the extent at off, or NULL if there is no valid extent there */
+static const InterposeExtent *interpose_extent(const char *data, uint64_t end, uint64_t off) {
+    if (off < INTERPOSE_EXTENT || off % INTERPOSE_EXTENT != 0 ||
+            off + sizeof(InterposeExtent) > end) {
+        return NULL;
+    }
+    const InterposeExtent *e = (const InterposeExtent *)(data + off);
+    if (e->magic != INTERPOSE_EXTENT_MAGIC || e->size < INTERPOSE_EXTENT ||
+            e->size % INTERPOSE_EXTENT != 0 || e->size > end - off) {
+        return NULL;
+    }
+    return e;
+}
+
+/* Add the file records of the chain of extents that starts at off */
+static void read_interpose_stream(const char *data, uint64_t end, uint64_t off,
+        map<string, FileUsage> &files) {
+    vector<const char *> strings;
+    const InterposeExtent *e = interpose_extent(data, end, off);
+    while (e != NULL) {
+        uint64_t used = off + (e->used < e->size ? e->used : e->size);
+        uint64_t roff = off + sizeof(InterposeExtent);
+        while (roff + sizeof(InterposeRecord) <= used) {
+            const InterposeRecord *r = (const InterposeRecord *)(data + roff);
+            if (r->size < sizeof(InterposeRecord) || roff + r->size > used) {
+                return;
+            }
+            if (r->type == INTERPOSE_STRING && r->size > sizeof(InterposeString)) {
+                const InterposeString *s = (const InterposeString *)r;
+                const char *value = data + roff + sizeof(InterposeString);
+                if (s->id <= strings.size() && s->length < r->size - sizeof(InterposeString) &&
+                        value[s->length] == '\0') {
+                    if (s->id == strings.size()) {
+                        strings.push_back(value);
+                    } else {
+                        strings[s->id] = value;
+                    }
+                }
+            } else if (r->type == INTERPOSE_FILE && r->size >= sizeof(InterposeFile)) {
+                const InterposeFile *f = (const InterposeFile *)r;
+                if (f->path < strings.size() && strings[f->path] != NULL) {
+                    FileUsage &u = files[strings[f->path]];
+                    u.path = strings[f->path];
+                    if (f->size > u.size) {
+                        u.size = f->size;
+                    }
+                    u.bread += f->bread;
+                    u.bwrite += f->bwrite;
+                }
+            }
+            roff += r->size;
+        }
+        if (e->next <= off) {
+            return;
+        }
+        off = e->next;
+        e = interpose_extent(data, end, off);
+    }
+}
+
+/* Add the file records of the libinterpose trace file of a task to files */
+static void read_interpose_trace(const string &path, map<string, FileUsage> &files) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_warn("Unable to open trace file %s: %s", path.c_str(), strerror(errno));
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(InterposeHeader)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_warn("Unable to map trace file %s: %s", path.c_str(), strerror(errno));
+        return;
+    }
+
+    const char *data = (const char *)map;
+    const InterposeHeader *header = (const InterposeHeader *)data;
+    if (header->magic != INTERPOSE_MAGIC || header->version != INTERPOSE_VERSION) {
+        log_warn("Trace file %s was not written by a known libinterpose", path.c_str());
+        munmap(map, st.st_size);
+        return;
+    }
+
+    // Extents claimed by a process that died before it set them up are
+    // empty, and are skipped one INTERPOSE_EXTENT at a time
+    uint64_t end = header->end < (uint64_t)st.st_size ? header->end : st.st_size;
+    uint64_t off = INTERPOSE_EXTENT;
+    while (off < end) {
+        const InterposeExtent *e = interpose_extent(data, end, off);
+        if (e == NULL) {
+            off += INTERPOSE_EXTENT;
+            continue;
+        }
+        if (e->first) {
+            read_interpose_stream(data, end, off, files);
+        }
+        off += e->size;
+    }
+
+    munmap(map, st.st_size);
+}
+
 static void log_signal(int signo) {
     log_error("Caught signal %d", signo);
 }
 
-PipeForward::PipeForward(string varname, string filename, int readfd, int writefd) {
+BufferPool::~BufferPool() {
+    for (unsigned i = 0; i < free.size(); i++) {
+        delete [] free[i];
+    }
+}
+
+char *BufferPool::get() {
+    if (free.empty()) {
+        return new char[PIPE_BUFFER_SIZE];
+    }
+    char *buffer = free.back();
+    free.pop_back();
+    return buffer;
+}
+
+void BufferPool::put(char *buffer) {
+    if (free.size() < PIPE_BUFFER_POOL) {
+        free.push_back(buffer);
+    } else {
+        delete [] buffer;
+    }
+}
+
+PipeForward::PipeForward(string varname, string filename, int readfd, int writefd,
+        BufferPool *pool) {
     this->varname = varname;
     this->filename = filename;
     this->readfd = readfd;
     this->writefd = writefd;
+    this->seq = 0;
+    this->stdio = false;
+    this->pool = pool;
+    this->buffer = NULL;
+    this->capacity = 0;
+    this->start = 0;
+    this->end = 0;
 }
 
 PipeForward::~PipeForward() {
@@ -44,30 +238,82 @@ PipeForward::~PipeForward() {
     // deleting them to prevent descriptor leaks
     // in the case of failures
     this->close();
+
+    if (capacity == PIPE_BUFFER_SIZE) {
+        pool->put(buffer);
+    } else {
+        delete [] buffer;
+    }
 }
 
 const char *PipeForward::data() {
-    return this->buffer.data();
+    return this->buffer + this->start;
 }
 
 size_t PipeForward::size() {
-    return this->buffer.size();
+    return this->end - this->start;
 }
 
 string PipeForward::destination() {
     return filename;
 }
 
-void PipeForward::append(char *buff, int size) {
-    this->buffer.append(buff, size);
+/*
+ * Make room for size more bytes at the end of the buffer, first by
+ * moving the data to the front, and then by growing the buffer
+ */
+void PipeForward::reserve(size_t size) {
+    if (buffer == NULL) {
+        buffer = pool->get();
+        capacity = PIPE_BUFFER_SIZE;
+    }
+    if (capacity - end >= size) {
+        return;
+    }
+    size_t used = end - start;
+    if (start > 0) {
+        memmove(buffer, buffer + start, used);
+        start = 0;
+        end = used;
+    }
+    if (capacity - end >= size) {
+        return;
+    }
+    size_t newcapacity = capacity;
+    while (newcapacity - used < size) {
+        newcapacity *= 2;
+    }
+    char *newbuffer = new char[newcapacity];
+    memcpy(newbuffer, buffer, used);
+    if (capacity == PIPE_BUFFER_SIZE) {
+        pool->put(buffer);
+    } else {
+        delete [] buffer;
+    }
+    buffer = newbuffer;
+    capacity = newcapacity;
+}
+
+void PipeForward::append(const char *buff, size_t size) {
+    reserve(size);
+    memcpy(buffer + end, buff, size);
+    end += size;
+}
+
+/* Remove data that has been sent from the front of the buffer */
+void PipeForward::consume(size_t size) {
+    start += size;
+    if (start == end) {
+        start = end = 0;
+    }
 }
 
+/* Read from the pipe straight into the free space at the end of the buffer */
 int PipeForward::read() {
-    char buff[BUFSIZ];
-    int rc = ::read(readfd, buff, BUFSIZ);
+    reserve(PIPE_BUFFER_SIZE / 2);
+    int rc = ::read(readfd, buffer + end, capacity - end);
     if (rc > 0) {
-        // We got some data, save it to the pipe's data buffer
-        this->append(buff, rc);
+        end += rc;
     }
     return rc;
 }
@@ -97,63 +343,144 @@ void PipeForward::closewrite() {
     }
 }
 
-FileForward::FileForward(const string &srcfile, const string &destfile, char *buff, size_t buffsize) {
+FileForward::FileForward(const string &srcfile, const string &destfile, size_t size, int fd) {
     this->srcfile = srcfile;
     this->destfile = destfile;
-    this->buff = buff;
-    this->buffsize = buffsize;
+    this->size = size;
+    this->fd = fd;
+    this->seq = 0;
 }
 
 FileForward::~FileForward() {
-    delete [] buff;
-}
-
-const char *FileForward::data() {
-    return this->buff;
-}
-
-size_t FileForward::size() {
-    return this->buffsize;
-}
-
-string FileForward::destination() {
-    return destfile;
+    if (fd >= 0) {
+        ::close(fd);
+    }
 }
 
-TaskHandler::TaskHandler(Worker *worker, string &name, list<string> &args, string &id, unsigned memory, unsigned cpus, const vector<cpu_t> &bindings, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards) {
+TaskHandler::TaskHandler(Worker *worker, string &name, list<string> &args, string &id, unsigned memory, unsigned cpus, double max_runtime, const vector<cpu_t> &bindings, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards) {
     this->worker = worker;
     this->name = name;
     this->args = args;
     this->id = id;
     this->memory = memory;
     this->cpus = cpus;
+    this->gpus = 0;
+    this->threads = 0;
+    this->max_runtime = max_runtime > 0 ? max_runtime : config.max_runtime;
+    this->timed_out = false;
+    this->killed = false;
     this->bindings = bindings;
     this->pipe_forwards = pipe_forwards;
     this->file_forwards = file_forwards;
+    this->stall = 0.0;
     this->start = 0;
     this->finish = 0;
     this->task_stdout = -1;
     this->task_stderr = -1;
+    this->pid = 0;
+    this->poll_failure = false;
+    this->pidfd = -1;
+    this->exited = false;
+    this->stdout_pipe = NULL;
+    this->stderr_pipe = NULL;
+    this->cpuset = NULL;
+    this->cpusetsize = 0;
+    this->nodemask = NULL;
+    this->maxnode = 0;
+    this->launch_time = 0;
+    this->cancelled = false;
+    this->cgroup_procs = -1;
+    if (!config.trace_file.empty()) {
+        this->trace.resize(TRACE_POINTS, 0.0);
+        this->trace[TRACE_RECEIVED] = current_time();
+    }
 }
 
 TaskHandler::~TaskHandler() {
+    while (!reading.empty()) {
+        stop_reading(reading.begin()->first);
+    }
+    close_pidfd();
+    if (!hostfile.empty()) {
+        unlink(hostfile.c_str());
+    }
+    release_cgroup();
+    release_interpose();
     close_stdio();
+    free_cpu_affinity(cpuset);
+    free_memory_affinity(nodemask);
 
     // Delete all the forwards
     for (unsigned i=0; i<forwards.size(); i++) {
         delete forwards[i];
     }
+    for (unsigned i=0; i<files.size(); i++) {
+        delete files[i];
+    }
+}
+
+/*
+ * Create a pipe for a task. Both ends are closed on exec, so that tasks
+ * launched by other threads of the process, with local workers, do not
+ * keep the pipe open. The task gets its end in child_process().
+ */
+static int task_pipe(int pipefd[2]) {
+#ifdef LINUX
+    return pipe2(pipefd, O_CLOEXEC);
+#else
+    if (pipe(pipefd) < 0) {
+        return -1;
+    }
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+/* Create a pipe that sends task stdout or stderr to the master */
+static PipeForward *stdio_pipe(const string &task, const string &stream, 
+        const string &destination, BufferPool *pool) {
+    int pipefd[2];
+    if (task_pipe(pipefd) < 0) {
+        log_error("Unable to create %s pipe for task %s: %s", stream.c_str(),
+                task.c_str(), strerror(errno));
+        return NULL;
+    }
+    PipeForward *p = new PipeForward(stream, destination, pipefd[0], pipefd[1], pool);
+    p->stdio = true;
+    return p;
 }
 
 int TaskHandler::open_stdio() {
-    // If per-task-stdio is not enabled, then use the global 
-    // task stdout/stderr streams
-    if (!worker->per_task_stdio) {
+    // With rank-stdio, use the task stdout/stderr files of the worker
+    if (!worker->per_task_stdio && config.rank_stdio) {
         task_stdout = worker->out;
         task_stderr = worker->err;
         return 0;
     }
 
+    // If per-task-stdio is not enabled, then task stdout/stderr are 
+    // sent to the master, which writes them to its task stdout/stderr
+    if (!worker->per_task_stdio) {
+        stdout_pipe = stdio_pipe(name, "stdout", IODATA_STDOUT, &worker->buffers);
+        if (stdout_pipe == NULL) {
+            return -1;
+        }
+        pipes.push_back(stdout_pipe);
+        forwards.push_back(stdout_pipe);
+
+        stderr_pipe = stdio_pipe(name, "stderr", IODATA_STDERR, &worker->buffers);
+        if (stderr_pipe == NULL) {
+            return -1;
+        }
+        pipes.push_back(stderr_pipe);
+        forwards.push_back(stderr_pipe);
+
+        task_stdout = stdout_pipe->writefd;
+        task_stderr = stderr_pipe->writefd;
+        return 0;
+    }
+
     // Determine the path to the next stdout/stderr file 
     string basefile = worker->workdir + "/" + name;
     char sequence[10];
@@ -183,7 +510,7 @@ int TaskHandler::open_stdio() {
     string errfile = basefile + ".err." + sequence;
 
     // Open the stdout file
-    task_stdout = open(outfile.c_str(), O_WRONLY|O_CREAT, 0000644);
+    task_stdout = open(outfile.c_str(), O_WRONLY|O_CREAT|O_CLOEXEC, 0000644);
     if (task_stdout < 0) {
         log_error("Task %s: Unable to open task stdout file %s: %s", 
                 name.c_str(), outfile.c_str(), strerror(errno));
@@ -191,7 +518,7 @@ int TaskHandler::open_stdio() {
     }
 
     // Open the stderr file
-    task_stderr = open(errfile.c_str(), O_WRONLY|O_CREAT, 0000644);
+    task_stderr = open(errfile.c_str(), O_WRONLY|O_CREAT|O_CLOEXEC, 0000644);
     if (task_stderr < 0) {
         log_error("Task %s: Unable to open task stderr file %s: %s", 
                 name.c_str(), errfile.c_str(), strerror(errno));
@@ -225,96 +552,260 @@ double TaskHandler::elapsed() {
     return this->finish - this->start;
 }
 
+/* Set name=value in the environment of the task */
+void TaskHandler::set_env(const string &name, const string &value) {
+    string prefix = name + "=";
+    for (unsigned i=0; i<exec_env.size(); i++) {
+        if (exec_env[i].compare(0, prefix.size(), prefix) == 0) {
+            exec_env[i] = prefix + value;
+            return;
+        }
+    }
+    exec_env.push_back(prefix + value);
+}
+
+/**
+ * Prepare everything the child process needs for execve(). This is done
+ * in the parent because the child of vfork() shares our memory and must
+ * not allocate or modify anything.
+ */
+int TaskHandler::prepare_exec() {
+    // Create argument structure
+    exec_args.assign(args.begin(), args.end());
+
+    // If the executable is not an absolute or relative path, then search PATH
+    executable = exec_args[0];
+    if (executable.find("/") == string::npos) {
+        executable = worker->find_executable(executable);
+    }
+    executable = worker->local_path(executable);
+
+    // Variables of this task that are added to the worker's environment.
+    // We need to add env variables for the pipes used to forward I/O from
+    // the task.
+    exec_env.clear();
+    char buf[1024];
+    for (unsigned i=0; i<pipes.size(); i++) {
+        PipeForward *p = pipes[i];
+        if (p->stdio) {
+            continue;
+        }
+        snprintf(buf, sizeof(buf), "%d", p->writefd);
+        set_env(p->varname, buf);
+    }
+
+    // Add other useful environment variables
+    set_env("PMC_TASK", this->name);
+    snprintf(buf, sizeof(buf), "%u", this->memory);
+    set_env("PMC_MEMORY", buf);
+    snprintf(buf, sizeof(buf), "%u", this->cpus);
+    set_env("PMC_CPUS", buf);
+    snprintf(buf, sizeof(buf), "%u", this->gpus);
+    set_env("PMC_GPUS", buf);
+    if (config.thread_env) {
+        set_thread_env();
+    }
+    if (!config.monitor_interpose.empty() && create_interpose_dir() < 0) {
+        return -1;
+    }
+
+    // Tasks that run on several hosts launch themselves on the others
+    if (hosts.size() > 0) {
+        if (write_hostfile() < 0) {
+            return -1;
+        }
+        string env_hosts;
+        for (unsigned i = 0; i < hosts.size(); i++) {
+            if (env_hosts.size() > 0) {
+                env_hosts += ",";
+            }
+            env_hosts += hosts[i];
+        }
+        set_env("PMC_HOSTS", env_hosts);
+        set_env("PMC_HOSTFILE", hostfile);
+    }
+
+    // Tasks only see the GPUs that were allocated to them, so tasks that
+    // did not ask for any must not use the GPUs of the tasks that did
+    if (gpus == 0 && worker->host_gpus.size() > 0) {
+        set_env("CUDA_VISIBLE_DEVICES", "");
+    } else if (gpus > 0) {
+        string devices;
+        for (unsigned i = 0; i < gpu_bindings.size(); i++) {
+            if (gpu_bindings[i] >= worker->host_gpus.size()) {
+                log_error("Invalid GPU %" PRIcpu_t " for task %s", gpu_bindings[i], name.c_str());
+                return -1;
+            }
+            if (devices.size() > 0) {
+                devices += ",";
+            }
+            devices += worker->host_gpus[gpu_bindings[i]];
+        }
+        log_debug("Task %s can use GPUs: %s", this->name.c_str(), devices.c_str());
+        set_env("CUDA_VISIBLE_DEVICES", devices);
+    }
+
+    // For multicore jobs with CPU affinity
+    if (bindings.size() > 0) {
+        string env_bindings;
+        for (vector<cpu_t>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+            snprintf(buf, sizeof(buf), "%" PRIcpu_t, *i);
+            if (env_bindings.size() > 0) {
+                env_bindings += ",";
+            }
+            env_bindings += buf;
+        }
+        set_env("PMC_AFFINITY", env_bindings);
+
+        if (config.set_affinity) {
+            log_debug("Binding task %s to cores: %s", this->name.c_str(), 
+                    env_bindings.c_str());
+            cpuset = alloc_cpu_affinity(bindings, &cpusetsize);
+            if (cpuset == NULL) {
+                log_error("Unable to set cpu affinity for task %s to %s: %s",
+                        name.c_str(), env_bindings.c_str(), strerror(errno));
+            }
+        }
+
+        // Tasks whose CPUs are all on one NUMA node, such as tasks that
+        // fill a socket, can have their memory allocated on that node
+        int node = get_numa_node(bindings);
+        if (node >= 0) {
+            snprintf(buf, sizeof(buf), "%d", node);
+            set_env("PMC_NUMA_NODE", buf);
+
+            if (config.set_affinity && config.memory_affinity != MEMORY_AFFINITY_NONE) {
+                log_debug("Binding memory of task %s to NUMA node %d", 
+                        this->name.c_str(), node);
+                nodemask = alloc_memory_affinity(node, &maxnode);
+                if (nodemask == NULL) {
+                    log_error("Unable to set memory affinity for task %s to node %d: %s",
+                            name.c_str(), node, strerror(errno));
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Tell the threading runtimes in the task how many threads to start, so
+ * that a task that requested N CPUs does not start one thread per core of
+ * the host. Variables the user set for the whole workflow are kept,
+ * unless the task overrides them with --threads. When the task is bound
+ * to its cores, OpenMP threads are pinned to them in order.
+ */
+void TaskHandler::set_thread_env() {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%u", threads > 0 ? threads : (cpus > 0 ? cpus : 1));
+    const char *vars[] = { "OMP_NUM_THREADS", "MKL_NUM_THREADS", "OPENBLAS_NUM_THREADS" };
+    for (unsigned i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+        if (threads > 0 || getenv(vars[i]) == NULL) {
+            set_env(vars[i], buf);
+        }
+    }
+
+    if (config.set_affinity && bindings.size() > 0 &&
+            getenv("OMP_PLACES") == NULL && getenv("OMP_PROC_BIND") == NULL) {
+        string places;
+        for (unsigned i = 0; i < bindings.size(); i++) {
+            snprintf(buf, sizeof(buf), "{%" PRIcpu_t "}", bindings[i]);
+            if (places.size() > 0) {
+                places += ",";
+            }
+            places += buf;
+        }
+        set_env("OMP_PLACES", places);
+        set_env("OMP_PROC_BIND", "close");
+    }
+}
+
+/*
+ * Write the hosts of the task to a hostfile next to the DAG, one host per
+ * line with the number of CPUs the task has on it, in the format used by
+ * mpiexec
+ */
+int TaskHandler::write_hostfile() {
+    hostfile = worker->workdir + "/" + name + ".hosts";
+    FILE *f = fopen(hostfile.c_str(), "w");
+    if (f == NULL) {
+        log_error("Unable to create hostfile %s for task %s: %s", hostfile.c_str(),
+                name.c_str(), strerror(errno));
+        hostfile = "";
+        return -1;
+    }
+    for (unsigned i = 0; i < hosts.size(); i++) {
+        fprintf(f, "%s slots=%" PRIcpu_t "\n", hosts[i].c_str(), cpus);
+    }
+    if (fclose(f) != 0) {
+        log_error("Unable to write hostfile %s for task %s: %s", hostfile.c_str(),
+                name.c_str(), strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Write an error message from the child. This only uses write() because
+ * the child may be sharing memory with the worker. */
+static void child_error(const char *message, const char *name, int err) {
+    const char *parts[] = { message, " for task ", name, ": ", strerror(err), "\n" };
+    for (unsigned i=0; i<sizeof(parts)/sizeof(parts[0]); i++) {
+        if (write(STDERR_FILENO, parts[i], strlen(parts[i])) < 0) {
+            return;
+        }
+    }
+}
+
 /**
  * Do all the operations required for the child process after
- * fork() up to and including execve()
+ * fork() up to and including execve(). Everything has been prepared by
+ * prepare_exec() so that this is safe to call after vfork().
  */
-void TaskHandler::child_process() {
+void TaskHandler::child_process(char **argv, char **envp) {
+    // Put the task in its own process group so that it can be killed
+    // along with any processes it starts
+    if (setpgid(0, 0) < 0) {
+        child_error("Unable to set process group", name.c_str(), errno);
+        _exit(1);
+    }
+
     // Redirect stdout/stderr. We do this first thing so that any
     // of the error messages printed before the execve show up in
     // the task stdout/stderr where they belong. Otherwise, we could
     // end up shipping a lot of error messages to the master process.
     if (dup2(task_stdout, STDOUT_FILENO) < 0) {
-        log_fatal("Error redirecting stdout of task %s: %s", 
-            name.c_str(), strerror(errno));
+        child_error("Error redirecting stdout", name.c_str(), errno);
         _exit(1);
     }
     if (dup2(task_stderr, STDERR_FILENO) < 0) {
-        log_fatal("Error redirecting stderr of task %s: %s", 
-            name.c_str(), strerror(errno));
+        child_error("Error redirecting stderr", name.c_str(), errno);
         _exit(1);
     }
 
     // Close the read end of all the pipes. This should force a
     // SIGPIPE in the case that the parent process closes the read
     // end of the pipe while we are writing to it.
+    // The stdout/stderr pipes are also closed because they were
+    // duplicated above. The descriptors are closed directly because
+    // the PipeForward objects may be shared with the parent.
     for (unsigned i=0; i<pipes.size(); i++) {
-        pipes[i]->closeread();
-    }
-
-    // Create argument structure
-    char **argp = new char*[args.size()+1];
-    int j = 0;
-    for (list<string>::iterator i = args.begin(); i != args.end(); i++) {
-        string arg = *i;
-        char *a = new char[arg.size()+1];
-        strncpy(a, arg.c_str(), arg.size()+1);
-        argp[j++] = a;
-    }
-    argp[j] = NULL;
-
-    // Update environment. We need to add env variables for the pipes used to
-    // forward I/O from the task.
-    for (unsigned i=0; i<pipes.size(); i++) {
-        PipeForward *p = pipes[i];
-        char buf[32];
-        if (snprintf(buf, 32, "%d", p->writefd) >= 32) {
-            log_fatal("Unable to create environment value for pipe forward: %s",
-                      strerror(errno));
-            _exit(1);
-        }
-        if (setenv(p->varname.c_str(), buf, 1) < 0) {
-            log_fatal("Unable to set environment entry for pipe forward: %s",
-                      strerror(errno));
+        close(pipes[i]->readfd);
+        if (pipes[i]->stdio) {
+            close(pipes[i]->writefd);
+        } else if (fcntl(pipes[i]->writefd, F_SETFD, 0) < 0) {
+            // The task writes to the pipe in its environment variable
+            child_error("Unable to pass pipe to task", name.c_str(), errno);
             _exit(1);
         }
     }
 
-    // Add other useful environment variables
-    int rc;
-    char envbuf[1024];
-    int envsz = sizeof(envbuf);
-    if (setenv("PMC_TASK", this->name.c_str(), 1) < 0) {
-        log_fatal("Unable to set environment entry for PMC_TASK: %s", strerror(errno));
-        _exit(1);
-    }
-    rc = snprintf(envbuf, envsz, "%u", this->memory);
-    if (rc < 0 || rc >= envsz || setenv("PMC_MEMORY", envbuf, 1) < 0) {
-        log_fatal("Unable to set environment entry for PMC_MEMORY: %s", strerror(errno));
-        _exit(1);
-    }
-    rc = snprintf(envbuf, envsz, "%u", this->cpus);
-    if (rc < 0 || rc >= envsz || setenv("PMC_CPUS", envbuf, 1) < 0) {
-        log_fatal("Unable to set environment entry for PMC_CPUS: %s", strerror(errno));
-        _exit(1);
-    }
-    rc = snprintf(envbuf, envsz, "%d", this->worker->rank);
-    if (rc < 0 || rc >= envsz || setenv("PMC_RANK", envbuf, 1) < 0) {
-        log_fatal("Unable to set environment entry for PMC_RANK: %s", strerror(errno));
-        _exit(1);
-    }
-    rc = snprintf(envbuf, envsz, "%d", this->worker->host_rank);
-    if (rc < 0 || rc >= envsz || setenv("PMC_HOST_RANK", envbuf, 1) < 0) {
-        log_fatal("Unable to set environment entry for PMC_HOST_RANK: %s", strerror(errno));
+    // Move the task into its cgroup before it can allocate anything
+    if (cgroup_procs >= 0 && write(cgroup_procs, "0", 1) < 0) {
+        child_error("Unable to move task into its cgroup", name.c_str(), errno);
         _exit(1);
     }
 
-    // If the executable is not an absolute or relative path, then search PATH
-    string executable = argp[0];
-    if (executable.find("/") == string::npos) {
-        executable = pathfind(executable);
-    }
-
     // Set strict resource limits
     if (worker->strict_limits && memory > 0) {
         rlim_t bytes = memory * 1024 * 1024;
@@ -325,130 +816,316 @@ void TaskHandler::child_process() {
         // These limits don't always seem to work, so set all of them. In fact,
         // they don't seem to work at all on OS X.
         if (setrlimit(RLIMIT_DATA, &memlimit) < 0) {
-            log_error("Unable to set memory limit (RLIMIT_DATA) for task %s: %s",
-                name.c_str(), strerror(errno));
+            child_error("Unable to set memory limit (RLIMIT_DATA)", name.c_str(), errno);
         }
         if (setrlimit(RLIMIT_STACK, &memlimit) < 0) {
-            log_error("Unable to set memory limit (RLIMIT_STACK) for task %s: %s",
-                name.c_str(), strerror(errno));
+            child_error("Unable to set memory limit (RLIMIT_STACK)", name.c_str(), errno);
         }
         if (setrlimit(RLIMIT_RSS, &memlimit) < 0) {
-            log_error("Unable to set memory limit (RLIMIT_RSS) for task %s: %s",
-                name.c_str(), strerror(errno));
+            child_error("Unable to set memory limit (RLIMIT_RSS)", name.c_str(), errno);
         }
         if (setrlimit(RLIMIT_AS, &memlimit) < 0) {
-            log_error("Unable to set memory limit (RLIMIT_AS) for task %s: %s",
-                name.c_str(), strerror(errno));
+            child_error("Unable to set memory limit (RLIMIT_AS)", name.c_str(), errno);
         }
     }
 
-    // For multicore jobs with CPU affinity
-    if (bindings.size() > 0) {
-
-        // Set environment variable
-        unsigned off = 0;
-        char env_bindings[1024];
-        for (vector<cpu_t>::iterator i = bindings.begin(); i != bindings.end(); i++) {
-            cpu_t core = *i;
-            off += snprintf(env_bindings + off, sizeof(env_bindings) - off, "%" PRIcpu_t ",", core);
-        }
-        env_bindings[off-1] = '\0';
-        setenv("PMC_AFFINITY", env_bindings, 1);
+    // Set the cpu affinity
+    if (cpuset != NULL && apply_cpu_affinity(cpuset, cpusetsize) < 0) {
+        child_error("Unable to set cpu affinity", name.c_str(), errno);
+    }
 
-        // Set the cpu affinity
-        if (config.set_affinity) {
-            log_debug("Binding task %s to cores: %s", this->name.c_str(), env_bindings);
-            if (set_cpu_affinity(bindings) < 0) {
-                log_error("Unable to set cpu affinity for task %s to %s: %s",
-                        name.c_str(), env_bindings, strerror(errno));
-            }
-        }
+    // Set the memory affinity
+    if (nodemask != NULL && apply_memory_affinity(nodemask, maxnode,
+                config.memory_affinity == MEMORY_AFFINITY_BIND) < 0) {
+        child_error("Unable to set memory affinity", name.c_str(), errno);
     }
 
     // Exec process
-    execve(executable.c_str(), argp, environ);
-    fprintf(stderr, "Unable to exec command %s for task %s: %s\n", 
-        executable.c_str(), name.c_str(), strerror(errno));
+    execve(executable.c_str(), argv, envp);
+    child_error("Unable to exec command", name.c_str(), errno);
     _exit(1);
 }
 
-/* Send all I/O forwarded data to master */
-void TaskHandler::send_io_data() {
-    for (unsigned i = 0; i < this->forwards.size(); i++) {
-        Forward *f = this->forwards[i];
-        log_trace("Task %s: Forward %s got %d bytes", name.c_str(), 
-                f->destination().c_str(), f->size());
-
-        // Don't bother to send the message if there is no data
-        if (f->size() == 0) {
-            continue;
+/*
+ * Send all I/O forwarded data to master. The last chunk of each file is
+ * only sent once all of the files have been read, and if one of them
+ * cannot be read, then the files are aborted instead, so that the master
+ * does not write any of them. The pipes go last because sending them
+ * cannot fail, and their data must not be written if the task fails.
+ */
+int TaskHandler::send_io_data() {
+    int result = 0;
+    if (config.direct_forwards) {
+        result = write_files_direct();
+    } else {
+        for (unsigned i = 0; i < this->files.size() && result == 0; i++) {
+            result = send_file(this->files[i]);
+        }
+        for (unsigned i = 0; i < this->files.size(); i++) {
+            finish_file(this->files[i], result == 0);
         }
-
-        IODataMessage iodata(this->name, f->destination(), f->data(), f->size());
-        worker->comm->send_message(&iodata, 0);
     }
-}
+    if (result < 0) {
+        return -1;
+    }
 
-/* unlink() all I/O forwarded files */
-void TaskHandler::delete_files() {
-    map<string,string>::iterator i;
-    for (i = file_forwards.begin(); i != file_forwards.end(); i++) {
-        string srcfile = i->first;
-        if (unlink(srcfile.c_str())) {
-            log_debug("Task %s: Error unlinking forwarded file %s: %s", 
-                    name.c_str(), srcfile.c_str(), strerror(errno));
+    for (unsigned i = 0; i < this->pipes.size(); i++) {
+        if (!this->pipes[i]->stdio) {
+            send_pipe(this->pipes[i]);
         }
     }
+
+    return 0;
 }
 
-/* Read all I/O forwarded files into memory */
-int TaskHandler::read_file_data() {
-    map<string,string>::iterator i;
-    for (i = file_forwards.begin(); i != file_forwards.end(); i++) {
-        string srcfile = i->first;
-        string destfile = i->second;
+/*
+ * With --direct-forwards, copy the forwarded files straight into regions
+ * of the destination files that the master reserved, and tell the master
+ * when they have been written. The master commits the regions of each
+ * file in order. A file that cannot be written here is sent to the
+ * master, which writes it into the region.
+ */
+int TaskHandler::write_files_direct() {
+    vector<FileForward *> forwards;
+    vector<string> filenames;
+    vector<unsigned long long> sizes;
+    for (unsigned i = 0; i < files.size(); i++) {
+        if (files[i]->size > 0) {
+            forwards.push_back(files[i]);
+            filenames.push_back(files[i]->destfile);
+            sizes.push_back(files[i]->size);
+        }
+    }
+    if (forwards.empty()) {
+        return 0;
+    }
 
-        // Make sure the file exists
-        struct stat st;
-        if (stat(srcfile.c_str(), &st)) {
-            if (errno == ENOENT) {
-                // If the file does not exist, then we just skip it. We assume that
-                // the user wants to have some tasks exit successfully without 
-                // producing any output data.
-                log_debug("Task %s: file %s does not exist", name.c_str(), 
-                        srcfile.c_str());
-                continue;
+    worker->send_to_master(new ReserveMessage(name, filenames, sizes));
+    vector<unsigned long long> offsets = worker->wait_for_region();
+
+    int result = 0;
+    for (unsigned i = 0; i < forwards.size() && result == 0; i++) {
+        FileForward *file = forwards[i];
+        log_trace("Task %s: Writing %lu bytes of %s to %s at offset %llu", name.c_str(),
+                (unsigned long)file->size, file->srcfile.c_str(), file->destfile.c_str(),
+                offsets[i]);
+
+        bool written = false;
+        int dest = open(file->destfile.c_str(), O_WRONLY|O_CREAT, 0666);
+        if (dest < 0) {
+            log_error("Task %s: Unable to open %s: %s", name.c_str(), 
+                    file->destfile.c_str(), strerror(errno));
+        } else {
+            written = copy_file(file->fd, dest, offsets[i], file->size) == 0;
+            if (!written) {
+                log_error("Task %s: Unable to write %s to %s: %s", name.c_str(), 
+                        file->srcfile.c_str(), file->destfile.c_str(), strerror(errno));
+            }
+            if (close(dest) < 0 && written) {
+                log_error("Task %s: Unable to close %s: %s", name.c_str(), 
+                        file->destfile.c_str(), strerror(errno));
+                written = false;
             }
-            log_error("Task %s: stat failed on file %s: %s", 
-                    name.c_str(), srcfile.c_str(), strerror(errno));
-            return -1;
         }
 
-        // Make sure it is a regular file
-        if (!S_ISREG(st.st_mode)) {
-            log_error("Task %s: %s is not a file", name.c_str(), srcfile.c_str());
-            return -1;
+        // The master writes the data into the region instead
+        if (!written) {
+            log_warn("Task %s: Sending %s to the master", name.c_str(), file->srcfile.c_str());
+            result = send_file(file);
+            finish_file(file, result == 0);
         }
+    }
 
-        // Check the size of the file
-        size_t size = st.st_size;
-        if (size > 1024*1024) {
-            log_error("Task %s: File %s is too large", name.c_str(), srcfile.c_str());
-            return -1;
+    worker->send_to_master(new CommitMessage(name, result == 0));
+    return result;
+}
+
+/* Send task stdout/stderr to the master whether the task succeeded or not */
+void TaskHandler::send_stdio() {
+    if (stdout_pipe != NULL) {
+        send_pipe(stdout_pipe);
+    }
+    if (stderr_pipe != NULL) {
+        send_pipe(stderr_pipe);
+    }
+}
+
+/* Send the data that is left in a pipe after the task exits */
+void TaskHandler::send_pipe(PipeForward *pipe) {
+    log_trace("Task %s: Forward %s got %d bytes", name.c_str(), 
+            pipe->destination().c_str(), pipe->size());
+
+    // The rest of a streamed pipe is sent as the last chunk, even if
+    // it is empty, because the last chunk commits the earlier ones
+    if (pipe->seq > 0) {
+        stall += worker->wait_for_credit();
+        worker->send_to_master(new IODataMessage(this->name, pipe->destination(),
+                    pipe->data(), pipe->size(), pipe->seq, true, !pipe->stdio));
+        return;
+    }
+
+    // Don't bother to send the message if there is no data
+    if (pipe->size() == 0) {
+        return;
+    }
+
+    send_data(pipe->destination(), pipe->data(), pipe->size());
+}
+
+/* Send data from memory, in chunks if it is too large for one message */
+void TaskHandler::send_data(const string &destination, const char *data, size_t size) {
+    // With --master-memory, every message needs credit
+    bool chunked = size > IODATA_CHUNK_SIZE;
+    bool credited = chunked || config.master_memory > 0;
+    unsigned seq = 0;
+    size_t sent = 0;
+    while (sent < size) {
+        size_t chunk = size - sent;
+        if (chunk > IODATA_CHUNK_SIZE) {
+            chunk = IODATA_CHUNK_SIZE;
         }
+        if (credited) {
+            stall += worker->wait_for_credit();
+        }
+        worker->send_to_master(new IODataMessage(this->name, destination,
+                    data + sent, chunk, seq++, sent + chunk == size));
+        sent += chunk;
+    }
+}
 
-        // Read the data into a buffer
-        char *buff = new char[size];
-        if (read_file(srcfile, buff, size) != (int)size) {
-            log_error("Task %s: Unable to read %s: %s", name.c_str(), srcfile.c_str(), 
-                    strerror(errno));
-            delete[] buff;
+/*
+ * Send full chunks of pipe data while the task is running. The master
+ * holds on to them until it knows whether the task succeeded, except
+ * for stdout/stderr, which are kept either way.
+ */
+void TaskHandler::stream_pipe(PipeForward *pipe) {
+    while (pipe->size() >= IODATA_CHUNK_SIZE) {
+        stall += worker->wait_for_credit();
+        worker->send_to_master(new IODataMessage(this->name, pipe->destination(),
+                    pipe->data(), IODATA_CHUNK_SIZE, pipe->seq++, false, !pipe->stdio));
+        pipe->consume(IODATA_CHUNK_SIZE);
+    }
+}
+
+/*
+ * Read a forwarded file one chunk at a time and send it to the master.
+ * The last chunk is kept in the FileForward and sent by finish_file().
+ */
+int TaskHandler::send_file(FileForward *file) {
+    log_trace("Task %s: Forward %s got %lu bytes", name.c_str(), 
+            file->destfile.c_str(), (unsigned long)file->size);
+
+    bool chunked = file->size > IODATA_CHUNK_SIZE;
+    size_t sent = 0;
+    while (sent < file->size) {
+        size_t chunk = file->size - sent;
+        if (chunk > IODATA_CHUNK_SIZE) {
+            chunk = IODATA_CHUNK_SIZE;
+        }
+
+        file->tail.resize(chunk);
+        size_t got = 0;
+        while (got < chunk) {
+            ssize_t rc = read(file->fd, &file->tail[got], chunk - got);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc <= 0) {
+                log_error("Task %s: Unable to read %s: %s", name.c_str(), 
+                        file->srcfile.c_str(), rc == 0 ? "file is truncated" : strerror(errno));
+                return -1;
+            }
+            got += rc;
+        }
+
+        sent += chunk;
+        if (sent == file->size) {
+            break;
+        }
+        if (chunked || config.master_memory > 0) {
+            stall += worker->wait_for_credit();
+        }
+        worker->send_to_master(new IODataMessage(this->name, file->destfile,
+                    file->tail.data(), chunk, file->seq++, false));
+    }
+
+    return 0;
+}
+
+/*
+ * Send the last chunk of a forwarded file, or, if the data of the task
+ * is not going to be committed, tell the master to throw away the chunks
+ * that were already sent.
+ */
+void TaskHandler::finish_file(FileForward *file, bool commit) {
+    bool chunked = file->size > IODATA_CHUNK_SIZE;
+    if (commit && file->size > 0) {
+        if (chunked || config.master_memory > 0) {
+            stall += worker->wait_for_credit();
+        }
+        worker->send_to_master(new IODataMessage(this->name, file->destfile,
+                    file->tail.data(), file->tail.size(), file->seq++, true));
+    } else if (!commit && file->seq > 0) {
+        stall += worker->wait_for_credit();
+        worker->send_to_master(new IODataMessage(this->name, file->destfile,
+                    "", 0, file->seq++, true, false, true));
+    }
+    file->tail.clear();
+}
+
+/* unlink() all I/O forwarded files */
+void TaskHandler::delete_files() {
+    map<string,string>::iterator i;
+    for (i = file_forwards.begin(); i != file_forwards.end(); i++) {
+        string srcfile = i->first;
+        if (unlink(srcfile.c_str())) {
+            log_debug("Task %s: Error unlinking forwarded file %s: %s", 
+                    name.c_str(), srcfile.c_str(), strerror(errno));
+        }
+    }
+}
+
+/*
+ * Find and open all the I/O forwarded files, so that a file that cannot
+ * be opened fails the task before any of the data is sent. They are read
+ * when they are sent.
+ */
+int TaskHandler::check_file_data() {
+    map<string,string>::iterator i;
+    for (i = file_forwards.begin(); i != file_forwards.end(); i++) {
+        string srcfile = i->first;
+        string destfile = i->second;
+
+        // A FIFO must not block the worker; it fails the check below
+        int fd = open(srcfile.c_str(), O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENOENT) {
+                // If the file does not exist, then we just skip it. We assume that
+                // the user wants to have some tasks exit successfully without 
+                // producing any output data.
+                log_debug("Task %s: file %s does not exist", name.c_str(), 
+                        srcfile.c_str());
+                continue;
+            }
+            log_error("Task %s: Unable to open %s: %s", name.c_str(), 
+                    srcfile.c_str(), strerror(errno));
             return -1;
         }
 
-        FileForward *fwd = new FileForward(srcfile, destfile, buff, size);
+        // Make sure it is a regular file
+        FileForward *fwd = new FileForward(srcfile, destfile, 0, fd);
         files.push_back(fwd);
-        forwards.push_back(fwd);
+        struct stat st;
+        if (fstat(fd, &st)) {
+            log_error("Task %s: stat failed on file %s: %s", 
+                    name.c_str(), srcfile.c_str(), strerror(errno));
+            return -1;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            log_error("Task %s: %s is not a file", name.c_str(), srcfile.c_str());
+            return -1;
+        }
+        fwd->size = st.st_size;
     }
 
     return 0;
@@ -456,12 +1133,19 @@ int TaskHandler::read_file_data() {
 
 /* Send info about the task back to the master */
 void TaskHandler::send_result() {
-    ResultMessage res(this->name, this->status, this->elapsed());
-    worker->comm->send_message(&res, 0);
+    if (!trace.empty()) {
+        trace[TRACE_SENT] = current_time();
+    }
+    worker->send_to_master(new ResultMessage(this->name, this->status, this->elapsed(),
+                this->launch_time, this->timed_out, this->trace, this->usage, this->start,
+                this->file_usage, this->stall));
+
+    // Don't make the master wait for the rest of the batch
+    worker->send_outbox();
 }
 
-/* Fork the task and wait for it to exit */
-int TaskHandler::run_process() {
+/* Create the pipes and fork the task without waiting for it */
+int TaskHandler::launch() {
 
     // Record start time of task
     this->start = current_time();
@@ -471,19 +1155,64 @@ int TaskHandler::run_process() {
         string varname = i->first;
         string filename = i->second;
         int pipefd[2];
-        if (pipe(pipefd) < 0) {
+        if (task_pipe(pipefd) < 0) {
             log_error("Unable to create pipe for task %s: %s",
                     name.c_str(), strerror(errno));
             return -1;
         }
         log_trace("Pipe: %s = %s", varname.c_str(), filename.c_str());
-        PipeForward *p = new PipeForward(varname, filename, pipefd[0], pipefd[1]);
+#ifdef F_SETPIPE_SZ
+        // A bigger pipe lets the task keep writing while a chunk is sent
+        if (config.stream_pipes && fcntl(pipefd[0], F_SETPIPE_SZ, IODATA_CHUNK_SIZE) < 0) {
+            log_debug("Unable to set size of pipe %s: %s", varname.c_str(), 
+                    strerror(errno));
+        }
+#endif
+        PipeForward *p = new PipeForward(varname, filename, pipefd[0], pipefd[1],
+                &worker->buffers);
         pipes.push_back(p);
         forwards.push_back(p);
     }
 
-    // Fork a child process to execute the task
-    pid_t pid = fork();
+    if (prepare_exec() < 0) {
+        return -1;
+    }
+    if (!config.cgroup_dir.empty() && create_cgroup() < 0) {
+        return -1;
+    }
+    vector<char *> argv;
+    for (unsigned i=0; i<exec_args.size(); i++) {
+        argv.push_back(const_cast<char *>(exec_args[i].c_str()));
+    }
+    argv.push_back(NULL);
+    vector<char *> envp;
+    const vector<string> &base_env = worker->task_environment();
+    for (unsigned i=0; i<base_env.size(); i++) {
+        const string &var = base_env[i];
+        size_t len = var.find('=');
+        len = len == string::npos ? var.size() : len + 1;
+        bool replaced = false;
+        for (unsigned j=0; j<exec_env.size() && !replaced; j++) {
+            replaced = exec_env[j].compare(0, len, var, 0, len) == 0;
+        }
+        if (!replaced) {
+            envp.push_back(const_cast<char *>(var.c_str()));
+        }
+    }
+    for (unsigned i=0; i<exec_env.size(); i++) {
+        envp.push_back(const_cast<char *>(exec_env[i].c_str()));
+    }
+    envp.push_back(NULL);
+
+    // Fork a child process to execute the task. With vfork() the worker
+    // is suspended until the child calls execve(), so launch_time includes
+    // the exec, but no copy of the worker's address space is made.
+    double before = current_time();
+    if (config.vfork) {
+        pid = vfork();
+    } else {
+        pid = fork();
+    }
     if (pid < 0) {
         // Fork failed
         log_error("Unable to fork task %s: %s", name.c_str(), strerror(errno));
@@ -491,7 +1220,23 @@ int TaskHandler::run_process() {
     }
 
     if (pid == 0) {
-        child_process();
+        child_process(&argv[0], &envp[0]);
+    }
+
+    double after = current_time();
+    this->launch_time = after - before;
+    log_trace("Launched task %s in %f seconds", name.c_str(), launch_time);
+    if (!trace.empty()) {
+        trace[TRACE_LAUNCH] = start;
+        trace[TRACE_FORKED] = after;
+    }
+
+    // This is also done in the child. Doing it here as well makes sure the
+    // process group exists before we try to signal it. It fails if the
+    // child has already called execve, but then the child has done it.
+    if (setpgid(pid, pid) < 0 && errno != EACCES) {
+        log_debug("Unable to set process group of task %s: %s", name.c_str(), 
+                strerror(errno));
     }
 
     // Close the write end of all the pipes
@@ -499,120 +1244,153 @@ int TaskHandler::run_process() {
         pipes[i]->closewrite();
     }
 
-    // Create a structure to hold all of the pipes
-    // we need to read from
-    map<int, PipeForward *> reading;
+    // Keep track of all the pipes we need to read from
     for (unsigned i=0; i<pipes.size(); i++) {
         reading[pipes[i]->readfd] = pipes[i];
+        worker->watch(pipes[i]->readfd, this);
     }
 
-    bool poll_failure = false;
-    std::vector<struct pollfd> fds(pipe_forwards.size());
-
-    // TODO Refactor the pipe/polling into another method
-
-    // While there are pipes to read from
-    while (reading.size() > 0) {
+    // Find out when the task exits without calling waitpid()
+    pidfd = open_pidfd(pid);
+    if (pidfd >= 0) {
+        worker->watch(pidfd, this);
+    }
 
-        // Set up inputs for poll()
-        int nfds = 0;
-        for (map<int, PipeForward *>::iterator p=reading.begin(); p!=reading.end(); p++) {
-            PipeForward *pipe = (*p).second;
-            fds[nfds].fd = pipe->readfd;
-            fds[nfds].events = POLLIN;
-            nfds++;
-        }
+    return 0;
+}
 
-        log_trace("Polling %d pipes", nfds);
+/* True if all of the pipes have been closed, or reading them failed */
+bool TaskHandler::pipes_done() {
+    return reading.empty() || poll_failure;
+}
 
-        int timeout = -1;
-        int rc = poll(&fds[0], nfds, timeout);
-        if (rc <= 0) {
-            // If this happens then we are in trouble. The only thing we
-            // can do is log it and break out of the loop. What should happen
-            // then is that we close all the pipes, which will force the child
-            // to get SIGPIPE and fail.
-            log_error("poll() failed for task %s: %s", name.c_str(), 
-                      strerror(errno));
-            poll_failure = true;
-            goto after_poll_loop;
-        }
+/* Stop polling the pipe fd, which has been closed or failed */
+void TaskHandler::stop_reading(int fd) {
+    worker->unwatch(fd);
+    reading.erase(fd);
+}
 
-        // One or more of the file descriptors are readable, find out which ones
-        for (int i=0; i<nfds; i++) {
-            int revents = fds[i].revents;
-            int fd = fds[i].fd;
+void TaskHandler::close_pidfd() {
+    if (pidfd >= 0) {
+        worker->unwatch(pidfd);
+        close(pidfd);
+        pidfd = -1;
+    }
+}
 
-            // This descriptor has no events 
-            if (revents == 0) {
-                continue;
-            }
+/* Handle an event from the poller on one of the pipes or the pidfd */
+void TaskHandler::handle_event(int fd, short revents) {
+    if (fd == pidfd) {
+        // The task exited. The pidfd stays readable, so stop polling it.
+        exited = true;
+        close_pidfd();
+        return;
+    }
 
-            if (revents & POLLIN) {
-                rc = reading[fd]->read();
-                if (rc < 0) {
-                    // If this happens we have a serious problem and need the
-                    // task to fail. Cause the failure by breaking out of the
-                    // loop and closing the pipes.
-                    log_error("Error reading from pipe %d: %s", 
-                              fd, strerror(errno));
-                    poll_failure = true;
-                    goto after_poll_loop;
-                } else if (rc == 0) {
-                    // Pipe was closed, EOF. Stop polling it.
-                    log_trace("Pipe %d closed", fd);
-                    reading.erase(fd);
-                } else {
-                    log_trace("Read %d bytes from pipe %d", rc, fd);
-                }
-            }
+    // The pipe may have been closed after a failure
+    if (poll_failure || reading.find(fd) == reading.end()) {
+        return;
+    }
 
-            if (revents & POLLHUP) {
-                log_trace("Hangup on pipe %d", fd);
-                // It is important that we don't stop reading the fd here
-                // because in the next poll we may get more data if our
-                // buffer wasn't big enough to get everything on this read.
-                // However, on Linux, if POLLIN was not set, then the pipe
-                // is really closed and we need to clean it up here.
-                if (! (revents & POLLIN)) {
-                    reading.erase(fd);
-                }
+    if (revents & POLLIN) {
+        int rc = reading[fd]->read();
+        if (rc < 0) {
+            // If this happens we have a serious problem and need the
+            // task to fail. Cause the failure by breaking out of the
+            // loop and closing the pipes.
+            log_error("Error reading from pipe %d: %s", 
+                      fd, strerror(errno));
+            poll_failure = true;
+            return;
+        } else if (rc == 0) {
+            // Pipe was closed, EOF. Stop polling it.
+            log_trace("Pipe %d closed", fd);
+            stop_reading(fd);
+            return;
+        } else {
+            log_trace("Read %d bytes from pipe %d", rc, fd);
+            if (config.stream_pipes || reading[fd]->stdio) {
+                stream_pipe(reading[fd]);
             }
+        }
+    }
 
-            if (revents & POLLERR) {
-                // I don't know what would cause this. I think possibly it can
-                // only happen for hardware devices and not pipes. In case it
-                // does happen we will log it here and fail the task.
-                log_error("Error on pipe %d", fd);
-                poll_failure = true;
-                goto after_poll_loop;
-            }
+    if (revents & POLLHUP) {
+        log_trace("Hangup on pipe %d", fd);
+        // It is important that we don't stop reading the fd here
+        // because in the next poll we may get more data if our
+        // buffer wasn't big enough to get everything on this read.
+        // However, on Linux, if POLLIN was not set, then the pipe
+        // is really closed and we need to clean it up here.
+        if (! (revents & POLLIN)) {
+            stop_reading(fd);
         }
     }
 
-after_poll_loop:
+    if (revents & POLLERR) {
+        // I don't know what would cause this. I think possibly it can
+        // only happen for hardware devices and not pipes. In case it
+        // does happen we will log it here and fail the task.
+        log_error("Error on pipe %d", fd);
+        poll_failure = true;
+    }
+}
+
+/*
+ * Collect the exit status of the task. If options is WNOHANG and the
+ * task is still running, then this returns false.
+ */
+bool TaskHandler::reap(int options) {
     // Close the pipes here just in case something happens above 
     // so that we aren't deadlocked waiting for a process that is itself 
     // deadlocked waiting for us to read data off the pipe. Instead, 
     // if we close the pipes here, then the task will get SIGPIPE and we 
     // can wait on it successfully.
-    for (unsigned i=0; i<pipes.size(); i++) {
-        pipes[i]->close();
+    if (pipes_done()) {
+        while (!reading.empty()) {
+            stop_reading(reading.begin()->first);
+        }
+        for (unsigned i=0; i<pipes.size(); i++) {
+            pipes[i]->close();
+        }
     }
 
     // Wait for task to complete
     int exitcode;
-    if (waitpid(pid, &exitcode, 0) < 0) {
+    struct rusage ru;
+    pid_t rc = wait4(pid, &exitcode, options, &ru);
+    if (rc == 0) {
+        return false;
+    }
+    if (rc < 0) {
         log_error("Failed waiting for task %s: %s", name.c_str(), 
                 strerror(errno));
-        return -1;
+        this->status = -1;
+        return true;
     }
+    close_pidfd();
 
     // Record the finish time of the task
     this->finish = current_time();
+    if (!trace.empty()) {
+        trace[TRACE_EXITED] = finish;
+    }
 
     double runtime = elapsed();
 
+    // ru_maxrss is in bytes on Darwin and KB everywhere else
+#ifdef DARWIN
+    usage.maxrss = ru.ru_maxrss / 1024;
+#else
+    usage.maxrss = ru.ru_maxrss;
+#endif
+    usage.utime = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1.0e6;
+    usage.stime = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1.0e6;
+    usage.inblock = ru.ru_inblock;
+    usage.oublock = ru.ru_oublock;
+    release_cgroup();
+    release_interpose();
+
     if (WIFEXITED(exitcode)) {
         log_debug("Task %s exited with status %d (%d) in %f seconds", 
             name.c_str(), WEXITSTATUS(exitcode), exitcode, runtime);
@@ -621,13 +1399,244 @@ after_poll_loop:
             name.c_str(), WTERMSIG(exitcode), exitcode, runtime);
     }
 
-    // We have to wait till here to return in the case of poll_failure
+    // We have to wait till here to fail in the case of poll_failure
     // because we need to wait() on the task
-    if (poll_failure) {
+    this->status = poll_failure ? -1 : exitcode;
+    return true;
+}
+
+/* Fork the task and wait for it to exit */
+int TaskHandler::run_process() {
+    if (launch() < 0) {
         return -1;
     }
 
-    return exitcode;
+    // While there are pipes to read from
+    while (!pipes_done()) {
+        // Wake up in time to enforce the runtime limit
+        int timeout = -1;
+        double now = current_time();
+        double next = check_runtime(now);
+        if (next > 0) {
+            timeout = (int)ceil((next - now) * 1000);
+        }
+        if (worker->poll_tasks(timeout) < 0) {
+            // If this happens then we are in trouble. The only thing we
+            // can do is log it and break out of the loop. What should happen
+            // then is that we close all the pipes, which will force the child
+            // to get SIGPIPE and fail.
+            log_error("Polling failed for task %s: %s", name.c_str(), 
+                      strerror(errno));
+            poll_failure = true;
+            break;
+        }
+    }
+
+    // A task with a runtime limit may close its pipes and keep running
+    if (max_runtime > 0) {
+        while (!reap(WNOHANG)) {
+            double now = current_time();
+            double next = check_runtime(now);
+            if (pidfd < 0) {
+                usleep(WORKER_POLL_INTERVAL * 1000);
+                continue;
+            }
+            int timeout = -1;
+            if (next > 0) {
+                timeout = (int)ceil((next - now) * 1000);
+            }
+            if (worker->poll_tasks(timeout) < 0) {
+                usleep(WORKER_POLL_INTERVAL * 1000);
+            }
+        }
+    } else {
+        reap(0);
+    }
+
+    return this->status;
+}
+
+/*
+ * Start the task without waiting for it to finish. Returns false if the
+ * task could not be started, in which case it is already finished.
+ */
+bool TaskHandler::begin() {
+    if (open_stdio()) {
+        this->status = 256;
+        return false;
+    }
+    if (launch() < 0) {
+        this->status = -1;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Create a cgroup that limits the memory of the task to what it was given
+ * by the master. Swap is disabled, if the kernel supports it, so that a
+ * task that goes over its limit is killed instead of slowing down the
+ * other tasks on the host. Tasks without memory get a cgroup without a
+ * limit, which still counts their peak memory and OOM kills.
+ */
+int TaskHandler::create_cgroup() {
+    static unsigned cgroup_seq = 0;
+
+    char buf[64];
+    // Local workers create cgroups from several threads of one process
+    snprintf(buf, sizeof(buf), "/pmc.%d.%u", (int)getpid(),
+            __sync_fetch_and_add(&cgroup_seq, 1));
+    string path = config.cgroup_dir + buf;
+    if (mkdir(path.c_str(), 0755) < 0) {
+        log_error("Unable to create cgroup %s for task %s: %s", path.c_str(),
+                name.c_str(), strerror(errno));
+        return -1;
+    }
+    cgroup = path;
+
+    if (memory > 0) {
+        snprintf(buf, sizeof(buf), "%llu", (unsigned long long)memory * 1024 * 1024);
+        if (write_file(cgroup + "/memory.max", buf) < 0) {
+            log_error("Unable to set memory limit of task %s in cgroup %s: %s",
+                    name.c_str(), cgroup.c_str(), strerror(errno));
+            return -1;
+        }
+        if (write_file(cgroup + "/memory.swap.max", "0") < 0) {
+            log_debug("Unable to disable swap for task %s: %s", name.c_str(),
+                    strerror(errno));
+        }
+    }
+
+    cgroup_procs = open((cgroup + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+    if (cgroup_procs < 0) {
+        log_error("Unable to open cgroup.procs in cgroup %s: %s", cgroup.c_str(),
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Collect the peak memory and the OOM kills of the task from its cgroup,
+ * and remove the cgroup. The peak of the cgroup includes all the processes
+ * of the task, unlike ru_maxrss, which is the largest of them.
+ */
+void TaskHandler::release_cgroup() {
+    if (cgroup.empty()) {
+        return;
+    }
+    if (cgroup_procs >= 0) {
+        close(cgroup_procs);
+        cgroup_procs = -1;
+    }
+
+    char buf[1024];
+    int size = read_file(cgroup + "/memory.peak", buf, sizeof(buf) - 1);
+    if (size > 0) {
+        buf[size] = '\0';
+        unsigned long peak = strtoul(buf, NULL, 10) / 1024;
+        if (peak > usage.maxrss) {
+            usage.maxrss = peak;
+        }
+    }
+
+    size = read_file(cgroup + "/memory.events", buf, sizeof(buf) - 1);
+    if (size > 0) {
+        buf[size] = '\0';
+        const char *oom = strstr(buf, "oom_kill ");
+        if (oom != NULL) {
+            usage.oom_kills = strtoul(oom + strlen("oom_kill "), NULL, 10);
+        }
+    }
+    if (usage.oom_kills > 0 && memory > 0) {
+        log_error("Task %s went over its memory limit of %u MB", name.c_str(), memory);
+    } else if (usage.oom_kills > 0) {
+        log_error("Task %s was killed because the host ran out of memory", name.c_str());
+    }
+
+    // This fails if the task left processes behind
+    if (rmdir(cgroup.c_str()) < 0) {
+        log_warn("Unable to remove cgroup %s: %s", cgroup.c_str(), strerror(errno));
+    }
+    cgroup.clear();
+}
+
+/*
+ * Preload libinterpose into the task for --monitor-interpose. The task
+ * gets a private directory for the trace file that all of its processes
+ * write to, which has to exist before the task starts.
+ */
+int TaskHandler::create_interpose_dir() {
+    const char *tmpdir = getenv("TMPDIR");
+    string tmpl = string(tmpdir != NULL && tmpdir[0] != '\0' ? tmpdir : "/tmp") +
+        "/pmc-interpose.XXXXXX";
+    vector<char> dir(tmpl.begin(), tmpl.end());
+    dir.push_back('\0');
+    if (mkdtemp(&dir[0]) == NULL) {
+        log_error("Unable to create trace directory for task %s: %s", name.c_str(),
+                strerror(errno));
+        return -1;
+    }
+    interpose_dir = &dir[0];
+
+    string trace = interpose_dir + "/trace";
+    int fd = open(trace.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("Unable to create trace file for task %s: %s", name.c_str(),
+                strerror(errno));
+        rmdir(interpose_dir.c_str());
+        interpose_dir.clear();
+        return -1;
+    }
+    InterposeHeader header;
+    header.magic = INTERPOSE_MAGIC;
+    header.version = INTERPOSE_VERSION;
+    header.end = INTERPOSE_EXTENT;
+    ssize_t written = write(fd, &header, sizeof(header));
+    close(fd);
+    if (written != sizeof(header)) {
+        log_error("Unable to write trace file for task %s: %s", name.c_str(),
+                strerror(errno));
+        unlink(trace.c_str());
+        rmdir(interpose_dir.c_str());
+        interpose_dir.clear();
+        return -1;
+    }
+
+    set_env("KICKSTART_PREFIX", trace);
+    string preload = config.monitor_interpose;
+    const char *current = getenv("LD_PRELOAD");
+    if (current != NULL && current[0] != '\0') {
+        preload = preload + ":" + current;
+    }
+    set_env("LD_PRELOAD", preload);
+    return 0;
+}
+
+/*
+ * Collect the files used by all the processes of the task from the
+ * libinterpose trace file, and remove the trace directory.
+ */
+void TaskHandler::release_interpose() {
+    if (interpose_dir.empty()) {
+        return;
+    }
+
+    map<string, FileUsage> paths;
+    string trace = interpose_dir + "/trace";
+    read_interpose_trace(trace, paths);
+    unlink(trace.c_str());
+    if (rmdir(interpose_dir.c_str()) < 0) {
+        log_warn("Unable to remove trace directory %s: %s", interpose_dir.c_str(),
+                strerror(errno));
+    }
+    interpose_dir.clear();
+
+    file_usage.clear();
+    for (map<string, FileUsage>::iterator p = paths.begin(); p != paths.end(); p++) {
+        file_usage.push_back(p->second);
+    }
 }
 
 /* Write cluster-task record to task stdout */
@@ -650,7 +1659,13 @@ void TaskHandler::write_cluster_task() {
         id_string.c_str(), name.c_str(), date, elapsed(), status, app.c_str(), 
         worker->host_name.c_str(), worker->rank, cpus, memory);
 
-    write(task_stdout, summary, strlen(summary));
+    if (worker->per_task_stdio || config.rank_stdio) {
+        write(task_stdout, summary, strlen(summary));
+    } else if (stdout_pipe != NULL) {
+        stdout_pipe->append(summary, strlen(summary));
+    } else {
+        send_data(IODATA_STDOUT, summary, strlen(summary));
+    }
 }
 
 bool TaskHandler::succeeded() {
@@ -667,27 +1682,30 @@ void TaskHandler::execute() {
         this->status = run_process();
     }
 
-    // If the task succeeded, then read all of the files. We only
-    // do this if the task succeeded because we only send the data
-    // if the task succeeded.
-    if (this->succeeded()) {
-        if (read_file_data()) {
-            // If unable to read file data, then set the status
-            // to exitcode = 1
-            this->status = 256;
-        }
-    }
+    complete();
+}
 
-    // This needs to go after read_file_data because that method
-    // may change the status of the task
-    write_cluster_task();
+/* Send the I/O data and the result of a task that has exited */
+void TaskHandler::complete() {
+    // The master only wants the result of a cancelled task, which
+    // tells it that the slot is free again
+    if (cancelled) {
+        delete_files();
+        send_result();
+        return;
+    }
 
-    // Regardless of what happens, we need to delete the files
-    delete_files();
+    // A task that ran out of time failed, even if it exited cleanly
+    // after SIGTERM
+    if (timed_out && status == 0) {
+        status = 256;
+    }
 
-    // If the task succeeded, then send the I/O back to the master.
-    // We only do this if the task succeeds because if the task 
-    // failed, then it might not have generated good output data.
+    // If the task succeeded, then find all of the files and send the
+    // I/O back to the master. We only do this if the task succeeds 
+    // because if the task failed, then it might not have generated 
+    // good output data. If a file cannot be read, then the task fails,
+    // and the master throws away the data it already got.
     // It is important that we do this before sending back the 
     // result message. If we send the result message first, or if
     // it gets processed first, then we could have a situation
@@ -697,12 +1715,80 @@ void TaskHandler::execute() {
     // messages sent from one process to another are delivered 
     // in the order sent.
     if (this->succeeded()) {
-        send_io_data();
+        if (check_file_data() || send_io_data()) {
+            // If unable to read file data, then set the status
+            // to exitcode = 1
+            this->status = 256;
+        }
+    }
+
+    // The executable may have moved, so look it up again for the next task
+    if (!this->succeeded() && !exec_args.empty()) {
+        worker->forget_executable(exec_args[0]);
     }
 
+    // This needs to go after send_io_data because that method
+    // may change the status of the task
+    write_cluster_task();
+
+    // The stdout/stderr of the task, including the cluster-task
+    // record, also has to be sent before the result message
+    send_stdio();
+
+    // Regardless of what happens, we need to delete the files
+    delete_files();
+
     send_result();
 }
 
+/* Send a signal to the task and all the processes it started */
+void TaskHandler::signal_task(int signo) {
+    if (killpg(pid, signo) < 0 && errno != ESRCH) {
+        log_error("Unable to send signal %d to task %s: %s", signo, 
+                name.c_str(), strerror(errno));
+    }
+}
+
+/*
+ * Enforce the runtime limit of the task. When the limit is reached the
+ * task gets SIGTERM, and if it is still running TASK_KILL_DELAY seconds
+ * later it gets SIGKILL. Returns the time when the limit should be
+ * checked again, or 0 if it doesn't have to be.
+ */
+double TaskHandler::check_runtime(double now) {
+    if (max_runtime <= 0 || killed) {
+        return 0;
+    }
+
+    double deadline = start + max_runtime;
+    if (timed_out) {
+        deadline += TASK_KILL_DELAY;
+    }
+    if (now < deadline) {
+        return deadline;
+    }
+
+    if (!timed_out) {
+        log_error("Task %s exceeded its maximum runtime of %f seconds", 
+                name.c_str(), max_runtime);
+        timed_out = true;
+        signal_task(SIGTERM);
+        return deadline + TASK_KILL_DELAY;
+    }
+
+    log_error("Killing task %s", name.c_str());
+    killed = true;
+    signal_task(SIGKILL);
+    return 0;
+}
+
+/* Kill the task because a copy of it finished on another worker */
+void TaskHandler::cancel() {
+    log_debug("Cancelling task %s", name.c_str());
+    cancelled = true;
+    signal_task(SIGKILL);
+}
+
 Worker::Worker(Communicator *comm, const string &dagfile, const string &host_script,
         unsigned int host_memory, cpu_t host_cpus, bool strict_limits, 
         bool per_task_stdio) {
@@ -724,62 +1810,346 @@ Worker::Worker(Communicator *comm, const string &dagfile, const string &host_scr
         this->host_threads = c.threads;
         this->host_cores = c.cores;
         this->host_sockets = c.sockets;
+        if (!get_host_topology(c.threads, host_cpu_cores, host_cpu_sockets)) {
+            log_debug("Unable to read CPU topology, assuming contiguous numbering");
+        }
     } else {
         this->host_threads = host_cpus;
         this->host_cores = host_cpus;
         this->host_sockets = 1;
     }
+    get_host_gpus(this->host_gpus);
+    if (this->host_gpus.size() > 255) {
+        this->host_gpus.resize(255);
+    }
+    this->host_staging = 0;
+    if (!config.staging_dir.empty()) {
+        if (mkdirs(config.staging_dir.c_str()) < 0) {
+            myfailures("Unable to create staging directory %s", 
+                    config.staging_dir.c_str());
+        }
+        if (config.staging_size > 0) {
+            this->host_staging = config.staging_size;
+        } else {
+            // Use the free space in the staging directory
+            struct statvfs fs;
+            if (statvfs(config.staging_dir.c_str(), &fs) < 0) {
+                myfailures("Unable to get free space in %s", 
+                        config.staging_dir.c_str());
+            }
+            this->host_staging = (unsigned)(((double)fs.f_bavail * fs.f_frsize) / (1024.0*1024.0));
+        }
+    }
     this->strict_limits = strict_limits;
     this->per_task_stdio = per_task_stdio;
     this->host_script_pgid = 0;
+    this->master_rank = 0;
+    this->batch_results = false;
+    this->task_table = NULL;
+    this->credits = IODATA_CREDITS;
+    if (config.master_memory > 0) {
+        // Share the memory of the master between the workers, but give
+        // each worker at least one chunk so that it can make progress
+        unsigned workers = comm->size() > 1 ? comm->size() - 1 : 1;
+        unsigned share = config.master_memory * (1024*1024 / IODATA_CHUNK_SIZE) / workers;
+        this->credits = std::max(1u, std::min(share, (unsigned)IODATA_CREDITS));
+    }
     rank = comm->rank();
     get_host_name(host_name);
-    if (per_task_stdio) {
+    if (per_task_stdio || !config.rank_stdio) {
         this->out = -1;
         this->err = -1;
     } else {
-        // Send stdout/stderr to a different file for each worker
-        char rankstr[10];
-        sprintf(rankstr, "%d", rank);
-        string outfile = dagfile + ".out." + rankstr;
-        string errfile = dagfile + ".err." + rankstr;
+        // Send stdout/stderr to a different file for each worker
+        char rankstr[10];
+        sprintf(rankstr, "%d", rank);
+        string outfile = dagfile + ".out." + rankstr;
+        string errfile = dagfile + ".err." + rankstr;
+
+        log_debug("Worker %d: Using task stdout file: %s", rank, outfile.c_str());
+        log_debug("Worker %d: Using task stderr file: %s", rank, errfile.c_str());
+
+        out = open(outfile.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0000644);
+        if (out < 0) {
+            myfailures("Worker %d: unable to open task stdout", rank);
+        }
+
+        err = open(errfile.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0000644);
+        if (err < 0) {
+            myfailures("Worker %d: unable to open task stderr", rank);
+        }
+    }
+}
+
+Worker::~Worker() {
+    delete task_table;
+    if (this->out > 0) {
+        close(this->out);
+    }
+    if (this->err > 0) {
+        close(this->err);
+    }
+}
+
+/*
+ * Handle a message from the master. Commands are added to the queue.
+ * Returns false if the message tells the worker to shut down.
+ */
+bool Worker::accept(Message *mesg) {
+    if (mesg->tag() == SHUTDOWN) {
+        log_trace("Worker %d: Got shutdown message", rank);
+        delete mesg;
+        return false;
+    }
+
+    if (mesg->tag() == CREDIT) {
+        // Credit for chunks sent by a task that has finished
+        credits += static_cast<CreditMessage *>(mesg)->credits;
+        delete mesg;
+        return true;
+    }
+
+    if (mesg->tag() == CANCEL) {
+        cancels.push_back(static_cast<CancelMessage *>(mesg)->name);
+        delete mesg;
+        return true;
+    }
+
+    if (mesg->tag() == STAGE) {
+        // The files are copied before the task that needs them arrives
+        stage_files(static_cast<StageMessage *>(mesg));
+        delete mesg;
+        return true;
+    }
+
+    if (mesg->tag() == FETCH) {
+        serve_file(static_cast<FetchMessage *>(mesg));
+        delete mesg;
+        return true;
+    }
+
+    if (mesg->tag() == UNSTAGE) {
+        unstage_files(static_cast<UnstageMessage *>(mesg));
+        delete mesg;
+        return true;
+    }
+
+    switch (mesg->tag()) {
+        case COMMAND:
+        case TASK:
+            log_trace("Worker %d: Got task", rank);
+            commands.push_back(mesg);
+            break;
+        case BATCH: {
+            BatchMessage *batch = static_cast<BatchMessage *>(mesg);
+            log_trace("Worker %d: Got batch of %u tasks", rank, 
+                    batch->messages.size());
+            for (unsigned i = 0; i < batch->messages.size(); i++) {
+                Message *m = batch->messages[i];
+                if (m->tag() != COMMAND && m->tag() != TASK) {
+                    myfailure("Expected command message in batch");
+                }
+                commands.push_back(m);
+            }
+            // The commands now belong to the queue
+            batch->messages.clear();
+            delete batch;
+            batch_results = true;
+            break;
+        }
+        default:
+            myfailure("Unexpected message");
+    }
+    return true;
+}
+
+/* Take the next command from the queue and create a handler for it */
+TaskHandler *Worker::next_task() {
+    Message *mesg = commands.front();
+    commands.pop_front();
+
+    // Tasks sent by index get everything but the bindings from the table
+    CommandMessage *cmd;
+    vector<cpu_t> *bindings;
+    vector<cpu_t> *gpu_bindings;
+    if (mesg->tag() == TASK) {
+        if (task_table == NULL) {
+            myfailure("Got task by index without a task table");
+        }
+        TaskMessage *tmsg = static_cast<TaskMessage *>(mesg);
+        cmd = task_table->command(tmsg->index);
+        bindings = &tmsg->bindings;
+        gpu_bindings = &tmsg->gpu_bindings;
+    } else {
+        cmd = static_cast<CommandMessage *>(mesg);
+        bindings = &cmd->bindings;
+        gpu_bindings = &cmd->gpu_bindings;
+    }
 
-        log_debug("Worker %d: Using task stdout file: %s", rank, outfile.c_str());
-        log_debug("Worker %d: Using task stderr file: %s", rank, errfile.c_str());
+    TaskHandler *task = new TaskHandler(this, cmd->name, cmd->args,
+            cmd->id, cmd->memory, cmd->cpus, cmd->max_runtime, *bindings, cmd->pipe_forwards,
+            cmd->file_forwards);
+    task->gpus = cmd->gpus;
+    task->threads = cmd->threads;
+    task->gpu_bindings = *gpu_bindings;
+    task->hosts = cmd->hosts;
 
-        out = open(outfile.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0000644);
-        if (out < 0) {
-            myfailures("Worker %d: unable to open task stdout", rank);
+    if (cmd != mesg) {
+        delete cmd;
+    }
+    delete mesg;
+
+    return task;
+}
+
+/* Run one task at a time until the master says to shut down */
+void Worker::run_sequential() {
+    while (true) {
+        if (commands.empty()) {
+            log_trace("Worker %d: Waiting for request", rank);
+            if (!accept(recv_message())) {
+                break;
+            }
+            continue;
         }
 
-        err = open(errfile.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0000644);
-        if (err < 0) {
-            myfailures("Worker %d: unable to open task stderr", rank);
+        TaskHandler *task = next_task();
+        task->execute();
+        delete task;
+
+        if (commands.empty()) {
+            flush_results();
         }
     }
 }
 
-Worker::~Worker() {
-    if (this->out > 0) {
-        close(this->out);
+/* Poll the descriptors of fd, which belong to task */
+void Worker::watch(int fd, TaskHandler *task) {
+    if (poller.add(fd) == 0) {
+        watched[fd] = task;
     }
-    if (this->err > 0) {
-        close(this->err);
+}
+
+void Worker::unwatch(int fd) {
+    map<int, TaskHandler *>::iterator w = watched.find(fd);
+    if (w != watched.end()) {
+        poller.remove(fd);
+        watched.erase(w);
+    }
+}
+
+/*
+ * Wait up to timeout ms for the pipes and pidfds of the running tasks,
+ * and hand the events to the tasks. Returns -1 if polling failed.
+ */
+int Worker::poll_tasks(int timeout) {
+    if (poller.wait(timeout, events) < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (unsigned i = 0; i < events.size(); i++) {
+        // The task may have stopped polling fd after an earlier event
+        map<int, TaskHandler *>::iterator w = watched.find(events[i].fd);
+        if (w != watched.end()) {
+            w->second->handle_event(events[i].fd, events[i].revents);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Run up to worker_slots tasks at the same time. The master never sends
+ * more tasks than there are slots, so every command is started as soon
+ * as it arrives. Messages from the master can't be polled along with the
+ * pipes and pidfds of the tasks, so they are polled with a short timeout
+ * and the worker checks for messages in between.
+ */
+void Worker::run_concurrent() {
+    list<TaskHandler *> running;
+    bool shutdown = false;
+    while (!shutdown || !running.empty()) {
+        while (!commands.empty()) {
+            if (running.size() >= config.worker_slots) {
+                myfailure("Worker %d: Got more than %u tasks", rank, config.worker_slots);
+            }
+            TaskHandler *task = next_task();
+            log_trace("Running task %s", task->name.c_str());
+            if (task->begin()) {
+                running.push_back(task);
+            } else {
+                task->complete();
+                delete task;
+            }
+        }
+
+        // Kill the tasks that finished somewhere else. The commands were
+        // started above, so a task that is not running has already exited.
+        for (unsigned i = 0; i < cancels.size(); i++) {
+            for (list<TaskHandler *>::iterator t = running.begin(); t != running.end(); t++) {
+                if ((*t)->name == cancels[i] && !(*t)->cancelled) {
+                    (*t)->cancel();
+                }
+            }
+        }
+        cancels.clear();
+
+        // Only block for messages when there is nothing else to do
+        if (running.empty()) {
+            if (shutdown) {
+                break;
+            }
+            log_trace("Worker %d: Waiting for request", rank);
+            shutdown = !accept(recv_message());
+            continue;
+        }
+        while (!shutdown && (!deferred.empty() || comm->message_waiting())) {
+            shutdown = !accept(recv_message());
+        }
+        if (!commands.empty() || !cancels.empty()) {
+            continue;
+        }
+
+        if (poller.empty()) {
+            // Only tasks without pipes are left, and there are no pidfds
+            usleep(WORKER_POLL_INTERVAL * 1000);
+        } else if (poll_tasks(WORKER_POLL_INTERVAL) < 0) {
+            myfailures("Worker %d: Polling tasks failed", rank);
+        }
+
+        // Enforce runtime limits
+        double now = current_time();
+        for (list<TaskHandler *>::iterator t = running.begin(); t != running.end(); t++) {
+            (*t)->check_runtime(now);
+        }
+
+        // Finish the tasks that have exited
+        list<TaskHandler *>::iterator t = running.begin();
+        while (t != running.end()) {
+            TaskHandler *task = *t;
+            if (task->pipes_done() && task->may_have_exited() && task->reap(WNOHANG)) {
+                task->complete();
+                delete task;
+                t = running.erase(t);
+            } else {
+                t++;
+            }
+        }
     }
 }
 
 /**
  * Launch the host script if a) this worker has host rank 0, and 
- * b) the host script is valid 
+ * b) the host script is valid. Returns the exit status of the script,
+ * or -1 if it timed out.
  */
-void Worker::run_host_script() {
+int Worker::run_host_script() {
     // Only launch it if it exists
     if (host_script == "")
-        return;
+        return 0;
 
-    // Only host_rank 0 launches a script, the others need to wait
+    // Only host_rank 0 launches a script, the master does not give the
+    // others any tasks until it has finished
     if (host_rank > 0)
-        return;
+        return 0;
 
     log_debug("Worker %d: Launching host script %s", rank, host_script.c_str());
 
@@ -859,8 +2229,9 @@ void Worker::run_host_script() {
                 // If waitpid was interrupted, then the host script timed out
                 // Kill the host script's process group
                 killpg(pid, SIGKILL);
-                myfailure("Worker %d: Host script timed out after %d seconds", 
+                log_error("Worker %d: Host script timed out after %d seconds", 
                     rank, HOST_SCRIPT_TIMEOUT);
+                return -1;
             } else {
                 myfailures("Worker %d: Error waiting for host script", rank);
             }
@@ -874,10 +2245,12 @@ void Worker::run_host_script() {
             }
 
             if (status != 0) {
-                myfailure("Worker %d: Host script failed with status %d", rank, status);
+                log_error("Worker %d: Host script failed with status %d", rank, status);
             }
+            return status;
         }
     }
+    return 0;
 }
 
 /**
@@ -918,53 +2291,519 @@ void Worker::kill_host_script_group() {
     }
 }
 
+/**
+ * The environment that every task starts with: the environment of the
+ * worker and the variables that are the same for all of its tasks. It
+ * is built once, when the first task is launched.
+ */
+const vector<string> &Worker::task_environment() {
+    if (base_env.empty()) {
+        for (char **e = environ; *e != NULL; e++) {
+            string var = *e;
+            // Tasks find the broadcast files on this host first
+            if (!config.broadcast_files.empty()) {
+                if (var.compare(0, 5, "PATH=") == 0) {
+                    var = "PATH=" + local_paths(var.substr(5));
+                } else if (var.compare(0, 16, "LD_LIBRARY_PATH=") == 0) {
+                    var = "LD_LIBRARY_PATH=" + local_paths(var.substr(16));
+                }
+            }
+            base_env.push_back(var);
+        }
+        char buf[64];
+        snprintf(buf, sizeof(buf), "PMC_RANK=%d", rank);
+        base_env.push_back(buf);
+        snprintf(buf, sizeof(buf), "PMC_HOST_RANK=%d", host_rank);
+        base_env.push_back(buf);
+        if (!config.staging_dir.empty()) {
+            base_env.push_back("PMC_STAGING_DIR=" + config.staging_dir);
+        }
+        if (!config.broadcast_files.empty()) {
+            base_env.push_back("PMC_BROADCAST_DIR=" + config.broadcast_dir);
+        }
+    }
+    return base_env;
+}
+
+/**
+ * Search PATH for an executable, or use the result of an earlier search.
+ * Executables that were not found are looked up again after a short time,
+ * in case they are installed by a task or the host script.
+ */
+string Worker::find_executable(const string &name) {
+    double now = current_time();
+    map<string, CachedExecutable>::iterator i = executables.find(name);
+    if (i != executables.end() && i->second.expires > now) {
+        return i->second.path;
+    }
+
+    CachedExecutable e;
+    e.path = pathfind(name);
+    if (e.path.find('/') == string::npos) {
+        e.expires = now + EXECUTABLE_CACHE_MISS_TTL;
+    } else {
+        e.expires = now + EXECUTABLE_CACHE_TTL;
+    }
+    log_trace("Worker %d: Found executable %s at %s", rank, name.c_str(), e.path.c_str());
+    executables[name] = e;
+    return e.path;
+}
+
+/* Forget the PATH lookup of an executable, e.g. after a task failed */
+void Worker::forget_executable(const string &name) {
+    executables.erase(name);
+}
+
+/* Get the next message, starting with any that were deferred */
+Message *Worker::recv_message() {
+    if (!deferred.empty()) {
+        Message *mesg = deferred.front();
+        deferred.pop_front();
+        return mesg;
+    }
+    return comm->recv_message();
+}
+
+/**
+ * Act as the sub-master for this host: forward batches of commands from
+ * the master to the workers on this host, and collect their results and
+ * I/O data into batches for the master. Messages from the same worker
+ * stay in the order they were sent.
+ */
+void Worker::relay() {
+    log_debug("Worker %d: Relaying messages for host %s", rank, host_name.c_str());
+
+    vector<Message *> pending;
+    vector<int> sources;
+    bool shutdown = false;
+
+    while (!shutdown) {
+        Message *mesg = recv_message();
+        if (mesg->source == 0) {
+            if (mesg->tag() == SHUTDOWN) {
+                log_trace("Worker %d: Got shutdown message", rank);
+                delete mesg;
+                shutdown = true;
+            } else if (mesg->tag() == BATCH) {
+                BatchMessage *batch = static_cast<BatchMessage *>(mesg);
+                for (unsigned i = 0; i < batch->messages.size(); i++) {
+                    Message *m = batch->messages[i];
+                    comm->send_message_async(m, m->source);
+                }
+                // The communicator deletes the messages once they are sent
+                batch->messages.clear();
+                delete batch;
+            } else {
+                myfailure("Unexpected message");
+            }
+        } else {
+            pending.push_back(mesg);
+            sources.push_back(mesg->source);
+        }
+
+        // Forward everything that arrived while we were busy in one batch,
+        // and whatever is left when the master shuts us down
+        if (!pending.empty() && (shutdown || !comm->message_waiting())) {
+            log_trace("Worker %d: Relaying %u messages to master", rank, pending.size());
+            comm->send_message_async(new BatchMessage(pending, sources), 0);
+            for (unsigned i = 0; i < pending.size(); i++) {
+                delete pending[i];
+            }
+            pending.clear();
+            sources.clear();
+        }
+    }
+}
+
+/* Send a message to the master, or hold it until the current task is done */
+void Worker::send_to_master(Message *mesg) {
+    if (batch_results) {
+        outbox.push_back(mesg);
+    } else {
+        // The master may be busy, so don't wait for it to receive the message
+        comm->send_message_async(mesg, master_rank);
+    }
+}
+
+/* Stop holding messages, and send the ones that are held */
+void Worker::flush_results() {
+    batch_results = false;
+    send_outbox();
+}
+
+/* Send all the held messages to the master in one batch */
+void Worker::send_outbox() {
+    if (outbox.empty()) {
+        return;
+    }
+
+    if (outbox.size() == 1) {
+        comm->send_message_async(outbox[0], master_rank);
+        outbox.clear();
+        return;
+    }
+
+    log_trace("Worker %d: Sending batch of %u messages", rank, outbox.size());
+
+    vector<int> sources(outbox.size(), rank);
+    comm->send_message_async(new BatchMessage(outbox, sources), master_rank);
+
+    for (unsigned i = 0; i < outbox.size(); i++) {
+        delete outbox[i];
+    }
+    outbox.clear();
+}
+
+/*
+ * Wait until the master allows another chunk of I/O data to be sent.
+ * Returns the time spent waiting.
+ */
+double Worker::wait_for_credit() {
+    if (credits > 0) {
+        credits--;
+        return 0.0;
+    }
+
+    // The master can't give credit for chunks it hasn't seen
+    send_outbox();
+
+    log_trace("Worker %d: Waiting for I/O credit", rank);
+    double start = current_time();
+    while (credits == 0) {
+        Message *mesg = comm->recv_message();
+        if (mesg->tag() == CREDIT) {
+            credits += static_cast<CreditMessage *>(mesg)->credits;
+            delete mesg;
+        } else {
+            // Tasks that the master sent ahead are run later
+            deferred.push_back(mesg);
+        }
+    }
+    credits--;
+    return current_time() - start;
+}
+
+/* Wait for the master to reserve the regions requested by the last reserve */
+vector<unsigned long long> Worker::wait_for_region() {
+    // The master can't reserve regions it hasn't been asked for
+    send_outbox();
+
+    log_trace("Worker %d: Waiting for regions", rank);
+    while (true) {
+        Message *mesg = comm->recv_message();
+        if (mesg->tag() == REGION) {
+            vector<unsigned long long> offsets = static_cast<RegionMessage *>(mesg)->offsets;
+            delete mesg;
+            return offsets;
+        } else if (mesg->tag() == CREDIT) {
+            credits += static_cast<CreditMessage *>(mesg)->credits;
+            delete mesg;
+        } else {
+            // Tasks that the master sent ahead are run later
+            deferred.push_back(mesg);
+        }
+    }
+}
+
+/*
+ * Copy intermediate files into this host's staging area from the workers
+ * that have them. Other workers can ask this one for files while it waits,
+ * and everything else is handled later. A file that can't be copied is
+ * left out, and the task that needs it fails when it can't find it.
+ */
+void Worker::stage_files(StageMessage *stage) {
+    for (unsigned i = 0; i < stage->paths.size(); i++) {
+        const string &path = stage->paths[i];
+        int source = stage->ranks[i];
+        string dest = config.staging_dir + "/" + path;
+
+        // Another worker on this host may have copied it already
+        if (access(dest.c_str(), F_OK) == 0) {
+            log_trace("Worker %d: %s is already staged", rank, path.c_str());
+            continue;
+        }
+
+        log_debug("Worker %d: Fetching %s from worker %d", rank, path.c_str(), source);
+        comm->send_message_async(new FetchMessage(path), source);
+
+        StagedMessage *reply = NULL;
+        while (reply == NULL) {
+            Message *mesg = comm->recv_message();
+            if (mesg->tag() == STAGED && mesg->source == source) {
+                reply = static_cast<StagedMessage *>(mesg);
+            } else if (mesg->tag() == FETCH) {
+                serve_file(static_cast<FetchMessage *>(mesg));
+                delete mesg;
+            } else {
+                deferred.push_back(mesg);
+            }
+        }
+
+        if (!reply->found) {
+            log_error("Worker %d: Worker %d does not have %s", rank, source, path.c_str());
+            delete reply;
+            continue;
+        }
+
+        // Write a temporary file and rename it so that other workers on
+        // this host never see a partial file
+        char tmp[32];
+        snprintf(tmp, sizeof(tmp), ".pmc-%d", rank);
+        string tmpfile = dest + tmp;
+        if (mkdirs(dirname(dest).c_str()) < 0) {
+            log_error("Worker %d: Unable to create directory for %s: %s", rank, 
+                    dest.c_str(), strerror(errno));
+            delete reply;
+            continue;
+        }
+        int fd = open(tmpfile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0000644);
+        if (fd < 0) {
+            log_error("Worker %d: Unable to open %s: %s", rank, tmpfile.c_str(), 
+                    strerror(errno));
+            delete reply;
+            continue;
+        }
+        unsigned written = 0;
+        while (written < reply->size) {
+            ssize_t w = write(fd, reply->data + written, reply->size - written);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            written += w;
+        }
+        if (close(fd) < 0 || written < reply->size) {
+            log_error("Worker %d: Unable to write %s: %s", rank, tmpfile.c_str(),
+                    strerror(errno));
+            unlink(tmpfile.c_str());
+        } else if (rename(tmpfile.c_str(), dest.c_str()) < 0) {
+            log_error("Worker %d: Unable to rename %s: %s", rank, tmpfile.c_str(),
+                    strerror(errno));
+            unlink(tmpfile.c_str());
+        }
+        delete reply;
+    }
+}
+
+/* Send an intermediate file from this host's staging area to another worker */
+void Worker::serve_file(FetchMessage *fetch) {
+    string path = config.staging_dir + "/" + fetch->path;
+    log_trace("Worker %d: Sending %s to worker %d", rank, fetch->path.c_str(), 
+            fetch->source);
+
+    string data;
+    bool found = false;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        log_error("Worker %d: Unable to open %s: %s", rank, path.c_str(), strerror(errno));
+    } else {
+        char buf[BUFSIZ];
+        ssize_t r;
+        while ((r = read(fd, buf, sizeof(buf))) != 0) {
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            data.append(buf, r);
+        }
+        if (r < 0) {
+            log_error("Worker %d: Unable to read %s: %s", rank, path.c_str(), 
+                    strerror(errno));
+        } else {
+            found = true;
+        }
+        close(fd);
+    }
+
+    // Don't wait for the other worker to receive it
+    comm->send_message_async(new StagedMessage(fetch->path, found, data.data(), 
+                found ? data.size() : 0), fetch->source);
+}
+
+/* Delete intermediate files that the tasks don't need any more */
+void Worker::unstage_files(UnstageMessage *unstage) {
+    for (unsigned i = 0; i < unstage->paths.size(); i++) {
+        string path = config.staging_dir + "/" + unstage->paths[i];
+        log_trace("Worker %d: Deleting %s", rank, path.c_str());
+        if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+            log_warn("Worker %d: Unable to delete %s: %s", rank, path.c_str(), 
+                    strerror(errno));
+        }
+    }
+}
+
+/*
+ * Receive the files that the master broadcasts at startup. The worker
+ * with host rank 0 writes them to --broadcast-dir, and the other workers
+ * on the host wait for it at the barrier before they run any tasks.
+ */
+void Worker::receive_files() {
+    bool writer = host_rank == 0;
+    if (writer && mkdirs(config.broadcast_dir.c_str()) < 0) {
+        myfailures("Worker %d: Unable to create broadcast directory %s", rank,
+                config.broadcast_dir.c_str());
+    }
+
+    bool last = false;
+    while (!last) {
+        Message *mesg = comm->broadcast_message(NULL, 0);
+        if (mesg->tag() != FILES) {
+            myfailure("Expected broadcast files");
+        }
+        FilesMessage *files = static_cast<FilesMessage *>(mesg);
+        if (writer) {
+            for (unsigned i = 0; i < files->files.size(); i++) {
+                write_broadcast_file(files->files[i]);
+            }
+        }
+        last = files->last;
+        delete files;
+    }
+    comm->barrier();
+
+    log_trace("Worker %d: Got broadcast files", rank);
+}
+
+void Worker::write_broadcast_file(const BroadcastFile &file) {
+    string path = config.broadcast_dir + "/" + file.path;
+    if (file.type == 'd') {
+        if (mkdir(path.c_str(), file.mode | S_IRWXU) < 0 && errno != EEXIST) {
+            myfailures("Worker %d: Unable to create directory %s", rank, path.c_str());
+        }
+    } else if (file.type == 'l') {
+        unlink(path.c_str());
+        if (symlink(string(file.data, file.size).c_str(), path.c_str()) < 0) {
+            myfailures("Worker %d: Unable to create link %s", rank, path.c_str());
+        }
+    } else {
+        // Files from an earlier run are replaced by the first chunk
+        int flags = O_WRONLY|O_CREAT|O_CLOEXEC;
+        if (file.offset == 0) {
+            flags |= O_TRUNC;
+        }
+        int fd = open(path.c_str(), flags, file.mode);
+        if (fd < 0) {
+            myfailures("Worker %d: Unable to open %s", rank, path.c_str());
+        }
+        unsigned done = 0;
+        while (done < file.size) {
+            ssize_t n = pwrite(fd, file.data + done, file.size - done, file.offset + done);
+            if (n < 0) {
+                myfailures("Worker %d: Unable to write %s", rank, path.c_str());
+            }
+            done += n;
+        }
+        fchmod(fd, file.mode);
+        close(fd);
+    }
+}
+
+/*
+ * The path of the node-local copy of path if it is, or is under, one of
+ * the --broadcast-files. Otherwise path is returned as it is.
+ */
+string Worker::local_path(const string &path) {
+    for (unsigned i = 0; i < config.broadcast_files.size(); i++) {
+        const string &src = config.broadcast_files[i];
+        if (path.compare(0, src.size(), src) == 0 &&
+                (path.size() == src.size() || path[src.size()] == '/')) {
+            return config.broadcast_dir + "/" + filename(src) + path.substr(src.size());
+        }
+    }
+    return path;
+}
+
+/* Rewrite each directory in a list like PATH to its node-local copy */
+string Worker::local_paths(const string &paths) {
+    string result;
+    size_t start = 0;
+    while (true) {
+        size_t end = paths.find(':', start);
+        if (start > 0) {
+            result += ":";
+        }
+        result += local_path(paths.substr(start, end == string::npos ? end : end - start));
+        if (end == string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    return result;
+}
+
 int Worker::run() {
     log_debug("Worker %d: Starting...", rank);
 
-    // Send worker's registration message to the master
-    RegistrationMessage regmsg(host_name, host_memory, host_threads, host_cores, host_sockets);
-    comm->send_message(&regmsg, 0);
+    // Tasks with a memory limit get their own cgroup under --cgroup, which
+    // needs the memory controller. This fails if there are processes in
+    // the cgroup itself.
+    if (!config.cgroup_dir.empty() &&
+            write_file(config.cgroup_dir + "/cgroup.subtree_control", "+memory") < 0) {
+        myfailures("Unable to enable the memory controller in cgroup %s",
+                config.cgroup_dir.c_str());
+    }
+
+    // Send worker's registration message to the master. All the workers
+    // register at once.
+    RegistrationMessage regmsg(host_name, host_memory, host_threads, host_cores, host_sockets,
+            host_cpu_cores, host_cpu_sockets, host_gpus.size(), host_staging);
+    comm->gather_messages(&regmsg, 0);
     log_trace("Worker %d: Host name: %s", rank, host_name.c_str());
     log_trace("Worker %d: Host memory: %u MB", rank, this->host_memory);
     log_trace("Worker %d: Host threads/CPUs: %" PRIcpu_t, rank, this->host_threads);
     log_trace("Worker %d: Host cores: %" PRIcpu_t, rank, this->host_cores);
     log_trace("Worker %d: Host sockets: %" PRIcpu_t, rank, this->host_sockets);
-
-    // Get worker's host rank
-    HostrankMessage *hrmsg = dynamic_cast<HostrankMessage *>(comm->recv_message());
-    if (hrmsg == NULL) {
+    log_trace("Worker %d: Host GPUs: %u", rank, (unsigned)this->host_gpus.size());
+    log_trace("Worker %d: Host staging area: %u MB", rank, this->host_staging);
+
+    // Get worker's host rank from the table broadcast by the master
+    HostrankMessage *hrmsg = dynamic_cast<HostrankMessage *>(comm->broadcast_message(NULL, 0));
+    // The master may have more workers than this communicator, in threads
+    // of its own process
+    if (hrmsg == NULL || hrmsg->hostranks.size() < (unsigned)comm->size() - 1) {
         myfailure("Expected hostrank message");
     }
-    host_rank = hrmsg->hostrank;
+    host_rank = hrmsg->hostranks[rank - 1];
+    master_rank = hrmsg->masters[rank - 1];
     delete hrmsg;
     log_trace("Worker %d: Host rank: %d", rank, host_rank);
 
-    // If there is a host script, then run it and wait here for all the host scripts to finish
-    if ("" != host_script) {
-        run_host_script();
-        comm->barrier();
+    if (config.broadcast_dag) {
+        Message *mesg = comm->broadcast_message(NULL, 0);
+        if (mesg->tag() != TASKTABLE) {
+            myfailure("Expected task table");
+        }
+        task_table = static_cast<TaskTableMessage *>(mesg);
+        log_trace("Worker %d: Got table of %u tasks", rank, task_table->size());
     }
 
-    while (true) {
-        log_trace("Worker %d: Waiting for request", rank);
-
-        Message *mesg = comm->recv_message();
-        if (ShutdownMessage *sdm = dynamic_cast<ShutdownMessage *>(mesg)) {
-            log_trace("Worker %d: Got shutdown message", rank);
-            delete sdm;
-            break;
-        } else if (CommandMessage *cmd = dynamic_cast<CommandMessage *>(mesg)) {
+    if (!config.broadcast_files.empty()) {
+        receive_files();
+    }
 
-            log_trace("Worker %d: Got task", rank);
+    // If there is a host script, then run it and tell the master that
+    // it can start tasks on this host. A sub-master sends this directly
+    // to the master, because it only starts relaying afterwards.
+    if ("" != host_script && host_rank == 0) {
+        int status = run_host_script();
+        comm->send_message_async(new ReadyMessage(status), 
+                master_rank == rank ? 0 : master_rank);
+    }
 
-            TaskHandler task(this, cmd->name, cmd->args,
-                    cmd->id, cmd->memory, cmd->cpus, cmd->bindings, cmd->pipe_forwards,
-                    cmd->file_forwards);
+    if (master_rank == rank) {
+        relay();
+    }
 
-            task.execute();
-            delete cmd;
+    if (master_rank != rank) {
+        // Tasks can only be cancelled while the worker is polling them
+        if (config.worker_slots > 1 || config.speculate > 0) {
+            run_concurrent();
         } else {
-            myfailure("Unexpected message");
+            run_sequential();
         }
     }
 
@@ -975,3 +2814,59 @@ int Worker::run() {
     return 0;
 }
 
+LocalWorkers::LocalWorkers(LocalCommunicator *comm, const string &dagfile,
+        unsigned host_memory, cpu_t host_cpus, bool strict_limits, bool per_task_stdio) {
+    for (unsigned i = 0; i < comm->local_workers(); i++) {
+        workers.push_back(new Worker(comm->worker(i), dagfile, "", host_memory, host_cpus,
+                strict_limits, per_task_stdio));
+    }
+    this->joined = false;
+}
+
+/* The workers can only be deleted once their threads have finished */
+LocalWorkers::~LocalWorkers() {
+    if (!joined && !threads.empty()) {
+        return;
+    }
+    for (unsigned i = 0; i < workers.size(); i++) {
+        delete workers[i];
+    }
+}
+
+void LocalWorkers::start() {
+    for (unsigned i = 0; i < workers.size(); i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, thread_main, workers[i]) != 0) {
+            myfailure("Unable to start local worker %d", workers[i]->rank);
+        }
+        threads.push_back(thread);
+    }
+    log_debug("Running %u workers in the master process", (unsigned)workers.size());
+}
+
+/* Wait for the workers to exit after the master has shut them down */
+void LocalWorkers::join() {
+    for (unsigned i = 0; i < threads.size(); i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            myfailure("Unable to join local worker %d", workers[i]->rank);
+        }
+    }
+    joined = true;
+}
+
+void *LocalWorkers::thread_main(void *arg) {
+    // Signals are for the master, which is interrupted by them
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    Worker *worker = static_cast<Worker *>(arg);
+    try {
+        worker->run();
+    } catch (std::exception &error) {
+        // The master can't catch this, so give up on the whole job
+        log_fatal("Local worker %d: %s", worker->rank, error.what());
+        worker->comm->abort(1);
+    }
+    return NULL;
+}
@@ -5,8 +5,13 @@
 #include <map>
 #include <list>
 #include <vector>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #include "comm.h"
+#include "localcomm.h"
+#include "poller.h"
 #include "tools.h"
 
 using std::string;
@@ -29,20 +34,53 @@ public:
     virtual string destination() = 0;
 };
 
+// Size of the buffers that pipes are read into, and the number of free
+// buffers a worker keeps for its next tasks
+#define PIPE_BUFFER_SIZE (64*1024)
+#define PIPE_BUFFER_POOL 16
+
+/* Buffers of PIPE_BUFFER_SIZE bytes that are reused by the pipes of tasks */
+class BufferPool {
+private:
+    vector<char *> free;
+
+public:
+    ~BufferPool();
+    char *get();
+    void put(char *buffer);
+};
+
+/*
+ * A pipe from a task. The data is read into a buffer from the pool,
+ * which is only reallocated if more than PIPE_BUFFER_SIZE bytes have to
+ * be kept. Data that has been sent is dropped from the front by moving
+ * the start of the buffer, not the data.
+ */
 class PipeForward : public Forward {
 private:
-    string buffer;
+    BufferPool *pool;
+    char *buffer;
+    size_t capacity;
+    size_t start;
+    size_t end;
+
+    void reserve(size_t size);
 
 public:
     string filename;
     string varname;
     int readfd;
     int writefd;
+    // Number of chunks sent while the task was running
+    unsigned seq;
+    // True if this is the task's stdout or stderr
+    bool stdio;
 
-    PipeForward(string varname, string filename, int readfd, int writefd);
+    PipeForward(string varname, string filename, int readfd, int writefd, BufferPool *pool);
     ~PipeForward();
     int read();
-    void append(char *buff, int size);
+    void append(const char *buff, size_t size);
+    void consume(size_t size);
     void close();
     void closeread();
     void closewrite();
@@ -51,20 +89,44 @@ public:
     string destination();
 };
 
-class FileForward : public Forward {
+/*
+ * A file that is read and sent to the master in chunks. The file is
+ * opened before any forwarded data of the task is sent, and the last
+ * chunk is held back until all the files of the task have been read.
+ */
+class FileForward {
 public:
     string destfile;
     string srcfile;
-    char *buff;
-    size_t buffsize;
+    size_t size;
+    int fd;
+    // Number of chunks sent, and the last chunk, which has not been sent
+    unsigned seq;
+    string tail;
 
-    FileForward(const string &srcfile, const string &destfile, char *buff, size_t buffsize);
+    FileForward(const string &srcfile, const string &destfile, size_t size, int fd);
     ~FileForward();
-    const char *data();
-    size_t size();
-    string destination();
 };
 
+// How often, in ms, a worker running several tasks checks for messages
+#define WORKER_POLL_INTERVAL 10
+
+// Seconds between SIGTERM and SIGKILL for a task that runs out of time
+#define TASK_KILL_DELAY 5.0
+
+// Seconds a worker trusts the PATH lookup of an executable, and the
+// lookup of an executable that was not found
+#define EXECUTABLE_CACHE_TTL 300.0
+#define EXECUTABLE_CACHE_MISS_TTL 10.0
+
+/* The result of a PATH lookup, cached by the worker */
+struct CachedExecutable {
+    string path;
+    double expires;
+};
+
+class TaskHandler;
+
 class Worker {
 public:
     Communicator *comm;
@@ -72,12 +134,16 @@ public:
     string dagfile;
     string workdir;
 
+    // Task stdout/stderr files for this worker with --rank-stdio
     int out;
     int err;
 
     int rank;
     int host_rank;
 
+    // Where results are sent: the master, or the sub-master for this host
+    int master_rank;
+
     string host_script;
     pid_t host_script_pgid;
 
@@ -86,18 +152,85 @@ public:
     cpu_t host_threads;
     cpu_t host_cores;
     cpu_t host_sockets;
+    vector<cpu_t> host_cpu_cores;
+    vector<cpu_t> host_cpu_sockets;
+    // The CUDA_VISIBLE_DEVICES name of each GPU the tasks can use
+    vector<string> host_gpus;
+    // Capacity of the staging area for intermediate files in MB
+    unsigned host_staging;
 
     bool strict_limits;
 
     bool per_task_stdio;
 
+    // Messages that arrived before the worker was ready for them
+    list<Message *> deferred;
+
+    // Commands and tasks that have been received but not run yet
+    list<Message *> commands;
+
+    // Names of running tasks that the master wants killed
+    vector<string> cancels;
+
+    // Commands for all the tasks when the master broadcasts the DAG
+    TaskTableMessage *task_table;
+
+    // When commands arrive in a batch, messages for the master are held
+    // here until the result of a task is ready, so that the I/O data and
+    // result of each task reach the master in one message as soon as the
+    // task is done
+    bool batch_results;
+    vector<Message *> outbox;
+
+    // Number of chunks of I/O data that can be sent before the master
+    // has to write some of them. With --master-memory every message of
+    // I/O data takes a credit.
+    unsigned credits;
+
+    // The environment that all tasks start from, and the executables
+    // found in PATH, so that launching a task does not search PATH on
+    // a shared file system every time
+    vector<string> base_env;
+    map<string, CachedExecutable> executables;
+
+    // The pipes and pidfds of the running tasks, the task that each
+    // descriptor belongs to, and the buffers that pipes are read into
+    Poller poller;
+    map<int, TaskHandler *> watched;
+    vector<struct pollfd> events;
+    BufferPool buffers;
+
     Worker(Communicator *comm, const string &dagfile, const string &host_script, 
             unsigned host_memory = 0, cpu_t host_cpus = 0, 
             bool strict_limits = false, bool per_task_stdio=false);
     ~Worker();
     int run();
-    void run_host_script();
+    bool accept(Message *mesg);
+    TaskHandler *next_task();
+    void run_sequential();
+    void run_concurrent();
+    Message *recv_message();
+    void relay();
+    void send_to_master(Message *mesg);
+    void flush_results();
+    void send_outbox();
+    double wait_for_credit();
+    vector<unsigned long long> wait_for_region();
+    void stage_files(StageMessage *stage);
+    void serve_file(FetchMessage *fetch);
+    void unstage_files(UnstageMessage *unstage);
+    void receive_files();
+    void write_broadcast_file(const BroadcastFile &file);
+    string local_path(const string &path);
+    string local_paths(const string &paths);
+    int run_host_script();
     void kill_host_script_group();
+    const vector<string> &task_environment();
+    string find_executable(const string &name);
+    void forget_executable(const string &name);
+    void watch(int fd, TaskHandler *task);
+    void unwatch(int fd);
+    int poll_tasks(int timeout);
 };
 
 class TaskHandler {
@@ -108,37 +241,147 @@ public:
     list<string> args;
     unsigned memory;
     cpu_t cpus;
+    cpu_t gpus;
+    // Threads requested with --threads, or 0 for one per CPU
+    cpu_t threads;
     vector<cpu_t> bindings;
+    // Indexes into Worker::host_gpus of the GPUs allocated to the task
+    vector<cpu_t> gpu_bindings;
+    // The hosts of a task that runs on several hosts, and the hostfile
+    // that lists them for the task
+    vector<string> hosts;
+    string hostfile;
+
+    // Limit on the runtime of the task, and whether the task has been
+    // sent SIGTERM and SIGKILL because it ran out of time
+    double max_runtime;
+    bool timed_out;
+    bool killed;
 
     vector<Forward *> forwards;
     vector<PipeForward *> pipes;
+    PipeForward *stdout_pipe;
+    PipeForward *stderr_pipe;
     map<string, string> pipe_forwards;
     vector<FileForward *> files;
     map<string, string> file_forwards;
 
+    // Time spent waiting for I/O credit to send the task's data
+    double stall;
+
     double start;
     double finish;
 
+    pid_t pid;
     int status;
 
+    // Pipes that are still open, and whether reading them failed
+    map<int, PipeForward *> reading;
+    bool poll_failure;
+
+    // A descriptor that becomes readable when the task exits, or -1 if
+    // the kernel does not support them, and whether it has
+    int pidfd;
+    bool exited;
+
     int task_stdout;
     int task_stderr;
 
-    TaskHandler(Worker *worker, string &name, list<string> &args, string &id, unsigned memory, unsigned cpus, const vector<cpu_t> &bindings, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards);
+    // The command, environment and CPU set of the task are prepared
+    // before the fork so that the child only has to make system calls.
+    // exec_env only has the variables of this task, which replace those
+    // of the same name in the worker's task_environment().
+    string executable;
+    vector<string> exec_args;
+    vector<string> exec_env;
+    void *cpuset;
+    size_t cpusetsize;
+    void *nodemask;
+    unsigned long maxnode;
+
+    // Time it took to fork (or vfork and exec) the task
+    double launch_time;
+
+    // Times of the TracePoints of the task, if tracing is enabled
+    vector<double> trace;
+
+    // Resources used by the task, collected when it is reaped
+    TaskUsage usage;
+
+    // With --cgroup, the cgroup that limits the memory of the task, and
+    // its cgroup.procs file, which the child writes itself into
+    string cgroup;
+    int cgroup_procs;
+
+    // With --monitor-interpose, the directory of the trace file that
+    // libinterpose writes for the task, and the files the task used
+    string interpose_dir;
+    vector<FileUsage> file_usage;
+
+    // Set when the task was killed because a copy of it finished elsewhere
+    bool cancelled;
+
+    TaskHandler(Worker *worker, string &name, list<string> &args, string &id, unsigned memory, unsigned cpus, double max_runtime, const vector<cpu_t> &bindings, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards);
     ~TaskHandler();
     double elapsed();
     void execute();
+    bool begin();
+    bool pipes_done();
+    bool may_have_exited() { return pidfd < 0 || exited; }
+    void handle_event(int fd, short revents);
+    bool reap(int options);
+    double check_runtime(double now);
+    void cancel();
+    void complete();
 private:
     bool succeeded();
     void send_result();
+    int launch();
     int run_process();
-    void child_process();
+    int prepare_exec();
+    int write_hostfile();
+    void set_env(const string &name, const string &value);
+    void set_thread_env();
+    void child_process(char **argv, char **envp);
+    void signal_task(int signo);
+    void stop_reading(int fd);
+    void close_pidfd();
     void write_cluster_task();
-    void send_io_data();
-    int read_file_data();
+    int create_cgroup();
+    void release_cgroup();
+    int create_interpose_dir();
+    void release_interpose();
+    int send_io_data();
+    void send_stdio();
+    void send_pipe(PipeForward *pipe);
+    void send_data(const string &destination, const char *data, size_t size);
+    void stream_pipe(PipeForward *pipe);
+    int send_file(FileForward *file);
+    void finish_file(FileForward *file, bool commit);
+    int write_files_direct();
+    int check_file_data();
     void delete_files();
     int open_stdio();
     void close_stdio();
 };
 
+/*
+ * Workers that run in threads of the master process, one for each rank
+ * of a LocalCommunicator, on the CPUs of the master's host that the
+ * master does not need. They run until the master shuts them down.
+ */
+class LocalWorkers {
+    vector<Worker *> workers;
+    vector<pthread_t> threads;
+    bool joined;
+
+    static void *thread_main(void *arg);
+public:
+    LocalWorkers(LocalCommunicator *comm, const string &dagfile, unsigned host_memory,
+            cpu_t host_cpus, bool strict_limits, bool per_task_stdio);
+    ~LocalWorkers();
+    void start();
+    void join();
+};
+
 #endif /* WORKER_H */